@@ -271,6 +271,26 @@ AC_DEFUN([RJK_SIZE_MAX],[
   ])
 ])
 
+AC_DEFUN([RJK_SHANI],[
+  AC_CACHE_CHECK([for SHA extension intrinsics],[rjk_cv_shani],[
+    AC_TRY_COMPILE([#include <immintrin.h>
+                    #include <cpuid.h>
+                    __attribute__((target("sha,sse4.1")))
+                    static __m128i f(__m128i a, __m128i b, __m128i c) {
+                      return _mm_sha256rnds2_epu32(a, b, c);
+                    }],
+                   [__m128i z = _mm_setzero_si128();
+                    unsigned a, b, c, d;
+                    __get_cpuid_count(7, 0, &a, &b, &c, &d);
+                    (void)f(z, z, z);],
+                   [rjk_cv_shani=yes],
+                   [rjk_cv_shani=no])
+  ])
+  if test "$rjk_cv_shani" = yes; then
+    AC_DEFINE([HAVE_SHANI],[1],[define if SHA extension intrinsics are available])
+  fi
+])
+
 AC_DEFUN([RJK_GETOPT],[
   AC_CHECK_FUNC([getopt_long],[],[
     AC_LIBOBJ([getopt])
@@ -0,0 +1,118 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file affinity.c @brief CPU affinity
+ *
+ * On multi-socket hosts, keeping the threads of a session on CPUs near the
+ * network and storage interrupts they depend on avoids moving data between
+ * nodes.  No NUMA library is needed: memory is placed on the node of the CPU
+ * that first touches it, so pinning a thread before it allocates is enough.
+ */
+
+#include "sftpserver.h"
+#include "affinity.h"
+#include "debug.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** @brief Names of roles, indexed by @ref affinity_role */
+static const char *const affinity_names[affinity_roles] = {
+    "reader",
+    "workers",
+    "output",
+};
+
+#if HAVE_PTHREAD_SETAFFINITY_NP
+/** @brief CPU set for each role */
+static cpu_set_t affinity_sets[affinity_roles];
+
+/** @brief Non-0 for each role with a CPU set */
+static int affinity_configured[affinity_roles];
+#endif
+
+int sftp_affinity_set(const char *role, const char *cpus) {
+  int r;
+
+  for(r = 0; r < affinity_roles && strcmp(role, affinity_names[r]); ++r)
+    ;
+  if(r == affinity_roles)
+    return -1;
+#if HAVE_PTHREAD_SETAFFINITY_NP
+  {
+    cpu_set_t set;
+    unsigned long first, last;
+    char *end;
+
+    CPU_ZERO(&set);
+    for(;;) {
+      first = last = strtoul(cpus, &end, 10);
+      if(end == cpus)
+        return -1;
+      if(*end == '-') {
+        cpus = end + 1;
+        last = strtoul(cpus, &end, 10);
+        if(end == cpus || last < first)
+          return -1;
+      }
+      if(last >= CPU_SETSIZE)
+        return -1;
+      while(first <= last)
+        CPU_SET(first++, &set);
+      if(!*end)
+        break;
+      if(*end != ',')
+        return -1;
+      cpus = end + 1;
+    }
+    affinity_sets[r] = set;
+    affinity_configured[r] = 1;
+  }
+#else
+  D(("CPU affinity not supported, ignoring %s %s", role, cpus));
+#endif
+  return 0;
+}
+
+void sftp_affinity_apply(enum affinity_role role) {
+#if HAVE_PTHREAD_SETAFFINITY_NP
+  int rc;
+
+  if(!affinity_configured[role])
+    return;
+  /* An unusable set (e.g. all CPUs offline) is not fatal */
+  if((rc = pthread_setaffinity_np(pthread_self(), sizeof affinity_sets[role],
+                                  &affinity_sets[role])))
+    D(("pthread_setaffinity_np %s: %s", affinity_names[role], strerror(rc)));
+#else
+  (void)role;
+#endif
+}
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
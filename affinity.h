@@ -0,0 +1,68 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file affinity.h @brief CPU affinity interface */
+
+#ifndef AFFINITY_H
+#  define AFFINITY_H
+
+/** @brief Threads that can be given a CPU set */
+enum affinity_role {
+  /** @brief The thread that reads requests */
+  affinity_reader,
+
+  /** @brief Worker threads */
+  affinity_workers,
+
+  /** @brief The output thread */
+  affinity_output,
+
+  /** @brief Number of roles */
+  affinity_roles
+};
+
+/** @brief Configure the CPU set for a role
+ * @param role Name of role: @c reader, @c workers or @c output
+ * @param cpus CPU list, e.g. @c 0-3,8
+ * @return 0 on success, -1 if @p role or @p cpus is invalid
+ */
+int sftp_affinity_set(const char *role, const char *cpus);
+
+/** @brief Bind the calling thread to its role's CPU set
+ * @param role Role of calling thread
+ *
+ * Does nothing if no set was configured for @p role.  Threads inherit the
+ * affinity of the thread that creates them, so this should be called before
+ * the thread allocates any state of its own: under the kernel's usual
+ * first-touch policy that places the state on the local NUMA node.
+ */
+void sftp_affinity_apply(enum affinity_role role);
+
+#endif /* AFFINITY_H */
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
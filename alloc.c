@@ -45,11 +45,11 @@ struct chunk {
   /** @brief Number of blocks left in this chunk */
   size_t left;
 
-  /** @brief Padding
+  /** @brief Total number of blocks in this chunk, including the header
    *
-   * size_t will usually have the same size as a pointer; by chucking an extra
-   * one in we become 4 * the size of a pointer, which is much more likely to
-   * be a power of 2 than 3 *.
+   * This also serves as padding: size_t will usually have the same size as a
+   * pointer; by chucking an extra one in we become 4 * the size of a pointer,
+   * which is much more likely to be a power of 2 than 3 *.
    */
   size_t spare;
 };
@@ -86,38 +86,62 @@ static inline size_t blocks(size_t nbytes) {
   return nbytes / sizeof(union block) + !!(nbytes % sizeof(union block));
 }
 
-void *sftp_alloc(struct allocator *a, size_t n) {
-  /* calculate number of blocks */
-  const size_t m = blocks(n);
+/** @brief Allocate blocks from an allocator
+ * @param a Allocator
+ * @param m Number of blocks
+ * @return Pointer to allocated memory
+ *
+ * The memory is not 0-filled.
+ */
+static void *alloc_blocks(struct allocator *a, size_t m) {
   struct chunk *c;
 
-  if(!m)
-    return 0;
   assert(a != 0);
   assert(m != SIZE_MAX); /* ...and so m+1 > 0 */
   /* See if there's enough room */
   if(!(c = a->chunks) || c->left < m) {
     /* Make sure we allocate enough space */
     const size_t cs = m >= NBLOCKS ? m + 1 : NBLOCKS;
-    /* sftp_xcalloc -> calloc which 0-fills */
     union block *nb;
 
-    nb = sftp_xcalloc(cs, sizeof(union block));
+    if(cs > SIZE_MAX / sizeof(union block))
+      sftp_fatal("sftp_alloc: out of memory");
+    nb = sftp_xmalloc(cs * sizeof(union block));
     c = &nb->c;
     c->next = a->chunks;
     c->ptr = nb + 1;
     c->left = cs - 1;
+    c->spare = cs;
     a->chunks = c;
   }
   assert(m <= c->left);
-  /* We always return 0-filled memory.  In this case we fill by block, which is
-   * guaranteed to be at least enough (compare below). */
-  sftp_memset(c->ptr, 0, m * sizeof(union block));
   c->left -= m;
   c->ptr += m;
   return c->ptr - m;
 }
 
+void *sftp_alloc(struct allocator *a, size_t n) {
+  /* calculate number of blocks */
+  const size_t m = blocks(n);
+  void *ptr;
+
+  if(!m)
+    return 0;
+  ptr = alloc_blocks(a, m);
+  /* We always return 0-filled memory.  In this case we fill by block, which is
+   * guaranteed to be at least enough (compare below). */
+  sftp_memset(ptr, 0, m * sizeof(union block));
+  return ptr;
+}
+
+void *sftp_alloc_raw(struct allocator *a, size_t n) {
+  const size_t m = blocks(n);
+
+  if(!m)
+    return 0;
+  return alloc_blocks(a, m);
+}
+
 void *sftp_alloc_more(struct allocator *a, void *ptr, size_t oldn,
                       size_t newn) {
   const size_t oldm = blocks(oldn), newm = blocks(newn);
@@ -172,6 +196,28 @@ void sftp_alloc_destroy(struct allocator *a) {
   a->chunks = 0;
 }
 
+void sftp_alloc_reset(struct allocator *a) {
+  struct chunk *c, *d;
+
+  if(!(c = a->chunks))
+    return;
+  /* Large one-off chunks aren't worth keeping */
+  if(c->spare != NBLOCKS) {
+    sftp_alloc_destroy(a);
+    return;
+  }
+  d = c->next;
+  c->next = 0;
+  while(d) {
+    struct chunk *const next = d->next;
+    free(d);
+    d = next;
+  }
+  /* Rewind to just after the header */
+  c->ptr = (union block *)c + 1;
+  c->left = NBLOCKS - 1;
+}
+
 /*
 Local Variables:
 c-basic-offset:2
@@ -57,6 +57,16 @@ struct allocator *sftp_alloc_init(struct allocator *a);
  */
 void *sftp_alloc(struct allocator *a, size_t n);
 
+/** @brief Allocate space from an allocator without 0-filling it
+ * @param a Allocator
+ * @param n Number of bytes to allocate
+ * @return Pointer to allocated memory
+ *
+ * As sftp_alloc() except that the memory is not 0-filled.  Use this when the
+ * caller is going to overwrite the whole allocation anyway.
+ */
+void *sftp_alloc_raw(struct allocator *a, size_t n);
+
 /** @brief Expand an allocation within an allocator
  * @param a Allocator
  * @param ptr Allocation to expand, or a null pointer
@@ -78,6 +88,16 @@ void *sftp_alloc_more(struct allocator *a, void *ptr, size_t oldn, size_t newn);
  */
 void sftp_alloc_destroy(struct allocator *a);
 
+/** @brief Reset an allocator for reuse
+ * @param a Allocator
+ *
+ * All allocations are invalidated, as with sftp_alloc_destroy(), but the
+ * most recent chunk is kept (provided it is of the default size) so that
+ * the next round of allocations need not go back to the system allocator.
+ * sftp_alloc_destroy() must still be called eventually.
+ */
+void sftp_alloc_reset(struct allocator *a);
+
 #endif /* ALLOC_H */
 
 /*
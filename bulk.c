@@ -0,0 +1,335 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file bulk.c @brief Bulk remove and rename
+ *
+ * Implements the @ref REMOVE_TREE and @ref RENAME_BATCH extensions.  Each
+ * takes what would otherwise be one round trip per file and does it in a
+ * single request, returning the failures, if any, in a single reply.
+ *
+ * A tree is removed depth first.  Each directory is opened with openat()
+ * relative to its parent, without following symbolic links, and removed
+ * with unlinkat(), so no path below the root is ever looked up by name
+ * again.  If a directory is replaced by a symbolic link after it has been
+ * listed, opening and removing it fail and are reported, and nothing outside
+ * the tree is touched.  One directory per level of the tree is open at a
+ * time.  The entries of each directory that are not themselves directories
+ * are unlinked in parallel by the stat helper threads (see
+ * sftp_statbatch_unlink()).  Symbolic links are removed, never followed.
+ */
+
+#include "sftpserver.h"
+#include "types.h"
+#include "globals.h"
+#include "parse.h"
+#include "send.h"
+#include "statbatch.h"
+#include "statcache.h"
+#include "sftp.h"
+#include "alloc.h"
+#include "utils.h"
+#include "debug.h"
+#include "bulk.h"
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/** @brief A failure to report */
+struct bulkfailure {
+  /** @brief Next failure */
+  struct bulkfailure *next;
+
+  /** @brief Path relative to the root of the tree */
+  const char *rel;
+
+  /** @brief @c errno value */
+  int error;
+};
+
+/** @brief A tree removal in progress */
+struct removetree {
+  /** @brief Allocator for anything that outlives a single directory */
+  struct allocator *a;
+
+  /** @brief Root of the tree */
+  const char *root;
+
+  /** @brief Number of entries removed */
+  uint64_t removed;
+
+  /** @brief Number of failures */
+  uint32_t nfailed;
+
+  /** @brief First @ref BULKERRORS failures */
+  struct bulkfailure *failures;
+
+  /** @brief Where to put the next failure */
+  struct bulkfailure **failurestail;
+};
+
+/** @brief Join a relative directory and a name
+ * @param a Allocator
+ * @param rel Directory relative to the root, or "" for the root itself
+ * @param name Name within @p rel
+ * @return Joined path
+ */
+static char *removetree_join(struct allocator *a, const char *rel,
+                             const char *name) {
+  char *s;
+
+  if(!*rel)
+    return strcpy(sftp_alloc_raw(a, strlen(name) + 1), name);
+  s = sftp_alloc_raw(a, strlen(rel) + strlen(name) + 2);
+  strcpy(s, rel);
+  strcat(s, "/");
+  strcat(s, name);
+  return s;
+}
+
+/** @brief Record a failure
+ * @param t Tree removal
+ * @param rel Path relative to the root, or "" for the root itself
+ * @param name Name within @p rel, or a null pointer
+ * @param error @c errno value
+ */
+static void removetree_fail(struct removetree *t, const char *rel,
+                            const char *name, int error) {
+  struct bulkfailure *f;
+
+  D(("remove-tree: %s/%s: %s", rel, name ? name : "", strerror(error)));
+  if(t->nfailed++ >= BULKERRORS)
+    return;
+  f = sftp_alloc(t->a, sizeof *f);
+  if(name)
+    f->rel = removetree_join(t->a, rel, name);
+  else
+    f->rel = *rel ? rel : ".";
+  f->error = error;
+  *t->failurestail = f;
+  t->failurestail = &f->next;
+}
+
+#if HAVE_OPENAT && HAVE_FDOPENDIR && HAVE_UNLINKAT && HAVE_FSTATAT
+/** @brief Empty one directory, including its subdirectories
+ * @param t Tree removal
+ * @param fd Descriptor for the directory, which is closed
+ * @param rel Path relative to the root, or "" for the root itself
+ *
+ * Each subdirectory is emptied, by recursion, and then removed.
+ */
+static void removetree_dir(struct removetree *t, int fd, const char *rel) {
+  struct allocator a;
+  struct statreq *reqs = NULL;
+  const char **subdirs = NULL;
+  size_t n = 0, limit = 0, nsubdirs = 0, subdirslimit = 0, i;
+  struct dirent *de;
+  struct stat sb;
+  const char *name, *subrel;
+  int isdir, subfd;
+  DIR *dp;
+
+  if(!(dp = fdopendir(fd))) {
+    removetree_fail(t, rel, NULL, errno);
+    close(fd);
+    return;
+  }
+  sftp_alloc_init(&a);
+  /* Read the whole directory before changing it, so that removals cannot
+   * upset the reading */
+  while((de = readdir(dp))) {
+    if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+#ifdef DT_UNKNOWN
+    if(de->d_type != DT_UNKNOWN)
+      isdir = de->d_type == DT_DIR;
+    else
+#endif
+    {
+      if(fstatat(fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+        if(errno != ENOENT)
+          removetree_fail(t, rel, de->d_name, errno);
+        continue;
+      }
+      isdir = S_ISDIR(sb.st_mode);
+    }
+    name = strcpy(sftp_alloc_raw(&a, strlen(de->d_name) + 1), de->d_name);
+    if(isdir) {
+      if(nsubdirs >= subdirslimit) {
+        subdirslimit = subdirslimit ? 2 * subdirslimit : 16;
+        subdirs = sftp_xrecalloc(subdirs, subdirslimit, sizeof *subdirs);
+      }
+      subdirs[nsubdirs++] = name;
+      continue;
+    }
+    if(n >= limit) {
+      limit = limit ? 2 * limit : 64;
+      reqs = sftp_xrecalloc(reqs, limit, sizeof *reqs);
+    }
+    reqs[n++].name = name;
+  }
+  /* Anything that has become a directory since it was listed fails to
+   * unlink, rather than being emptied */
+  sftp_statbatch_unlink(fd, *rel ? removetree_join(&a, t->root, rel) : t->root,
+                        reqs, n);
+  for(i = 0; i < n; ++i) {
+    if(!reqs[i].error)
+      ++t->removed;
+    else if(reqs[i].error != ENOENT)
+      removetree_fail(t, rel, reqs[i].name, reqs[i].error);
+  }
+  for(i = 0; i < nsubdirs; ++i) {
+    subrel = removetree_join(t->a, rel, subdirs[i]);
+    /* A subdirectory that has been swapped for a symbolic link since it was
+     * listed fails to open here, and again to remove below */
+    if((subfd = openat(fd, subdirs[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW))
+       >= 0)
+      removetree_dir(t, subfd, subrel);
+    else if(errno == ENOENT)
+      continue;
+    else
+      removetree_fail(t, subrel, NULL, errno);
+    if(unlinkat(fd, subdirs[i], AT_REMOVEDIR) < 0) {
+      if(errno != ENOENT)
+        removetree_fail(t, subrel, NULL, errno);
+    } else
+      ++t->removed;
+  }
+  closedir(dp);
+  free(reqs);
+  free(subdirs);
+  sftp_alloc_destroy(&a);
+}
+#endif
+
+uint32_t sftp_vany_remove_tree(struct sftpjob *job) {
+  struct worker *const w = job->worker;
+  struct removetree t;
+  struct bulkfailure *f;
+  struct stat sb;
+  char *path;
+  uint32_t n;
+  int fd;
+
+  if(readonly)
+    return SSH_FX_PERMISSION_DENIED;
+  sftp_statcache_invalidate();
+  pcheck(sftp_parse_path_borrow(job, &path));
+  D(("sftp_vany_remove_tree %s", path));
+  if(lstat(path, &sb) < 0)
+    return HANDLER_ERRNO;
+  sftp_memset(&t, 0, sizeof t);
+  t.a = job->a;
+  t.root = path;
+  t.failurestail = &t.failures;
+  if(S_ISDIR(sb.st_mode)) {
+#if HAVE_OPENAT && HAVE_FDOPENDIR && HAVE_UNLINKAT && HAVE_FSTATAT
+    if((fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) >= 0)
+      removetree_dir(&t, fd, "");
+    else
+      removetree_fail(&t, "", NULL, errno);
+    if(rmdir(path) < 0)
+      removetree_fail(&t, "", NULL, errno);
+    else
+      ++t.removed;
+#else
+    /* Without the *at() functions a tree can't be removed safely */
+    (void)fd;
+    return SSH_FX_OP_UNSUPPORTED;
+#endif
+  } else if(unlink(path) < 0)
+    return HANDLER_ERRNO;
+  else
+    t.removed = 1;
+  sftp_realpath_invalidate();
+  D(("...removed %" PRIu64 ", %" PRIu32 " failures", t.removed, t.nfailed));
+  sftp_send_begin(w);
+  sftp_send_uint8(w, SSH_FXP_EXTENDED_REPLY);
+  sftp_send_uint32(w, job->id);
+  sftp_send_uint64(w, t.removed);
+  sftp_send_uint32(w, t.nfailed);
+  sftp_send_uint32(w, t.nfailed < BULKERRORS ? t.nfailed : BULKERRORS);
+  for(f = t.failures, n = 0; f && n < BULKERRORS; f = f->next, ++n) {
+    sftp_send_path(job, w, f->rel);
+    sftp_send_uint32(w, sftp_errno_to_status(f->error));
+  }
+  sftp_send_end(w);
+  return HANDLER_RESPONDED;
+}
+
+uint32_t sftp_vany_rename_batch(struct sftpjob *job) {
+  struct worker *const w = job->worker;
+  char **oldpaths, **newpaths;
+  uint32_t count, i, nfailed = 0, *failed;
+  int *errors;
+
+  if(readonly)
+    return SSH_FX_PERMISSION_DENIED;
+  sftp_statcache_invalidate();
+  pcheck(sftp_parse_uint32(job, &count));
+  D(("sftp_vany_rename_batch %" PRIu32, count));
+  /* Every pair takes at least two length words, which bounds the allocations
+   * below by the size of the request */
+  if(count > job->left / 8)
+    return SSH_FX_BAD_MESSAGE;
+  oldpaths = sftp_alloc_raw(job->a, (count ? count : 1) * sizeof *oldpaths);
+  newpaths = sftp_alloc_raw(job->a, (count ? count : 1) * sizeof *newpaths);
+  failed = sftp_alloc_raw(job->a, (count ? count : 1) * sizeof *failed);
+  errors = sftp_alloc_raw(job->a, (count ? count : 1) * sizeof *errors);
+  /* Parse everything first, so a malformed request changes nothing */
+  for(i = 0; i < count; ++i) {
+    pcheck(sftp_parse_path_borrow(job, &oldpaths[i]));
+    pcheck(sftp_parse_path_borrow(job, &newpaths[i]));
+  }
+  /* Renames are done in order, so later pairs may depend on earlier ones */
+  for(i = 0; i < count; ++i) {
+    D(("...%s -> %s", oldpaths[i], newpaths[i]));
+    if(rename(oldpaths[i], newpaths[i]) < 0) {
+      failed[nfailed] = i;
+      errors[nfailed++] = errno;
+    }
+  }
+  if(count)
+    sftp_realpath_invalidate();
+  sftp_send_begin(w);
+  sftp_send_uint8(w, SSH_FXP_EXTENDED_REPLY);
+  sftp_send_uint32(w, job->id);
+  sftp_send_uint32(w, nfailed);
+  for(i = 0; i < nfailed; ++i) {
+    sftp_send_uint32(w, failed[i]);
+    sftp_send_uint32(w, sftp_errno_to_status(errors[i]));
+  }
+  sftp_send_end(w);
+  return HANDLER_RESPONDED;
+}
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,287 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file capture.c @brief Request capture implementation
+ *
+ * Requests are captured by the reader thread as they arrive and responses by
+ * whichever thread sends them.  Records go through a large stdio buffer so
+ * that each costs a copy under @ref capture_lock, and they are only ordered
+ * by their timestamps within each kind.
+ */
+
+#include "sftpserver.h"
+#include "sftpconf.h"
+#include "types.h"
+#include "globals.h"
+#include "session.h"
+#include "handle.h"
+#include "parse.h"
+#include "sftp.h"
+#include "debug.h"
+#include "utils.h"
+#include "thread.h"
+#include "putword.h"
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+/** @brief Size of the capture file's output buffer */
+#define CAPTUREBUFFER 1048576
+
+int sftp_capturing;
+
+/** @brief Lock protecting @ref capturefp */
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Capture file */
+static FILE *capturefp;
+
+/** @brief When the session started */
+static struct timespec epoch;
+
+/** @brief Number of sessions captured by this process */
+static unsigned nsessions;
+
+uint32_t sftp_capture_hash(const void *data, size_t len) {
+  const unsigned char *p = data;
+  uint32_t h = 2166136261u;
+
+  /* FNV-1a */
+  while(len--)
+    h = (h ^ *p++) * 16777619u;
+  return h;
+}
+
+void sftp_capture_decode(const unsigned char *buffer,
+                         struct capturerecord *r) {
+  r->when = get64(buffer);
+  r->kind = buffer[8];
+  r->type = buffer[9];
+  r->id = get32(buffer + 12);
+  r->handle = get32(buffer + 16);
+  r->offset = get64(buffer + 20);
+  r->length = get32(buffer + 28);
+  r->path = get32(buffer + 32);
+  r->path2 = get32(buffer + 36);
+}
+
+/** @brief Timestamp and write a capture record
+ * @param r Record to write
+ */
+static void capture_write(struct capturerecord *r) {
+  unsigned char buffer[CAPTURE_RECORD];
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  r->when = (uint64_t)(now.tv_sec - epoch.tv_sec) * 1000000000 + now.tv_nsec -
+            epoch.tv_nsec;
+  put64(buffer, r->when);
+  buffer[8] = r->kind;
+  buffer[9] = r->type;
+  buffer[10] = buffer[11] = 0;
+  put32(buffer + 12, r->id);
+  put32(buffer + 16, r->handle);
+  put64(buffer + 20, r->offset);
+  put32(buffer + 28, r->length);
+  put32(buffer + 32, r->path);
+  put32(buffer + 36, r->path2);
+  ferrcheck(pthread_mutex_lock(&capture_lock));
+  if(capturefp && fwrite(buffer, sizeof buffer, 1, capturefp) != 1) {
+    syslog(LOG_ERR, "error writing capture: %s", strerror(errno));
+    fclose(capturefp);
+    capturefp = NULL;
+  }
+  ferrcheck(pthread_mutex_unlock(&capture_lock));
+}
+
+void sftp_capture_start(void) {
+  char *path;
+  int fd;
+
+  if(!sftpconf_capture)
+    return;
+  path = sftp_xmalloc(strlen(sftpconf_capture) + 64);
+  sprintf(path, "%s/gesftpserver-%ju-%u.capture", sftpconf_capture,
+          (uintmax_t)getpid(), nsessions++);
+  if((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0
+     || !(capturefp = fdopen(fd, "w"))) {
+    syslog(LOG_ERR, "error opening %s: %s", path, strerror(errno));
+    if(fd >= 0)
+      close(fd);
+    free(path);
+    return;
+  }
+  free(path);
+  setvbuf(capturefp, NULL, _IOFBF, CAPTUREBUFFER);
+  fwrite(CAPTURE_MAGIC, CAPTURE_MAGICLEN, 1, capturefp);
+  clock_gettime(CLOCK_MONOTONIC, &epoch);
+  sftp_capturing = 1;
+}
+
+void sftp_capture_stop(void) {
+  if(!sftp_capturing)
+    return;
+  sftp_capturing = 0;
+  ferrcheck(pthread_mutex_lock(&capture_lock));
+  if(capturefp && fclose(capturefp) < 0)
+    syslog(LOG_ERR, "error writing capture: %s", strerror(errno));
+  capturefp = NULL;
+  ferrcheck(pthread_mutex_unlock(&capture_lock));
+}
+
+/** @brief Parse and hash a path
+ * @param job Job
+ * @param hashp Where to store hash
+ * @return 0 on success, else an error code
+ */
+static uint32_t capture_path(struct sftpjob *job, uint32_t *hashp) {
+  const char *s;
+  size_t len;
+  uint32_t rc;
+
+  if((rc = sftp_parse_view(job, &s, &len)))
+    return rc;
+  *hashp = sftp_capture_hash(s, len);
+  return 0;
+}
+
+/** @brief Parse a handle
+ * @param job Job
+ * @param handlep Where to store handle number
+ * @return 0 on success, else an error code
+ */
+static uint32_t capture_handle(struct sftpjob *job, uint32_t *handlep) {
+  struct handleid id;
+  uint32_t rc;
+
+  if((rc = sftp_parse_handle(job, &id)))
+    return rc;
+  *handlep = id.id;
+  return 0;
+}
+
+void sftp_capture_request(const struct sftpjob *job) {
+  struct sftpjob j = *job;
+  struct capturerecord r;
+  uint32_t u, v;
+
+  sftp_memset(&r, 0, sizeof r);
+  r.kind = capture_request;
+  j.ptr = job->data;
+  j.left = job->len;
+  /* Malformed requests are captured as far as they go */
+  if(sftp_parse_uint8(&j, &r.type))
+    return;
+  if(sftp_parse_uint32(&j, &r.id))
+    goto done;
+  switch(r.type) {
+  case SSH_FXP_OPEN:
+    if(capture_path(&j, &r.path) || sftp_parse_uint32(&j, &u))
+      break;
+    r.offset = u;
+    if(j.session->protocol->version >= 5 && !sftp_parse_uint32(&j, &v))
+      r.offset = (uint64_t)u << 32 | v;
+    break;
+  case SSH_FXP_CLOSE:
+  case SSH_FXP_READDIR:
+  case SSH_FXP_FSETSTAT:
+    capture_handle(&j, &r.handle);
+    break;
+  case SSH_FXP_FSTAT:
+    if(!capture_handle(&j, &r.handle) && j.session->protocol->version >= 4 &&
+       !sftp_parse_uint32(&j, &u))
+      r.offset = u;
+    break;
+  case SSH_FXP_READ:
+  case SSH_FXP_WRITE:
+    /* For a write, the length is that of the data string */
+    if(!capture_handle(&j, &r.handle) && !sftp_parse_uint64(&j, &r.offset))
+      sftp_parse_uint32(&j, &r.length);
+    break;
+  case SSH_FXP_LSTAT:
+  case SSH_FXP_STAT:
+    if(!capture_path(&j, &r.path) && j.session->protocol->version >= 4 &&
+       !sftp_parse_uint32(&j, &u))
+      r.offset = u;
+    break;
+  case SSH_FXP_RENAME:
+    if(!capture_path(&j, &r.path) && !capture_path(&j, &r.path2) &&
+       j.session->protocol->version >= 5 && !sftp_parse_uint32(&j, &u))
+      r.offset = u;
+    break;
+  case SSH_FXP_SYMLINK:
+  case SSH_FXP_LINK:
+    if(!capture_path(&j, &r.path))
+      capture_path(&j, &r.path2);
+    break;
+  case SSH_FXP_SETSTAT:
+  case SSH_FXP_OPENDIR:
+  case SSH_FXP_REMOVE:
+  case SSH_FXP_MKDIR:
+  case SSH_FXP_RMDIR:
+  case SSH_FXP_REALPATH:
+  case SSH_FXP_READLINK:
+  case SSH_FXP_EXTENDED:
+    capture_path(&j, &r.path);
+    break;
+  }
+done:
+  capture_write(&r);
+}
+
+void sftp_capture_response(const void *msg, size_t n) {
+  const unsigned char *m = msg;
+  struct capturerecord r;
+
+  if(n < 5)
+    return;
+  sftp_memset(&r, 0, sizeof r);
+  r.kind = capture_response;
+  r.type = m[0];
+  r.id = get32(m + 1);
+  switch(r.type) {
+  case SSH_FXP_HANDLE:
+    if(n >= 13 && get32(m + 5) == 8)
+      r.handle = get32(m + 9);
+    break;
+  case SSH_FXP_STATUS:
+  case SSH_FXP_DATA:
+  case SSH_FXP_NAME:
+    if(n >= 9)
+      r.length = get32(m + 5);
+    break;
+  }
+  capture_write(&r);
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
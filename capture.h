@@ -0,0 +1,151 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file capture.h @brief Request capture interface
+ *
+ * With the @c capture directive, the server records a compact description of
+ * each request and response of a session in a file, without any of the file
+ * data or names.  @c sftpreplay uses the result to reproduce the workload
+ * against another server.
+ *
+ * A capture file consists of @ref CAPTURE_MAGIC followed by records of
+ * @ref CAPTURE_RECORD bytes, each in the order: @c when (64 bits), @c kind (8
+ * bits), @c type (8 bits), 16 bits of padding, @c id, @c handle (32 bits
+ * each), @c offset (64 bits), @c length, @c path and @c path2 (32 bits each),
+ * all big-endian.
+ */
+
+#ifndef CAPTURE_H
+#  define CAPTURE_H
+
+#  include <stddef.h>
+#  include <stdint.h>
+
+struct sftpjob;
+
+/** @brief Start of a capture file */
+#  define CAPTURE_MAGIC "GESFTPC1"
+
+/** @brief Length of @ref CAPTURE_MAGIC */
+#  define CAPTURE_MAGICLEN 8
+
+/** @brief Size of a capture record on disk */
+#  define CAPTURE_RECORD 40
+
+/** @brief Kinds of capture record */
+enum capture_kind {
+  /** @brief Request from the client */
+  capture_request,
+
+  /** @brief Response to the client */
+  capture_response
+};
+
+/** @brief One captured message
+ *
+ * Fields that do not apply to a message type are 0.
+ */
+struct capturerecord {
+  /** @brief Nanoseconds since the session started */
+  uint64_t when;
+
+  /** @brief Kind of record */
+  enum capture_kind kind;
+
+  /** @brief Message type */
+  uint8_t type;
+
+  /** @brief Request ID, or the version for @ref SSH_FXP_INIT */
+  uint32_t id;
+
+  /** @brief Server's number for the handle used or returned */
+  uint32_t handle;
+
+  /** @brief Offset for reads and writes, flags for other requests
+   *
+   * For @ref SSH_FXP_OPEN these are the @c pflags, or for protocol 5 and
+   * later the @c desired-access and @c flags in the top and bottom 32 bits.
+   * For stat requests and @ref SSH_FXP_RENAME they are the @c flags word, if
+   * the protocol version has one.
+   */
+  uint64_t offset;
+
+  /** @brief Length of data, or status code for @ref SSH_FXP_STATUS, or number
+   * of names for @ref SSH_FXP_NAME */
+  uint32_t length;
+
+  /** @brief Hash of the path, or of the extension name for @ref
+   * SSH_FXP_EXTENDED */
+  uint32_t path;
+
+  /** @brief Hash of the second path */
+  uint32_t path2;
+};
+
+/** @brief Non-0 if the session is being captured */
+extern int sftp_capturing;
+
+/** @brief Start capturing a session
+ *
+ * Does nothing unless the @c capture directive is set.  Otherwise, creates a
+ * capture file in that directory and sets @ref sftp_capturing.
+ */
+void sftp_capture_start(void);
+
+/** @brief Stop capturing and close the capture file */
+void sftp_capture_stop(void);
+
+/** @brief Capture a request
+ * @param job Request, which is not modified
+ */
+void sftp_capture_request(const struct sftpjob *job);
+
+/** @brief Capture a response
+ * @param msg Response, starting with its type byte
+ * @param n Number of bytes available at @p msg
+ *
+ * Only the first few fields of the response are needed, so for data sent
+ * from a file or mapping @p n need not cover all of it.
+ */
+void sftp_capture_response(const void *msg, size_t n);
+
+/** @brief Hash a path for a capture
+ * @param data Path as sent on the wire
+ * @param len Length of path
+ * @return Hash value
+ */
+uint32_t sftp_capture_hash(const void *data, size_t len);
+
+/** @brief Decode a capture record
+ * @param buffer @ref CAPTURE_RECORD bytes from a capture file
+ * @param r Where to store decoded record
+ */
+void sftp_capture_decode(const unsigned char *buffer, struct capturerecord *r);
+
+#endif /* CAPTURE_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
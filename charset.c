@@ -27,6 +27,12 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <strings.h>
+#include "types.h"
+#if __SSE2__
+#  include <emmintrin.h>
+#endif
 
 wchar_t *sftp_mbs2wcs(const char *s) {
   wchar_t *ws;
@@ -54,21 +60,185 @@ int sftp_iconv(struct allocator *a, iconv_t cd, char **sp) {
 
   assert(cd != 0);
   do {
-    output = sftp_alloc(a, outputsize);
+    output = sftp_alloc_raw(a, outputsize);
     iconv(cd, 0, 0, 0, 0);
     inbuf = input;
     inbytesleft = inputsize;
     outbuf = output;
     outbytesleft = outputsize;
     rc = iconv(cd, (void *)&inbuf, &inbytesleft, &outbuf, &outbytesleft);
+    /* Make sure there's room for the terminator */
+    if(rc != (size_t)-1 && !outbytesleft) {
+      rc = (size_t)-1;
+      errno = E2BIG;
+    }
     outputsize *= 2;
   } while(rc == (size_t)-1 && errno == E2BIG);
   if(rc == (size_t)-1)
     return -1;
+  *outbuf = 0;
   *sp = output;
   return 0;
 }
 
+size_t sftp_ascii_prefix(const char *s, size_t n) {
+  size_t i = 0;
+
+#if __SSE2__
+  /* 16 bytes at a time; the top bit of each byte lands in the mask */
+  for(; i + 16 <= n; i += 16) {
+    const int mask =
+        _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+    if(mask)
+      return i + __builtin_ctz(mask);
+  }
+#else
+  /* 8 bytes at a time */
+  for(; i + 8 <= n; i += 8) {
+    uint64_t word;
+    memcpy(&word, s + i, sizeof word);
+    if(word & 0x8080808080808080ULL)
+      break;
+  }
+#endif
+  while(i < n && !(s[i] & 0x80))
+    ++i;
+  return i;
+}
+
+int sftp_utf8_valid(const char *s, size_t n) {
+  const unsigned char *p = (const unsigned char *)s, *const end = p + n;
+  unsigned c;
+
+  while(p < end) {
+    p += sftp_ascii_prefix((const char *)p, end - p);
+    if(p >= end)
+      break;
+    c = *p;
+    if(c >= 0xC2 && c <= 0xDF) {
+      /* 2 bytes */
+      if(end - p < 2 || (p[1] & 0xC0) != 0x80)
+        return 0;
+      p += 2;
+    } else if(c >= 0xE0 && c <= 0xEF) {
+      /* 3 bytes, excluding overlongs and surrogates */
+      if(end - p < 3 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80 ||
+         (c == 0xE0 && p[1] < 0xA0) || (c == 0xED && p[1] > 0x9F))
+        return 0;
+      p += 3;
+    } else if(c >= 0xF0 && c <= 0xF4) {
+      /* 4 bytes, excluding overlongs and values above U+10FFFF */
+      if(end - p < 4 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80 ||
+         (p[3] & 0xC0) != 0x80 || (c == 0xF0 && p[1] < 0x90) ||
+         (c == 0xF4 && p[1] > 0x8F))
+        return 0;
+      p += 4;
+    } else
+      return 0;
+  }
+  return 1;
+}
+
+int sftp_charset_passthrough(const struct worker *w, const char *s) {
+  size_t n;
+
+  if(!w->ascii_passthrough)
+    return 0;
+  n = strlen(s);
+  if(sftp_ascii_prefix(s, n) == n)
+    return 1;
+  return w->utf8_passthrough && sftp_utf8_valid(s, n);
+}
+
+/** @brief Local encoding, as passed to sftp_charset_init() */
+static const char *charset_local;
+
+/** @brief Non-0 if ASCII strings are the same in both encodings */
+static int charset_ascii_passthrough;
+
+/** @brief Non-0 if valid UTF-8 strings are the same in both encodings */
+static int charset_utf8_passthrough;
+
+/** @brief Open a conversion descriptor or die
+ * @param to Target encoding
+ * @param from Source encoding
+ * @return Conversion descriptor
+ */
+static iconv_t charset_open(const char *to, const char *from) {
+  iconv_t cd;
+
+  if((cd = iconv_open(to, from)) == (iconv_t)-1)
+    sftp_fatal("error calling iconv_open(%s,%s): %s", to, from,
+               strerror(errno));
+  return cd;
+}
+
+void sftp_charset_init(const char *local_encoding) {
+  char ascii[128], *converted;
+  struct allocator a;
+  iconv_t to_utf8, to_local;
+  int n;
+
+  charset_local = local_encoding;
+  charset_ascii_passthrough = charset_utf8_passthrough = 0;
+  /* The common encodings are known without asking iconv, which saves loading
+   * conversion modules that many sessions never use. */
+  if(!strcasecmp(local_encoding, "UTF-8") ||
+     !strcasecmp(local_encoding, "UTF8")) {
+    charset_ascii_passthrough = charset_utf8_passthrough = 1;
+    return;
+  }
+  if(!strcasecmp(local_encoding, "ANSI_X3.4-1968") ||
+     !strcasecmp(local_encoding, "ASCII") ||
+     !strcasecmp(local_encoding, "US-ASCII")) {
+    charset_ascii_passthrough = 1;
+    return;
+  }
+  /* See whether ASCII survives the round trip unchanged.  This is true of
+   * almost every encoding in practical use but not quite all of them. */
+  to_utf8 = charset_open("UTF-8", local_encoding);
+  to_local = charset_open(local_encoding, "UTF-8");
+  for(n = 1; n < 128; ++n)
+    ascii[n - 1] = n;
+  ascii[127] = 0;
+  sftp_alloc_init(&a);
+  converted = ascii;
+  if(!sftp_iconv(&a, to_utf8, &converted) && !strcmp(converted, ascii)) {
+    converted = ascii;
+    if(!sftp_iconv(&a, to_local, &converted) && !strcmp(converted, ascii))
+      charset_ascii_passthrough = 1;
+  }
+  sftp_alloc_destroy(&a);
+  iconv_close(to_utf8);
+  iconv_close(to_local);
+}
+
+void sftp_charset_init_worker(struct worker *w) {
+  w->local_to_utf8 = w->utf8_to_local = (iconv_t)-1;
+  w->ascii_passthrough = charset_ascii_passthrough;
+  w->utf8_passthrough = charset_utf8_passthrough;
+}
+
+void sftp_charset_cleanup_worker(struct worker *w) {
+  if(w->local_to_utf8 != (iconv_t)-1)
+    iconv_close(w->local_to_utf8);
+  if(w->utf8_to_local != (iconv_t)-1)
+    iconv_close(w->utf8_to_local);
+  w->local_to_utf8 = w->utf8_to_local = (iconv_t)-1;
+}
+
+iconv_t sftp_charset_to_utf8(struct worker *w) {
+  if(w->local_to_utf8 == (iconv_t)-1)
+    w->local_to_utf8 = charset_open("UTF-8", charset_local);
+  return w->local_to_utf8;
+}
+
+iconv_t sftp_charset_to_local(struct worker *w) {
+  if(w->utf8_to_local == (iconv_t)-1)
+    w->utf8_to_local = charset_open(charset_local, "UTF-8");
+  return w->utf8_to_local;
+}
+
 /*
 Local Variables:
 c-basic-offset:2
@@ -25,6 +25,7 @@
 
 #  include <wchar.h>
 #  include <iconv.h>
+#  include <stddef.h>
 
 /** @brief Convert a multibyte string to a wide string
  * @param s Multibyte string to convert
@@ -45,6 +46,67 @@ wchar_t *sftp_mbs2wcs(const char *s);
  */
 int sftp_iconv(struct allocator *a, iconv_t cd, char **sp);
 
+/** @brief Find the length of the ASCII prefix of a string
+ * @param s String to scan
+ * @param n Length of @p s
+ * @return Number of leading bytes of @p s below 0x80
+ */
+size_t sftp_ascii_prefix(const char *s, size_t n);
+
+/** @brief Check whether a string is valid UTF-8
+ * @param s String to check
+ * @param n Length of @p s
+ * @return Non-0 if @p s is valid UTF-8
+ *
+ * Overlong encodings, surrogates and values above U+10FFFF are rejected,
+ * matching what iconv() accepts.
+ */
+int sftp_utf8_valid(const char *s, size_t n);
+
+/** @brief Decide whether a string can skip conversion
+ * @param w Worker owning the conversion descriptors
+ * @param s String to convert
+ * @return Non-0 if @p s is the same in both encodings
+ *
+ * Uses the @c ascii_passthrough and @c utf8_passthrough fields of @p w,
+ * which are set up by sftp_charset_init_worker().
+ */
+int sftp_charset_passthrough(const struct worker *w, const char *s);
+
+/** @brief Work out which strings can skip conversion
+ * @param local_encoding Name of local encoding
+ *
+ * Must be called once, before any worker is set up.  UTF-8 and ASCII are
+ * recognized by name; any other encoding is checked with a round trip through
+ * iconv().
+ */
+void sftp_charset_init(const char *local_encoding);
+
+/** @brief Set up a worker's character conversion state
+ * @param w Worker
+ *
+ * The conversion descriptors are not opened until sftp_charset_to_utf8() or
+ * sftp_charset_to_local() first needs them.
+ */
+void sftp_charset_init_worker(struct worker *w);
+
+/** @brief Close a worker's conversion descriptors
+ * @param w Worker
+ */
+void sftp_charset_cleanup_worker(struct worker *w);
+
+/** @brief Get a worker's local-to-UTF-8 conversion descriptor
+ * @param w Worker
+ * @return Conversion descriptor, opened if necessary
+ */
+iconv_t sftp_charset_to_utf8(struct worker *w);
+
+/** @brief Get a worker's UTF-8-to-local conversion descriptor
+ * @param w Worker
+ * @return Conversion descriptor, opened if necessary
+ */
+iconv_t sftp_charset_to_local(struct worker *w);
+
 #endif /* CHARSET_H */
 
 /*
@@ -0,0 +1,357 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file checkfile.c @brief File hashing implementation
+ *
+ * Implements the @c check-file-handle and @c check-file-name extensions from
+ * draft-ietf-secsh-filexfer-extensions-00 s3.  When the client asks for a
+ * hash per block, the blocks are independent, so they are shared out among
+ * a small pool of helper threads in the same way as in statbatch.c.  Each
+ * thread reads its blocks with pread() in @ref HASHCHUNK pieces.
+ */
+
+#include "sftpserver.h"
+#include "sftpconf.h"
+#include "types.h"
+#include "globals.h"
+#include "handle.h"
+#include "parse.h"
+#include "send.h"
+#include "sftp.h"
+#include "debug.h"
+#include "utils.h"
+#include "thread.h"
+#include "hash.h"
+#include "checkfile.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/** @brief A hashing request in progress */
+struct hashbatch {
+  /** @brief Next batch with unclaimed blocks */
+  struct hashbatch *next;
+
+  /** @brief File descriptor to read */
+  int fd;
+
+  /** @brief Hash function */
+  const struct sftphash *hash;
+
+  /** @brief Offset of first byte */
+  uint64_t start;
+
+  /** @brief Offset just past last byte */
+  uint64_t end;
+
+  /** @brief Block size */
+  uint64_t blocksize;
+
+  /** @brief Where to put digests */
+  unsigned char *digests;
+
+  /** @brief Number of blocks */
+  size_t n;
+
+  /** @brief Number of blocks claimed */
+  size_t claimed;
+
+  /** @brief Number of blocks completed */
+  size_t completed;
+
+  /** @brief First error, as an @c errno value, or 0 */
+  int error;
+
+  /** @brief Signaled when @ref completed reaches @ref n */
+  pthread_cond_t done;
+};
+
+/** @brief Lock protecting the batch list */
+static pthread_mutex_t hash_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Signaled when a batch is added or on shutdown */
+static pthread_cond_t hash_ready = PTHREAD_COND_INITIALIZER;
+
+/** @brief Batches with unclaimed blocks, oldest first */
+static struct hashbatch *batches;
+
+/** @brief Helper threads */
+static pthread_t *helpers;
+
+/** @brief Number of helper threads */
+static int nhelpers;
+
+/** @brief Number of helper threads to start when they are first needed */
+static int nwanted;
+
+/** @brief Set to shut down helpers */
+static int stopping;
+
+/** @brief Hash one block
+ * @param b Batch
+ * @param i Block number
+ * @param buffer Read buffer of @ref HASHCHUNK bytes
+ * @return 0 on success, else an @c errno value
+ */
+static int hash_one(const struct hashbatch *b, size_t i,
+                    unsigned char *buffer) {
+  struct sftphashctx ctx;
+  uint64_t offset = b->start + i * b->blocksize, limit;
+  ssize_t n;
+
+  limit = b->end - offset < b->blocksize ? b->end : offset + b->blocksize;
+  sftp_hash_init(&ctx, b->hash);
+  while(offset < limit) {
+    n = pread(b->fd, buffer,
+              limit - offset < HASHCHUNK ? limit - offset : HASHCHUNK, offset);
+    if(n < 0)
+      return errno;
+    if(n == 0)
+      break; /* the file got shorter */
+    sftp_hash_update(&ctx, buffer, n);
+    offset += n;
+  }
+  sftp_hash_final(&ctx, b->digests + i * b->hash->size);
+  return 0;
+}
+
+/** @brief Work on claimed blocks until there are none left
+ * @param buffer Read buffer of @ref HASHCHUNK bytes
+ *
+ * Must be called with @ref hash_lock held.
+ */
+static void hash_work(unsigned char *buffer) {
+  struct hashbatch *b;
+  size_t i;
+  int error;
+
+  while((b = batches)) {
+    i = b->claimed++;
+    if(b->claimed == b->n)
+      batches = b->next;
+    ferrcheck(pthread_mutex_unlock(&hash_lock));
+    error = hash_one(b, i, buffer);
+    ferrcheck(pthread_mutex_lock(&hash_lock));
+    if(error && !b->error)
+      b->error = error;
+    if(++b->completed == b->n)
+      ferrcheck(pthread_cond_signal(&b->done));
+  }
+}
+
+/** @brief Helper thread
+ * @param arg Unused
+ * @return Null pointer
+ */
+static void *hash_thread(void attribute((unused)) * arg) {
+  unsigned char *buffer = sftp_xmalloc(HASHCHUNK);
+
+  ferrcheck(pthread_mutex_lock(&hash_lock));
+  while(!stopping) {
+    hash_work(buffer);
+    if(!stopping)
+      ferrcheck(pthread_cond_wait(&hash_ready, &hash_lock));
+  }
+  ferrcheck(pthread_mutex_unlock(&hash_lock));
+  free(buffer);
+  return NULL;
+}
+
+void sftp_checkfile_start(int nthreads) {
+  nwanted = nthreads > 0 ? nthreads : 0;
+}
+
+/** @brief Start the helper threads if they are not already running
+ *
+ * Must be called with @ref hash_lock held.  Most sessions never share out
+ * any work, so the threads are only created when a batch first needs them.
+ */
+static void hash_helpers(void) {
+  int n;
+
+  if(nhelpers)
+    return;
+  helpers = sftp_xcalloc(nwanted, sizeof *helpers);
+  for(n = 0; n < nwanted; ++n)
+    ferrcheck(pthread_create(&helpers[n], 0, hash_thread, 0));
+  nhelpers = nwanted;
+  D(("started %d hash helpers", nhelpers));
+}
+
+void sftp_checkfile_stop(void) {
+  int n;
+
+  nwanted = 0;
+  if(!nhelpers)
+    return;
+  ferrcheck(pthread_mutex_lock(&hash_lock));
+  stopping = 1;
+  ferrcheck(pthread_cond_broadcast(&hash_ready));
+  ferrcheck(pthread_mutex_unlock(&hash_lock));
+  for(n = 0; n < nhelpers; ++n)
+    ferrcheck(pthread_join(helpers[n], 0));
+  free(helpers);
+  helpers = NULL;
+  nhelpers = 0;
+  stopping = 0;
+}
+
+int sftp_checkfile_hash(int fd, const struct sftphash *hash, uint64_t start,
+                        uint64_t end, uint64_t blocksize,
+                        unsigned char *digests) {
+  struct hashbatch b, **bp;
+  unsigned char *buffer = sftp_xmalloc(HASHCHUNK);
+  size_t i;
+
+  b.next = NULL;
+  b.fd = fd;
+  b.hash = hash;
+  b.start = start;
+  b.end = end;
+  b.digests = digests;
+  b.error = 0;
+  if(blocksize) {
+    b.blocksize = blocksize;
+    b.n = (end - start + blocksize - 1) / blocksize;
+  } else {
+    /* One hash for the whole range, even if it is empty */
+    b.blocksize = end - start;
+    b.n = 1;
+  }
+  if(!nwanted || b.n < 2) {
+    /* Nobody to share with */
+    for(i = 0; i < b.n && !b.error; ++i)
+      b.error = hash_one(&b, i, buffer);
+    free(buffer);
+    return b.error;
+  }
+  b.claimed = b.completed = 0;
+  ferrcheck(pthread_cond_init(&b.done, 0));
+  ferrcheck(pthread_mutex_lock(&hash_lock));
+  hash_helpers();
+  for(bp = &batches; *bp; bp = &(*bp)->next)
+    ;
+  *bp = &b;
+  ferrcheck(pthread_cond_broadcast(&hash_ready));
+  /* Help out */
+  hash_work(buffer);
+  while(b.completed < b.n)
+    ferrcheck(pthread_cond_wait(&b.done, &hash_lock));
+  ferrcheck(pthread_mutex_unlock(&hash_lock));
+  ferrcheck(pthread_cond_destroy(&b.done));
+  free(buffer);
+  return b.error;
+}
+
+/** @brief Common code for check-file extensions
+ * @param job Job, positioned after the handle or file name
+ * @param fd File descriptor to hash
+ * @return Error code
+ */
+static uint32_t checkfile_common(struct sftpjob *job, int fd) {
+  char *list;
+  uint64_t start, length, end;
+  uint32_t blocksize;
+  const struct sftphash *hash;
+  struct stat sb;
+  size_t nblocks, size;
+  struct worker *const w = job->worker;
+  int error;
+
+  pcheck(sftp_parse_string_borrow(job, &list, 0));
+  pcheck(sftp_parse_uint64(job, &start));
+  pcheck(sftp_parse_uint64(job, &length));
+  pcheck(sftp_parse_uint32(job, &blocksize));
+  D(("check-file %s %" PRIu64 "+%" PRIu64 " %" PRIu32, list, start, length,
+     blocksize));
+  /* draft-ietf-secsh-filexfer-extensions-00 s3.1 sets a lower limit on the
+   * block size */
+  if(blocksize && blocksize < 256)
+    return SSH_FX_INVALID_PARAMETER;
+  if(!(hash = sftp_hash_choose(list)))
+    return SSH_FX_OP_UNSUPPORTED;
+  if(fstat(fd, &sb) < 0)
+    return HANDLER_ERRNO;
+  /* A length of 0 means 'to end of file', and we never hash past EOF */
+  end = (uint64_t)sb.st_size;
+  if(start > end)
+    start = end;
+  if(length && length < end - start)
+    end = start + length;
+  nblocks = blocksize ? (end - start + blocksize - 1) / blocksize : 1;
+  if(nblocks > sftpconf_max_read / hash->size)
+    return SSH_FX_INVALID_PARAMETER;
+  size = nblocks * hash->size;
+  sftp_send_begin(w);
+  sftp_send_uint8(w, SSH_FXP_EXTENDED_REPLY);
+  sftp_send_uint32(w, job->id);
+  sftp_send_string(w, "check-file");
+  sftp_send_string(w, hash->name);
+  /* The digests go straight into the output buffer */
+  sftp_send_need(w, size);
+  if((error = sftp_checkfile_hash(fd, hash, start, end, blocksize,
+                                  w->buffer + w->bufused))) {
+    errno = error;
+    return HANDLER_ERRNO;
+  }
+  w->bufused += size;
+  sftp_send_end(w);
+  return HANDLER_RESPONDED;
+}
+
+uint32_t sftp_vany_check_file_handle(struct sftpjob *job) {
+  struct handleid id;
+  int fd;
+  uint32_t rc;
+
+  pcheck(sftp_parse_handle(job, &id));
+  D(("sftp_vany_check_file_handle %" PRIu32 " %" PRIu32, id.id, id.tag));
+  if((rc = sftp_handle_get_fd(&id, &fd, 0)))
+    return rc;
+  return checkfile_common(job, fd);
+}
+
+uint32_t sftp_vany_check_file_name(struct sftpjob *job) {
+  char *path;
+  int fd, save_errno;
+  uint32_t rc;
+
+  pcheck(sftp_parse_path_borrow(job, &path));
+  D(("sftp_vany_check_file_name %s", path));
+  if((fd = open(path, O_RDONLY)) < 0)
+    return HANDLER_ERRNO;
+  rc = checkfile_common(job, fd);
+  save_errno = errno;
+  close(fd);
+  errno = save_errno;
+  return rc;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,68 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file checkfile.h @brief File hashing interface */
+
+#ifndef CHECKFILE_H
+#  define CHECKFILE_H
+
+#  include <stddef.h>
+#  include <stdint.h>
+
+struct sftphash;
+
+/** @brief Start the hashing helper threads
+ * @param nthreads Number of helper threads, or 0 for none
+ *
+ * With no helpers, sftp_checkfile_hash() does all the work in the calling
+ * thread.  The threads are not actually created until the first request for
+ * more than one block.
+ */
+void sftp_checkfile_start(int nthreads);
+
+/** @brief Stop the hashing helper threads */
+void sftp_checkfile_stop(void);
+
+/** @brief Hash a range of a file block by block
+ * @param fd File descriptor to read from
+ * @param hash Hash function
+ * @param start Offset of first byte to hash
+ * @param end Offset just past last byte to hash
+ * @param blocksize Size of each block, or 0 for a single block
+ * @param digests Where to store the digests, one after another
+ * @return 0 on success, else an @c errno value
+ *
+ * The last block may be short.  Blocks are shared out between the helper
+ * threads and the calling thread.
+ */
+int sftp_checkfile_hash(int fd, const struct sftphash *hash, uint64_t start,
+                        uint64_t end, uint64_t blocksize,
+                        unsigned char *digests);
+
+#endif /* CHECKFILE_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
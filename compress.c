@@ -0,0 +1,346 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file compress.c @brief Payload compression
+ *
+ * The @ref COMPRESS extension switches on compression of the data carried
+ * by @ref SSH_FXP_READ and @ref SSH_FXP_WRITE for one file handle:
+ *
+ * <pre>
+ * string "compress@rjk.greenend.org.uk"
+ * string handle
+ * string methods
+ * </pre>
+ *
+ * @c methods is a comma-separated list of method names in order of
+ * preference, or an empty string to switch compression off again.  The
+ * response is an @ref SSH_FXP_EXTENDED_REPLY containing the name of the
+ * method chosen:
+ *
+ * <pre>
+ * string method
+ * </pre>
+ *
+ * or @ref SSH_FX_OP_UNSUPPORTED if none of them are available.  Text and
+ * append-mode handles cannot be compressed.
+ *
+ * Once compression is on, the data of each @ref SSH_FXP_DATA response and of
+ * each @ref SSH_FXP_WRITE request on that handle is a frame:
+ *
+ * <pre>
+ * uint32 length
+ * byte   encoding
+ * byte   payload[...]
+ * </pre>
+ *
+ * @c length is the uncompressed size.  If @c encoding is @ref
+ * COMPRESS_STORED the payload is the data itself, which is used when it
+ * does not compress; if it is @ref COMPRESS_PACKED the payload is the data
+ * compressed with the chosen method.  The length field of a
+ * @ref SSH_FXP_READ request is still the uncompressed size wanted.
+ *
+ * Each read compresses its own data in the worker thread that handles it,
+ * so reads on many handles, or out-of-order reads on one, compress in
+ * parallel.
+ */
+
+#include "sftpserver.h"
+#include "sftpconf.h"
+#include "types.h"
+#include "globals.h"
+#include "handle.h"
+#include "parse.h"
+#include "send.h"
+#include "sftp.h"
+#include "debug.h"
+#include "utils.h"
+#include "stats.h"
+#include "alloc.h"
+#include "direct.h"
+#include "putword.h"
+#include "compress.h"
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#if HAVE_ZSTD_H && HAVE_LIBZSTD
+#  include <zstd.h>
+#endif
+#if HAVE_LZ4_H && HAVE_LIBLZ4
+#  include <lz4.h>
+#endif
+#if HAVE_ZLIB_H && HAVE_LIBZ
+#  include <zlib.h>
+#endif
+
+#if HAVE_ZSTD_H && HAVE_LIBZSTD
+/* zstd ------------------------------------------------------------------- */
+
+static size_t zstd_bound(size_t n) {
+  return ZSTD_compressBound(n);
+}
+
+static size_t zstd_compress(void *dst, size_t cap, const void *src,
+                            size_t n) {
+  size_t rc = ZSTD_compress(dst, cap, src, n, 1);
+
+  return ZSTD_isError(rc) ? 0 : rc;
+}
+
+static int zstd_decompress(void *dst, size_t n, const void *src, size_t len) {
+  size_t rc = ZSTD_decompress(dst, n, src, len);
+
+  return ZSTD_isError(rc) || rc != n ? -1 : 0;
+}
+#endif
+
+#if HAVE_LZ4_H && HAVE_LIBLZ4
+/* LZ4 -------------------------------------------------------------------- */
+
+static size_t lz4_bound(size_t n) {
+  return n > LZ4_MAX_INPUT_SIZE ? 0 : (size_t)LZ4_compressBound((int)n);
+}
+
+static size_t lz4_compress(void *dst, size_t cap, const void *src, size_t n) {
+  int rc;
+
+  if(n > LZ4_MAX_INPUT_SIZE || cap > INT_MAX)
+    return 0;
+  rc = LZ4_compress_default(src, dst, (int)n, (int)cap);
+  return rc > 0 ? (size_t)rc : 0;
+}
+
+static int lz4_decompress(void *dst, size_t n, const void *src, size_t len) {
+  if(n > INT_MAX || len > INT_MAX)
+    return -1;
+  return LZ4_decompress_safe(src, dst, (int)len, (int)n) == (int)n ? 0 : -1;
+}
+#endif
+
+#if HAVE_ZLIB_H && HAVE_LIBZ
+/* zlib ------------------------------------------------------------------- */
+
+static size_t zlib_bound(size_t n) {
+  return compressBound(n);
+}
+
+static size_t zlib_compress(void *dst, size_t cap, const void *src,
+                            size_t n) {
+  uLongf dlen = cap;
+
+  return compress2(dst, &dlen, src, n, 1) == Z_OK ? dlen : 0;
+}
+
+static int zlib_decompress(void *dst, size_t n, const void *src, size_t len) {
+  uLongf dlen = n;
+
+  return uncompress(dst, &dlen, src, len) == Z_OK && dlen == n ? 0 : -1;
+}
+#endif
+
+/** @brief Supported methods, best first */
+static const struct sftpcompressor compressors[] = {
+#if HAVE_ZSTD_H && HAVE_LIBZSTD
+    {"zstd", zstd_bound, zstd_compress, zstd_decompress},
+#endif
+#if HAVE_LZ4_H && HAVE_LIBLZ4
+    {"lz4", lz4_bound, lz4_compress, lz4_decompress},
+#endif
+#if HAVE_ZLIB_H && HAVE_LIBZ
+    {"zlib", zlib_bound, zlib_compress, zlib_decompress},
+#endif
+    {NULL, NULL, NULL, NULL},
+};
+
+const struct sftpcompressor *sftp_compress_choose(const char *list) {
+  const char *end;
+  size_t n, len;
+
+  while(*list) {
+    end = strchr(list, ',');
+    len = end ? (size_t)(end - list) : strlen(list);
+    for(n = 0; compressors[n].name; ++n)
+      if(strlen(compressors[n].name) == len &&
+         !strncmp(compressors[n].name, list, len))
+        return &compressors[n];
+    if(!end)
+      break;
+    list = end + 1;
+  }
+  return NULL;
+}
+
+const char *sftp_compress_methods(void) {
+  static const char methods[] = ""
+#if HAVE_ZSTD_H && HAVE_LIBZSTD
+                                ",zstd"
+#endif
+#if HAVE_LZ4_H && HAVE_LIBLZ4
+                                ",lz4"
+#endif
+#if HAVE_ZLIB_H && HAVE_LIBZ
+                                ",zlib"
+#endif
+      ;
+
+  return methods + (*methods == ',');
+}
+
+size_t sftp_compress_frame_bound(const struct sftpcompressor *c, size_t n) {
+  const size_t bound = c->bound(n);
+
+  return COMPRESS_HEADER + (bound > n ? bound : n);
+}
+
+size_t sftp_compress_frame(const struct sftpcompressor *c, void *dst,
+                           const void *src, size_t n) {
+  uint8_t *const frame = dst;
+  size_t len;
+
+  put32(frame, n);
+  /* Keep incompressible data as it is */
+  len = n ? c->compress(frame + COMPRESS_HEADER, c->bound(n), src, n) : 0;
+  if(len && len < n) {
+    frame[4] = COMPRESS_PACKED;
+    return COMPRESS_HEADER + len;
+  }
+  frame[4] = COMPRESS_STORED;
+  memcpy(frame + COMPRESS_HEADER, src, n);
+  return COMPRESS_HEADER + n;
+}
+
+int sftp_compress_frame_size(const void *frame, size_t len, size_t *rawp) {
+  const uint8_t *const f = frame;
+
+  if(len < COMPRESS_HEADER)
+    return -1;
+  *rawp = get32(f);
+  if(*rawp > COMPRESS_MAX)
+    return -1;
+  if(f[4] == COMPRESS_STORED && *rawp != len - COMPRESS_HEADER)
+    return -1;
+  return 0;
+}
+
+int sftp_compress_unframe(const struct sftpcompressor *c, const void *frame,
+                          size_t len, void *buffer, const void **datap) {
+  const uint8_t *const f = frame;
+  size_t raw;
+
+  if(sftp_compress_frame_size(frame, len, &raw))
+    return -1;
+  switch(f[4]) {
+  case COMPRESS_STORED:
+    *datap = f + COMPRESS_HEADER;
+    return 0;
+  case COMPRESS_PACKED:
+    if(c->decompress(buffer, raw, f + COMPRESS_HEADER, len - COMPRESS_HEADER))
+      return -1;
+    *datap = buffer;
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+/* Server side ------------------------------------------------------------ */
+
+uint32_t sftp_vany_compress(struct sftpjob *job) {
+  struct handleid id;
+  const struct sftpcompressor *c = NULL;
+  char *list;
+  uint32_t rc;
+
+  pcheck(sftp_parse_handle(job, &id));
+  pcheck(sftp_parse_string_borrow(job, &list, 0));
+  D(("sftp_vany_compress %" PRIu32 " %" PRIu32 " %s", id.id, id.tag, list));
+  if(*list && !(c = sftp_compress_choose(list)))
+    return SSH_FX_OP_UNSUPPORTED;
+  if((rc = sftp_handle_set_compress(&id, c)))
+    return rc;
+  sftp_send_begin(job->worker);
+  sftp_send_uint8(job->worker, SSH_FXP_EXTENDED_REPLY);
+  sftp_send_uint32(job->worker, job->id);
+  sftp_send_string(job->worker, c ? c->name : "");
+  sftp_send_end(job->worker);
+  return HANDLER_RESPONDED;
+}
+
+uint32_t sftp_compress_read(struct sftpjob *job, const struct handleid *id,
+                            int fd, uint64_t offset, uint32_t len) {
+  const struct sftpcompressor *const c = sftp_handle_get_compress(id);
+  const int dfd = sftp_handle_get_direct(id);
+  struct worker *const w = job->worker;
+  uint8_t *raw;
+  ssize_t n;
+  size_t size;
+
+  if(!c)
+    return SSH_FX_INVALID_HANDLE;
+  raw = sftp_alloc(job->a, len ? len : 1);
+  if(dfd >= 0)
+    n = sftp_direct_pread(fd, dfd, raw, len, offset);
+  else
+    n = pread(fd, raw, len, offset);
+  if(n < 0)
+    return HANDLER_ERRNO;
+  if(n == 0)
+    return SSH_FX_EOF;
+  sftp_stats_bytes(stats_bytes_read, n);
+  sftp_send_begin(w);
+  sftp_send_uint8(w, SSH_FXP_DATA);
+  sftp_send_uint32(w, job->id);
+  sftp_send_need(w, sftp_compress_frame_bound(c, n) + 4);
+  size = sftp_compress_frame(c, w->buffer + w->bufused + 4, raw, n);
+  sftp_send_uint32(w, size);
+  w->bufused += size;
+  sftp_send_end(w);
+  return HANDLER_RESPONDED;
+}
+
+uint32_t sftp_compress_write(struct sftpjob *job, const struct handleid *id,
+                             uint32_t *lenp) {
+  const struct sftpcompressor *const c = sftp_handle_get_compress(id);
+  const void *data;
+  void *buffer;
+  size_t raw;
+
+  if(!c)
+    return SSH_FX_INVALID_HANDLE;
+  if(sftp_compress_frame_size(job->ptr, *lenp, &raw))
+    return SSH_FX_BAD_MESSAGE;
+  buffer = sftp_alloc(job->a, raw ? raw : 1);
+  if(sftp_compress_unframe(c, job->ptr, *lenp, buffer, &data))
+    return SSH_FX_BAD_MESSAGE;
+  job->ptr = data;
+  job->left = raw;
+  *lenp = raw;
+  return SSH_FX_OK;
+}
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
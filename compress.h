@@ -0,0 +1,167 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file compress.h @brief Payload compression interface */
+
+#ifndef COMPRESS_H
+#  define COMPRESS_H
+
+#  include <stddef.h>
+#  include <stdint.h>
+
+/** @brief Name of the compression extension */
+#  define COMPRESS "compress@rjk.greenend.org.uk"
+
+/** @brief Size of a compressed frame's header
+ *
+ * A frame is a 32-bit uncompressed length, a @ref COMPRESS_STORED or
+ * @ref COMPRESS_PACKED byte, and the payload.
+ */
+#  define COMPRESS_HEADER 5
+
+/** @brief Frame payload is the data itself */
+#  define COMPRESS_STORED 0
+
+/** @brief Frame payload is compressed */
+#  define COMPRESS_PACKED 1
+
+/** @brief Largest uncompressed length of a frame that will be accepted */
+#  define COMPRESS_MAX 16777216
+
+/** @brief A compression method */
+struct sftpcompressor {
+  /** @brief Name as used by the @ref COMPRESS extension */
+  const char *name;
+
+  /** @brief Worst-case compressed size
+   * @param n Input size
+   * @return Largest possible output size
+   */
+  size_t (*bound)(size_t n);
+
+  /** @brief Compress a block
+   * @param dst Output buffer
+   * @param cap Size of output buffer
+   * @param src Input
+   * @param n Size of input
+   * @return Compressed size, or 0 on error
+   */
+  size_t (*compress)(void *dst, size_t cap, const void *src, size_t n);
+
+  /** @brief Decompress a block
+   * @param dst Output buffer
+   * @param n Expected size of output
+   * @param src Compressed input
+   * @param len Size of input
+   * @return 0 if exactly @p n bytes were produced, else -1
+   */
+  int (*decompress)(void *dst, size_t n, const void *src, size_t len);
+};
+
+/** @brief Pick a compression method from a list
+ * @param list Comma-separated list of names in order of preference
+ * @return First supported method in @p list, or a null pointer
+ */
+const struct sftpcompressor *sftp_compress_choose(const char *list);
+
+/** @brief Comma-separated list of all supported methods
+ * @return List, best first, or an empty string
+ */
+const char *sftp_compress_methods(void);
+
+/** @brief Space needed for a frame
+ * @param c Compression method
+ * @param n Uncompressed size
+ * @return Largest possible frame size
+ */
+size_t sftp_compress_frame_bound(const struct sftpcompressor *c, size_t n);
+
+/** @brief Build a frame
+ * @param c Compression method
+ * @param dst Where to put the frame (at least sftp_compress_frame_bound()
+ * bytes)
+ * @param src Data to compress
+ * @param n Size of data
+ * @return Size of frame
+ *
+ * Data that does not get smaller is stored instead.
+ */
+size_t sftp_compress_frame(const struct sftpcompressor *c, void *dst,
+                           const void *src, size_t n);
+
+/** @brief Find the uncompressed size of a frame
+ * @param frame Frame
+ * @param len Size of frame
+ * @param rawp Where to store the uncompressed size
+ * @return 0 on success, -1 if the frame is malformed or too big
+ */
+int sftp_compress_frame_size(const void *frame, size_t len, size_t *rawp);
+
+/** @brief Unpack a frame
+ * @param c Compression method
+ * @param frame Frame
+ * @param len Size of frame
+ * @param buffer Space for the uncompressed data
+ * @param datap Where to store a pointer to the data
+ * @return 0 on success, -1 if the frame is malformed
+ *
+ * @p buffer must be as large as sftp_compress_frame_size() says.  Stored
+ * data is not copied; @p *datap points into @p frame instead.
+ */
+int sftp_compress_unframe(const struct sftpcompressor *c, const void *frame,
+                          size_t len, void *buffer, const void **datap);
+
+struct sftpjob;
+struct handleid;
+
+/** @brief Respond to a read on a compressed handle
+ * @param job Job
+ * @param id Handle
+ * @param fd File descriptor for @p id
+ * @param offset Offset to read from
+ * @param len Bytes to read
+ * @return Error code
+ */
+uint32_t sftp_compress_read(struct sftpjob *job, const struct handleid *id,
+                            int fd, uint64_t offset, uint32_t len);
+
+/** @brief Unpack the data of a write on a compressed handle
+ * @param job Job, positioned at the frame
+ * @param id Handle
+ * @param lenp Size of frame, replaced with the size of the data
+ * @return Error code
+ *
+ * On success @c job->ptr points at the uncompressed data, which lasts only
+ * as long as the job's allocator.
+ */
+uint32_t sftp_compress_write(struct sftpjob *job, const struct handleid *id,
+                             uint32_t *lenp);
+
+#endif /* COMPRESS_H */
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
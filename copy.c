@@ -0,0 +1,183 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file copy.c @brief Server-side copy implementation
+ *
+ * Implements the @c copy-data extension from
+ * draft-ietf-secsh-filexfer-extensions-00 s7.  Copies are attempted first as
+ * a reflink, which shares the underlying blocks; then with
+ * copy_file_range(), which lets the kernel (or a network filesystem's
+ * server) move the data without it entering user space; and finally with a
+ * read/write loop.
+ */
+
+#include "sftpserver.h"
+#include "types.h"
+#include "globals.h"
+#include "handle.h"
+#include "parse.h"
+#include "sftp.h"
+#include "debug.h"
+#include "utils.h"
+#include "statcache.h"
+#include "copy.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#if HAVE_LINUX_FS_H
+#  include <linux/fs.h>
+#endif
+
+#ifndef COPYCHUNK
+/** @brief Buffer size for copies done in user space */
+#  define COPYCHUNK 1048576
+#endif
+
+/** @brief Copy with a reflink
+ * @param rfd Source file descriptor
+ * @param roff Source offset
+ * @param len Bytes to copy, or 0 to copy to end of file
+ * @param wfd Destination file descriptor
+ * @param woff Destination offset
+ * @return 0 on success, -1 if not possible
+ *
+ * Reflinks have alignment requirements and are only supported by some
+ * filesystems; in every case of failure we just fall back to other
+ * approaches.
+ */
+static int copy_reflink(int rfd, uint64_t roff, uint64_t len, int wfd,
+                        uint64_t woff) {
+#ifdef FICLONERANGE
+  struct file_clone_range fcr;
+
+  fcr.src_fd = rfd;
+  fcr.src_offset = roff;
+  fcr.src_length = len;
+  fcr.dest_offset = woff;
+  if(ioctl(wfd, FICLONERANGE, &fcr) == 0) {
+    D(("copied by reflink"));
+    return 0;
+  }
+#else
+  (void)rfd;
+  (void)roff;
+  (void)len;
+  (void)wfd;
+  (void)woff;
+#endif
+  return -1;
+}
+
+uint32_t sftp_copy_range(int rfd, uint64_t roff, uint64_t len, int wfd,
+                         uint64_t woff) {
+  const int to_eof = !len;
+  char *buffer = NULL;
+  ssize_t n, w, m;
+  int kernel = 1;
+
+  if(!copy_reflink(rfd, roff, len, wfd, woff))
+    return 0;
+  while(to_eof || len) {
+#if HAVE_COPY_FILE_RANGE
+    if(kernel) {
+      off_t ro = roff, wo = woff;
+
+      /* Let the kernel take as much as it likes */
+      n = copy_file_range(rfd, &ro, wfd, &wo,
+                          to_eof || len > 0x40000000 ? 0x40000000 : len, 0);
+      if(n < 0) {
+        if(errno != EXDEV && errno != EINVAL && errno != ENOSYS
+           && errno != EOPNOTSUPP)
+          goto error;
+        /* Can't do this copy in the kernel */
+        kernel = 0;
+        continue;
+      }
+    } else
+#endif
+    {
+      if(!buffer)
+        buffer = sftp_xmalloc(COPYCHUNK);
+      if((n = pread(rfd, buffer, to_eof || len > COPYCHUNK ? COPYCHUNK : len,
+                    roff))
+         < 0)
+        goto error;
+      for(w = 0; w < n; w += m)
+        if((m = pwrite(wfd, buffer + w, n - w, woff + w)) < 0)
+          goto error;
+    }
+    if(n == 0)
+      break; /* EOF */
+    roff += n;
+    woff += n;
+    if(!to_eof)
+      len -= n;
+  }
+  free(buffer);
+  return 0;
+error:
+  free(buffer);
+  return HANDLER_ERRNO;
+}
+
+uint32_t sftp_vany_copy_data(struct sftpjob *job) {
+  struct handleid rid, wid;
+  uint64_t roff, len, woff;
+  int rfd, wfd;
+  unsigned rflags, wflags;
+  uint32_t rc;
+
+  pcheck(sftp_parse_handle(job, &rid));
+  pcheck(sftp_parse_uint64(job, &roff));
+  pcheck(sftp_parse_uint64(job, &len));
+  pcheck(sftp_parse_handle(job, &wid));
+  pcheck(sftp_parse_uint64(job, &woff));
+  D(("sftp_vany_copy_data %" PRIu32 " %" PRIu32 " %" PRIu64 "+%" PRIu64
+     " -> %" PRIu32 " %" PRIu32 " %" PRIu64,
+     rid.id, rid.tag, roff, len, wid.id, wid.tag, woff));
+  if(readonly)
+    return SSH_FX_PERMISSION_DENIED;
+  sftp_statcache_invalidate();
+  if((rc = sftp_handle_get_fd(&rid, &rfd, &rflags)))
+    return rc;
+  if((rc = sftp_handle_get_fd(&wid, &wfd, &wflags)))
+    return rc;
+  /* We only support copying between binary files at explicit offsets */
+  if((rflags | wflags) & (HANDLE_TEXT | HANDLE_APPEND))
+    return SSH_FX_OP_UNSUPPORTED;
+  /* Copies within a single file must not overlap.  Copying to the end of the
+   * file is only safe if the destination is before the source. */
+  if(rid.id == wid.id && rid.tag == wid.tag) {
+    if(len ? (roff < woff + len && woff < roff + len) : woff >= roff)
+      return SSH_FX_INVALID_PARAMETER;
+  }
+  return sftp_copy_range(rfd, roff, len, wfd, woff);
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,51 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file copy.h @brief Server-side copy interface */
+
+#ifndef COPY_H
+#  define COPY_H
+
+#  include <stdint.h>
+
+/** @brief Copy data between two files
+ * @param rfd Source file descriptor
+ * @param roff Source offset
+ * @param len Bytes to copy, or 0 to copy to end of file
+ * @param wfd Destination file descriptor
+ * @param woff Destination offset
+ * @return 0 on success, @ref HANDLER_ERRNO on error
+ *
+ * Reflinks and copy_file_range() are used where possible.  Copying stops
+ * early if the end of the source file is reached.
+ */
+uint32_t sftp_copy_range(int rfd, uint64_t roff, uint64_t len, int wfd,
+                         uint64_t woff);
+
+#endif /* COPY_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
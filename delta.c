@@ -0,0 +1,178 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file delta.c @brief Delta transfer implementation
+ *
+ * Two vendor extensions allow a client to update a large file by sending
+ * only the parts that have changed, in the style of rsync:
+ *
+ * - @c delta-signature@rjk.greenend.org.uk returns a weak rolling checksum
+ *   and a SHA-256 hash for each block of an open file.  The client slides a
+ *   window over its own copy looking for blocks that the server already has.
+ *
+ * - @c delta-apply@rjk.greenend.org.uk writes a sequence of literal data and
+ *   references to blocks of a source handle into a destination handle.  The
+ *   client normally writes into a temporary file and then renames it over
+ *   the original with @c posix-rename@openssh.com, so the update is atomic.
+ *
+ * Signatures are computed by the check-file hashing engine, so blocks are
+ * hashed in parallel; block references are copied with sftp_copy_range(), so
+ * they may be reflinked or copied in the kernel.
+ */
+
+#include "sftpserver.h"
+#include "sftpconf.h"
+#include "types.h"
+#include "globals.h"
+#include "handle.h"
+#include "parse.h"
+#include "send.h"
+#include "sftp.h"
+#include "debug.h"
+#include "utils.h"
+#include "statcache.h"
+#include "hash.h"
+#include "checkfile.h"
+#include "copy.h"
+#include "delta.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+uint32_t sftp_vany_delta_signature(struct sftpjob *job) {
+  struct handleid id;
+  uint64_t start, end;
+  uint32_t blocksize, rc;
+  struct stat sb;
+  size_t nblocks, max;
+  unsigned char *strong;
+  struct worker *const w = job->worker;
+  int fd, error;
+
+  pcheck(sftp_parse_handle(job, &id));
+  pcheck(sftp_parse_uint64(job, &start));
+  pcheck(sftp_parse_uint32(job, &blocksize));
+  D(("sftp_vany_delta_signature %" PRIu32 " %" PRIu32 " %" PRIu64
+     " %" PRIu32,
+     id.id, id.tag, start, blocksize));
+  if(blocksize < 256)
+    return SSH_FX_INVALID_PARAMETER;
+  if((rc = sftp_handle_get_fd(&id, &fd, 0)))
+    return rc;
+  if(fstat(fd, &sb) < 0)
+    return HANDLER_ERRNO;
+  end = (uint64_t)sb.st_size;
+  if(start > end)
+    start = end;
+  /* Return as many signatures as fit in a response; the client asks again
+   * for the rest */
+  nblocks = (end - start + blocksize - 1) / blocksize;
+  max = sftpconf_max_read / (sftp_hash_rolling.size + DELTA_STRONG);
+  if(nblocks > max) {
+    nblocks = max;
+    end = start + (uint64_t)nblocks * blocksize;
+  }
+  sftp_send_begin(w);
+  sftp_send_uint8(w, SSH_FXP_EXTENDED_REPLY);
+  sftp_send_uint32(w, job->id);
+  sftp_send_uint32(w, nblocks);
+  sftp_send_need(w, nblocks * (sftp_hash_rolling.size + DELTA_STRONG));
+  if((error = sftp_checkfile_hash(fd, &sftp_hash_rolling, start, end,
+                                  blocksize, w->buffer + w->bufused)))
+    goto error;
+  w->bufused += nblocks * sftp_hash_rolling.size;
+  strong = w->buffer + w->bufused;
+  if((error = sftp_checkfile_hash(fd, sftp_hash_find(DELTA_STRONG_HASH), start,
+                                  end, blocksize, strong)))
+    goto error;
+  w->bufused += nblocks * DELTA_STRONG;
+  sftp_send_end(w);
+  return HANDLER_RESPONDED;
+error:
+  errno = error;
+  return HANDLER_ERRNO;
+}
+
+uint32_t sftp_vany_delta_apply(struct sftpjob *job) {
+  struct handleid sid, did;
+  uint64_t offset, soffset, len;
+  int sfd, dfd;
+  unsigned sflags, dflags;
+  uint8_t op;
+  const unsigned char *data;
+  size_t n;
+  ssize_t written;
+  uint32_t rc;
+
+  pcheck(sftp_parse_handle(job, &sid));
+  pcheck(sftp_parse_handle(job, &did));
+  pcheck(sftp_parse_uint64(job, &offset));
+  D(("sftp_vany_delta_apply %" PRIu32 " %" PRIu32 " -> %" PRIu32 " %" PRIu32
+     " %" PRIu64,
+     sid.id, sid.tag, did.id, did.tag, offset));
+  if(readonly)
+    return SSH_FX_PERMISSION_DENIED;
+  sftp_statcache_invalidate();
+  if((rc = sftp_handle_get_fd(&sid, &sfd, &sflags)))
+    return rc;
+  if((rc = sftp_handle_get_fd(&did, &dfd, &dflags)))
+    return rc;
+  if((sflags | dflags) & (HANDLE_TEXT | HANDLE_APPEND))
+    return SSH_FX_OP_UNSUPPORTED;
+  while(job->left) {
+    pcheck(sftp_parse_uint8(job, &op));
+    switch(op) {
+    case DELTA_LITERAL:
+      /* Write straight from the request rather than copying it */
+      data = job->ptr + 4;
+      pcheck(sftp_parse_string(job, 0, &n));
+      while(n) {
+        if((written = pwrite(dfd, data, n, offset)) < 0)
+          return HANDLER_ERRNO;
+        data += written;
+        n -= written;
+        offset += written;
+      }
+      break;
+    case DELTA_COPY:
+      pcheck(sftp_parse_uint64(job, &soffset));
+      pcheck(sftp_parse_uint64(job, &len));
+      if(!len)
+        return SSH_FX_INVALID_PARAMETER;
+      if((rc = sftp_copy_range(sfd, soffset, len, dfd, offset)))
+        return rc;
+      offset += len;
+      break;
+    default:
+      return SSH_FX_BAD_MESSAGE;
+    }
+  }
+  return SSH_FX_OK;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
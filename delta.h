@@ -0,0 +1,56 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file delta.h @brief Delta transfer protocol definitions
+ *
+ * These are shared between the server and client.
+ */
+
+#ifndef DELTA_H
+#  define DELTA_H
+
+/** @brief Name of signature extension */
+#  define DELTA_SIGNATURE "delta-signature@rjk.greenend.org.uk"
+
+/** @brief Name of apply extension */
+#  define DELTA_APPLY "delta-apply@rjk.greenend.org.uk"
+
+/** @brief Strong hash used in signatures */
+#  define DELTA_STRONG_HASH "sha256"
+
+/** @brief Size of strong hash */
+#  define DELTA_STRONG 32
+
+/** @brief @c delta-apply operation: string of literal data */
+#  define DELTA_LITERAL 0
+
+/** @brief @c delta-apply operation: uint64 source offset, uint64 length */
+#  define DELTA_COPY 1
+
+#endif /* DELTA_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,244 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file direct.c @brief Direct IO
+ *
+ * Bulk transfers below a @c direct-io prefix bypass the page cache, so that
+ * a large upload or download does not evict data that other programs on the
+ * host are using.  @c O_DIRECT requires offsets, lengths and buffer
+ * addresses to be aligned, which SFTP requests generally are not, so each
+ * such file has two descriptors: one opened with @c O_DIRECT for the aligned
+ * bulk of each transfer and the ordinary one for unaligned heads and tails.
+ * The kernel keeps the two views coherent.
+ */
+
+#include "sftpserver.h"
+#include "direct.h"
+#include "alloc.h"
+#include "debug.h"
+#include "utils.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/** @brief Path prefixes for direct IO */
+static char **direct_prefixes;
+
+/** @brief Number of path prefixes */
+static size_t direct_nprefixes;
+
+/** @brief Round down to a multiple of @ref DIRECTALIGN */
+#define ALIGN_DOWN(n) ((n) - (n) % DIRECTALIGN)
+
+/** @brief Round up to a multiple of @ref DIRECTALIGN */
+#define ALIGN_UP(n) ALIGN_DOWN((n) + DIRECTALIGN - 1)
+
+void sftp_direct_add(const char *prefix) {
+  size_t len = strlen(prefix);
+  char *p;
+
+  /* Trailing slashes would spoil the match */
+  while(len > 1 && prefix[len - 1] == '/')
+    --len;
+  p = sftp_xmalloc(len + 1);
+  memcpy(p, prefix, len);
+  p[len] = 0;
+  direct_prefixes = sftp_xrecalloc(direct_prefixes, direct_nprefixes + 1,
+                                   sizeof *direct_prefixes);
+  direct_prefixes[direct_nprefixes++] = p;
+}
+
+/** @brief Test whether a path is below a direct IO prefix
+ * @param path Absolute path name
+ * @return Nonzero if @p path matches
+ */
+static int direct_match(const char *path) {
+  size_t n, len;
+
+  for(n = 0; n < direct_nprefixes; ++n) {
+    len = strlen(direct_prefixes[n]);
+    if(!strncmp(path, direct_prefixes[n], len) &&
+       (path[len] == '/' || path[len] == 0 || len == 1))
+      return 1;
+  }
+  return 0;
+}
+
+int sftp_direct_open(struct allocator *a, int fd, const char *path) {
+#ifdef O_DIRECT
+  struct stat sb, dsb;
+  const char *resolved;
+  int fl, dfd;
+
+  if(!direct_nprefixes ||
+     !(resolved = sftp_find_realpath(a, path, RP_READLINK)) ||
+     !direct_match(resolved))
+    return -1;
+  if(fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) ||
+     (fl = fcntl(fd, F_GETFL)) < 0)
+    return -1;
+  if((dfd = open(resolved, (fl & O_ACCMODE) | O_DIRECT)) < 0) {
+    D(("direct open %s: %s", resolved, strerror(errno)));
+    return -1;
+  }
+  /* The file might have been renamed since it was first opened */
+  if(fstat(dfd, &dsb) < 0 || dsb.st_dev != sb.st_dev ||
+     dsb.st_ino != sb.st_ino) {
+    close(dfd);
+    return -1;
+  }
+  D(("direct IO for %s", resolved));
+  return dfd;
+#else
+  (void)a;
+  (void)fd;
+  (void)path;
+  return -1;
+#endif
+}
+
+/** @brief Allocate an aligned bounce buffer
+ * @param size Size of buffer
+ * @return Buffer, to be released with free()
+ */
+static char *direct_bounce(size_t size) {
+  void *ptr;
+  int rc;
+
+  if((rc = posix_memalign(&ptr, DIRECTALIGN, size)))
+    sftp_fatal("posix_memalign: %s", strerror(rc));
+  return ptr;
+}
+
+/** @brief Write all of a buffer
+ * @param fd File to write to
+ * @param data Data to write
+ * @param len Number of bytes to write
+ * @param offset File offset
+ * @return 0 on success, else an @c errno value
+ */
+static int direct_pwrite_all(int fd, const char *data, size_t len,
+                             uint64_t offset) {
+  ssize_t n;
+
+  while(len > 0) {
+    if((n = pwrite(fd, data, len, offset)) < 0)
+      return errno;
+    data += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+/** @brief Write an aligned range through the direct IO descriptor
+ * @param dfd Direct IO descriptor
+ * @param data Data to write
+ * @param len Number of bytes to write, a multiple of @ref DIRECTALIGN
+ * @param offset File offset, a multiple of @ref DIRECTALIGN
+ * @return 0 on success, else an @c errno value
+ */
+static int direct_pwrite_middle(int dfd, const char *data, size_t len,
+                                uint64_t offset) {
+  char *bounce;
+  size_t chunk;
+  int error = 0;
+
+  if((uintptr_t)data % DIRECTALIGN == 0)
+    return direct_pwrite_all(dfd, data, len, offset);
+  /* Stage through an aligned buffer */
+  bounce = direct_bounce(len < DIRECTCHUNK ? len : DIRECTCHUNK);
+  while(len > 0 && !error) {
+    chunk = len < DIRECTCHUNK ? len : DIRECTCHUNK;
+    memcpy(bounce, data, chunk);
+    error = direct_pwrite_all(dfd, bounce, chunk, offset);
+    data += chunk;
+    len -= chunk;
+    offset += chunk;
+  }
+  free(bounce);
+  return error;
+}
+
+int sftp_direct_pwrite(int fd, int dfd, const char *data, size_t len,
+                       uint64_t offset) {
+  const uint64_t start = ALIGN_UP(offset), end = ALIGN_DOWN(offset + len);
+  int error;
+
+  if(start >= end)
+    /* Not even one aligned block */
+    return direct_pwrite_all(fd, data, len, offset);
+  if(start > offset &&
+     (error = direct_pwrite_all(fd, data, start - offset, offset)))
+    return error;
+  data += start - offset;
+  error = direct_pwrite_middle(dfd, data, end - start, start);
+  if(error == EINVAL)
+    /* The filesystem doesn't support direct IO after all */
+    error = direct_pwrite_all(fd, data, end - start, start);
+  if(error)
+    return error;
+  data += end - start;
+  if(end < offset + len)
+    error = direct_pwrite_all(fd, data, offset + len - end, end);
+  return error;
+}
+
+ssize_t sftp_direct_pread(int fd, int dfd, void *buffer, size_t len,
+                          uint64_t offset) {
+  const uint64_t start = ALIGN_DOWN(offset), end = ALIGN_UP(offset + len);
+  const size_t skip = offset - start;
+  char *bounce = direct_bounce(end - start);
+  ssize_t n;
+  int save_errno;
+
+  if((n = pread(dfd, bounce, end - start, start)) < 0) {
+    save_errno = errno;
+    free(bounce);
+    if(save_errno == EINVAL)
+      /* The filesystem doesn't support direct IO after all */
+      return pread(fd, buffer, len, offset);
+    errno = save_errno;
+    return -1;
+  }
+  if((size_t)n <= skip)
+    n = 0; /* end of file */
+  else {
+    n -= skip;
+    if((size_t)n > len)
+      n = len;
+    memcpy(buffer, bounce + skip, n);
+  }
+  free(bounce);
+  return n;
+}
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
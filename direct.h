@@ -0,0 +1,91 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file direct.h @brief Direct IO interface */
+
+#ifndef DIRECT_H
+#  define DIRECT_H
+
+#  include <stdint.h>
+#  include <stddef.h>
+#  include <sys/types.h>
+
+/** @brief Add a path prefix for direct IO
+ * @param prefix Absolute path of a directory or file
+ *
+ * Used for the @c direct-io configuration directive.
+ */
+void sftp_direct_add(const char *prefix);
+
+struct allocator;
+
+/** @brief Open a second descriptor for direct IO if configured
+ * @param a Allocator
+ * @param fd Descriptor for the newly opened file
+ * @param path Path name of the file
+ * @return Descriptor opened with @c O_DIRECT, or -1
+ *
+ * Returns -1 if @p path does not resolve to somewhere below a @c direct-io
+ * prefix, if @p fd is not a regular file, or if direct IO is not available.
+ * The new descriptor has the same access mode as @p fd and refers to the
+ * same file.
+ */
+int sftp_direct_open(struct allocator *a, int fd, const char *path);
+
+/** @brief Write to a file, bypassing the page cache where possible
+ * @param fd Ordinary descriptor for the file
+ * @param dfd Direct IO descriptor for the same file
+ * @param data Data to write
+ * @param len Number of bytes to write
+ * @param offset File offset to write at
+ * @return 0 on success, else an @c errno value
+ *
+ * The aligned middle of the range is written through @p dfd, straight
+ * from @p data if it is suitably aligned in memory and through a bounce
+ * buffer otherwise.  Any unaligned head or tail goes through @p fd.
+ */
+int sftp_direct_pwrite(int fd, int dfd, const char *data, size_t len,
+                       uint64_t offset);
+
+/** @brief Read from a file, bypassing the page cache where possible
+ * @param fd Ordinary descriptor for the file
+ * @param dfd Direct IO descriptor for the same file
+ * @param buffer Where to store data
+ * @param len Maximum number of bytes to read
+ * @param offset File offset to read from
+ * @return Number of bytes read, 0 at end of file, or -1 on error
+ *
+ * The aligned range covering the request is read through @p dfd into a
+ * bounce buffer.  If the filesystem refuses then @p fd is used instead.
+ */
+ssize_t sftp_direct_pread(int fd, int dfd, void *buffer, size_t len,
+                          uint64_t offset);
+
+#endif /* DIRECT_H */
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
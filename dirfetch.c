@@ -0,0 +1,383 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file dirfetch.c @brief Directory entry prefetch
+ *
+ * Listing a directory takes one @ref SSH_FXP_READDIR round trip per batch of
+ * names.  Rather than sit idle for the round trip, once a batch has been
+ * answered the next one is read and stat'd in the background, so that when
+ * the client asks for it the answer is ready.  A single thread does the
+ * prefetching and hands the stat() calls to the helpers in statbatch.c.
+ *
+ * Requests on a directory handle do not generally run alone.  @ref
+ * SSH_FXP_READDIR is a query (see serialize.c), so it may run on the query
+ * worker alongside reads and writes on other handles, and in multiplex mode
+ * alongside any request from another session.  What serialize.c does
+ * guarantee is that queries and barriers within a session run in order, and
+ * handles belong to a single session, so at most one handler at a time is
+ * inside sftp_dirfetch_next() or sftp_dirfetch_free() for a given handle.
+ *
+ * That handler can still overlap the prefetch thread, so ownership of each
+ * handle's stream and batch passes between them through @ref
+ * dirfetch::state, which together with the @ref pending queue is protected
+ * by @ref fetch_lock.  The prefetch thread owns the rest of the state while
+ * the batch is @ref fetch_queued or @ref fetch_running, and the handler owns
+ * it otherwise; fetch_claim() is how the handler takes it back.  Neither
+ * holds @ref fetch_lock while reading or stat'ing, so the <dirent.h> calls
+ * for different handles may run at the same time.
+ */
+
+#include "sftpserver.h"
+#include "sftpconf.h"
+#include "sftp.h"
+#include "alloc.h"
+#include "thread.h"
+#include "utils.h"
+#include "debug.h"
+#include "statbatch.h"
+#include "statcache.h"
+#include "dirfetch.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** @brief Attributes that need more than a directory entry to fill in */
+#define READDIR_STAT_ATTRS                                                    \
+  (SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_PERMISSIONS |                    \
+   SSH_FILEXFER_ATTR_ACCESSTIME | SSH_FILEXFER_ATTR_MODIFYTIME |               \
+   SSH_FILEXFER_ATTR_UIDGID | SSH_FILEXFER_ATTR_OWNERGROUP |                   \
+   SSH_FILEXFER_ATTR_ALLOCATION_SIZE | SSH_FILEXFER_ATTR_LINK_COUNT |          \
+   SSH_FILEXFER_ATTR_CTIME)
+
+/** @brief Where a handle's next batch has got to */
+enum fetchstate {
+  fetch_idle,    /**< @brief Nothing prefetched */
+  fetch_queued,  /**< @brief Waiting for the prefetch thread */
+  fetch_running, /**< @brief Being read by the prefetch thread */
+  fetch_ready,   /**< @brief Prefetched and waiting for the client */
+};
+
+/** @brief Prefetch state for a directory handle */
+struct dirfetch {
+  /** @brief Next handle waiting for the prefetch thread */
+  struct dirfetch *next;
+
+  /** @brief Directory stream */
+  DIR *dp;
+
+  /** @brief Name of directory */
+  const char *path;
+
+  /** @brief State of the next batch */
+  enum fetchstate state;
+
+  /** @brief Attributes the current batch was stat'd for */
+  uint32_t mask;
+
+  /** @brief Storage for the current batch */
+  struct allocator a;
+
+  /** @brief Entries in the current batch */
+  struct statreq *reqs;
+
+  /** @brief Number of entries in the current batch */
+  size_t n;
+
+  /** @brief 0 or an @c errno value from reading the current batch */
+  int error;
+
+  /** @brief Non-0 once the end of the directory has been reached */
+  int eof;
+};
+
+/** @brief Lock protecting the prefetch state */
+static pthread_mutex_t fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Signaled when a handle is queued, or on shutdown */
+static pthread_cond_t fetch_wanted = PTHREAD_COND_INITIALIZER;
+
+/** @brief Signaled when a prefetch finishes */
+static pthread_cond_t fetch_done = PTHREAD_COND_INITIALIZER;
+
+/** @brief Handles waiting for the prefetch thread, oldest first */
+static struct dirfetch *pending;
+
+/** @brief Prefetch thread */
+static pthread_t fetch_thread_id;
+
+/** @brief Nonzero if the prefetch thread is running */
+static int fetch_started;
+
+/** @brief Set to shut down the prefetch thread */
+static int fetch_stopping;
+
+/** @brief Find the file type of a directory entry without stat()
+ * @param de Directory entry
+ * @return @c S_IFMT bits, or 0 if the type is not known
+ */
+static mode_t readdir_type(const struct dirent attribute((unused)) * de) {
+#ifdef DT_UNKNOWN
+  switch(de->d_type) {
+  case DT_FIFO:
+    return S_IFIFO;
+  case DT_CHR:
+    return S_IFCHR;
+  case DT_DIR:
+    return S_IFDIR;
+  case DT_BLK:
+    return S_IFBLK;
+  case DT_REG:
+    return S_IFREG;
+  case DT_LNK:
+    return S_IFLNK;
+  case DT_SOCK:
+    return S_IFSOCK;
+  }
+#endif
+  return 0;
+}
+
+/** @brief Get the descriptor for a handle's directory stream
+ * @param f Prefetch state
+ * @return File descriptor, or -1 if not available
+ */
+static int fetch_dirfd(const struct dirfetch *f) {
+#if HAVE_DIRFD
+  return dirfd(f->dp);
+#else
+  (void)f;
+  return -1;
+#endif
+}
+
+/** @brief Stat the entries in the current batch
+ * @param f Prefetch state
+ * @param mask Attributes wanted
+ */
+static void fetch_stat(struct dirfetch *f, uint32_t mask) {
+  struct statreq *lookup;
+  size_t i, m, *where;
+  uint64_t generation;
+
+  f->mask = mask;
+  /* Stat the whole batch at once, relative to the directory where possible
+   * to save constructing full paths */
+  if(mask & READDIR_STAT_ATTRS) {
+    generation = sftp_statcache_generation();
+    sftp_statbatch(fetch_dirfd(f), f->path, f->reqs, f->n, mask);
+    /* Clients often stat what they have just listed */
+    for(i = 0; i < f->n; ++i)
+      if(!f->reqs[i].error)
+        sftp_statcache_note(f->path, f->reqs[i].name, mask, &f->reqs[i].sb,
+                            generation);
+    return;
+  }
+  /* Only the entries whose type readdir() did not tell us need a stat */
+  lookup = sftp_alloc_raw(&f->a, (f->n ? f->n : 1) * sizeof *lookup);
+  where = sftp_alloc_raw(&f->a, (f->n ? f->n : 1) * sizeof *where);
+  for(i = m = 0; i < f->n; ++i)
+    if(!f->reqs[i].sb.st_mode) {
+      lookup[m].name = f->reqs[i].name;
+      where[m++] = i;
+    }
+  sftp_statbatch(fetch_dirfd(f), f->path, lookup, m, mask);
+  for(i = 0; i < m; ++i) {
+    f->reqs[where[i]].sb = lookup[i].sb;
+    f->reqs[where[i]].error = lookup[i].error;
+  }
+}
+
+/** @brief Read and stat a batch of entries
+ * @param f Prefetch state
+ * @param mask Attributes wanted
+ *
+ * Replaces the current batch.
+ */
+static void fetch_batch(struct dirfetch *f, uint32_t mask) {
+  struct dirent *de;
+  size_t n;
+
+  sftp_alloc_reset(&f->a);
+  f->reqs = sftp_alloc_raw(&f->a, sftpconf_max_names * sizeof *f->reqs);
+  f->n = 0;
+  f->error = 0;
+  if(f->eof)
+    return;
+  for(n = 0; n < (size_t)sftpconf_max_names; ++n) {
+    /* readdir() has a slightly shonky interface - a null return can mean EOF
+     * or error, and there is no guarantee that errno is reset to 0 on EOF. */
+    errno = 0;
+    if(!(de = readdir(f->dp))) {
+      if(!(f->error = errno))
+        f->eof = 1;
+      break;
+    }
+    /* We include . and .. in the list - if the cliient doesn't like them it
+     * can filter them out itself. */
+    f->reqs[n].name =
+        strcpy(sftp_alloc_raw(&f->a, strlen(de->d_name) + 1), de->d_name);
+    /* If the client only wants names then the file type is all that's
+     * needed, and readdir() usually supplies that */
+    sftp_memset(&f->reqs[n].sb, 0, sizeof f->reqs[n].sb);
+    f->reqs[n].sb.st_mode = readdir_type(de);
+    f->reqs[n].error = 0;
+  }
+  f->n = n;
+  if(!f->error)
+    fetch_stat(f, mask);
+}
+
+/** @brief Prefetch thread
+ * @param arg Unused
+ * @return Null pointer
+ */
+static void *fetch_thread(void attribute((unused)) * arg) {
+  struct dirfetch *f;
+
+  ferrcheck(pthread_mutex_lock(&fetch_lock));
+  while(!fetch_stopping) {
+    if(!(f = pending)) {
+      ferrcheck(pthread_cond_wait(&fetch_wanted, &fetch_lock));
+      continue;
+    }
+    pending = f->next;
+    f->state = fetch_running;
+    ferrcheck(pthread_mutex_unlock(&fetch_lock));
+    fetch_batch(f, f->mask);
+    ferrcheck(pthread_mutex_lock(&fetch_lock));
+    f->state = fetch_ready;
+    ferrcheck(pthread_cond_broadcast(&fetch_done));
+  }
+  ferrcheck(pthread_mutex_unlock(&fetch_lock));
+  return NULL;
+}
+
+void sftp_dirfetch_stop(void) {
+  if(!fetch_started)
+    return;
+  ferrcheck(pthread_mutex_lock(&fetch_lock));
+  fetch_stopping = 1;
+  ferrcheck(pthread_cond_broadcast(&fetch_wanted));
+  ferrcheck(pthread_mutex_unlock(&fetch_lock));
+  ferrcheck(pthread_join(fetch_thread_id, 0));
+  fetch_started = 0;
+  fetch_stopping = 0;
+}
+
+struct dirfetch *sftp_dirfetch_new(DIR *dp, const char *path) {
+  struct dirfetch *f = sftp_xmalloc(sizeof *f);
+
+  sftp_memset(f, 0, sizeof *f);
+  f->dp = dp;
+  f->path = path;
+  f->state = fetch_idle;
+  sftp_alloc_init(&f->a);
+  return f;
+}
+
+/** @brief Claim a handle's next batch for the calling thread
+ * @param f Prefetch state
+ * @return Non-0 if the batch was prefetched
+ *
+ * A batch that the prefetch thread has not started on is taken off the
+ * queue, and one it is working on is waited for.  Must be called with @ref
+ * fetch_lock held.
+ */
+static int fetch_claim(struct dirfetch *f) {
+  struct dirfetch **fp;
+
+  switch(f->state) {
+  case fetch_queued:
+    for(fp = &pending; *fp != f; fp = &(*fp)->next)
+      ;
+    *fp = f->next;
+    break;
+  case fetch_running:
+    while(f->state == fetch_running)
+      ferrcheck(pthread_cond_wait(&fetch_done, &fetch_lock));
+    break;
+  default:
+    break;
+  }
+  if(f->state == fetch_ready) {
+    f->state = fetch_idle;
+    return 1;
+  }
+  f->state = fetch_idle;
+  return 0;
+}
+
+void sftp_dirfetch_free(struct dirfetch *f) {
+  if(!f)
+    return;
+  ferrcheck(pthread_mutex_lock(&fetch_lock));
+  fetch_claim(f);
+  ferrcheck(pthread_mutex_unlock(&fetch_lock));
+  sftp_alloc_destroy(&f->a);
+  free(f);
+}
+
+int sftp_dirfetch_next(struct dirfetch *f, uint32_t mask,
+                       struct statreq **reqsp, size_t *np) {
+  int ready;
+
+  ferrcheck(pthread_mutex_lock(&fetch_lock));
+  ready = fetch_claim(f);
+  ferrcheck(pthread_mutex_unlock(&fetch_lock));
+  if(!ready)
+    fetch_batch(f, mask);
+  else if(f->mask != mask && !f->error) {
+    /* The client changed its mind about what it wants */
+    D(("re-stat prefetched batch for %#" PRIx32, mask));
+    fetch_stat(f, mask);
+  }
+  *reqsp = f->reqs;
+  *np = f->n;
+  return f->error;
+}
+
+void sftp_dirfetch_ahead(struct dirfetch *f) {
+  struct dirfetch **fp;
+
+  if(!sftpconf_readdir_prefetch || f->eof || f->error)
+    return;
+  ferrcheck(pthread_mutex_lock(&fetch_lock));
+  if(!fetch_started) {
+    ferrcheck(pthread_create(&fetch_thread_id, 0, fetch_thread, 0));
+    fetch_started = 1;
+  }
+  f->state = fetch_queued;
+  f->next = NULL;
+  for(fp = &pending; *fp; fp = &(*fp)->next)
+    ;
+  *fp = f;
+  ferrcheck(pthread_cond_signal(&fetch_wanted));
+  ferrcheck(pthread_mutex_unlock(&fetch_lock));
+}
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
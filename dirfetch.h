@@ -0,0 +1,88 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file dirfetch.h @brief Directory entry prefetch interface */
+
+#ifndef DIRFETCH_H
+#  define DIRFETCH_H
+
+#  include <dirent.h>
+#  include <stddef.h>
+#  include <stdint.h>
+
+struct dirfetch;
+struct statreq;
+
+/** @brief Stop the prefetch thread
+ *
+ * The thread is started when the first batch is prefetched.  Batches that
+ * have not been started yet are left for sftp_dirfetch_next() to read.
+ */
+void sftp_dirfetch_stop(void);
+
+/** @brief Create the prefetch state for a directory handle
+ * @param dp Directory stream
+ * @param path Name of directory
+ * @return New prefetch state
+ *
+ * @p dp and @p path must remain valid until sftp_dirfetch_free() is called.
+ */
+struct dirfetch *sftp_dirfetch_new(DIR *dp, const char *path);
+
+/** @brief Destroy the prefetch state for a directory handle
+ * @param f Prefetch state, or a null pointer
+ *
+ * Waits for any prefetch in progress.  The directory stream is not closed.
+ */
+void sftp_dirfetch_free(struct dirfetch *f);
+
+/** @brief Get the next batch of directory entries
+ * @param f Prefetch state
+ * @param mask Attributes wanted
+ * @param reqsp Where to store entries and their attributes
+ * @param np Where to store number of entries, 0 at end of directory
+ * @return 0 on success, else an @c errno value
+ *
+ * If the batch was prefetched then it is returned at once, or as soon as
+ * the prefetch finishes.  Otherwise it is read now.  The entries remain valid
+ * until the next call to sftp_dirfetch_ahead() or sftp_dirfetch_free().
+ */
+int sftp_dirfetch_next(struct dirfetch *f, uint32_t mask,
+                       struct statreq **reqsp, size_t *np);
+
+/** @brief Start prefetching the batch after the one just returned
+ * @param f Prefetch state
+ *
+ * Does nothing if prefetching is disabled or if the last batch reached the
+ * end of the directory.  Call once the last batch has been answered.
+ */
+void sftp_dirfetch_ahead(struct dirfetch *f);
+
+#endif /* DIRFETCH_H */
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
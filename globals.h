@@ -41,8 +41,13 @@ extern const struct sftpprotocol sftp_v3;
 /** @brief Pre-initialization protocol callbacks */
 extern const struct sftpprotocol sftp_preinit;
 
-/** @brief Selected protocol */
-extern const struct sftpprotocol *protocol;
+/** @brief Selected protocol
+ *
+ * Each thread has its own copy.  In the server it is that of the session the
+ * thread is working for (see session.h); the client's threads copy it from
+ * the thread that starts them.
+ */
+extern THREAD_LOCAL const struct sftpprotocol *protocol;
 
 /** @brief What messages this process sends
  *
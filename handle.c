@@ -18,7 +18,20 @@
  * USA
  */
 
-/** @file handle.c @brief File handle implementation */
+/** @file handle.c @brief File handle implementation
+ *
+ * Handles live in a table of fixed-size chunks which, once allocated, never
+ * move, so a slot can be found without taking any lock.  Creating and
+ * destroying handles is serialized by @ref sftp_handle_lock; free slots are
+ * kept on a list so allocation does not have to search.
+ *
+ * Looking up a file handle is on the path of every read and write, so where
+ * C11 atomics are available it is lock-free.  The slot's tag doubles as a
+ * sequence lock: it is 0 while the slot is being changed, and a fresh tag is
+ * stored only once the other fields are in place.  A reader checks the tag,
+ * reads what it needs and checks the tag again; if it did not change, the
+ * values read belong to the handle the caller named.
+ */
 
 #include "sftpserver.h"
 #include "debug.h"
@@ -27,28 +40,105 @@
 #include "handle.h"
 #include "thread.h"
 #include "types.h"
+#include "sftpconf.h"
+#include "walk.h"
+#include "lineindex.h"
+#include "mapread.h"
+#include "direct.h"
+#include "dirfetch.h"
+#include "watch.h"
+#include "session.h"
+#include "statcache.h"
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#if HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
+#if HAVE_STDATOMIC_H
+/** @brief Type of handle fields read without holding the lock */
+typedef atomic_uint handleword;
+
+/** @brief Type of file descriptors read without holding the lock */
+typedef atomic_int handlefd;
+#else
+typedef unsigned handleword;
+typedef int handlefd;
+#endif
+
+/** @brief Number of handles per chunk of the table */
+#define HANDLECHUNK 64
+
+/** @brief End of free list */
+#define NOFREE UINT32_MAX
 
 /** @brief Handle data structure */
 struct handle {
-  int type;     /**< @brief @ref SSH_FXP_OPEN or @ref SSH_FXP_OPENDIR */
-  uint32_t tag; /**< @brief Unique tag or 0 for unused */
-  union {
-    int fd;   /**< @brief File descriptor for a file */
-    DIR *dir; /**< @brief Directory stream */
-  } u;
-  char *path;     /**< @brief Name of file or directory */
-  unsigned flags; /**< @brief Flags */
+  handleword type; /**< @brief @ref SSH_FXP_OPEN, @ref SSH_FXP_OPENDIR or
+                    * @ref HANDLE_WALK or @ref HANDLE_WATCH */
+  handleword tag;  /**< @brief Unique tag or 0 for unused */
+  handlefd fd;     /**< @brief File descriptor for a file */
+  int dfd;         /**< @brief Direct IO descriptor, or -1 */
+  DIR *dir;        /**< @brief Directory stream */
+  struct dirfetch *fetch; /**< @brief Directory entry prefetch state */
+  struct walk *walk; /**< @brief Directory walk */
+  struct watch *watch; /**< @brief Change notification */
+  char *path;      /**< @brief Name of file or directory */
+  handleword flags; /**< @brief Flags */
+  uint32_t attrmask; /**< @brief Attributes wanted from a directory */
+  uint32_t nextfree; /**< @brief Next free slot, if this one is free */
+  struct session *owner; /**< @brief Session that opened the handle */
+
+  /* Read-ahead state, protected by @ref wlock.  Reads on one handle run
+   * concurrently once the client has asked for them to be re-ordered (see
+   * serialize.c). */
+  uint64_t next;  /**< @brief Offset just past the last read */
+  uint64_t ahead; /**< @brief Offset up to which read-ahead was requested */
+  unsigned run;   /**< @brief Number of consecutive sequential reads */
+  struct lineindex *lines; /**< @brief Line index for text-seek */
+  struct mapwindow *map; /**< @brief Current window for mmap-read */
+  const struct sftpcompressor *compress; /**< @brief Payload compression */
+
+  /* Write-behind state.  Non-overlapping writes to one handle may run
+   * concurrently, so these are protected by @ref wlock. */
+  pthread_mutex_t wlock; /**< @brief Lock protecting per-handle IO state */
+  char *wbuf;     /**< @brief Write-behind buffer or a null pointer */
+  size_t wskew;   /**< @brief Offset of buffered data within @ref wbuf */
+  uint64_t wstart; /**< @brief File offset of start of @ref wbuf */
+  size_t wused;   /**< @brief Bytes used in @ref wbuf */
+  int werror;     /**< @brief Deferred errno value from a failed flush */
+  int wknown;     /**< @brief Non-0 if @ref wdev and @ref wino are set */
+  dev_t wdev;     /**< @brief Device of the file */
+  ino_t wino;     /**< @brief Inode of the file */
+
+  /* Preallocation state, also protected by @ref wlock. */
+  uint64_t prealloc; /**< @brief Offset up to which space was preallocated */
+  int ptrim;      /**< @brief Non-0 to release unused space on close */
+  int pstop;      /**< @brief Non-0 to preallocate no further */
 };
 
-/** @brief Table of handles */
-static struct handle *handles;
+/** @brief Table of chunks of handles
+ *
+ * This has room for @ref sftpconf_max_handles handles and is allocated when
+ * the first handle is created.  Chunks are allocated as needed and never
+ * freed.
+ */
+static struct handle **chunks;
 
-/** @brief Size of @p handles array */
-static size_t nhandles;
+/** @brief Number of slots in use or on the free list
+ *
+ * Stored with release semantics after the chunk holding the new slot is
+ * ready, so a reader that sees a slot number below this can use it.
+ */
+static handleword nslots;
+
+/** @brief First free slot, or @ref NOFREE */
+static uint32_t freelist = NOFREE;
 
 /** @brief Next sequence number */
 static uint32_t sequence;
@@ -56,58 +146,242 @@ static uint32_t sequence;
 /** @brief Lock protecting handles data structure */
 static pthread_mutex_t sftp_handle_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/** @brief Find a free slot in @ref handles
+/** @brief Find the slot for a handle ID
+ * @param n Handle ID
+ * @return Slot, or a null pointer if @p n is out of range
+ */
+static struct handle *handle_slot(uint32_t n) {
+#if HAVE_STDATOMIC_H
+  if(n >= atomic_load_explicit(&nslots, memory_order_acquire))
+#else
+  if(n >= nslots)
+#endif
+    return NULL;
+  return &chunks[n / HANDLECHUNK][n % HANDLECHUNK];
+}
+
+/** @brief Find the slot for a handle
+ * @param id Handle
+ * @return Slot, or a null pointer if @p id is not a valid handle
+ *
+ * Handles are only valid in the session that opened them.
+ */
+static struct handle *handle_find(const struct handleid *id) {
+  struct handle *h;
+
+  if(!id->tag || !(h = handle_slot(id->id)) || h->tag != id->tag
+     || h->owner != sftp_session)
+    return NULL;
+  return h;
+}
+
+/** @brief Find a free slot
  * @param id Where to store handle
  * @param type @ref SSH_FXP_OPEN or @ref SSH_FXP_OPENDIR
+ * @return Slot, or a null pointer if the table is full
+ *
+ * The caller fills in the rest of the slot and then calls handle_publish().
  */
-static void find_free_handle(struct handleid *id, int type) {
-  size_t n;
+static struct handle *find_free_handle(struct handleid *id, int type) {
+  struct handle *h;
+  uint32_t n;
+
+  if(freelist != NOFREE) {
+    n = freelist;
+    h = handle_slot(n);
+    freelist = h->nextfree;
+  } else {
+    n = nslots;
+    if(n >= (uint32_t)sftpconf_max_handles)
+      return NULL;
+    if(!chunks)
+      chunks = sftp_xcalloc((sftpconf_max_handles + HANDLECHUNK - 1)
+                                / HANDLECHUNK,
+                            sizeof *chunks);
+    if(n % HANDLECHUNK == 0) {
+      struct handle *chunk = sftp_xcalloc(HANDLECHUNK, sizeof **chunks);
+      size_t i;
 
-  for(n = 0; n < nhandles && handles[n].tag; ++n)
-    ;
-  if(n == nhandles && nhandles < MAXHANDLES) {
-    /* need more space */
-    nhandles = (nhandles ? 2 * nhandles : 16);
-    assert(nhandles != 0);
-    handles = sftp_xrecalloc(handles, nhandles, sizeof(*handles));
-    sftp_memset(handles + n, 0, (nhandles - n) * sizeof(*handles));
+      for(i = 0; i < HANDLECHUNK; ++i)
+        ferrcheck(pthread_mutex_init(&chunk[i].wlock, 0));
+      chunks[n / HANDLECHUNK] = chunk;
+    }
+    h = &chunks[n / HANDLECHUNK][n % HANDLECHUNK];
+    nslots = n + 1;
   }
   while(!sequence)
     ++sequence; /* never have a tag of 0 */
-  handles[n].tag = sequence++;
-  handles[n].type = type;
+  h->type = type;
+  h->owner = sftp_session;
+  h->nextfree = NOFREE;
+  h->next = h->ahead = 0;
+  h->run = 0;
+  h->lines = NULL;
+  h->map = NULL;
+  h->compress = NULL;
+  h->dfd = -1;
+  h->wskew = 0;
+  h->wused = 0;
+  h->werror = 0;
+  h->wknown = 0;
+  h->prealloc = 0;
+  h->ptrim = h->pstop = 0;
   id->id = n;
-  id->tag = handles[n].tag;
+  id->tag = sequence++;
+  return h;
+}
+
+/** @brief Make a new handle visible
+ * @param h Slot
+ * @param id Handle
+ *
+ * Storing the tag last means a lock-free reader never sees a valid tag
+ * alongside stale contents.
+ */
+static void handle_publish(struct handle *h, const struct handleid *id) {
+  h->tag = id->tag;
+}
+
+uint32_t sftp_handle_new_file(struct handleid *id, int fd, const char *path,
+                              unsigned flags) {
+  struct handle *h;
+
+  ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
+  if((h = find_free_handle(id, SSH_FXP_OPEN))) {
+    h->fd = fd;
+    h->path = sftp_xstrdup(path);
+    h->flags = flags;
+    handle_publish(h, id);
+  }
+  ferrcheck(pthread_mutex_unlock(&sftp_handle_lock));
+  if(!h) {
+    errno = EMFILE;
+    return HANDLER_ERRNO;
+  }
+  return 0;
+}
+
+uint32_t sftp_handle_new_dir(struct handleid *id, DIR *dp, const char *path) {
+  struct handle *h;
+
+  ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
+  if((h = find_free_handle(id, SSH_FXP_OPENDIR))) {
+    h->dir = dp;
+    h->path = sftp_xstrdup(path);
+    h->fetch = sftp_dirfetch_new(dp, h->path);
+    h->flags = 0;
+    h->attrmask = 0xFFFFFFFF;
+    handle_publish(h, id);
+  }
+  ferrcheck(pthread_mutex_unlock(&sftp_handle_lock));
+  if(!h) {
+    errno = EMFILE;
+    return HANDLER_ERRNO;
+  }
+  return 0;
+}
+
+uint32_t sftp_handle_new_walk(struct handleid *id, struct walk *w,
+                              const char *path) {
+  struct handle *h;
+
+  ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
+  if((h = find_free_handle(id, HANDLE_WALK))) {
+    h->walk = w;
+    h->path = sftp_xstrdup(path);
+    h->flags = 0;
+    handle_publish(h, id);
+  }
+  ferrcheck(pthread_mutex_unlock(&sftp_handle_lock));
+  if(!h) {
+    errno = EMFILE;
+    return HANDLER_ERRNO;
+  }
+  return 0;
 }
 
-void sftp_handle_new_file(struct handleid *id, int fd, const char *path,
-                          unsigned flags) {
+uint32_t sftp_handle_new_watch(struct handleid *id, struct watch *w,
+                               const char *path) {
+  struct handle *h;
+
   ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
-  find_free_handle(id, SSH_FXP_OPEN);
-  handles[id->id].u.fd = fd;
-  handles[id->id].path = sftp_xstrdup(path);
-  handles[id->id].flags = flags;
+  if((h = find_free_handle(id, HANDLE_WATCH))) {
+    h->watch = w;
+    h->path = sftp_xstrdup(path);
+    h->flags = 0;
+    handle_publish(h, id);
+  }
   ferrcheck(pthread_mutex_unlock(&sftp_handle_lock));
+  if(!h) {
+    errno = EMFILE;
+    return HANDLER_ERRNO;
+  }
+  return 0;
 }
 
-void sftp_handle_new_dir(struct handleid *id, DIR *dp, const char *path) {
+/** @brief Read a handle's type, file descriptor and flags
+ * @param id Handle
+ * @param typep Where to store type
+ * @param fdp Where to store file descriptor
+ * @param flagsp Where to store flags
+ * @return 0 on success, -1 if @p id is not a valid handle
+ *
+ * Where possible this does not take @ref sftp_handle_lock.
+ */
+static int handle_peek(const struct handleid *id, unsigned *typep, int *fdp,
+                       unsigned *flagsp) {
+  struct handle *h;
+  int rc = -1;
+
+  if(!id->tag)
+    return -1;
+#if HAVE_STDATOMIC_H
+  if((h = handle_slot(id->id))
+     && atomic_load_explicit(&h->tag, memory_order_acquire) == id->tag
+     && h->owner == sftp_session) {
+    *typep = atomic_load_explicit(&h->type, memory_order_relaxed);
+    *fdp = atomic_load_explicit(&h->fd, memory_order_relaxed);
+    *flagsp = atomic_load_explicit(&h->flags, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if(atomic_load_explicit(&h->tag, memory_order_relaxed) == id->tag)
+      rc = 0;
+  }
+#else
   ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
-  find_free_handle(id, SSH_FXP_OPENDIR);
-  handles[id->id].u.dir = dp;
-  handles[id->id].path = sftp_xstrdup(path);
+  if((h = handle_find(id))) {
+    *typep = h->type;
+    *fdp = h->fd;
+    *flagsp = h->flags;
+    rc = 0;
+  }
   ferrcheck(pthread_mutex_unlock(&sftp_handle_lock));
+#endif
+  return rc;
 }
 
 uint32_t sftp_handle_get_fd(const struct handleid *id, int *fd,
                             unsigned *flagsp) {
+  unsigned type, flags;
+  int hfd;
+
+  if(handle_peek(id, &type, &hfd, &flags) || type != SSH_FXP_OPEN)
+    return SSH_FX_INVALID_HANDLE;
+  *fd = hfd;
+  if(flagsp)
+    *flagsp = flags;
+  return 0;
+}
+
+uint32_t sftp_handle_get_dir(const struct handleid *id, struct dirfetch **fp,
+                             uint32_t *maskp) {
+  struct handle *h;
   uint32_t rc;
 
   ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
-  if(id->id < nhandles && id->tag == handles[id->id].tag &&
-     handles[id->id].type == SSH_FXP_OPEN) {
-    *fd = handles[id->id].u.fd;
-    if(flagsp)
-      *flagsp = handles[id->id].flags;
+  if((h = handle_find(id)) && h->type == SSH_FXP_OPENDIR) {
+    *fp = h->fetch;
+    if(maskp)
+      *maskp = h->attrmask;
     rc = 0;
   } else
     rc = SSH_FX_INVALID_HANDLE;
@@ -115,16 +389,13 @@ uint32_t sftp_handle_get_fd(const struct handleid *id, int *fd,
   return rc;
 }
 
-uint32_t sftp_handle_get_dir(const struct handleid *id, DIR **dp,
-                             const char **pathp) {
+uint32_t sftp_handle_set_attrmask(const struct handleid *id, uint32_t mask) {
+  struct handle *h;
   uint32_t rc;
 
   ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
-  if(id->id < nhandles && id->tag == handles[id->id].tag &&
-     handles[id->id].type == SSH_FXP_OPENDIR) {
-    *dp = handles[id->id].u.dir;
-    if(pathp)
-      *pathp = handles[id->id].path;
+  if((h = handle_find(id)) && h->type == SSH_FXP_OPENDIR) {
+    h->attrmask = mask;
     rc = 0;
   } else
     rc = SSH_FX_INVALID_HANDLE;
@@ -132,50 +403,544 @@ uint32_t sftp_handle_get_dir(const struct handleid *id, DIR **dp,
   return rc;
 }
 
-uint32_t sftp_handle_close(const struct handleid *id) {
+uint32_t sftp_handle_get_walk(const struct handleid *id, struct walk **wp) {
+  struct handle *h;
   uint32_t rc;
 
-  if(!id->tag)
-    return SSH_FX_INVALID_HANDLE;
   ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
-  if(id->id < nhandles && id->tag == handles[id->id].tag) {
-    handles[id->id].tag = 0; /* free up */
-    switch(handles[id->id].type) {
-    case SSH_FXP_OPEN:
-      if(close(handles[id->id].u.fd) < 0)
-        rc = HANDLER_ERRNO;
-      else
-        rc = 0;
-      break;
-    case SSH_FXP_OPENDIR:
-      if(closedir(handles[id->id].u.dir) < 0)
-        rc = HANDLER_ERRNO;
-      else
-        rc = 0;
-      break;
-    default:
-      rc = SSH_FX_INVALID_HANDLE;
-    }
-    free(handles[id->id].path);
-    handles[id->id].path = NULL;
+  if((h = handle_find(id)) && h->type == HANDLE_WALK) {
+    *wp = h->walk;
+    rc = 0;
   } else
     rc = SSH_FX_INVALID_HANDLE;
   ferrcheck(pthread_mutex_unlock(&sftp_handle_lock));
   return rc;
 }
 
-unsigned sftp_handle_flags(const struct handleid *id) {
-  unsigned rc;
+uint32_t sftp_handle_get_watch(const struct handleid *id, struct watch **wp) {
+  struct handle *h;
+  uint32_t rc;
 
   ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
-  if(id->id < nhandles && id->tag == handles[id->id].tag)
-    rc = handles[id->id].flags;
-  else
+  if((h = handle_find(id)) && h->type == HANDLE_WATCH) {
+    *wp = h->watch;
     rc = 0;
+  } else
+    rc = SSH_FX_INVALID_HANDLE;
+  ferrcheck(pthread_mutex_unlock(&sftp_handle_lock));
+  return rc;
+}
+
+/** @brief Write a block of data in full
+ * @param fd File descriptor
+ * @param data Data to write
+ * @param len Number of bytes
+ * @param offset File offset
+ * @return 0 on success, else an @c errno value
+ */
+static int handle_pwrite(int fd, const char *data, size_t len,
+                         uint64_t offset) {
+  ssize_t n;
+
+  while(len > 0) {
+    /* Short writes aren't allowed so we loop around writing more */
+    if((n = pwrite(fd, data, len, offset)) < 0)
+      return errno;
+    data += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+/** @brief Write a block of data to a file handle
+ * @param h Slot
+ * @param fd File descriptor
+ * @param data Data to write
+ * @param len Number of bytes
+ * @param offset File offset
+ * @return 0 on success, else an @c errno value
+ */
+static int handle_output(const struct handle *h, int fd, const char *data,
+                         size_t len, uint64_t offset) {
+  if(h && h->dfd >= 0)
+    return sftp_direct_pwrite(fd, h->dfd, data, len, offset);
+  return handle_pwrite(fd, data, len, offset);
+}
+
+/** @brief Flush a handle's write-behind buffer
+ * @param h Slot
+ * @return Deferred or new @c errno value, or 0
+ *
+ * Must be called with @c h->wlock held.  Any deferred error is consumed.
+ */
+static int handle_wflush(struct handle *h) {
+  int error = h->werror;
+
+  h->werror = 0;
+  if(h->wused) {
+    int rc;
+
+    /* The file's size and times are about to change */
+    sftp_statcache_invalidate();
+    rc = handle_output(h, h->fd, h->wbuf + h->wskew, h->wused, h->wstart);
+    h->wused = 0;
+    if(!error)
+      error = rc;
+  }
+  return error;
+}
+
+/** @brief Find the slot for a valid file handle
+ * @param id Handle
+ * @return Slot, or a null pointer
+ */
+static struct handle *handle_file(const struct handleid *id) {
+  struct handle *h;
+
+  if(!(h = handle_find(id)) || h->type != SSH_FXP_OPEN)
+    return NULL;
+  return h;
+}
+
+/** @brief Note which file a handle refers to
+ * @param h Slot
+ *
+ * Must be called with @c h->wlock held.
+ */
+static void handle_identify(struct handle *h) {
+  struct stat sb;
+
+  if(!h->wknown && fstat(h->fd, &sb) == 0) {
+    h->wdev = sb.st_dev;
+    h->wino = sb.st_ino;
+    h->wknown = 1;
+  }
+}
+
+/** @brief Flush one slot's write-behind buffer, deferring any error
+ * @param h Slot
+ *
+ * Must be called with @c h->wlock held.
+ */
+static void handle_wflush_deferred(struct handle *h) {
+  int error;
+
+  if(h->wused && (error = handle_wflush(h)))
+    /* Report it on the next write or close */
+    h->werror = error;
+}
+
+struct lineindex **sftp_handle_lines(const struct handleid *id) {
+  struct handle *h = handle_file(id);
+
+  return h ? &h->lines : NULL;
+}
+
+struct mapwindow **sftp_handle_map(const struct handleid *id) {
+  struct handle *h = handle_file(id);
+
+  return h ? &h->map : NULL;
+}
+
+void sftp_handle_set_direct(const struct handleid *id, int dfd) {
+  struct handle *h;
+
+  ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
+  if((h = handle_file(id))) {
+    h->dfd = dfd;
+    h->flags |= HANDLE_DIRECT;
+    dfd = -1;
+  }
+  ferrcheck(pthread_mutex_unlock(&sftp_handle_lock));
+  if(dfd >= 0)
+    close(dfd);
+}
+
+int sftp_handle_get_direct(const struct handleid *id) {
+  struct handle *h = handle_file(id);
+
+  return h ? h->dfd : -1;
+}
+
+uint32_t sftp_handle_set_compress(const struct handleid *id,
+                                  const struct sftpcompressor *c) {
+  struct handle *h;
+  uint32_t rc = SSH_FX_OK;
+
+  ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
+  if(!(h = handle_file(id)))
+    rc = SSH_FX_INVALID_HANDLE;
+  else if(h->flags & (HANDLE_TEXT | HANDLE_APPEND))
+    rc = SSH_FX_OP_UNSUPPORTED;
+  else {
+    h->compress = c;
+    if(c)
+      h->flags |= HANDLE_COMPRESS;
+    else
+      h->flags &= ~HANDLE_COMPRESS;
+  }
+  ferrcheck(pthread_mutex_unlock(&sftp_handle_lock));
+  return rc;
+}
+
+const struct sftpcompressor *sftp_handle_get_compress(
+    const struct handleid *id) {
+  struct handle *h = handle_file(id);
+
+  return h ? h->compress : NULL;
+}
+
+/** @brief Allocate an aligned write-behind buffer
+ * @param size Size of buffer
+ * @return Buffer, to be released with free()
+ */
+static char *handle_aligned(size_t size) {
+  void *ptr;
+  int rc;
+
+  if((rc = posix_memalign(&ptr, DIRECTALIGN, size)))
+    sftp_fatal("posix_memalign: %s", strerror(rc));
+  return ptr;
+}
+
+uint32_t sftp_handle_write(const struct handleid *id, int fd, uint64_t offset,
+                           const void *data, size_t len) {
+  const size_t size = sftpconf_write_behind;
+  struct handle *h = handle_file(id);
+  int error;
+
+  if(!size || !h) {
+    if((error = handle_output(h, fd, data, len, offset))) {
+      errno = error;
+      return HANDLER_ERRNO;
+    }
+    return 0;
+  }
+  ferrcheck(pthread_mutex_lock(&h->wlock));
+  if(!h->werror && h->wused && offset == h->wstart + h->wused
+     && h->wused + len <= size) {
+    /* Contiguous with the buffered data and there's room */
+    memcpy(h->wbuf + h->wskew + h->wused, data, len);
+    h->wused += len;
+    error = 0;
+  } else if(!(error = handle_wflush(h))) {
+    if(len < size) {
+      /* Start a new buffer.  For direct IO the data is placed so that
+       * aligned file offsets fall at aligned addresses. */
+      if(!h->wbuf) {
+        h->wbuf = h->dfd >= 0 ? handle_aligned(size + DIRECTALIGN)
+                              : sftp_xmalloc(size);
+        handle_identify(h);
+      }
+      h->wskew = h->dfd >= 0 ? offset % DIRECTALIGN : 0;
+      memcpy(h->wbuf + h->wskew, data, len);
+      h->wstart = offset;
+      h->wused = len;
+    } else
+      error = handle_output(h, fd, data, len, offset);
+  }
+  ferrcheck(pthread_mutex_unlock(&h->wlock));
+  if(error) {
+    errno = error;
+    return HANDLER_ERRNO;
+  }
+  return 0;
+}
+
+void sftp_handle_flush(const struct handleid *id) {
+  struct handle *h, *o;
+  uint32_t n;
+  dev_t dev;
+  ino_t ino;
+  int known;
+
+  if(!sftpconf_write_behind || !(h = handle_file(id)))
+    return;
+  ferrcheck(pthread_mutex_lock(&h->wlock));
+  handle_wflush_deferred(h);
+  handle_identify(h);
+  known = h->wknown;
+  dev = h->wdev;
+  ino = h->wino;
+  ferrcheck(pthread_mutex_unlock(&h->wlock));
+  if(!known)
+    return;
+  /* Other handles on the same file, in this session or another, may hold
+   * data that a read through this one should see */
+  ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
+  for(n = 0; n < nslots; ++n) {
+    o = handle_slot(n);
+    if(o == h || !o->tag || o->type != SSH_FXP_OPEN)
+      continue;
+    ferrcheck(pthread_mutex_lock(&o->wlock));
+    if(o->wused && o->wknown && o->wdev == dev && o->wino == ino)
+      handle_wflush_deferred(o);
+    ferrcheck(pthread_mutex_unlock(&o->wlock));
+  }
+  ferrcheck(pthread_mutex_unlock(&sftp_handle_lock));
+}
+
+void sftp_handle_flush_all(void) {
+  struct handle *h;
+  uint32_t n;
+
+  if(!sftpconf_write_behind)
+    return;
+  /* Every session's buffers, since another session's request may be looking
+   * at the same files */
+  ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
+  for(n = 0; n < nslots; ++n) {
+    h = handle_slot(n);
+    if(!h->tag || h->type != SSH_FXP_OPEN)
+      continue;
+    ferrcheck(pthread_mutex_lock(&h->wlock));
+    handle_wflush_deferred(h);
+    ferrcheck(pthread_mutex_unlock(&h->wlock));
+  }
   ferrcheck(pthread_mutex_unlock(&sftp_handle_lock));
+}
+
+/** @brief Release preallocated space that was never written
+ * @param h Slot
+ *
+ * Must be called with @c h->wlock held.
+ */
+static void handle_trim(struct handle *h) {
+#if HAVE_FALLOCATE && defined FALLOC_FL_KEEP_SIZE
+  struct stat sb;
+  struct timespec times[2];
+
+  if(!h->ptrim || fstat(h->fd, &sb) < 0 || (uint64_t)sb.st_size >= h->prealloc)
+    return;
+  /* Truncating to the current size discards blocks past the end of the file
+   * but also touches the modification time, which the client may already
+   * have set, so put it back. */
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1] = sb.st_mtim;
+  if(ftruncate(h->fd, sb.st_size) == 0)
+    futimens(h->fd, times);
+#else
+  (void)h;
+#endif
+}
+
+uint32_t sftp_handle_release(const struct handleid *id, int *fdp,
+                             DIR **dirp) {
+  struct handle *h;
+  unsigned type;
+  int werror = 0;
+
+  *fdp = -1;
+  *dirp = NULL;
+  ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
+  if(!(h = handle_find(id))) {
+    ferrcheck(pthread_mutex_unlock(&sftp_handle_lock));
+    return SSH_FX_INVALID_HANDLE;
+  }
+  h->tag = 0; /* nobody else can find it now */
+  ferrcheck(pthread_mutex_unlock(&sftp_handle_lock));
+  /* Flushing and trimming may be slow, so they are done without the lock.
+   * The slot cannot be reused until it is back on the free list. */
+  type = h->type;
+  switch(type) {
+  case SSH_FXP_OPEN:
+    ferrcheck(pthread_mutex_lock(&h->wlock));
+    werror = handle_wflush(h);
+    handle_trim(h);
+    free(h->wbuf);
+    h->wbuf = NULL;
+    ferrcheck(pthread_mutex_unlock(&h->wlock));
+    *fdp = h->fd;
+    h->fd = -1;
+    sftp_lineindex_free(h->lines);
+    h->lines = NULL;
+    sftp_mapread_release(&h->map);
+    if(h->dfd >= 0) {
+      close(h->dfd);
+      h->dfd = -1;
+    }
+    break;
+  case SSH_FXP_OPENDIR:
+    /* A prefetch may still be using the stream */
+    sftp_dirfetch_free(h->fetch);
+    h->fetch = NULL;
+    *dirp = h->dir;
+    h->dir = NULL;
+    break;
+  case HANDLE_WALK:
+    sftp_walk_free(h->walk);
+    h->walk = NULL;
+    break;
+  case HANDLE_WATCH:
+    sftp_watch_free(h->watch);
+    h->watch = NULL;
+    break;
+  }
+  free(h->path);
+  h->path = NULL;
+  ferrcheck(pthread_mutex_lock(&sftp_handle_lock));
+  h->nextfree = freelist;
+  freelist = id->id;
+  ferrcheck(pthread_mutex_unlock(&sftp_handle_lock));
+  if(type != SSH_FXP_OPEN && type != SSH_FXP_OPENDIR && type != HANDLE_WALK
+     && type != HANDLE_WATCH)
+    return SSH_FX_INVALID_HANDLE;
+  if(werror) {
+    /* Report the first error */
+    errno = werror;
+    return HANDLER_ERRNO;
+  }
+  return 0;
+}
+
+uint32_t sftp_handle_close(const struct handleid *id) {
+  int fd, save_errno;
+  DIR *dir;
+  uint32_t rc;
+
+  rc = sftp_handle_release(id, &fd, &dir);
+  save_errno = errno;
+  if(fd >= 0 && close(fd) < 0 && !rc)
+    return HANDLER_ERRNO;
+  if(dir && closedir(dir) < 0 && !rc)
+    return HANDLER_ERRNO;
+  errno = save_errno;
   return rc;
 }
 
+void sftp_handle_close_all(void) {
+  struct handle *h;
+  struct handleid id;
+  uint32_t n;
+
+  for(n = 0; (h = handle_slot(n)); ++n) {
+    if(!h->tag || h->owner != sftp_session)
+      continue;
+    id.id = n;
+    id.tag = h->tag;
+    sftp_handle_close(&id);
+  }
+}
+
+void sftp_handle_note_read(const struct handleid *id, int fd, uint64_t offset,
+                           size_t len) {
+#if HAVE_POSIX_FADVISE
+  struct handle *h;
+  uint64_t start = 0, end = 0;
+
+  if(!sftpconf_read_ahead || !(h = handle_find(id)))
+    return;
+  ferrcheck(pthread_mutex_lock(&h->wlock));
+  if(offset == h->next) {
+    if(h->run < READAHEADRUN)
+      if(++h->run == READAHEADRUN)
+        /* Looks like a sequential transfer; encourage the kernel to read
+         * further ahead than usual */
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  } else {
+    if(h->run >= READAHEADRUN)
+      /* The client has seeked; stop reading ahead */
+      posix_fadvise(fd, 0, 0, POSIX_FADV_NORMAL);
+    h->run = 0;
+    h->ahead = 0;
+  }
+  h->next = offset + len;
+  /* Keep a window of data ahead of the client, topping it up when half of
+   * it has been consumed */
+  if(h->run >= READAHEADRUN
+     && h->ahead < h->next + (uint64_t)sftpconf_read_ahead / 2) {
+    start = h->ahead > h->next ? h->ahead : h->next;
+    end = h->next + sftpconf_read_ahead;
+    h->ahead = end;
+  }
+  ferrcheck(pthread_mutex_unlock(&h->wlock));
+  /* Starting the read can take a while, so it's done without the lock */
+  if(end > start)
+    posix_fadvise(fd, start, end - start, POSIX_FADV_WILLNEED);
+#else
+  (void)id;
+  (void)fd;
+  (void)offset;
+  (void)len;
+#endif
+}
+
+void sftp_handle_preallocate(const struct handleid *id, int fd,
+                             uint64_t allocation, uint64_t planned) {
+#if HAVE_FALLOCATE && defined FALLOC_FL_KEEP_SIZE
+  struct handle *h;
+
+  if(!(h = handle_file(id)))
+    return;
+  ferrcheck(pthread_mutex_lock(&h->wlock));
+  if(allocation) {
+    /* The client knows what it wants, so leave it at that */
+    if(fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, allocation) < 0)
+      D(("fallocate %" PRIu64 ": %s", allocation, strerror(errno)));
+    h->pstop = 1;
+  } else if(planned && sftpconf_preallocate) {
+    if(fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, planned) == 0) {
+      h->prealloc = planned;
+      h->ptrim = 1;
+    } else
+      h->pstop = 1;
+  }
+  ferrcheck(pthread_mutex_unlock(&h->wlock));
+#else
+  (void)id;
+  (void)fd;
+  (void)allocation;
+  (void)planned;
+#endif
+}
+
+void sftp_handle_note_write(const struct handleid *id, int fd,
+                            uint64_t offset, size_t len) {
+#if HAVE_FALLOCATE && defined FALLOC_FL_KEEP_SIZE
+  const uint64_t window = sftpconf_preallocate;
+  const uint64_t end = offset + len;
+  struct handle *h;
+  uint64_t start;
+
+  if(!window || !(h = handle_file(id)))
+    return;
+  ferrcheck(pthread_mutex_lock(&h->wlock));
+  /* Keep a window of space allocated past the furthest write, topping it up
+   * when half of it has been used.  A write well past the preallocated space
+   * is not part of a sequential upload, so leave the hole alone. */
+  if(!h->pstop && end + window / 2 > h->prealloc
+     && offset <= h->prealloc + window) {
+    start = h->prealloc > offset ? h->prealloc : offset;
+    if(fallocate(fd, FALLOC_FL_KEEP_SIZE, start, end + window - start) == 0) {
+      h->prealloc = end + window;
+      h->ptrim = 1;
+    } else {
+      /* Probably not supported by the filesystem, or it is full; either way
+       * don't try again */
+      D(("fallocate: %s", strerror(errno)));
+      h->pstop = 1;
+    }
+  }
+  ferrcheck(pthread_mutex_unlock(&h->wlock));
+#else
+  (void)id;
+  (void)fd;
+  (void)offset;
+  (void)len;
+#endif
+}
+
+unsigned sftp_handle_flags(const struct handleid *id) {
+  unsigned type, flags;
+  int fd;
+
+  if(handle_peek(id, &type, &fd, &flags))
+    return 0;
+  return flags;
+}
+
 /*
 Local Variables:
 c-basic-offset:2
@@ -29,7 +29,7 @@
 struct handleid {
   /** @brief Handle ID
    *
-   * This is an index into the @ref handles array.  At any given moment no two
+   * This is an index into the handle table.  At any given moment no two
    * valid handles have the same ID, but handles that do not overlap in
    * lifetime will often have matching IDs.
    */
@@ -51,9 +51,13 @@ struct handleid {
  * Valid handle flags are:
  * - @ref HANDLE_TEXT
  * - @ref HANDLE_APPEND
+ *
+ * Returns 0 on success.  If @ref sftpconf_max_handles handles are already open
+ * then returns @ref HANDLER_ERRNO with @c errno set to @c EMFILE; the caller
+ * remains responsible for @p fd.
  */
-void sftp_handle_new_file(struct handleid *id, int fd, const char *path,
-                          unsigned flags);
+uint32_t sftp_handle_new_file(struct handleid *id, int fd, const char *path,
+                              unsigned flags);
 
 /** @brief Handle flag for text files
  *
@@ -67,12 +71,79 @@ void sftp_handle_new_file(struct handleid *id, int fd, const char *path,
  */
 #  define HANDLE_APPEND 0x0002
 
+/** @brief Handle flag for files with a direct IO descriptor
+ *
+ * Set by sftp_handle_set_direct(), never by the creator of the handle.
+ */
+#  define HANDLE_DIRECT 0x0004
+
+/** @brief Handle flag for files with compressed payloads
+ *
+ * Set by sftp_handle_set_compress(), never by the creator of the handle.
+ */
+#  define HANDLE_COMPRESS 0x0008
+
 /** @brief Create a new directory handle
  * @param id Where to store new handle
  * @param dp Directory stream to attach to handle
  * @param path Path name to attach to handle (will be copied)
+ * @return 0 on success or @ref HANDLER_ERRNO
+ *
+ * See sftp_handle_new_file() for error handling.
+ */
+uint32_t sftp_handle_new_dir(struct handleid *id, DIR *dp, const char *path);
+
+/** @brief Handle type for directory walks
+ *
+ * Unlike the other handle types this is not an SFTP message type.
+ */
+#  define HANDLE_WALK 0x10000
+
+/** @brief Handle type for change notification
+ *
+ * See @ref WATCH.
+ */
+#  define HANDLE_WATCH 0x20000
+
+struct walk;
+struct dirfetch;
+struct watch;
+
+/** @brief Create a new directory walk handle
+ * @param id Where to store new handle
+ * @param w Walk to attach to handle, destroyed by sftp_handle_release()
+ * @param path Path name to attach to handle (will be copied)
+ * @return 0 on success or @ref HANDLER_ERRNO
+ *
+ * See sftp_handle_new_file() for error handling.
+ */
+uint32_t sftp_handle_new_walk(struct handleid *id, struct walk *w,
+                              const char *path);
+
+/** @brief Retrieve the directory walk attached to handle @p id
+ * @param id Handle
+ * @param wp Where to store walk
+ * @return 0 on success, @ref SSH_FX_INVALID_HANDLE on error
  */
-void sftp_handle_new_dir(struct handleid *id, DIR *dp, const char *path);
+uint32_t sftp_handle_get_walk(const struct handleid *id, struct walk **wp);
+
+/** @brief Create a new change notification handle
+ * @param id Where to store new handle
+ * @param w Watch to attach to handle, destroyed by sftp_handle_release()
+ * @param path Path name to attach to handle (will be copied)
+ * @return 0 on success or @ref HANDLER_ERRNO
+ *
+ * See sftp_handle_new_file() for error handling.
+ */
+uint32_t sftp_handle_new_watch(struct handleid *id, struct watch *w,
+                               const char *path);
+
+/** @brief Retrieve the watch attached to handle @p id
+ * @param id Handle
+ * @param wp Where to store watch
+ * @return 0 on success, @ref SSH_FX_INVALID_HANDLE on error
+ */
+uint32_t sftp_handle_get_watch(const struct handleid *id, struct watch **wp);
 
 /** @brief Retrieve the flags for handle @p id
  * @param id Handle
@@ -91,27 +162,194 @@ unsigned sftp_handle_flags(const struct handleid *id);
 uint32_t sftp_handle_get_fd(const struct handleid *id, int *fd,
                             unsigned *flagsp);
 
-/** @brief Retrieve the directory stream attached to handle @p id
+/** @brief Retrieve the directory attached to handle @p id
  * @param id Handle
- * @param dp Where to store directory stream
- * @param pathp Where to store path, or a null pointer
+ * @param fp Where to store the directory's prefetch state
+ * @param maskp Where to store the attribute mask, or a null pointer
  * @return 0 on success, @ref SSH_FX_INVALID_HANDLE on error
  *
- * If @p pathp is not a null pointer then the value assigned to @c *pathp
- * points to the handle's copy of the path name.  It will not outlive the
- * handle.
+ * The prefetch state holds the directory stream and will not outlive the
+ * handle.  See dirfetch.h.
  */
-uint32_t sftp_handle_get_dir(const struct handleid *id, DIR **dp,
-                             const char **pathp);
+uint32_t sftp_handle_get_dir(const struct handleid *id, struct dirfetch **fp,
+                             uint32_t *maskp);
+
+/** @brief Set the attributes to be sent when reading a directory handle
+ * @param id Handle
+ * @param mask Attributes to send
+ * @return 0 on success, @ref SSH_FX_INVALID_HANDLE on error
+ *
+ * New directory handles send every attribute.
+ */
+uint32_t sftp_handle_set_attrmask(const struct handleid *id, uint32_t mask);
+
+struct lineindex;
+
+/** @brief Find the line index for a file handle
+ * @param id Handle
+ * @return Where the handle's line index pointer lives, or a null pointer if
+ * @p id is not a valid file handle
+ *
+ * The index is created by sftp_lineindex_find() and destroyed when the handle
+ * is closed.  Requests that use it are serialized with reads and writes on
+ * the handle, so it needs no locking.
+ */
+struct lineindex **sftp_handle_lines(const struct handleid *id);
+
+struct mapwindow;
+
+/** @brief Find the mapped window for a file handle
+ * @param id Handle
+ * @return Where the handle's window pointer lives, or a null pointer if @p id
+ * is not a valid file handle
+ *
+ * The window is managed by sftp_mapread_get() and released when the handle
+ * is closed.
+ */
+struct mapwindow **sftp_handle_map(const struct handleid *id);
+
+/** @brief Attach a direct IO descriptor to a file handle
+ * @param id Handle
+ * @param dfd Descriptor from sftp_direct_open()
+ *
+ * Sets @ref HANDLE_DIRECT.  Writes through sftp_handle_write() then use
+ * sftp_direct_pwrite() and @p dfd is closed along with the handle.  If
+ * @p id is not a valid file handle then @p dfd is closed immediately.
+ */
+void sftp_handle_set_direct(const struct handleid *id, int dfd);
+
+/** @brief Find the direct IO descriptor for a file handle
+ * @param id Handle
+ * @return Descriptor, or -1 if there is none
+ */
+int sftp_handle_get_direct(const struct handleid *id);
+
+struct sftpcompressor;
+
+/** @brief Set the payload compression for a file handle
+ * @param id Handle
+ * @param c Compression method, or a null pointer for none
+ * @return 0 on success or an error code
+ *
+ * Sets or clears @ref HANDLE_COMPRESS.  Text and append-mode handles cannot
+ * be compressed.
+ */
+uint32_t sftp_handle_set_compress(const struct handleid *id,
+                                  const struct sftpcompressor *c);
+
+/** @brief Find the payload compression for a file handle
+ * @param id Handle
+ * @return Compression method, or a null pointer if there is none
+ */
+const struct sftpcompressor *sftp_handle_get_compress(
+    const struct handleid *id);
+
+/** @brief Record a read from a file handle
+ * @param id Handle
+ * @param fd File descriptor for handle
+ * @param offset Offset of read
+ * @param len Length of read
+ *
+ * When a handle is read sequentially, the kernel is asked to read up to
+ * @ref sftpconf_read_ahead bytes ahead of the client.  A non-sequential read
+ * cancels this.
+ */
+void sftp_handle_note_read(const struct handleid *id, int fd, uint64_t offset,
+                           size_t len);
+
+/** @brief Preallocate space for a newly opened file
+ * @param id Handle
+ * @param fd File descriptor for handle
+ * @param allocation Allocation size requested by the client, or 0
+ * @param planned Planned total size given by the client, or 0
+ *
+ * A nonzero @p allocation is allocated and kept, and stops any further
+ * preallocation.  Otherwise, if @ref sftpconf_preallocate is nonzero, @p
+ * planned bytes are allocated and whatever is not written is released on
+ * close.  The file size is not changed.
+ */
+void sftp_handle_preallocate(const struct handleid *id, int fd,
+                             uint64_t allocation, uint64_t planned);
+
+/** @brief Record a write to a file handle
+ * @param id Handle
+ * @param fd File descriptor for handle
+ * @param offset Offset of write
+ * @param len Length of write
+ *
+ * If @ref sftpconf_preallocate is nonzero then up to that many bytes of space
+ * are kept allocated past the end of sequential writes.  Whatever is not
+ * written is released when the handle is closed.
+ */
+void sftp_handle_note_write(const struct handleid *id, int fd,
+                            uint64_t offset, size_t len);
+
+/** @brief Write to a file handle
+ * @param id Handle
+ * @param fd File descriptor for handle
+ * @param offset Offset to write at
+ * @param data Data to write
+ * @param len Number of bytes to write
+ * @return 0 on success or @ref HANDLER_ERRNO
+ *
+ * If @ref sftpconf_write_behind is nonzero then small writes are collected in
+ * a per-handle buffer and written together when a write is not contiguous
+ * with the buffered data, the buffer fills, or it is flushed explicitly.  An
+ * error from a write that has already been acknowledged is reported by the
+ * next write to, or the close of, the same handle.
+ */
+uint32_t sftp_handle_write(const struct handleid *id, int fd, uint64_t offset,
+                           const void *data, size_t len);
+
+/** @brief Flush write-behind buffers before reading from a file handle
+ * @param id Handle
+ *
+ * Flushes the handle's own buffer and those of any other handles, in any
+ * session, on the same file.  Errors are deferred as described for
+ * sftp_handle_write().
+ */
+void sftp_handle_flush(const struct handleid *id);
+
+/** @brief Flush every write-behind buffer
+ *
+ * This is called before any request other than a read or write, so that
+ * they all see the effects of earlier writes, including those made by other
+ * sessions in the same process.
+ */
+void sftp_handle_flush_all(void);
+
+/** @brief Destroy a handle but keep what it refers to
+ * @param id Handle to release
+ * @param fdp Where to store the file descriptor, or -1 for a directory
+ * @param dirp Where to store the directory stream, or a null pointer for a
+ * file or directory walk
+ * @return 0 on success, SFTP error code or HANDLER_ERRNO on error
+ *
+ * Any buffered writes are flushed first and their error, if any, is
+ * returned.  The caller becomes responsible for closing @p *fdp or @p *dirp,
+ * which are set even if an error is returned.  A directory walk is destroyed
+ * here.  The handle table is not
+ * locked while flushing, so other handles remain usable meanwhile.
+ */
+uint32_t sftp_handle_release(const struct handleid *id, int *fdp,
+                             DIR **dirp);
 
 /** @brief Destroy a handle
  * @param id Handle to close
  * @return 0 on success, SFTP error code or HANDLER_ERRNO on error
  *
- * The attached file descriptor or director stream is closed.
+ * The attached file descriptor or director stream is closed.  Any buffered
+ * writes are flushed first.
  */
 uint32_t sftp_handle_close(const struct handleid *id);
 
+/** @brief Destroy every handle
+ *
+ * Used at the end of a session when the process will go on to serve
+ * another.  Errors are ignored.
+ */
+void sftp_handle_close_all(void);
+
 #endif /* HANDLE_H */
 
 /*
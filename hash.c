@@ -0,0 +1,534 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file hash.c @brief Hash functions
+ *
+ * MD5, SHA-1 and SHA-256 share the same Merkle-Damgård framing, differing
+ * only in their compression functions and byte order, so a single set of
+ * buffering and padding logic serves all three.  CRC-32 is provided as a
+ * cheap non-cryptographic alternative.
+ *
+ * SHA-256 uses the x86 SHA extensions where the CPU has them.
+ */
+
+#include "sftpserver.h"
+#include "hash.h"
+#include "thread.h"
+#include "utils.h"
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_SHANI
+#  include <immintrin.h>
+#  include <cpuid.h>
+#endif
+
+/** @brief Rotate left */
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/** @brief Rotate right */
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/** @brief Load a little-endian 32-bit value */
+static inline uint32_t le32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+/** @brief Load a big-endian 32-bit value */
+static inline uint32_t be32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         (uint32_t)p[3];
+}
+
+/* CRC-32 ------------------------------------------------------------------ */
+
+/** @brief Slice-by-8 CRC tables */
+static uint32_t crc_table[8][256];
+
+/** @brief Fill in @ref crc_table
+ *
+ * Called once, from hash_init().
+ */
+static void crc_init(void) {
+  uint32_t c;
+  int i, j;
+
+  for(i = 0; i < 256; ++i) {
+    c = i;
+    for(j = 0; j < 8; ++j)
+      c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    crc_table[0][i] = c;
+  }
+  for(i = 0; i < 256; ++i)
+    for(j = 1; j < 8; ++j)
+      crc_table[j][i] =
+          (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xFF];
+}
+
+/** @brief CRC-32 update
+ *
+ * The state holds the running CRC, inverted.  Eight bytes are consumed per
+ * iteration using the slice-by-8 tables.
+ */
+static void crc_compress(uint32_t *state, const unsigned char *p, size_t n) {
+  uint32_t crc = state[0], a, b;
+
+  while(n >= 8) {
+    a = crc ^ le32(p);
+    b = le32(p + 4);
+    crc = crc_table[7][a & 0xFF] ^ crc_table[6][(a >> 8) & 0xFF] ^
+          crc_table[5][(a >> 16) & 0xFF] ^ crc_table[4][a >> 24] ^
+          crc_table[3][b & 0xFF] ^ crc_table[2][(b >> 8) & 0xFF] ^
+          crc_table[1][(b >> 16) & 0xFF] ^ crc_table[0][b >> 24];
+    p += 8;
+    n -= 8;
+  }
+  while(n--)
+    crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  state[0] = crc;
+}
+
+/** @brief CRC-32 initial state */
+static const uint32_t crc_iv[] = {0xFFFFFFFF};
+
+/* Rolling checksum -------------------------------------------------------- */
+
+/** @brief Rolling checksum update
+ *
+ * The low 16 bits of the state are the sum of the bytes and the high 16 bits
+ * the sum of the running sums, both modulo 2^16.  See sftp_hash_roll().
+ */
+static void rolling_compress(uint32_t *state, const unsigned char *p,
+                             size_t n) {
+  uint32_t a = state[0] & 0xFFFF, b = state[0] >> 16;
+
+  while(n--) {
+    a += *p++;
+    b += a;
+  }
+  state[0] = (a & 0xFFFF) | (b << 16);
+}
+
+/** @brief Rolling checksum initial state */
+static const uint32_t rolling_iv[] = {0};
+
+const struct sftphash sftp_hash_rolling = {"rolling", 4, 1, 1, rolling_iv,
+                                           rolling_compress};
+
+uint32_t sftp_hash_roll(uint32_t sum, size_t n, unsigned char out,
+                        unsigned char in) {
+  uint32_t a = sum & 0xFFFF, b = sum >> 16;
+
+  a = a - out + in;
+  b = b - (uint32_t)n * out + a;
+  return (a & 0xFFFF) | (b << 16);
+}
+
+/* MD5 --------------------------------------------------------------------- */
+
+/** @brief MD5 per-round additive constants */
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+    0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+    0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+    0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+    0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+    0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+
+/** @brief MD5 per-round shift amounts */
+static const unsigned char md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+
+/** @brief MD5 compression function */
+static void md5_compress(uint32_t *state, const unsigned char *data,
+                         size_t nblocks) {
+  uint32_t w[16], a, b, c, d, f, t;
+  int i, g;
+
+  while(nblocks--) {
+    for(i = 0; i < 16; ++i)
+      w[i] = le32(data + 4 * i);
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    for(i = 0; i < 64; ++i) {
+      if(i < 16) {
+        f = (b & c) | (~b & d);
+        g = i;
+      } else if(i < 32) {
+        f = (d & b) | (~d & c);
+        g = (5 * i + 1) & 15;
+      } else if(i < 48) {
+        f = b ^ c ^ d;
+        g = (3 * i + 5) & 15;
+      } else {
+        f = c ^ (b | ~d);
+        g = (7 * i) & 15;
+      }
+      t = d;
+      d = c;
+      c = b;
+      b += ROL(a + f + md5_k[i] + w[g], md5_r[i]);
+      a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    data += 64;
+  }
+}
+
+/** @brief MD5 initial state */
+static const uint32_t md5_iv[] = {0x67452301, 0xefcdab89, 0x98badcfe,
+                                  0x10325476};
+
+/* SHA-1 ------------------------------------------------------------------- */
+
+/** @brief SHA-1 compression function */
+static void sha1_compress(uint32_t *state, const unsigned char *data,
+                          size_t nblocks) {
+  uint32_t w[80], a, b, c, d, e, f, k, t;
+  int i;
+
+  while(nblocks--) {
+    for(i = 0; i < 16; ++i)
+      w[i] = be32(data + 4 * i);
+    for(; i < 80; ++i)
+      w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    for(i = 0; i < 80; ++i) {
+      if(i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if(i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if(i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      t = ROL(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = ROL(b, 30);
+      b = a;
+      a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    data += 64;
+  }
+}
+
+/** @brief SHA-1 initial state */
+static const uint32_t sha1_iv[] = {0x67452301, 0xEFCDAB89, 0x98BADCFE,
+                                   0x10325476, 0xC3D2E1F0};
+
+/* SHA-256 ----------------------------------------------------------------- */
+
+/** @brief SHA-256 round constants */
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+/** @brief SHA-256 compression function, portable version */
+static void sha256_compress_c(uint32_t *state, const unsigned char *data,
+                              size_t nblocks) {
+  uint32_t w[64], a, b, c, d, e, f, g, h, s0, s1, t1, t2;
+  int i;
+
+  while(nblocks--) {
+    for(i = 0; i < 16; ++i)
+      w[i] = be32(data + 4 * i);
+    for(; i < 64; ++i) {
+      s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    f = state[5];
+    g = state[6];
+    h = state[7];
+    for(i = 0; i < 64; ++i) {
+      s1 = ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25);
+      t1 = h + s1 + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+      s0 = ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22);
+      t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+    data += 64;
+  }
+}
+
+#if HAVE_SHANI
+/** @brief SHA-256 compression function using the x86 SHA extensions
+ *
+ * The state is kept in the ABEF/CDGH arrangement the instructions expect and
+ * the message schedule is computed four words at a time.
+ */
+__attribute__((target("sha,sse4.1"))) static void
+sha256_compress_shani(uint32_t *state, const unsigned char *data,
+                      size_t nblocks) {
+  const __m128i mask =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i state0, state1, tmp, msg, w[4], abef, cdgh;
+  int i;
+
+  tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+  state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);            /* CDAB */
+  state1 = _mm_shuffle_epi32(state1, 0x1B);      /* EFGH */
+  state0 = _mm_alignr_epi8(tmp, state1, 8);      /* ABEF */
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);   /* CDGH */
+  while(nblocks--) {
+    abef = state0;
+    cdgh = state1;
+    for(i = 0; i < 16; ++i) {
+      if(i < 4)
+        w[i] = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i *)(data + 16 * i)), mask);
+      else
+        w[i & 3] = _mm_sha256msg2_epu32(
+            _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]),
+                          _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4)),
+            w[(i + 3) & 3]);
+      msg = _mm_add_epi32(w[i & 3],
+                          _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+    data += 64;
+  }
+  tmp = _mm_shuffle_epi32(state0, 0x1B);         /* FEBA */
+  state1 = _mm_shuffle_epi32(state1, 0xB1);      /* DCHG */
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);   /* DCBA */
+  state1 = _mm_alignr_epi8(state1, tmp, 8);      /* ABEF */
+  _mm_storeu_si128((__m128i *)&state[0], state0);
+  _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+#endif
+
+/** @brief SHA-256 compression function actually in use */
+static void (*sha256_compress_fn)(uint32_t *, const unsigned char *,
+                                  size_t) = sha256_compress_c;
+
+/** @brief SHA-256 compression function */
+static void sha256_compress(uint32_t *state, const unsigned char *data,
+                            size_t nblocks) {
+  sha256_compress_fn(state, data, nblocks);
+}
+
+/** @brief SHA-256 initial state */
+static const uint32_t sha256_iv[] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                     0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                     0x1f83d9ab, 0x5be0cd19};
+
+/* Generic ----------------------------------------------------------------- */
+
+/** @brief Guard for hash_init() */
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+
+/** @brief One-time setup */
+static void hash_init(void) {
+#if HAVE_SHANI
+  unsigned a, b, c, d;
+
+  /* SHA is CPUID.7.0:EBX[29]; SSE4.1 is CPUID.1:ECX[19] */
+  if(__get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29)) &&
+     __get_cpuid(1, &a, &b, &c, &d) && (c & (1u << 19)))
+    sha256_compress_fn = sha256_compress_shani;
+#endif
+  crc_init();
+}
+
+/** @brief Table of supported hashes */
+static const struct sftphash hashes[] = {
+    {"md5", 16, 64, 0, md5_iv, md5_compress},
+    {"sha1", 20, 64, 1, sha1_iv, sha1_compress},
+    {"sha256", 32, 64, 1, sha256_iv, sha256_compress},
+    {"crc32", 4, 1, 1, crc_iv, crc_compress},
+};
+
+const struct sftphash *sftp_hash_find(const char *name) {
+  size_t n;
+
+  for(n = 0; n < sizeof hashes / sizeof *hashes; ++n)
+    if(!strcmp(hashes[n].name, name))
+      return &hashes[n];
+  return NULL;
+}
+
+const struct sftphash *sftp_hash_choose(const char *list) {
+  const char *end;
+  size_t n, len;
+
+  while(*list) {
+    end = strchr(list, ',');
+    len = end ? (size_t)(end - list) : strlen(list);
+    for(n = 0; n < sizeof hashes / sizeof *hashes; ++n)
+      if(strlen(hashes[n].name) == len && !strncmp(hashes[n].name, list, len))
+        return &hashes[n];
+    if(!end)
+      break;
+    list = end + 1;
+  }
+  return NULL;
+}
+
+void sftp_hash_init(struct sftphashctx *ctx, const struct sftphash *hash) {
+  ferrcheck(pthread_once(&hash_once, hash_init));
+  ctx->hash = hash;
+  ctx->length = 0;
+  ctx->used = 0;
+  memcpy(ctx->state, hash->iv, (hash->blocksize == 1 ? 1 : hash->size / 4)
+                                   * sizeof(uint32_t));
+}
+
+void sftp_hash_update(struct sftphashctx *ctx, const void *data, size_t n) {
+  const struct sftphash *const h = ctx->hash;
+  const unsigned char *p = data;
+  size_t m;
+
+  ctx->length += n;
+  if(h->blocksize == 1) {
+    h->compress(ctx->state, p, n);
+    return;
+  }
+  /* Complete any partial block */
+  if(ctx->used) {
+    m = 64 - ctx->used < n ? 64 - ctx->used : n;
+    memcpy(ctx->block + ctx->used, p, m);
+    ctx->used += m;
+    p += m;
+    n -= m;
+    if(ctx->used < 64)
+      return;
+    h->compress(ctx->state, ctx->block, 1);
+    ctx->used = 0;
+  }
+  /* Process whole blocks directly from the input */
+  if(n >= 64) {
+    h->compress(ctx->state, p, n / 64);
+    p += n & ~(size_t)63;
+    n &= 63;
+  }
+  memcpy(ctx->block, p, n);
+  ctx->used = n;
+}
+
+void sftp_hash_final(struct sftphashctx *ctx, unsigned char *digest) {
+  const struct sftphash *const h = ctx->hash;
+  uint64_t bits = ctx->length * 8;
+  size_t n;
+  uint32_t w;
+
+  if(h->blocksize == 1) {
+    w = ctx->state[0] ^ h->iv[0];
+    digest[0] = w >> 24;
+    digest[1] = w >> 16;
+    digest[2] = w >> 8;
+    digest[3] = w;
+    return;
+  }
+  ctx->block[ctx->used++] = 0x80;
+  if(ctx->used > 56) {
+    memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+    h->compress(ctx->state, ctx->block, 1);
+    ctx->used = 0;
+  }
+  memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+  for(n = 0; n < 8; ++n)
+    ctx->block[h->bigendian ? 63 - n : 56 + n] = bits >> (8 * n);
+  h->compress(ctx->state, ctx->block, 1);
+  for(n = 0; n < h->size / 4; ++n) {
+    w = ctx->state[n];
+    if(h->bigendian) {
+      digest[4 * n] = w >> 24;
+      digest[4 * n + 1] = w >> 16;
+      digest[4 * n + 2] = w >> 8;
+      digest[4 * n + 3] = w;
+    } else {
+      digest[4 * n] = w;
+      digest[4 * n + 1] = w >> 8;
+      digest[4 * n + 2] = w >> 16;
+      digest[4 * n + 3] = w >> 24;
+    }
+  }
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
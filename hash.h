@@ -0,0 +1,137 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file hash.h @brief Hash function interface */
+
+#ifndef HASH_H
+#  define HASH_H
+
+#  include <stddef.h>
+#  include <stdint.h>
+
+/** @brief Largest digest size of any supported hash */
+#  define HASH_MAXSIZE 32
+
+/** @brief A hash function */
+struct sftphash {
+  /** @brief Name as used by the @c check-file extensions */
+  const char *name;
+
+  /** @brief Size of digest in bytes */
+  size_t size;
+
+  /** @brief Size of input blocks in bytes
+   *
+   * 1 for hashes that need no buffering or padding.  These have a single
+   * word of state, which is XORed with its initial value to form the digest.
+   */
+  size_t blocksize;
+
+  /** @brief Non-0 if lengths and digest words are big-endian */
+  int bigendian;
+
+  /** @brief Initial state */
+  const uint32_t *iv;
+
+  /** @brief Process whole blocks
+   * @param state Hash state
+   * @param data Input
+   * @param nblocks Number of blocks of input
+   */
+  void (*compress)(uint32_t *state, const unsigned char *data,
+                   size_t nblocks);
+};
+
+/** @brief Hash computation in progress */
+struct sftphashctx {
+  /** @brief Hash function */
+  const struct sftphash *hash;
+
+  /** @brief Bytes hashed so far */
+  uint64_t length;
+
+  /** @brief Bytes used in @ref block */
+  size_t used;
+
+  /** @brief Current state */
+  uint32_t state[8];
+
+  /** @brief Partial input block */
+  unsigned char block[64];
+};
+
+/** @brief Rolling checksum for delta transfers
+ *
+ * This is the weak checksum from rsync.  It is not available through
+ * sftp_hash_find().
+ */
+extern const struct sftphash sftp_hash_rolling;
+
+/** @brief Slide the rolling checksum along by one byte
+ * @param sum Checksum of @p n bytes starting with @p out
+ * @param n Window size
+ * @param out Byte leaving the window
+ * @param in Byte entering the window
+ * @return Checksum of the @p n bytes following @p out
+ */
+uint32_t sftp_hash_roll(uint32_t sum, size_t n, unsigned char out,
+                        unsigned char in);
+
+/** @brief Find a hash function by name
+ * @param name Name of hash function
+ * @return Hash function or a null pointer
+ */
+const struct sftphash *sftp_hash_find(const char *name);
+
+/** @brief Pick a hash function from a list
+ * @param list Comma-separated list of names in order of preference
+ * @return First supported hash function in @p list, or a null pointer
+ */
+const struct sftphash *sftp_hash_choose(const char *list);
+
+/** @brief Start a hash computation
+ * @param ctx Context to initialize
+ * @param hash Hash function to use
+ */
+void sftp_hash_init(struct sftphashctx *ctx, const struct sftphash *hash);
+
+/** @brief Add data to a hash computation
+ * @param ctx Context
+ * @param data Data to hash
+ * @param n Number of bytes to hash
+ */
+void sftp_hash_update(struct sftphashctx *ctx, const void *data, size_t n);
+
+/** @brief Finish a hash computation
+ * @param ctx Context
+ * @param digest Where to store the digest (at least @c ctx->hash->size bytes)
+ */
+void sftp_hash_final(struct sftphashctx *ctx, unsigned char *digest);
+
+#endif /* HASH_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
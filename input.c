@@ -0,0 +1,292 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file input.c @brief Buffered request input
+ *
+ * The obvious approach of reading each request with two read() calls, one for
+ * the length and one for the body, costs at least two syscalls per request.
+ * Clients pipeline aggressively so there is usually more than one request
+ * waiting; here we read as much as the kernel will give us in one go and
+ * carve requests out of the buffer.
+ *
+ * Requests are then held in memory until they complete, and a client that
+ * sends faster than the filesystem can keep up would otherwise grow that
+ * without bound.  So each request is charged against a budget of bytes and
+ * requests, and while the budget is used up we stop reading, which lets SSH
+ * flow control push back on the client.
+ *
+ * A session that owns its process blocks in sftp_input_job().  Where one
+ * process serves many sessions, an event loop calls sftp_input_read() when
+ * the descriptor is readable and sftp_input_next() to frame what arrived,
+ * and is woken through a pipe rather than a condition variable.
+ */
+
+#include "sftpserver.h"
+#include "sftpconf.h"
+#include "input.h"
+#include "types.h"
+#include "utils.h"
+#include "debug.h"
+#include "putword.h"
+#include "pool.h"
+#include "thread.h"
+#include "stats.h"
+#include "session.h"
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+void sftp_input_init(struct sftpinput *in, struct session *session, int fd,
+                     size_t size) {
+  sftp_memset(in, 0, sizeof *in);
+  in->fd = fd;
+  in->session = session;
+  in->wakefd = -1;
+  in->size = size;
+  in->buffer = sftp_xmalloc(size);
+  ferrcheck(pthread_mutex_init(&in->lock, 0));
+  ferrcheck(pthread_cond_init(&in->space, 0));
+}
+
+/** @brief Test whether a request would exceed the budget
+ * @param in Reader
+ * @param len Size of request
+ * @return Non-0 if the request must wait
+ *
+ * Must be called with the reader's lock held.  When nothing is in flight any
+ * request is admitted, so that one bigger than the byte budget can't wedge
+ * the session.
+ */
+static int input_over_budget(const struct sftpinput *in, size_t len) {
+  if(!in->requests)
+    return 0;
+  if(sftpconf_max_inflight_requests &&
+     in->requests >= (size_t)sftpconf_max_inflight_requests)
+    return 1;
+  if(sftpconf_max_inflight_bytes &&
+     in->bytes + len > (size_t)sftpconf_max_inflight_bytes)
+    return 1;
+  return 0;
+}
+
+/** @brief Charge a request against the budget
+ * @param in Reader
+ * @param len Size of request
+ * @param wait Non-0 to wait for the budget, 0 to give up
+ * @return 0 on success, -1 if the budget is used up and @p wait is 0
+ */
+static int input_reserve(struct sftpinput *in, size_t len, int wait) {
+  size_t requests, bytes;
+  int stalled;
+
+  ferrcheck(pthread_mutex_lock(&in->lock));
+  if(input_over_budget(in, len)) {
+    if(!in->waiting)
+      ++in->stalls;
+    in->waiting = 1;
+    if(!wait) {
+      ferrcheck(pthread_mutex_unlock(&in->lock));
+      return -1;
+    }
+    do
+      ferrcheck(pthread_cond_wait(&in->space, &in->lock));
+    while(input_over_budget(in, len));
+  }
+  stalled = in->waiting;
+  in->waiting = 0;
+  ++in->requests;
+  in->bytes += len;
+  if(in->requests > in->peak_requests)
+    in->peak_requests = in->requests;
+  if(in->bytes > in->peak_bytes)
+    in->peak_bytes = in->bytes;
+  requests = in->requests;
+  bytes = in->bytes;
+  ferrcheck(pthread_mutex_unlock(&in->lock));
+  sftp_stats_inflight(requests, bytes, stalled);
+  return 0;
+}
+
+void sftp_input_wake(struct sftpinput *in) {
+  static const char byte = 0;
+
+  /* If the pipe is full then the loop has plenty to look at already */
+  if(write(in->wakefd, &byte, 1) < 0 && errno != EAGAIN)
+    sftp_fatal("error writing to wakeup pipe: %s", strerror(errno));
+}
+
+void sftp_input_free(struct sftpjob *job) {
+  struct sftpinput *const in = &job->session->in;
+
+  ferrcheck(pthread_mutex_lock(&in->lock));
+  --in->requests;
+  in->bytes -= job->len;
+  if(in->wakefd < 0) {
+    if(in->waiting)
+      ferrcheck(pthread_cond_signal(&in->space));
+  } else if(in->waiting || (in->draining && !in->requests))
+    sftp_input_wake(in);
+  ferrcheck(pthread_mutex_unlock(&in->lock));
+  sftp_pool_free(job->data);
+  sftp_pool_free(job);
+}
+
+int sftp_input_drain(struct sftpinput *in) {
+  int drained;
+
+  ferrcheck(pthread_mutex_lock(&in->lock));
+  in->draining = 1;
+  drained = !in->requests;
+  ferrcheck(pthread_mutex_unlock(&in->lock));
+  return drained;
+}
+
+/** @brief Ensure that some bytes are buffered
+ * @param in Reader
+ * @param n Number of bytes required (no more than the buffer size)
+ * @return 0 on success, -1 at EOF
+ */
+static int input_fill(struct sftpinput *in, size_t n) {
+  ssize_t bytes;
+
+  while(in->end - in->start < n) {
+    /* Shuffle down if there isn't room for the rest of the data */
+    if(in->start + n > in->size) {
+      memmove(in->buffer, in->buffer + in->start, in->end - in->start);
+      in->end -= in->start;
+      in->start = 0;
+    }
+    bytes = read(in->fd, in->buffer + in->end, in->size - in->end);
+    if(bytes > 0)
+      in->end += bytes;
+    else if(bytes == 0)
+      return -1; /* eof */
+    else
+      sftp_fatal("read error: %s", strerror(errno));
+  }
+  return 0;
+}
+
+struct sftpjob *sftp_input_job(struct sftpinput *in) {
+  struct sftpjob *job;
+  size_t have;
+  uint32_t len;
+
+  if(input_fill(in, 4))
+    return 0;
+  len = get32(in->buffer + in->start);
+  in->start += 4;
+  if(!len || len > (uint32_t)sftpconf_max_request)
+    sftp_fatal("invalid request size");
+  input_reserve(in, len, 1);
+  job = sftp_pool_alloc(sizeof *job);
+  job->session = in->session;
+  job->len = len;
+  job->data = sftp_pool_alloc(len);
+  if(len <= in->size) {
+    if(input_fill(in, len))
+      /* Job data missing or truncated - the other end is not playing the game
+       * fair so we give up straight away */
+      sftp_fatal("read error: unexpected eof");
+    memcpy(job->data, in->buffer + in->start, len);
+    in->start += len;
+  } else {
+    /* Too big for the buffer; take what we have and read the rest
+     * directly. */
+    have = in->end - in->start;
+    memcpy(job->data, in->buffer + in->start, have);
+    in->start = in->end = 0;
+    if(sftp_xread(in->fd, job->data + have, len - have))
+      sftp_fatal("read error: unexpected eof");
+  }
+  if(in->start == in->end)
+    in->start = in->end = 0;
+  return job;
+}
+
+int sftp_input_read(struct sftpinput *in) {
+  ssize_t bytes;
+
+  if(in->start && in->end == in->size) {
+    memmove(in->buffer, in->buffer + in->start, in->end - in->start);
+    in->end -= in->start;
+    in->start = 0;
+  }
+  if(in->end == in->size)
+    return 0; /* must be waiting for the budget */
+  if((bytes = read(in->fd, in->buffer + in->end, in->size - in->end)) <= 0)
+    return -1;
+  in->end += bytes;
+  return 0;
+}
+
+int sftp_input_next(struct sftpinput *in, struct sftpjob **jobp) {
+  struct sftpjob *job;
+  uint32_t len;
+
+  if(in->end - in->start < 4)
+    return 1;
+  len = get32(in->buffer + in->start);
+  if(!len || len > (uint32_t)sftpconf_max_request)
+    return -1;
+  if(in->end - in->start < 4 + (size_t)len) {
+    /* Make sure the whole request will fit */
+    if(4 + (size_t)len > in->size - in->start) {
+      memmove(in->buffer, in->buffer + in->start, in->end - in->start);
+      in->end -= in->start;
+      in->start = 0;
+      if(4 + (size_t)len > in->size)
+        in->buffer = sftp_xrealloc(in->buffer, in->size = 4 + (size_t)len);
+    }
+    return 1;
+  }
+  if(input_reserve(in, len, 0))
+    return 2;
+  job = sftp_pool_alloc(sizeof *job);
+  job->session = in->session;
+  job->len = len;
+  job->data = sftp_pool_alloc(len);
+  memcpy(job->data, in->buffer + in->start + 4, len);
+  in->start += 4 + (size_t)len;
+  if(in->start == in->end)
+    in->start = in->end = 0;
+  *jobp = job;
+  return 0;
+}
+
+void sftp_input_destroy(struct sftpinput *in) {
+  D(("in-flight high water: %zu requests, %zu bytes, %lu stalls",
+     in->peak_requests, in->peak_bytes, in->stalls));
+  free(in->buffer);
+  in->buffer = 0;
+  in->size = in->start = in->end = 0;
+  ferrcheck(pthread_mutex_destroy(&in->lock));
+  ferrcheck(pthread_cond_destroy(&in->space));
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,177 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file input.h @brief Buffered request input interface */
+
+#ifndef INPUT_H
+#  define INPUT_H
+
+#  include <stddef.h>
+#  include <pthread.h>
+
+struct session;
+
+/** @brief Buffered packet reader
+ *
+ * Reads as much as is available from the input file descriptor in each
+ * syscall, and frames as many packets as possible out of each read.
+ *
+ * Each reader has its own in-flight budget.
+ */
+struct sftpinput {
+  /** @brief File descriptor to read from */
+  int fd;
+
+  /** @brief Session that requests belong to */
+  struct session *session;
+
+  /** @brief Descriptor to write a byte to when the reader should look again,
+   * or -1
+   *
+   * If this is -1 then the reader blocks in sftp_input_job() until the budget
+   * allows it to continue.  Otherwise it is writable end of a pipe which an
+   * event loop is watching; see sftp_input_next() and sftp_input_drain().
+   */
+  int wakefd;
+
+  /** @brief Lock protecting the in-flight budget */
+  pthread_mutex_t lock;
+
+  /** @brief Signaled when a request is released while the reader waits */
+  pthread_cond_t space;
+
+  /** @brief Requests read but not yet freed */
+  size_t requests;
+
+  /** @brief Bytes of request data read but not yet freed */
+  size_t bytes;
+
+  /** @brief Largest value of @ref requests */
+  size_t peak_requests;
+
+  /** @brief Largest value of @ref bytes */
+  size_t peak_bytes;
+
+  /** @brief Number of times the reader waited for the budget */
+  unsigned long stalls;
+
+  /** @brief Non-0 while the reader is waiting for the budget */
+  int waiting;
+
+  /** @brief Non-0 once the reader is waiting for every request to be freed */
+  int draining;
+
+  /** @brief Input buffer */
+  unsigned char *buffer;
+
+  /** @brief Size of input buffer */
+  size_t size;
+
+  /** @brief Offset of first unconsumed byte in @ref buffer */
+  size_t start;
+
+  /** @brief Offset just past last valid byte in @ref buffer */
+  size_t end;
+};
+
+/** @brief Initialize a packet reader
+ * @param in Reader to initialize
+ * @param session Session that requests belong to
+ * @param fd File descriptor to read from
+ * @param size Buffer size
+ */
+void sftp_input_init(struct sftpinput *in, struct session *session, int fd,
+                     size_t size);
+
+/** @brief Read the next request
+ * @param in Reader
+ * @return Newly allocated job, or a null pointer at EOF
+ *
+ * The returned job's @c data and @c len fields are filled in; both the job and
+ * its data are allocated with sftp_pool_alloc(), and must be freed with
+ * sftp_input_free().  Over-long or truncated requests are fatal.
+ *
+ * If the @c max-inflight-bytes or @c max-inflight-requests budget is used
+ * up, waits for other threads to free jobs before reading any further.
+ */
+struct sftpjob *sftp_input_job(struct sftpinput *in);
+
+/** @brief Read whatever input is available
+ * @param in Reader with a @c wakefd
+ * @return 0 on success, -1 at EOF or on error
+ *
+ * Makes a single read() call, so if the descriptor is readable this does not
+ * block.  Call sftp_input_next() afterwards to frame requests.
+ */
+int sftp_input_read(struct sftpinput *in);
+
+/** @brief Frame the next request from buffered input
+ * @param in Reader with a @c wakefd
+ * @param jobp Where to store newly allocated job
+ * @return 0 if a job was framed, 1 if more input is needed, 2 if the budget
+ * is used up, or -1 if the request is invalid
+ *
+ * Never reads or blocks.  When it returns 2 a byte will be written to @c
+ * wakefd once a request is freed, and the caller should try again then
+ * before reading any further.
+ */
+int sftp_input_next(struct sftpinput *in, struct sftpjob **jobp);
+
+/** @brief Tell an event loop to look at a reader's session again
+ * @param in Reader with a @c wakefd
+ *
+ * May be called from any thread.
+ */
+void sftp_input_wake(struct sftpinput *in);
+
+/** @brief Wait for every request to be freed
+ * @param in Reader with a @c wakefd
+ * @return Non-0 if every request has been freed
+ *
+ * If requests are outstanding, a byte will be written to @c wakefd once the
+ * last is freed.
+ */
+int sftp_input_drain(struct sftpinput *in);
+
+/** @brief Free a job
+ * @param job Job from sftp_input_job()
+ *
+ * The job's share of its reader's in-flight budget is returned, waking the
+ * reader if it is waiting.  May be called from any thread.
+ */
+void sftp_input_free(struct sftpjob *job);
+
+/** @brief Destroy a packet reader
+ * @param in Reader to destroy
+ *
+ * The file descriptor is not closed.
+ */
+void sftp_input_destroy(struct sftpinput *in);
+
+#endif /* INPUT_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,275 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file lineindex.c @brief Text file line index
+ *
+ * The @c text-seek extension asks for the file position of a given line.
+ * Rather than read the file from the start every time, each text handle
+ * remembers how many newlines precede each @ref LINESPAN block of the file.
+ * Finding a line is then a binary search for the block that contains the
+ * newline ending the line before it, and a scan of that one block.
+ *
+ * Whole blocks are counted eight bytes at a time; memchr() is only used to
+ * find the exact newline within the final block.
+ */
+
+#include "sftpserver.h"
+#include "utils.h"
+#include "lineindex.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct lineindex {
+  /** @brief Newlines before each block
+   *
+   * @c counts[k] is the number of newlines before offset @c k*LINESPAN.
+   * The first entry is always 0. */
+  uint64_t *counts;
+
+  /** @brief Number of entries in @ref counts */
+  size_t nblocks;
+
+  /** @brief Space in @ref counts */
+  size_t nslots;
+
+  /** @brief Bytes counted after the last block boundary */
+  size_t pending;
+
+  /** @brief Newlines in the @ref pending bytes */
+  uint64_t pendlines;
+};
+
+size_t sftp_count_newlines(const void *data, size_t n) {
+  const unsigned char *p = data;
+  const uint64_t low = 0x7F7F7F7F7F7F7F7FULL;
+  uint64_t x, t;
+  size_t count = 0;
+
+  while(n >= 8) {
+    memcpy(&x, p, 8);
+    /* Bytes equal to '\n' become 0.  Adding 0x7F to the low seven bits sets
+     * the top bit of every nonzero byte without carrying into the next, so
+     * only the zero bytes are left with their top bit clear. */
+    x ^= 0x0A0A0A0A0A0A0A0AULL;
+    t = ((x & low) + low) | x;
+    count += __builtin_popcountll(~t & ~low);
+    p += 8;
+    n -= 8;
+  }
+  while(n--)
+    count += *p++ == '\n';
+  return count;
+}
+
+/** @brief Empty an index
+ * @param li Index
+ */
+static void lineindex_reset(struct lineindex *li) {
+  li->nblocks = 1;
+  li->counts[0] = 0;
+  li->pending = 0;
+  li->pendlines = 0;
+}
+
+/** @brief Record the end of another block
+ * @param li Index
+ * @param count Newlines before the next block
+ */
+static void lineindex_append(struct lineindex *li, uint64_t count) {
+  if(li->nblocks == li->nslots) {
+    li->nslots *= 2;
+    li->counts = sftp_xrealloc(li->counts, li->nslots * sizeof *li->counts);
+  }
+  li->counts[li->nblocks++] = count;
+}
+
+/** @brief Read one block
+ * @param fd File to read
+ * @param buffer Buffer of @ref LINESPAN bytes
+ * @param offset Offset of block
+ * @return Bytes read, which is less than @ref LINESPAN only at end of file,
+ * or -1 on error
+ */
+static ssize_t lineindex_read(int fd, unsigned char *buffer, uint64_t offset) {
+  size_t got = 0;
+  ssize_t n;
+
+  while(got < LINESPAN) {
+    if((n = pread(fd, buffer + got, LINESPAN - got, offset + got)) < 0)
+      return -1;
+    if(n == 0)
+      break;
+    got += n;
+  }
+  return got;
+}
+
+/** @brief Find a newline in a buffer
+ * @param buffer Buffer
+ * @param n Size of buffer
+ * @param want Which newline to find, counting from 1
+ * @return Offset just after the newline, or @c (size_t)-1 if there are
+ * fewer than @p want newlines
+ */
+static size_t lineindex_locate(const unsigned char *buffer, size_t n,
+                               uint64_t want) {
+  const unsigned char *p = buffer, *nl;
+
+  while((nl = memchr(p, '\n', n - (p - buffer)))) {
+    p = nl + 1;
+    if(!--want)
+      return p - buffer;
+  }
+  return (size_t)-1;
+}
+
+int sftp_lineindex_find(struct lineindex **lip, int fd, uint64_t line,
+                        uint64_t *offsetp) {
+  struct lineindex *li = *lip;
+  unsigned char *buffer;
+  struct stat sb;
+  uint64_t end, seen, c;
+  size_t lo, hi, mid, pos;
+  ssize_t n;
+  int rc;
+
+  if(!line) {
+    *offsetp = 0;
+    return 0;
+  }
+  if(!li) {
+    li = *lip = sftp_xmalloc(sizeof *li);
+    li->nslots = 16;
+    li->counts = sftp_xcalloc(li->nslots, sizeof *li->counts);
+    lineindex_reset(li);
+  }
+  if(fstat(fd, &sb) < 0)
+    return -1;
+  end = (uint64_t)(li->nblocks - 1) * LINESPAN;
+  if((uint64_t)sb.st_size < end + li->pending)
+    /* The file has been truncated */
+    lineindex_reset(li);
+  buffer = sftp_xmalloc(LINESPAN);
+  if(line <= li->counts[li->nblocks - 1]) {
+    /* Find the last block with fewer than LINE newlines before it.  The
+     * invariant is counts[lo] < line <= counts[hi]. */
+    lo = 0;
+    hi = li->nblocks - 1;
+    while(hi - lo > 1) {
+      mid = lo + (hi - lo) / 2;
+      if(li->counts[mid] < line)
+        lo = mid;
+      else
+        hi = mid;
+    }
+    if((n = lineindex_read(fd, buffer, (uint64_t)lo * LINESPAN)) < 0) {
+      rc = -1;
+      goto done;
+    }
+    if((pos = lineindex_locate(buffer, n, line - li->counts[lo]))
+       != (size_t)-1) {
+      *offsetp = (uint64_t)lo * LINESPAN + pos;
+      rc = 0;
+      goto done;
+    }
+    /* The file changed under us; start again */
+    lineindex_reset(li);
+  }
+  /* Count forward from the end of the index */
+  li->pending = 0;
+  li->pendlines = 0;
+  end = (uint64_t)(li->nblocks - 1) * LINESPAN;
+  seen = li->counts[li->nblocks - 1];
+  for(;;) {
+    if((n = lineindex_read(fd, buffer, end)) < 0) {
+      rc = -1;
+      break;
+    }
+    c = sftp_count_newlines(buffer, n);
+    if(seen + c >= line) {
+      *offsetp = end + lineindex_locate(buffer, n, line - seen);
+      rc = 0;
+    } else
+      rc = 1;
+    seen += c;
+    if(n < LINESPAN) {
+      li->pending = n;
+      li->pendlines = c;
+      break;
+    }
+    lineindex_append(li, seen);
+    end += LINESPAN;
+    if(rc == 0)
+      break;
+  }
+done:
+  free(buffer);
+  return rc;
+}
+
+void sftp_lineindex_note(struct lineindex *li, uint64_t offset,
+                         const void *data, size_t n) {
+  const unsigned char *p = data;
+  uint64_t end;
+  size_t skip, take;
+
+  if(!li)
+    return;
+  end = (uint64_t)(li->nblocks - 1) * LINESPAN + li->pending;
+  if(offset > end || offset + n <= end)
+    return;
+  skip = end - offset;
+  p += skip;
+  n -= skip;
+  while(n > 0) {
+    take = LINESPAN - li->pending;
+    if(take > n)
+      take = n;
+    li->pendlines += sftp_count_newlines(p, take);
+    li->pending += take;
+    p += take;
+    n -= take;
+    if(li->pending == LINESPAN) {
+      lineindex_append(li, li->counts[li->nblocks - 1] + li->pendlines);
+      li->pending = 0;
+      li->pendlines = 0;
+    }
+  }
+}
+
+void sftp_lineindex_free(struct lineindex *li) {
+  if(li) {
+    free(li->counts);
+    free(li);
+  }
+}
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,82 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file lineindex.h @brief Text file line index interface */
+
+#ifndef LINEINDEX_H
+#  define LINEINDEX_H
+
+#  include <stdint.h>
+#  include <stddef.h>
+
+/** @brief Sparse index of line boundaries in a text file */
+struct lineindex;
+
+/** @brief Find the start of a line
+ * @param lip Index, created on first use
+ * @param fd File to search
+ * @param line Line number, counting from 0
+ * @param offsetp Where to store the offset of the start of @p line
+ * @return 0 on success, -1 on error with @c errno set, or 1 if the file has
+ * fewer than @p line newlines
+ *
+ * Each call reads at most one @ref LINESPAN block of the file that has been
+ * seen before, plus whatever lies between the end of the index and the line
+ * wanted.  The index assumes that the file is only appended to while it is
+ * open; if it shrinks the index is discarded.
+ */
+int sftp_lineindex_find(struct lineindex **lip, int fd, uint64_t line,
+                        uint64_t *offsetp);
+
+/** @brief Add data read from a file to an index
+ * @param li Index, or a null pointer
+ * @param offset Offset @p data was read from
+ * @param data Data read
+ * @param n Number of bytes read
+ *
+ * Lets sequential text reads extend the index for free.  Data that does not
+ * follow on from what the index already covers is ignored.
+ */
+void sftp_lineindex_note(struct lineindex *li, uint64_t offset,
+                         const void *data, size_t n);
+
+/** @brief Destroy an index
+ * @param li Index, or a null pointer
+ */
+void sftp_lineindex_free(struct lineindex *li);
+
+/** @brief Count the newlines in a buffer
+ * @param data Buffer
+ * @param n Size of buffer
+ * @return Number of newline characters in @p data
+ */
+size_t sftp_count_newlines(const void *data, size_t n);
+
+#endif /* LINEINDEX_H */
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
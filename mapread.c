@@ -0,0 +1,191 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file mapread.c @brief Memory-mapped reads
+ *
+ * With @c mmap-read, READ responses for large files take their data
+ * straight from a shared mapping of the file rather than being copied into
+ * the send buffer.  Each handle has a current window of the file; reads
+ * that fall outside it slide it along.  The output code holds a reference
+ * to a window until the data has been written, so a window may outlive its
+ * place on the handle.
+ *
+ * Nothing here touches the mapped pages: the kernel reads them directly when
+ * the response is written.  So if the file is truncated under us the write
+ * fails with @c EFAULT rather than the process taking @c SIGBUS; see
+ * send.c for how that is handled.
+ */
+
+#include "sftpserver.h"
+#include "sftpconf.h"
+#include "mapread.h"
+#include "alloc.h"
+#include "debug.h"
+#include "thread.h"
+#include "utils.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/** @brief A mapped window onto part of a file */
+struct mapwindow {
+  /** @brief Start of mapping */
+  uint8_t *base;
+
+  /** @brief File offset of @ref base */
+  uint64_t start;
+
+  /** @brief Size of mapping */
+  size_t length;
+
+  /** @brief Number of references */
+  int refs;
+};
+
+/** @brief Lock protecting reference counts and handles' window pointers */
+static pthread_mutex_t mapread_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Placeholder window for files that are not to be mapped */
+static struct mapwindow mapread_never;
+
+/** @brief Unmap and free a window
+ * @param m Window with no references left
+ */
+static void mapread_destroy(struct mapwindow *m) {
+  if(munmap(m->base, m->length) < 0)
+    sftp_fatal("error calling munmap: %s", strerror(errno));
+  free(m);
+}
+
+/** @brief Map a new window
+ * @param fd File descriptor to map
+ * @param offset Offset of first byte wanted
+ * @param len Number of bytes wanted
+ * @param size Size of the file
+ * @return New window with no references, or a null pointer
+ */
+static struct mapwindow *mapread_new(int fd, uint64_t offset, size_t len,
+                                     uint64_t size) {
+  struct mapwindow *m;
+  uint64_t start;
+  size_t length;
+  void *base;
+
+  /* MMAPWINDOW is a multiple of the page size, and of the huge page size */
+  start = offset - offset % MMAPWINDOW;
+  length = offset + len - start;
+  if(length < MMAPWINDOW)
+    length = MMAPWINDOW;
+  if(length > size - start)
+    length = size - start;
+  if((base = mmap(0, length, PROT_READ, MAP_SHARED, fd, start)) == MAP_FAILED) {
+    D(("mmap %zu at %" PRIu64 ": %s", length, start, strerror(errno)));
+    return NULL;
+  }
+#if HAVE_MADVISE
+  /* These are only hints, so errors don't matter */
+  madvise(base, length, MADV_SEQUENTIAL);
+#  ifdef MADV_HUGEPAGE
+  if(sftpconf_huge_pages)
+    madvise(base, length, MADV_HUGEPAGE);
+#  endif
+#endif
+  m = sftp_xmalloc(sizeof *m);
+  m->base = base;
+  m->start = start;
+  m->length = length;
+  m->refs = 0;
+  return m;
+}
+
+const uint8_t *sftp_mapread_get(struct mapwindow **slotp, int fd,
+                                uint64_t offset, size_t len, uint64_t size,
+                                struct mapwindow **refp) {
+  struct mapwindow *m, *old;
+  int fl;
+
+  ferrcheck(pthread_mutex_lock(&mapread_lock));
+  m = *slotp;
+  if(m && m != &mapread_never && m->start <= offset &&
+     offset + len <= m->start + m->length) {
+    ++m->refs;
+    ferrcheck(pthread_mutex_unlock(&mapread_lock));
+    *refp = m;
+    return m->base + (offset - m->start);
+  }
+  ferrcheck(pthread_mutex_unlock(&mapread_lock));
+  if(m == &mapread_never)
+    return NULL;
+  /* Files that might be written are left alone.  This is only checked the
+   * first time so it costs nothing on later reads. */
+  if(!m && ((fl = fcntl(fd, F_GETFL)) < 0 || (fl & O_ACCMODE) != O_RDONLY)) {
+    ferrcheck(pthread_mutex_lock(&mapread_lock));
+    if(!*slotp)
+      *slotp = &mapread_never;
+    ferrcheck(pthread_mutex_unlock(&mapread_lock));
+    return NULL;
+  }
+  if(!(m = mapread_new(fd, offset, len, size)))
+    return NULL;
+  /* One reference for the handle and one for the caller */
+  m->refs = 2;
+  ferrcheck(pthread_mutex_lock(&mapread_lock));
+  if((old = *slotp) && --old->refs)
+    old = NULL;
+  *slotp = m;
+  ferrcheck(pthread_mutex_unlock(&mapread_lock));
+  if(old)
+    mapread_destroy(old);
+  *refp = m;
+  return m->base + (offset - m->start);
+}
+
+void sftp_mapread_put(struct mapwindow *m) {
+  int refs;
+
+  ferrcheck(pthread_mutex_lock(&mapread_lock));
+  refs = --m->refs;
+  ferrcheck(pthread_mutex_unlock(&mapread_lock));
+  if(!refs)
+    mapread_destroy(m);
+}
+
+void sftp_mapread_release(struct mapwindow **slotp) {
+  struct mapwindow *m;
+
+  ferrcheck(pthread_mutex_lock(&mapread_lock));
+  m = *slotp;
+  *slotp = NULL;
+  ferrcheck(pthread_mutex_unlock(&mapread_lock));
+  if(m && m != &mapread_never)
+    sftp_mapread_put(m);
+}
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,75 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file mapread.h @brief Memory-mapped read interface */
+
+#ifndef MAPREAD_H
+#  define MAPREAD_H
+
+#  include <stdint.h>
+#  include <stddef.h>
+
+/** @brief A mapped window onto part of a file */
+struct mapwindow;
+
+/** @brief Find file contents in a mapping
+ * @param slotp Where the handle's current window lives
+ * @param fd File descriptor to map
+ * @param offset Offset of first byte wanted
+ * @param len Number of bytes wanted
+ * @param size Size of the file
+ * @param refp Where to store a reference to the window
+ * @return Address of the byte at @p offset, or a null pointer
+ *
+ * If the current window does not cover the range then a new one of at least
+ * @ref MMAPWINDOW bytes, starting at or before @p offset, replaces it.  The
+ * caller must ensure that @p offset + @p len does not exceed @p size, and
+ * pass the reference to sftp_mapread_put() when done with the data.
+ *
+ * A null pointer is returned if the file cannot be mapped, or if @p fd was
+ * not opened read-only, in which case later calls fail at once too.
+ */
+const uint8_t *sftp_mapread_get(struct mapwindow **slotp, int fd,
+                                uint64_t offset, size_t len, uint64_t size,
+                                struct mapwindow **refp);
+
+/** @brief Drop a reference to a window
+ * @param m Window
+ *
+ * The window is unmapped when the last reference goes.
+ */
+void sftp_mapread_put(struct mapwindow *m);
+
+/** @brief Drop a handle's current window
+ * @param slotp Where the handle's current window lives
+ */
+void sftp_mapread_release(struct mapwindow **slotp);
+
+#endif /* MAPREAD_H */
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
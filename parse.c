@@ -78,8 +78,9 @@ uint32_t sftp_parse_string(struct sftpjob *job, char **strp, size_t *lenp) {
   if(lenp)
     *lenp = len;
   if(strp) {
-    str = sftp_alloc(job->a, len + 1); /* 0-fills */
+    str = sftp_alloc_raw(job->a, len + 1);
     sftp_memcpy(str, job->ptr, len);
+    str[len] = 0;
     *strp = str;
   }
   job->ptr += len;
@@ -95,6 +96,53 @@ uint32_t sftp_parse_path(struct sftpjob *job, char **strp) {
   return protocol->decode(job, strp);
 }
 
+uint32_t sftp_parse_view(struct sftpjob *job, const char **strp,
+                         size_t *lenp) {
+  uint32_t len, rc;
+
+  if((rc = sftp_parse_uint32(job, &len)) != SSH_FX_OK)
+    return rc;
+  if(job->left < len)
+    return SSH_FX_BAD_MESSAGE; /* not enough bytes to satisfy */
+  if(strp)
+    *strp = (const char *)job->ptr;
+  if(lenp)
+    *lenp = len;
+  job->ptr += len;
+  job->left -= len;
+  return SSH_FX_OK;
+}
+
+uint32_t sftp_parse_string_borrow(struct sftpjob *job, char **strp,
+                                  size_t *lenp) {
+  const char *view;
+  size_t len;
+  uint32_t rc;
+  char *str;
+
+  if((rc = sftp_parse_view(job, &view, &len)) != SSH_FX_OK)
+    return rc;
+  if(lenp)
+    *lenp = len;
+  if(strp) {
+    /* The length word has been consumed, so slide the string down over it to
+     * make room for a terminator without touching the next field. */
+    str = (char *)view - 4;
+    memmove(str, view, len);
+    str[len] = 0;
+    *strp = str;
+  }
+  return SSH_FX_OK;
+}
+
+uint32_t sftp_parse_path_borrow(struct sftpjob *job, char **strp) {
+  uint32_t rc;
+
+  if((rc = sftp_parse_string_borrow(job, strp, 0)) != SSH_FX_OK)
+    return rc;
+  return protocol->decode(job, strp);
+}
+
 uint32_t sftp_parse_handle(struct sftpjob *job, struct handleid *id) {
   uint32_t len, rc;
 
@@ -57,10 +57,9 @@ uint32_t sftp_parse_uint64(struct sftpjob *job, uint64_t *ur);
  * @param lenp Where to store length
  * @return 0 on success, @ref SSH_FX_BAD_MESSAGE on error
  *
- * The string will be allocated using the job's allocator and will not be
- * 0-terminated.
- *
- * @todo Could we just point into the message?
+ * The string will be allocated using the job's allocator and will be
+ * 0-terminated.  The copy outlives the message, which the client relies on;
+ * the server should use sftp_parse_string_borrow() instead.
  */
 uint32_t sftp_parse_string(struct sftpjob *job, char **strp, size_t *lenp);
 
@@ -75,6 +74,41 @@ uint32_t sftp_parse_string(struct sftpjob *job, char **strp, size_t *lenp);
  */
 uint32_t sftp_parse_path(struct sftpjob *job, char **strp);
 
+/** @brief Retrieve the next string value from a message without copying it
+ * @param job Job containing message
+ * @param strp Where to store a pointer to the string
+ * @param lenp Where to store length
+ * @return 0 on success, @ref SSH_FX_BAD_MESSAGE on error
+ *
+ * The string points into the message and is not 0-terminated.  The message
+ * is not modified.
+ */
+uint32_t sftp_parse_view(struct sftpjob *job, const char **strp,
+                         size_t *lenp);
+
+/** @brief Retrieve the next string value from a message in place
+ * @param job Job containing message
+ * @param strp Where to store string
+ * @param lenp Where to store length
+ * @return 0 on success, @ref SSH_FX_BAD_MESSAGE on error
+ *
+ * The string is moved down over its length word and 0-terminated there, so
+ * it points into the message and is valid for as long as the job is.  Later
+ * fields are not disturbed but the message cannot be parsed a second time.
+ */
+uint32_t sftp_parse_string_borrow(struct sftpjob *job, char **strp,
+                                  size_t *lenp);
+
+/** @brief Retrieve the next path value from a message in place
+ * @param job Job containing message
+ * @param strp Where to store path
+ * @return 0 on success, error code on error
+ *
+ * As sftp_parse_path() but using sftp_parse_string_borrow().  The path only
+ * points into the message if no conversion was needed.
+ */
+uint32_t sftp_parse_path_borrow(struct sftpjob *job, char **strp);
+
 /** @brief Retrieve the next handle value from a message
  * @param job Job containing message
  * @param id Where to store handle
@@ -0,0 +1,163 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file pool.c @brief Recycling memory pool
+ *
+ * Every request passes through several short-lived allocations: the job, its
+ * body, its serialization queue entry and (for the mutex work queue) its
+ * queue entry.  They are allocated by the input thread and released by
+ * whichever worker handles the request.  Rather than hand them back to
+ * malloc() each time, released blocks are kept on a free list for their size
+ * class and reused.
+ *
+ * The free lists are shared between threads, since memory always migrates
+ * from the input thread to the workers; a per-thread cache would simply fill
+ * up in the workers and stay empty in the input thread.
+ */
+
+#include "sftpserver.h"
+#include "pool.h"
+#include "utils.h"
+#include "thread.h"
+#include <stdlib.h>
+#include <string.h>
+
+/** @brief Header preceding every pool allocation
+ *
+ * The union ensures the allocation that follows is suitably aligned. */
+union poolhdr {
+  /** @brief Size class index, or @ref NCLASSES for oversized allocations */
+  size_t cls;
+
+  /** @brief Next free block, when on a free list */
+  union poolhdr *next;
+
+  /** @brief For alignment */
+  long double ld;
+
+  /** @brief For alignment */
+  void *vp;
+
+  /** @brief For alignment */
+  long long ll;
+};
+
+/** @brief One size class */
+struct poolclass {
+  /** @brief Largest allocation in this class */
+  size_t size;
+
+  /** @brief Maximum number of free blocks to keep */
+  size_t max;
+
+  /** @brief Free blocks */
+  union poolhdr *free;
+
+  /** @brief Number of free blocks */
+  size_t nfree;
+
+  /** @brief Lock protecting this class */
+  pthread_mutex_t m;
+
+  /** @brief Statistics */
+  struct poolstats stats;
+};
+
+/** @brief Number of size classes */
+#define NCLASSES 4
+
+/** @brief Size classes
+ *
+ * The classes cover (respectively) fixed-size control structures, typical
+ * metadata requests, 32KiB writes (OpenSSH's default) and the largest
+ * possible request.
+ */
+static struct poolclass classes[NCLASSES + 1] = {
+    {256, 1024, 0, 0, PTHREAD_MUTEX_INITIALIZER, {256, 0, 0, 0}},
+    {4096, 256, 0, 0, PTHREAD_MUTEX_INITIALIZER, {4096, 0, 0, 0}},
+    {36864, 64, 0, 0, PTHREAD_MUTEX_INITIALIZER, {36864, 0, 0, 0}},
+    {MAXREQUEST, 8, 0, 0, PTHREAD_MUTEX_INITIALIZER, {MAXREQUEST, 0, 0, 0}},
+    {0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, {0, 0, 0, 0}},
+};
+
+void *sftp_pool_alloc(size_t n) {
+  size_t cls;
+  struct poolclass *pc;
+  union poolhdr *h;
+
+  for(cls = 0; cls < NCLASSES && n > classes[cls].size; ++cls)
+    ;
+  pc = &classes[cls];
+  ferrcheck(pthread_mutex_lock(&pc->m));
+  if((h = pc->free)) {
+    pc->free = h->next;
+    --pc->nfree;
+    ++pc->stats.hits;
+  } else
+    ++pc->stats.misses;
+  ferrcheck(pthread_mutex_unlock(&pc->m));
+  if(!h) {
+    if(n > SIZE_MAX - sizeof *h)
+      sftp_fatal("sftp_pool_alloc: out of memory (%zu)", n);
+    h = sftp_xmalloc(sizeof *h + (cls < NCLASSES ? pc->size : n));
+  }
+  h->cls = cls;
+  return h + 1;
+}
+
+void sftp_pool_free(void *ptr) {
+  union poolhdr *h;
+  struct poolclass *pc;
+
+  if(!ptr)
+    return;
+  h = (union poolhdr *)ptr - 1;
+  pc = &classes[h->cls];
+  ferrcheck(pthread_mutex_lock(&pc->m));
+  if(pc->nfree < pc->max) {
+    h->next = pc->free;
+    pc->free = h;
+    ++pc->nfree;
+    h = 0;
+  } else if(pc->size)
+    ++pc->stats.overflows;
+  ferrcheck(pthread_mutex_unlock(&pc->m));
+  free(h);
+}
+
+size_t sftp_pool_stats(struct poolstats *stats, size_t max) {
+  size_t n;
+
+  for(n = 0; n <= NCLASSES && n < max; ++n) {
+    ferrcheck(pthread_mutex_lock(&classes[n].m));
+    stats[n] = classes[n].stats;
+    ferrcheck(pthread_mutex_unlock(&classes[n].m));
+  }
+  return NCLASSES + 1;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,77 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file pool.h @brief Recycling memory pool interface */
+
+#ifndef POOL_H
+#  define POOL_H
+
+#  include <stddef.h>
+
+/** @brief Statistics for one pool size class */
+struct poolstats {
+  /** @brief Largest allocation in this class, or 0 for oversized ones */
+  size_t size;
+
+  /** @brief Allocations satisfied from the pool */
+  unsigned long hits;
+
+  /** @brief Allocations that fell back to malloc() */
+  unsigned long misses;
+
+  /** @brief Releases that went back to free() because the pool was full */
+  unsigned long overflows;
+};
+
+/** @brief Allocate memory from the pool
+ * @param n Number of bytes to allocate
+ * @return Pointer to allocated memory
+ *
+ * Unlike sftp_alloc() the memory is not 0-filled, and unlike sftp_xmalloc()
+ * it must be released with sftp_pool_free().  The calling thread need not be
+ * the thread that releases it.  If memory cannot be allocated, the process
+ * is terminated.
+ */
+void *sftp_pool_alloc(size_t n);
+
+/** @brief Release memory back to the pool
+ * @param ptr Pointer from sftp_pool_alloc(), or a null pointer
+ */
+void sftp_pool_free(void *ptr);
+
+/** @brief Retrieve pool statistics
+ * @param stats Where to store statistics
+ * @param max Maximum number of entries to store in @p stats
+ * @return Number of size classes (which may exceed @p max)
+ *
+ * The final class counts allocations too big for any size class.
+ */
+size_t sftp_pool_stats(struct poolstats *stats, size_t max);
+
+#endif /* POOL_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
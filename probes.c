@@ -0,0 +1,79 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file probes.c @brief Static tracepoint support */
+
+#include "sftpserver.h"
+#include "probes.h"
+#include "sftp.h"
+#include "putword.h"
+
+#if USDT
+/** @brief Define the semaphore for a probe
+ * @param name Probe name
+ *
+ * The tracer finds these in the @c .probes section and increments them while
+ * it is attached.
+ */
+#  define SFTP_PROBE_DEFINE(name)                                             \
+    unsigned short SFTP_PROBE_SEMAPHORE(name)                                 \
+        __attribute__((section(".probes")))
+
+SFTP_PROBE_DEFINE(request_framed);
+SFTP_PROBE_DEFINE(request_queued);
+SFTP_PROBE_DEFINE(request_dequeued);
+SFTP_PROBE_DEFINE(serialize_start);
+SFTP_PROBE_DEFINE(serialize_done);
+SFTP_PROBE_DEFINE(handler_start);
+SFTP_PROBE_DEFINE(handler_done);
+SFTP_PROBE_DEFINE(response_sent);
+#endif
+
+void sftp_probe_decode(const void *msg, size_t n, struct probeargs *p) {
+  const unsigned char *m = msg;
+
+  p->id = p->handle = 0;
+  p->type = n ? m[0] : 0;
+  if(n < 5 || p->type == SSH_FXP_INIT || p->type == SSH_FXP_VERSION)
+    return;
+  p->id = get32(m + 1);
+  switch(p->type) {
+  case SSH_FXP_CLOSE:
+  case SSH_FXP_READ:
+  case SSH_FXP_WRITE:
+  case SSH_FXP_FSTAT:
+  case SSH_FXP_FSETSTAT:
+  case SSH_FXP_READDIR:
+  case SSH_FXP_HANDLE:
+    /* Our handles are always 8 bytes, starting with the handle number */
+    if(n >= 13 && get32(m + 5) == 8)
+      p->handle = get32(m + 9);
+    break;
+  }
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,119 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file probes.h @brief Static tracepoints
+ *
+ * With @c --enable-usdt, the server has USDT probes in the @c gesftpserver
+ * provider, which tools such as bpftrace, perf and SystemTap can attach to:
+ * - @c request_framed: a request has been read from the client
+ * - @c request_queued: it has been handed to the work queue
+ * - @c request_dequeued: a worker thread has picked it up
+ * - @c serialize_start and @c serialize_done: it is waiting for earlier
+ *   requests to complete (see serialize.c)
+ * - @c handler_start and @c handler_done: its handler is running
+ * - @c response_sent: a response is complete and about to be written or
+ *   queued for output
+ *
+ * Each probe has four arguments: the request ID, the message type, the
+ * handle number (or 0 if the message has no handle) and the message length.
+ * @c handler_done does not fire for requests completed asynchronously; their
+ * end is marked by @c response_sent.
+ *
+ * Each probe has a semaphore that is only non-0 while something is attached,
+ * so when nothing is attached a probe costs a load and a branch and the
+ * message is never decoded.  Without @c --enable-usdt the probes expand to
+ * nothing.
+ */
+
+#ifndef PROBES_H
+#  define PROBES_H
+
+#  include <stddef.h>
+#  include <stdint.h>
+
+/** @brief Probe arguments decoded from a message */
+struct probeargs {
+  /** @brief Request ID */
+  uint32_t id;
+
+  /** @brief Message type */
+  int type;
+
+  /** @brief Handle number, or 0 */
+  uint32_t handle;
+};
+
+/** @brief Decode probe arguments from a message
+ * @param msg Message, starting with the type byte
+ * @param n Number of bytes available at @p msg
+ * @param p Where to store arguments
+ *
+ * Truncated and malformed messages produce zero values.
+ */
+void sftp_probe_decode(const void *msg, size_t n, struct probeargs *p);
+
+#  if USDT
+#    define _SDT_HAS_SEMAPHORES 1
+#    include <sys/sdt.h>
+
+/** @brief Declare the semaphore for a probe
+ * @param name Probe name
+ *
+ * The semaphores are defined in probes.c.
+ */
+#    define SFTP_PROBE_SEMAPHORE(name)                                        \
+      gesftpserver_##name##_semaphore
+
+/** @brief Fire a probe
+ * @param name Probe name
+ * @param msg Message, starting with the type byte
+ * @param n Number of bytes available at @p msg
+ * @param length Length of the whole message
+ */
+#    define SFTP_PROBE(name, msg, n, length)                                  \
+      do {                                                                    \
+        if(SFTP_PROBE_SEMAPHORE(name)) {                                      \
+          struct probeargs probe_;                                            \
+          sftp_probe_decode((msg), (n), &probe_);                             \
+          STAP_PROBE4(gesftpserver, name, probe_.id, probe_.type,             \
+                      probe_.handle, (size_t)(length));                       \
+        }                                                                     \
+      } while(0)
+
+extern unsigned short SFTP_PROBE_SEMAPHORE(request_framed),
+    SFTP_PROBE_SEMAPHORE(request_queued), SFTP_PROBE_SEMAPHORE(request_dequeued),
+    SFTP_PROBE_SEMAPHORE(serialize_start), SFTP_PROBE_SEMAPHORE(serialize_done),
+    SFTP_PROBE_SEMAPHORE(handler_start), SFTP_PROBE_SEMAPHORE(handler_done),
+    SFTP_PROBE_SEMAPHORE(response_sent);
+
+#  else
+#    define SFTP_PROBE(name, msg, n, length) ((void)0)
+#  endif
+
+#endif /* PROBES_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
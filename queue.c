@@ -18,7 +18,37 @@
  * USA
  */
 
-/** @file queue.h @brief Thread pool/queue implementation */
+/** @file queue.c @brief Thread pool/queue implementation
+ *
+ * The pool starts with the requested number of threads and adapts between a
+ * minimum and maximum.  A supervisor thread watches for jobs that sit in the
+ * queue without any progress being made, for instance because every worker
+ * is blocked on a slow filesystem, and adds a thread each time this lasts
+ * @ref THREADSPAWNDELAY milliseconds.  It sleeps whenever the queue is empty
+ * or a worker is idle.  Workers that have been idle for @ref THREADIDLE
+ * seconds exit, down to the minimum.
+ *
+ * Workers are detached; @ref queue::live counts those that have not yet
+ * finished, so queue_destroy() can wait for them.  Per-thread state is only
+ * created when a worker gets its first job.
+ *
+ * Urgent jobs from queue_add_urgent() go on a separate list served by a
+ * dedicated express worker, started when the first one arrives, so they are
+ * never stuck behind a long run of ordinary jobs.
+ *
+ * A @ref queue_fair queue keeps a separate list for each flow, i.e. each
+ * nonzero key passed to queue_add_keyed(), and takes jobs from the flows
+ * with work in turn.  Jobs without a key divide the queue into segments:
+ * such a job is only taken once every older keyed job has been, and no newer
+ * keyed job is taken before it.  An urgent job ends the current segment too,
+ * without joining it: no keyed job newer than it is taken until every older
+ * keyed job has been.  Callers use this to keep jobs that depend on each
+ * other in order.  A keyed job may wait for an older urgent job, which may
+ * wait for an older keyed job; since the older job is always taken first, a
+ * worker never picks up a job that is waiting for one still in the queue.
+ * Optionally, a flow whose jobs already occupy enough workers is passed over
+ * until one of them finishes.
+ */
 
 #include "sftpserver.h"
 
@@ -27,8 +57,15 @@
 #include "debug.h"
 #include "utils.h"
 #include "thread.h"
+#include "pool.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#if HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#endif
 
 /** @brief One job in a queue */
 struct queuejob {
@@ -37,7 +74,74 @@ struct queuejob {
 
   /** @brief Job */
   void *job;
+
+  /** @brief Flow this job belongs to, or a null pointer (@ref queue_fair) */
+  struct queueflow *flow;
+
+  /** @brief Segment this job belongs to (@ref queue_fair keyed jobs only) */
+  struct queueseg *seg;
+};
+
+/** @brief Jobs that share a key (@ref queue_fair only) */
+struct queueflow {
+  /** @brief Next flow in the same hash bucket */
+  struct queueflow *hnext;
+
+  /** @brief Next flow in the active or parked list */
+  struct queueflow *next;
+
+  /** @brief Key */
+  uint64_t key;
+
+  /** @brief Jobs not yet taken, oldest first */
+  struct queuejob *jobs;
+
+  /** @brief Where to store new tail of @ref jobs */
+  struct queuejob **jobstail;
+
+  /** @brief Number of jobs taken but not finished */
+  int running;
+
+  /** @brief Nonzero if on the active or parked list */
+  int listed;
+};
+
+/** @brief A run of keyed jobs ended by an unkeyed one (@ref queue_fair only) */
+struct queueseg {
+  /** @brief Next newer segment */
+  struct queueseg *next;
+
+  /** @brief Number of keyed jobs in this segment not yet taken */
+  size_t pending;
+
+  /** @brief Unkeyed job ending this segment, or a null pointer
+   *
+   * A null pointer means either that this is the newest segment, or that an
+   * urgent job ended it. */
+  struct queuejob *barrier;
+};
+
+#if HAVE_STDATOMIC_H
+/** @brief Type of flags read without holding the lock */
+typedef atomic_int flag;
+#else
+typedef int flag;
+#endif
+
+#if HAVE_STDATOMIC_H
+/** @brief One slot in a ring queue
+ *
+ * See Dmitry Vyukov's bounded MPMC queue.  @ref seq tells producers and
+ * consumers whose turn it is to use the slot.
+ */
+struct queueslot {
+  /** @brief Sequence number */
+  atomic_size_t seq;
+
+  /** @brief Job */
+  void *job;
 };
+#endif
 
 /** @brief Definition of a queue */
 struct queue {
@@ -56,16 +160,512 @@ struct queue {
   /** @brief Queue-specific callbacks */
   const struct queuedetails *details;
 
-  /** @brief Number of worker threads */
+  /** @brief Number of worker threads, not counting any that are retiring */
   int nthreads;
 
-  /** @brief Table of worker thread IDs */
-  pthread_t *threads;
+  /** @brief Fewest worker threads */
+  int minthreads;
+
+  /** @brief Most worker threads */
+  int maxthreads;
+
+  /** @brief Number of worker threads that have not yet finished */
+  int live;
+
+  /** @brief Signaled when @ref live decreases */
+  pthread_cond_t gone;
+
+  /** @brief Number of jobs taken from the queue (@ref queue_mutex only) */
+  size_t taken;
+
+  /** @brief Number of workers waiting for a job (@ref queue_mutex only) */
+  int idle;
+
+  /** @brief Supervisor thread, if @ref maxthreads exceeds @ref minthreads */
+  pthread_t supervisor;
+
+  /** @brief Nonzero if the supervisor thread exists */
+  int supervised;
+
+  /** @brief Nonzero if the supervisor is waiting for a job to be queued */
+  flag watching;
+
+  /** @brief Condition variable for waking the supervisor */
+  pthread_cond_t stuck;
+
+  /** @brief Head of urgent queue */
+  struct queuejob *urgent;
+
+  /** @brief Where to store new tail of urgent queue */
+  struct queuejob **urgenttail;
+
+  /** @brief Condition variable signaled when an urgent job is added */
+  pthread_cond_t uc;
+
+  /** @brief Express worker thread */
+  pthread_t express;
+
+  /** @brief Nonzero if the express worker exists */
+  int expressing;
 
   /** @brief Set when queue is being destroyed */
   int join;
+
+  /** @brief Queue implementation */
+  enum queue_type type;
+
+  /** @brief Flows by key, @ref QUEUEFLOWS buckets (@ref queue_fair only) */
+  struct queueflow **flows;
+
+  /** @brief Flows with a job that may be taken now, in turn */
+  struct queueflow *active;
+
+  /** @brief Where to store new tail of @ref active */
+  struct queueflow **activetail;
+
+  /** @brief Flows whose next job is in a later segment */
+  struct queueflow *parked;
+
+  /** @brief Oldest segment; jobs are only taken from this one */
+  struct queueseg *segs;
+
+  /** @brief Newest segment, where new jobs go */
+  struct queueseg *newestseg;
+
+  /** @brief Number of jobs not yet taken (@ref queue_fair only) */
+  size_t npending;
+
+  /** @brief Most jobs from one flow to run at once, or 0 for no limit */
+  int flowlimit;
+
+#if HAVE_STDATOMIC_H
+  /** @brief Ring slots (@ref queue_ring only) */
+  struct queueslot *slots;
+
+  /** @brief Number of slots minus 1 */
+  size_t mask;
+
+  /** @brief Next slot to add to */
+  atomic_size_t tail;
+
+  /** @brief Next slot to take from */
+  atomic_size_t head;
+
+  /** @brief Number of workers waiting for a job */
+  atomic_int sleepers;
+
+  /** @brief Nonzero if the producer is waiting for a free slot */
+  atomic_int producer_waiting;
+
+  /** @brief Condition variable signaled when a slot becomes free */
+  pthread_cond_t space;
+#endif
 };
 
+/** @brief Compute a deadline for pthread_cond_timedwait()
+ * @param ts Where to store deadline
+ * @param ms Milliseconds from now
+ */
+static void deadline(struct timespec *ts, long ms) {
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000;
+  if(ts->tv_nsec >= 1000000000) {
+    ts->tv_nsec -= 1000000000;
+    ++ts->tv_sec;
+  }
+}
+
+/** @brief Wait on a condition variable with a deadline
+ * @param c Condition variable
+ * @param m Mutex (held)
+ * @param ts Deadline
+ * @return Nonzero if the deadline passed
+ */
+static int timedwait(pthread_cond_t *c, pthread_mutex_t *m,
+                     const struct timespec *ts) {
+  const int rc = pthread_cond_timedwait(c, m, ts);
+
+  if(rc && rc != ETIMEDOUT)
+    sftp_fatal("pthread_cond_timedwait: %s", strerror(rc));
+  return rc == ETIMEDOUT;
+}
+
+/** @brief Decide whether an idle worker should exit
+ * @param q Queue pointer
+ * @return Nonzero if the worker should exit
+ *
+ * Must be called with @ref queue::m held.  If the answer is yes, the worker
+ * is no longer counted in @ref queue::nthreads.
+ */
+static int retire(struct queue *q) {
+  if(q->nthreads <= q->minthreads)
+    return 0;
+  --q->nthreads;
+  D(("worker retiring, %d left", q->nthreads));
+  return 1;
+}
+
+/** @brief Note that a worker thread has finished
+ * @param q Queue pointer
+ *
+ * The worker must not touch @p q after this.
+ */
+static void finished(struct queue *q) {
+  ferrcheck(pthread_mutex_lock(&q->m));
+  if(!--q->live)
+    ferrcheck(pthread_cond_signal(&q->gone));
+  ferrcheck(pthread_mutex_unlock(&q->m));
+}
+
+#if HAVE_STDATOMIC_H
+/** @brief Try to add a job to a ring queue
+ * @param q Queue pointer
+ * @param job Job to add
+ * @return 0 on success, -1 if the queue is full
+ */
+static int ring_add(struct queue *q, void *job) {
+  struct queueslot *slot;
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed), seq;
+
+  for(;;) {
+    slot = &q->slots[pos & q->mask];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if(seq == pos) {
+      if(atomic_compare_exchange_weak_explicit(
+             &q->tail, &pos, pos + 1, memory_order_relaxed,
+             memory_order_relaxed))
+        break;
+    } else if((ptrdiff_t)(seq - pos) < 0)
+      return -1; /* full */
+    else
+      pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  }
+  slot->job = job;
+  atomic_store(&slot->seq, pos + 1);
+  return 0;
+}
+
+/** @brief Try to take a job from a ring queue
+ * @param q Queue pointer
+ * @param locked Non-0 if the caller holds @c q->m
+ * @return Job, or a null pointer if the queue is empty
+ */
+static void *ring_take(struct queue *q, int locked) {
+  struct queueslot *slot;
+  size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed), seq;
+  void *job;
+
+  for(;;) {
+    slot = &q->slots[pos & q->mask];
+    seq = atomic_load(&slot->seq);
+    if(seq == pos + 1) {
+      if(atomic_compare_exchange_weak_explicit(
+             &q->head, &pos, pos + 1, memory_order_relaxed,
+             memory_order_relaxed))
+        break;
+    } else if((ptrdiff_t)(seq - (pos + 1)) < 0)
+      return 0; /* empty */
+    else
+      pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  }
+  job = slot->job;
+  atomic_store_explicit(&slot->seq, pos + q->mask + 1, memory_order_release);
+  /* Let the producer know there's space, if it cares.  This fence pairs with
+   * the one in queue_add_keyed() after it sets producer_waiting: either we
+   * see the flag or its next ring_add() sees the free slot. */
+  atomic_thread_fence(memory_order_seq_cst);
+  if(atomic_load(&q->producer_waiting)) {
+    if(!locked)
+      ferrcheck(pthread_mutex_lock(&q->m));
+    ferrcheck(pthread_cond_signal(&q->space));
+    if(!locked)
+      ferrcheck(pthread_mutex_unlock(&q->m));
+  }
+  return job;
+}
+
+/** @brief Wait for a job from a ring queue
+ * @param q Queue pointer
+ * @return Job, or a null pointer if the queue is being destroyed and is empty
+ *
+ * The mutex and condition variable are only used when the queue is empty, so
+ * busy workers never touch them.  Producers check @ref queue::sleepers after
+ * adding a job and only signal if someone is waiting.  The pairing is
+ * between the producer's store to the slot's sequence number in ring_add()
+ * and its load of @ref queue::sleepers, and the worker's increment of
+ * @ref queue::sleepers and its load of the sequence number in ring_take().
+ * All four are sequentially consistent, so either the worker sees the new
+ * job or the producer sees the worker.
+ */
+static void *ring_wait(struct queue *q) {
+  struct timespec ts;
+  void *job;
+
+  if((job = ring_take(q, 0)))
+    return job;
+  ferrcheck(pthread_mutex_lock(&q->m));
+  atomic_fetch_add(&q->sleepers, 1);
+  deadline(&ts, THREADIDLE * 1000L);
+  while(!(job = ring_take(q, 1)) && !q->join)
+    if(timedwait(&q->c, &q->m, &ts)) {
+      if(retire(q))
+        break;
+      deadline(&ts, THREADIDLE * 1000L);
+    }
+  atomic_fetch_sub(&q->sleepers, 1);
+  ferrcheck(pthread_mutex_unlock(&q->m));
+  return job;
+}
+
+/** @brief Worker thread for a ring queue
+ * @param vq Queue pointer
+ * @return A null pointer
+ */
+static void *ring_thread(void *vq) {
+  struct queue *const q = vq;
+  struct allocator a;
+  void *workerdata = NULL, *job;
+
+  sftp_alloc_init(&a);
+  while((job = ring_wait(q))) {
+    if(!workerdata)
+      workerdata = q->details->init();
+    q->details->worker(job, workerdata, &a);
+    sftp_alloc_reset(&a);
+  }
+  sftp_alloc_destroy(&a);
+  if(workerdata)
+    q->details->cleanup(workerdata);
+  finished(q);
+  return 0;
+}
+#endif
+
+/** @brief Find or create the flow for a key
+ * @param q Queue pointer
+ * @param key Nonzero key
+ * @return Flow
+ *
+ * Must be called with @ref queue::m held.
+ */
+static struct queueflow *flow_get(struct queue *q, uint64_t key) {
+  struct queueflow **const bucket = &q->flows[key % QUEUEFLOWS], *f;
+
+  for(f = *bucket; f; f = f->hnext)
+    if(f->key == key)
+      return f;
+  f = sftp_pool_alloc(sizeof *f);
+  sftp_memset(f, 0, sizeof *f);
+  f->key = key;
+  f->jobstail = &f->jobs;
+  f->hnext = *bucket;
+  *bucket = f;
+  return f;
+}
+
+/** @brief Discard a flow if nothing refers to it any more
+ * @param q Queue pointer
+ * @param f Flow
+ *
+ * Must be called with @ref queue::m held.
+ */
+static void flow_release(struct queue *q, struct queueflow *f) {
+  struct queueflow **fp;
+
+  if(f->jobs || f->running)
+    return;
+  for(fp = &q->flows[f->key % QUEUEFLOWS]; *fp != f; fp = &(*fp)->hnext)
+    ;
+  *fp = f->hnext;
+  sftp_pool_free(f);
+}
+
+/** @brief Put a flow with untaken jobs on the right list
+ * @param q Queue pointer
+ * @param f Flow, not on any list
+ *
+ * A flow at its limit goes on no list; flow_done() puts it back when one of
+ * its jobs finishes.  Must be called with @ref queue::m held.
+ */
+static void flow_schedule(struct queue *q, struct queueflow *f) {
+  if(q->flowlimit && f->running >= q->flowlimit)
+    return;
+  f->listed = 1;
+  f->next = NULL;
+  if(f->jobs->seg == q->segs) {
+    *q->activetail = f;
+    q->activetail = &f->next;
+  } else {
+    f->next = q->parked;
+    q->parked = f;
+  }
+}
+
+/** @brief End the newest segment of a fair queue
+ * @param q Queue pointer
+ * @param barrier Unkeyed job ending it, or a null pointer
+ *
+ * Must be called with @ref queue::m held.
+ */
+static void fair_close(struct queue *q, struct queuejob *barrier) {
+  struct queueseg *const seg = q->newestseg;
+
+  seg->barrier = barrier;
+  seg->next = sftp_pool_alloc(sizeof *seg->next);
+  sftp_memset(seg->next, 0, sizeof *seg->next);
+  q->newestseg = seg->next;
+}
+
+/** @brief Move on from the oldest segment of a fair queue
+ * @param q Queue pointer
+ *
+ * Must be called with @ref queue::m held, once every keyed job in the oldest
+ * segment has been taken.
+ */
+static void fair_advance(struct queue *q) {
+  struct queueseg *const seg = q->segs;
+  struct queueflow *f, *parked;
+
+  q->segs = seg->next;
+  sftp_pool_free(seg);
+  /* Flows that were waiting for the next segment may now have a turn */
+  parked = q->parked;
+  q->parked = NULL;
+  while((f = parked)) {
+    parked = f->next;
+    f->listed = 0;
+    flow_schedule(q, f);
+  }
+}
+
+/** @brief Add a job to a fair queue
+ * @param q Queue pointer
+ * @param qj Job
+ * @param key Flow, or 0 for none
+ *
+ * Must be called with @ref queue::m held.
+ */
+static void fair_add(struct queue *q, struct queuejob *qj, uint64_t key) {
+  struct queueseg *const seg = q->newestseg;
+  struct queueflow *f;
+
+  ++q->npending;
+  if(!key) {
+    fair_close(q, qj);
+    return;
+  }
+  f = flow_get(q, key);
+  qj->flow = f;
+  qj->seg = seg;
+  ++seg->pending;
+  *f->jobstail = qj;
+  f->jobstail = &qj->next;
+  if(f->jobs == qj && !f->listed)
+    flow_schedule(q, f);
+}
+
+/** @brief Take the next job from a fair queue
+ * @param q Queue pointer
+ * @return Job, or a null pointer if none may be taken now
+ *
+ * Must be called with @ref queue::m held.
+ */
+static struct queuejob *fair_take(struct queue *q) {
+  struct queueseg *const seg = q->segs;
+  struct queueflow *f;
+  struct queuejob *qj;
+
+  if((f = q->active)) {
+    /* Take from the flow whose turn it is and send it to the back */
+    if(!(q->active = f->next))
+      q->activetail = &q->active;
+    f->listed = 0;
+    qj = f->jobs;
+    if(!(f->jobs = qj->next))
+      f->jobstail = &f->jobs;
+    --q->npending;
+    ++f->running;
+    if(f->jobs)
+      flow_schedule(q, f);
+    /* A segment ended by an urgent job is over once its last keyed job has
+     * been taken */
+    if(!--seg->pending && seg->next && !seg->barrier)
+      fair_advance(q);
+    return qj;
+  }
+  /* The unkeyed job ending the segment goes once all the keyed ones have */
+  if(seg->pending || !seg->barrier)
+    return NULL;
+  qj = seg->barrier;
+  --q->npending;
+  fair_advance(q);
+  return qj;
+}
+
+/** @brief Note that a keyed job from a fair queue has finished
+ * @param q Queue pointer
+ * @param f Flow the job belonged to
+ *
+ * Must be called with @ref queue::m held.
+ */
+static void flow_done(struct queue *q, struct queueflow *f) {
+  --f->running;
+  if(f->jobs && !f->listed) {
+    /* It may have been held back by the limit */
+    flow_schedule(q, f);
+    if(f->listed && q->idle)
+      ferrcheck(pthread_cond_signal(&q->c));
+  }
+  flow_release(q, f);
+}
+
+/** @brief Find out whether a job may be taken
+ * @param q Queue pointer
+ * @return Nonzero if take() would succeed
+ *
+ * Must be called with @ref queue::m held.
+ */
+static int ready(const struct queue *q) {
+  if(q->type == queue_fair)
+    return q->active || (!q->segs->pending && q->segs->barrier);
+  return q->jobs != NULL;
+}
+
+/** @brief Find out whether any jobs are queued
+ * @param q Queue pointer
+ * @return Nonzero if there are untaken jobs, whether or not they may be
+ * taken yet
+ *
+ * Must be called with @ref queue::m held.
+ */
+static int queued(const struct queue *q) {
+  if(q->type == queue_fair)
+    return q->npending != 0;
+  return q->jobs != NULL;
+}
+
+/** @brief Take the next job from a mutex or fair queue
+ * @param q Queue pointer
+ * @return Job, or a null pointer if none may be taken now
+ *
+ * Must be called with @ref queue::m held.
+ */
+static struct queuejob *take(struct queue *q) {
+  struct queuejob *qj;
+
+  if(q->type == queue_fair) {
+    if((qj = fair_take(q)) && q->idle && ready(q))
+      /* Taking one job can release several */
+      ferrcheck(pthread_cond_signal(&q->c));
+    return qj;
+  }
+  if((qj = q->jobs))
+    if(!(q->jobs = qj->next))
+      q->jobstail = &q->jobs;
+  return qj;
+}
+
 /** @brief Implementation of worker thread
  * @param vq Queue pointer
  * @return A null pointer
@@ -73,36 +673,171 @@ struct queue {
 static void *queue_thread(void *vq) {
   struct queue *const q = vq;
   struct queuejob *qj;
+  struct queueflow *flow;
   struct allocator a;
-  void *workerdata;
+  struct timespec ts;
+  void *workerdata = NULL;
+  int timedout;
 
-  workerdata = q->details->init();
+  sftp_alloc_init(&a);
   ferrcheck(pthread_mutex_lock(&q->m));
-  while(q->jobs || !q->join) {
-    if(q->jobs) {
-      /* Pick job of front of queue */
-      qj = q->jobs;
-      if(!(q->jobs = qj->next))
-        q->jobstail = &q->jobs;
+  while(queued(q) || !q->join) {
+    if((qj = take(q))) {
+      ++q->taken;
       /* Don't hold lock while executing job */
       ferrcheck(pthread_mutex_unlock(&q->m));
-      sftp_alloc_init(&a);
+      if(!workerdata)
+        workerdata = q->details->init();
       q->details->worker(qj->job, workerdata, &a);
-      sftp_alloc_destroy(&a);
-      free(qj);
+      sftp_alloc_reset(&a);
+      flow = qj->flow;
+      sftp_pool_free(qj);
       ferrcheck(pthread_mutex_lock(&q->m));
+      if(flow)
+        flow_done(q, flow);
     } else {
       /* Nothing's happening, wait for a signal */
-      ferrcheck(pthread_cond_wait(&q->c, &q->m));
+      ++q->idle;
+      deadline(&ts, THREADIDLE * 1000L);
+      timedout = timedwait(&q->c, &q->m, &ts);
+      --q->idle;
+      if(timedout && !queued(q) && !q->join && retire(q))
+        break;
     }
   }
   ferrcheck(pthread_mutex_unlock(&q->m));
+  sftp_alloc_destroy(&a);
+  if(workerdata)
+    q->details->cleanup(workerdata);
+  finished(q);
+  return 0;
+}
+
+/** @brief Express worker thread
+ * @param vq Queue pointer
+ * @return A null pointer
+ */
+static void *express_thread(void *vq) {
+  struct queue *const q = vq;
+  struct queuejob *qj;
+  struct allocator a;
+  void *workerdata = q->details->init();
+
+  sftp_alloc_init(&a);
+  ferrcheck(pthread_mutex_lock(&q->m));
+  while(q->urgent || !q->join) {
+    if(q->urgent) {
+      qj = q->urgent;
+      if(!(q->urgent = qj->next))
+        q->urgenttail = &q->urgent;
+      ferrcheck(pthread_mutex_unlock(&q->m));
+      q->details->worker(qj->job, workerdata, &a);
+      sftp_alloc_reset(&a);
+      sftp_pool_free(qj);
+      ferrcheck(pthread_mutex_lock(&q->m));
+    } else
+      ferrcheck(pthread_cond_wait(&q->uc, &q->m));
+  }
+  ferrcheck(pthread_mutex_unlock(&q->m));
+  sftp_alloc_destroy(&a);
   q->details->cleanup(workerdata);
   return 0;
 }
 
+/** @brief Start a worker thread
+ * @param q Queue pointer
+ * @return 0 on success, else an error number
+ *
+ * Must be called with @ref queue::m held, or before any threads exist.
+ */
+static int spawn(struct queue *q) {
+  pthread_attr_t attr;
+  pthread_t id;
+  int rc;
+
+  ferrcheck(pthread_attr_init(&attr));
+  ferrcheck(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED));
+  ++q->nthreads;
+  ++q->live;
+#if HAVE_STDATOMIC_H
+  rc = pthread_create(&id, &attr, q->type == queue_ring ? ring_thread
+                                                        : queue_thread, q);
+#else
+  rc = pthread_create(&id, &attr, queue_thread, q);
+#endif
+  if(rc) {
+    --q->nthreads;
+    --q->live;
+  }
+  ferrcheck(pthread_attr_destroy(&attr));
+  return rc;
+}
+
+/** @brief Find out whether there are jobs waiting for a busy pool
+ * @param q Queue pointer
+ * @param progressp Where to store a count that increases as jobs are taken
+ * @return Nonzero if jobs are waiting and no worker is idle
+ *
+ * Must be called with @ref queue::m held.
+ */
+static int waiting(struct queue *q, size_t *progressp) {
+#if HAVE_STDATOMIC_H
+  if(q->type == queue_ring) {
+    *progressp = atomic_load(&q->head);
+    return atomic_load(&q->tail) != *progressp && !atomic_load(&q->sleepers);
+  }
+#endif
+  *progressp = q->taken;
+  return ready(q) && !q->idle;
+}
+
+/** @brief Supervisor thread
+ * @param vq Queue pointer
+ * @return A null pointer
+ */
+static void *queue_supervisor(void *vq) {
+  struct queue *const q = vq;
+  struct timespec ts;
+  size_t before, after;
+
+  ferrcheck(pthread_mutex_lock(&q->m));
+  while(!q->join) {
+    /* Announce that we are watching before looking, so that a producer that
+     * adds a job after we look is sure to see us */
+    q->watching = 1;
+    if(q->nthreads >= q->maxthreads || !waiting(q, &before)) {
+      ferrcheck(pthread_cond_wait(&q->stuck, &q->m));
+      continue;
+    }
+    q->watching = 0;
+    deadline(&ts, THREADSPAWNDELAY);
+    while(!q->join && !timedwait(&q->stuck, &q->m, &ts))
+      ;
+    if(!q->join && q->nthreads < q->maxthreads && waiting(q, &after)
+       && after == before) {
+      if(spawn(q) == 0)
+        D(("queue stalled, now %d workers", q->nthreads));
+    }
+  }
+  ferrcheck(pthread_mutex_unlock(&q->m));
+  return 0;
+}
+
+/** @brief Wake the supervisor if it is waiting for a job
+ * @param q Queue pointer
+ *
+ * Must be called with @ref queue::m held.
+ */
+static void wake_supervisor(struct queue *q) {
+  if(q->watching) {
+    q->watching = 0;
+    ferrcheck(pthread_cond_signal(&q->stuck));
+  }
+}
+
 void queue_init(struct queue **qr, const struct queuedetails *details,
-                int nthreads) {
+                int nthreads, int minthreads, int maxthreads,
+                enum queue_type type) {
   int n;
   struct queue *q;
 
@@ -110,41 +845,165 @@ void queue_init(struct queue **qr, const struct queuedetails *details,
   sftp_memset(q, 0, sizeof *q);
   q->jobs = 0;
   q->jobstail = &q->jobs;
+  q->urgenttail = &q->urgent;
   ferrcheck(pthread_mutex_init(&q->m, 0));
   ferrcheck(pthread_cond_init(&q->c, 0));
+  ferrcheck(pthread_cond_init(&q->gone, 0));
+  ferrcheck(pthread_cond_init(&q->stuck, 0));
+  ferrcheck(pthread_cond_init(&q->uc, 0));
   q->details = details;
-  q->nthreads = nthreads;
-  q->threads = sftp_xcalloc(nthreads, sizeof(pthread_t));
+  if(minthreads < 1)
+    minthreads = 1;
+  if(nthreads < minthreads)
+    nthreads = minthreads;
+  if(maxthreads < nthreads)
+    maxthreads = nthreads;
+  q->minthreads = minthreads;
+  q->maxthreads = maxthreads;
   q->join = 0;
-  for(n = 0; n < q->nthreads; ++n)
-    ferrcheck(pthread_create(&q->threads[n], 0, queue_thread, q));
+  q->type = type;
+#if HAVE_STDATOMIC_H
+  if(type == queue_ring) {
+    size_t i;
+
+    q->mask = QUEUERING - 1;
+    q->slots = sftp_xcalloc(QUEUERING, sizeof *q->slots);
+    for(i = 0; i < QUEUERING; ++i)
+      atomic_init(&q->slots[i].seq, i);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->sleepers, 0);
+    atomic_init(&q->producer_waiting, 0);
+    ferrcheck(pthread_cond_init(&q->space, 0));
+  }
+#else
+  if(type == queue_ring)
+    q->type = queue_mutex;
+#endif
+  if(type == queue_fair) {
+    q->flows = sftp_xcalloc(QUEUEFLOWS, sizeof *q->flows);
+    q->activetail = &q->active;
+    q->segs = q->newestseg = sftp_pool_alloc(sizeof *q->segs);
+    sftp_memset(q->segs, 0, sizeof *q->segs);
+  }
+  for(n = 0; n < nthreads; ++n)
+    ferrcheck(spawn(q));
+  if(q->maxthreads > q->minthreads) {
+    ferrcheck(pthread_create(&q->supervisor, 0, queue_supervisor, q));
+    q->supervised = 1;
+  }
   *qr = q;
 }
 
 void queue_add(struct queue *q, void *job) {
+  queue_add_keyed(q, job, 0);
+}
+
+void queue_add_keyed(struct queue *q, void *job, uint64_t key) {
   struct queuejob *qj;
 
-  qj = sftp_xmalloc(sizeof *qj);
+#if HAVE_STDATOMIC_H
+  if(q->type == queue_ring) {
+    if(ring_add(q, job)) {
+      /* Full; wait for a worker to free up a slot */
+      ferrcheck(pthread_mutex_lock(&q->m));
+      atomic_store(&q->producer_waiting, 1);
+      /* Pairs with the fence in ring_take() after it frees a slot: either
+       * that worker sees the flag and signals, or we see the free slot */
+      atomic_thread_fence(memory_order_seq_cst);
+      while(ring_add(q, job))
+        ferrcheck(pthread_cond_wait(&q->space, &q->m));
+      atomic_store(&q->producer_waiting, 0);
+      ferrcheck(pthread_mutex_unlock(&q->m));
+    }
+    if(atomic_load(&q->sleepers)) {
+      ferrcheck(pthread_mutex_lock(&q->m));
+      ferrcheck(pthread_cond_signal(&q->c)); /* any one thread */
+      ferrcheck(pthread_mutex_unlock(&q->m));
+    } else if(atomic_load(&q->watching)) {
+      ferrcheck(pthread_mutex_lock(&q->m));
+      wake_supervisor(q);
+      ferrcheck(pthread_mutex_unlock(&q->m));
+    }
+    return;
+  }
+#endif
+
+  qj = sftp_pool_alloc(sizeof *qj);
   qj->next = 0;
   qj->job = job;
+  qj->flow = 0;
   ferrcheck(pthread_mutex_lock(&q->m));
-  *q->jobstail = qj;
-  q->jobstail = &qj->next;
-  ferrcheck(pthread_cond_signal(&q->c)); /* any one thread */
+  if(q->type == queue_fair)
+    fair_add(q, qj, key);
+  else {
+    *q->jobstail = qj;
+    q->jobstail = &qj->next;
+  }
+  if(q->idle)
+    ferrcheck(pthread_cond_signal(&q->c)); /* any one thread */
+  else
+    wake_supervisor(q);
   ferrcheck(pthread_mutex_unlock(&q->m));
 }
 
-void queue_destroy(struct queue *q) {
-  int n;
+void queue_flow_limit(struct queue *q, int limit) {
+  ferrcheck(pthread_mutex_lock(&q->m));
+  q->flowlimit = limit > 0 ? limit : 0;
+  ferrcheck(pthread_mutex_unlock(&q->m));
+}
+
+void queue_add_urgent(struct queue *q, void *job) {
+  struct queuejob *qj;
 
+  qj = sftp_pool_alloc(sizeof *qj);
+  qj->next = 0;
+  qj->job = job;
+  qj->flow = 0;
+  ferrcheck(pthread_mutex_lock(&q->m));
+  /* Keyed jobs queued after this one may have to wait for it, and it may have
+   * to wait for older ones, so they must not be taken first */
+  if(q->type == queue_fair && q->newestseg->pending)
+    fair_close(q, NULL);
+  *q->urgenttail = qj;
+  q->urgenttail = &qj->next;
+  if(!q->expressing) {
+    ferrcheck(pthread_create(&q->express, 0, express_thread, q));
+    q->expressing = 1;
+  } else
+    ferrcheck(pthread_cond_signal(&q->uc));
+  ferrcheck(pthread_mutex_unlock(&q->m));
+}
+
+void queue_destroy(struct queue *q) {
   if(q) {
     ferrcheck(pthread_mutex_lock(&q->m));
     q->join = 1;
     ferrcheck(pthread_cond_broadcast(&q->c)); /* all threads */
+    ferrcheck(pthread_cond_signal(&q->stuck));
+    ferrcheck(pthread_cond_signal(&q->uc));
     ferrcheck(pthread_mutex_unlock(&q->m));
-    for(n = 0; n < q->nthreads; ++n)
-      ferrcheck(pthread_join(q->threads[n], 0));
-    free(q->threads);
+    if(q->supervised)
+      ferrcheck(pthread_join(q->supervisor, 0));
+    if(q->expressing)
+      ferrcheck(pthread_join(q->express, 0));
+    ferrcheck(pthread_mutex_lock(&q->m));
+    while(q->live)
+      ferrcheck(pthread_cond_wait(&q->gone, &q->m));
+    ferrcheck(pthread_mutex_unlock(&q->m));
+#if HAVE_STDATOMIC_H
+    if(q->type == queue_ring) {
+      ferrcheck(pthread_cond_destroy(&q->space));
+      free(q->slots);
+    }
+#endif
+    if(q->type == queue_fair) {
+      sftp_pool_free(q->segs);
+      free(q->flows);
+    }
+    ferrcheck(pthread_cond_destroy(&q->gone));
+    ferrcheck(pthread_cond_destroy(&q->stuck));
+    ferrcheck(pthread_cond_destroy(&q->uc));
     free(q);
   }
 }
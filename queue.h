@@ -23,8 +23,26 @@
 #ifndef QUEUE_H
 #  define QUEUE_H
 
+#  include <stdint.h>
+
 struct allocator;
 
+/** @brief Queue implementations */
+enum queue_type {
+  /** @brief Linked list protected by a mutex */
+  queue_mutex = 0,
+
+  /** @brief Bounded lock-free ring
+   *
+   * Falls back to @ref queue_mutex if atomics are not available. */
+  queue_ring = 1,
+
+  /** @brief Linked lists protected by a mutex, served in turn by key
+   *
+   * See queue_add_keyed(). */
+  queue_fair = 2,
+};
+
 /** @brief Queue-specific callbacks */
 struct queuedetails {
   /** @brief Per-thread initialization
@@ -48,10 +66,17 @@ struct queuedetails {
 /** @brief Create a thread pool and queue
  * @param qp Where store queue pointer
  * @param details Queue-specific callbacks (not copied)
- * @param nthreads Number of threads to create
+ * @param nthreads Number of threads to start with
+ * @param minthreads Fewest threads to shrink to when idle
+ * @param maxthreads Most threads to grow to when jobs are kept waiting
+ * @param type Queue implementation
+ *
+ * @p nthreads is adjusted to lie between @p minthreads and @p maxthreads,
+ * and @p maxthreads is raised to at least @p nthreads.
  */
 void queue_init(struct queue **qp, const struct queuedetails *details,
-                int nthreads);
+                int nthreads, int minthreads, int maxthreads,
+                enum queue_type type);
 
 /** @brief Add a job to a thread pool's queue
  * @param q Queue pointer
@@ -62,6 +87,32 @@ void queue_init(struct queue **qp, const struct queuedetails *details,
  * job is executed before returning from queue_add(). */
 void queue_add(struct queue *q, void *job);
 
+/** @brief Add a job belonging to a flow to a thread pool's queue
+ * @param q Queue pointer
+ * @param job Job to add to queue
+ * @param key Flow the job belongs to, or 0 for none
+ *
+ * With @ref queue_fair, jobs with a nonzero key are taken from each key in
+ * turn, and in order within a key.  A job with a key of 0 is taken only after
+ * every older job, and before any newer one.  Other implementations ignore
+ * the key and behave as queue_add(). */
+void queue_add_keyed(struct queue *q, void *job, uint64_t key);
+
+/** @brief Limit the number of jobs from one flow being processed at once
+ * @param q Queue pointer
+ * @param limit Most jobs with the same nonzero key at once, or 0 for no limit
+ *
+ * Only @ref queue_fair respects the limit. */
+void queue_flow_limit(struct queue *q, int limit);
+
+/** @brief Add an urgent job to a thread pool
+ * @param q Queue pointer
+ * @param job Job to add
+ *
+ * Urgent jobs are executed in order by a dedicated thread, started when the
+ * first one is added, so they do not wait behind ordinary jobs. */
+void queue_add_urgent(struct queue *q, void *job);
+
 /** @brief Destroy a queue
  * @param q Queue pointer
  *
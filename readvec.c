@@ -0,0 +1,241 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file readvec.c @brief Vectored read implementation
+ *
+ * Clients reading scattered pieces of a file normally send a separate
+ * @ref SSH_FXP_READ for each one.  The @ref READ_VECTOR extension reads many
+ * ranges of an open file in one request:
+ *
+ * <pre>
+ * string "read-vector@rjk.greenend.org.uk"
+ * string handle
+ * uint32 count
+ * repeated count times:
+ *   uint64 offset
+ *   uint32 length
+ * </pre>
+ *
+ * The response is an @ref SSH_FXP_EXTENDED_REPLY containing the data for
+ * each range, in the order requested:
+ *
+ * <pre>
+ * uint32 count
+ * repeated count times:
+ *   string data
+ * </pre>
+ *
+ * As with @ref SSH_FXP_READ, the data for a range may be short, and is empty
+ * at end of file.  The total is limited by the server's read limit, so later
+ * ranges may come back short or empty even before end of file.  Errors fail
+ * the whole request.
+ *
+ * The data is read straight into the output buffer.  Ranges are sorted by
+ * offset and runs that are adjacent in the file are read with a single
+ * preadv() into their separate places in the response.
+ *
+ * serialize.c treats this request as a read of the whole file on its handle.
+ */
+
+#include "sftpserver.h"
+#include "sftpconf.h"
+#include "types.h"
+#include "globals.h"
+#include "handle.h"
+#include "parse.h"
+#include "send.h"
+#include "sftp.h"
+#include "debug.h"
+#include "utils.h"
+#include "stats.h"
+#include "alloc.h"
+#include "direct.h"
+#include "readvec.h"
+#include "putword.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+/** @brief Most iovecs in one preadv() */
+#  define IOV_MAX 16
+#endif
+
+/** @brief One range of a vectored read */
+struct readrange {
+  /** @brief Offset in file */
+  uint64_t offset;
+
+  /** @brief Bytes asked for, after limits */
+  uint32_t len;
+
+  /** @brief Bytes read */
+  uint32_t got;
+
+  /** @brief Where the data goes in the output buffer */
+  size_t where;
+};
+
+/** @brief Compare ranges by offset
+ * @param av Pointer to pointer to range
+ * @param bv Pointer to pointer to range
+ * @return Result of comparison
+ */
+static int compare_ranges(const void *av, const void *bv) {
+  const struct readrange *a = *(const struct readrange *const *)av;
+  const struct readrange *b = *(const struct readrange *const *)bv;
+
+  if(a->offset != b->offset)
+    return a->offset < b->offset ? -1 : 1;
+  return 0;
+}
+
+/** @brief Read a run of ranges that are adjacent in the file
+ * @param fd File descriptor
+ * @param dfd Direct IO file descriptor or -1
+ * @param buffer Output buffer
+ * @param run Ranges in file order
+ * @param n Number of ranges
+ * @return 0 on success or -1 on error
+ *
+ * Stops early at end of file.
+ */
+static int read_run(int fd, int dfd, uint8_t *buffer,
+                    struct readrange **run, size_t n) {
+  struct iovec iov[IOV_MAX];
+  size_t i, k, first = 0;
+  uint64_t offset;
+  ssize_t got;
+
+  while(first < n) {
+    /* Skip ranges already satisfied (or empty) */
+    if(run[first]->got == run[first]->len) {
+      ++first;
+      continue;
+    }
+    offset = run[first]->offset + run[first]->got;
+    for(i = first, k = 0; i < n && k < IOV_MAX; ++i, ++k) {
+      iov[k].iov_base = buffer + run[i]->where + run[i]->got;
+      iov[k].iov_len = run[i]->len - run[i]->got;
+    }
+    if(dfd >= 0 && k == 1)
+      got = sftp_direct_pread(fd, dfd, iov[0].iov_base, iov[0].iov_len,
+                              offset);
+    else
+      got = preadv(fd, iov, k, offset);
+    if(got < 0)
+      return -1;
+    if(got == 0)
+      return 0; /* end of file */
+    /* Share out what we got */
+    for(i = first; got > 0; ++i) {
+      const uint32_t want = run[i]->len - run[i]->got;
+      const uint32_t used = (size_t)got < want ? (uint32_t)got : want;
+
+      run[i]->got += used;
+      got -= used;
+    }
+  }
+  return 0;
+}
+
+uint32_t sftp_vany_read_vector(struct sftpjob *job) {
+  struct handleid id;
+  struct worker *const w = job->worker;
+  struct readrange *ranges, **sorted;
+  uint32_t count, n, rc;
+  size_t i, start, budget, total = 0, to;
+  unsigned flags;
+  int fd, dfd;
+  uint8_t *buffer;
+
+  pcheck(sftp_parse_handle(job, &id));
+  pcheck(sftp_parse_uint32(job, &count));
+  D(("sftp_vany_read_vector %" PRIu32 " %" PRIu32 ": %" PRIu32 " ranges",
+     id.id, id.tag, count));
+  /* Each range takes 12 bytes to ask for */
+  if(count > job->left / 12)
+    return SSH_FX_BAD_MESSAGE;
+  if((rc = sftp_handle_get_fd(&id, &fd, &flags)))
+    return rc;
+  /* Ranges only make sense for random access */
+  if(flags & (HANDLE_TEXT | HANDLE_APPEND))
+    return SSH_FX_OP_UNSUPPORTED;
+  dfd = flags & HANDLE_DIRECT ? sftp_handle_get_direct(&id) : -1;
+  /* Make sure we see our own writes */
+  sftp_handle_flush(&id);
+  ranges = sftp_alloc(job->a, (count ? count : 1) * sizeof *ranges);
+  sorted = sftp_alloc(job->a, (count ? count : 1) * sizeof *sorted);
+  budget = sftpconf_max_read;
+  for(n = 0; n < count; ++n) {
+    pcheck(sftp_parse_uint64(job, &ranges[n].offset));
+    pcheck(sftp_parse_uint32(job, &ranges[n].len));
+    if(ranges[n].len > budget)
+      ranges[n].len = budget;
+    budget -= ranges[n].len;
+    ranges[n].got = 0;
+    ranges[n].where = total + 4 * (n + 1);
+    total += ranges[n].len;
+    sorted[n] = &ranges[n];
+  }
+  qsort(sorted, count, sizeof *sorted, compare_ranges);
+  sftp_send_begin(w);
+  sftp_send_uint8(w, SSH_FXP_EXTENDED_REPLY);
+  sftp_send_uint32(w, job->id);
+  sftp_send_uint32(w, count);
+  /* Each range's data follows its length word */
+  sftp_send_need(w, total + 4 * count);
+  buffer = w->buffer + w->bufused;
+  for(start = 0; start < count; start = i) {
+    for(i = start + 1;
+        i < count &&
+        sorted[i]->offset == sorted[i - 1]->offset + sorted[i - 1]->len;
+        ++i)
+      ;
+    if(read_run(fd, dfd, buffer, sorted + start, i - start) < 0)
+      return HANDLER_ERRNO;
+  }
+  /* Close up any gaps left by short ranges */
+  for(n = 0, to = 0; n < count; ++n) {
+    const uint32_t got = ranges[n].got;
+
+    put32(buffer + to, got);
+    if(to + 4 != ranges[n].where)
+      memmove(buffer + to + 4, buffer + ranges[n].where, got);
+    to += 4 + got;
+  }
+  sftp_stats_bytes(stats_bytes_read, to - 4 * count);
+  w->bufused += to;
+  sftp_send_end(w);
+  return HANDLER_RESPONDED;
+}
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
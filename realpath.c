@@ -18,18 +18,216 @@
  * USA
  */
 
-/** @file realpath.c @brief Implementation of sftp_find_realpath() */
+/** @file realpath.c @brief Implementation of sftp_find_realpath()
+ *
+ * Following symlinks costs a readlink() for every prefix of a path, and
+ * GUI clients ask for real paths constantly, often for paths in the same
+ * few directories.  So when the cache is enabled we remember, for a short
+ * time, which prefixes are symlinks and where they point, along with the
+ * current directory.  Failed lookups other than "not a link" are not cached,
+ * so creating files never leaves stale entries; the server discards the
+ * cache after anything that could create, remove or replace a link.
+ *
+ * A lookup that misses reads the link without holding the lock, so a
+ * discard can happen between the readlink() and the insert.  Each discard
+ * counts up @ref rp_generation, and a lookup only adds its result if the
+ * count is unchanged since before its readlink().
+ */
 
 #include "sftpcommon.h"
 #include "utils.h"
 #include "alloc.h"
 #include "debug.h"
+#include "thread.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
+
+#ifndef REALPATHCACHEBUCKETS
+/** @brief Number of hash buckets in the realpath cache */
+#  define REALPATHCACHEBUCKETS 256
+#endif
+
+#ifndef REALPATHCACHEMAX
+/** @brief Maximum entries in the realpath cache before it is flushed */
+#  define REALPATHCACHEMAX 4096
+#endif
+
+/** @brief One cached readlink() result */
+struct rpentry {
+  /** @brief Next entry in the same bucket */
+  struct rpentry *next;
+
+  /** @brief Path */
+  char *path;
+
+  /** @brief Link target, or a null pointer if not a link */
+  char *target;
+
+  /** @brief When this entry expires */
+  time_t expires;
+};
+
+/** @brief Lock protecting the cache */
+static pthread_rwlock_t rp_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** @brief Cache lifetime in seconds, or 0 if disabled */
+static int rp_ttl;
+
+/** @brief Hash buckets */
+static struct rpentry *rp_buckets[REALPATHCACHEBUCKETS];
+
+/** @brief Number of cached entries */
+static size_t rp_nentries;
+
+/** @brief Cached current directory, or a null pointer */
+static char *rp_cwd;
+
+/** @brief When @ref rp_cwd expires */
+static time_t rp_cwd_expires;
+
+/** @brief Number of times the cache has been discarded */
+static uint64_t rp_generation;
+
+void sftp_realpath_cache_init(int ttl) {
+  rp_ttl = ttl;
+}
+
+/** @brief Discard all entries
+ *
+ * Must be called with @ref rp_lock held for writing.
+ */
+static void rp_flush(void) {
+  struct rpentry *e;
+  size_t n;
+
+  for(n = 0; n < REALPATHCACHEBUCKETS; ++n)
+    while((e = rp_buckets[n])) {
+      rp_buckets[n] = e->next;
+      free(e->path);
+      free(e->target);
+      free(e);
+    }
+  rp_nentries = 0;
+  free(rp_cwd);
+  rp_cwd = NULL;
+}
+
+void sftp_realpath_invalidate(void) {
+  if(!rp_ttl)
+    return;
+  ferrcheck(pthread_rwlock_wrlock(&rp_lock));
+  rp_flush();
+  ++rp_generation;
+  ferrcheck(pthread_rwlock_unlock(&rp_lock));
+}
+
+/** @brief Find the bucket for a path
+ * @param path Path name
+ * @return Pointer to bucket
+ */
+static struct rpentry **rp_bucket(const char *path) {
+  unsigned long h = 0;
+
+  while(*path)
+    h = 31 * h + (unsigned char)*path++;
+  return &rp_buckets[h % REALPATHCACHEBUCKETS];
+}
+
+/** @brief Read a symlink, consulting the cache
+ * @param a Allocator to store result
+ * @param path Path name to inspect
+ * @return As for sftp_do_readlink()
+ */
+static char *rp_readlink(struct allocator *a, const char *path) {
+  struct rpentry *e;
+  char *target = NULL, *copy;
+  uint64_t generation;
+  int save_errno, hit = 0;
+
+  if(!rp_ttl)
+    return sftp_do_readlink(a, path);
+  ferrcheck(pthread_rwlock_rdlock(&rp_lock));
+  for(e = *rp_bucket(path); e; e = e->next)
+    if(!strcmp(e->path, path)) {
+      if(e->expires > time(NULL)) {
+        target = e->target ? strcpy(sftp_alloc_raw(a, strlen(e->target) + 1),
+                                    e->target)
+                           : NULL;
+        hit = 1;
+      }
+      break;
+    }
+  generation = rp_generation;
+  ferrcheck(pthread_rwlock_unlock(&rp_lock));
+  if(hit) {
+    if(!target)
+      errno = EINVAL;
+    return target;
+  }
+  target = sftp_do_readlink(a, path);
+  save_errno = errno;
+  if(target || errno == EINVAL) {
+    copy = target ? sftp_xstrdup(target) : NULL;
+    ferrcheck(pthread_rwlock_wrlock(&rp_lock));
+    /* If the cache was discarded since we looked then what we read may
+     * already be out of date */
+    if(generation == rp_generation) {
+      /* An expired entry for the same path is brought up to date */
+      for(e = *rp_bucket(path); e && strcmp(e->path, path); e = e->next)
+        ;
+      if(!e) {
+        if(rp_nentries >= REALPATHCACHEMAX)
+          rp_flush();
+        e = sftp_xmalloc(sizeof *e);
+        e->path = sftp_xstrdup(path);
+        e->target = NULL;
+        e->next = *rp_bucket(path);
+        *rp_bucket(path) = e;
+        ++rp_nentries;
+      }
+      free(e->target);
+      e->target = copy;
+      e->expires = time(NULL) + rp_ttl;
+      copy = NULL;
+    }
+    ferrcheck(pthread_rwlock_unlock(&rp_lock));
+    free(copy);
+  }
+  errno = save_errno;
+  return target;
+}
+
+/** @brief Find the current directory, consulting the cache
+ * @param a Allocator to store result
+ * @return As for sftp_getcwd()
+ */
+static char *rp_getcwd(struct allocator *a) {
+  char *cwd = NULL;
+  time_t now;
+
+  if(!rp_ttl)
+    return sftp_getcwd(a);
+  now = time(NULL);
+  ferrcheck(pthread_rwlock_rdlock(&rp_lock));
+  if(rp_cwd && rp_cwd_expires > now)
+    cwd = strcpy(sftp_alloc_raw(a, strlen(rp_cwd) + 1), rp_cwd);
+  ferrcheck(pthread_rwlock_unlock(&rp_lock));
+  if(cwd)
+    return cwd;
+  if(!(cwd = sftp_getcwd(a)))
+    return NULL;
+  ferrcheck(pthread_rwlock_wrlock(&rp_lock));
+  free(rp_cwd);
+  rp_cwd = sftp_xstrdup(cwd);
+  rp_cwd_expires = now + rp_ttl;
+  ferrcheck(pthread_rwlock_unlock(&rp_lock));
+  return cwd;
+}
 
 static char *process_path(struct allocator *a, char *result, size_t *nresultp,
                           const char *path, unsigned flags);
@@ -47,10 +245,10 @@ char *sftp_find_realpath(struct allocator *a, const char *path,
 
   /* Convert relative paths to absolute paths */
   if(path[0] != '/') {
-    if(!(cwd = sftp_getcwd(a)))
+    if(!(cwd = rp_getcwd(a)))
       return 0;
     assert(cwd[0] == '/');
-    abspath = sftp_alloc(a, strlen(cwd) + strlen(path) + 2);
+    abspath = sftp_alloc_raw(a, strlen(cwd) + strlen(path) + 2);
     strcpy(abspath, cwd);
     strcat(abspath, "/");
     strcat(abspath, path);
@@ -105,7 +303,7 @@ static char *process_path(struct allocator *a, char *result, size_t *nresultp,
         /* If we're following symlinks, see if the path so far points to a
          * link */
         if(flags & RP_READLINK) {
-          const char *const target = sftp_do_readlink(a, result);
+          const char *const target = rp_readlink(a, result);
 
           if(target) {
             if(target[0] == '/')
@@ -18,7 +18,17 @@
  * USA
  */
 
-/** @file send.c @brief Message sending implementation */
+/** @file send.c @brief Message sending implementation
+ *
+ * Each worker builds a message in its own buffer.  Without the send buffer
+ * pool a worker keeps that buffer for life, so a single large read leaves it
+ * holding megabytes for the rest of the session.  With the pool, workers
+ * check out a buffer in sftp_send_begin() and it goes back to the pool once
+ * the message has been written, possibly by the output thread.  Buffers are
+ * all the same size, big enough for the largest read; a message that needs
+ * more grows its buffer privately and that buffer is freed rather than
+ * pooled.  Spare buffers that go unused for a while are freed.
+ */
 
 #include "sftpserver.h"
 #include "debug.h"
@@ -28,19 +38,160 @@
 #include "thread.h"
 #include "types.h"
 #include "globals.h"
+#include "mapread.h"
+#include "affinity.h"
+#include "trace.h"
+#include "capture.h"
+#include "probes.h"
+#include "session.h"
+#include "serialize.h"
+#include "input.h"
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#if HAVE_SYS_SENDFILE_H
+#  include <sys/sendfile.h>
+#endif
 #include "putword.h"
 
-/** @brief Mutex to serialize IO */
+#ifndef IOV_MAX
+#  define IOV_MAX 16
+#endif
+
+/** @brief Huge page size assumed when aligning pooled buffers */
+#define HUGEPAGESIZE 2097152
+
+/** @brief A completed message awaiting output
+ *
+ * Also used to hold spare buffers for recycling back to workers. */
+struct outputbuf {
+  /** @brief Next message or a null pointer */
+  struct outputbuf *next;
+
+  /** @brief Message contents */
+  uint8_t *buffer;
+
+  /** @brief Size of message */
+  size_t len;
+
+  /** @brief Size of @ref buffer */
+  size_t size;
+
+  /** @brief File to send after @ref buffer, or -1
+   *
+   * This is a duplicate descriptor, closed after sending. */
+  int fd;
+
+  /** @brief Offset in @ref fd */
+  uint64_t offset;
+
+  /** @brief Number of bytes to send from @ref fd or @ref mapdata */
+  size_t count;
+
+  /** @brief Mapping to send from after @ref buffer, or a null pointer
+   *
+   * This holds a reference, dropped after sending. */
+  struct mapwindow *map;
+
+  /** @brief Start of data in @ref map */
+  const uint8_t *mapdata;
+
+  /** @brief Job to finish once this message is written, or a null pointer
+   *
+   * A response whose data is still to be read from the file keeps its job
+   * serialized until then, so that later requests can't change the data. */
+  struct sftpjob *job;
+};
+
+/** @brief Mutex to serialize IO
+ *
+ * When the output thread is running this also protects the output queue.
+ * Sessions that share their process have locks of their own (see
+ * output_mutex()). */
 static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/** @brief Signaled when a message is queued or the output thread should stop
+ */
+static pthread_cond_t output_ready = PTHREAD_COND_INITIALIZER;
+
+/** @brief Signaled when queued messages are written */
+static pthread_cond_t output_space = PTHREAD_COND_INITIALIZER;
+
+/** @brief Head of output queue */
+static struct outputbuf *output_head;
+
+/** @brief Where to store new tail of output queue */
+static struct outputbuf **output_tail = &output_head;
+
+/** @brief Spare buffers */
+static struct outputbuf *output_spare;
+
+/** @brief Number of spare buffers */
+static int output_nspare;
+
+/** @brief Total bytes in output queue */
+static size_t output_queued;
+
+/** @brief Maximum number of messages per @c writev() call, or 0 */
+static int output_batch;
+
+/** @brief Set when output thread should stop */
+static int output_stopping;
+
+/** @brief Output thread ID */
+static pthread_t output_thread_id;
+
+/** @brief A spare pooled send buffer */
+struct sendspare {
+  /** @brief Buffer */
+  uint8_t *buffer;
+
+  /** @brief When it was returned to the pool */
+  time_t released;
+};
+
+/** @brief Lock protecting the send buffer pool
+ *
+ * May be taken with @ref output_lock held but not the other way round. */
+static pthread_mutex_t sendpool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Size of pooled buffers, or 0 if the pool is not in use */
+static size_t sendpool_size;
+
+/** @brief Spare buffers, least recently released first */
+static struct sendspare *sendpool_spare;
+
+/** @brief Number of spare buffers */
+static int sendpool_nspare;
+
+/** @brief Maximum number of spare buffers */
+static int sendpool_max;
+
+/** @brief Seconds a spare buffer may go unused before it is freed, or 0 */
+static int sendpool_idle;
+
+/** @brief Non-0 to ask for huge pages for pooled buffers */
+static int sendpool_huge;
+
+/** @brief Buffers taken from @ref sendpool_spare */
+static unsigned long sendpool_hits;
+
+/** @brief Buffers that had to be allocated */
+static unsigned long sendpool_misses;
+
 int sftpout = 1; /* default is stdout */
 
+int sftp_zerocopy;
+
 /** @brief Store a 16-bit value */
 #define sftp_send_raw16(u)                                                     \
   do {                                                                         \
@@ -62,6 +213,156 @@ int sftpout = 1; /* default is stdout */
     w->bufused += 8;                                                           \
   } while(0)
 
+/** @brief Get the current time for idle trimming
+ * @return Seconds on a monotonic clock
+ */
+static time_t sendpool_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/** @brief Allocate a new pooled buffer
+ * @return Buffer of @ref sendpool_size bytes
+ */
+static uint8_t *sendpool_new(void) {
+#if HAVE_MADVISE && defined MADV_HUGEPAGE
+  void *ptr;
+  int rc;
+
+  if(sendpool_huge) {
+    /* Memory from posix_memalign() can be released with free(), so nothing
+     * else needs to know how the buffer was allocated */
+    if((rc = posix_memalign(&ptr, HUGEPAGESIZE, sendpool_size)))
+      sftp_fatal("error calling posix_memalign: %s", strerror(rc));
+    madvise(ptr, sendpool_size, MADV_HUGEPAGE); /* just a hint */
+    return ptr;
+  }
+#endif
+  return sftp_xmalloc(sendpool_size);
+}
+
+/** @brief Free spare buffers that have been idle for too long
+ * @param now Current time from sendpool_now()
+ *
+ * Must be called with @ref sendpool_lock held.
+ */
+static void sendpool_expire(time_t now) {
+  int n;
+
+  if(!sendpool_idle)
+    return;
+  for(n = 0; n < sendpool_nspare &&
+              now - sendpool_spare[n].released >= sendpool_idle;
+      ++n)
+    free(sendpool_spare[n].buffer);
+  if(n) {
+    memmove(sendpool_spare, sendpool_spare + n,
+            (sendpool_nspare - n) * sizeof *sendpool_spare);
+    sendpool_nspare -= n;
+  }
+}
+
+/** @brief Check a buffer out of the pool
+ * @param w Worker to give the buffer to
+ */
+static void sendpool_get(struct worker *w) {
+  ferrcheck(pthread_mutex_lock(&sendpool_lock));
+  if(sendpool_nspare) {
+    /* The most recently released buffer is the most likely to be cached */
+    w->buffer = sendpool_spare[--sendpool_nspare].buffer;
+    ++sendpool_hits;
+    ferrcheck(pthread_mutex_unlock(&sendpool_lock));
+  } else {
+    ++sendpool_misses;
+    ferrcheck(pthread_mutex_unlock(&sendpool_lock));
+    w->buffer = sendpool_new();
+  }
+  w->bufsize = sendpool_size;
+}
+
+/** @brief Return a buffer to the pool
+ * @param buffer Buffer, or a null pointer
+ * @param size Size of @p buffer
+ *
+ * Buffers that have grown beyond the pool size, or that don't fit, are
+ * freed.
+ */
+static void sendpool_put(uint8_t *buffer, size_t size) {
+  const time_t now = sendpool_now();
+
+  if(!buffer)
+    return;
+  ferrcheck(pthread_mutex_lock(&sendpool_lock));
+  sendpool_expire(now);
+  if(size == sendpool_size && sendpool_nspare < sendpool_max) {
+    sendpool_spare[sendpool_nspare].buffer = buffer;
+    sendpool_spare[sendpool_nspare].released = now;
+    ++sendpool_nspare;
+    buffer = 0;
+  }
+  ferrcheck(pthread_mutex_unlock(&sendpool_lock));
+  free(buffer);
+}
+
+/** @brief Free idle spare buffers
+ * @return Number of spare buffers left
+ */
+static int sendpool_trim(void) {
+  const time_t now = sendpool_now();
+  int left;
+
+  ferrcheck(pthread_mutex_lock(&sendpool_lock));
+  sendpool_expire(now);
+  left = sendpool_nspare;
+  ferrcheck(pthread_mutex_unlock(&sendpool_lock));
+  return left;
+}
+
+/** @brief Give up a worker's buffer once its message is sent
+ * @param w Worker
+ *
+ * Does nothing if the pool is not in use, in which case the worker keeps
+ * its buffer for next time.
+ */
+static void sendpool_release(struct worker *w) {
+  if(!sendpool_size)
+    return;
+  sendpool_put(w->buffer, w->bufsize);
+  w->buffer = 0;
+  w->bufsize = 0;
+}
+
+void sftp_send_pool_start(size_t size, int nspare, int idle, int huge) {
+  if(nspare <= 0)
+    return;
+  if(huge)
+    size = (size + HUGEPAGESIZE - 1) & ~(size_t)(HUGEPAGESIZE - 1);
+  sendpool_size = size;
+  sendpool_max = nspare;
+  sendpool_idle = idle;
+  sendpool_huge = huge;
+  sendpool_spare = sftp_xcalloc(nspare, sizeof *sendpool_spare);
+  sendpool_nspare = 0;
+  sendpool_hits = sendpool_misses = 0;
+}
+
+void sftp_send_pool_stop(void) {
+  int n;
+
+  if(!sendpool_size)
+    return;
+  D(("send buffer pool: %lu hits %lu misses", sendpool_hits,
+     sendpool_misses));
+  for(n = 0; n < sendpool_nspare; ++n)
+    free(sendpool_spare[n].buffer);
+  free(sendpool_spare);
+  sendpool_spare = 0;
+  sendpool_nspare = sendpool_max = 0;
+  sendpool_size = 0;
+}
+
 void sftp_send_need(struct worker *w, size_t n) {
   assert(w->bufused < 0x80000000);
   if(n > w->bufsize - w->bufused) {
@@ -75,32 +376,606 @@ void sftp_send_need(struct worker *w, size_t n) {
 }
 
 void sftp_send_begin(struct worker *w) {
+  /* A worker may still hold a buffer if it abandoned a message */
+  if(!w->buffer && sendpool_size)
+    sendpool_get(w);
   w->bufused = 0;
   sftp_send_uint32(w, 0); /* placeholder for length */
 }
 
+/** @brief Find where the calling thread's responses go
+ * @return File descriptor
+ */
+static inline int output_fd(void) {
+  return sftp_session ? sftp_session->outfd : sftpout;
+}
+
+/** @brief Find the lock serializing the calling thread's responses
+ * @return Mutex
+ */
+static inline pthread_mutex_t *output_mutex(void) {
+  return sftp_session && sftp_session->shared ? &sftp_session->output_lock
+                                              : &output_lock;
+}
+
+/** @brief Give up on the session's output
+ * @param why Description of what went wrong
+ *
+ * The stream of responses is no longer intact, so the session cannot
+ * continue.  If the session shares its process with others then it is shut
+ * down, which its event loop will notice, and later writes fail harmlessly.
+ * Otherwise the process exits.
+ */
+static void output_abandon(const char *why) {
+  if(!sftp_session || !sftp_session->shared)
+    sftp_fatal("%s", why);
+  D(("%s", why));
+  shutdown(sftp_session->outfd, SHUT_RDWR);
+  /* Nothing more will be sent */
+  sftp_session->broken = 1;
+  sftp_session->backlog_start = sftp_session->backlog_end = 0;
+}
+
+/** @brief Handle an error sending a response
+ * @param what Description of what failed
+ */
+static void output_failed(const char *what) {
+  char why[256];
+
+  snprintf(why, sizeof why, "%s: %s", what, strerror(errno));
+  output_abandon(why);
+}
+
+/** @brief Add output to a shared session's backlog
+ * @param s Session
+ * @param iov Buffers to add
+ * @param niov Number of buffers
+ *
+ * Called with @c s->output_lock held.
+ */
+static void output_hold(struct session *s, const struct iovec *iov,
+                        int niov) {
+  size_t total = 0, size;
+  int n;
+
+  for(n = 0; n < niov; ++n)
+    total += iov[n].iov_len;
+  if(s->backlog_start && total > s->backlog_size - s->backlog_end) {
+    /* Shuffle down to make room */
+    memmove(s->backlog, s->backlog + s->backlog_start,
+            s->backlog_end - s->backlog_start);
+    s->backlog_end -= s->backlog_start;
+    s->backlog_start = 0;
+  }
+  if(total > s->backlog_size - s->backlog_end) {
+    size = s->backlog_size ? s->backlog_size : 65536;
+    while(size - s->backlog_end < total)
+      size *= 2;
+    s->backlog = sftp_xrealloc(s->backlog, size);
+    s->backlog_size = size;
+  }
+  for(n = 0; n < niov; ++n) {
+    sftp_memcpy(s->backlog + s->backlog_end, iov[n].iov_base,
+                iov[n].iov_len);
+    s->backlog_end += iov[n].iov_len;
+  }
+}
+
+/** @brief Write an array of buffers to a shared session without blocking
+ * @param s Session
+ * @param iov Buffers to write (modified)
+ * @param niov Number of buffers
+ *
+ * Called with @c s->output_lock held.  Whatever the socket will not take at
+ * once is added to the backlog, and the event loop is woken to send it.
+ * While there is a backlog, new output joins the end of it so that responses
+ * stay in order.
+ */
+static void output_shared(struct session *s, struct iovec *iov, int niov) {
+  struct msghdr msg;
+  ssize_t n;
+
+  if(s->broken)
+    return;
+  if(s->backlog_end == s->backlog_start) {
+    sftp_memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = niov;
+    while((n = sendmsg(s->outfd, &msg, MSG_DONTWAIT)) < 0 && errno == EINTR)
+      ;
+    if(n < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK) {
+        output_failed("error sending response");
+        return;
+      }
+      n = 0;
+    }
+    while(niov > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --niov;
+    }
+    if(!niov)
+      return;
+    iov->iov_base = (char *)iov->iov_base + n;
+    iov->iov_len -= n;
+    output_hold(s, iov, niov);
+    sftp_input_wake(&s->in);
+  } else
+    output_hold(s, iov, niov);
+}
+
+size_t sftp_send_flush(struct session *s) {
+  size_t left;
+  ssize_t n;
+
+  ferrcheck(pthread_mutex_lock(&s->output_lock));
+  while(s->backlog_end > s->backlog_start) {
+    if((n = send(s->outfd, s->backlog + s->backlog_start,
+                 s->backlog_end - s->backlog_start, MSG_DONTWAIT))
+       < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno != EAGAIN && errno != EWOULDBLOCK) {
+        D(("error sending response: %s", strerror(errno)));
+        shutdown(s->outfd, SHUT_RDWR);
+        s->broken = 1;
+        s->backlog_start = s->backlog_end = 0;
+      }
+      break;
+    }
+    s->backlog_start += n;
+  }
+  if(s->backlog_start == s->backlog_end) {
+    /* Don't keep a large buffer for a session that is keeping up */
+    free(s->backlog);
+    s->backlog = 0;
+    s->backlog_start = s->backlog_end = s->backlog_size = 0;
+  }
+  left = s->backlog_end - s->backlog_start;
+  ferrcheck(pthread_mutex_unlock(&s->output_lock));
+  return left;
+}
+
+size_t sftp_send_backlog(struct session *s) {
+  size_t left;
+
+  ferrcheck(pthread_mutex_lock(&s->output_lock));
+  left = s->backlog_end - s->backlog_start;
+  ferrcheck(pthread_mutex_unlock(&s->output_lock));
+  return left;
+}
+
+/** @brief Write an array of buffers, coping with short writes
+ * @param iov Buffers to write (modified)
+ * @param niov Number of buffers
+ */
+static void output_writev(struct iovec *iov, int niov) {
+  ssize_t n;
+
+  if(sftp_session && sftp_session->shared) {
+    output_shared(sftp_session, iov, niov);
+    return;
+  }
+  while(niov > 0) {
+    if((n = writev(output_fd(), iov, niov)) < 0) {
+      output_failed("error sending response");
+      return;
+    }
+    while(niov > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --niov;
+    }
+    if(niov > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+/** @brief Write an array of buffers, the last of which is mapped from a file
+ * @param iov Buffers to write (modified)
+ * @param niov Number of buffers
+ *
+ * The request stays serialized until this has finished, but something
+ * outside the session may still truncate the file, and then the end of the
+ * mapping is no longer backed by anything.  Touching it would raise
+ * @c SIGBUS, but since the kernel reads it on our behalf the write fails with
+ * @c EFAULT instead.  The response's length has already been sent, so the
+ * session is then abandoned.
+ */
+static void output_mapped(struct iovec *iov, int niov) {
+  ssize_t n;
+
+  while(niov > 0) {
+    if((n = writev(output_fd(), iov, niov)) < 0) {
+      if(errno != EFAULT) {
+        output_failed("error sending response");
+        return;
+      }
+      /* Only the mapping can fault */
+      output_abandon("file truncated while sending response");
+      return;
+    }
+    while(niov > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --niov;
+    }
+    if(niov > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+/** @brief Write part of a file
+ * @param fd File to read from
+ * @param offset Offset to start reading at
+ * @param count Number of bytes to write
+ *
+ * Uses sendfile() where possible, so the data need not pass through user
+ * space.  The request stays serialized until this has finished, but
+ * something outside the session may still truncate the file.  The response's
+ * length has already been sent, and there is no honest way to make up the
+ * difference, so the session is then abandoned.
+ */
+static void output_file(int fd, uint64_t offset, size_t count) {
+  char buffer[8192];
+  ssize_t n;
+  struct iovec iov;
+
+#if HAVE_SYS_SENDFILE_H && HAVE_SENDFILE
+  off_t off = offset;
+
+  while(count > 0) {
+    if((n = sendfile(output_fd(), fd, &off, count)) > 0)
+      count -= n;
+    else if(n == 0) {
+      output_abandon("file truncated while sending response");
+      return;
+    } else if(errno == EINVAL || errno == ENOSYS)
+      break; /* fall back to copying */
+    else {
+      output_failed("error sending response");
+      return;
+    }
+  }
+  offset = off;
+#endif
+  while(count > 0) {
+    n = pread(fd, buffer, count > sizeof buffer ? sizeof buffer : count,
+              offset);
+    if(n < 0) {
+      output_failed("error reading file while sending response");
+      return;
+    }
+    if(n == 0) {
+      output_abandon("file truncated while sending response");
+      return;
+    }
+    iov.iov_base = buffer;
+    iov.iov_len = n;
+    output_writev(&iov, 1);
+    offset += n;
+    count -= n;
+  }
+}
+
+/** @brief Finish the job behind a message once its data has been written
+ * @param ob Message
+ */
+static void output_finish(struct outputbuf *ob) {
+  if(ob->job) {
+    /* Later requests may now go ahead */
+    serialize_remove_job(ob->job);
+    sftp_input_free(ob->job);
+    ob->job = NULL;
+  }
+}
+
+/** @brief Output thread
+ *
+ * Takes completed messages off the output queue and writes them in batches.
+ * Anything that arrives while a batch is being written will form (part of)
+ * the next batch.
+ */
+static void *output_thread(void attribute((unused)) * arg) {
+  struct iovec iov[IOV_MAX];
+  struct outputbuf *batch, *ob, *next;
+  struct timespec ts;
+  size_t bytes;
+  int n, rc;
+
+  sftp_affinity_apply(affinity_output);
+  ferrcheck(pthread_mutex_lock(&output_lock));
+  for(;;) {
+    while(!output_head && !output_stopping) {
+      /* While idle, wake up now and then to free unused send buffers */
+      if(sendpool_idle && sendpool_trim()) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += sendpool_idle;
+        rc = pthread_cond_timedwait(&output_ready, &output_lock, &ts);
+        if(rc && rc != ETIMEDOUT)
+          ferrcheck(rc);
+      } else
+        ferrcheck(pthread_cond_wait(&output_ready, &output_lock));
+    }
+    if(!output_head)
+      break;
+    /* Detach a batch from the head of the queue */
+    batch = output_head;
+    bytes = 0;
+    for(n = 0, ob = batch; n < output_batch - 1 && ob->next; ++n)
+      ob = ob->next;
+    output_head = ob->next;
+    ob->next = 0;
+    if(!output_head)
+      output_tail = &output_head;
+    ferrcheck(pthread_mutex_unlock(&output_lock));
+    for(n = 0, ob = batch; ob; ob = ob->next) {
+      iov[n].iov_base = ob->buffer;
+      iov[n].iov_len = ob->len;
+      ++n;
+      bytes += ob->len;
+      if(ob->fd >= 0) {
+        /* The rest of this message comes from a file */
+        output_writev(iov, n);
+        n = 0;
+        output_file(ob->fd, ob->offset, ob->count);
+        if(close(ob->fd) < 0)
+          sftp_fatal("error calling close: %s", strerror(errno));
+        ob->fd = -1;
+        output_finish(ob);
+      } else if(ob->map) {
+        /* The rest of this message comes from a mapping, which can go out
+         * in the same call if there's room */
+        if(n == IOV_MAX) {
+          output_writev(iov, n - 1);
+          iov[0] = iov[n - 1];
+          n = 1;
+        }
+        iov[n].iov_base = (void *)ob->mapdata;
+        iov[n].iov_len = ob->count;
+        output_mapped(iov, n + 1);
+        n = 0;
+        sftp_mapread_put(ob->map);
+        ob->map = NULL;
+        output_finish(ob);
+      }
+    }
+    output_writev(iov, n);
+    ferrcheck(pthread_mutex_lock(&output_lock));
+    /* Keep a few buffers back for reuse, free the rest */
+    for(ob = batch; ob; ob = next) {
+      next = ob->next;
+      if(sendpool_size) {
+        /* The pool looks after the message buffer */
+        sendpool_put(ob->buffer, ob->size);
+        ob->buffer = 0;
+        ob->size = 0;
+      }
+      if(output_nspare < OUTPUTSPARE) {
+        ob->next = output_spare;
+        output_spare = ob;
+        ++output_nspare;
+      } else {
+        free(ob->buffer);
+        free(ob);
+      }
+    }
+    output_queued -= bytes;
+    ferrcheck(pthread_cond_broadcast(&output_space));
+  }
+  ferrcheck(pthread_mutex_unlock(&output_lock));
+  return 0;
+}
+
+void sftp_send_output_start(int batch) {
+  if(batch <= 0)
+    return;
+  output_batch = batch > IOV_MAX ? IOV_MAX : batch;
+  output_stopping = 0;
+  ferrcheck(pthread_create(&output_thread_id, 0, output_thread, 0));
+}
+
+void sftp_send_output_stop(void) {
+  struct outputbuf *ob;
+
+  if(!output_batch)
+    return;
+  ferrcheck(pthread_mutex_lock(&output_lock));
+  output_stopping = 1;
+  ferrcheck(pthread_cond_signal(&output_ready));
+  ferrcheck(pthread_mutex_unlock(&output_lock));
+  ferrcheck(pthread_join(output_thread_id, 0));
+  output_batch = 0;
+  while((ob = output_spare)) {
+    output_spare = ob->next;
+    free(ob->buffer);
+    free(ob);
+  }
+  output_nspare = 0;
+}
+
+/** @brief Hand a completed message to the output thread
+ * @param w Worker containing message
+ * @return Queue entry for message
+ *
+ * Called with @ref output_lock held.  The worker's buffer is swapped for a
+ * spare one (if there is one).  When the send buffer pool is in use spares
+ * have no buffer, so the worker is left without one until it next calls
+ * sftp_send_begin().
+ */
+static struct outputbuf *output_enqueue(struct worker *w) {
+  struct outputbuf *ob;
+
+  /* Limit how much can pile up if the client isn't reading */
+  while(output_head && output_queued >= OUTPUTLIMIT)
+    ferrcheck(pthread_cond_wait(&output_space, &output_lock));
+  if((ob = output_spare)) {
+    output_spare = ob->next;
+    --output_nspare;
+  } else {
+    ob = sftp_xmalloc(sizeof *ob);
+    ob->buffer = 0;
+    ob->size = 0;
+  }
+  /* Swap buffers */
+  {
+    uint8_t *const buffer = ob->buffer;
+    const size_t size = ob->size;
+
+    ob->buffer = w->buffer;
+    ob->size = w->bufsize;
+    w->buffer = buffer;
+    w->bufsize = size;
+  }
+  ob->len = w->bufused;
+  ob->fd = -1;
+  ob->map = NULL;
+  ob->job = NULL;
+  ob->next = 0;
+  *output_tail = ob;
+  output_tail = &ob->next;
+  output_queued += ob->len;
+  ferrcheck(pthread_cond_signal(&output_ready));
+  return ob;
+}
+
+int sftp_send_zerocopy_init(void) {
+  struct stat sb;
+
+#if HAVE_SYS_SENDFILE_H && HAVE_SENDFILE
+  if(fstat(sftpout, &sb) >= 0 && (S_ISFIFO(sb.st_mode) || S_ISSOCK(sb.st_mode)))
+    sftp_zerocopy = 1;
+#else
+  (void)sb;
+#endif
+  return sftp_zerocopy;
+}
+
+uint32_t sftp_send_end_file(struct sftpjob *job, int fd, uint64_t offset,
+                            size_t count) {
+  pthread_mutex_t *const lock = output_mutex();
+  struct worker *const w = job->worker;
+  struct outputbuf *ob;
+  uint32_t rc = HANDLER_RESPONDED;
+  int dupfd;
+
+  assert(w->bufused < 0x80000000);
+  *(uint32_t *)w->buffer = htonl(w->bufused - 4 + count);
+  if(sftp_trace_enabled)
+    sftp_trace(w, trace_response, w->buffer + 4, w->bufused - 4,
+               w->bufused - 4 + count);
+  if(sftp_capturing)
+    sftp_capture_response(w->buffer + 4, w->bufused - 4);
+  SFTP_PROBE(response_sent, w->buffer + 4, w->bufused - 4,
+             w->bufused - 4 + count);
+  ferrcheck(pthread_mutex_lock(lock));
+  if(output_batch) {
+    /* The handle may be closed before the output thread gets to it */
+    if((dupfd = dup(fd)) < 0)
+      sftp_fatal("error calling dup: %s", strerror(errno));
+    ob = output_enqueue(w);
+    ob->fd = dupfd;
+    ob->offset = offset;
+    ob->count = count;
+    /* The output thread finishes the job once it has read the file */
+    ob->job = job;
+    rc = HANDLER_ASYNC;
+  } else {
+    struct iovec iov;
+
+    iov.iov_base = w->buffer;
+    iov.iov_len = w->bufused;
+    output_writev(&iov, 1);
+    output_file(fd, offset, count);
+  }
+  ferrcheck(pthread_mutex_unlock(lock));
+  sendpool_release(w);
+  w->bufused = 0x80000000;
+  return rc;
+}
+
+uint32_t sftp_send_end_map(struct sftpjob *job, struct mapwindow *m,
+                           const uint8_t *data, size_t count) {
+  pthread_mutex_t *const lock = output_mutex();
+  struct worker *const w = job->worker;
+  struct outputbuf *ob;
+  uint32_t rc = HANDLER_RESPONDED;
+
+  assert(w->bufused < 0x80000000);
+  *(uint32_t *)w->buffer = htonl(w->bufused - 4 + count);
+  if(sftp_trace_enabled)
+    sftp_trace(w, trace_response, w->buffer + 4, w->bufused - 4,
+               w->bufused - 4 + count);
+  if(sftp_capturing)
+    sftp_capture_response(w->buffer + 4, w->bufused - 4);
+  SFTP_PROBE(response_sent, w->buffer + 4, w->bufused - 4,
+             w->bufused - 4 + count);
+  ferrcheck(pthread_mutex_lock(lock));
+  if(output_batch) {
+    /* The output thread drops the reference once the data is written */
+    ob = output_enqueue(w);
+    ob->map = m;
+    ob->mapdata = data;
+    ob->count = count;
+    m = NULL;
+    /* The output thread finishes the job once the data is written */
+    ob->job = job;
+    rc = HANDLER_ASYNC;
+  } else {
+    struct iovec iov[2];
+
+    iov[0].iov_base = w->buffer;
+    iov[0].iov_len = w->bufused;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = count;
+    output_mapped(iov, 2);
+  }
+  ferrcheck(pthread_mutex_unlock(lock));
+  if(m)
+    sftp_mapread_put(m);
+  sendpool_release(w);
+  w->bufused = 0x80000000;
+  return rc;
+}
+
 void sftp_send_end(struct worker *w) {
-  ssize_t n, written;
+  pthread_mutex_t *const lock = output_mutex();
+  struct iovec iov;
 
   assert(w->bufused < 0x80000000);
   /* Fill in length word.  The malloc'd area is assumed to be aligned
    * suitably. */
   *(uint32_t *)w->buffer = htonl(w->bufused - 4);
+  /* Trace records are copied out before taking the lock and written later,
+   * so tracing does not hold up other threads' output */
+  if(sftp_trace_enabled)
+    sftp_trace(w, trace_response, w->buffer + 4, w->bufused - 4,
+               w->bufused - 4);
+  if(sftp_capturing)
+    sftp_capture_response(w->buffer + 4, w->bufused - 4);
+  SFTP_PROBE(response_sent, w->buffer + 4, w->bufused - 4, w->bufused - 4);
   /* Write the complete output, protecting stdout with a lock to avoid
    * interleaving different responses. */
-  ferrcheck(pthread_mutex_lock(&output_lock));
-  if(sftp_debugging) {
+  ferrcheck(pthread_mutex_lock(lock));
+  if(sftp_debugging && !sftp_trace_enabled) {
     D(("%s:", sendtype));
     sftp_debug_hexdump(w->buffer + 4, w->bufused - 4);
   }
-  /* Write the whole buffer, coping with short writes */
-  written = 0;
-  while((size_t)written < w->bufused)
-    if((n = write(sftpout, w->buffer + written, w->bufused - written)) > 0)
-      written += n;
-    else if(n < 0)
-      sftp_fatal("error sending response: %s", strerror(errno));
-  ferrcheck(pthread_mutex_unlock(&output_lock));
+  if(output_batch)
+    output_enqueue(w);
+  else {
+    /* Write the whole buffer, coping with short writes */
+    iov.iov_base = w->buffer;
+    iov.iov_len = w->bufused;
+    output_writev(&iov, 1);
+  }
+  ferrcheck(pthread_mutex_unlock(lock));
+  sendpool_release(w);
   w->bufused = 0x80000000;
 }
 
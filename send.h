@@ -49,6 +49,49 @@ void sftp_send_begin(struct worker *w);
  */
 void sftp_send_end(struct worker *w);
 
+/** @brief Complete a message, taking its final bytes from a file
+ * @param job Job the message answers; its worker contains the message
+ * @param fd File to read from
+ * @param offset Offset in @p fd
+ * @param count Number of bytes to append from @p fd
+ * @return @ref HANDLER_ASYNC or @ref HANDLER_RESPONDED
+ *
+ * The bytes are not read into the message buffer; they are sent directly
+ * from @p fd to the output, with sendfile() if possible.  The caller must
+ * ensure that @p count bytes are actually available.  Only used if
+ * sftp_send_zerocopy_init() succeeded.
+ *
+ * If the output thread sends the message then it also finishes @p job, which
+ * stays serialized until the bytes have been read, and the return value is
+ * @ref HANDLER_ASYNC.  The handler should return whatever this returns.
+ */
+uint32_t sftp_send_end_file(struct sftpjob *job, int fd, uint64_t offset,
+                            size_t count);
+
+struct mapwindow;
+
+/** @brief Complete a message, taking its final bytes from a file mapping
+ * @param job Job the message answers; its worker contains the message
+ * @param m Mapping, from sftp_mapread_get()
+ * @param data Start of bytes to append, within @p m
+ * @param count Number of bytes to append
+ * @return @ref HANDLER_ASYNC or @ref HANDLER_RESPONDED
+ *
+ * The message header and the mapped bytes are written together with
+ * writev(), so the data is never copied into the message buffer.  The
+ * reference to @p m is dropped once the data has been written.
+ *
+ * As with sftp_send_end_file(), if the output thread sends the message then
+ * it also finishes @p job, and the handler should return what this returns.
+ */
+uint32_t sftp_send_end_map(struct sftpjob *job, struct mapwindow *m,
+                           const uint8_t *data, size_t count);
+
+/** @brief Lower limit for sftp_send_end_file()
+ *
+ * Below this size it's cheaper to copy the data. */
+#  define ZEROCOPYMIN 16384
+
 /** @brief Add an 8-bit value to a message
  * @param w Worker containing message
  * @param n Value to add to message
@@ -113,6 +156,67 @@ size_t sftp_send_sub_begin(struct worker *w);
  */
 void sftp_send_sub_end(struct worker *w, size_t offset);
 
+/** @brief Start the output thread
+ * @param batch Maximum number of messages per @c writev() call
+ *
+ * After this is called, sftp_send_end() queues messages for a background
+ * thread to write rather than writing them itself.  Messages are still
+ * written in the order sftp_send_end() is called.  If @p batch is 0 then
+ * nothing happens.
+ */
+void sftp_send_output_start(int batch);
+
+/** @brief Stop the output thread
+ *
+ * Any queued messages are written before returning.
+ */
+void sftp_send_output_stop(void);
+
+/** @brief Start pooling send buffers
+ * @param size Size of each buffer
+ * @param nspare Maximum number of spare buffers to keep, or 0 for no pool
+ * @param idle Seconds before an unused spare is freed, or 0 to keep them
+ * @param huge Non-0 to ask for huge pages
+ *
+ * Without a pool each worker keeps its own buffer, grown as needed, for as
+ * long as it exists.  With a pool, workers only hold a buffer while building
+ * a message.  Must be called before sftp_send_output_start().
+ */
+void sftp_send_pool_start(size_t size, int nspare, int idle, int huge);
+
+/** @brief Stop pooling send buffers
+ *
+ * Spare buffers are freed.  Must be called after sftp_send_output_stop().
+ */
+void sftp_send_pool_stop(void);
+
+/** @brief Send as much of a shared session's backlog as possible
+ * @param s Session
+ * @return Bytes still waiting to be sent
+ *
+ * Never blocks.  Called by the event loop when the session's socket is
+ * writable.  If writing fails then the backlog is discarded and the session
+ * shut down.
+ */
+size_t sftp_send_flush(struct session *s);
+
+/** @brief Find how much of a shared session's output is held back
+ * @param s Session
+ * @return Bytes waiting to be sent
+ */
+size_t sftp_send_backlog(struct session *s);
+
+/** @brief Enable zero-copy file output if possible
+ * @return Nonzero if zero-copy output is enabled
+ *
+ * Zero-copy output requires sendfile() and for @ref sftpout to be a pipe
+ * or socket.
+ */
+int sftp_send_zerocopy_init(void);
+
+/** @brief Nonzero if sftp_send_end_file() may be used */
+extern int sftp_zerocopy;
+
 /** @brief File descriptor to send messages to
  *
  * The default value is 1, i.e. standard output. */
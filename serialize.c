@@ -29,6 +29,10 @@
 #include "serialize.h"
 #include "debug.h"
 #include "globals.h"
+#include "pool.h"
+#include "readvec.h"
+#include "compress.h"
+#include "session.h"
 #include <string.h>
 #include <stdlib.h>
 
@@ -59,13 +63,46 @@
  * the <dirent.h> functions.  Indeed you could say this about any other
  * operation but readdir() is the most obvious one to worry about.
  *
+ * 5) Requests that only inspect the filesystem, such as @ref SSH_FXP_STAT or
+ * @ref SSH_FXP_READDIR, are 'queries'.  Reads cannot change what a query
+ * would see, so the two may be re-ordered.  A query must still wait for older
+ * barriers, writes and queries, and writes and barriers wait for older
+ * queries.  Queries are therefore processed in order with respect to one
+ * another, which keeps @ref SSH_FXP_READDIR safe, but do not wait behind
+ * bulk reads; sftpserver.c dispatches them to a dedicated worker.
+ *
+ * 6) By default reads on the same handle are not re-ordered (see
+ * reorderable()).  A client that matches responses to requests by ID can
+ * lift this with the @c read-order@rjk.greenend.org.uk extension.
+ *
+ * 7) A @ref READ_VECTOR request is queued as a read of the whole of its
+ * handle, so it can run alongside other reads and waits only for writes to
+ * the same handle.
  */
 
-/** @brief One job in the serialization queue */
+/** @brief One job in the serialization queue
+ *
+ * Each job records the jobs that it is blocking in @ref waiters, and the
+ * number of jobs blocking it in @ref nblockers.  These are worked out once,
+ * when the job is added to the queue, and completing a job only touches the
+ * jobs that were actually waiting for it.
+ */
 struct sqnode {
-  /** @brief The next job in the queue */
+  /** @brief The next older job in the queue */
   struct sqnode *older;
 
+  /** @brief The next newer job in the queue */
+  struct sqnode *newer;
+
+  /** @brief The queue this job is in */
+  struct serialqueue *queue;
+
+  /** @brief The next job in the same hash bucket */
+  struct sqnode *hnext;
+
+  /** @brief The previous job in the same hash bucket */
+  struct sqnode *hprev;
+
   /** @brief This job */
   struct sftpjob *job;
 
@@ -83,16 +120,37 @@ struct sqnode {
 
   /** @brief Request type */
   uint8_t type;
-};
 
-/** @brief The newest job in the queue */
-static struct sqnode *newest;
+  /** @brief Nonzero if no job may be re-ordered with respect to this one */
+  int barrier;
+
+  /** @brief Nonzero if this job is a query */
+  int query;
+
+  /** @brief Number of jobs blocking this one */
+  size_t nblockers;
 
-/** @brief Lock protecting the serialization queue */
-static pthread_mutex_t sq_mutex = PTHREAD_MUTEX_INITIALIZER;
+  /** @brief Jobs blocked by this one */
+  struct sqnode **waiters;
 
-/** @brief Condition variable signaling changes to the queue */
-static pthread_cond_t sq_cond = PTHREAD_COND_INITIALIZER;
+  /** @brief Number of jobs blocked by this one */
+  size_t nwaiters;
+
+  /** @brief Size of @ref waiters */
+  size_t nwaitersalloc;
+
+  /** @brief Condition variable signaled when @ref nblockers reaches 0 */
+  pthread_cond_t cond;
+};
+
+void serialize_init(struct serialqueue *sq) {
+  sftp_memset(sq, 0, sizeof *sq);
+  ferrcheck(pthread_mutex_init(&sq->lock, 0));
+}
+
+void serialize_destroy(struct serialqueue *sq) {
+  ferrcheck(pthread_mutex_destroy(&sq->lock));
+}
 
 /** @brief Test whether two handles are identical
  * @param h1 Handle
@@ -124,7 +182,7 @@ static int ranges_overlap(const struct sqnode *a, const struct sqnode *b) {
 
 /** @brief Test wether two jobs may be re-ordered
  * @param q1 Serialization queue entry
- * @param q2 Serialization queue entry
+ * @param q2 Serialization queue entry in the same queue
  * @param flags Flags for @p q1
  * @return Nonzero if the @p q1 and @p q2 may be re-ordered
  *
@@ -147,7 +205,8 @@ static int reorderable(const struct sqnode *q1, const struct sqnode *q2,
      * request order.  As a workaround we avoid re-ordering reads until a fix
      * is adequately widely deployed ("in Debian stable" seems like a good
      * measure). */
-    if(q1->type == SSH_FXP_READ && q2->type == SSH_FXP_READ)
+    if(q1->type == SSH_FXP_READ && q2->type == SSH_FXP_READ
+       && !q1->queue->reorder_reads)
       return 0;
     if(flags & (HANDLE_TEXT | HANDLE_APPEND))
       /* Operations on text or append-write files cannot be re-ordered. */
@@ -163,14 +222,61 @@ static int reorderable(const struct sqnode *q1, const struct sqnode *q2,
     return 0;
 }
 
-void queue_serializable_job(struct sftpjob *job) {
+/** @brief Find the hash bucket for a handle
+ * @param sq Serialization queue
+ * @param hid Handle
+ * @return Pointer to bucket
+ */
+static inline struct sqnode **bucket(struct serialqueue *sq,
+                                     const struct handleid *hid) {
+  return &sq->buckets[(hid->id ^ hid->tag * 31) % SQBUCKETS];
+}
+
+/** @brief Record that one job blocks another
+ * @param blocker Older job
+ * @param waiter Newer job that must wait for @p blocker
+ */
+static void block(struct sqnode *blocker, struct sqnode *waiter) {
+  if(blocker->nwaiters >= blocker->nwaitersalloc) {
+    blocker->nwaitersalloc =
+        blocker->nwaitersalloc ? 2 * blocker->nwaitersalloc : 4;
+    blocker->waiters = sftp_xrecalloc(
+        blocker->waiters, blocker->nwaitersalloc, sizeof *blocker->waiters);
+  }
+  blocker->waiters[blocker->nwaiters++] = waiter;
+  ++waiter->nblockers;
+}
+
+/** @brief Test whether a request type is a query
+ * @param type Request type
+ * @return Nonzero if requests of type @p type only inspect the filesystem
+ */
+static int is_query(uint8_t type) {
+  switch(type) {
+  case SSH_FXP_STAT:
+  case SSH_FXP_LSTAT:
+  case SSH_FXP_FSTAT:
+  case SSH_FXP_REALPATH:
+  case SSH_FXP_READLINK:
+  case SSH_FXP_OPENDIR:
+  case SSH_FXP_READDIR:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+int queue_serializable_job(struct sftpjob *job) {
   uint8_t type;
   uint32_t id;
   uint64_t offset, len64;
   uint32_t len;
   struct handleid hid;
   unsigned handleflags;
-  struct sqnode *q;
+  struct serialqueue *const sq = &job->session->sq;
+  struct sqnode *q, *oq;
+  const char *name;
+  size_t namelen;
 
   job->ptr = job->data;
   job->left = job->len;
@@ -185,6 +291,27 @@ void queue_serializable_job(struct sftpjob *job) {
     /* This is a well-formed read or write operation */
     len64 = len;
     handleflags = sftp_handle_flags(&hid);
+    /* A compressed write covers its uncompressed size */
+    if(type == SSH_FXP_WRITE && (handleflags & HANDLE_COMPRESS)) {
+      size_t raw;
+
+      if(sftp_compress_frame_size(job->ptr, len < job->left ? len : job->left,
+                                  &raw))
+        len64 = ~(uint64_t)0;
+      else
+        len64 = raw;
+    }
+  } else if(type == SSH_FXP_EXTENDED &&
+            sftp_parse_uint32(job, &id) == SSH_FX_OK &&
+            sftp_parse_view(job, &name, &namelen) == SSH_FX_OK &&
+            namelen == strlen(READ_VECTOR) &&
+            !memcmp(name, READ_VECTOR, namelen) &&
+            sftp_parse_handle(job, &hid) == SSH_FX_OK) {
+    /* A vectored read might touch any part of the file */
+    type = SSH_FXP_READ;
+    offset = 0;
+    len64 = ~(uint64_t)0;
+    handleflags = sftp_handle_flags(&hid);
   } else {
     /* Anything else has dummy values */
     sftp_memset(&hid, 0, sizeof hid);
@@ -192,57 +319,155 @@ void queue_serializable_job(struct sftpjob *job) {
     len64 = ~(uint64_t)0;
     handleflags = 0;
   }
-  ferrcheck(pthread_mutex_lock(&sq_mutex));
-  q = sftp_xmalloc(sizeof *q);
-  q->older = newest;
+  q = sftp_pool_alloc(sizeof *q);
+  sftp_memset(q, 0, sizeof *q);
   q->job = job;
+  q->queue = sq;
   q->type = type;
   q->hid = hid;
   q->handleflags = handleflags;
   q->offset = offset;
   q->len = len64;
-  newest = q;
-  ferrcheck(pthread_mutex_unlock(&sq_mutex));
+  q->query = sftpconf_reorder && is_query(type);
+  q->barrier = !sftpconf_reorder || (type != SSH_FXP_READ
+                                     && type != SSH_FXP_WRITE && !q->query);
+  ferrcheck(pthread_cond_init(&q->cond, 0));
+  job->sq = q;
+  ferrcheck(pthread_mutex_lock(&sq->lock));
+  if(q->barrier) {
+    /* A barrier must wait for everything older than it.  Anything older than
+     * the sq->newest existing barrier is already blocking that barrier, so we
+     * need only wait for it and anything newer. */
+    for(oq = sq->newest; oq; oq = oq->older) {
+      block(oq, q);
+      if(oq->barrier)
+        break;
+    }
+    sq->newest_barrier = q;
+  } else if(q->query) {
+    /* A query must wait for the newest barrier and for any write or query
+     * newer than it */
+    if(sq->newest_barrier)
+      block(sq->newest_barrier, q);
+    for(oq = sq->newest; oq && !oq->barrier; oq = oq->older)
+      if(oq->query || oq->type == SSH_FXP_WRITE)
+        block(oq, q);
+    ++sq->nqueries;
+  } else {
+    /* A read or write must wait for the newest barrier and for any
+     * conflicting operation on the same handle. */
+    if(sq->newest_barrier)
+      block(sq->newest_barrier, q);
+    for(oq = *bucket(sq, &hid); oq; oq = oq->hnext)
+      if(handles_equal(&oq->hid, &hid) && !reorderable(q, oq, handleflags))
+        block(oq, q);
+    /* A write must also wait for any query newer than the barrier */
+    if(sq->nqueries && type == SSH_FXP_WRITE)
+      for(oq = sq->newest; oq && !oq->barrier; oq = oq->older)
+        if(oq->query)
+          block(oq, q);
+    /* Jobs in a bucket are newest first */
+    if((q->hnext = *bucket(sq, &hid)))
+      q->hnext->hprev = q;
+    *bucket(sq, &hid) = q;
+  }
+  if((q->older = sq->newest))
+    sq->newest->newer = q;
+  sq->newest = q;
+  ferrcheck(pthread_mutex_unlock(&sq->lock));
+  return q->query;
+}
+
+uint64_t serialize_key(const struct sftpjob *job) {
+  const struct sqnode *const q = job->sq;
+  uint64_t key;
+
+  if(!q || q->barrier || q->query)
+    return 0;
+  /* Keep different sessions' handles apart too */
+  key = (uint64_t)(uintptr_t)q->queue * 0x9E3779B97F4A7C15ULL;
+  key ^= (uint64_t)q->hid.id << 32 | q->hid.tag;
+  return key ? key : 1;
 }
 
 void serialize(struct sftpjob *job) {
-  struct sqnode *q, *oq;
+  struct sqnode *const q = job->sq;
+  struct serialqueue *sq;
 
-  ferrcheck(pthread_mutex_lock(&sq_mutex));
-  for(;;) {
-    for(q = newest; q && q->job != job; q = q->older)
-      ;
-    /* If the job isn't in the queue then we process it straight away.  This
-     * shouldn't happen... */
-    if(!q)
-      break;
-    /* We've found our position in the queue.  See if there is any request on
-     * the same handle which blocks our request. */
-    for(oq = q->older; oq; oq = oq->older)
-      if(!reorderable(q, oq, q->handleflags))
-        break;
-    if(!oq)
-      break;
-    /* We found an blocking request.  Wait for it to be removed. */
-    ferrcheck(pthread_cond_wait(&sq_cond, &sq_mutex));
-  }
-  /* We did not find any blocking request.  We proceed. */
-  ferrcheck(pthread_mutex_unlock(&sq_mutex));
+  /* If the job isn't in the queue then we process it straight away.  This
+   * shouldn't happen... */
+  if(!q)
+    return;
+  sq = q->queue;
+  ferrcheck(pthread_mutex_lock(&sq->lock));
+  while(q->nblockers)
+    ferrcheck(pthread_cond_wait(&q->cond, &sq->lock));
+  ferrcheck(pthread_mutex_unlock(&sq->lock));
 }
 
 void serialize_remove_job(struct sftpjob *job) {
-  struct sqnode *q, **qq;
-
-  ferrcheck(pthread_mutex_lock(&sq_mutex));
-  for(qq = &newest; (q = *qq) && q->job != job; qq = &q->older)
-    ;
-  if(q) {
-    *qq = q->older;
-    free(q);
-    /* Wake up anything that's waiting */
-    ferrcheck(pthread_cond_broadcast(&sq_cond));
+  struct sqnode *const q = job->sq, *oq;
+  struct serialqueue *sq;
+  size_t n;
+
+  if(!q)
+    return;
+  sq = q->queue;
+  ferrcheck(pthread_mutex_lock(&sq->lock));
+  /* Jobs that are rejected before reaching serialize() must still not leave
+   * the queue ahead of their blockers, which hold pointers to them */
+  while(q->nblockers)
+    ferrcheck(pthread_cond_wait(&q->cond, &sq->lock));
+  /* Wake up anything that was only waiting for this job */
+  for(n = 0; n < q->nwaiters; ++n)
+    if(!--q->waiters[n]->nblockers)
+      ferrcheck(pthread_cond_signal(&q->waiters[n]->cond));
+  /* Unlink from the queue */
+  if(q->newer)
+    q->newer->older = q->older;
+  else
+    sq->newest = q->older;
+  if(q->older)
+    q->older->newer = q->newer;
+  if(q->barrier) {
+    if(sq->newest_barrier == q) {
+      for(oq = q->older; oq && !oq->barrier; oq = oq->older)
+        ;
+      sq->newest_barrier = oq;
+    }
+  } else if(q->query) {
+    --sq->nqueries;
+  } else {
+    if(q->hprev)
+      q->hprev->hnext = q->hnext;
+    else
+      *bucket(sq, &q->hid) = q->hnext;
+    if(q->hnext)
+      q->hnext->hprev = q->hprev;
   }
-  ferrcheck(pthread_mutex_unlock(&sq_mutex));
+  ferrcheck(pthread_mutex_unlock(&sq->lock));
+  ferrcheck(pthread_cond_destroy(&q->cond));
+  free(q->waiters);
+  sftp_pool_free(q);
+  job->sq = 0;
+}
+
+uint32_t sftp_vany_read_order(struct sftpjob *job) {
+  struct serialqueue *const sq = &job->session->sq;
+  char *order;
+
+  pcheck(sftp_parse_string_borrow(job, &order, 0));
+  D(("sftp_vany_read_order %s", order));
+  /* reorderable() runs in the input thread with the lock held */
+  ferrcheck(pthread_mutex_lock(&sq->lock));
+  if(!strcmp(order, "any"))
+    sq->reorder_reads = 1;
+  else if(!strcmp(order, "request"))
+    sq->reorder_reads = 0;
+  else
+    order = 0;
+  ferrcheck(pthread_mutex_unlock(&sq->lock));
+  return order ? SSH_FX_OK : SSH_FX_INVALID_PARAMETER;
 }
 
 /*
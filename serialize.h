@@ -23,11 +23,72 @@
 #ifndef SERIALIZE_H
 #  define SERIALIZE_H
 
+#  include <pthread.h>
+#  include <stddef.h>
+#  include <stdint.h>
+
+struct sqnode;
+
+#  ifndef SQBUCKETS
+/** @brief Number of hash buckets for reads and writes */
+#    define SQBUCKETS 64
+#  endif
+
+/** @brief A serialization queue
+ *
+ * Each session has its own, so requests from different sessions never wait
+ * for one another.
+ */
+struct serialqueue {
+  /** @brief The newest job in the queue */
+  struct sqnode *newest;
+
+  /** @brief The newest barrier job in the queue */
+  struct sqnode *newest_barrier;
+
+  /** @brief Number of queries in the queue */
+  size_t nqueries;
+
+  /** @brief Nonzero if reads on the same handle may be re-ordered
+   *
+   * Set by the @c read-order@rjk.greenend.org.uk extension. */
+  int reorder_reads;
+
+  /** @brief Reads and writes in the queue, hashed by handle */
+  struct sqnode *buckets[SQBUCKETS];
+
+  /** @brief Lock protecting the queue */
+  pthread_mutex_t lock;
+};
+
+/** @brief Initialize an empty serialization queue
+ * @param sq Queue to initialize
+ */
+void serialize_init(struct serialqueue *sq);
+
+/** @brief Destroy a serialization queue
+ * @param sq Queue to destroy, which must be empty
+ */
+void serialize_destroy(struct serialqueue *sq);
+
 /** @brief Establish a job's place in the serialization queue
  * @param job Job to establish
+ * @return Nonzero if @p job is a query that may overtake reads
+ *
+ * Called for every job, which joins its session's queue.  Queries are
+ * requests that only inspect the filesystem; they are kept in order with
+ * respect to everything except reads. */
+int queue_serializable_job(struct sftpjob *job);
+
+/** @brief Find the work queue flow for a job
+ * @param job Job established by queue_serializable_job()
+ * @return Nonzero key shared by reads and writes on the same handle, or 0
  *
- * Called for @ref SSH_FXP_READ and @ref SSH_FXP_WRITE. */
-void queue_serializable_job(struct sftpjob *job);
+ * Jobs with different keys never wait for each other in serialize(), so a
+ * fair work queue may take them in any order.  Every other job gets 0, so
+ * stays in order with respect to all of them.  Unrelated handles may share a
+ * key, which only makes the queue less fair. */
+uint64_t serialize_key(const struct sftpjob *job);
 
 /** @brief Serialize a job
  * @param job Job to serialize
@@ -0,0 +1,63 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file session.c @brief Per-session state */
+
+#include "sftpserver.h"
+#include "session.h"
+#include "handle.h"
+#include "statcache.h"
+#include "thread.h"
+#include "utils.h"
+#include <string.h>
+#include <stdlib.h>
+
+THREAD_LOCAL struct session *sftp_session;
+
+void sftp_session_init(struct session *s, int infd, int outfd, int shared) {
+  sftp_memset(s, 0, sizeof *s);
+  sftp_input_init(&s->in, s, infd, INPUTBUFFER);
+  serialize_init(&s->sq);
+  s->outfd = outfd;
+  s->state = sftp_state_run;
+  s->shared = shared;
+  ferrcheck(pthread_mutex_init(&s->output_lock, 0));
+}
+
+void sftp_session_destroy(struct session *s) {
+  sftp_session_enter(s);
+  sftp_handle_close_all();
+  /* Closing may have flushed buffered writes */
+  sftp_statcache_settle();
+  sftp_input_destroy(&s->in);
+  serialize_destroy(&s->sq);
+  free(s->backlog);
+  ferrcheck(pthread_mutex_destroy(&s->output_lock));
+  sftp_session = NULL;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
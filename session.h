@@ -0,0 +1,154 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file session.h @brief Per-session state interface
+ *
+ * Everything that belongs to one client connection lives in a @ref session.
+ * Normally a process serves one session at a time, but with the @c multiplex
+ * directive one process serves many, sharing its worker threads, handle
+ * table and caches between them.
+ *
+ * Each thread has a current session, set by sftp_session_enter() whenever it
+ * starts work on a request.  The selected protocol, session state, handle
+ * lookups and output all follow it.
+ */
+
+#ifndef SESSION_H
+#  define SESSION_H
+
+#  include "input.h"
+#  include "serialize.h"
+#  include "globals.h"
+
+/** @brief State for one client connection */
+struct session {
+  /** @brief Request reader */
+  struct sftpinput in;
+
+  /** @brief Serialization queue */
+  struct serialqueue sq;
+
+  /** @brief Descriptor responses are written to */
+  int outfd;
+
+  /** @brief Selected protocol */
+  const struct sftpprotocol *protocol;
+
+  /** @brief Session state */
+  enum sftp_state state;
+
+  /** @brief Non-0 while the client may still send @c version-select
+   *
+   * Set when version 6 is negotiated and cleared once any further request
+   * has been handled. */
+  int selectable;
+
+  /** @brief Non-0 if this session shares its process with others
+   *
+   * Shared sessions serialize output with @ref output_lock instead of the
+   * process-wide lock in send.c, and a failed write ends the session rather
+   * than the process. */
+  int shared;
+
+  /** @brief Lock serializing output for a shared session
+   *
+   * Also protects the backlog. */
+  pthread_mutex_t output_lock;
+
+  /** @brief Responses the client has not yet accepted, or a null pointer
+   *
+   * A shared session's socket is never written in a way that blocks, so that
+   * a client that stops reading cannot hold up the workers that the other
+   * sessions depend on.  What the socket will not take at once waits here
+   * for the event loop; see sftp_send_flush(). */
+  uint8_t *backlog;
+
+  /** @brief Offset of the first unsent byte in @ref backlog */
+  size_t backlog_start;
+
+  /** @brief Offset just past the last unsent byte in @ref backlog */
+  size_t backlog_end;
+
+  /** @brief Size of @ref backlog */
+  size_t backlog_size;
+
+  /** @brief Non-0 once writing to the client has failed */
+  int broken;
+
+  /** @brief Non-0 while the event loop waits for the in-flight budget */
+  int stalled;
+
+  /** @brief Non-0 once the client has closed its end */
+  int eof;
+
+  /** @brief Non-0 once the event loop is ending the session */
+  int ending;
+
+  /** @brief Next session in the event loop */
+  struct session *next;
+};
+
+/** @brief The calling thread's current session, or a null pointer */
+extern THREAD_LOCAL struct session *sftp_session;
+
+/** @brief Initialize a session
+ * @param s Session to initialize
+ * @param infd Descriptor to read requests from
+ * @param outfd Descriptor to write responses to
+ * @param shared Non-0 if the session shares its process with others
+ *
+ * The caller sets @c s->protocol.
+ */
+void sftp_session_init(struct session *s, int infd, int outfd, int shared);
+
+/** @brief Destroy a session
+ * @param s Session to destroy
+ *
+ * Every request must have been freed.  Any handles the client left open are
+ * closed.  The descriptors are not closed.  Becomes the calling thread's
+ * current session.
+ */
+void sftp_session_destroy(struct session *s);
+
+/** @brief Make a session the calling thread's current session
+ * @param s Session
+ */
+static inline void sftp_session_enter(struct session *s) {
+  sftp_session = s;
+  protocol = s->protocol;
+}
+
+/** @brief Select the protocol for the current session
+ * @param p Protocol
+ */
+static inline void sftp_session_protocol(const struct sftpprotocol *p) {
+  protocol = sftp_session->protocol = p;
+}
+
+#endif /* SESSION_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
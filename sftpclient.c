@@ -32,6 +32,16 @@
 #include "thread.h"
 #include "stat.h"
 #include "charset.h"
+#include "hash.h"
+#include "delta.h"
+#include "statbatch.h"
+#include "walk.h"
+#include "bulk.h"
+#include "watch.h"
+#include "wholefile.h"
+#include "readvec.h"
+#include "compress.h"
+#include "putword.h"
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,9 +54,11 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <libgen.h>
 #include <assert.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <locale.h>
 #include <sys/time.h>
 #include <langinfo.h>
@@ -108,17 +120,38 @@ static uint32_t attrmask;
 static const char *rename_extension;
 static const char *hardlink_extension;
 static const char *statvfs_extension;
-
-const struct sftpprotocol *protocol = &sftp_v3;
+static const char *copydata_extension;
+static const char *checkfile_extension;
+static const char *limits_extension;
+static const char *fsync_extension;
+static const char *read_order_extension;
+static int read_order_sent;
+static int delta_extension;
+static int stat_batch_extension;
+static int readdir_mask_extension;
+static int walk_extension;
+static int remove_tree_extension;
+static int rename_batch_extension;
+static int watch_extension;
+static struct client_handle watch_handle; /* data is 0 if not watching */
+static int put_file_extension;
+static int get_file_extension;
+static int read_vector_extension;
+static int compress_extension;
+static const char *compress_methods; /* wanted methods, or null pointer */
+
+THREAD_LOCAL const struct sftpprotocol *protocol = &sftp_v3;
 const char sendtype[] = "request";
 
 /* Command line */
 static size_t buffersize = 32768;
 static int nrequests = 16;
+static int adaptive = 1;
 static const char *subsystem;
 static const char *program;
 static const char *program_debugpath;
 static const char *program_config;
+static const char **server_command; /* null with --host */
 static const char *batchfile;
 static int sshversion;
 static int compress;
@@ -143,6 +176,7 @@ enum {
   OPT_FORCE_VERSION,
   OPT_PROGRAM_DEBUG_PATH,
   OPT_PROGRAM_CONFIG,
+  OPT_FIXED_WINDOW,
 };
 
 static const struct option options[] = {
@@ -154,6 +188,7 @@ static const struct option options[] = {
     {"program", required_argument, 0, 'P'},
     {"program-config", required_argument, 0, OPT_PROGRAM_CONFIG},
     {"requests", required_argument, 0, 'R'},
+    {"fixed-window", no_argument, 0, OPT_FIXED_WINDOW},
     {"subsystem", required_argument, 0, 's'},
     {"sftp-version", required_argument, 0, 'S'},
     {"quirk-reverse-symlink", no_argument, 0, OPT_QUIRK_REVERSE_SYMLINK},
@@ -195,6 +230,7 @@ static void attribute((noreturn)) help(void) {
       "  -b, --batch PATH         Read batch file\n"
       "  -P, --program PATH       Execute program as SFTP server\n"
       "  -R, --requests COUNT     Maximum outstanding requests (default 8)\n"
+      "  --fixed-window           Don't adapt -B and -R to the link\n"
       "  -s, --subsystem NAME     Remote subsystem name\n"
       "  -S, --sftp-version VER   Protocol version to request (default 3)\n"
       "  --echo                   Echo commands\n"
@@ -337,15 +373,161 @@ static char *remote_cwd(void) {
   return cwd;
 }
 
-static void progress(const char *path, uint64_t sofar, uint64_t total) {
+/* Seconds since some arbitrary point */
+static double monotonic_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* Adaptive pipelining.  Downloads and uploads time each request and adjust
+ * the number of requests in flight and their size to suit the link.  The
+ * difference between the smoothed and the quickest round trip estimates how
+ * many requests are queued rather than travelling.  While that is small the
+ * pipe is not full, so the window grows: first the request size, up to the
+ * server's advertised limit, then the number of requests.  When many
+ * requests are queueing the window shrinks again.  In between, the request
+ * size keeps growing for as long as that improves goodput. */
+
+/* Most requests left in flight */
+#define MAXREQUESTS 128
+
+/* Fewest requests left in flight */
+#define MINREQUESTS 4
+
+/* Largest request size, whatever the server says */
+#define MAXBUFFER 4194304
+
+/* Most bytes left in flight */
+#define MAXWINDOW 67108864
+
+struct pipeline {
+  int adapt;       /* non-0 to adjust depth and size */
+  int depth;       /* requests to keep in flight */
+  int maxdepth;    /* size of request tables */
+  size_t size;     /* bytes per request */
+  size_t maxsize;  /* largest request size */
+  double minrtt;   /* quickest round trip seen, or 0 */
+  double srtt;     /* smoothed round trip */
+  double started;  /* start of this interval */
+  uint64_t bytes;  /* bytes transferred this interval */
+  int responses;   /* responses this interval */
+  double rate;     /* goodput over the last interval in bytes/second */
+  double sizerate; /* goodput when the size was last raised */
+};
+
+/* Server limits from limits@openssh.com, or 0 if unknown */
+static uint64_t max_read_length, max_write_length;
+static int limits_known;
+
+/* Find out how large the server will let requests get */
+static void server_limits(void) {
+  uint64_t packet;
+  uint32_t id;
+
+  if(limits_known)
+    return;
+  limits_known = 1;
+  if(!limits_extension)
+    return;
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, limits_extension);
+  sftp_send_end(&fakeworker);
+  if(getresponse(SSH_FXP_EXTENDED_REPLY, id, limits_extension) !=
+     SSH_FXP_EXTENDED_REPLY)
+    return;
+  cpcheck(sftp_parse_uint64(&fakejob, &packet));
+  cpcheck(sftp_parse_uint64(&fakejob, &max_read_length));
+  cpcheck(sftp_parse_uint64(&fakejob, &max_write_length));
+}
+
+/* Set up the pipeline for a transfer */
+static void pipeline_init(struct pipeline *p, int upload) {
+  uint64_t limit;
+
+  sftp_memset(p, 0, sizeof *p);
+  p->adapt = adaptive;
+  p->depth = nrequests;
+  p->maxdepth = (p->adapt && nrequests < MAXREQUESTS) ? MAXREQUESTS
+                                                       : nrequests;
+  p->size = p->maxsize = buffersize;
+  if(p->adapt) {
+    server_limits();
+    limit = upload ? max_write_length : max_read_length;
+    if(limit > MAXBUFFER)
+      limit = MAXBUFFER;
+    if(limit > p->maxsize)
+      p->maxsize = limit;
+  }
+  p->started = monotonic_now();
+}
+
+/* Note a response to a request sent at time SENT that moved BYTES bytes */
+static void pipeline_response(struct pipeline *p, double sent, size_t bytes) {
+  const double now = monotonic_now(), rtt = now - sent;
+  double queued;
+
+  p->bytes += bytes;
+  ++p->responses;
+  if(!p->minrtt || rtt < p->minrtt)
+    p->minrtt = rtt;
+  p->srtt = p->srtt ? p->srtt + (rtt - p->srtt) / 8 : rtt;
+  /* Review once per round trip and per window of responses */
+  if(now - p->started < p->srtt || p->responses < p->depth)
+    return;
+  p->rate = p->bytes / (now - p->started);
+  p->started = now;
+  p->bytes = 0;
+  p->responses = 0;
+  if(!p->adapt)
+    return;
+  queued = p->depth * (1 - p->minrtt / p->srtt);
+  if(queued > 4 + p->depth / 4) {
+    if(p->depth > MINREQUESTS) {
+      p->depth -= p->depth / 4;
+      if(p->depth < MINREQUESTS)
+        p->depth = MINREQUESTS;
+    }
+  } else if((double)p->depth * p->size >= MAXWINDOW) {
+    /* big enough */
+  } else if(p->sizerate && p->rate < p->sizerate * 0.9) {
+    /* The last size increase made things worse */
+    if(p->size / 2 >= buffersize)
+      p->size /= 2;
+    p->maxsize = p->size;
+    p->sizerate = 0;
+    p->minrtt = p->srtt = 0;
+  } else if(p->size < p->maxsize &&
+            (queued < 2 || p->rate > p->sizerate * 1.1)) {
+    p->size = p->size * 2 < p->maxsize ? p->size * 2 : p->maxsize;
+    p->sizerate = p->rate;
+    /* Bigger requests take longer, so measure again */
+    p->minrtt = p->srtt = 0;
+  } else if(queued < 2 && p->depth < p->maxdepth) {
+    p->depth += p->depth / 2;
+    if(p->depth > p->maxdepth)
+      p->depth = p->maxdepth;
+  }
+}
+
+static void progress(const char *path, uint64_t sofar, uint64_t total,
+                     const struct pipeline *p) {
   if(progress_indicators) {
     if(!total)
       sftp_xprintf("\r%*s\r", terminal_width, "");
-    else if(total == (uint64_t)-1)
-      sftp_xprintf("\r%.60s: %12" PRIu64 "b", path, sofar);
-    else
-      sftp_xprintf("\r%.60s: %12" PRIu64 "b %3d%%", path, sofar,
-                   (int)(100 * sofar / total));
+    else {
+      if(total == (uint64_t)-1)
+        sftp_xprintf("\r%.40s: %12" PRIu64 "b", path, sofar);
+      else
+        sftp_xprintf("\r%.40s: %12" PRIu64 "b %3d%%", path, sofar,
+                     (int)(100 * sofar / total));
+      if(p && p->rate)
+        sftp_xprintf(" %dx%zuK %.1fMB/s", p->depth, p->size / 1024,
+                     p->rate / 1048576);
+    }
     if(fflush(stdout) < 0)
       sftp_fatal("error writing to stdout: %s", strerror(errno));
   }
@@ -357,6 +539,9 @@ static int sftp_init(void) {
   uint32_t version, u32;
   uint16_t u16;
 
+  read_order_sent = 0;
+  limits_known = 0;
+  max_read_length = max_write_length = 0;
   /* Send SSH_FXP_INIT */
   sftp_send_begin(&fakeworker);
   sftp_send_uint8(&fakeworker, SSH_FXP_INIT);
@@ -438,6 +623,8 @@ static int sftp_init(void) {
       cpcheck(sftp_parse_uint32(&xjob, &u32)); /* supported-open-flags */
       cpcheck(sftp_parse_uint32(&xjob, &u32)); /* supported-access-mask */
       cpcheck(sftp_parse_uint32(&xjob, &u32)); /* max-read-size */
+      if(u32)
+        max_read_length = u32;
       while(xjob.left)
         cpcheck(sftp_parse_string(&xjob, 0, 0)); /* extension-names */
     } else if(!strcmp(xname, "supported2")) {
@@ -453,6 +640,8 @@ static int sftp_init(void) {
       cpcheck(sftp_parse_uint32(&xjob, &u32)); /* supported-open-flags */
       cpcheck(sftp_parse_uint32(&xjob, &u32)); /* supported-access-mask */
       cpcheck(sftp_parse_uint32(&xjob, &u32)); /* max-read-size */
+      if(u32)
+        max_read_length = u32;
       cpcheck(sftp_parse_uint16(&xjob, &u16)); /* supported-open-block-vector */
       cpcheck(sftp_parse_uint16(&xjob, &u16)); /* supported-block-vector */
       cpcheck(sftp_parse_uint32(&xjob, &u32)); /* attrib-extension-count */
@@ -472,6 +661,39 @@ static int sftp_init(void) {
       rename_extension = "posix-rename@openssh.com";
     } else if(!strcmp(xname, "hardlink@openssh.com") && !strcmp(xdata, "1")) {
       hardlink_extension = "hardlink@openssh.com";
+    } else if(!strcmp(xname, DELTA_APPLY) && !strcmp(xdata, "1")) {
+      delta_extension = 1;
+    } else if(!strcmp(xname, "check-file-name")) {
+      checkfile_extension = "check-file-name";
+    } else if(!strcmp(xname, "copy-data") && !strcmp(xdata, "1")) {
+      copydata_extension = "copy-data";
+    } else if(!strcmp(xname, "fsync@openssh.com") && !strcmp(xdata, "1")) {
+      fsync_extension = "fsync@openssh.com";
+    } else if(!strcmp(xname, "limits@openssh.com") && !strcmp(xdata, "1")) {
+      limits_extension = "limits@openssh.com";
+    } else if(!strcmp(xname, "read-order@rjk.greenend.org.uk")
+              && !strcmp(xdata, "1")) {
+      read_order_extension = "read-order@rjk.greenend.org.uk";
+    } else if(!strcmp(xname, STAT_BATCH) && !strcmp(xdata, "1")) {
+      stat_batch_extension = 1;
+    } else if(!strcmp(xname, READDIR_MASK) && !strcmp(xdata, "1")) {
+      readdir_mask_extension = 1;
+    } else if(!strcmp(xname, WALK) && !strcmp(xdata, "1")) {
+      walk_extension = 1;
+    } else if(!strcmp(xname, REMOVE_TREE) && !strcmp(xdata, "1")) {
+      remove_tree_extension = 1;
+    } else if(!strcmp(xname, RENAME_BATCH) && !strcmp(xdata, "1")) {
+      rename_batch_extension = 1;
+    } else if(!strcmp(xname, WATCH) && !strcmp(xdata, "1")) {
+      watch_extension = 1;
+    } else if(!strcmp(xname, PUT_FILE) && !strcmp(xdata, "1")) {
+      put_file_extension = 1;
+    } else if(!strcmp(xname, GET_FILE) && !strcmp(xdata, "1")) {
+      get_file_extension = 1;
+    } else if(!strcmp(xname, READ_VECTOR) && !strcmp(xdata, "1")) {
+      read_vector_extension = 1;
+    } else if(!strcmp(xname, COMPRESS) && !strcmp(xdata, "1")) {
+      compress_extension = 1;
     } else if(!strcmp(xname, "statvfs@openssh.com") && !strcmp(xdata, "2")) {
       statvfs_extension = "statvfs@openssh.com";
     }
@@ -652,6 +874,129 @@ static int sftp_close(const struct client_handle *hp) {
   return status();
 }
 
+/* Compress reads and writes on a handle, if that's wanted and available.
+ * Returns the method chosen or a null pointer. */
+static const struct sftpcompressor *sftp_compress(
+    const struct client_handle *hp) {
+  uint32_t id;
+  char *name;
+
+  if(!compress_methods || !compress_extension || textmode)
+    return NULL;
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, COMPRESS);
+  sftp_send_bytes(&fakeworker, hp->data, hp->len);
+  sftp_send_string(&fakeworker, compress_methods);
+  sftp_send_end(&fakeworker);
+  /* If the server can't help, carry on without */
+  if(getresponse(-1, id, COMPRESS) != SSH_FXP_EXTENDED_REPLY)
+    return NULL;
+  cpcheck(sftp_parse_string(&fakejob, &name, 0));
+  return *name ? sftp_compress_choose(name) : NULL;
+}
+
+static int sftp_readdir_mask(const struct client_handle *hp, uint32_t mask) {
+  uint32_t id;
+
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, READDIR_MASK);
+  sftp_send_bytes(&fakeworker, hp->data, hp->len);
+  sftp_send_uint32(&fakeworker, mask);
+  sftp_send_end(&fakeworker);
+  getresponse(SSH_FXP_STATUS, id, READDIR_MASK);
+  return status();
+}
+
+/* Upload the whole of a small file in one request */
+static int sftp_put_file(int fd, const char *local, const char *path,
+                         uint32_t flags, const struct sftpattr *attrs,
+                         size_t size) {
+  uint32_t id;
+  size_t got = 0;
+  ssize_t n;
+  char *data;
+
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, PUT_FILE);
+  sftp_send_path(&fakejob, &fakeworker, path);
+  sftp_send_uint32(&fakeworker, flags);
+  protocol->sendattrs(&fakejob, attrs);
+  /* We read straight into our output buffer */
+  sftp_send_need(&fakeworker, size + 4);
+  data = (char *)fakeworker.buffer + fakeworker.bufused + 4;
+  while(got < size) {
+    if((n = read(fd, data + got, size - got)) < 0)
+      return error("error reading %s: %s", local, strerror(errno));
+    if(!n)
+      break;
+    got += n;
+  }
+  sftp_send_uint32(&fakeworker, got);
+  fakeworker.bufused += got;
+  sftp_send_end(&fakeworker);
+  getresponse(SSH_FXP_STATUS, id, PUT_FILE);
+  return status();
+}
+
+/* Download the whole of a small file in one request.  Returns 1 if the file
+ * is too large, in which case the caller should read it the usual way. */
+static int sftp_get_file(const char *path, uint32_t flags, uint32_t maxlen,
+                         int fd, const char *local, struct sftpattr *attrs,
+                         uint64_t *sizep) {
+  uint32_t id, st;
+  size_t len;
+  char *data;
+  ssize_t n;
+
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, GET_FILE);
+  sftp_send_path(&fakejob, &fakeworker, path);
+  sftp_send_uint32(&fakeworker, flags);
+  sftp_send_uint32(&fakeworker, maxlen);
+  sftp_send_end(&fakeworker);
+  if(getresponse(-1, id, GET_FILE) == SSH_FXP_STATUS) {
+    cpcheck(sftp_parse_uint32(&fakejob, &st));
+    if(st == SSH_FX_FAILURE)
+      return 1;
+    if(!status())
+      return error("unexpected success from %s", GET_FILE);
+    return -1;
+  }
+  cpcheck(protocol->parseattrs(&fakejob, attrs));
+  cpcheck(sftp_parse_string(&fakejob, &data, &len));
+  *sizep = len;
+  while(len > 0) {
+    if((n = write(fd, data, len)) < 0)
+      return error("error writing %s: %s", local, strerror(errno));
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int sftp_fsync(const struct client_handle *hp) {
+  uint32_t id;
+
+  if(!fsync_extension)
+    return error("no fsync extension found");
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, fsync_extension);
+  sftp_send_bytes(&fakeworker, hp->data, hp->len);
+  sftp_send_end(&fakeworker);
+  getresponse(SSH_FXP_STATUS, id, fsync_extension);
+  return status();
+}
+
 static int sftp_setstat(const char *path, const struct sftpattr *attrs) {
   uint32_t id;
 
@@ -785,8 +1130,10 @@ static int sftp_link(const char *targetpath, const char *linkpath,
   return status();
 }
 
-static int sftp_open(const char *path, uint32_t desired_access, uint32_t flags,
-                     const struct sftpattr *attrs, struct client_handle *hp) {
+/* Send an SSH_FXP_OPEN request without waiting for the reply */
+static int sftp_open_send(const char *path, uint32_t desired_access,
+                          uint32_t flags, const struct sftpattr *attrs,
+                          uint32_t *idp) {
   uint32_t id, pflags = 0;
 
   remote_cwd();
@@ -845,6 +1192,16 @@ static int sftp_open(const char *path, uint32_t desired_access, uint32_t flags,
     protocol->sendattrs(&fakejob, attrs);
     sftp_send_end(&fakeworker);
   }
+  *idp = id;
+  return 0;
+}
+
+static int sftp_open(const char *path, uint32_t desired_access, uint32_t flags,
+                     const struct sftpattr *attrs, struct client_handle *hp) {
+  uint32_t id;
+
+  if(sftp_open_send(path, desired_access, flags, attrs, &id))
+    return -1;
   if(getresponse(SSH_FXP_HANDLE, id, "SSH_FXP_OPEN") != SSH_FXP_HANDLE)
     return -1;
   cpcheck(sftp_parse_string(&fakejob, &hp->data, &hp->len));
@@ -1132,6 +1489,12 @@ static int cmd_ls(int ac, char **av, unsigned options) {
     singlefile = 0;
     if(sftp_opendir(path, &h))
       return -1;
+    /* A short listing sorted by name needs nothing but names */
+    if(readdir_mask_extension && !strpbrk(ls_options, "lnSt") &&
+       sftp_readdir_mask(&h, 0)) {
+      sftp_close(&h);
+      return -1;
+    }
     for(;;) {
       if(sftp_readdir(&h, &attrs, &nattrs)) {
         sftp_close(&h);
@@ -1361,9 +1724,55 @@ static int cmd_chmod(int attribute((unused)) ac, char **av, unsigned options) {
   return sftp_setstat(sftp_fullpath(&fakejob, av[1], options), &attrs);
 }
 
-static int cmd_rm(int attribute((unused)) ac, char **av, unsigned options) {
+/* Remove a whole tree.  NAME is how the user referred to PATH. */
+static int remove_tree(const char *path, const char *name) {
+  uint32_t id, failed, listed, st, i;
+  uint64_t removed;
+  char *rel;
+
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, REMOVE_TREE);
+  sftp_send_path(&fakejob, &fakeworker, path);
+  sftp_send_end(&fakeworker);
+  if(getresponse(SSH_FXP_EXTENDED_REPLY, id, REMOVE_TREE) !=
+     SSH_FXP_EXTENDED_REPLY)
+    return -1;
+  cpcheck(sftp_parse_uint64(&fakejob, &removed));
+  cpcheck(sftp_parse_uint32(&fakejob, &failed));
+  cpcheck(sftp_parse_uint32(&fakejob, &listed));
+  D(("removed %" PRIu64 " entries under %s", removed, path));
+  for(i = 0; i < listed; ++i) {
+    cpcheck(sftp_parse_path(&fakejob, &rel));
+    cpcheck(sftp_parse_uint32(&fakejob, &st));
+    if(!strcmp(rel, "."))
+      error("%s: %s", name, status_to_string(st));
+    else
+      error("%s/%s: %s", name, rel, status_to_string(st));
+  }
+  if(failed > listed)
+    error("%s: %" PRIu32 " more failures", name, failed - listed);
+  return failed ? -1 : 0;
+}
+
+static int cmd_rm(int ac, char **av, unsigned options) {
+  int recursive = 0, rc = 0;
+
+  if(!strcmp(av[0], "-r")) {
+    recursive = 1;
+    ++av;
+    if(!--ac)
+      return error("no paths to remove");
+    if(!remove_tree_extension)
+      return error("no remove-tree extension found");
+  }
   remote_cwd();
-  return sftp_remove(sftp_fullpath(&fakejob, av[0], options));
+  for(; ac > 0; --ac, ++av)
+    if((recursive ? remove_tree(sftp_fullpath(&fakejob, *av, options), *av)
+                  : sftp_remove(sftp_fullpath(&fakejob, *av, options))))
+      rc = -1;
+  return rc;
 }
 
 static int cmd_rmdir(int attribute((unused)) ac, char **av, unsigned options) {
@@ -1371,16 +1780,70 @@ static int cmd_rmdir(int attribute((unused)) ac, char **av, unsigned options) {
   return sftp_rmdir(sftp_fullpath(&fakejob, av[0], options));
 }
 
-static int cmd_mv(int attribute((unused)) ac, char **av, unsigned options) {
+/* Rename OLDPATHS[i] to NEWPATHS[i] for each I in one request.  NAMES are
+ * how the user referred to the old paths. */
+static int sftp_rename_batch(int n, const char **oldpaths,
+                             const char **newpaths, char **names) {
+  uint32_t id, failed, index, st;
+  int i;
+
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, RENAME_BATCH);
+  sftp_send_uint32(&fakeworker, n);
+  for(i = 0; i < n; ++i) {
+    sftp_send_path(&fakejob, &fakeworker, oldpaths[i]);
+    sftp_send_path(&fakejob, &fakeworker, newpaths[i]);
+  }
+  sftp_send_end(&fakeworker);
+  if(getresponse(SSH_FXP_EXTENDED_REPLY, id, RENAME_BATCH) !=
+     SSH_FXP_EXTENDED_REPLY)
+    return -1;
+  cpcheck(sftp_parse_uint32(&fakejob, &failed));
+  for(i = 0; i < (int)failed; ++i) {
+    cpcheck(sftp_parse_uint32(&fakejob, &index));
+    cpcheck(sftp_parse_uint32(&fakejob, &st));
+    if(index >= (uint32_t)n)
+      sftp_fatal("bad index in %s reply", RENAME_BATCH);
+    error("%s: %s", names[index], status_to_string(st));
+  }
+  return failed ? -1 : 0;
+}
+
+/* Move each of PATHS into directory DIR, keeping its last component */
+static int mv_into(int n, char **paths, const char *dir, unsigned options) {
+  const char **oldpaths, **newpaths;
+  const char *base, *newdir = sftp_fullpath(&fakejob, dir, options);
+  char *newpath;
+  int i;
+
+  if(!rename_batch_extension)
+    return error("no posix-rename-batch extension found");
+  oldpaths = sftp_alloc(fakejob.a, n * sizeof *oldpaths);
+  newpaths = sftp_alloc(fakejob.a, n * sizeof *newpaths);
+  for(i = 0; i < n; ++i) {
+    oldpaths[i] = sftp_fullpath(&fakejob, paths[i], options);
+    base = strrchr(oldpaths[i], '/');
+    base = base ? base + 1 : oldpaths[i];
+    newpath = sftp_alloc(fakejob.a, strlen(newdir) + strlen(base) + 2);
+    strcpy(newpath, newdir);
+    strcat(newpath, "/");
+    strcat(newpath, base);
+    newpaths[i] = newpath;
+  }
+  return sftp_rename_batch(n, oldpaths, newpaths, paths);
+}
+
+static int cmd_mv(int ac, char **av, unsigned options) {
+  unsigned flags = 0;
+  int posixrename = 0;
+
   remote_cwd();
-  if(ac == 3) {
-    const char *ptr = av[0];
+  if(ac >= 3 && av[0][0] == '-') {
+    const char *ptr = av[0] + 1;
     int c;
-    unsigned flags = 0;
-    int posixrename = 0;
 
-    if(*ptr++ != '-')
-      return error("invalid options '%s'", av[0]);
     while((c = *ptr++)) {
       switch(c) {
       case 'n':
@@ -1399,15 +1862,23 @@ static int cmd_mv(int attribute((unused)) ac, char **av, unsigned options) {
         return error("invalid options '%s'", av[0]);
       }
     }
-    if(posixrename)
-      return sftp_prename(sftp_fullpath(&fakejob, av[1], options),
-                          sftp_fullpath(&fakejob, av[2], options));
-    else
-      return sftp_rename(sftp_fullpath(&fakejob, av[1], options),
-                         sftp_fullpath(&fakejob, av[2], options), flags);
-  } else
+    ++av;
+    --ac;
+  }
+  if(ac > 2) {
+    /* Several files into a directory, as a single batch of POSIX renames */
+    if(flags)
+      return error("-n, -a and -o cannot be used with several files");
+    return mv_into(ac - 1, av, av[ac - 1], options);
+  }
+  if(ac < 2)
+    return error("no destination given");
+  if(posixrename)
+    return sftp_prename(sftp_fullpath(&fakejob, av[0], options),
+                        sftp_fullpath(&fakejob, av[1], options));
+  else
     return sftp_rename(sftp_fullpath(&fakejob, av[0], options),
-                       sftp_fullpath(&fakejob, av[1], options), 0);
+                       sftp_fullpath(&fakejob, av[1], options), flags);
 }
 
 static int cmd_symlink(int attribute((unused)) ac, char **av,
@@ -1416,87 +1887,639 @@ static int cmd_symlink(int attribute((unused)) ac, char **av,
   return sftp_link(av[0], sftp_fullpath(&fakejob, av[1], options), 1);
 }
 
+static int cmd_check(int ac, char **av, unsigned options) {
+  uint32_t id;
+  char *reply, *algorithm;
+  size_t n, i;
+  const struct sftphash *hash;
+
+  if(!checkfile_extension)
+    return error("no check-file extension found");
+  remote_cwd();
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, checkfile_extension);
+  sftp_send_path(&fakejob, &fakeworker,
+                 sftp_fullpath(&fakejob, av[1], options));
+  sftp_send_string(&fakeworker, av[0]);
+  sftp_send_uint64(&fakeworker, 0);
+  sftp_send_uint64(&fakeworker, 0);
+  sftp_send_uint32(&fakeworker, ac > 2 ? strtoul(av[2], 0, 0) : 0);
+  sftp_send_end(&fakeworker);
+  if(getresponse(SSH_FXP_EXTENDED_REPLY, id, checkfile_extension) !=
+     SSH_FXP_EXTENDED_REPLY)
+    return -1;
+  cpcheck(sftp_parse_string(&fakejob, &reply, 0));
+  cpcheck(sftp_parse_string(&fakejob, &algorithm, 0));
+  if(!(hash = sftp_hash_find(algorithm)))
+    return error("unknown hash algorithm '%s'", algorithm);
+  /* The rest of the reply is the digests */
+  for(n = 0; n + hash->size <= fakejob.left; n += hash->size) {
+    sftp_xprintf("%s ", algorithm);
+    for(i = 0; i < hash->size; ++i)
+      sftp_xprintf("%02x", fakejob.ptr[n + i]);
+    sftp_xprintf("\n");
+  }
+  return 0;
+}
+
+static int cmd_copy(int attribute((unused)) ac, char **av, unsigned options) {
+  struct client_handle src, dst;
+  struct sftpattr attrs;
+  uint32_t id;
+  int rc;
+
+  if(!copydata_extension)
+    return error("no copy-data extension found");
+  remote_cwd();
+  sftp_memset(&attrs, 0, sizeof attrs);
+  if(sftp_open(sftp_fullpath(&fakejob, av[0], options), ACE4_READ_DATA,
+               SSH_FXF_OPEN_EXISTING, &attrs, &src))
+    return -1;
+  if(sftp_open(sftp_fullpath(&fakejob, av[1], options), ACE4_WRITE_DATA,
+               SSH_FXF_CREATE_TRUNCATE, &attrs, &dst)) {
+    sftp_close(&src);
+    return -1;
+  }
+  /* Copy the whole of the source file */
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, copydata_extension);
+  sftp_send_bytes(&fakeworker, src.data, src.len);
+  sftp_send_uint64(&fakeworker, 0);
+  sftp_send_uint64(&fakeworker, 0);
+  sftp_send_bytes(&fakeworker, dst.data, dst.len);
+  sftp_send_uint64(&fakeworker, 0);
+  sftp_send_end(&fakeworker);
+  getresponse(SSH_FXP_STATUS, id, copydata_extension);
+  rc = status();
+  if(sftp_close(&dst))
+    rc = -1;
+  if(sftp_close(&src))
+    rc = -1;
+  return rc;
+}
+
 static int cmd_link(int attribute((unused)) ac, char **av, unsigned options) {
   remote_cwd();
   return sftp_link(sftp_fullpath(&fakejob, av[0], options),
                    sftp_fullpath(&fakejob, av[1], options), 0);
 }
 
-/* cmd_get uses a background thread to send requests */
-struct outstanding_read {
-  uint32_t id;  /* 0 or a request ID */
-  off_t offset; /* offset in source file */
-};
-
-struct reader_data {
-  pthread_mutex_t m;             /* protects everything here */
-  pthread_cond_t c1;             /* signaled when a response received */
-  pthread_cond_t c2;             /* signaled when a request sent */
-  struct client_handle h;        /* target handle */
-  struct outstanding_read *reqs; /* in-flight requests */
-  uint64_t next_offset;          /* next offset */
-  int outstanding, eof, failed;
-  uint64_t size;     /* file size */
-  uint64_t written;  /* byte written so far */
-  int fd;            /* file to write to */
-  char *local, *tmp; /* output filename */
-  /* For text translation: */
-  FILE *translated_fp;     /* file to write to (in stdio-speak) */
-  size_t translated_state; /* how far thru newline we've seen */
-};
-
-static void *reader_thread(void *arg) {
-  struct reader_data *const r = arg;
-  int n;
-  uint32_t id, len;
+static int cmd_limits(int attribute((unused)) ac,
+                      char attribute((unused)) * *av,
+                      unsigned attribute((unused)) options) {
+  static const char *const names[] = {"max-packet-length", "max-read-length",
+                                      "max-write-length", "max-open-handles"};
+  uint64_t u64;
+  uint32_t id;
+  size_t n;
 
-  ferrcheck(pthread_mutex_lock(&r->m));
-  while(!r->eof && !r->failed) {
-    /* Wait for a job to be reaped */
-    while(r->outstanding == nrequests && !r->eof)
-      ferrcheck(pthread_cond_wait(&r->c1, &r->m));
-    /* Send as many jobs as we can */
-    while(r->outstanding < nrequests && !r->eof) {
-      /* Find a spare slot */
-      for(n = 0; n < nrequests && r->reqs[n].id; ++n)
-        ;
-      assert(n < nrequests);
-      id = newid();
-      sftp_send_begin(&fakeworker);
-      sftp_send_uint8(&fakeworker, SSH_FXP_READ);
-      sftp_send_uint32(&fakeworker, id);
-      sftp_send_bytes(&fakeworker, r->h.data, r->h.len);
-      sftp_send_uint64(&fakeworker, r->next_offset);
-      if(r->size == (uint64_t)-1 || r->size - r->next_offset > buffersize)
-        len = buffersize;
-      else {
-        len = (uint32_t)(r->size - r->next_offset);
-        r->eof = 1;
-      }
-      sftp_send_uint32(&fakeworker, len);
-      /* Fill in the outstanding_read once we've sent it */
-      r->reqs[n].id = id;
-      r->reqs[n].offset = r->next_offset;
-      ++r->outstanding;
-      r->next_offset += buffersize;
-      /* Don't hold the lock while doing the send itself */
-      ferrcheck(pthread_mutex_unlock(&r->m));
-      sftp_send_end(&fakeworker);
-      ferrcheck(pthread_mutex_lock(&r->m));
-      /* Notify the main threader that we set off a request */
-      ferrcheck(pthread_cond_signal(&r->c2));
-    }
+  if(!limits_extension)
+    return error("no limits extension found");
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, limits_extension);
+  sftp_send_end(&fakeworker);
+  if(getresponse(SSH_FXP_EXTENDED_REPLY, id, limits_extension) !=
+     SSH_FXP_EXTENDED_REPLY)
+    return -1;
+  for(n = 0; n < sizeof names / sizeof *names; ++n) {
+    cpcheck(sftp_parse_uint64(&fakejob, &u64));
+    sftp_xprintf("%s %" PRIu64 "\n", names[n], u64);
   }
-  ferrcheck(pthread_mutex_unlock(&r->m));
   return 0;
 }
 
-/* Inbound text file translation */
+/* reap_write_response() matches responses by ID, so tell the server it need
+ * not keep reads in order.  This is left until the first download since in
+ * v6 the first request after init might be version-select. */
+static int read_order(void) {
+  uint32_t id;
 
-static int write_translated_init(struct reader_data *r) {
-  if(!(r->translated_fp = fdopen(r->fd, "w")))
-    return error("error calling fdopen: %s", strerror(errno));
-  r->translated_state = 0;
+  if(!read_order_extension || read_order_sent)
+    return 0;
+  read_order_sent = 1;
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, read_order_extension);
+  sftp_send_string(&fakeworker, "any");
+  sftp_send_end(&fakeworker);
+  getresponse(SSH_FXP_STATUS, id, read_order_extension);
+  return status();
+}
+
+/* Resumed transfers.  reget and reput find out how much of the local and
+ * remote files agree and carry on from there.  With check-file the common
+ * part is compared block by block.  Without it, a sample of blocks is read
+ * back and compared; an interrupted transfer can leave holes anywhere in its
+ * last window, so a window's worth before the end of the sample is sent
+ * again regardless. */
+
+/* Block size when comparing with check-file */
+#define RESUME_BLOCK 1048576
+
+/* Most blocks in one check-file request */
+#define RESUME_BLOCKS 1024
+
+/* Number and size of blocks compared without check-file */
+#define RESUME_SAMPLES 16
+#define RESUME_SAMPLE 65536
+
+/* Compare the first LENGTH bytes of remote PATH and local FD using
+ * check-file.  Returns 1 if the server can't do it. */
+static int resume_hashes(const char *path, int fd, uint64_t length,
+                         uint64_t *verified) {
+  unsigned char *buffer, digest[HASH_MAXSIZE];
+  const struct sftphash *hash;
+  struct sftphashctx ctx;
+  uint64_t start, chunk, offset;
+  uint32_t id;
+  char *algorithm;
+  size_t i, n, bs;
+  ssize_t got;
+  int rc = 0;
+
+  if(!checkfile_extension)
+    return 1;
+  buffer = sftp_xmalloc(RESUME_BLOCK);
+  for(start = 0; start < length; start += chunk) {
+    chunk = length - start;
+    if(chunk > (uint64_t)RESUME_BLOCK * RESUME_BLOCKS)
+      chunk = (uint64_t)RESUME_BLOCK * RESUME_BLOCKS;
+    sftp_send_begin(&fakeworker);
+    sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+    sftp_send_uint32(&fakeworker, id = newid());
+    sftp_send_string(&fakeworker, checkfile_extension);
+    sftp_send_path(&fakejob, &fakeworker, path);
+    sftp_send_string(&fakeworker, "sha256,sha1,md5");
+    sftp_send_uint64(&fakeworker, start);
+    sftp_send_uint64(&fakeworker, chunk);
+    sftp_send_uint32(&fakeworker, RESUME_BLOCK);
+    sftp_send_end(&fakeworker);
+    /* If the server can't help, compare samples instead */
+    if(getresponse(-1, id, checkfile_extension) != SSH_FXP_EXTENDED_REPLY) {
+      rc = start ? 0 : 1;
+      break;
+    }
+    cpcheck(sftp_parse_string(&fakejob, 0, 0));
+    cpcheck(sftp_parse_string(&fakejob, &algorithm, 0));
+    if(!(hash = sftp_hash_find(algorithm))) {
+      rc = error("unknown hash algorithm '%s'", algorithm);
+      break;
+    }
+    n = (chunk + RESUME_BLOCK - 1) / RESUME_BLOCK;
+    if(fakejob.left < n * hash->size) {
+      rc = error("malformed %s response", checkfile_extension);
+      break;
+    }
+    for(i = 0; i < n; ++i) {
+      offset = start + (uint64_t)i * RESUME_BLOCK;
+      bs = length - offset < RESUME_BLOCK ? length - offset : RESUME_BLOCK;
+      if((got = pread(fd, buffer, bs, offset)) < 0) {
+        rc = error("error reading local file: %s", strerror(errno));
+        goto done;
+      }
+      sftp_hash_init(&ctx, hash);
+      sftp_hash_update(&ctx, buffer, got);
+      sftp_hash_final(&ctx, digest);
+      if((size_t)got != bs ||
+         memcmp(digest, fakejob.ptr + i * hash->size, hash->size))
+        goto done;
+      *verified = offset + bs;
+    }
+  }
+done:
+  free(buffer);
+  return rc;
+}
+
+/* Compare one block of remote H and local FD */
+static int resume_compare(const struct client_handle *h, int fd,
+                          uint64_t offset, size_t n, unsigned char *buffer) {
+  uint32_t id, len, st;
+  ssize_t got;
+
+  if((got = pread(fd, buffer, n, offset)) < 0)
+    return error("error reading local file: %s", strerror(errno));
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_READ);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_bytes(&fakeworker, h->data, h->len);
+  sftp_send_uint64(&fakeworker, offset);
+  sftp_send_uint32(&fakeworker, n);
+  sftp_send_end(&fakeworker);
+  switch(getresponse(-1, id, "SSH_FXP_READ")) {
+  case SSH_FXP_DATA:
+    cpcheck(sftp_parse_uint32(&fakejob, &len));
+    /* A short read counts as a difference */
+    return len == n && (size_t)got == n && len <= fakejob.left &&
+           !memcmp(fakejob.ptr, buffer, n);
+  case SSH_FXP_STATUS:
+    cpcheck(sftp_parse_uint32(&fakejob, &st));
+    if(st == SSH_FX_EOF)
+      return 0;
+    return status();
+  default:
+    sftp_fatal("unexpected response to SSH_FXP_READ");
+  }
+}
+
+/* Compare the first LENGTH bytes of remote H and local FD by reading back a
+ * sample of blocks */
+static int resume_samples(const struct client_handle *h, int fd,
+                          uint64_t length, int upload, uint64_t *verified) {
+  unsigned char *const buffer = sftp_xmalloc(RESUME_SAMPLE);
+  struct pipeline p;
+  uint64_t offset, window;
+  size_t n;
+  int k, rc = 0;
+
+  if(length <= (uint64_t)RESUME_SAMPLES * RESUME_SAMPLE) {
+    /* Small enough to compare it all */
+    for(offset = 0; offset < length; offset += n) {
+      n = length - offset < RESUME_SAMPLE ? length - offset : RESUME_SAMPLE;
+      if((rc = resume_compare(h, fd, offset, n, buffer)) <= 0)
+        break;
+      *verified = offset + n;
+    }
+    free(buffer);
+    return rc < 0 ? -1 : 0;
+  }
+  /* Blocks evenly spaced from the start to the very end */
+  for(k = 0; k < RESUME_SAMPLES; ++k) {
+    offset = (length - RESUME_SAMPLE) / (RESUME_SAMPLES - 1) * k;
+    if(k == RESUME_SAMPLES - 1)
+      offset = length - RESUME_SAMPLE;
+    if((rc = resume_compare(h, fd, offset, RESUME_SAMPLE, buffer)) <= 0)
+      break;
+    *verified = offset + RESUME_SAMPLE;
+  }
+  free(buffer);
+  if(rc < 0)
+    return -1;
+  if(k < RESUME_SAMPLES)
+    *verified = offset; /* up to the block that differed */
+  pipeline_init(&p, upload);
+  window = (uint64_t)p.maxdepth * p.maxsize;
+  *verified = *verified > window ? *verified - window : 0;
+  return 0;
+}
+
+/* Find the offset to resume a transfer between remote PATH, open as H, and
+ * local FD from */
+static int resume_point(const char *path, const struct client_handle *h,
+                        int fd, uint64_t local_size, uint64_t remote_size,
+                        int upload, uint64_t *offset) {
+  const uint64_t length = local_size < remote_size ? local_size : remote_size;
+  int rc;
+
+  *offset = 0;
+  if((rc = resume_hashes(path, fd, length, offset)) > 0)
+    rc = resume_samples(h, fd, length, upload, offset);
+  D(("resuming %s at %" PRIu64 " of %" PRIu64, path, *offset, length));
+  return rc;
+}
+
+/* Striped transfers.  The server serializes the requests on any one handle
+ * that might overlap, and one window can only keep so much of the link busy.
+ * A large file can instead be split into contiguous stripes, each with its
+ * own handle and window, so that the server can work on all of them at once.
+ * One thread sends for every stripe and handles all the responses; downloads
+ * are assembled with pwrite() and uploads written at each stripe's offsets.
+ * Stripes are not compressed. */
+
+/* Most stripes in one transfer */
+#define MAXSTRIPES 16
+
+/* Smallest stripe worth a handle of its own */
+#define STRIPE_MIN 1048576
+
+/* A request in flight for a stripe */
+struct sreq {
+  uint32_t id; /* or 0 for empty slot */
+  uint64_t offset;
+  uint32_t len;
+  double sent;
+};
+
+/* One stripe of a striped transfer */
+struct stripe {
+  struct client_handle h; /* remote handle */
+  struct pipeline pipe;   /* window */
+  struct sreq *reqs;      /* pipe.maxdepth slots */
+  uint64_t offset, end;   /* next request, end of stripe */
+  int outstanding;        /* requests in flight */
+  int eof;                /* no more requests needed */
+};
+
+/* State of a striped transfer */
+struct stransfer {
+  int put;                /* non-0 for uploads */
+  int fd;                 /* local file */
+  const char *name;       /* file name for messages */
+  struct stripe *stripes;
+  int nstripes;
+  int outstanding;        /* requests in flight over all stripes */
+  int failed;             /* an error has been reported */
+  uint64_t size, done;    /* end of file, bytes so far */
+};
+
+/* How many stripes to use for LENGTH bytes, given WANTED */
+static int stripe_count(uint64_t length, int wanted) {
+  const uint64_t most = length / STRIPE_MIN;
+
+  if(wanted > MAXSTRIPES)
+    wanted = MAXSTRIPES;
+  if((uint64_t)wanted > most)
+    wanted = most ? (int)most : 1;
+  return wanted;
+}
+
+/* Send a request for LEN bytes at OFFSET for a stripe.  Returns the number of
+ * bytes asked for, or 0 if none were. */
+static uint32_t stripe_request(struct stransfer *t, struct stripe *s,
+                               uint64_t offset, uint32_t len) {
+  uint32_t id;
+  ssize_t n;
+  int i;
+
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, t->put ? SSH_FXP_WRITE : SSH_FXP_READ);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_bytes(&fakeworker, s->h.data, s->h.len);
+  sftp_send_uint64(&fakeworker, offset);
+  if(t->put) {
+    /* We read straight into our output buffer */
+    sftp_send_need(&fakeworker, len + 4);
+    n = pread(t->fd, fakeworker.buffer + fakeworker.bufused + 4, len, offset);
+    if(n <= 0) {
+      /* The file got shorter, or can't be read */
+      if(n < 0) {
+        error("error reading %s: %s", t->name, strerror(errno));
+        t->failed = 1;
+      }
+      s->eof = 1;
+      return 0;
+    }
+    len = n;
+    sftp_send_uint32(&fakeworker, len);
+    fakeworker.bufused += len;
+  } else
+    sftp_send_uint32(&fakeworker, len);
+  sftp_send_end(&fakeworker);
+  for(i = 0; i < s->pipe.maxdepth && s->reqs[i].id; ++i)
+    ;
+  assert(i < s->pipe.maxdepth);
+  s->reqs[i].id = id;
+  s->reqs[i].offset = offset;
+  s->reqs[i].len = len;
+  s->reqs[i].sent = monotonic_now();
+  ++s->outstanding;
+  ++t->outstanding;
+  return len;
+}
+
+/* Send the next request for a stripe.  Returns non-0 if one was sent. */
+static int stripe_next(struct stransfer *t, struct stripe *s) {
+  uint32_t len;
+
+  if(t->failed || s->eof || s->outstanding >= s->pipe.depth)
+    return 0;
+  if(s->offset >= s->end) {
+    s->eof = 1;
+    return 0;
+  }
+  len = s->pipe.size;
+  if(s->end - s->offset < len)
+    len = s->end - s->offset;
+  if(!(len = stripe_request(t, s, s->offset, len)))
+    return 0;
+  s->offset += len;
+  return 1;
+}
+
+/* Handle a response for one of a stripe's requests */
+static void stripe_response(struct stransfer *t, struct stripe *s,
+                            const struct sreq *r, uint8_t type) {
+  uint32_t st;
+  char *data;
+  size_t len;
+
+  --s->outstanding;
+  --t->outstanding;
+  switch(type) {
+  case SSH_FXP_DATA:
+    if(t->put)
+      sftp_fatal("unexpected SSH_FXP_DATA response to SSH_FXP_WRITE");
+    cpcheck(sftp_parse_string(&fakejob, &data, &len));
+    if(len > r->len)
+      sftp_fatal("oversized SSH_FXP_DATA for %s", t->name);
+    if(t->failed)
+      break;
+    if(pwrite(t->fd, data, len, r->offset) < 0) {
+      error("error writing to %s: %s", t->name, strerror(errno));
+      t->failed = 1;
+      break;
+    }
+    t->done += len;
+    pipeline_response(&s->pipe, r->sent, len);
+    if(!len)
+      s->eof = 1;
+    else if(len < r->len)
+      /* Short read, ask for the rest */
+      stripe_request(t, s, r->offset + len, r->len - len);
+    break;
+  case SSH_FXP_STATUS:
+    cpcheck(sftp_parse_uint32(&fakejob, &st));
+    if(st == SSH_FX_OK && t->put) {
+      t->done += r->len;
+      pipeline_response(&s->pipe, r->sent, r->len);
+    } else if(st == SSH_FX_EOF && !t->put)
+      s->eof = 1; /* the file got shorter */
+    else if(!t->failed) {
+      /* Only report the first error */
+      status();
+      t->failed = 1;
+    }
+    break;
+  default:
+    sftp_fatal("unexpected response %d to %s", type,
+               t->put ? "SSH_FXP_WRITE" : "SSH_FXP_READ");
+  }
+  progress(t->name, t->done, t->size, &s->pipe);
+}
+
+/* Transfer bytes START to SIZE between local FD and remote PATH, open as H,
+ * in up to WANTED stripes.  NAME is used for messages.  Further handles are
+ * opened with FLAGS.  On return *DONE is the number of bytes transferred. */
+static int striped(const struct client_handle *h, const char *path,
+                   uint32_t flags, int put, int fd, const char *name,
+                   uint64_t start, uint64_t size, int wanted,
+                   uint64_t *done) {
+  struct stransfer t;
+  struct stripe *s;
+  struct sftpattr attrs;
+  uint64_t chunk;
+  double started, elapsed;
+  uint8_t type;
+  int n, i, rc = 0;
+
+  sftp_memset(&t, 0, sizeof t);
+  t.put = put;
+  t.fd = fd;
+  t.name = name;
+  t.size = size;
+  t.nstripes = stripe_count(size - start, wanted);
+  t.stripes = sftp_alloc(fakejob.a, t.nstripes * sizeof *t.stripes);
+  sftp_memset(t.stripes, 0, t.nstripes * sizeof *t.stripes);
+  /* Stripes start on request boundaries */
+  chunk = (size - start) / t.nstripes;
+  chunk = (chunk + buffersize - 1) / buffersize * buffersize;
+  for(n = 0; n < t.nstripes; ++n) {
+    s = &t.stripes[n];
+    if(n == 0)
+      s->h = *h;
+    else {
+      sftp_memset(&attrs, 0, sizeof attrs);
+      if(sftp_open(path, put ? ACE4_WRITE_DATA : ACE4_READ_DATA,
+                   SSH_FXF_OPEN_EXISTING | flags, &attrs, &s->h)) {
+        rc = -1;
+        break;
+      }
+    }
+    s->offset = start + n * chunk < size ? start + n * chunk : size;
+    s->end = size - s->offset > chunk ? s->offset + chunk : size;
+    pipeline_init(&s->pipe, put);
+    s->reqs = sftp_alloc(fakejob.a, s->pipe.maxdepth * sizeof *s->reqs);
+    sftp_memset(s->reqs, 0, s->pipe.maxdepth * sizeof *s->reqs);
+    D(("stripe %d: %" PRIu64 "-%" PRIu64, n, s->offset, s->end));
+  }
+  started = monotonic_now();
+  while(!rc) {
+    /* Fill every stripe's window */
+    for(n = 0; n < t.nstripes; ++n)
+      while(stripe_next(&t, &t.stripes[n]))
+        ;
+    if(!t.outstanding)
+      break;
+    type = getresponse(-1, 0, "striped transfer");
+    for(n = 0; n < t.nstripes; ++n) {
+      s = &t.stripes[n];
+      for(i = 0; i < s->pipe.maxdepth && s->reqs[i].id != fakejob.id; ++i)
+        ;
+      if(i < s->pipe.maxdepth)
+        break;
+    }
+    if(n >= t.nstripes)
+      sftp_fatal("unexpected response ID %" PRIu32, fakejob.id);
+    s->reqs[i].id = 0;
+    stripe_response(&t, s, &s->reqs[i], type);
+  }
+  progress(0, 0, 0, 0);
+  elapsed = monotonic_now() - started;
+  /* Stripe 0's handle belongs to the caller */
+  for(n = 1; n < t.nstripes; ++n)
+    if(t.stripes[n].h.len && sftp_close(&t.stripes[n].h))
+      rc = -1;
+  if(t.failed)
+    rc = -1;
+  if(!rc && progress_indicators) {
+    sftp_xprintf("%" PRIu64 " bytes in %.1f seconds", t.done, elapsed);
+    if(elapsed > 0.1)
+      sftp_xprintf(" %.0f bytes/sec", t.done / elapsed);
+    sftp_xprintf(", %d stripes\n", t.nstripes);
+  }
+  *done = t.done;
+  return rc;
+}
+
+/* cmd_get uses a background thread to send requests */
+struct outstanding_read {
+  uint32_t id;  /* 0 or a request ID */
+  off_t offset; /* offset in source file */
+  double sent;  /* when the request was sent */
+};
+
+struct reader_data {
+  pthread_mutex_t m;             /* protects everything here */
+  pthread_cond_t c1;             /* signaled when a response received */
+  pthread_cond_t c2;             /* signaled when a request sent */
+  struct client_handle h;        /* target handle */
+  struct outstanding_read *reqs; /* in-flight requests */
+  struct pipeline pipe;          /* window */
+  const struct sftpcompressor *compress; /* payload compression */
+  void *cbuf;                    /* decompression buffer */
+  const struct sftpprotocol *protocol; /* protocol for the thread */
+  uint64_t next_offset;          /* next offset */
+  int outstanding, eof, failed;
+  uint64_t size;     /* file size */
+  uint64_t written;  /* byte written so far */
+  int fd;            /* file to write to */
+  char *local, *tmp; /* output filename */
+  /* For text translation: */
+  FILE *translated_fp;     /* file to write to (in stdio-speak) */
+  size_t translated_state; /* how far thru newline we've seen */
+};
+
+static void *reader_thread(void *arg) {
+  struct reader_data *const r = arg;
+  int n;
+  uint32_t id, len;
+
+  protocol = r->protocol;
+  ferrcheck(pthread_mutex_lock(&r->m));
+  while(!r->eof && !r->failed) {
+    /* Wait for a job to be reaped */
+    while(r->outstanding >= r->pipe.depth && !r->eof)
+      ferrcheck(pthread_cond_wait(&r->c1, &r->m));
+    /* Send as many jobs as we can */
+    while(r->outstanding < r->pipe.depth && !r->eof) {
+      /* Find a spare slot */
+      for(n = 0; n < r->pipe.maxdepth && r->reqs[n].id; ++n)
+        ;
+      assert(n < r->pipe.maxdepth);
+      id = newid();
+      sftp_send_begin(&fakeworker);
+      sftp_send_uint8(&fakeworker, SSH_FXP_READ);
+      sftp_send_uint32(&fakeworker, id);
+      sftp_send_bytes(&fakeworker, r->h.data, r->h.len);
+      sftp_send_uint64(&fakeworker, r->next_offset);
+      if(r->size == (uint64_t)-1 || r->size - r->next_offset > r->pipe.size)
+        len = r->pipe.size;
+      else {
+        len = (uint32_t)(r->size - r->next_offset);
+        r->eof = 1;
+      }
+      sftp_send_uint32(&fakeworker, len);
+      /* Fill in the outstanding_read once we've sent it */
+      r->reqs[n].id = id;
+      r->reqs[n].offset = r->next_offset;
+      r->reqs[n].sent = monotonic_now();
+      ++r->outstanding;
+      r->next_offset += len;
+      /* Don't hold the lock while doing the send itself */
+      ferrcheck(pthread_mutex_unlock(&r->m));
+      sftp_send_end(&fakeworker);
+      ferrcheck(pthread_mutex_lock(&r->m));
+      /* Notify the main threader that we set off a request */
+      ferrcheck(pthread_cond_signal(&r->c2));
+    }
+  }
+  ferrcheck(pthread_mutex_unlock(&r->m));
+  return 0;
+}
+
+/* Inbound text file translation */
+
+static int write_translated_init(struct reader_data *r) {
+  if(!(r->translated_fp = fdopen(r->fd, "w")))
+    return error("error calling fdopen: %s", strerror(errno));
+  r->translated_state = 0;
   return 0;
 }
 
@@ -1562,6 +2585,8 @@ static int write_translated_done(struct reader_data *r) {
 static void reap_write_response(struct reader_data *r) {
   uint8_t rtype;
   uint32_t st, len;
+  const void *data;
+  size_t raw;
   int n, rc;
 
   /* Get the next response and count it down.  We don't hold the lock while
@@ -1575,6 +2600,12 @@ static void reap_write_response(struct reader_data *r) {
     return;
   switch(rtype) {
   case SSH_FXP_STATUS:
+    /* Responses can arrive in any order, so free up whichever slot this was
+     * for */
+    for(n = 0; n < r->pipe.maxdepth && fakejob.id != r->reqs[n].id; ++n)
+      ;
+    if(n < r->pipe.maxdepth)
+      r->reqs[n].id = 0;
     cpcheck(sftp_parse_uint32(&fakejob, &st));
     if(st == SSH_FX_EOF)
       r->eof = 1;
@@ -1585,9 +2616,9 @@ static void reap_write_response(struct reader_data *r) {
     break;
   case SSH_FXP_DATA:
     /* Find the right request */
-    for(n = 0; n < nrequests && fakejob.id != r->reqs[n].id; ++n)
+    for(n = 0; n < r->pipe.maxdepth && fakejob.id != r->reqs[n].id; ++n)
       ;
-    assert(n < nrequests);
+    assert(n < r->pipe.maxdepth);
     /* Free up this slot */
     r->reqs[n].id = 0;
     /* We don't fully parse the string but instead write it out from the
@@ -1602,36 +2633,47 @@ static void reap_write_response(struct reader_data *r) {
      * In text mode we can rely on the responses arriving in the correct
      * order.
      */
+    data = fakejob.ptr;
+    if(r->compress) {
+      if(len > fakejob.left || sftp_compress_frame_size(data, len, &raw) ||
+         raw > r->pipe.maxsize ||
+         sftp_compress_unframe(r->compress, data, len, r->cbuf, &data))
+        sftp_fatal("malformed compressed SSH_FXP_DATA");
+      len = raw;
+    }
     if(textmode) {
       /* We must replace each instance of the newline string with \n */
-      rc = write_translated(r, fakejob.ptr, len);
+      rc = write_translated(r, data, len);
     } else
-      rc = pwrite(r->fd, fakejob.ptr, len, r->reqs[n].offset);
+      rc = pwrite(r->fd, data, len, r->reqs[n].offset);
     if(rc < 0) {
       error("error writing to %s: %s", r->tmp, strerror(errno));
       r->failed = 1;
       return;
     }
     r->written += len;
-    progress(r->local, r->written, r->size);
+    pipeline_response(&r->pipe, r->reqs[n].sent, len);
+    progress(r->local, r->written, r->size, &r->pipe);
     break;
   default:
     sftp_fatal("unexpected response %d to SSH_FXP_READ", rtype);
   }
 }
 
-static int cmd_get(int ac, char **av, unsigned options) {
+/* Shared by get and reget */
+static int get_common(int ac, char **av, unsigned options, int resume) {
   int preserve = 0;
   const char *e;
-  char *remote;
+  char *remote, *path;
   struct reader_data r;
   struct sftpattr attrs;
   pthread_t tid;
   struct timeval started, finished;
   double elapsed;
   uint32_t flags = 0;
-  int seek = 0;
-  uint64_t line = 0;
+  int seek = 0, stripes = 1;
+  uint64_t line = 0, offset;
+  struct stat sb;
 
   remote_cwd();
   sftp_memset(&attrs, 0, sizeof attrs);
@@ -1653,6 +2695,11 @@ static int cmd_get(int ac, char **av, unsigned options) {
         line = (uint64_t)strtoull(s, 0, 10);
         s = "";
         break;
+      case 'k':
+        if((stripes = atoi(s)) <= 0)
+          return error("invalid stripe count '%s'", s);
+        s = "";
+        break;
       default:
         return error("unknown get option -%c'", s[-1]);
       }
@@ -1666,10 +2713,22 @@ static int cmd_get(int ac, char **av, unsigned options) {
     --ac;
   } else
     r.local = basename(remote);
+  if(resume && textmode)
+    return error("text mode downloads cannot be resumed");
+  path = sftp_fullpath(&fakejob, remote, options);
   /* we'll write to a temporary file */
   r.tmp = sftp_alloc(fakejob.a, strlen(r.local) + 5);
   sprintf(r.tmp, "%s.new", r.local);
-  if((r.fd = open(r.tmp, O_WRONLY | O_TRUNC | O_CREAT, 0666)) < 0) {
+  if(resume) {
+    /* Carry on with the temporary file left by an interrupted get, or else
+     * with the file itself */
+    if(access(r.tmp, F_OK) < 0 && errno == ENOENT &&
+       rename(r.local, r.tmp) < 0 && errno != ENOENT)
+      return error("error renaming %s: %s", r.local, strerror(errno));
+    r.fd = open(r.tmp, O_RDWR | O_CREAT, 0666);
+  } else
+    r.fd = open(r.tmp, O_WRONLY | O_TRUNC | O_CREAT, 0666);
+  if(r.fd < 0) {
     error("error opening %s: %s", r.tmp, strerror(errno));
     goto error;
   }
@@ -1679,9 +2738,22 @@ static int cmd_get(int ac, char **av, unsigned options) {
       goto error;
     r.fd = -1;
   }
+  if(read_order())
+    goto error;
+  if(get_file_extension && !textmode && !resume) {
+    /* Small files arrive in a single response */
+    switch(sftp_get_file(path, flags,
+                         buffersize, r.fd, r.tmp, &attrs, &r.written)) {
+    case 0:
+      goto fetched;
+    case 1:
+      break;
+    default:
+      goto error;
+    }
+  }
   /* open the remote file */
-  if(sftp_open(sftp_fullpath(&fakejob, remote, options),
-               ACE4_READ_DATA | ACE4_READ_ATTRIBUTES,
+  if(sftp_open(path, ACE4_READ_DATA | ACE4_READ_ATTRIBUTES,
                SSH_FXF_OPEN_EXISTING | flags, &attrs, &r.h))
     goto error;
   /* stat the file */
@@ -1704,11 +2776,38 @@ static int cmd_get(int ac, char **av, unsigned options) {
     if(sftp_text_seek(&r.h, line))
       goto error;
   }
+  if(resume) {
+    if(r.size == (uint64_t)-1) {
+      error("size of %s is not known", remote);
+      goto error;
+    }
+    if(fstat(r.fd, &sb) < 0) {
+      error("error statting %s: %s", r.tmp, strerror(errno));
+      goto error;
+    }
+    if(resume_point(path, &r.h, r.fd, sb.st_size, r.size, 0, &offset))
+      goto error;
+    if(ftruncate(r.fd, offset) < 0) {
+      error("error truncating %s: %s", r.tmp, strerror(errno));
+      goto error;
+    }
+    r.next_offset = r.written = offset;
+  }
+  if(stripes > 1 && !textmode && r.size != (uint64_t)-1) {
+    if(striped(&r.h, path, flags, 0, r.fd, r.tmp, r.next_offset, r.size,
+               stripes, &r.written))
+      goto error;
+    goto transferred;
+  }
   gettimeofday(&started, 0);
   ferrcheck(pthread_mutex_init(&r.m, 0));
   ferrcheck(pthread_cond_init(&r.c1, 0));
   ferrcheck(pthread_cond_init(&r.c2, 0));
-  r.reqs = sftp_alloc(fakejob.a, nrequests * sizeof *r.reqs);
+  pipeline_init(&r.pipe, 0);
+  r.reqs = sftp_alloc(fakejob.a, r.pipe.maxdepth * sizeof *r.reqs);
+  if((r.compress = sftp_compress(&r.h)))
+    r.cbuf = sftp_alloc(fakejob.a, r.pipe.maxsize);
+  r.protocol = protocol;
   ferrcheck(pthread_create(&tid, 0, reader_thread, &r));
   ferrcheck(pthread_mutex_lock(&r.m));
   /* If there are requests in flight, we must keep going whatever else
@@ -1736,7 +2835,7 @@ static int cmd_get(int ac, char **av, unsigned options) {
   ferrcheck(pthread_mutex_destroy(&r.m));
   ferrcheck(pthread_cond_destroy(&r.c1));
   ferrcheck(pthread_cond_destroy(&r.c2));
-  progress(0, 0, 0);
+  progress(0, 0, 0, 0);
   if(r.failed)
     goto error;
   gettimeofday(&finished, 0);
@@ -1746,11 +2845,15 @@ static int cmd_get(int ac, char **av, unsigned options) {
     sftp_xprintf("%" PRIu64 " bytes in %.1f seconds", r.written, elapsed);
     if(elapsed > 0.1)
       sftp_xprintf(" %.0f bytes/sec", r.written / elapsed);
+    if(r.pipe.adapt)
+      sftp_xprintf(", window %dx%zuK", r.pipe.depth, r.pipe.size / 1024);
     sftp_xprintf("\n");
   }
+transferred:
   /* Close the handle */
   sftp_close(&r.h);
   r.h.len = 0;
+fetched:
   if(preserve) {
     /* Set permissions etc */
     attrs.valid &= ~SSH_FILEXFER_ATTR_SIZE;   /* don't truncate */
@@ -1779,17 +2882,26 @@ error:
   write_translated_done(&r); /* ok to call if not initialized */
   if(r.fd >= 0)
     close(r.fd);
-  if(r.tmp)
-    unlink(r.tmp);
+  if(r.tmp && !resume)
+    unlink(r.tmp); /* a resumed download keeps what it has */
   if(r.h.len)
     sftp_close(&r.h);
   return -1;
 }
 
+static int cmd_get(int ac, char **av, unsigned options) {
+  return get_common(ac, av, options, 0);
+}
+
+static int cmd_reget(int ac, char **av, unsigned options) {
+  return get_common(ac, av, options, 1);
+}
+
 /* put uses a thread to gather responses */
 struct outstanding_write {
   uint32_t id; /* or 0 for empty slot */
   ssize_t n;   /* size of this request */
+  double sent; /* when the request was sent */
 };
 
 struct writer_data {
@@ -1800,7 +2912,10 @@ struct writer_data {
   int outstanding;                /* number of outstanding requests */
   int finished;                   /* set when writer finished */
   struct outstanding_write *reqs; /* outstanding requests */
+  struct pipeline pipe;           /* window */
+  const struct sftpcompressor *compress; /* payload compression */
   const char *remote;             /* remote path */
+  const struct sftpprotocol *protocol; /* protocol for the thread */
   uint64_t written, total;        /* total size */
 };
 
@@ -1809,6 +2924,7 @@ static void *writer_thread(void *arg) {
   int i;
   uint32_t st;
 
+  protocol = w->protocol;
   ferrcheck(pthread_mutex_lock(&w->m));
   /* Keep going until the writer has finished and there are no outstanding
    * requests left */
@@ -1822,30 +2938,319 @@ static void *writer_thread(void *arg) {
     getresponse(SSH_FXP_STATUS, 0 /*don't care about id*/, "SSH_FXP_WRITE");
     ferrcheck(pthread_cond_signal(&w->c2));
     /* Find the request ID */
-    for(i = 0; i < nrequests && w->reqs[i].id != fakejob.id; ++i)
+    for(i = 0; i < w->pipe.maxdepth && w->reqs[i].id != fakejob.id; ++i)
       ;
-    assert(i < nrequests);
+    assert(i < w->pipe.maxdepth);
     --w->outstanding;
     cpcheck(sftp_parse_uint32(&fakejob, &st));
     if(st == SSH_FX_OK) {
       w->written += w->reqs[i].n;
       w->reqs[i].id = 0;
-      progress(w->remote, w->written, w->total);
+      pipeline_response(&w->pipe, w->reqs[i].sent, w->reqs[i].n);
+      progress(w->remote, w->written, w->total, &w->pipe);
     } else if(!w->failed) {
       /* Only report the first error */
       status();
       w->failed = 1;
     }
   }
-  progress(0, 0, 0); /* clear progress indicator */
+  progress(0, 0, 0, 0); /* clear progress indicator */
   ferrcheck(pthread_mutex_unlock(&w->m));
   return 0;
 }
 
-static int cmd_put(int ac, char **av, unsigned options) {
-  char *local;
+/* Delta uploads */
+
+/* Size of delta-apply requests to aim for */
+#define DELTA_REQUEST 262144
+
+/* Largest literal in one delta-apply operation */
+#define DELTA_MAXLITERAL 65536
+
+/* Signatures of the remote copy of a file */
+struct delta_sigs {
+  uint32_t blocksize;
+  size_t n;
+  uint32_t *weak;
+  unsigned char *strong;
+  uint32_t *table; /* index+1 of full blocks, by weak checksum */
+  size_t tablesize;
+};
+
+/* A delta-apply request under construction */
+struct delta_state {
+  const struct client_handle *src, *dst;
+  uint64_t next;     /* destination offset of next operation */
+  int started;       /* non-0 if a request has been started */
+  uint32_t id;       /* ID of request */
+  uint64_t copy_off; /* pending block reference */
+  uint64_t copy_len;
+  uint64_t literal;  /* statistics */
+  uint64_t copied;
+};
+
+static int delta_signatures(const struct client_handle *h, uint64_t size,
+                            struct delta_sigs *s) {
+  uint64_t start = 0;
+  uint32_t id, count;
+  size_t i, hn;
+
+  while(start < size) {
+    sftp_send_begin(&fakeworker);
+    sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+    sftp_send_uint32(&fakeworker, id = newid());
+    sftp_send_string(&fakeworker, DELTA_SIGNATURE);
+    sftp_send_bytes(&fakeworker, h->data, h->len);
+    sftp_send_uint64(&fakeworker, start);
+    sftp_send_uint32(&fakeworker, s->blocksize);
+    sftp_send_end(&fakeworker);
+    if(getresponse(SSH_FXP_EXTENDED_REPLY, id, DELTA_SIGNATURE) !=
+       SSH_FXP_EXTENDED_REPLY)
+      return -1;
+    cpcheck(sftp_parse_uint32(&fakejob, &count));
+    if(!count)
+      break; /* file got shorter */
+    if(fakejob.left < (size_t)count * (4 + DELTA_STRONG))
+      return error("malformed %s response", DELTA_SIGNATURE);
+    s->weak = sftp_xrealloc(s->weak, (s->n + count) * sizeof *s->weak);
+    s->strong = sftp_xrealloc(s->strong, (s->n + count) * DELTA_STRONG);
+    for(i = 0; i < count; ++i)
+      s->weak[s->n + i] = get32(fakejob.ptr + 4 * i);
+    memcpy(s->strong + s->n * DELTA_STRONG, fakejob.ptr + 4 * (size_t)count,
+           (size_t)count * DELTA_STRONG);
+    s->n += count;
+    start += (uint64_t)count * s->blocksize;
+  }
+  /* Index the full blocks; a short final block can never match */
+  for(s->tablesize = 16; s->tablesize < 2 * s->n; s->tablesize *= 2)
+    ;
+  s->table = sftp_xcalloc(s->tablesize, sizeof *s->table);
+  for(i = 0; i < s->n; ++i) {
+    if((uint64_t)(i + 1) * s->blocksize > size)
+      break;
+    for(hn = (s->weak[i] * 2654435761u) & (s->tablesize - 1); s->table[hn];
+        hn = (hn + 1) & (s->tablesize - 1))
+      ;
+    s->table[hn] = i + 1;
+  }
+  return 0;
+}
+
+/* Find a remote block matching local data, or return -1 */
+static long delta_match(const struct delta_sigs *s, uint32_t weak,
+                        const unsigned char *data) {
+  unsigned char strong[HASH_MAXSIZE];
+  struct sftphashctx ctx;
+  int hashed = 0;
+  size_t hn, i;
+
+  for(hn = (weak * 2654435761u) & (s->tablesize - 1); s->table[hn];
+      hn = (hn + 1) & (s->tablesize - 1)) {
+    i = s->table[hn] - 1;
+    if(s->weak[i] != weak)
+      continue;
+    if(!hashed) {
+      sftp_hash_init(&ctx, sftp_hash_find(DELTA_STRONG_HASH));
+      sftp_hash_update(&ctx, data, s->blocksize);
+      sftp_hash_final(&ctx, strong);
+      hashed = 1;
+    }
+    if(!memcmp(strong, s->strong + i * DELTA_STRONG, DELTA_STRONG))
+      return (long)i;
+  }
+  return -1;
+}
+
+static int delta_send(struct delta_state *d) {
+  if(!d->started)
+    return 0;
+  sftp_send_end(&fakeworker);
+  d->started = 0;
+  getresponse(SSH_FXP_STATUS, d->id, DELTA_APPLY);
+  return status();
+}
+
+static void delta_begin(struct delta_state *d) {
+  if(d->started)
+    return;
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, d->id = newid());
+  sftp_send_string(&fakeworker, DELTA_APPLY);
+  sftp_send_bytes(&fakeworker, d->src->data, d->src->len);
+  sftp_send_bytes(&fakeworker, d->dst->data, d->dst->len);
+  sftp_send_uint64(&fakeworker, d->next);
+  d->started = 1;
+}
+
+static int delta_flush_copy(struct delta_state *d) {
+  if(!d->copy_len)
+    return 0;
+  delta_begin(d);
+  sftp_send_uint8(&fakeworker, DELTA_COPY);
+  sftp_send_uint64(&fakeworker, d->copy_off);
+  sftp_send_uint64(&fakeworker, d->copy_len);
+  d->next += d->copy_len;
+  d->copied += d->copy_len;
+  d->copy_len = 0;
+  return fakeworker.bufused >= DELTA_REQUEST ? delta_send(d) : 0;
+}
+
+static int delta_literal(struct delta_state *d, const unsigned char *data,
+                         size_t n) {
+  size_t chunk;
+
+  if(delta_flush_copy(d))
+    return -1;
+  while(n) {
+    chunk = n < DELTA_MAXLITERAL ? n : DELTA_MAXLITERAL;
+    delta_begin(d);
+    sftp_send_uint8(&fakeworker, DELTA_LITERAL);
+    sftp_send_bytes(&fakeworker, data, chunk);
+    d->next += chunk;
+    d->literal += chunk;
+    data += chunk;
+    n -= chunk;
+    if(fakeworker.bufused >= DELTA_REQUEST && delta_send(d))
+      return -1;
+  }
+  return 0;
+}
+
+static int delta_copy(struct delta_state *d, uint64_t offset, uint64_t len) {
+  /* Runs of consecutive blocks become a single operation */
+  if(d->copy_len && d->copy_off + d->copy_len == offset) {
+    d->copy_len += len;
+    return 0;
+  }
+  if(delta_flush_copy(d))
+    return -1;
+  d->copy_off = offset;
+  d->copy_len = len;
+  return 0;
+}
+
+/* Generate and send the delta between local data and the remote signatures */
+static int delta_generate(struct delta_state *d, const struct delta_sigs *s,
+                          const unsigned char *base, size_t size) {
+  const size_t bs = s->blocksize;
+  size_t pos = 0, lit = 0;
+  uint32_t weak = 0;
+  unsigned char digest[4];
+  struct sftphashctx ctx;
+  int have = 0;
+  long i;
+
+  while(pos + bs <= size) {
+    if(!have) {
+      sftp_hash_init(&ctx, &sftp_hash_rolling);
+      sftp_hash_update(&ctx, base + pos, bs);
+      sftp_hash_final(&ctx, digest);
+      weak = get32(digest);
+      have = 1;
+    }
+    if((i = delta_match(s, weak, base + pos)) >= 0) {
+      if(delta_literal(d, base + lit, pos - lit) ||
+         delta_copy(d, (uint64_t)i * bs, bs))
+        return -1;
+      pos += bs;
+      lit = pos;
+      have = 0;
+    } else {
+      if(pos + bs < size)
+        weak = sftp_hash_roll(weak, bs, base[pos], base[pos + bs]);
+      ++pos;
+    }
+  }
+  if(delta_literal(d, base + lit, size - lit) || delta_flush_copy(d))
+    return -1;
+  return delta_send(d);
+}
+
+/* Upload by sending only the differences from the existing remote file */
+static int delta_put(int fd, const struct stat *sb, const char *path,
+                     struct sftpattr *attrs) {
+  struct client_handle basis, tmp;
+  struct sftpattr rattrs;
+  struct delta_sigs s;
+  struct delta_state d;
+  unsigned char *base = NULL;
+  char *tmppath;
+  int rc = -1, opened = 0;
+
+  if(!delta_extension)
+    return error("no delta extension found");
+  if(!rename_extension)
+    return error("no posix-rename extension found");
+  if(!S_ISREG(sb->st_mode))
+    return error("delta uploads only work on regular files");
+  sftp_memset(&s, 0, sizeof s);
+  sftp_memset(&d, 0, sizeof d);
+  sftp_memset(&rattrs, 0, sizeof rattrs);
+  if(sftp_open(path, ACE4_READ_DATA | ACE4_READ_ATTRIBUTES,
+               SSH_FXF_OPEN_EXISTING, &rattrs, &basis))
+    return -1;
+  if(sftp_fstat(&basis, &rattrs) ||
+     !(rattrs.valid & SSH_FILEXFER_ATTR_SIZE)) {
+    sftp_close(&basis);
+    return -1;
+  }
+  /* Blocks of about the square root of the file size, as rsync does */
+  for(s.blocksize = 2048;
+      (uint64_t)s.blocksize * s.blocksize < rattrs.size &&
+      s.blocksize < 1048576;
+      s.blocksize *= 2)
+    ;
+  if(delta_signatures(&basis, rattrs.size, &s))
+    goto done;
+  if(sb->st_size &&
+     (base = mmap(0, sb->st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+         MAP_FAILED) {
+    base = NULL;
+    error("cannot map local file: %s", strerror(errno));
+    goto done;
+  }
+  /* Keep the remote file's permissions unless told otherwise */
+  if(!(attrs->valid & SSH_FILEXFER_ATTR_PERMISSIONS) &&
+     (rattrs.valid & SSH_FILEXFER_ATTR_PERMISSIONS)) {
+    attrs->valid |= SSH_FILEXFER_ATTR_PERMISSIONS;
+    attrs->permissions = rattrs.permissions & 07777;
+  }
+  tmppath = sftp_alloc(fakejob.a, strlen(path) + 32);
+  sprintf(tmppath, "%s.%lu.delta", path, (unsigned long)getpid());
+  if(sftp_open(tmppath, ACE4_WRITE_DATA | ACE4_WRITE_ATTRIBUTES,
+               SSH_FXF_CREATE_TRUNCATE, attrs, &tmp))
+    goto done;
+  opened = 1;
+  d.src = &basis;
+  d.dst = &tmp;
+  rc = delta_generate(&d, &s, base, sb->st_size);
+  D(("delta: %" PRIu64 " bytes sent, %" PRIu64 " bytes matched", d.literal,
+     d.copied));
+  if(sftp_close(&tmp))
+    rc = -1;
+  opened = 0;
+  if(!rc)
+    rc = sftp_prename(tmppath, path);
+  if(rc)
+    sftp_remove(tmppath);
+done:
+  if(opened)
+    sftp_close(&tmp);
+  sftp_close(&basis);
+  if(base)
+    munmap(base, sb->st_size);
+  free(s.weak);
+  free(s.strong);
+  free(s.table);
+  return rc;
+}
+
+/* Shared by put and reput */
+static int put_common(int ac, char **av, unsigned options, int resume) {
+  char *local, *path;
   const char *remote;
-  struct sftpattr attrs;
+  struct sftpattr attrs, rattrs;
   struct stat sb;
   int fd = -1, i, preserve = 0, failed = 0, eof = 0;
   struct client_handle h;
@@ -1856,10 +3261,13 @@ static int cmd_put(int ac, char **av, unsigned options) {
   struct timeval started, finished;
   double elapsed;
   uint32_t id;
+  size_t len, size = 0;
+  void *raw = 0;
   FILE *fp = 0;
   uint32_t disp = SSH_FXF_CREATE_TRUNCATE, flags = 0;
-  int setmode = 0;
+  int setmode = 0, delta = 0, durable = 0, stripes = 1;
   mode_t mode = 0;
+  uint64_t resumed = 0;
 
   remote_cwd();
   sftp_memset(&h, 0, sizeof h);
@@ -1873,6 +3281,12 @@ static int cmd_put(int ac, char **av, unsigned options) {
       case 'P':
         preserve = 1;
         break;
+      case 'D':
+        delta = 1;
+        break;
+      case 'S':
+        durable = 1;
+        break;
       case 'a':
         disp = SSH_FXF_OPEN_OR_CREATE;
         flags |= SSH_FXF_APPEND_DATA;
@@ -1898,6 +3312,11 @@ static int cmd_put(int ac, char **av, unsigned options) {
         mode = strtoul(s, 0, 8);
         s = "";
         break;
+      case 'k':
+        if((stripes = atoi(s)) <= 0)
+          return error("invalid stripe count '%s'", s);
+        s = "";
+        break;
       default:
         return error("unknown put option -%c'", s[-1]);
       }
@@ -1911,6 +3330,11 @@ static int cmd_put(int ac, char **av, unsigned options) {
     --ac;
   } else
     remote = basename(local);
+  if(resume && (textmode || delta || flags || disp != SSH_FXF_CREATE_TRUNCATE))
+    return error("resumed uploads cannot be combined with other modes");
+  if(stripes > 1 && (flags & SSH_FXF_APPEND_DATA))
+    return error("appending uploads cannot be striped");
+  path = sftp_fullpath(&fakejob, remote, options);
   if((fd = open(local, O_RDONLY)) < 0) {
     error("cannot open %s: %s", local, strerror(errno));
     goto error;
@@ -1929,6 +3353,9 @@ static int cmd_put(int ac, char **av, unsigned options) {
       error("%s is too large to upload via SFTP", local);
       goto error;
     }
+  } else if(resume) {
+    error("%s is not a regular file", local);
+    goto error;
   } else
     w.total = (uint64_t)-1;
   if(preserve) {
@@ -1948,12 +3375,66 @@ static int cmd_put(int ac, char **av, unsigned options) {
     attrs.valid |= SSH_FILEXFER_ATTR_PERMISSIONS;
     attrs.permissions = mode;
   }
+  if(delta) {
+    if(textmode || flags || disp != SSH_FXF_CREATE_TRUNCATE || stripes > 1) {
+      error("delta uploads cannot be combined with other modes");
+      goto error;
+    }
+    i = delta_put(fd, &sb, path, &attrs);
+    close(fd);
+    return i;
+  }
+  if(put_file_extension && !textmode && !durable && !resume &&
+     S_ISREG(sb.st_mode) && w.total <= buffersize) {
+    /* Small files go in a single request */
+    i = sftp_put_file(fd, local, path, disp | flags, &attrs, w.total);
+    close(fd);
+    return i;
+  }
   if(textmode)
     flags |= SSH_FXF_TEXT_MODE;
-  if(sftp_open(sftp_fullpath(&fakejob, remote, options),
-               ACE4_WRITE_DATA | ACE4_WRITE_ATTRIBUTES, disp | flags, &attrs,
-               &h))
+  else if(resume) {
+    /* Keep what is there; we need to read it back to compare */
+    if(sftp_open(path,
+                 ACE4_READ_DATA | ACE4_WRITE_DATA | ACE4_READ_ATTRIBUTES |
+                     ACE4_WRITE_ATTRIBUTES,
+                 SSH_FXF_OPEN_OR_CREATE, &attrs, &h))
+      goto error;
+    sftp_memset(&rattrs, 0, sizeof rattrs);
+    if(sftp_fstat(&h, &rattrs))
+      goto error;
+    if(!(rattrs.valid & SSH_FILEXFER_ATTR_SIZE)) {
+      error("size of %s is not known", remote);
+      goto error;
+    }
+    if(resume_point(path, &h, fd, w.total, rattrs.size, 1, &resumed))
+      goto error;
+    if(rattrs.size > resumed) {
+      rattrs.valid = SSH_FILEXFER_ATTR_SIZE;
+      rattrs.size = resumed;
+      if(sftp_fsetstat(&h, &rattrs))
+        goto error;
+    }
+    if(lseek(fd, resumed, SEEK_SET) < 0) {
+      error("error seeking %s: %s", local, strerror(errno));
+      goto error;
+    }
+    w.written = resumed;
+  } else if(w.total != (uint64_t)-1 && protocol->version >= 5) {
+    /* From v5 the size at open is the planned total size, which lets the
+     * server preallocate */
+    attrs.valid |= SSH_FILEXFER_ATTR_SIZE;
+    attrs.size = w.total;
+  }
+  if(!resume && sftp_open(path, ACE4_WRITE_DATA | ACE4_WRITE_ATTRIBUTES,
+                          disp | flags, &attrs, &h))
     goto error;
+  if(stripes > 1 && !textmode && w.total != (uint64_t)-1) {
+    if(striped(&h, path, flags & SSH_FXF_NOFOLLOW, 1, fd, local, resumed,
+               w.total, stripes, &w.written))
+      goto error;
+    goto transferred;
+  }
   if(textmode) {
     if(!(fp = fdopen(fd, "r"))) {
       error("error calling fdopen: %s", strerror(errno));
@@ -1961,21 +3442,26 @@ static int cmd_put(int ac, char **av, unsigned options) {
     }
     fd = -1;
   }
-  w.reqs = sftp_alloc(fakejob.a, nrequests * sizeof *w.reqs);
+  pipeline_init(&w.pipe, 1);
+  w.reqs = sftp_alloc(fakejob.a, w.pipe.maxdepth * sizeof *w.reqs);
+  if((w.compress = sftp_compress(&h)))
+    raw = sftp_alloc(fakejob.a, w.pipe.maxsize);
   w.remote = remote;
+  w.protocol = protocol;
   gettimeofday(&started, 0);
   ferrcheck(pthread_mutex_init(&w.m, 0));
   ferrcheck(pthread_cond_init(&w.c1, 0));
   ferrcheck(pthread_cond_init(&w.c2, 0));
   ferrcheck(pthread_create(&tid, 0, writer_thread, &w));
   ferrcheck(pthread_mutex_lock(&w.m));
-  offset = 0;
+  offset = resumed;
   while(!w.failed && !eof && !failed) {
     /* Wait until we're allowed to send another request */
-    if(w.outstanding >= nrequests) {
+    if(w.outstanding >= w.pipe.depth) {
       ferrcheck(pthread_cond_wait(&w.c2, &w.m));
       continue;
     }
+    len = w.pipe.size;
     /* Release the lock while we mess around with IO */
     ferrcheck(pthread_mutex_unlock(&w.m));
     /* Construct a write command */
@@ -1984,120 +3470,790 @@ static int cmd_put(int ac, char **av, unsigned options) {
     sftp_send_uint32(&fakeworker, id = newid());
     sftp_send_bytes(&fakeworker, h.data, h.len);
     sftp_send_uint64(&fakeworker, offset);
-    sftp_send_need(fakejob.worker, buffersize + 4);
+    sftp_send_need(fakejob.worker, len + 4);
     if(textmode) {
       char *const start =
           ((char *)fakejob.worker->buffer + fakejob.worker->bufused + 4);
       char *ptr = start;
-      size_t left = buffersize;
+      size_t left = len;
       const size_t newline_len = strlen(newline);
       int c;
       /* We will need to perform a translation step.  We read from stdio into
        * our buffer expanding newlines as necessary. */
 
-      while(left > 0 && (c = getc(fp)) != EOF) {
-        if(c == '\n') {
-          /* We found a newline.  Let us translated it to the desired wire
-           * format. */
-          if(left >= newline_len) {
-            /* We can fit a translated newline here */
-            strcpy(ptr, newline);
-            ptr += newline_len;
-            left -= newline_len;
-          } else {
-            /* Whoops, we cannot fit a translated newline in. */
-            if(ungetc(c, fp) < 0)
-              sftp_fatal("ungetc: %s", strerror(errno));
-          }
-        } else {
-          /* This character is not a newline. */
-          *ptr++ = c;
-          --left;
+      while(left > 0 && (c = getc(fp)) != EOF) {
+        if(c == '\n') {
+          /* We found a newline.  Let us translated it to the desired wire
+           * format. */
+          if(left >= newline_len) {
+            /* We can fit a translated newline here */
+            strcpy(ptr, newline);
+            ptr += newline_len;
+            left -= newline_len;
+          } else {
+            /* Whoops, we cannot fit a translated newline in. */
+            if(ungetc(c, fp) < 0)
+              sftp_fatal("ungetc: %s", strerror(errno));
+          }
+        } else {
+          /* This character is not a newline. */
+          *ptr++ = c;
+          --left;
+        }
+      }
+      /* Fake up n to look like the result of read() */
+      if(ferror(fp))
+        n = -1;
+      else
+        n = ptr - start;
+      /* There is always space to write at least one translated newline (see
+       * main() below) so n will only be 0 if we genuinely are at EOF. */
+    } else if(w.compress) {
+      /* Compress into our output buffer */
+      if((n = read(fd, raw, len)) > 0) {
+        sftp_send_need(fakejob.worker,
+                       sftp_compress_frame_bound(w.compress, n) + 4);
+        size = sftp_compress_frame(
+            w.compress, fakejob.worker->buffer + fakejob.worker->bufused + 4,
+            raw, n);
+      }
+    } else {
+      /* We read straight into our output buffer */
+      n = read(fd, fakejob.worker->buffer + fakejob.worker->bufused + 4, len);
+    }
+    if(n > 0) {
+      /* Update the reqs[] array first, so that a reply can't arrive before its
+       * ID is listed */
+      ferrcheck(pthread_mutex_lock(&w.m));
+      for(i = 0; i < w.pipe.maxdepth && w.reqs[i].id; ++i)
+        ;
+      assert(i < w.pipe.maxdepth);
+      w.reqs[i].id = id;
+      w.reqs[i].n = n;
+      w.reqs[i].sent = monotonic_now();
+      ++w.outstanding;
+      ferrcheck(pthread_mutex_unlock(&w.m));
+      /* Send off the write request with however much data we read */
+      if(!w.compress)
+        size = n;
+      sftp_send_uint32(&fakeworker, size);
+      fakejob.worker->bufused += size;
+      sftp_send_end(&fakeworker);
+      offset += n;
+    } else if(n == 0) {
+      /* We reached EOF on the input file */
+      eof = 1;
+    } else {
+      /* Error reading the input file */
+      error("error reading %s: %s", local, strerror(errno));
+      failed = 1;
+    }
+    ferrcheck(pthread_mutex_lock(&w.m));
+    ferrcheck(pthread_cond_signal(&w.c1));
+  }
+  w.finished = 1;
+  ferrcheck(pthread_cond_signal(&w.c1));
+  ferrcheck(pthread_mutex_unlock(&w.m));
+  ferrcheck(pthread_join(tid, 0));
+  assert(w.outstanding == 0);
+  ferrcheck(pthread_mutex_destroy(&w.m));
+  ferrcheck(pthread_cond_destroy(&w.c1));
+  ferrcheck(pthread_cond_destroy(&w.c2));
+  if(failed || w.failed)
+    goto error;
+  gettimeofday(&finished, 0);
+  if(progress_indicators) {
+    elapsed = ((finished.tv_sec - started.tv_sec) +
+               (finished.tv_usec - started.tv_usec) / 1000000.0);
+    sftp_xprintf("%" PRIu64 " bytes in %.1f seconds", w.written, elapsed);
+    if(elapsed > 0.1)
+      sftp_xprintf(" %.0f bytes/sec", w.written / elapsed);
+    if(w.pipe.adapt)
+      sftp_xprintf(", window %dx%zuK", w.pipe.depth, w.pipe.size / 1024);
+    sftp_xprintf("\n");
+  }
+transferred:
+  if(fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  if(fp) {
+    fclose(fp);
+    fp = 0;
+  }
+  if(durable && sftp_fsync(&h))
+    goto error;
+  if(preserve) {
+    /* mtime at least will be nadgered */
+    if(sftp_fsetstat(&h, &attrs))
+      goto error;
+  }
+  sftp_close(&h);
+  return 0;
+error:
+  if(fp)
+    fclose(fp);
+  if(fd >= 0)
+    close(fd);
+  if(h.len) {
+    sftp_close(&h);
+    if(!resume)
+      sftp_remove(remote); /* tidy up our mess */
+  }
+  return -1;
+}
+
+static int cmd_put(int ac, char **av, unsigned options) {
+  return put_common(ac, av, options, 0);
+}
+
+static int cmd_reput(int ac, char **av, unsigned options) {
+  return put_common(ac, av, options, 1);
+}
+
+/* Multi-file transfers.  Up to mjobs files are in flight at once, sharing
+ * one request window.  Everything happens in one thread: it
+ * sends whatever requests the window allows and then handles the next
+ * response, whichever file it belongs to. */
+
+/* Default number of files in flight */
+#define MJOBS 4
+
+/* Progress of one file */
+enum mstate {
+  m_pending, /* not started */
+  m_whole,   /* put-file or get-file sent */
+  m_open,    /* SSH_FXP_OPEN sent */
+  m_stat,    /* SSH_FXP_FSTAT sent */
+  m_data,    /* transferring data */
+  m_close,   /* SSH_FXP_CLOSE sent */
+  m_remove,  /* SSH_FXP_REMOVE sent, tidying up a failed upload */
+  m_done
+};
+
+/* One file in a multi-file transfer */
+struct mfile {
+  struct mfile *next;
+  const char *local, *remote;
+  char *tmp;                /* temporary local file for downloads */
+  int fd;                   /* local file or -1 */
+  struct client_handle h;   /* remote handle, if open */
+  uint64_t size;            /* bytes to transfer, (uint64_t)-1 if unknown */
+  uint64_t offset;          /* offset of next request */
+  uint64_t done;            /* bytes transferred */
+  int outstanding;          /* requests in flight */
+  int eof;                  /* no more requests needed */
+  int failed;               /* an error has been reported */
+  enum mstate state;
+};
+
+/* A request in flight */
+struct mreq {
+  uint32_t id; /* or 0 for empty slot */
+  struct mfile *f;
+  uint64_t offset;
+  uint32_t len;
+  double sent;
+};
+
+/* State of a multi-file transfer */
+struct mtransfer {
+  int put;             /* non-0 for uploads */
+  struct pipeline pipe; /* window */
+  struct mreq *reqs;   /* pipe.maxdepth slots */
+  int outstanding;     /* requests in flight */
+  struct mfile *files; /* files not yet finished */
+  struct mfile **tail;
+  int nfiles, ok;      /* statistics */
+  uint64_t bytes;
+};
+
+/* Add a file to a multi-file transfer */
+static void madd(struct mtransfer *t, const char *local, const char *remote,
+                 uint64_t size) {
+  struct mfile *f = sftp_alloc(fakejob.a, sizeof *f);
+
+  sftp_memset(f, 0, sizeof *f);
+  f->local = local;
+  f->remote = remote;
+  f->fd = -1;
+  f->size = size;
+  f->state = m_pending;
+  *t->tail = f;
+  t->tail = &f->next;
+  ++t->nfiles;
+}
+
+/* Join a directory and a name */
+static char *mjoin(const char *dir, const char *name) {
+  char *path = sftp_alloc(fakejob.a, strlen(dir) + strlen(name) + 2);
+
+  sprintf(path, "%s/%s", dir, name);
+  return path;
+}
+
+/* Record a request in flight */
+static void mrecord(struct mtransfer *t, struct mfile *f, uint32_t id,
+                    uint64_t offset, uint32_t len) {
+  int i;
+
+  for(i = 0; i < t->pipe.maxdepth && t->reqs[i].id; ++i)
+    ;
+  assert(i < t->pipe.maxdepth);
+  t->reqs[i].id = id;
+  t->reqs[i].f = f;
+  t->reqs[i].offset = offset;
+  t->reqs[i].len = len;
+  t->reqs[i].sent = monotonic_now();
+  ++t->outstanding;
+  ++f->outstanding;
+}
+
+/* Report a failed file, using the status in the current response if
+ * there is one */
+static void mfail(struct mfile *f, const char *why) {
+  uint32_t st;
+  char *msg;
+
+  if(!f->failed) {
+    if(!why) {
+      fakejob.ptr = fakejob.data + 5;
+      fakejob.left = fakejob.len - 5;
+      cpcheck(sftp_parse_uint32(&fakejob, &st));
+      cpcheck(sftp_parse_string(&fakejob, &msg, 0));
+      error("%s: %s (%s)", f->remote, msg, status_to_string(st));
+    } else
+      error("%s: %s", f->local, why);
+  }
+  f->failed = 1;
+  f->eof = 1;
+}
+
+/* Send a request that only needs a handle */
+static void msend_handle(struct mtransfer *t, struct mfile *f, uint8_t type) {
+  uint32_t id;
+
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, type);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_bytes(&fakeworker, f->h.data, f->h.len);
+  if(type == SSH_FXP_FSTAT && protocol->version > 3)
+    sftp_send_uint32(&fakeworker, SSH_FILEXFER_ATTR_SIZE);
+  sftp_send_end(&fakeworker);
+  mrecord(t, f, id, 0, 0);
+}
+
+/* Start transferring a file */
+static void mstart(struct mtransfer *t, struct mfile *f) {
+  struct sftpattr attrs;
+  struct stat sb;
+  uint32_t id;
+  ssize_t n;
+  char *data;
+
+  if(t->put) {
+    if((f->fd = open(f->local, O_RDONLY)) < 0 || fstat(f->fd, &sb) < 0) {
+      mfail(f, strerror(errno));
+      f->state = m_done;
+      return;
+    }
+    f->size = sb.st_size;
+    if(put_file_extension && f->size <= buffersize) {
+      /* Small files go in a single request */
+      sftp_memset(&attrs, 0, sizeof attrs);
+      sftp_send_begin(&fakeworker);
+      sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+      sftp_send_uint32(&fakeworker, id = newid());
+      sftp_send_string(&fakeworker, PUT_FILE);
+      sftp_send_path(&fakejob, &fakeworker, f->remote);
+      sftp_send_uint32(&fakeworker, SSH_FXF_CREATE_TRUNCATE);
+      protocol->sendattrs(&fakejob, &attrs);
+      sftp_send_need(&fakeworker, f->size + 4);
+      data = (char *)fakeworker.buffer + fakeworker.bufused + 4;
+      if((n = pread(f->fd, data, f->size, 0)) < 0) {
+        mfail(f, strerror(errno));
+        f->state = m_done;
+        return;
+      }
+      sftp_send_uint32(&fakeworker, n);
+      fakeworker.bufused += n;
+      sftp_send_end(&fakeworker);
+      f->done = n;
+      f->state = m_whole;
+    } else {
+      sftp_memset(&attrs, 0, sizeof attrs);
+      if(protocol->version >= 5) {
+        attrs.valid = SSH_FILEXFER_ATTR_SIZE;
+        attrs.size = f->size;
+      }
+      if(sftp_open_send(f->remote, ACE4_WRITE_DATA | ACE4_WRITE_ATTRIBUTES,
+                        SSH_FXF_CREATE_TRUNCATE, &attrs, &id))
+        sftp_fatal("cannot open %s", f->remote);
+      f->state = m_open;
+    }
+  } else {
+    f->tmp = sftp_alloc(fakejob.a, strlen(f->local) + 5);
+    sprintf(f->tmp, "%s.new", f->local);
+    if((f->fd = open(f->tmp, O_WRONLY | O_TRUNC | O_CREAT, 0666)) < 0) {
+      mfail(f, strerror(errno));
+      f->state = m_done;
+      return;
+    }
+    if(get_file_extension &&
+       (f->size == (uint64_t)-1 || f->size <= buffersize)) {
+      sftp_send_begin(&fakeworker);
+      sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+      sftp_send_uint32(&fakeworker, id = newid());
+      sftp_send_string(&fakeworker, GET_FILE);
+      sftp_send_path(&fakejob, &fakeworker, f->remote);
+      sftp_send_uint32(&fakeworker, 0);
+      sftp_send_uint32(&fakeworker, buffersize);
+      sftp_send_end(&fakeworker);
+      f->state = m_whole;
+    } else {
+      sftp_memset(&attrs, 0, sizeof attrs);
+      if(sftp_open_send(f->remote, ACE4_READ_DATA | ACE4_READ_ATTRIBUTES,
+                        SSH_FXF_OPEN_EXISTING, &attrs, &id))
+        sftp_fatal("cannot open %s", f->remote);
+      f->state = m_open;
+    }
+  }
+  mrecord(t, f, id, 0, 0);
+}
+
+/* Send the next data request for a file.  Returns non-0 if one was sent. */
+static int mnext(struct mtransfer *t, struct mfile *f) {
+  uint32_t id, len;
+  ssize_t n;
+
+  if(f->state != m_data || f->eof)
+    return 0;
+  if(f->size != (uint64_t)-1 && f->offset >= f->size) {
+    f->eof = 1;
+    return 0;
+  }
+  len = t->pipe.size;
+  if(f->size != (uint64_t)-1 && f->size - f->offset < len)
+    len = f->size - f->offset;
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, t->put ? SSH_FXP_WRITE : SSH_FXP_READ);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_bytes(&fakeworker, f->h.data, f->h.len);
+  sftp_send_uint64(&fakeworker, f->offset);
+  if(t->put) {
+    /* We read straight into our output buffer */
+    sftp_send_need(&fakeworker, len + 4);
+    n = pread(f->fd, fakeworker.buffer + fakeworker.bufused + 4, len,
+              f->offset);
+    if(n <= 0) {
+      /* The file got shorter, or can't be read */
+      if(n < 0)
+        mfail(f, strerror(errno));
+      f->eof = 1;
+      return 0;
+    }
+    len = n;
+    sftp_send_uint32(&fakeworker, len);
+    fakeworker.bufused += len;
+  } else
+    sftp_send_uint32(&fakeworker, len);
+  sftp_send_end(&fakeworker);
+  mrecord(t, f, id, f->offset, len);
+  f->offset += len;
+  return 1;
+}
+
+/* Finish with a file once nothing is in flight for it */
+static void mfinish(struct mtransfer *t, struct mfile *f) {
+  uint32_t id;
+
+  if(f->outstanding)
+    return;
+  switch(f->state) {
+  case m_data:
+    if(!f->eof)
+      return;
+    msend_handle(t, f, SSH_FXP_CLOSE);
+    f->state = m_close;
+    return;
+  case m_close:
+  case m_whole:
+    if(f->failed && t->put && f->state == m_close) {
+      /* Tidy up our mess */
+      sftp_send_begin(&fakeworker);
+      sftp_send_uint8(&fakeworker, SSH_FXP_REMOVE);
+      sftp_send_uint32(&fakeworker, id = newid());
+      sftp_send_path(&fakejob, &fakeworker, f->remote);
+      sftp_send_end(&fakeworker);
+      mrecord(t, f, id, 0, 0);
+      f->state = m_remove;
+      return;
+    }
+    break;
+  case m_open:
+  case m_stat:
+  case m_remove:
+    break;
+  default:
+    return;
+  }
+  if(f->fd >= 0) {
+    if(close(f->fd) < 0 && !t->put)
+      mfail(f, strerror(errno));
+    f->fd = -1;
+  }
+  if(!t->put) {
+    if(!f->failed && rename(f->tmp, f->local) < 0)
+      mfail(f, strerror(errno));
+    if(f->failed)
+      unlink(f->tmp);
+  }
+  if(!f->failed) {
+    ++t->ok;
+    t->bytes += f->done;
+  }
+  f->state = m_done;
+}
+
+/* Handle a response for a file */
+static void mresponse(struct mtransfer *t, struct mreq *r, uint8_t type) {
+  struct mfile *const f = r->f;
+  struct sftpattr attrs;
+  uint32_t st, id;
+  char *data;
+  size_t len;
+  ssize_t n;
+
+  --t->outstanding;
+  --f->outstanding;
+  if(type == SSH_FXP_STATUS) {
+    cpcheck(sftp_parse_uint32(&fakejob, &st));
+    fakejob.ptr = fakejob.data + 5;
+    fakejob.left = fakejob.len - 5;
+  } else
+    st = SSH_FX_OK;
+  switch(f->state) {
+  case m_whole:
+    if(type == SSH_FXP_EXTENDED_REPLY) {
+      cpcheck(protocol->parseattrs(&fakejob, &attrs));
+      cpcheck(sftp_parse_string(&fakejob, &data, &len));
+      f->done = len;
+      while(len > 0) {
+        if((n = write(f->fd, data, len)) < 0) {
+          mfail(f, strerror(errno));
+          break;
         }
+        data += n;
+        len -= n;
       }
-      /* Fake up n to look like the result of read() */
-      if(ferror(fp))
-        n = -1;
-      else
-        n = ptr - start;
-      /* There is always space to write at least one translated newline (see
-       * main() below) so n will only be 0 if we genuinely are at EOF. */
-    } else {
-      /* We read straight into our output buffer */
-      n = read(fd, fakejob.worker->buffer + fakejob.worker->bufused + 4,
-               buffersize);
+    } else if(!t->put && st == SSH_FX_FAILURE) {
+      /* Too large for get-file */
+      sftp_memset(&attrs, 0, sizeof attrs);
+      if(sftp_open_send(f->remote, ACE4_READ_DATA | ACE4_READ_ATTRIBUTES,
+                        SSH_FXF_OPEN_EXISTING, &attrs, &id))
+        sftp_fatal("cannot open %s", f->remote);
+      mrecord(t, f, id, 0, 0);
+      f->state = m_open;
+    } else if(st != SSH_FX_OK)
+      mfail(f, 0);
+    break;
+  case m_open:
+    if(type != SSH_FXP_HANDLE) {
+      mfail(f, 0);
+      break;
     }
-    if(n > 0) {
-      /* Update the reqs[] array first, so that a reply can't arrive before its
-       * ID is listed */
-      ferrcheck(pthread_mutex_lock(&w.m));
-      for(i = 0; i < nrequests && w.reqs[i].id; ++i)
-        ;
-      assert(i < nrequests);
-      w.reqs[i].id = id;
-      w.reqs[i].n = n;
-      ++w.outstanding;
-      ferrcheck(pthread_mutex_unlock(&w.m));
-      /* Send off the write request with however much data we read */
-      sftp_send_uint32(&fakeworker, n);
-      fakejob.worker->bufused += n;
-      sftp_send_end(&fakeworker);
-      offset += n;
-    } else if(n == 0) {
-      /* We reached EOF on the input file */
-      eof = 1;
-    } else {
-      /* Error reading the input file */
-      error("error reading %s: %s", local, strerror(errno));
-      failed = 1;
+    cpcheck(sftp_parse_string(&fakejob, &data, &len));
+    f->h.data = sftp_alloc(fakejob.a, len);
+    memcpy(f->h.data, data, len);
+    f->h.len = len;
+    if(!t->put && f->size == (uint64_t)-1) {
+      msend_handle(t, f, SSH_FXP_FSTAT);
+      f->state = m_stat;
+    } else
+      f->state = m_data;
+    break;
+  case m_stat:
+    if(type == SSH_FXP_ATTRS) {
+      cpcheck(protocol->parseattrs(&fakejob, &attrs));
+      if(attrs.valid & SSH_FILEXFER_ATTR_SIZE)
+        f->size = attrs.size;
+    } else
+      mfail(f, 0);
+    f->state = m_data;
+    break;
+  case m_data:
+    if(t->put) {
+      if(st == SSH_FX_OK) {
+        f->done += r->len;
+        pipeline_response(&t->pipe, r->sent, r->len);
+      } else
+        mfail(f, 0);
+    } else if(type == SSH_FXP_DATA) {
+      cpcheck(sftp_parse_string(&fakejob, &data, &len));
+      if(len > r->len)
+        sftp_fatal("oversized SSH_FXP_DATA for %s", f->remote);
+      if(pwrite(f->fd, data, len, r->offset) < 0)
+        mfail(f, strerror(errno));
+      f->done += len;
+      pipeline_response(&t->pipe, r->sent, len);
+      if(len && len < r->len && !f->failed) {
+        /* Short read, ask for the rest */
+        sftp_send_begin(&fakeworker);
+        sftp_send_uint8(&fakeworker, SSH_FXP_READ);
+        sftp_send_uint32(&fakeworker, id = newid());
+        sftp_send_bytes(&fakeworker, f->h.data, f->h.len);
+        sftp_send_uint64(&fakeworker, r->offset + len);
+        sftp_send_uint32(&fakeworker, r->len - len);
+        sftp_send_end(&fakeworker);
+        mrecord(t, f, id, r->offset + len, r->len - len);
+      }
+    } else if(st == SSH_FX_EOF)
+      f->eof = 1;
+    else
+      mfail(f, 0);
+    break;
+  case m_close:
+    if(st != SSH_FX_OK)
+      mfail(f, 0);
+    break;
+  default:
+    break;
+  }
+  /* Closing the handle is all that's left after a failure */
+  if(f->failed && f->state == m_data)
+    f->eof = 1;
+  if(f->failed && f->state != m_data && f->state != m_close &&
+     f->state != m_remove && f->h.len && !f->outstanding) {
+    msend_handle(t, f, SSH_FXP_CLOSE);
+    f->state = m_close;
+  }
+  mfinish(t, f);
+}
+
+/* Run a multi-file transfer */
+static int mrun(struct mtransfer *t, int jobs) {
+  struct mfile *f, **fp, *pending = t->files;
+  struct timeval started, finished;
+  double elapsed;
+  uint8_t type;
+  int i, active = 0, sent;
+
+  pipeline_init(&t->pipe, t->put);
+  t->reqs = sftp_alloc(fakejob.a, t->pipe.maxdepth * sizeof *t->reqs);
+  sftp_memset(t->reqs, 0, t->pipe.maxdepth * sizeof *t->reqs);
+  gettimeofday(&started, 0);
+  for(;;) {
+    /* Start more files if there's room */
+    while(pending && active < jobs && t->outstanding < t->pipe.depth) {
+      mstart(t, pending);
+      if(pending->state != m_done)
+        ++active;
+      pending = pending->next;
     }
-    ferrcheck(pthread_mutex_lock(&w.m));
-    ferrcheck(pthread_cond_signal(&w.c1));
+    /* Fill the window, taking turns between files */
+    do {
+      sent = 0;
+      for(f = t->files; f != pending && t->outstanding < t->pipe.depth;
+          f = f->next) {
+        if(mnext(t, f))
+          sent = 1;
+        else
+          mfinish(t, f);
+      }
+    } while(sent && t->outstanding < t->pipe.depth);
+    /* Forget finished files */
+    for(fp = &t->files; (f = *fp) != pending;)
+      if(f->state == m_done) {
+        *fp = f->next;
+        --active;
+      } else
+        fp = &f->next;
+    if(!t->outstanding) {
+      if(!pending)
+        break;
+      continue;
+    }
+    type = getresponse(-1, 0, "multi-file transfer");
+    for(i = 0; i < t->pipe.maxdepth && t->reqs[i].id != fakejob.id; ++i)
+      ;
+    if(i >= t->pipe.maxdepth)
+      sftp_fatal("unexpected response ID %" PRIu32, fakejob.id);
+    t->reqs[i].id = 0;
+    mresponse(t, &t->reqs[i], type);
   }
-  w.finished = 1;
-  ferrcheck(pthread_cond_signal(&w.c1));
-  ferrcheck(pthread_mutex_unlock(&w.m));
-  ferrcheck(pthread_join(tid, 0));
-  assert(w.outstanding == 0);
-  ferrcheck(pthread_mutex_destroy(&w.m));
-  ferrcheck(pthread_cond_destroy(&w.c1));
-  ferrcheck(pthread_cond_destroy(&w.c2));
-  if(failed || w.failed)
-    goto error;
   gettimeofday(&finished, 0);
   if(progress_indicators) {
     elapsed = ((finished.tv_sec - started.tv_sec) +
                (finished.tv_usec - started.tv_usec) / 1000000.0);
-    sftp_xprintf("%" PRIu64 " bytes in %.1f seconds", w.written, elapsed);
+    sftp_xprintf("%d files, %" PRIu64 " bytes in %.1f seconds", t->ok,
+                 t->bytes, elapsed);
     if(elapsed > 0.1)
-      sftp_xprintf(" %.0f bytes/sec", w.written / elapsed);
+      sftp_xprintf(" %.0f bytes/sec", t->bytes / elapsed);
     sftp_xprintf("\n");
   }
-  if(fd >= 0) {
-    close(fd);
-    fd = -1;
+  return t->ok == t->nfiles ? 0 : -1;
+}
+
+/* Parse options common to mget and mput */
+static int moptions(int *acp, char ***avp, int *recursep, int *jobsp) {
+  char **av = *avp;
+  int ac = *acp;
+
+  *recursep = 0;
+  *jobsp = MJOBS;
+  while(ac && av[0][0] == '-') {
+    if(!strcmp(av[0], "-r"))
+      *recursep = 1;
+    else if(!strcmp(av[0], "-j") && ac > 1) {
+      if((*jobsp = atoi(av[1])) <= 0)
+        return error("invalid job count '%s'", av[1]);
+      ++av;
+      --ac;
+    } else
+      return error("unknown option '%s'", av[0]);
+    ++av;
+    --ac;
   }
-  if(fp) {
-    fclose(fp);
-    fp = 0;
+  if(!ac)
+    return error("no files to transfer");
+  if(textmode)
+    return error("multi-file transfers are binary only");
+  *acp = ac;
+  *avp = av;
+  return 0;
+}
+
+/* Add a local file or directory tree to an upload */
+static int mput_add(struct mtransfer *t, const char *local,
+                    const char *remote, int recurse) {
+  struct stat sb;
+  struct dirent *de;
+  uint32_t id, st;
+  DIR *dp;
+  int rc = 0;
+
+  if(stat(local, &sb) < 0)
+    return error("cannot stat %s: %s", local, strerror(errno));
+  if(S_ISREG(sb.st_mode)) {
+    madd(t, local, remote, sb.st_size);
+    return 0;
   }
-  if(preserve) {
-    /* mtime at least will be nadgered */
-    if(sftp_fsetstat(&h, &attrs))
-      goto error;
+  if(!S_ISDIR(sb.st_mode))
+    return error("%s is not a regular file", local);
+  if(!recurse)
+    return error("%s is a directory", local);
+  /* The directory might already exist */
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_MKDIR);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_path(&fakejob, &fakeworker, remote);
+  sftp_send_uint32(&fakeworker, 0);
+  if(protocol->version >= 4)
+    sftp_send_uint8(&fakeworker, SSH_FILEXFER_TYPE_DIRECTORY);
+  sftp_send_end(&fakeworker);
+  getresponse(SSH_FXP_STATUS, id, "SSH_FXP_MKDIR");
+  cpcheck(sftp_parse_uint32(&fakejob, &st));
+  if(st != SSH_FX_OK && st != SSH_FX_FAILURE &&
+     st != SSH_FX_FILE_ALREADY_EXISTS)
+    return status();
+  if(!(dp = opendir(local)))
+    return error("cannot open %s: %s", local, strerror(errno));
+  while((de = readdir(dp))) {
+    if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+    if(mput_add(t, mjoin(local, de->d_name), mjoin(remote, de->d_name),
+                recurse))
+      rc = -1;
+  }
+  closedir(dp);
+  return rc;
+}
+
+/* Add a remote file or directory tree to a download */
+static int mget_add(struct mtransfer *t, const char *remote,
+                    const char *local, int recurse, uint8_t type,
+                    uint64_t size) {
+  struct client_handle h;
+  struct sftpattr *attrs;
+  size_t nattrs, n;
+  int rc = 0;
+
+  if(type == SSH_FILEXFER_TYPE_REGULAR) {
+    madd(t, local, remote, size);
+    return 0;
+  }
+  if(type != SSH_FILEXFER_TYPE_DIRECTORY)
+    return 0; /* only files and directories are copied */
+  if(mkdir(local, 0777) < 0 && errno != EEXIST)
+    return error("cannot create %s: %s", local, strerror(errno));
+  if(sftp_opendir(remote, &h))
+    return -1;
+  for(;;) {
+    if(sftp_readdir(&h, &attrs, &nattrs)) {
+      rc = -1;
+      break;
+    }
+    if(!nattrs)
+      break;
+    for(n = 0; n < nattrs; ++n) {
+      if(!strcmp(attrs[n].name, ".") || !strcmp(attrs[n].name, ".."))
+        continue;
+      if(mget_add(t, mjoin(remote, attrs[n].name),
+                  mjoin(local, attrs[n].name), recurse, attrs[n].type,
+                  attrs[n].valid & SSH_FILEXFER_ATTR_SIZE ? attrs[n].size
+                                                          : (uint64_t)-1))
+        rc = -1;
+    }
   }
   sftp_close(&h);
-  return 0;
-error:
-  if(fp)
-    fclose(fp);
-  if(fd >= 0)
-    close(fd);
-  if(h.len) {
-    sftp_close(&h);
-    sftp_remove(remote); /* tidy up our mess */
+  return rc;
+}
+
+static int cmd_mget(int ac, char **av, unsigned options) {
+  struct mtransfer t;
+  struct sftpattr attrs;
+  const char *remote;
+  int recurse, jobs, rc = 0;
+
+  if(moptions(&ac, &av, &recurse, &jobs))
+    return -1;
+  remote_cwd();
+  sftp_memset(&t, 0, sizeof t);
+  t.tail = &t.files;
+  for(; ac > 0; --ac, ++av) {
+    remote = sftp_fullpath(&fakejob, *av, options);
+    if(!recurse)
+      madd(&t, basename(*av), remote, (uint64_t)-1);
+    else if(sftp_stat(remote, &attrs, SSH_FXP_STAT) ||
+            mget_add(&t, remote, basename(*av), 1, attrs.type,
+                     attrs.valid & SSH_FILEXFER_ATTR_SIZE ? attrs.size
+                                                          : (uint64_t)-1))
+      rc = -1;
   }
-  return -1;
+  if(read_order())
+    return -1;
+  if(mrun(&t, jobs))
+    rc = -1;
+  return rc;
+}
+
+static int cmd_mput(int ac, char **av, unsigned options) {
+  struct mtransfer t;
+  int recurse, jobs, rc = 0;
+
+  if(moptions(&ac, &av, &recurse, &jobs))
+    return -1;
+  remote_cwd();
+  sftp_memset(&t, 0, sizeof t);
+  t.put = 1;
+  t.tail = &t.files;
+  for(; ac > 0; --ac, ++av)
+    if(mput_add(&t, *av, sftp_fullpath(&fakejob, basename(*av), options),
+                recurse))
+      rc = -1;
+  if(mrun(&t, jobs))
+    rc = -1;
+  return rc;
 }
 
 static int cmd_progress(int ac, char **av,
@@ -2114,6 +4270,26 @@ static int cmd_progress(int ac, char **av,
   return 0;
 }
 
+static int cmd_compress(int ac, char **av,
+                        unsigned attribute((unused)) options) {
+  if(ac && !strcmp(av[0], "off")) {
+    compress_methods = NULL;
+    return 0;
+  }
+  if(!compress_extension)
+    return error("no compress extension found");
+  if(ac) {
+    if(!sftp_compress_choose(av[0]))
+      return error("no supported method in '%s'", av[0]);
+    compress_methods = sftp_xstrdup(av[0]);
+  } else {
+    if(!*sftp_compress_methods())
+      return error("no compression methods available");
+    compress_methods = sftp_compress_methods();
+  }
+  return 0;
+}
+
 static int cmd_text(int attribute((unused)) ac, char attribute((unused)) * *av,
                     unsigned attribute((unused)) options) {
   if(protocol->version < 4)
@@ -2448,38 +4624,299 @@ static int cmd_bad_path(int attribute((unused)) ac,
                                           * sequence */
   /* missing type field */
   sftp_send_end(&fakeworker);
-  getresponse(SSH_FXP_STATUS, 0, "_bad_path");
-  status();
-  return 0;
+  getresponse(SSH_FXP_STATUS, 0, "_bad_path");
+  status();
+  return 0;
+}
+
+static int cmd_stat(int attribute((unused)) ac, char **av, unsigned options) {
+  struct sftpattr attrs;
+  time_t now;
+  struct tm nowtime;
+
+  remote_cwd();
+  if(sftp_stat(sftp_fullpath(&fakejob, av[0], options), &attrs, SSH_FXP_STAT))
+    return -1;
+  attrs.name = av[0];
+  time(&now);
+  gmtime_r(&now, &nowtime);
+  sftp_xprintf("%s\n", sftp_format_attr(fakejob.a, &attrs, nowtime.tm_year, 0));
+  return 0;
+}
+
+static int cmd_lstat(int attribute((unused)) ac, char **av, unsigned options) {
+  struct sftpattr attrs;
+  time_t now;
+  struct tm nowtime;
+
+  remote_cwd();
+  if(sftp_stat(sftp_fullpath(&fakejob, av[0], options), &attrs, SSH_FXP_LSTAT))
+    return -1;
+  attrs.name = av[0];
+  time(&now);
+  gmtime_r(&now, &nowtime);
+  sftp_xprintf("%s\n", sftp_format_attr(fakejob.a, &attrs, nowtime.tm_year, 0));
+  return 0;
+}
+
+static int cmd_mstat(int ac, char **av, unsigned options) {
+  struct sftpattr attrs;
+  uint32_t flags = 0, id, count, st, i;
+  time_t now;
+  struct tm nowtime;
+
+  if(!stat_batch_extension)
+    return error("no stat-batch extension found");
+  if(!strcmp(av[0], "-L")) {
+    flags |= STAT_BATCH_FOLLOW;
+    ++av;
+    if(!--ac)
+      return error("no paths to stat");
+  }
+  remote_cwd();
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, STAT_BATCH);
+  sftp_send_uint32(&fakeworker, flags);
+  sftp_send_uint32(&fakeworker, ac);
+  for(i = 0; i < (uint32_t)ac; ++i)
+    sftp_send_path(&fakejob, &fakeworker,
+                   sftp_fullpath(&fakejob, av[i], options));
+  sftp_send_end(&fakeworker);
+  if(getresponse(SSH_FXP_EXTENDED_REPLY, id, STAT_BATCH) !=
+     SSH_FXP_EXTENDED_REPLY)
+    return -1;
+  cpcheck(sftp_parse_uint32(&fakejob, &count));
+  if(count != (uint32_t)ac)
+    sftp_fatal("wrong count in %s reply", STAT_BATCH);
+  time(&now);
+  gmtime_r(&now, &nowtime);
+  for(i = 0; i < count; ++i) {
+    cpcheck(sftp_parse_uint32(&fakejob, &st));
+    if(st) {
+      sftp_xprintf("%s: %s\n", av[i], status_to_string(st));
+      continue;
+    }
+    cpcheck(protocol->parseattrs(&fakejob, &attrs));
+    attrs.name = av[i];
+    sftp_xprintf("%s\n",
+                 sftp_format_attr(fakejob.a, &attrs, nowtime.tm_year, 0));
+  }
+  return 0;
+}
+
+static int cmd_readv(int ac, char **av, unsigned options) {
+  struct client_handle h;
+  struct sftpattr attrs;
+  uint64_t *offsets;
+  uint32_t *lengths, id, count, i;
+  char *data, *end;
+  size_t len;
+  int rc = -1;
+
+  if(!read_vector_extension)
+    return error("no read-vector extension found");
+  offsets = sftp_alloc(fakejob.a, ac * sizeof *offsets);
+  lengths = sftp_alloc(fakejob.a, ac * sizeof *lengths);
+  for(i = 1; i < (uint32_t)ac; ++i) {
+    offsets[i] = strtoull(av[i], &end, 0);
+    if(*end != '+')
+      return error("invalid range '%s'", av[i]);
+    lengths[i] = strtoul(end + 1, &end, 0);
+    if(*end)
+      return error("invalid range '%s'", av[i]);
+  }
+  sftp_memset(&attrs, 0, sizeof attrs);
+  if(sftp_open(sftp_fullpath(&fakejob, av[0], options),
+               ACE4_READ_DATA, SSH_FXF_OPEN_EXISTING, &attrs, &h))
+    return -1;
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, READ_VECTOR);
+  sftp_send_bytes(&fakeworker, h.data, h.len);
+  sftp_send_uint32(&fakeworker, ac - 1);
+  for(i = 1; i < (uint32_t)ac; ++i) {
+    sftp_send_uint64(&fakeworker, offsets[i]);
+    sftp_send_uint32(&fakeworker, lengths[i]);
+  }
+  sftp_send_end(&fakeworker);
+  if(getresponse(SSH_FXP_EXTENDED_REPLY, id, READ_VECTOR) !=
+     SSH_FXP_EXTENDED_REPLY)
+    goto done;
+  cpcheck(sftp_parse_uint32(&fakejob, &count));
+  if(count != (uint32_t)ac - 1)
+    sftp_fatal("wrong count in %s reply", READ_VECTOR);
+  for(i = 1; i <= count; ++i) {
+    cpcheck(sftp_parse_string(&fakejob, &data, &len));
+    sftp_xprintf("%s: %.*s\n", av[i], (int)len, data);
+  }
+  rc = 0;
+done:
+  sftp_close(&h);
+  return rc;
 }
 
-static int cmd_stat(int attribute((unused)) ac, char **av, unsigned options) {
-  struct sftpattr attrs;
+static int cmd_walk(int ac, char **av, unsigned options) {
+  uint32_t id, flags = 0;
+  uint64_t newer = 0, minsize = 0, maxsize = UINT64_MAX;
+  const char *glob = "", *opt;
+  struct client_handle h;
+  struct sftpattr *attrs, *allattrs = 0;
+  size_t nattrs, nallattrs = 0, n;
+  int longformat = 0;
   time_t now;
   struct tm nowtime;
 
+  if(!walk_extension)
+    return error("no walk extension found");
+  while(ac > 1 && av[0][0] == '-') {
+    opt = *av++;
+    --ac;
+    if(!strcmp(opt, "-d"))
+      flags |= WALK_ALL_DIRS;
+    else if(!strcmp(opt, "-l"))
+      longformat = 1;
+    else if(ac > 1 && !strcmp(opt, "-g"))
+      glob = *av++, --ac;
+    else if(ac > 1 && !strcmp(opt, "-n"))
+      newer = strtoull(*av++, 0, 10), --ac;
+    else if(ac > 1 && !strcmp(opt, "-s"))
+      minsize = strtoull(*av++, 0, 10), --ac;
+    else if(ac > 1 && !strcmp(opt, "-S"))
+      maxsize = strtoull(*av++, 0, 10), --ac;
+    else
+      return error("invalid option '%s'", opt);
+  }
+  if(ac != 1)
+    return error("wrong number of arguments");
   remote_cwd();
-  if(sftp_stat(sftp_fullpath(&fakejob, av[0], options), &attrs, SSH_FXP_STAT))
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, WALK);
+  sftp_send_path(&fakejob, &fakeworker, sftp_fullpath(&fakejob, av[0], options));
+  sftp_send_uint32(&fakeworker, flags);
+  if(*glob)
+    sftp_send_path(&fakejob, &fakeworker, glob);
+  else
+    sftp_send_string(&fakeworker, "");
+  sftp_send_uint64(&fakeworker, newer);
+  sftp_send_uint64(&fakeworker, minsize);
+  sftp_send_uint64(&fakeworker, maxsize);
+  sftp_send_end(&fakeworker);
+  if(getresponse(SSH_FXP_HANDLE, id, WALK) != SSH_FXP_HANDLE)
     return -1;
-  attrs.name = av[0];
+  cpcheck(sftp_parse_string(&fakejob, &h.data, &h.len));
+  for(;;) {
+    if(sftp_readdir(&h, &attrs, &nattrs)) {
+      sftp_close(&h);
+      free(allattrs);
+      return -1;
+    }
+    if(!nattrs)
+      break; /* eof */
+    allattrs = sftp_xrecalloc(allattrs, nattrs + nallattrs, sizeof *attrs);
+    for(n = 0; n < nattrs; ++n)
+      allattrs[nallattrs++] = attrs[n];
+  }
+  sftp_close(&h);
+  if(nallattrs)
+    qsort(allattrs, nallattrs, sizeof *allattrs, sort_by_name);
   time(&now);
   gmtime_r(&now, &nowtime);
-  sftp_xprintf("%s\n", sftp_format_attr(fakejob.a, &attrs, nowtime.tm_year, 0));
+  for(n = 0; n < nallattrs; ++n)
+    if(longformat)
+      sftp_xprintf("%s\n", sftp_format_attr(fakejob.a, &allattrs[n],
+                                             nowtime.tm_year, 0));
+    else
+      sftp_xprintf("%s\n", allattrs[n].name);
+  free(allattrs);
   return 0;
 }
 
-static int cmd_lstat(int attribute((unused)) ac, char **av, unsigned options) {
-  struct sftpattr attrs;
-  time_t now;
-  struct tm nowtime;
+static int cmd_unwatch(int attribute((unused)) ac,
+                       char attribute((unused)) * *av,
+                       unsigned attribute((unused)) options) {
+  int rc;
+
+  if(!watch_handle.data)
+    return error("not watching anything");
+  rc = sftp_close(&watch_handle);
+  free(watch_handle.data);
+  watch_handle.data = 0;
+  return rc;
+}
+
+static int cmd_watch(int attribute((unused)) ac, char **av, unsigned options) {
+  uint32_t id;
+  char *data;
+  size_t len;
 
+  if(!watch_extension)
+    return error("no watch extension found");
+  if(watch_handle.data && cmd_unwatch(0, 0, 0))
+    return -1;
   remote_cwd();
-  if(sftp_stat(sftp_fullpath(&fakejob, av[0], options), &attrs, SSH_FXP_LSTAT))
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, WATCH);
+  sftp_send_path(&fakejob, &fakeworker, sftp_fullpath(&fakejob, av[0], options));
+  sftp_send_uint32(&fakeworker, 0);
+  sftp_send_end(&fakeworker);
+  if(getresponse(SSH_FXP_HANDLE, id, WATCH) != SSH_FXP_HANDLE)
     return -1;
-  attrs.name = av[0];
-  time(&now);
-  gmtime_r(&now, &nowtime);
-  sftp_xprintf("%s\n", sftp_format_attr(fakejob.a, &attrs, nowtime.tm_year, 0));
+  cpcheck(sftp_parse_string(&fakejob, &data, &len));
+  watch_handle.data = sftp_xmalloc(len);
+  memcpy(watch_handle.data, data, len);
+  watch_handle.len = len;
+  return 0;
+}
+
+static int cmd_events(int ac, char **av,
+                      unsigned attribute((unused)) options) {
+  static const struct {
+    uint32_t bit;
+    const char *name;
+  } names[] = {
+      {WATCH_CREATED, "created"},       {WATCH_REMOVED, "removed"},
+      {WATCH_MODIFIED, "modified"},     {WATCH_ATTRIBUTES, "attributes"},
+      {WATCH_MOVED_FROM, "moved-from"}, {WATCH_MOVED_TO, "moved-to"},
+      {WATCH_GONE, "gone"},             {WATCH_OVERFLOW, "overflow"},
+  };
+  uint32_t id, count, i, events, timeout = 1000;
+  size_t n;
+  char *name;
+  const char *sep;
+
+  if(!watch_handle.data)
+    return error("not watching anything");
+  if(ac)
+    timeout = strtoul(av[0], 0, 10);
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_string(&fakeworker, WATCH_READ);
+  sftp_send_bytes(&fakeworker, watch_handle.data, watch_handle.len);
+  sftp_send_uint32(&fakeworker, timeout);
+  sftp_send_end(&fakeworker);
+  if(getresponse(SSH_FXP_EXTENDED_REPLY, id, WATCH_READ) !=
+     SSH_FXP_EXTENDED_REPLY)
+    return -1;
+  cpcheck(sftp_parse_uint32(&fakejob, &count));
+  for(i = 0; i < count; ++i) {
+    cpcheck(sftp_parse_path(&fakejob, &name));
+    cpcheck(sftp_parse_uint32(&fakejob, &events));
+    sep = "";
+    for(n = 0; n < sizeof names / sizeof *names; ++n)
+      if(events & names[n].bit) {
+        sftp_xprintf("%s%s", sep, names[n].name);
+        sep = ",";
+      }
+    sftp_xprintf(" %s\n", *name ? name : ".");
+  }
   return 0;
 }
 
@@ -2604,6 +5041,594 @@ error:
   return rc;
 }
 
+/* Write to PATH through one handle and check that the data can be seen
+ * through a second handle and by name before the first is closed */
+static int cmd_reread(int attribute((unused)) ac, char **av,
+                      unsigned options) {
+  static const char data[] = "write-behind coherence\n";
+  const size_t len = sizeof data - 1;
+  const char *const path = sftp_fullpath(&fakejob, av[0], options);
+  struct client_handle w, r;
+  struct sftpattr attrs;
+  uint32_t id, got;
+  int rc = -1;
+
+  remote_cwd();
+  sftp_memset(&attrs, 0, sizeof attrs);
+  if(sftp_open(path, ACE4_WRITE_DATA, SSH_FXF_CREATE_TRUNCATE, &attrs, &w))
+    return -1;
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_WRITE);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_bytes(&fakeworker, w.data, w.len);
+  sftp_send_uint64(&fakeworker, 0);
+  sftp_send_bytes(&fakeworker, data, len);
+  sftp_send_end(&fakeworker);
+  getresponse(SSH_FXP_STATUS, id, "SSH_FXP_WRITE");
+  if(status())
+    goto close_w;
+  if(sftp_open(path, ACE4_READ_DATA, SSH_FXF_OPEN_EXISTING, &attrs, &r))
+    goto close_w;
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_READ);
+  sftp_send_uint32(&fakeworker, id = newid());
+  sftp_send_bytes(&fakeworker, r.data, r.len);
+  sftp_send_uint64(&fakeworker, 0);
+  sftp_send_uint32(&fakeworker, len);
+  sftp_send_end(&fakeworker);
+  if(getresponse(-1, id, "SSH_FXP_READ") != SSH_FXP_DATA) {
+    error("%s: nothing to read through a second handle", path);
+    goto close_r;
+  }
+  cpcheck(sftp_parse_uint32(&fakejob, &got));
+  if(got != len || memcmp(fakejob.ptr, data, len)) {
+    error("%s: read %" PRIu32 " bytes through a second handle", path, got);
+    goto close_r;
+  }
+  if(sftp_fstat(&r, &attrs))
+    goto close_r;
+  if(attrs.size != len) {
+    error("%s: size %" PRIu64 " through a second handle", path, attrs.size);
+    goto close_r;
+  }
+  if(sftp_stat(path, &attrs, SSH_FXP_STAT))
+    goto close_r;
+  if(attrs.size != len) {
+    error("%s: size %" PRIu64 " by name", path, attrs.size);
+    goto close_r;
+  }
+  rc = 0;
+close_r:
+  sftp_close(&r);
+close_w:
+  sftp_close(&w);
+  return rc;
+}
+
+static int cmd_restat(int attribute((unused)) ac, char **av,
+                      unsigned options) {
+  const char *const dir = sftp_fullpath(&fakejob, av[0], options);
+  struct client_handle h;
+  struct sftpattr *names, attrs;
+  size_t nnames, n, m, i, first;
+  char **paths = 0, *path;
+  uint32_t perms;
+  int round, rc = 0;
+
+  remote_cwd();
+  /* Find out what is in the directory */
+  if(sftp_opendir(dir, &h))
+    return -1;
+  m = 0;
+  for(;;) {
+    if(sftp_readdir(&h, &names, &nnames)) {
+      sftp_close(&h);
+      free(paths);
+      return -1;
+    }
+    if(!nnames)
+      break;
+    paths = sftp_xrecalloc(paths, m + nnames, sizeof *paths);
+    for(n = 0; n < nnames; ++n)
+      if(strcmp(names[n].name, ".") && strcmp(names[n].name, "..")) {
+        path = sftp_alloc(fakejob.a, strlen(dir) + strlen(names[n].name) + 2);
+        strcpy(path, dir);
+        strcat(path, "/");
+        strcat(path, names[n].name);
+        paths[m++] = path;
+      }
+  }
+  if(sftp_close(&h)) {
+    free(paths);
+    return -1;
+  }
+  /* Each READDIR answer sets the prefetcher to work on the next batch.  Any
+   * SETSTAT invalidates the whole cache, so changing just the first few files
+   * in that batch and then looking them up gives a stale result the best
+   * chance of being noticed. */
+  for(round = 0; round < 64 && !rc; ++round) {
+    perms = round & 1 ? 0600 : 0644;
+    if(sftp_opendir(dir, &h)) {
+      rc = -1;
+      break;
+    }
+    if(sftp_readdir(&h, &names, &nnames)) {
+      sftp_close(&h);
+      rc = -1;
+      break;
+    }
+    for(n = first = 0; n < nnames; ++n)
+      if(strcmp(names[n].name, ".") && strcmp(names[n].name, ".."))
+        ++first;
+    for(i = 0; i < 4 && i < m && !rc; ++i) {
+      sftp_memset(&attrs, 0, sizeof attrs);
+      attrs.valid = SSH_FILEXFER_ATTR_PERMISSIONS;
+      attrs.type = SSH_FILEXFER_TYPE_UNKNOWN;
+      attrs.permissions = perms;
+      if(sftp_setstat(paths[(first + i) % m], &attrs))
+        rc = -1;
+    }
+    for(i = 0; i < 4 && i < m && !rc; ++i) {
+      n = (first + i) % m;
+      if(sftp_stat(paths[n], &attrs, SSH_FXP_STAT))
+        rc = -1;
+      else if((attrs.permissions & 07777) != perms)
+        rc = error("%s: permissions %#o after setting %#o", paths[n],
+                   (unsigned)(attrs.permissions & 07777), (unsigned)perms);
+    }
+    if(sftp_close(&h))
+      rc = -1;
+  }
+  free(paths);
+  return rc;
+}
+
+/* Send a WRITE of len bytes at offset without waiting for the answer */
+static void send_write(const struct client_handle *hp, uint64_t offset,
+                       const char *data, size_t len) {
+  sftp_send_begin(&fakeworker);
+  sftp_send_uint8(&fakeworker, SSH_FXP_WRITE);
+  sftp_send_uint32(&fakeworker, newid());
+  sftp_send_bytes(&fakeworker, hp->data, hp->len);
+  sftp_send_uint64(&fakeworker, offset);
+  sftp_send_bytes(&fakeworker, data, len);
+  sftp_send_end(&fakeworker);
+}
+
+static int cmd_interleave(int attribute((unused)) ac,
+                          char attribute((unused)) * *av,
+                          unsigned attribute((unused)) options) {
+  static const char *const names[] = {"interleave0", "interleave1",
+                                      "interleave2"};
+  struct client_handle h[3];
+  struct sftpattr attrs;
+  const size_t len = 65536;
+  char *data;
+  uint32_t st;
+  int n, round, opened = 0, rc = 0;
+
+  /* A write on the first handle is pipelined behind another one, so a
+   * handle-threads limit of 1 passes it over.  Then comes a STAT, which it
+   * must finish before, and then writes on the other handles, which must
+   * wait for the STAT; unless they are held back too they take every worker
+   * and the first handle's write never runs. */
+  sftp_memset(&attrs, 0, sizeof attrs);
+  for(opened = 0; opened < 3; ++opened)
+    if(sftp_open(names[opened], ACE4_WRITE_DATA, SSH_FXF_CREATE_TRUNCATE,
+                 &attrs, &h[opened])) {
+      rc = -1;
+      goto done;
+    }
+  data = sftp_xmalloc(len);
+  memset(data, 'x', len);
+  for(round = 0; round < 64 && !rc; ++round) {
+    send_write(&h[0], 2 * round * len, data, len);
+    send_write(&h[0], (2 * round + 1) * len, data, len);
+    sftp_send_begin(&fakeworker);
+    sftp_send_uint8(&fakeworker, SSH_FXP_STAT);
+    sftp_send_uint32(&fakeworker, newid());
+    sftp_send_path(&fakejob, &fakeworker, names[0]);
+    if(protocol->version > 3)
+      sftp_send_uint32(&fakeworker, 0xFFFFFFFF);
+    sftp_send_end(&fakeworker);
+    for(n = 0; n < 4; ++n)
+      send_write(&h[1 + n % 2], (round * 2 + n / 2) * len, data, len);
+    for(n = 0; n < 7; ++n)
+      switch(getresponse(-1, 0, "SSH_FXP_WRITE")) {
+      case SSH_FXP_ATTRS:
+        break;
+      case SSH_FXP_STATUS:
+        cpcheck(sftp_parse_uint32(&fakejob, &st));
+        if(st != SSH_FX_OK && !rc)
+          rc = status();
+        break;
+      default:
+        sftp_fatal("bogus response to SSH_FXP_WRITE");
+      }
+  }
+  free(data);
+done:
+  while(opened-- > 0)
+    if(sftp_close(&h[opened]))
+      rc = -1;
+  return rc;
+}
+
+/* _bench measures throughput and latency for run-bench.  Each operation
+ * prints a single JSON object. */
+
+/* Keep up to nrequests READs or WRITEs in flight, one per entry in
+ * offsets[] */
+static int bench_transfer(const struct client_handle *hp, uint8_t type,
+                          const uint64_t *offsets, size_t nblocks,
+                          uint64_t size, uint64_t *bytes) {
+  size_t sent = 0, received = 0;
+  int outstanding = 0, rc = 0;
+  uint32_t len, st;
+  char *data = 0;
+  size_t datalen;
+
+  if(type == SSH_FXP_WRITE) {
+    data = sftp_xmalloc(buffersize);
+    memset(data, 'x', buffersize);
+  }
+  *bytes = 0;
+  while(received < nblocks) {
+    while(sent < nblocks && outstanding < nrequests) {
+      len = size - offsets[sent] < buffersize ? size - offsets[sent]
+                                              : buffersize;
+      sftp_send_begin(&fakeworker);
+      sftp_send_uint8(&fakeworker, type);
+      sftp_send_uint32(&fakeworker, newid());
+      sftp_send_bytes(&fakeworker, hp->data, hp->len);
+      sftp_send_uint64(&fakeworker, offsets[sent]);
+      if(type == SSH_FXP_WRITE) {
+        sftp_send_bytes(&fakeworker, data, len);
+        *bytes += len;
+      } else
+        sftp_send_uint32(&fakeworker, len);
+      sftp_send_end(&fakeworker);
+      ++sent;
+      ++outstanding;
+    }
+    switch(getresponse(-1, 0, type == SSH_FXP_WRITE ? "SSH_FXP_WRITE"
+                                                   : "SSH_FXP_READ")) {
+    case SSH_FXP_DATA:
+      cpcheck(sftp_parse_string(&fakejob, 0, &datalen));
+      *bytes += datalen;
+      break;
+    case SSH_FXP_STATUS:
+      cpcheck(sftp_parse_uint32(&fakejob, &st));
+      if(st != SSH_FX_OK && st != SSH_FX_EOF && !rc)
+        rc = status();
+      break;
+    default:
+      sftp_fatal("bogus response to %s",
+                 type == SSH_FXP_WRITE ? "SSH_FXP_WRITE" : "SSH_FXP_READ");
+    }
+    ++received;
+    --outstanding;
+  }
+  free(data);
+  return rc;
+}
+
+static int bench_throughput(const char *op, const char *path,
+                            const char *sizestr) {
+  struct client_handle h;
+  struct sftpattr attrs;
+  uint64_t size, *offsets, bytes, t, seed = 88172645463325252ULL;
+  size_t nblocks, n, m;
+  const int write = !strcmp(op, "write") || !strcmp(op, "randwrite");
+  const int random = !strcmp(op, "randread") || !strcmp(op, "randwrite");
+  double started, elapsed;
+  int rc;
+
+  sftp_memset(&attrs, 0, sizeof attrs);
+  if(write) {
+    if(!sizestr)
+      return error("_bench %s requires a size", op);
+    size = strtoull(sizestr, 0, 10);
+    if(sftp_open(path, ACE4_WRITE_DATA, SSH_FXF_CREATE_TRUNCATE, &attrs, &h))
+      return -1;
+  } else {
+    if(sftp_open(path, ACE4_READ_DATA, SSH_FXF_OPEN_EXISTING, &attrs, &h))
+      return -1;
+    if(sftp_fstat(&h, &attrs)) {
+      sftp_close(&h);
+      return -1;
+    }
+    size = attrs.size;
+  }
+  nblocks = (size + buffersize - 1) / buffersize;
+  offsets = sftp_xcalloc(nblocks ? nblocks : 1, sizeof *offsets);
+  for(n = 0; n < nblocks; ++n)
+    offsets[n] = n * (uint64_t)buffersize;
+  if(random) {
+    /* A fixed shuffle, so that runs are comparable */
+    for(n = nblocks; n > 1; --n) {
+      seed ^= seed << 13;
+      seed ^= seed >> 7;
+      seed ^= seed << 17;
+      m = seed % n;
+      t = offsets[n - 1];
+      offsets[n - 1] = offsets[m];
+      offsets[m] = t;
+    }
+  }
+  started = monotonic_now();
+  rc = bench_transfer(&h, write ? SSH_FXP_WRITE : SSH_FXP_READ, offsets,
+                      nblocks, size, &bytes);
+  if(sftp_close(&h))
+    rc = -1;
+  elapsed = monotonic_now() - started;
+  free(offsets);
+  if(rc)
+    return -1;
+  sftp_xprintf("{\"op\": \"%s\", \"buffer\": %zu, \"requests\": %d, "
+               "\"bytes\": %" PRIu64 ", \"seconds\": %.6f, "
+               "\"bytes_per_sec\": %.0f}\n",
+               op, buffersize, nrequests, bytes, elapsed,
+               elapsed > 0 ? bytes / elapsed : 0);
+  return 0;
+}
+
+/* Download remote PATH to local NAME.bench, or upload local NAME to remote
+ * PATH.bench, in up to STRIPESSTR stripes */
+static int bench_striped(const char *op, const char *path, const char *name,
+                         const char *stripesstr) {
+  struct client_handle h;
+  struct sftpattr attrs;
+  struct stat sb;
+  const int put = !strcmp(op, "put");
+  const int wanted = stripesstr ? atoi(stripesstr) : 1;
+  const char *local = name;
+  uint64_t size, bytes;
+  double started, elapsed;
+  int fd, rc;
+  char *copy;
+
+  if(wanted <= 0)
+    return error("invalid stripe count '%s'", stripesstr);
+  sftp_memset(&attrs, 0, sizeof attrs);
+  copy = sftp_alloc(fakejob.a, strlen(put ? path : name) + 7);
+  sprintf(copy, "%s.bench", put ? path : name);
+  if(put) {
+    path = copy;
+    if((fd = open(local, O_RDONLY)) < 0 || fstat(fd, &sb) < 0)
+      return error("cannot open %s: %s", local, strerror(errno));
+    size = sb.st_size;
+    if(sftp_open(path, ACE4_WRITE_DATA, SSH_FXF_CREATE_TRUNCATE, &attrs, &h)) {
+      close(fd);
+      return -1;
+    }
+  } else {
+    local = copy;
+    if(sftp_open(path, ACE4_READ_DATA, SSH_FXF_OPEN_EXISTING, &attrs, &h))
+      return -1;
+    if(sftp_fstat(&h, &attrs)) {
+      sftp_close(&h);
+      return -1;
+    }
+    size = attrs.size;
+    if((fd = open(local, O_WRONLY | O_TRUNC | O_CREAT, 0666)) < 0) {
+      sftp_close(&h);
+      return error("cannot open %s: %s", local, strerror(errno));
+    }
+  }
+  started = monotonic_now();
+  rc = striped(&h, path, 0, put, fd, local, 0, size, wanted, &bytes);
+  if(sftp_close(&h))
+    rc = -1;
+  elapsed = monotonic_now() - started;
+  if(close(fd) < 0 && !rc)
+    rc = error("error closing %s: %s", local, strerror(errno));
+  if(rc)
+    return -1;
+  sftp_xprintf("{\"op\": \"%s\", \"stripes\": %d, \"buffer\": %zu, "
+               "\"requests\": %d, \"bytes\": %" PRIu64 ", "
+               "\"seconds\": %.6f, \"bytes_per_sec\": %.0f}\n",
+               op, stripe_count(size, wanted), buffersize, nrequests, bytes,
+               elapsed, elapsed > 0 ? bytes / elapsed : 0);
+  return 0;
+}
+
+static int bench_compare(const void *a, const void *b) {
+  const double x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void bench_latencies(const char *op, double *samples, size_t count) {
+  qsort(samples, count, sizeof *samples, bench_compare);
+  sftp_xprintf("{\"op\": \"%s\", \"count\": %zu, \"p50_us\": %.1f, "
+               "\"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}\n",
+               op, count, samples[count / 2] * 1e6,
+               samples[count * 9 / 10] * 1e6, samples[count * 99 / 100] * 1e6,
+               samples[count - 1] * 1e6);
+}
+
+static int bench_latency(const char *op, const char *path,
+                         const char *countstr) {
+  struct client_handle h;
+  struct sftpattr attrs;
+  size_t count = countstr ? strtoul(countstr, 0, 10) : 1000, n;
+  double *opening, *closing, t;
+  int rc = 0;
+
+  if(!count)
+    return error("_bench %s requires a nonzero count", op);
+  sftp_memset(&attrs, 0, sizeof attrs);
+  opening = sftp_xcalloc(count, sizeof *opening);
+  closing = sftp_xcalloc(count, sizeof *closing);
+  for(n = 0; n < count && !rc; ++n) {
+    t = monotonic_now();
+    if(!strcmp(op, "stat"))
+      rc = sftp_stat(path, &attrs, SSH_FXP_STAT);
+    else if(!(rc = sftp_open(path, ACE4_READ_DATA, SSH_FXF_OPEN_EXISTING,
+                             &attrs, &h))) {
+      opening[n] = monotonic_now() - t;
+      t = monotonic_now();
+      rc = sftp_close(&h);
+      closing[n] = monotonic_now() - t;
+      continue;
+    }
+    opening[n] = monotonic_now() - t;
+  }
+  if(!rc) {
+    bench_latencies(op, opening, count);
+    if(strcmp(op, "stat"))
+      bench_latencies("close", closing, count);
+  }
+  free(opening);
+  free(closing);
+  return rc;
+}
+
+/* Round trips for an extension with no arguments.  Unknown names measure
+ * the cost of a failed lookup. */
+static int bench_extension(const char *name, const char *countstr) {
+  size_t count = countstr ? strtoul(countstr, 0, 10) : 1000, n;
+  double *samples, t;
+  uint32_t id;
+  uint8_t type;
+
+  if(!count)
+    return error("_bench extension requires a nonzero count");
+  samples = sftp_xcalloc(count, sizeof *samples);
+  for(n = 0; n < count; ++n) {
+    t = monotonic_now();
+    sftp_send_begin(&fakeworker);
+    sftp_send_uint8(&fakeworker, SSH_FXP_EXTENDED);
+    sftp_send_uint32(&fakeworker, id = newid());
+    sftp_send_string(&fakeworker, name);
+    sftp_send_end(&fakeworker);
+    type = getresponse(-1, id, name);
+    samples[n] = monotonic_now() - t;
+    if(type != SSH_FXP_EXTENDED_REPLY && type != SSH_FXP_STATUS) {
+      free(samples);
+      return error("unexpected response to %s", name);
+    }
+  }
+  bench_latencies("extension", samples, count);
+  free(samples);
+  return 0;
+}
+
+/* Start fresh servers, timing how long each takes to answer SSH_FXP_INIT
+ * and then its first request */
+static int bench_startup(const char *countstr) {
+  size_t count = countstr ? strtoul(countstr, 0, 10) : 100, n;
+  double *versions, *firsts, t;
+  const int save_in = sftpin, save_out = sftpout;
+  int ip[2], op[2], rc = 0;
+  uint32_t id;
+  pid_t pid;
+
+  if(!server_command)
+    return error("_bench startup needs a server command");
+  if(!count)
+    return error("_bench startup requires a nonzero count");
+  versions = sftp_xcalloc(count, sizeof *versions);
+  firsts = sftp_xcalloc(count, sizeof *firsts);
+  for(n = 0; n < count && !rc; ++n) {
+    t = monotonic_now();
+    sftp_xpipe(ip);
+    sftp_xpipe(op);
+    if(!(pid = sftp_xfork())) {
+      sftp_xclose(ip[0]);
+      sftp_xclose(op[1]);
+      sftp_xdup2(ip[1], 1);
+      sftp_xdup2(op[0], 0);
+      execvp(server_command[0], (void *)server_command);
+      sftp_fatal("executing %s: %s", server_command[0], strerror(errno));
+    }
+    sftp_xclose(ip[1]);
+    sftp_xclose(op[0]);
+    sftpin = ip[0];
+    sftpout = op[1];
+    sftp_send_begin(&fakeworker);
+    sftp_send_uint8(&fakeworker, SSH_FXP_INIT);
+    sftp_send_uint32(&fakeworker, sftpversion);
+    sftp_send_end(&fakeworker);
+    if(getresponse(SSH_FXP_VERSION, 0, "SSH_FXP_INIT") != SSH_FXP_VERSION)
+      rc = -1;
+    else {
+      versions[n] = monotonic_now() - t;
+      t = monotonic_now();
+      sftp_send_begin(&fakeworker);
+      sftp_send_uint8(&fakeworker, SSH_FXP_REALPATH);
+      sftp_send_uint32(&fakeworker, id = newid());
+      sftp_send_string(&fakeworker, ".");
+      sftp_send_end(&fakeworker);
+      if(getresponse(SSH_FXP_NAME, id, "SSH_FXP_REALPATH") != SSH_FXP_NAME)
+        rc = -1;
+      firsts[n] = monotonic_now() - t;
+    }
+    /* Closing the request pipe tells the server to stop */
+    sftp_xclose(sftpout);
+    sftp_xclose(sftpin);
+    sftpin = save_in;
+    sftpout = save_out;
+    if(waitpid(pid, 0, 0) < 0)
+      sftp_fatal("error calling waitpid: %s", strerror(errno));
+  }
+  if(!rc) {
+    bench_latencies("startup", versions, count);
+    bench_latencies("first-request", firsts, count);
+  }
+  free(versions);
+  free(firsts);
+  return rc;
+}
+
+static int bench_readdir(const char *path) {
+  struct client_handle h;
+  size_t nattrs, total = 0;
+  double started, elapsed;
+  int rc = 0;
+
+  started = monotonic_now();
+  if(sftp_opendir(path, &h))
+    return -1;
+  do {
+    if((rc = sftp_readdir(&h, 0, &nattrs)))
+      break;
+    total += nattrs;
+  } while(nattrs);
+  if(sftp_close(&h))
+    rc = -1;
+  elapsed = monotonic_now() - started;
+  if(rc)
+    return -1;
+  sftp_xprintf("{\"op\": \"readdir\", \"entries\": %zu, \"seconds\": %.6f, "
+               "\"entries_per_sec\": %.0f}\n",
+               total, elapsed, elapsed > 0 ? total / elapsed : 0);
+  return 0;
+}
+
+static int cmd_bench(int ac, char **av, unsigned options) {
+  const char *const op = av[0];
+  const char *const path = sftp_fullpath(&fakejob, av[1], options);
+  const char *const arg = ac > 2 ? av[2] : 0;
+
+  remote_cwd();
+  if(!strcmp(op, "read") || !strcmp(op, "randread") || !strcmp(op, "write") ||
+     !strcmp(op, "randwrite"))
+    return bench_throughput(op, path, arg);
+  if(!strcmp(op, "stat") || !strcmp(op, "open"))
+    return bench_latency(op, path, arg);
+  if(!strcmp(op, "get") || !strcmp(op, "put"))
+    return bench_striped(op, path, av[1], arg);
+  if(!strcmp(op, "readdir"))
+    return bench_readdir(path);
+  if(!strcmp(op, "extension"))
+    return bench_extension(av[1], arg);
+  if(!strcmp(op, "startup"))
+    return bench_startup(av[1]);
+  return error("unknown _bench operation '%s'", op);
+}
+
 /* Table of command line operations */
 static const struct command commands[] = {
     {"_bad_handle", 0, 0, 0, cmd_bad_handle, 0, "operate on a bogus handle"},
@@ -2611,12 +5636,21 @@ static const struct command commands[] = {
     {"_bad_packet456", 0, 0, 0, cmd_bad_packet456, 0,
      "send bad packets (protos >= 4 only)"},
     {"_bad_path", 0, 0, 0, cmd_bad_path, 0, "send bad paths"},
+    {"_bench", CMD_RAW, 2, 3, cmd_bench,
+     "OPERATION PATH [SIZE|COUNT|STRIPES]",
+     "measure performance"},
     {"_ext_unsupported", 0, 0, 0, cmd_ext_unsupported, 0,
      "send an unsupported extension"},
     {"_init", 0, 0, 0, cmd_init, 0, "resend SSH_FXP_INIT"},
+    {"_interleave", 0, 0, 0, cmd_interleave, "",
+     "test writes on several handles around a STAT"},
     {"_lrealpath", 0, 2, 2, cmd_lrealpath, "CONTROL PATH",
      "expand a local path name"},
     {"_overlap", 0, 0, 0, cmd_overlap, "", "test overlapping writes"},
+    {"_restat", CMD_RAW, 1, 1, cmd_restat, "DIR",
+     "check attributes are fresh after SETSTAT during a listing"},
+    {"_reread", CMD_RAW, 1, 1, cmd_reread, "PATH",
+     "check writes can be read back through another handle"},
     {"_unsupported", 0, 0, 0, cmd_unsupported, 0,
      "send an unsupported command"},
     {"binary", 0, 0, 0, cmd_binary, 0, "binary mode"},
@@ -2627,13 +5661,23 @@ static const struct command commands[] = {
      "change remote file permissions"},
     {"chown", CMD_RAW, 2, 2, cmd_chown, "UID PATH",
      "change remote file ownership"},
+    {"check", CMD_RAW, 2, 3, cmd_check, "ALGORITHMS PATH [BLOCKSIZE]",
+     "hash a remote file on the server"},
+    {"compress", 0, 0, 1, cmd_compress, "[METHODS|off]",
+     "compress get and put payloads"},
+    {"copy", CMD_RAW, 2, 2, cmd_copy, "OLDPATH NEWPATH",
+     "copy a remote file on the server"},
     {"debug", 0, 0, 0, cmd_debug, 0, "toggle sftp_debugging"},
     {"df", 0, 0, 1, cmd_df, "[PATH]", "query available space"},
+    {"events", 0, 0, 1, cmd_events, "[TIMEOUT]",
+     "wait for and display changes to the watched directory"},
     {"exit", 0, 0, 0, cmd_quit, 0, "quit"},
-    {"get", CMD_RAW, 1, 3, cmd_get, "[-PfL<line>] REMOTE-PATH [LOCAL-PATH]",
+    {"get", CMD_RAW, 1, 3, cmd_get,
+     "[-Pfk<stripes>L<line>] REMOTE-PATH [LOCAL-PATH]",
      "retrieve a remote file"},
     {"help", 0, 0, 0, cmd_help, 0, "display help"},
     {"lcd", 0, 1, 1, cmd_lcd, "DIR", "change local directory"},
+    {"limits", 0, 0, 0, cmd_limits, 0, "display server limits"},
     {"link", CMD_RAW, 2, 2, cmd_link, "OLDPATH NEWPATH",
      "create a remote hard link"},
     {"lpwd", 0, 0, 0, cmd_lpwd, "DIR", "display current local directory"},
@@ -2643,23 +5687,39 @@ static const struct command commands[] = {
     {"ls", CMD_RAW, 0, 2, cmd_ls, "[OPTIONS] [PATH]", "list remote directory"},
     {"lstat", CMD_RAW, 1, 1, cmd_lstat, "PATH", "lstat a file"},
     {"lumask", 0, 0, 1, cmd_lumask, "OCTAL", "get or set local umask"},
+    {"mget", CMD_RAW, 1, INT_MAX, cmd_mget, "[-r] [-j N] REMOTE-PATH...",
+     "retrieve several remote files at once"},
     {"mkdir", CMD_RAW, 1, 2, cmd_mkdir, "[MODE] DIRECTORY",
      "create a remote directory"},
-    {"mv", CMD_RAW, 2, 3, cmd_mv, "[-naop] OLDPATH NEWPATH",
-     "rename a remote file"},
+    {"mput", CMD_RAW, 1, INT_MAX, cmd_mput, "[-r] [-j N] LOCAL-PATH...",
+     "upload several files at once"},
+    {"mstat", CMD_RAW, 1, INT_MAX, cmd_mstat, "[-L] PATH...",
+     "stat several files at once"},
+    {"mv", CMD_RAW, 2, INT_MAX, cmd_mv, "[-naop] OLDPATH... NEWPATH",
+     "rename remote files"},
     {"progress", 0, 0, 1, cmd_progress, "[on|off]",
      "set or toggle progress indicators"},
-    {"put", CMD_RAW, 1, 3, cmd_put, "[-PaftemMODE] LOCAL-PATH [REMOTE-PATH]",
+    {"put", CMD_RAW, 1, 3, cmd_put,
+     "[-PDSaftek<stripes>mMODE] LOCAL-PATH [REMOTE-PATH]",
      "upload a file"},
     {"pwd", 0, 0, 0, cmd_pwd, 0, "display current remote directory"},
     {"quit", 0, 0, 0, cmd_quit, 0, "quit"},
     {"readlink", CMD_RAW, 1, 1, cmd_readlink, "PATH", "inspect a symlink"},
+    {"readv", CMD_RAW, 2, INT_MAX, cmd_readv, "PATH OFFSET+LENGTH...",
+     "read several ranges of a file"},
     {"realpath", CMD_RAW, 1, 1, cmd_realpath, "PATH", "expand a path name"},
     {"realpath6", CMD_RAW, 2, INT_MAX, cmd_realpath6,
      "CONTROL PATH [COMPOSE...]", "expand a path name"},
+    {"reget", CMD_RAW, 1, 3, cmd_reget,
+     "[-Pfk<stripes>] REMOTE-PATH [LOCAL-PATH]",
+     "resume retrieving a remote file"},
     {"rename", CMD_RAW, 2, 2, cmd_mv, "OLDPATH NEWPATH",
      "rename a remote file"},
-    {"rm", CMD_RAW, 1, 1, cmd_rm, "PATH", "remove remote file"},
+    {"reput", CMD_RAW, 1, 3, cmd_reput,
+     "[-PSk<stripes>mMODE] LOCAL-PATH [REMOTE-PATH]",
+     "resume uploading a file"},
+    {"rm", CMD_RAW, 1, INT_MAX, cmd_rm, "[-r] PATH...",
+     "remove remote files"},
     {"rmdir", CMD_RAW, 1, 1, cmd_rmdir, "PATH", "remove remote directory"},
     {"symlink", CMD_RAW, 2, 2, cmd_symlink, "TARGET NEWPATH",
      "create a remote symlink"},
@@ -2667,7 +5727,13 @@ static const struct command commands[] = {
     {"statfs", CMD_RAW, 1, 1, cmd_statfs, "PATH", "stat a filesystem"},
     {"text", 0, 0, 0, cmd_text, 0, "text mode"},
     {"truncate", CMD_RAW, 2, 2, cmd_truncate, "LENGTH FILE", "truncate a file"},
+    {"unwatch", 0, 0, 0, cmd_unwatch, 0, "stop watching a remote directory"},
     {"version", 0, 0, 1, cmd_version, 0, "set or display protocol version"},
+    {"walk", CMD_RAW, 1, INT_MAX, cmd_walk,
+     "[-dl] [-g GLOB] [-n TIME] [-s MIN] [-S MAX] PATH",
+     "list a remote directory tree"},
+    {"watch", 0, 1, 1, cmd_watch, "PATH",
+     "watch a remote directory for changes"},
     {0, 0, 0, 0, 0, 0, 0}};
 
 static int cmd_help(int attribute((unused)) ac, char attribute((unused)) * *av,
@@ -2926,6 +5992,9 @@ int main(int argc, char **argv) {
     case OPT_PROGRAM_CONFIG:
       program_config = optarg;
       break;
+    case OPT_FIXED_WINDOW:
+      adaptive = 0;
+      break;
     case 'H':
       host = optarg;
       break;
@@ -2948,8 +6017,8 @@ int main(int argc, char **argv) {
   /* sanity checking */
   if(nrequests <= 0)
     nrequests = 1;
-  if(nrequests > 128)
-    nrequests = 128;
+  if(nrequests > MAXREQUESTS)
+    nrequests = MAXREQUESTS;
   if(buffersize < 64)
     buffersize = 64;
   if(buffersize > 1048576)
@@ -3023,6 +6092,8 @@ int main(int argc, char **argv) {
       cmdline[ncmdline++] = subsystem ? subsystem : "sftp";
     }
     cmdline[ncmdline] = 0;
+    server_command = sftp_xcalloc(ncmdline + 1, sizeof *server_command);
+    memcpy(server_command, cmdline, ncmdline * sizeof *server_command);
     sftp_xpipe(ip);
     sftp_xpipe(op);
     if(!(pid = sftp_xfork())) {
@@ -82,10 +82,15 @@
 
 struct queue;
 struct allocator;
+/** @brief Storage class for variables with a separate value in each thread */
+#  define THREAD_LOCAL __thread
+
 struct handleid;
 struct sftpjob;
 struct sftpattr;
 struct worker;
+struct sftpprotocol;
+struct session;
 struct stat;
 
 /** @brief Return a human-readable description of @p status
@@ -102,6 +107,8 @@ enum sftp_state {
 
 /** @brief Get the current SFTP service state
  * @return State value
+ *
+ * In the server this is the state of the calling thread's session.
  */
 enum sftp_state sftp_state_get(void);
 
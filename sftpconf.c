@@ -19,14 +19,54 @@
  */
 #include "sftpserver.h"
 #include "sftpconf.h"
+#include "queue.h"
 #include "utils.h"
+#include "direct.h"
+#include "affinity.h"
+#include "trace.h"
 #include <stdio.h>
 #include <errno.h>
 #include <ctype.h>
 #include <stdlib.h>
 
 int sftpconf_nthreads = NTHREADS;
+int sftpconf_min_threads = MINTHREADS;
+int sftpconf_max_threads = MAXTHREADS;
+int sftpconf_fsync_on_close = 0;
 int sftpconf_reorder = 1;
+int sftpconf_output_batch = OUTPUTBATCH;
+int sftpconf_queue = queue_ring;
+int sftpconf_zerocopy = 0;
+int sftpconf_max_handles = MAXHANDLES;
+int sftpconf_max_inflight_bytes = MAXINFLIGHTBYTES;
+int sftpconf_max_inflight_requests = MAXINFLIGHTREQUESTS;
+int sftpconf_max_names = MAXNAMES;
+int sftpconf_max_read = MAXREAD;
+int sftpconf_max_request = MAXREQUEST;
+int sftpconf_stat_threads = 0;
+int sftpconf_stat_cache_ttl = 0;
+int sftpconf_handle_threads = 0;
+int sftpconf_hash_threads = HASHTHREADS;
+int sftpconf_user_cache_ttl = USERCACHETTL;
+int sftpconf_uring = 0;
+int sftpconf_read_ahead = READAHEAD;
+int sftpconf_readdir_prefetch = 1;
+int sftpconf_write_behind = WRITEBEHIND;
+int sftpconf_realpath_cache_ttl = REALPATHCACHETTL;
+int sftpconf_preallocate = 0;
+int sftpconf_prefork = 0;
+int sftpconf_prefork_sessions = PREFORKSESSIONS;
+int sftpconf_reuse_port = 0;
+int sftpconf_stats = 0;
+int sftpconf_trace = 0;
+int sftpconf_trace_payload = 0;
+int sftpconf_trace_sample = 1;
+int sftpconf_send_pool = SENDPOOL;
+int sftpconf_send_pool_idle = SENDPOOLIDLE;
+int sftpconf_huge_pages = 0;
+int sftpconf_mmap_read = 0;
+int sftpconf_multiplex = 0;
+const char *sftpconf_capture;
 
 static size_t sftpconf_split(char *line, char **words, size_t maxwords) {
   size_t nwords = 0;
@@ -88,6 +128,180 @@ void sftpconf_read(const char *path) {
       if(nwords != 2)
         sftp_fatal("%s:%d: invalid threads directive", path, lineno);
       sftpconf_nthreads = atoi(words[1]);
+    } else if(!strcmp(words[0], "capture")) {
+      if(nwords != 2 || words[1][0] != '/')
+        sftp_fatal("%s:%d: invalid capture directive", path, lineno);
+      sftpconf_capture = sftp_xstrdup(words[1]);
+    } else if(!strcmp(words[0], "cpu-affinity")) {
+      if(nwords != 3 || sftp_affinity_set(words[1], words[2]))
+        sftp_fatal("%s:%d: invalid cpu-affinity directive", path, lineno);
+    } else if(!strcmp(words[0], "direct-io")) {
+      if(nwords != 2 || words[1][0] != '/')
+        sftp_fatal("%s:%d: invalid direct-io directive", path, lineno);
+      sftp_direct_add(words[1]);
+    } else if(!strcmp(words[0], "fsync-on-close")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid fsync-on-close directive", path, lineno);
+      if(!strcmp(words[1], "true"))
+        sftpconf_fsync_on_close = 1;
+      else if(!strcmp(words[1], "false"))
+        sftpconf_fsync_on_close = 0;
+      else
+        sftp_fatal("%s:%d: invalid fsync-on-close directive", path, lineno);
+    } else if(!strcmp(words[0], "handle-threads")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid handle-threads directive", path, lineno);
+      sftpconf_handle_threads = atoi(words[1]);
+      if(sftpconf_handle_threads < 0)
+        sftp_fatal("%s:%d: invalid handle-threads directive", path, lineno);
+    } else if(!strcmp(words[0], "hash-threads")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid hash-threads directive", path, lineno);
+      sftpconf_hash_threads = atoi(words[1]);
+      if(sftpconf_hash_threads < 0)
+        sftp_fatal("%s:%d: invalid hash-threads directive", path, lineno);
+    } else if(!strcmp(words[0], "huge-pages")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid huge-pages directive", path, lineno);
+      if(!strcmp(words[1], "true"))
+        sftpconf_huge_pages = 1;
+      else if(!strcmp(words[1], "false"))
+        sftpconf_huge_pages = 0;
+      else
+        sftp_fatal("%s:%d: invalid huge-pages directive", path, lineno);
+    } else if(!strcmp(words[0], "io-uring")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid io-uring directive", path, lineno);
+      if(!strcmp(words[1], "true"))
+        sftpconf_uring = 1;
+      else if(!strcmp(words[1], "false"))
+        sftpconf_uring = 0;
+      else
+        sftp_fatal("%s:%d: invalid io-uring directive", path, lineno);
+    } else if(!strcmp(words[0], "max-handles")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid max-handles directive", path, lineno);
+      sftpconf_max_handles = atoi(words[1]);
+      if(sftpconf_max_handles < 1)
+        sftp_fatal("%s:%d: invalid max-handles directive", path, lineno);
+    } else if(!strcmp(words[0], "max-inflight-bytes")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid max-inflight-bytes directive", path,
+                   lineno);
+      sftpconf_max_inflight_bytes = atoi(words[1]);
+      if(sftpconf_max_inflight_bytes < 0)
+        sftp_fatal("%s:%d: invalid max-inflight-bytes directive", path,
+                   lineno);
+    } else if(!strcmp(words[0], "max-inflight-requests")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid max-inflight-requests directive", path,
+                   lineno);
+      sftpconf_max_inflight_requests = atoi(words[1]);
+      if(sftpconf_max_inflight_requests < 0)
+        sftp_fatal("%s:%d: invalid max-inflight-requests directive", path,
+                   lineno);
+    } else if(!strcmp(words[0], "max-names")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid max-names directive", path, lineno);
+      sftpconf_max_names = atoi(words[1]);
+      if(sftpconf_max_names < 1)
+        sftp_fatal("%s:%d: invalid max-names directive", path, lineno);
+    } else if(!strcmp(words[0], "max-read")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid max-read directive", path, lineno);
+      sftpconf_max_read = atoi(words[1]);
+      if(sftpconf_max_read < 1024)
+        sftp_fatal("%s:%d: invalid max-read directive", path, lineno);
+    } else if(!strcmp(words[0], "max-request")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid max-request directive", path, lineno);
+      sftpconf_max_request = atoi(words[1]);
+      if(sftpconf_max_request < 2 * MAXWRITEOVERHEAD)
+        sftp_fatal("%s:%d: invalid max-request directive", path, lineno);
+    } else if(!strcmp(words[0], "max-threads")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid max-threads directive", path, lineno);
+      sftpconf_max_threads = atoi(words[1]);
+      if(sftpconf_max_threads < 1)
+        sftp_fatal("%s:%d: invalid max-threads directive", path, lineno);
+    } else if(!strcmp(words[0], "min-threads")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid min-threads directive", path, lineno);
+      sftpconf_min_threads = atoi(words[1]);
+      if(sftpconf_min_threads < 1)
+        sftp_fatal("%s:%d: invalid min-threads directive", path, lineno);
+    } else if(!strcmp(words[0], "mmap-read")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid mmap-read directive", path, lineno);
+      sftpconf_mmap_read = atoi(words[1]);
+      if(sftpconf_mmap_read < 0)
+        sftp_fatal("%s:%d: invalid mmap-read directive", path, lineno);
+    } else if(!strcmp(words[0], "multiplex")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid multiplex directive", path, lineno);
+      sftpconf_multiplex = atoi(words[1]);
+      if(sftpconf_multiplex < 0)
+        sftp_fatal("%s:%d: invalid multiplex directive", path, lineno);
+    } else if(!strcmp(words[0], "output-batch")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid output-batch directive", path, lineno);
+      sftpconf_output_batch = atoi(words[1]);
+      if(sftpconf_output_batch < 0)
+        sftp_fatal("%s:%d: invalid output-batch directive", path, lineno);
+    } else if(!strcmp(words[0], "preallocate")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid preallocate directive", path, lineno);
+      sftpconf_preallocate = atoi(words[1]);
+      if(sftpconf_preallocate < 0)
+        sftp_fatal("%s:%d: invalid preallocate directive", path, lineno);
+    } else if(!strcmp(words[0], "prefork")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid prefork directive", path, lineno);
+      sftpconf_prefork = atoi(words[1]);
+      if(sftpconf_prefork < 0)
+        sftp_fatal("%s:%d: invalid prefork directive", path, lineno);
+    } else if(!strcmp(words[0], "prefork-sessions")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid prefork-sessions directive", path,
+                   lineno);
+      sftpconf_prefork_sessions = atoi(words[1]);
+      if(sftpconf_prefork_sessions < 0)
+        sftp_fatal("%s:%d: invalid prefork-sessions directive", path,
+                   lineno);
+    } else if(!strcmp(words[0], "queue")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid queue directive", path, lineno);
+      if(!strcmp(words[1], "fair"))
+        sftpconf_queue = queue_fair;
+      else if(!strcmp(words[1], "mutex"))
+        sftpconf_queue = queue_mutex;
+      else if(!strcmp(words[1], "ring"))
+        sftpconf_queue = queue_ring;
+      else
+        sftp_fatal("%s:%d: invalid queue directive", path, lineno);
+    } else if(!strcmp(words[0], "read-ahead")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid read-ahead directive", path, lineno);
+      sftpconf_read_ahead = atoi(words[1]);
+      if(sftpconf_read_ahead < 0)
+        sftp_fatal("%s:%d: invalid read-ahead directive", path, lineno);
+    } else if(!strcmp(words[0], "readdir-prefetch")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid readdir-prefetch directive", path, lineno);
+      if(!strcmp(words[1], "true"))
+        sftpconf_readdir_prefetch = 1;
+      else if(!strcmp(words[1], "false"))
+        sftpconf_readdir_prefetch = 0;
+      else
+        sftp_fatal("%s:%d: invalid readdir-prefetch directive", path, lineno);
+    } else if(!strcmp(words[0], "realpath-cache-ttl")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid realpath-cache-ttl directive", path,
+                   lineno);
+      sftpconf_realpath_cache_ttl = atoi(words[1]);
+      if(sftpconf_realpath_cache_ttl < 0)
+        sftp_fatal("%s:%d: invalid realpath-cache-ttl directive", path,
+                   lineno);
     } else if(!strcmp(words[0], "reorder")) {
       if(nwords != 2)
         sftp_fatal("%s:%d: invalid reorder directive", path, lineno);
@@ -97,6 +311,93 @@ void sftpconf_read(const char *path) {
         sftpconf_reorder = 0;
       else
         sftp_fatal("%s:%d: invalid reorder directive", path, lineno);
+    } else if(!strcmp(words[0], "reuse-port")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid reuse-port directive", path, lineno);
+      if(!strcmp(words[1], "true"))
+        sftpconf_reuse_port = 1;
+      else if(!strcmp(words[1], "false"))
+        sftpconf_reuse_port = 0;
+      else
+        sftp_fatal("%s:%d: invalid reuse-port directive", path, lineno);
+    } else if(!strcmp(words[0], "send-pool")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid send-pool directive", path, lineno);
+      sftpconf_send_pool = atoi(words[1]);
+      if(sftpconf_send_pool < 0)
+        sftp_fatal("%s:%d: invalid send-pool directive", path, lineno);
+    } else if(!strcmp(words[0], "send-pool-idle")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid send-pool-idle directive", path, lineno);
+      sftpconf_send_pool_idle = atoi(words[1]);
+      if(sftpconf_send_pool_idle < 0)
+        sftp_fatal("%s:%d: invalid send-pool-idle directive", path, lineno);
+    } else if(!strcmp(words[0], "stat-cache-ttl")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid stat-cache-ttl directive", path, lineno);
+      sftpconf_stat_cache_ttl = atoi(words[1]);
+      if(sftpconf_stat_cache_ttl < 0)
+        sftp_fatal("%s:%d: invalid stat-cache-ttl directive", path, lineno);
+    } else if(!strcmp(words[0], "stat-threads")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid stat-threads directive", path, lineno);
+      sftpconf_stat_threads = atoi(words[1]);
+      if(sftpconf_stat_threads < 0)
+        sftp_fatal("%s:%d: invalid stat-threads directive", path, lineno);
+    } else if(!strcmp(words[0], "stats")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid stats directive", path, lineno);
+      if(!strcmp(words[1], "true"))
+        sftpconf_stats = 1;
+      else if(!strcmp(words[1], "false"))
+        sftpconf_stats = 0;
+      else
+        sftp_fatal("%s:%d: invalid stats directive", path, lineno);
+    } else if(!strcmp(words[0], "trace")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid trace directive", path, lineno);
+      if(!strcmp(words[1], "true"))
+        sftpconf_trace = 1;
+      else if(!strcmp(words[1], "false"))
+        sftpconf_trace = 0;
+      else
+        sftp_fatal("%s:%d: invalid trace directive", path, lineno);
+    } else if(!strcmp(words[0], "trace-payload")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid trace-payload directive", path, lineno);
+      sftpconf_trace_payload = atoi(words[1]);
+      if(sftpconf_trace_payload < 0 || sftpconf_trace_payload > MAXREQUEST)
+        sftp_fatal("%s:%d: invalid trace-payload directive", path, lineno);
+    } else if(!strcmp(words[0], "trace-sample")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid trace-sample directive", path, lineno);
+      sftpconf_trace_sample = atoi(words[1]);
+      if(sftpconf_trace_sample < 1)
+        sftp_fatal("%s:%d: invalid trace-sample directive", path, lineno);
+    } else if(!strcmp(words[0], "trace-types")) {
+      if(nwords != 2 || sftp_trace_types(words[1]))
+        sftp_fatal("%s:%d: invalid trace-types directive", path, lineno);
+    } else if(!strcmp(words[0], "user-cache-ttl")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid user-cache-ttl directive", path, lineno);
+      sftpconf_user_cache_ttl = atoi(words[1]);
+      if(sftpconf_user_cache_ttl < 0)
+        sftp_fatal("%s:%d: invalid user-cache-ttl directive", path, lineno);
+    } else if(!strcmp(words[0], "write-behind")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid write-behind directive", path, lineno);
+      sftpconf_write_behind = atoi(words[1]);
+      if(sftpconf_write_behind < 0)
+        sftp_fatal("%s:%d: invalid write-behind directive", path, lineno);
+    } else if(!strcmp(words[0], "zero-copy")) {
+      if(nwords != 2)
+        sftp_fatal("%s:%d: invalid zero-copy directive", path, lineno);
+      if(!strcmp(words[1], "true"))
+        sftpconf_zerocopy = 1;
+      else if(!strcmp(words[1], "false"))
+        sftpconf_zerocopy = 0;
+      else
+        sftp_fatal("%s:%d: invalid zero-copy directive", path, lineno);
     } else {
       sftp_fatal("%s:%d: unrecognized directive: %s", path, lineno, words[0]);
     }
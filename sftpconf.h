@@ -23,7 +23,43 @@
 
 void sftpconf_read(const char *path);
 
-extern int sftpconf_nthreads; // Number of threads to use
+extern int sftpconf_nthreads; // Number of threads to start with
+extern int sftpconf_min_threads; // Fewest threads
+extern int sftpconf_max_threads; // Most threads
+extern int sftpconf_fsync_on_close; // Make files durable before closing
 extern int sftpconf_reorder;  // Response re-ordering
+extern int sftpconf_output_batch; // Responses per output syscall, or 0
+extern int sftpconf_queue;        // Work queue implementation
+extern int sftpconf_zerocopy;     // Zero-copy reads
+extern int sftpconf_max_handles;  // Maximum open handles
+extern int sftpconf_max_inflight_bytes; // Request bytes in memory, or 0
+extern int sftpconf_max_inflight_requests; // Requests in memory, or 0
+extern int sftpconf_max_names;    // Maximum names per READDIR response
+extern int sftpconf_max_read;     // Maximum bytes per READ response
+extern int sftpconf_max_request;  // Maximum request size
+extern int sftpconf_stat_threads; // READDIR stat helper threads
+extern int sftpconf_stat_cache_ttl; // Stat cache lifetime in ms, or 0
+extern int sftpconf_handle_threads; // Workers per handle in a fair queue, or 0
+extern int sftpconf_hash_threads; // check-file hashing helper threads
+extern int sftpconf_user_cache_ttl; // User/group cache lifetime, or 0
+extern int sftpconf_uring;        // Asynchronous reads and writes
+extern int sftpconf_read_ahead;   // Sequential read-ahead in bytes, or 0
+extern int sftpconf_readdir_prefetch; // Prefetch directory entries
+extern int sftpconf_write_behind; // Write coalescing buffer size, or 0
+extern int sftpconf_realpath_cache_ttl; // Path resolution cache lifetime, or 0
+extern int sftpconf_preallocate;  // Preallocation ahead of uploads, or 0
+extern int sftpconf_prefork;      // Preforked server processes, or 0
+extern int sftpconf_prefork_sessions; // Sessions per preforked process, or 0
+extern int sftpconf_reuse_port;   // One SO_REUSEPORT listener per process
+extern int sftpconf_stats;        // Collect and log performance statistics
+extern int sftpconf_trace;        // Trace messages through per-thread rings
+extern int sftpconf_trace_payload; // Message bytes traced beyond the header
+extern int sftpconf_trace_sample; // Trace one request ID in this many
+extern int sftpconf_send_pool;    // Spare pooled send buffers, or 0
+extern int sftpconf_send_pool_idle; // Idle send buffer lifetime, or 0
+extern int sftpconf_huge_pages;   // Huge pages for send buffers
+extern int sftpconf_mmap_read;    // Smallest file to read by mmap, or 0
+extern int sftpconf_multiplex;    // Sessions served concurrently per process, or 0
+extern const char *sftpconf_capture; // Directory for request captures, or 0
 
 #endif /* SFTPCONF_H */
@@ -0,0 +1,647 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file sftpmicrobench.c @brief Microbenchmarks for the core primitives
+ *
+ * Times the building blocks in libsftp.a on their own, outside any server:
+ * the allocator, the parse and send functions, the serialization queue, the
+ * work queue and character set conversion.  Each benchmark is run at each of
+ * a list of thread counts and reports the time per operation, the number of
+ * heap allocations per operation and, where perf_event_open() is permitted,
+ * cycles and cache misses per operation.
+ *
+ * Most benchmarks run the same loop in every thread and report the time each
+ * thread took per operation, so that contention shows up as growth with the
+ * thread count.  The work queue benchmarks have a single producer, as in the
+ * server, and the thread count is the number of workers.
+ */
+
+#include "sftpserver.h"
+#include "sftpconf.h"
+#include "types.h"
+#include "alloc.h"
+#include "parse.h"
+#include "send.h"
+#include "sftp.h"
+#include "queue.h"
+#include "serialize.h"
+#include "session.h"
+#include "charset.h"
+#include "utils.h"
+#include "thread.h"
+#include "handle.h"
+#include "xfns.h"
+#include "globals.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <iconv.h>
+#if HAVE_LINUX_PERF_EVENT_H
+#  include <linux/perf_event.h>
+#  include <sys/syscall.h>
+#  include <sys/ioctl.h>
+#endif
+
+#if HAVE___LIBC_MALLOC
+/** @brief Heap allocations made by the calling thread */
+static THREAD_LOCAL uint64_t allocations;
+
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t n);
+
+/* Count allocations on the way through to the C library */
+void *malloc(size_t n) {
+  ++allocations;
+  return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size) {
+  ++allocations;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t n) {
+  ++allocations;
+  return __libc_realloc(ptr, n);
+}
+#endif
+
+/** @brief State for one benchmark thread */
+struct benchthread {
+  /** @brief Operations to perform */
+  size_t iterations;
+
+  /** @brief Index of this thread */
+  int index;
+
+  /** @brief Total number of threads */
+  int nthreads;
+
+  /** @brief Allocations made during the timed loop */
+  uint64_t allocations;
+
+  /** @brief Thread ID */
+  pthread_t thread;
+};
+
+/** @brief A benchmark */
+struct bench {
+  /** @brief Name */
+  const char *name;
+
+  /** @brief Description */
+  const char *description;
+
+  /** @brief Set up shared state before the threads start, or a null pointer
+   * @param nthreads Number of threads
+   */
+  void (*setup)(int nthreads);
+
+  /** @brief Timed loop, run in each thread
+   * @param t Thread state
+   */
+  void (*run)(struct benchthread *t);
+
+  /** @brief Tear down shared state after the threads finish, or a null pointer
+   */
+  void (*teardown)(void);
+
+  /** @brief Non-0 to run @ref run in one thread only
+   *
+   * The thread count is then passed to @ref setup for the benchmark's own
+   * use. */
+  int single;
+};
+
+THREAD_LOCAL const struct sftpprotocol *protocol = &sftp_v3;
+const char sendtype[] = "request";
+
+/** @brief Lock for starting threads together */
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Signaled when @ref started is set */
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+
+/** @brief Set when the timed section begins */
+static int started;
+
+/** @brief Benchmark being run */
+static const struct bench *current;
+
+/** @brief Shared session for the serialization benchmark */
+static struct session session;
+
+/** @brief Work queue for the queue benchmarks */
+static struct queue *benchqueue;
+
+/** @brief Jobs completed by the work queue */
+static size_t completed;
+
+/** @brief Lock protecting @ref completed */
+static pthread_mutex_t completed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct option options[] = {
+    {"help", no_argument, 0, 'h'},
+    {"version", no_argument, 0, 'V'},
+    {"iterations", required_argument, 0, 'n'},
+    {"threads", required_argument, 0, 't'},
+    {"quick", no_argument, 0, 'q'},
+    {0, 0, 0, 0}};
+
+/** @brief Get a timestamp
+ * @return Monotonic time in nanoseconds
+ */
+static uint64_t now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Allocator ---------------------------------------------------------------- */
+
+static void run_alloc(struct benchthread *t) {
+  struct allocator a;
+  size_t i;
+
+  sftp_alloc_init(&a);
+  for(i = 0; i < t->iterations; ++i) {
+    *(char *)sftp_alloc(&a, 8 + (i & 127)) = 0;
+    /* Reset about as often as a worker does between requests */
+    if((i & 63) == 63)
+      sftp_alloc_reset(&a);
+  }
+  sftp_alloc_destroy(&a);
+}
+
+static void run_alloc_more(struct benchthread *t) {
+  struct allocator a;
+  size_t i, n = 16;
+  void *ptr = NULL;
+
+  sftp_alloc_init(&a);
+  for(i = 0; i < t->iterations; ++i) {
+    ptr = sftp_alloc_more(&a, ptr, n, 2 * n);
+    n *= 2;
+    /* Grow to 4KB and start again */
+    if(n >= 4096) {
+      sftp_alloc_reset(&a);
+      ptr = NULL;
+      n = 16;
+    }
+  }
+  sftp_alloc_destroy(&a);
+}
+
+/* Parsing and sending ------------------------------------------------------ */
+
+/** @brief Start a typical read-sized message
+ * @param w Worker to send with
+ * @param index Thread index, used as the handle
+ * @param i Operation number
+ */
+static void build_request(struct worker *w, int index, size_t i) {
+  struct handleid id;
+
+  id.id = index;
+  id.tag = 1;
+  sftp_send_begin(w);
+  sftp_send_uint8(w, SSH_FXP_READ);
+  sftp_send_uint32(w, (uint32_t)i);
+  sftp_send_handle(w, &id);
+  sftp_send_uint64(w, (uint64_t)i * 32768);
+  sftp_send_uint32(w, 32768);
+}
+
+static void run_parse(struct benchthread *t) {
+  struct worker w;
+  struct allocator a;
+  struct sftpjob job;
+  struct handleid id;
+  uint8_t type;
+  uint32_t u32;
+  uint64_t u64;
+  char *s;
+  size_t i, len;
+
+  sftp_memset(&w, 0, sizeof w);
+  sftp_memset(&job, 0, sizeof job);
+  build_request(&w, t->index, 0);
+  sftp_send_string(&w, "some/directory/some-file.name");
+  job.a = sftp_alloc_init(&a);
+  job.worker = &w;
+  job.data = w.buffer + 4;
+  job.len = w.bufused - 4;
+  for(i = 0; i < t->iterations; ++i) {
+    job.ptr = job.data;
+    job.left = job.len;
+    if(sftp_parse_uint8(&job, &type) || sftp_parse_uint32(&job, &u32) ||
+       sftp_parse_handle(&job, &id) || sftp_parse_uint64(&job, &u64) ||
+       sftp_parse_uint32(&job, &u32) || sftp_parse_string(&job, &s, &len))
+      sftp_fatal("parse failed");
+    if((i & 63) == 63)
+      sftp_alloc_reset(&a);
+  }
+  sftp_alloc_destroy(&a);
+  free(w.buffer);
+}
+
+static void run_send(struct benchthread *t) {
+  struct worker w;
+  size_t i;
+
+  sftp_memset(&w, 0, sizeof w);
+  for(i = 0; i < t->iterations; ++i) {
+    build_request(&w, t->index, i);
+    sftp_send_string(&w, "some/directory/some-file.name");
+  }
+  free(w.buffer);
+}
+
+/* Serialization ------------------------------------------------------------ */
+
+static void setup_serialize(int attribute((unused)) nthreads) {
+  serialize_init(&session.sq);
+}
+
+static void run_serialize(struct benchthread *t) {
+  struct worker w;
+  struct sftpjob job;
+  size_t i;
+
+  /* Every thread reads from its own handle, so only the queue lock and the
+   * handle table are shared */
+  sftp_memset(&w, 0, sizeof w);
+  sftp_memset(&job, 0, sizeof job);
+  job.session = &session;
+  for(i = 0; i < t->iterations; ++i) {
+    build_request(&w, t->index, i);
+    job.data = w.buffer + 4;
+    job.len = w.bufused - 4;
+    queue_serializable_job(&job);
+    serialize(&job);
+    serialize_remove_job(&job);
+  }
+  free(w.buffer);
+}
+
+static void teardown_serialize(void) {
+  serialize_destroy(&session.sq);
+}
+
+/* Work queue --------------------------------------------------------------- */
+
+static void queue_work(void attribute((unused)) * job,
+                       void attribute((unused)) * workerdata,
+                       struct allocator attribute((unused)) * a) {
+  ferrcheck(pthread_mutex_lock(&completed_lock));
+  ++completed;
+  ferrcheck(pthread_mutex_unlock(&completed_lock));
+}
+
+static void *queue_init_worker(void) {
+  return &completed;
+}
+
+static void queue_cleanup_worker(void attribute((unused)) * workerdata) {}
+
+static const struct queuedetails bench_queuedetails = {
+    queue_init_worker,
+    queue_work,
+    queue_cleanup_worker,
+};
+
+static void setup_queue_mutex(int nthreads) {
+  completed = 0;
+  queue_init(&benchqueue, &bench_queuedetails, nthreads, nthreads, nthreads,
+             queue_mutex);
+}
+
+static void setup_queue_ring(int nthreads) {
+  completed = 0;
+  queue_init(&benchqueue, &bench_queuedetails, nthreads, nthreads, nthreads,
+             queue_ring);
+}
+
+static void setup_queue_fair(int nthreads) {
+  completed = 0;
+  queue_init(&benchqueue, &bench_queuedetails, nthreads, nthreads, nthreads,
+             queue_fair);
+}
+
+static void run_queue(struct benchthread *t) {
+  size_t i;
+
+  for(i = 0; i < t->iterations; ++i)
+    queue_add_keyed(benchqueue, &completed, 1 + (i & 7));
+  /* Destroying the queue waits for it to drain */
+  queue_destroy(benchqueue);
+  benchqueue = NULL;
+  if(completed != t->iterations)
+    sftp_fatal("queue completed %zu jobs out of %zu", completed,
+               t->iterations);
+}
+
+/* Character set conversion ------------------------------------------------- */
+
+static void run_iconv(struct benchthread *t) {
+  struct allocator a;
+  iconv_t cd;
+  size_t i;
+  char *s;
+
+  if((cd = iconv_open("UTF-8", "ISO-8859-1")) == (iconv_t)-1)
+    sftp_fatal("error calling iconv_open: %s", strerror(errno));
+  sftp_alloc_init(&a);
+  for(i = 0; i < t->iterations; ++i) {
+    s = (char *)"some/directory/caf\xe9-na\xefve.name";
+    if(sftp_iconv(&a, cd, &s))
+      sftp_fatal("error converting string: %s", strerror(errno));
+    if((i & 63) == 63)
+      sftp_alloc_reset(&a);
+  }
+  sftp_alloc_destroy(&a);
+  iconv_close(cd);
+}
+
+/** @brief Table of benchmarks */
+static const struct bench benches[] = {
+    {"alloc", "sftp_alloc() of 8-135 bytes", NULL, run_alloc, NULL, 0},
+    {"alloc-more", "sftp_alloc_more() doubling to 4KB", NULL, run_alloc_more,
+     NULL, 0},
+    {"parse", "sftp_parse_*() of a read request and a string", NULL,
+     run_parse, NULL, 0},
+    {"send", "sftp_send_*() of a read request and a string", NULL, run_send,
+     NULL, 0},
+    {"serialize", "serialize a read, one handle per thread", setup_serialize,
+     run_serialize, teardown_serialize, 0},
+    {"queue-mutex", "queue_add() to mutex queue workers", setup_queue_mutex,
+     run_queue, NULL, 1},
+    {"queue-ring", "queue_add() to ring queue workers", setup_queue_ring,
+     run_queue, NULL, 1},
+    {"queue-fair", "queue_add_keyed() across 8 keys to fair queue workers",
+     setup_queue_fair, run_queue, NULL, 1},
+    {"iconv", "sftp_iconv() from ISO-8859-1 to UTF-8", NULL, run_iconv, NULL,
+     0},
+};
+
+/** @brief Number of benchmarks */
+#define NBENCHES (sizeof benches / sizeof *benches)
+
+/* Harness ------------------------------------------------------------------ */
+
+/* display usage message and terminate */
+static void attribute((noreturn)) help(void) {
+  size_t i;
+
+  sftp_xprintf("Usage:\n"
+               "  sftpmicrobench [OPTIONS] [BENCHMARK...]\n"
+               "\n"
+               "Time the core primitives of the SFTP server.\n"
+               "\n");
+  sftp_xprintf("Options:\n"
+               "  --help, -h               Display usage message\n"
+               "  --version, -V            Display version number\n"
+               "  -n, --iterations N       Operations per thread (default "
+               "200000)\n"
+               "  -t, --threads LIST       Comma-separated thread counts "
+               "(default 1,2,4)\n"
+               "  -q, --quick              Run very few iterations\n"
+               "\n"
+               "Benchmarks:\n");
+  for(i = 0; i < NBENCHES; ++i)
+    sftp_xprintf("  %-24s %s\n", benches[i].name, benches[i].description);
+  exit(0);
+}
+
+/* display version number and terminate */
+static void attribute((noreturn)) version_info(void) {
+  sftp_xprintf("sftpmicrobench version %s\n", VERSION);
+  exit(0);
+}
+
+/** @brief Hardware counters measured */
+enum counter { counter_cycles, counter_misses, ncounters };
+
+/** @brief File descriptors for hardware counters, or -1 */
+static int counterfds[ncounters];
+
+/** @brief Open and start the hardware counters
+ *
+ * Counters are inherited by threads created afterwards.  If they cannot be
+ * opened (for instance because of @c perf_event_paranoid) they are left at
+ * -1.
+ */
+static void counters_start(void) {
+  int n;
+
+  for(n = 0; n < ncounters; ++n) {
+    counterfds[n] = -1;
+#if HAVE_LINUX_PERF_EVENT_H
+    struct perf_event_attr attr;
+
+    sftp_memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = n == counter_cycles ? PERF_COUNT_HW_CPU_CYCLES
+                                      : PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counterfds[n] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if(counterfds[n] >= 0)
+      ioctl(counterfds[n], PERF_EVENT_IOC_ENABLE, 0);
+#endif
+  }
+}
+
+/** @brief Stop and read the hardware counters
+ * @param values Where to store counts, or all bits set if not available
+ *
+ * Must only be called once the threads have been joined, since inherited
+ * counts are only added in when a thread exits.
+ */
+static void counters_stop(uint64_t values[ncounters]) {
+  int n;
+
+  for(n = 0; n < ncounters; ++n) {
+    values[n] = ~(uint64_t)0;
+    if(counterfds[n] < 0)
+      continue;
+#if HAVE_LINUX_PERF_EVENT_H
+    ioctl(counterfds[n], PERF_EVENT_IOC_DISABLE, 0);
+    if(read(counterfds[n], &values[n], sizeof values[n]) != sizeof values[n])
+      values[n] = ~(uint64_t)0;
+#endif
+    close(counterfds[n]);
+  }
+}
+
+/** @brief Benchmark thread
+ * @param arg Thread state
+ * @return Null pointer
+ */
+static void *bench_thread(void *arg) {
+  struct benchthread *const t = arg;
+#if HAVE___LIBC_MALLOC
+  uint64_t before;
+#endif
+
+  ferrcheck(pthread_mutex_lock(&start_lock));
+  while(!started)
+    ferrcheck(pthread_cond_wait(&start_cond, &start_lock));
+  ferrcheck(pthread_mutex_unlock(&start_lock));
+#if HAVE___LIBC_MALLOC
+  before = allocations;
+  current->run(t);
+  t->allocations = allocations - before;
+#else
+  current->run(t);
+#endif
+  return NULL;
+}
+
+/** @brief Run one benchmark at one thread count and report the results
+ * @param b Benchmark
+ * @param nthreads Number of threads
+ * @param iterations Operations per thread
+ */
+static void bench_run(const struct bench *b, int nthreads, size_t iterations) {
+  const int nrun = b->single ? 1 : nthreads;
+  struct benchthread *threads = sftp_xcalloc(nrun, sizeof *threads);
+  uint64_t begin, elapsed, allocs = 0, values[ncounters];
+  double ops;
+  int n;
+
+  current = b;
+  started = 0;
+  if(b->setup)
+    b->setup(nthreads);
+  counters_start();
+  for(n = 0; n < nrun; ++n) {
+    threads[n].iterations = iterations;
+    threads[n].index = n;
+    threads[n].nthreads = nthreads;
+    ferrcheck(pthread_create(&threads[n].thread, 0, bench_thread, &threads[n]));
+  }
+  ferrcheck(pthread_mutex_lock(&start_lock));
+  begin = now();
+  started = 1;
+  ferrcheck(pthread_cond_broadcast(&start_cond));
+  ferrcheck(pthread_mutex_unlock(&start_lock));
+  for(n = 0; n < nrun; ++n) {
+    ferrcheck(pthread_join(threads[n].thread, 0));
+    allocs += threads[n].allocations;
+  }
+  elapsed = now() - begin;
+  counters_stop(values);
+  if(b->teardown)
+    b->teardown();
+  ops = (double)iterations * nrun;
+  printf("%-12s %7d %10.1f", b->name, nthreads, (double)elapsed / iterations);
+#if HAVE___LIBC_MALLOC
+  printf(" %10.3f", allocs / ops);
+#else
+  printf(" %10s", "-");
+#endif
+  for(n = 0; n < ncounters; ++n)
+    if(values[n] != ~(uint64_t)0)
+      printf(" %10.1f", values[n] / ops);
+    else
+      printf(" %10s", "-");
+  printf("\n");
+  fflush(stdout);
+  free(threads);
+}
+
+int main(int argc, char **argv) {
+  size_t iterations = 200000, i;
+  int n, nthreadcounts = 0, threadcounts[16], selected;
+  const char *list = "1,2,4";
+  char *end;
+
+  while((n = getopt_long(argc, argv, "hVn:t:q", options, 0)) >= 0) {
+    switch(n) {
+    case 'h':
+      help();
+    case 'V':
+      version_info();
+    case 'n':
+      errno = 0;
+      iterations = strtoul(optarg, &end, 10);
+      if(errno || *end || !iterations)
+        sftp_fatal("invalid --iterations argument '%s'", optarg);
+      break;
+    case 't':
+      list = optarg;
+      break;
+    case 'q':
+      iterations = 2000;
+      break;
+    default:
+      exit(1);
+    }
+  }
+  while(*list) {
+    if(nthreadcounts >= (int)(sizeof threadcounts / sizeof *threadcounts))
+      sftp_fatal("too many thread counts");
+    errno = 0;
+    threadcounts[nthreadcounts] = strtol(list, &end, 10);
+    if(errno || end == list || threadcounts[nthreadcounts] <= 0 ||
+       (*end && *end != ','))
+      sftp_fatal("invalid --threads argument");
+    ++nthreadcounts;
+    list = *end ? end + 1 : end;
+  }
+  for(n = optind; n < argc; ++n) {
+    for(i = 0; i < NBENCHES && strcmp(argv[n], benches[i].name); ++i)
+      ;
+    if(i == NBENCHES)
+      sftp_fatal("unknown benchmark '%s'", argv[n]);
+  }
+  printf("%-12s %7s %10s %10s %10s %10s\n", "benchmark", "threads", "ns/op",
+         "allocs/op", "cycles/op", "misses/op");
+  for(i = 0; i < NBENCHES; ++i) {
+    selected = optind == argc;
+    for(n = optind; n < argc && !selected; ++n)
+      selected = !strcmp(argv[n], benches[i].name);
+    if(!selected)
+      continue;
+    for(n = 0; n < nthreadcounts; ++n)
+      bench_run(&benches[i], threadcounts[n], iterations);
+  }
+  return 0;
+}
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,975 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file sftpreplay.c @brief Capture replay tool
+ *
+ * Replays a capture written by the server's @c capture directive (see
+ * capture.h) against a server run as a child process, and reports latency
+ * distributions for each request type alongside those in the capture.
+ *
+ * Captures contain no names or data.  Each path becomes a file called
+ * @c c<hash> in the replay directory, and files and directories that the
+ * capture shows existing before the session touched them are created before
+ * replay starts, large enough for the reads made from them.  Writes send
+ * zeros.
+ *
+ * By default requests are sent as fast as possible, except that no more are
+ * outstanding at once than were in the capture, and a request using a handle
+ * waits for the handle to arrive.  With <tt>--speed original</tt> each
+ * request is also held back until the time it was originally received.
+ */
+
+#include "sftpserver.h"
+#include "utils.h"
+#include "xfns.h"
+#include "send.h"
+#include "globals.h"
+#include "types.h"
+#include "alloc.h"
+#include "parse.h"
+#include "sftp.h"
+#include "debug.h"
+#include "capture.h"
+#include "trace.h"
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <time.h>
+
+/** @brief One request from the capture */
+struct request {
+  /** @brief Captured request */
+  struct capturerecord rec;
+
+  /** @brief Type of captured response, or 0 if there was none */
+  uint8_t rtype;
+
+  /** @brief Handle in captured response */
+  uint32_t rhandle;
+
+  /** @brief Status code or length in captured response */
+  uint32_t rlength;
+
+  /** @brief Captured latency in nanoseconds */
+  uint64_t latency;
+
+  /** @brief Number of requests outstanding in the capture when it arrived */
+  size_t window;
+};
+
+/** @brief What is known about a path */
+struct pathinfo {
+  /** @brief Hash of path */
+  uint32_t hash;
+
+  /** @brief What to create before replaying */
+  enum {
+    /** @brief Empty slot */
+    path_unused,
+
+    /** @brief Nothing; the capture creates it */
+    path_new,
+
+    /** @brief A file */
+    path_file,
+
+    /** @brief A directory */
+    path_dir
+  } state;
+
+  /** @brief Size of file to create */
+  uint64_t size;
+};
+
+/** @brief State of a captured handle */
+struct replayhandle {
+  /** @brief Whether the handle is usable */
+  enum {
+    /** @brief No handle */
+    handle_none,
+
+    /** @brief Waiting for the response to an open */
+    handle_pending,
+
+    /** @brief Open */
+    handle_open
+  } state;
+
+  /** @brief Request ID of open, if @ref handle_pending */
+  uint32_t id;
+
+  /** @brief Length of @ref data */
+  size_t len;
+
+  /** @brief Handle from replay server */
+  char data[256];
+};
+
+/** @brief A request sent but not yet answered */
+struct inflight {
+  /** @brief Request ID */
+  uint32_t id;
+
+  /** @brief Index into @ref requests */
+  size_t request;
+
+  /** @brief When it was sent */
+  uint64_t sent;
+};
+
+/** @brief A growable list of latencies */
+struct latencies {
+  /** @brief Latencies in nanoseconds */
+  uint64_t *v;
+
+  /** @brief Number of latencies */
+  size_t n;
+
+  /** @brief Space in @ref v */
+  size_t size;
+};
+
+THREAD_LOCAL const struct sftpprotocol *protocol = &sftp_v3;
+const char sendtype[] = "request";
+
+/** @brief Requests from the capture */
+static struct request *requests;
+
+/** @brief Number of requests */
+static size_t nrequests;
+
+/** @brief Protocol version from the capture */
+static uint32_t version = 3;
+
+/** @brief Hash table of paths */
+static struct pathinfo *paths;
+
+/** @brief Number of paths */
+static size_t npaths;
+
+/** @brief Size of @ref paths (a power of 2) */
+static size_t pathslots;
+
+/** @brief Captured handles */
+static struct replayhandle *handles;
+
+/** @brief Size of @ref handles */
+static size_t nhandles;
+
+/** @brief Outstanding requests */
+static struct inflight *inflight;
+
+/** @brief Number of outstanding requests */
+static size_t ninflight;
+
+/** @brief Size of @ref inflight */
+static size_t inflightsize;
+
+/** @brief Replay latencies by request type */
+static struct latencies replayed[256];
+
+/** @brief Captured latencies by request type */
+static struct latencies captured[256];
+
+/** @brief Number of requests not replayed */
+static size_t skipped;
+
+/** @brief Number of responses that differed from those captured */
+static size_t differed;
+
+/** @brief Directory for replay files */
+static const char *directory = ".";
+
+/** @brief Non-0 to replay at the original speed */
+static int original_speed;
+
+/** @brief File descriptor for responses */
+static int sftpin;
+
+/** @brief Last request ID used */
+static uint32_t lastid;
+
+/** @brief Zeros to write */
+static unsigned char *zeros;
+
+/** @brief Allocator for @ref job */
+static struct allocator allocator;
+
+/** @brief Current response, and state for sending */
+static struct sftpjob job;
+
+/** @brief Buffer for requests */
+static struct worker worker;
+
+static const struct option options[] = {
+    {"help", no_argument, 0, 'h'},
+    {"version", no_argument, 0, 'V'},
+    {"program", required_argument, 0, 'P'},
+    {"program-config", required_argument, 0, 'C'},
+    {"directory", required_argument, 0, 'd'},
+    {"speed", required_argument, 0, 's'},
+    {0, 0, 0, 0}};
+
+/* display usage message and terminate */
+static void attribute((noreturn)) help(void) {
+  sftp_xprintf("Usage:\n"
+               "  sftpreplay [OPTIONS] -P PROGRAM CAPTURE\n"
+               "\n"
+               "Replay a server capture and report latencies.\n"
+               "\n");
+  sftp_xprintf(
+      "Options:\n"
+      "  --help, -h               Display usage message\n"
+      "  --version, -V            Display version number\n"
+      "  -P, --program PATH       Execute program as SFTP server\n"
+      "  -C, --program-config PATH  Configuration file for server\n"
+      "  -d, --directory DIR      Remote directory for files (default .)\n"
+      "  -s, --speed original|max Request timing (default max)\n");
+  exit(0);
+}
+
+/* display version number and terminate */
+static void attribute((noreturn)) version_info(void) {
+  sftp_xprintf("sftpreplay version %s\n", VERSION);
+  exit(0);
+}
+
+/** @brief Get a timestamp
+ * @return Monotonic time in nanoseconds
+ */
+static uint64_t now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** @brief Add a latency to a list
+ * @param l List
+ * @param ns Latency in nanoseconds
+ */
+static void latency_add(struct latencies *l, uint64_t ns) {
+  if(l->n >= l->size) {
+    l->size = l->size ? 2 * l->size : 64;
+    l->v = sftp_xrecalloc(l->v, l->size, sizeof *l->v);
+  }
+  l->v[l->n++] = ns;
+}
+
+/** @brief Compare latencies for qsort() */
+static int latency_compare(const void *av, const void *bv) {
+  const uint64_t a = *(const uint64_t *)av, b = *(const uint64_t *)bv;
+
+  return a < b ? -1 : a > b;
+}
+
+/** @brief Find a percentile
+ * @param l Sorted list, which must not be empty
+ * @param p Percentile, in tenths of a percent
+ * @return Latency in microseconds
+ */
+static uint64_t percentile(const struct latencies *l, unsigned p) {
+  size_t n = (l->n * p + 999) / 1000;
+
+  return l->v[n ? n - 1 : 0] / 1000;
+}
+
+/* Loading the capture */
+
+/** @brief Find a path
+ * @param hash Hash of path
+ * @param state State for new path, or @ref path_unused to only look
+ * @return Path, or a null pointer if not found and not created
+ */
+static struct pathinfo *path_find(uint32_t hash, int state) {
+  struct pathinfo *old;
+  size_t n, oldslots;
+
+  if(state != path_unused && 2 * (npaths + 1) > pathslots) {
+    old = paths;
+    oldslots = pathslots;
+    pathslots = pathslots ? 2 * pathslots : 256;
+    paths = sftp_xcalloc(pathslots, sizeof *paths);
+    npaths = 0;
+    for(n = 0; n < oldslots; ++n)
+      if(old[n].state != path_unused)
+        *path_find(old[n].hash, old[n].state) = old[n];
+    free(old);
+  }
+  if(!pathslots)
+    return NULL;
+  for(n = hash & (pathslots - 1); paths[n].state != path_unused;
+      n = (n + 1) & (pathslots - 1))
+    if(paths[n].hash == hash)
+      return &paths[n];
+  if(state == path_unused)
+    return NULL;
+  paths[n].hash = hash;
+  paths[n].state = state;
+  paths[n].size = 0;
+  ++npaths;
+  return &paths[n];
+}
+
+/** @brief Find a captured handle
+ * @param h Handle number
+ * @return Handle state
+ */
+static struct replayhandle *handle_find(uint32_t h) {
+  size_t n;
+
+  if(h >= nhandles) {
+    n = nhandles;
+    nhandles = h + 64;
+    handles = sftp_xrecalloc(handles, nhandles, sizeof *handles);
+    memset(handles + n, 0, (nhandles - n) * sizeof *handles);
+  }
+  return &handles[h];
+}
+
+/** @brief Read a capture file
+ * @param path Filename
+ */
+static void load(const char *path) {
+  FILE *fp;
+  unsigned char buffer[CAPTURE_RECORD];
+  struct capturerecord r;
+  struct request *q;
+  size_t *pending = NULL, npending = 0, pendingsize = 0, size = 0, n;
+
+  if(!(fp = fopen(path, "rb")))
+    sftp_fatal("error opening %s: %s", path, strerror(errno));
+  if(fread(buffer, CAPTURE_MAGICLEN, 1, fp) != 1
+     || memcmp(buffer, CAPTURE_MAGIC, CAPTURE_MAGICLEN))
+    sftp_fatal("%s: not a capture file", path);
+  while(fread(buffer, sizeof buffer, 1, fp) == 1) {
+    sftp_capture_decode(buffer, &r);
+    if(r.kind == capture_request) {
+      if(r.type == SSH_FXP_INIT) {
+        version = r.id;
+        continue;
+      }
+      if(nrequests >= size) {
+        size = size ? 2 * size : 1024;
+        requests = sftp_xrecalloc(requests, size, sizeof *requests);
+      }
+      q = &requests[nrequests];
+      sftp_memset(q, 0, sizeof *q);
+      q->rec = r;
+      q->window = npending;
+      if(npending >= pendingsize) {
+        pendingsize = pendingsize ? 2 * pendingsize : 64;
+        pending = sftp_xrecalloc(pending, pendingsize, sizeof *pending);
+      }
+      pending[npending++] = nrequests++;
+    } else if(r.type != SSH_FXP_VERSION) {
+      for(n = 0; n < npending && requests[pending[n]].rec.id != r.id; ++n)
+        ;
+      if(n == npending)
+        continue;
+      q = &requests[pending[n]];
+      q->rtype = r.type;
+      q->rhandle = r.handle;
+      q->rlength = r.length;
+      q->latency = r.when - q->rec.when;
+      pending[n] = pending[--npending];
+    }
+  }
+  if(ferror(fp))
+    sftp_fatal("error reading %s: %s", path, strerror(errno));
+  fclose(fp);
+  free(pending);
+}
+
+/** @brief Note the first use of a path
+ * @param hash Hash of path
+ * @param ok Non-0 if the captured request succeeded
+ * @param state What to create if the request succeeded
+ */
+static void path_use(uint32_t hash, int ok, int state) {
+  path_find(hash, ok ? state : path_new);
+}
+
+/** @brief Work out what must exist before replay starts
+ *
+ * Only the first use of each path counts.  A path that was successfully
+ * used without being created must have existed already.
+ */
+static void analyse(void) {
+  uint32_t *handlepaths = NULL;
+  size_t n, nhandlepaths = 0, old;
+  struct request *q;
+  struct pathinfo *p;
+  int ok, exclusive;
+
+  for(n = 0; n < nrequests; ++n) {
+    q = &requests[n];
+    /* Successful if we got anything other than an error status */
+    ok = q->rtype && (q->rtype != SSH_FXP_STATUS || q->rlength == SSH_FX_OK);
+    switch(q->rec.type) {
+    case SSH_FXP_OPEN:
+      if(version >= 5)
+        exclusive = (q->rec.offset & SSH_FXF_ACCESS_DISPOSITION) ==
+                    SSH_FXF_CREATE_NEW;
+      else
+        exclusive = (q->rec.offset & (SSH_FXF_CREAT | SSH_FXF_EXCL)) ==
+                    (SSH_FXF_CREAT | SSH_FXF_EXCL);
+      path_use(q->rec.path, ok && !exclusive, path_file);
+      if(q->rtype == SSH_FXP_HANDLE) {
+        if(q->rhandle >= nhandlepaths) {
+          old = nhandlepaths;
+          nhandlepaths = q->rhandle + 64;
+          handlepaths =
+              sftp_xrecalloc(handlepaths, nhandlepaths, sizeof *handlepaths);
+          memset(handlepaths + old, 0,
+                 (nhandlepaths - old) * sizeof *handlepaths);
+        }
+        handlepaths[q->rhandle] = q->rec.path;
+      }
+      break;
+    case SSH_FXP_READ:
+      /* Files must be big enough to satisfy the reads made from them */
+      if(q->rtype == SSH_FXP_DATA && q->rec.handle < nhandlepaths
+         && (p = path_find(handlepaths[q->rec.handle], path_unused))
+         && p->state == path_file && q->rec.offset + q->rlength > p->size)
+        p->size = q->rec.offset + q->rlength;
+      break;
+    case SSH_FXP_OPENDIR:
+    case SSH_FXP_RMDIR:
+      path_use(q->rec.path, ok, path_dir);
+      break;
+    case SSH_FXP_MKDIR:
+      path_use(q->rec.path, 0, path_new);
+      break;
+    case SSH_FXP_RENAME:
+      path_use(q->rec.path, ok, path_file);
+      path_use(q->rec.path2, 0, path_new);
+      break;
+    case SSH_FXP_STAT:
+    case SSH_FXP_LSTAT:
+    case SSH_FXP_SETSTAT:
+    case SSH_FXP_REMOVE:
+    case SSH_FXP_REALPATH:
+    case SSH_FXP_READLINK:
+      path_use(q->rec.path, ok, path_file);
+      break;
+    }
+  }
+  free(handlepaths);
+}
+
+/* Talking to the server */
+
+/** @brief Get a new request ID
+ * @return Request ID
+ */
+static uint32_t newid(void) {
+  do {
+    ++lastid;
+  } while(!lastid);
+  return lastid;
+}
+
+/** @brief Read a response into @ref job
+ * @return Response type
+ */
+static uint8_t getresponse(void) {
+  uint32_t len;
+  uint8_t type;
+
+  if(sftp_xread(sftpin, &len, sizeof len))
+    sftp_fatal("unexpected EOF from server");
+  free(job.data);
+  job.len = ntohl(len);
+  job.data = sftp_xmalloc(job.len);
+  if(sftp_xread(sftpin, job.data, job.len))
+    sftp_fatal("unexpected EOF from server");
+  job.ptr = job.data;
+  job.left = job.len;
+  job.id = 0;
+  if(sftp_parse_uint8(&job, &type))
+    sftp_fatal("empty response from server");
+  if(type != SSH_FXP_VERSION && sftp_parse_uint32(&job, &job.id))
+    sftp_fatal("truncated response from server");
+  return type;
+}
+
+/** @brief Wait for a response to a synchronous request
+ * @param id Request ID
+ * @param what Description of request
+ * @return Response type
+ */
+static uint8_t waitresponse(uint32_t id, const char *what) {
+  uint8_t type = getresponse();
+  uint32_t status;
+
+  if(job.id != id)
+    sftp_fatal("wrong ID in response to %s", what);
+  if(type == SSH_FXP_STATUS && !sftp_parse_uint32(&job, &status) && status)
+    sftp_fatal("%s failed with status %" PRIu32, what, status);
+  return type;
+}
+
+/** @brief Add a replay path to the request
+ * @param hash Hash of path
+ */
+static void send_path(uint32_t hash) {
+  char *name = sftp_xmalloc(strlen(directory) + 16);
+
+  sprintf(name, "%s/c%08" PRIx32, directory, hash);
+  sftp_send_string(&worker, name);
+  free(name);
+}
+
+/** @brief Add empty attributes to the request
+ * @param type File type
+ */
+static void send_attrs(uint8_t type) {
+  struct sftpattr attrs;
+
+  sftp_memset(&attrs, 0, sizeof attrs);
+  attrs.type = type;
+  protocol->sendattrs(&job, &attrs);
+}
+
+/** @brief Add a handle to the request
+ * @param h Handle
+ */
+static void send_handle(const struct replayhandle *h) {
+  sftp_send_bytes(&worker, h->data, h->len);
+}
+
+/** @brief Negotiate the protocol version */
+static void init(void) {
+  uint32_t v;
+
+  sftp_send_begin(&worker);
+  sftp_send_uint8(&worker, SSH_FXP_INIT);
+  sftp_send_uint32(&worker, version);
+  sftp_send_end(&worker);
+  if(getresponse() != SSH_FXP_VERSION || sftp_parse_uint32(&job, &v))
+    sftp_fatal("bad response to SSH_FXP_INIT");
+  switch(v) {
+  case 3:
+    protocol = &sftp_v3;
+    break;
+  case 4:
+    protocol = &sftp_v4;
+    break;
+  case 5:
+    protocol = &sftp_v5;
+    break;
+  case 6:
+    protocol = &sftp_v6;
+    break;
+  default:
+    sftp_fatal("server wanted protocol version %" PRIu32, v);
+  }
+  if(v != version)
+    sftp_fatal("capture used protocol version %" PRIu32 " but server wanted %"
+               PRIu32, version, v);
+}
+
+/** @brief Create a file or directory that the capture expects to exist
+ * @param p Path
+ */
+static void prepare(const struct pathinfo *p) {
+  struct replayhandle h;
+  uint32_t id;
+
+  sftp_send_begin(&worker);
+  if(p->state == path_dir) {
+    sftp_send_uint8(&worker, SSH_FXP_MKDIR);
+    sftp_send_uint32(&worker, id = newid());
+    send_path(p->hash);
+    send_attrs(SSH_FILEXFER_TYPE_DIRECTORY);
+    sftp_send_end(&worker);
+    /* It may already exist from an earlier replay */
+    getresponse();
+    return;
+  }
+  sftp_send_uint8(&worker, SSH_FXP_OPEN);
+  sftp_send_uint32(&worker, id = newid());
+  send_path(p->hash);
+  if(protocol->version >= 5) {
+    sftp_send_uint32(&worker, ACE4_WRITE_DATA);
+    sftp_send_uint32(&worker, SSH_FXF_CREATE_TRUNCATE);
+  } else
+    sftp_send_uint32(&worker, SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC);
+  send_attrs(SSH_FILEXFER_TYPE_REGULAR);
+  sftp_send_end(&worker);
+  if(waitresponse(id, "SSH_FXP_OPEN") != SSH_FXP_HANDLE)
+    sftp_fatal("unexpected response to SSH_FXP_OPEN");
+  if(sftp_parse_uint32(&job, &id) || id > sizeof h.data || id > job.left)
+    sftp_fatal("bad handle from server");
+  h.len = id;
+  memcpy(h.data, job.ptr, h.len);
+  if(p->size) {
+    /* A single byte at the end leaves the rest as a hole */
+    sftp_send_begin(&worker);
+    sftp_send_uint8(&worker, SSH_FXP_WRITE);
+    sftp_send_uint32(&worker, id = newid());
+    send_handle(&h);
+    sftp_send_uint64(&worker, p->size - 1);
+    sftp_send_bytes(&worker, "", 1);
+    sftp_send_end(&worker);
+    waitresponse(id, "SSH_FXP_WRITE");
+  }
+  sftp_send_begin(&worker);
+  sftp_send_uint8(&worker, SSH_FXP_CLOSE);
+  sftp_send_uint32(&worker, id = newid());
+  send_handle(&h);
+  sftp_send_end(&worker);
+  waitresponse(id, "SSH_FXP_CLOSE");
+}
+
+/* Replay */
+
+/** @brief Read and account for one response */
+static void receive(void) {
+  const uint8_t type = getresponse();
+  const struct request *q;
+  struct replayhandle *h;
+  uint32_t status = 0, len;
+  size_t n;
+
+  for(n = 0; n < ninflight && inflight[n].id != job.id; ++n)
+    ;
+  if(n == ninflight)
+    sftp_fatal("response with unexpected ID %" PRIu32, job.id);
+  q = &requests[inflight[n].request];
+  latency_add(&replayed[q->rec.type], now() - inflight[n].sent);
+  inflight[n] = inflight[--ninflight];
+  if(type == SSH_FXP_STATUS)
+    sftp_parse_uint32(&job, &status);
+  if(q->rtype
+     && (type != q->rtype || (type == SSH_FXP_STATUS && status != q->rlength)))
+    ++differed;
+  if((q->rec.type == SSH_FXP_OPEN || q->rec.type == SSH_FXP_OPENDIR)
+     && q->rtype == SSH_FXP_HANDLE) {
+    h = handle_find(q->rhandle);
+    if(h->state == handle_pending && h->id == job.id) {
+      if(type == SSH_FXP_HANDLE && !sftp_parse_uint32(&job, &len)
+         && len <= sizeof h->data && len <= job.left) {
+        h->len = len;
+        memcpy(h->data, job.ptr, len);
+        h->state = handle_open;
+      } else
+        h->state = handle_none;
+    }
+  }
+}
+
+/** @brief Wait until the time a request was received in the capture
+ * @param due When to send it
+ */
+static void wait_until(uint64_t due) {
+  struct pollfd pfd;
+  struct timespec ts;
+  uint64_t t;
+
+  while((t = now()) < due) {
+    if(ninflight) {
+      pfd.fd = sftpin;
+      pfd.events = POLLIN;
+      if(poll(&pfd, 1, (int)((due - t) / 1000000) + 1) > 0)
+        receive();
+    } else {
+      ts.tv_sec = (due - t) / 1000000000;
+      ts.tv_nsec = (due - t) % 1000000000;
+      nanosleep(&ts, NULL);
+    }
+  }
+}
+
+/** @brief Find the handle a request uses, waiting for it if necessary
+ * @param q Request
+ * @return Handle, or a null pointer if it is not open
+ */
+static struct replayhandle *request_handle(const struct request *q) {
+  struct replayhandle *h = handle_find(q->rec.handle);
+
+  while(h->state == handle_pending) {
+    receive();
+    h = handle_find(q->rec.handle);
+  }
+  return h->state == handle_open ? h : NULL;
+}
+
+/** @brief Replay one request
+ * @param n Index of request
+ * @return 0 if it was sent, -1 if it was skipped
+ */
+static int replay(size_t n) {
+  const struct request *q = &requests[n];
+  const struct capturerecord *r = &q->rec;
+  struct replayhandle *h = NULL;
+  uint32_t id;
+
+  switch(r->type) {
+  case SSH_FXP_CLOSE:
+  case SSH_FXP_READDIR:
+  case SSH_FXP_FSTAT:
+  case SSH_FXP_FSETSTAT:
+  case SSH_FXP_READ:
+  case SSH_FXP_WRITE:
+    if(!(h = request_handle(q)))
+      return -1;
+    break;
+  case SSH_FXP_OPEN:
+  case SSH_FXP_OPENDIR:
+  case SSH_FXP_REMOVE:
+  case SSH_FXP_RMDIR:
+  case SSH_FXP_REALPATH:
+  case SSH_FXP_READLINK:
+  case SSH_FXP_STAT:
+  case SSH_FXP_LSTAT:
+  case SSH_FXP_SETSTAT:
+  case SSH_FXP_MKDIR:
+  case SSH_FXP_RENAME:
+    break;
+  default:
+    /* Links need their targets and extensions their arguments, neither of
+     * which are captured */
+    return -1;
+  }
+  sftp_send_begin(&worker);
+  sftp_send_uint8(&worker, r->type);
+  sftp_send_uint32(&worker, id = newid());
+  switch(r->type) {
+  case SSH_FXP_OPEN:
+    send_path(r->path);
+    if(protocol->version >= 5) {
+      sftp_send_uint32(&worker, r->offset >> 32);
+      sftp_send_uint32(&worker, (uint32_t)r->offset);
+    } else
+      sftp_send_uint32(&worker, (uint32_t)r->offset);
+    send_attrs(SSH_FILEXFER_TYPE_REGULAR);
+    break;
+  case SSH_FXP_OPENDIR:
+  case SSH_FXP_REMOVE:
+  case SSH_FXP_RMDIR:
+  case SSH_FXP_REALPATH:
+  case SSH_FXP_READLINK:
+    send_path(r->path);
+    break;
+  case SSH_FXP_STAT:
+  case SSH_FXP_LSTAT:
+    send_path(r->path);
+    if(protocol->version >= 4)
+      sftp_send_uint32(&worker, (uint32_t)r->offset);
+    break;
+  case SSH_FXP_SETSTAT:
+    send_path(r->path);
+    send_attrs(SSH_FILEXFER_TYPE_REGULAR);
+    break;
+  case SSH_FXP_MKDIR:
+    send_path(r->path);
+    send_attrs(SSH_FILEXFER_TYPE_DIRECTORY);
+    break;
+  case SSH_FXP_RENAME:
+    send_path(r->path);
+    send_path(r->path2);
+    if(protocol->version >= 5)
+      sftp_send_uint32(&worker, (uint32_t)r->offset);
+    break;
+  case SSH_FXP_CLOSE:
+  case SSH_FXP_READDIR:
+    send_handle(h);
+    break;
+  case SSH_FXP_FSTAT:
+    send_handle(h);
+    if(protocol->version >= 4)
+      sftp_send_uint32(&worker, (uint32_t)r->offset);
+    break;
+  case SSH_FXP_FSETSTAT:
+    send_handle(h);
+    send_attrs(SSH_FILEXFER_TYPE_REGULAR);
+    break;
+  case SSH_FXP_READ:
+    send_handle(h);
+    sftp_send_uint64(&worker, r->offset);
+    sftp_send_uint32(&worker, r->length);
+    break;
+  case SSH_FXP_WRITE:
+    send_handle(h);
+    sftp_send_uint64(&worker, r->offset);
+    sftp_send_bytes(&worker, zeros, r->length);
+    break;
+  }
+  sftp_send_end(&worker);
+  if(ninflight >= inflightsize) {
+    inflightsize = inflightsize ? 2 * inflightsize : 64;
+    inflight = sftp_xrecalloc(inflight, inflightsize, sizeof *inflight);
+  }
+  inflight[ninflight].id = id;
+  inflight[ninflight].request = n;
+  inflight[ninflight].sent = now();
+  ++ninflight;
+  if(q->rtype)
+    latency_add(&captured[r->type], q->latency);
+  if((r->type == SSH_FXP_OPEN || r->type == SSH_FXP_OPENDIR)
+     && q->rtype == SSH_FXP_HANDLE) {
+    h = handle_find(q->rhandle);
+    h->state = handle_pending;
+    h->id = id;
+  } else if(r->type == SSH_FXP_CLOSE)
+    h->state = handle_none;
+  return 0;
+}
+
+/** @brief Report latencies */
+static void report(void) {
+  struct latencies *l, *c;
+  const char *name;
+  uint64_t total;
+  size_t n, i;
+
+  for(n = 0; n < 256; ++n) {
+    l = &replayed[n];
+    c = &captured[n];
+    if(!l->n)
+      continue;
+    qsort(l->v, l->n, sizeof *l->v, latency_compare);
+    for(total = 0, i = 0; i < l->n; ++i)
+      total += l->v[i];
+    name = sftp_trace_type_name(n);
+    printf("replay request=%s count=%zu mean_us=%" PRIu64 " p50_us=%" PRIu64
+           " p90_us=%" PRIu64 " p99_us=%" PRIu64 " max_us=%" PRIu64,
+           name ? name : "unknown", l->n, total / l->n / 1000,
+           percentile(l, 500), percentile(l, 900), percentile(l, 990),
+           l->v[l->n - 1] / 1000);
+    if(c->n) {
+      qsort(c->v, c->n, sizeof *c->v, latency_compare);
+      printf(" capture_p50_us=%" PRIu64 " capture_p99_us=%" PRIu64,
+             percentile(c, 500), percentile(c, 990));
+    }
+    putchar('\n');
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *program = NULL, *program_config = NULL;
+  const char *cmdline[8];
+  int n, ncmdline = 0, ip[2], op[2];
+  uint32_t maxwrite = 0;
+  uint64_t started, first;
+  size_t i;
+
+  while((n = getopt_long(argc, argv, "hVP:C:d:s:", options, 0)) >= 0) {
+    switch(n) {
+    case 'h':
+      help();
+    case 'V':
+      version_info();
+    case 'P':
+      program = optarg;
+      break;
+    case 'C':
+      program_config = optarg;
+      break;
+    case 'd':
+      directory = optarg;
+      break;
+    case 's':
+      if(!strcmp(optarg, "original"))
+        original_speed = 1;
+      else if(!strcmp(optarg, "max"))
+        original_speed = 0;
+      else
+        sftp_fatal("invalid --speed argument '%s'", optarg);
+      break;
+    default:
+      exit(1);
+    }
+  }
+  if(!program)
+    sftp_fatal("--program is required");
+  if(optind + 1 != argc)
+    sftp_fatal("expected one capture file");
+  load(argv[optind]);
+  analyse();
+  for(i = 0; i < nrequests; ++i)
+    if(requests[i].rec.type == SSH_FXP_WRITE && requests[i].rec.length > maxwrite)
+      maxwrite = requests[i].rec.length;
+  zeros = sftp_xcalloc(maxwrite + 1, 1);
+
+  /* Start the server */
+  cmdline[ncmdline++] = program;
+  if(program_config) {
+    cmdline[ncmdline++] = "-C";
+    cmdline[ncmdline++] = program_config;
+  }
+  cmdline[ncmdline] = 0;
+  sftp_xpipe(ip);
+  sftp_xpipe(op);
+  if(!sftp_xfork()) {
+    sftp_xclose(ip[0]);
+    sftp_xclose(op[1]);
+    sftp_xdup2(ip[1], 1);
+    sftp_xdup2(op[0], 0);
+    execvp(cmdline[0], (void *)cmdline);
+    sftp_fatal("executing %s: %s", cmdline[0], strerror(errno));
+  }
+  sftp_xclose(ip[1]);
+  sftp_xclose(op[0]);
+  sftpin = ip[0];
+  sftpout = op[1];
+  job.a = sftp_alloc_init(&allocator);
+  job.worker = &worker;
+
+  init();
+  for(i = 0; i < pathslots; ++i)
+    if(paths[i].state == path_file || paths[i].state == path_dir)
+      prepare(&paths[i]);
+  started = now();
+  first = nrequests ? requests[0].rec.when : 0;
+  for(i = 0; i < nrequests; ++i) {
+    if(original_speed)
+      wait_until(started + (requests[i].rec.when - first));
+    /* Keep no more outstanding than the client did */
+    while(ninflight > requests[i].window)
+      receive();
+    if(replay(i))
+      ++skipped;
+  }
+  while(ninflight)
+    receive();
+  printf("replayed %zu requests in %.3fs, %zu skipped, %zu responses differ"
+         " from the capture\n",
+         nrequests - skipped, (now() - started) / 1e9, skipped, differed);
+  report();
+  return 0;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
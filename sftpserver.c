@@ -32,7 +32,25 @@
 #include "types.h"
 #include "globals.h"
 #include "serialize.h"
+#include "handle.h"
+#include "statbatch.h"
+#include "statcache.h"
+#include "checkfile.h"
+#include "uring.h"
+#include "input.h"
+#include "pool.h"
+#include "affinity.h"
+#include "users.h"
 #include "xfns.h"
+#include "charset.h"
+#include "stats.h"
+#include "sync.h"
+#include "trace.h"
+#include "capture.h"
+#include "probes.h"
+#include "session.h"
+#include "dirfetch.h"
+#include "watch.h"
 #include <assert.h>
 #include <arpa/inet.h>
 #include <string.h>
@@ -51,6 +69,10 @@
 #include <stdio.h>
 #include <syslog.h>
 #include <netinet/in.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <time.h>
 #if HAVE_SYS_PRCTL_H
 #  include <sys/prctl.h>
 #endif
@@ -68,18 +90,29 @@ int daemon(int, int);
 /* Forward declarations */
 
 static void *worker_init(void);
+static void *worker_thread_init(void);
 static void worker_cleanup(void *wdv);
 static void process_sftpjob(void *jv, void *wdv, struct allocator *a);
-static void sftp_service(void);
+static void sftp_service(void *wdv);
+#if DAEMON
+static void multiplex(int listenfd, int limit);
+#endif
 
 /** @brief Local character encoding */
 static const char *local_encoding;
 
 /** @brief Queue-specific callbacks for processing SFTP requests */
 static const struct queuedetails workqueue_details = {
-    worker_init, process_sftpjob, worker_cleanup};
+    worker_thread_init, process_sftpjob, worker_cleanup};
 
-const struct sftpprotocol *protocol = &sftp_preinit;
+/** @brief Create the work queue */
+static void workqueue_start(void) {
+  queue_init(&workqueue, &workqueue_details, sftpconf_nthreads,
+             sftpconf_min_threads, sftpconf_max_threads, sftpconf_queue);
+  queue_flow_limit(workqueue, sftpconf_handle_threads);
+}
+
+THREAD_LOCAL const struct sftpprotocol *protocol = &sftp_preinit;
 const char sendtype[] = "response";
 
 /* Options */
@@ -152,21 +185,22 @@ static uint32_t sftp_init(struct sftpjob *job) {
   case 2:
     return SSH_FX_OP_UNSUPPORTED;
   case 3:
-    protocol = &sftp_v3;
+    sftp_session_protocol(&sftp_v3);
 #if REVERSE_SYMLINK
     reverse_symlink = 1;
 #endif
     break;
   case 4:
-    protocol = &sftp_v4;
+    sftp_session_protocol(&sftp_v4);
     break;
   case 5:
-    protocol = &sftp_v5;
+    sftp_session_protocol(&sftp_v5);
     break;
   default:
-    protocol = &sftp_v6;
+    sftp_session_protocol(&sftp_v6);
     break;
   }
+  sftp_extensions_index(protocol);
   sftp_send_begin(job->worker);
   sftp_send_uint8(job->worker, SSH_FXP_VERSION);
   sftp_send_uint32(job->worker, protocol->version);
@@ -269,18 +303,25 @@ static uint32_t sftp_init(struct sftpjob *job) {
     sftp_send_string(job->worker, "linkpath-targetpath");
   }
   sftp_send_end(job->worker);
-  if(protocol->version < 6) {
-    /* Now we are initialized we can safely process other jobs in the
-     * background.  We can't do this for v6 because the first request might be
-     * version-select. */
-    D(("normal work queue creation"));
-    queue_init(&workqueue, &workqueue_details, sftpconf_nthreads);
+  if(protocol->version >= 6)
+    sftp_session->selectable = 1;
+  if(!workqueue) {
+    /* Nothing else needs the output thread or the workers until the client
+     * has seen the version, so they are started only now.  Even for v6 it is
+     * safe to process other jobs in the background: version-select is not a
+     * read or write, so it runs alone and later requests see its effect when
+     * they re-read the protocol after serializing. */
+    D(("work queue creation"));
+    sftp_send_output_start(sftpconf_output_batch);
+    workqueue_start();
   }
   return HANDLER_RESPONDED;
 }
 
 /** @brief Requests supported prior to initialization */
-static const struct sftpcmd sftppreinittab[] = {{SSH_FXP_INIT, sftp_init}};
+static const struct sftpcmd sftppreinittab[] = {
+    SFTPCMD(SSH_FXP_INIT, sftp_init),
+};
 
 /** @brief Protocol supported prior to initialization
  *
@@ -297,6 +338,7 @@ const struct sftpprotocol sftp_preinit = {sizeof sftppreinittab /
                                           sftp_v3_encode,
                                           0,
                                           0,
+                                          0,
                                           0};
 
 /* Worker setup/teardown */
@@ -309,23 +351,29 @@ static void *worker_init(void) {
 
   sftp_memset(w, 0, sizeof *w);
   w->buffer = 0;
-  if((w->utf8_to_local = iconv_open(local_encoding, "UTF-8")) == (iconv_t)-1)
-    sftp_fatal("error calling iconv_open(%s,UTF-8): %s", local_encoding,
-               strerror(errno));
-  if((w->local_to_utf8 = iconv_open("UTF-8", local_encoding)) == (iconv_t)-1)
-    sftp_fatal("error calling iconv_open(UTF-8,%s): %s", local_encoding,
-               strerror(errno));
+  sftp_charset_init_worker(w);
   return w;
 }
 
+/** @brief Worker state setup in a worker thread
+ * @return Initialized worker state
+ *
+ * The thread is placed on its CPUs first, so that its state is allocated
+ * nearby.
+ */
+static void *worker_thread_init(void) {
+  sftp_affinity_apply(affinity_workers);
+  return worker_init();
+}
+
 /** @brief Worker thread cleanup after processing SFTP requests
  * @param wdv Worker state created by worker_init()
  */
 static void worker_cleanup(void *wdv) {
   struct worker *w = wdv;
 
-  iconv_close(w->utf8_to_local);
-  iconv_close(w->local_to_utf8);
+  sftp_trace_release(w);
+  sftp_charset_cleanup_worker(w);
   free(w->buffer);
   free(w);
 }
@@ -341,9 +389,13 @@ static void worker_cleanup(void *wdv) {
  * completing. */
 static void process_sftpjob(void *jv, void *wdv, struct allocator *a) {
   struct sftpjob *const job = jv;
-  int l, r, type = 0;
+  int type = 0;
   uint32_t status, rc;
+  uint64_t started;
 
+  sftp_session_enter(job->session);
+  sftp_stats_wait(stats_wait_queue, job->queued);
+  SFTP_PROBE(request_dequeued, job->data, job->len, job->len);
   job->a = a;
   job->id = 0;
   job->worker = wdv;
@@ -363,46 +415,54 @@ static void process_sftpjob(void *jv, void *wdv, struct allocator *a) {
       sftp_send_status(job, rc, "missing ID field");
       goto done;
     }
-  /* Locate the handler for the command */
-  l = 0;
-  r = protocol->ncommands - 1;
-  while(l <= r) {
-    const int m = (l + r) / 2;
-    const int mtype = protocol->commands[m].type;
-
-    if(type < mtype)
-      r = m - 1;
-    else if(type > mtype)
-      l = m + 1;
-    else {
-      /* Serialize */
-      serialize(job);
-      /* Run the handler */
-      status = protocol->commands[m].handler(job);
-      /* Send a response if necessary */
-      switch(status) {
-      case HANDLER_RESPONDED:
-        break;
-      default:
-        sftp_send_status(job, status, 0);
-        break;
-      }
-      goto done;
+  /* Locate the handler for the command.  The table is indexed by type, with
+   * null handlers for unsupported types. */
+  if(type < protocol->ncommands && protocol->commands[type].handler) {
+    /* Serialize */
+    started = sftp_stats_now();
+    SFTP_PROBE(serialize_start, job->data, job->len, job->len);
+    serialize(job);
+    SFTP_PROBE(serialize_done, job->data, job->len, job->len);
+    /* The protocol may have changed while we waited */
+    sftp_session_enter(job->session);
+    sftp_stats_wait(stats_wait_serialize, started);
+    /* Anything but a read or write runs alone, and must see the effects of
+     * all earlier writes */
+    if(type != SSH_FXP_READ && type != SSH_FXP_WRITE)
+      sftp_handle_flush_all();
+    /* Run the handler */
+    started = sftp_stats_now();
+    SFTP_PROBE(handler_start, job->data, job->len, job->len);
+    status = protocol->commands[type].handler(job);
+    /* Anything the handler changed is done with */
+    sftp_statcache_settle();
+    /* Asynchronous requests are only timed as far as submission */
+    sftp_stats_request(type, started);
+    /* Send a response if necessary */
+    switch(status) {
+    case HANDLER_ASYNC:
+      /* Someone else will send the response and free the job, so it may
+       * already be gone */
+      return;
+    case HANDLER_RESPONDED:
+      SFTP_PROBE(handler_done, job->data, job->len, job->len);
+      break;
+    default:
+      SFTP_PROBE(handler_done, job->data, job->len, job->len);
+      sftp_send_status(job, status, 0);
+      break;
     }
+    goto done;
   }
   /* We did not find a handler */
   sftp_send_status(job, SSH_FX_OP_UNSUPPORTED, 0);
 done:
+  /* Asynchronous requests need a handle, so can never be the first after
+   * initialization */
+  if(type != SSH_FXP_INIT)
+    sftp_session->selectable = 0;
   serialize_remove_job(job);
-  free(job->data);
-  free(job);
-  if(type != SSH_FXP_INIT && workqueue == 0) {
-    /* This must have been the first job after initializing to version 6.  It
-     * might or might not have been version-select but either way it's now safe
-     * to go multithreaded. */
-    D(("late work queue creation"));
-    queue_init(&workqueue, &workqueue_details, sftpconf_nthreads);
-  }
+  sftp_input_free(job);
   return;
 }
 
@@ -415,6 +475,271 @@ static void sigchld_handler(int attribute((unused)) sig) {
     ;
   errno = save_errno;
 }
+
+/** @brief Create a listening socket
+ * @param res Address to bind to
+ * @return Socket
+ */
+static int listen_socket(const struct addrinfo *res) {
+  int fd;
+  static const int one = 1;
+
+  if((fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0)
+    sftp_fatal("error calling socket: %s", strerror(errno));
+  if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) < 0)
+    sftp_fatal("error calling setsockopt: %s", strerror(errno));
+  if(sftpconf_reuse_port) {
+#  ifdef SO_REUSEPORT
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) < 0)
+      sftp_fatal("error calling setsockopt: %s", strerror(errno));
+#  else
+    sftp_fatal("reuse-port is not supported on this platform");
+#  endif
+  }
+  if(bind(fd, res->ai_addr, res->ai_addrlen) < 0)
+    sftp_fatal("error calling bind: %s", strerror(errno));
+  if(listen(fd, SOMAXCONN) < 0)
+    sftp_fatal("error calling listen: %s", strerror(errno));
+  return fd;
+}
+
+/** @brief Prepare for another session in the same process
+ *
+ * Everything sftp_service() leaves behind that would be visible to the next
+ * client is put back the way it was at startup.
+ */
+static void session_reset(void) {
+  workqueue = 0;
+  sftp_realpath_invalidate();
+  /* Make sure the client sees EOF now rather than when the next connection
+   * replaces FDs 0 and 1 */
+  shutdown(0, SHUT_RDWR);
+}
+
+/** @brief Body of a preforked server process
+ * @param listenfd Socket to accept connections on
+ *
+ * Serves up to @ref sftpconf_prefork_sessions sessions and then exits.  They
+ * are served one at a time unless @ref sftpconf_multiplex is set.
+ */
+static void attribute((noreturn)) prefork_child(int listenfd) {
+  void *wdv;
+  int sessions = 0, fd;
+
+  if(sftpconf_multiplex) {
+    multiplex(listenfd, sftpconf_prefork_sessions);
+    _exit(0);
+  }
+  wdv = worker_init();
+  while(!sftpconf_prefork_sessions || sessions < sftpconf_prefork_sessions) {
+    if((fd = accept(listenfd, 0, 0)) < 0) {
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+      sftp_fatal("accept: %s", strerror(errno));
+    }
+    if(dup2(fd, 0) < 0 || dup2(fd, 1) < 0)
+      sftp_fatal("dup2: %s", strerror(errno));
+    if(fd > 1 && close(fd) < 0)
+      sftp_fatal("close: %s", strerror(errno));
+    sftp_service(wdv);
+    session_reset();
+    ++sessions;
+  }
+  worker_cleanup(wdv);
+  _exit(0);
+}
+
+/** @brief Set when the preforking parent is asked to terminate */
+static volatile sig_atomic_t prefork_terminate;
+
+/** @brief SIGTERM handler for the preforking parent
+ * @param sig Signal number
+ */
+static void prefork_term_handler(int sig) { prefork_terminate = sig; }
+
+/** @brief SIGALRM handler for the preforking parent
+ * @param sig Signal number
+ *
+ * Does nothing; the signal only interrupts wait() so that delayed processes
+ * can be started.
+ */
+static void prefork_alarm_handler(int attribute((unused)) sig) {}
+
+/** @brief One process in the prefork pool */
+struct preforkslot {
+  /** @brief Process ID, or 0 if not running */
+  pid_t pid;
+
+  /** @brief When the process was started */
+  time_t started;
+
+  /** @brief Earliest time to start a replacement */
+  time_t restart;
+
+  /** @brief Seconds to wait before the next replacement, or 0 */
+  unsigned delay;
+};
+
+/** @brief Log a message from the preforking parent
+ * @param pri Syslog priority
+ * @param msg Format string
+ *
+ * Goes to syslog when running as a daemon, otherwise to standard error.
+ */
+static void prefork_log(int pri, const char *msg, ...)
+    attribute((format(printf, 2, 3)));
+
+static void prefork_log(int pri, const char *msg, ...) {
+  va_list ap;
+
+  va_start(ap, msg);
+  if(sftp_log_syslog)
+    vsyslog(pri, msg, ap);
+  else {
+    vfprintf(stderr, msg, ap);
+    fputc('\n', stderr);
+  }
+  va_end(ap);
+}
+
+/** @brief Return the time in seconds for the prefork pool
+ * @return Seconds since an arbitrary epoch
+ */
+static time_t prefork_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/** @brief Delay the replacement of a failing process
+ * @param s Pool slot
+ * @param now Current time
+ *
+ * The delay starts at a second and doubles with each consecutive failure, up
+ * to @ref PREFORKMAXDELAY, so that a process that cannot start (for instance
+ * because of a broken configuration or an exhausted resource) is not forked
+ * again as fast as the system allows.
+ */
+static void prefork_backoff(struct preforkslot *s, time_t now) {
+  if(!s->delay)
+    s->delay = 1;
+  else if((s->delay *= 2) > PREFORKMAXDELAY)
+    s->delay = PREFORKMAXDELAY;
+  s->restart = now + s->delay;
+}
+
+/** @brief Run a pool of preforked server processes
+ * @param listenfds Listening sockets
+ * @param nlisteners Number of listening sockets
+ *
+ * Process @c n accepts on @c listenfds[n % nlisteners].  Processes that exit
+ * are replaced, after a delay if they failed within @ref PREFORKMINLIFE
+ * seconds of starting.  On SIGTERM or SIGINT the pool is terminated too.
+ */
+static void attribute((noreturn)) prefork_pool(const int *listenfds,
+                                               int nlisteners) {
+  struct preforkslot *slots = sftp_xcalloc(sftpconf_prefork, sizeof *slots);
+  struct preforkslot *s;
+  pid_t pid;
+  int n, l, w, live;
+  time_t now, wake;
+  struct sigaction sa;
+
+  /* We reap our own children */
+  signal(SIGCHLD, SIG_DFL);
+  sa.sa_handler = prefork_term_handler;
+  sa.sa_flags = 0; /* so that wait() is interrupted */
+  sigemptyset(&sa.sa_mask);
+  if(sigaction(SIGTERM, &sa, 0) < 0 || sigaction(SIGINT, &sa, 0) < 0)
+    sftp_fatal("error calling sigaction: %s", strerror(errno));
+  sa.sa_handler = prefork_alarm_handler;
+  if(sigaction(SIGALRM, &sa, 0) < 0)
+    sftp_fatal("error calling sigaction: %s", strerror(errno));
+  while(!prefork_terminate) {
+    now = prefork_now();
+    wake = 0;
+    live = 0;
+    for(n = 0; n < sftpconf_prefork; ++n) {
+      s = &slots[n];
+      if(s->pid) {
+        ++live;
+        continue;
+      }
+      if(s->restart <= now) {
+        switch(pid = fork()) {
+        case -1:
+          prefork_log(LOG_ERR, "fork: %s", strerror(errno));
+          prefork_backoff(s, now);
+          break;
+        case 0:
+          sftp_forked();
+          signal(SIGTERM, SIG_DFL);
+          signal(SIGINT, SIG_DFL);
+          signal(SIGALRM, SIG_DFL);
+          for(l = 0; l < nlisteners; ++l)
+            if(l != n % nlisteners && close(listenfds[l]) < 0)
+              sftp_fatal("close: %s", strerror(errno));
+          prefork_child(listenfds[n % nlisteners]);
+        default:
+          s->pid = pid;
+          s->started = now;
+          ++live;
+          continue;
+        }
+      }
+      if(!wake || s->restart < wake)
+        wake = s->restart;
+    }
+    if(!live) {
+      /* Nothing to wait for until the next replacement is due */
+      sleep((unsigned)(wake - now));
+      continue;
+    }
+    if(wake)
+      alarm((unsigned)(wake - now));
+    pid = wait(&w);
+    if(wake)
+      alarm(0);
+    if(pid < 0) {
+      if(errno != EINTR)
+        sftp_fatal("wait: %s", strerror(errno));
+      continue;
+    }
+    now = prefork_now();
+    for(n = 0; n < sftpconf_prefork; ++n) {
+      s = &slots[n];
+      if(s->pid != pid)
+        continue;
+      s->pid = 0;
+      if(WIFEXITED(w) && !WEXITSTATUS(w)) {
+        /* Served its quota of sessions */
+        s->delay = 0;
+        s->restart = now;
+        break;
+      }
+      if(WIFSIGNALED(w))
+        prefork_log(LOG_ERR, "process %ld terminated by signal %d",
+                    (long)pid, WTERMSIG(w));
+      else
+        prefork_log(LOG_ERR, "process %ld exited with status %d", (long)pid,
+                    WEXITSTATUS(w));
+      if(now - s->started < PREFORKMINLIFE) {
+        prefork_backoff(s, now);
+        prefork_log(LOG_ERR, "replacing process %ld in %u seconds",
+                    (long)pid, s->delay);
+      } else {
+        s->delay = 0;
+        s->restart = now;
+      }
+      break;
+    }
+  }
+  for(n = 0; n < sftpconf_prefork; ++n)
+    if(slots[n].pid)
+      kill(slots[n].pid, SIGTERM);
+  exit(0);
+}
 #endif
 
 int main(int argc, char **argv) {
@@ -423,7 +748,7 @@ int main(int argc, char **argv) {
   const char *config = ETCDIR "/gesftpserver.conf";
 #if DAEMON
   iconv_t cd;
-  int listenfd = -1;
+  int listenfd = -1, *listenfds = 0, nlisteners = 0;
   const char *root = 0, *user = 0;
   struct passwd *pw = 0;
   const char *host = 0, *port = 0;
@@ -455,6 +780,7 @@ int main(int argc, char **argv) {
   /* We need I18N support for filename encoding */
   setlocale(LC_CTYPE, "");
   local_encoding = nl_langinfo(CODESET);
+  sftp_charset_init(local_encoding);
 
   while((n = getopt_long(argc, argv, "hVdD:r:u:H:L:b46RC:", options, 0)) >= 0) {
     switch(n) {
@@ -544,7 +870,6 @@ int main(int argc, char **argv) {
   if(port) {
     struct addrinfo *res;
     int rc;
-    static const int one = 1;
     struct sigaction sa;
 
     sa.sa_handler = sigchld_handler;
@@ -559,26 +884,30 @@ int main(int argc, char **argv) {
       else
         sftp_fatal("error resolving port %s: %s", port, gai_strerror(rc));
     }
-    if((listenfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) <
-       0)
-      sftp_fatal("error calling socket: %s", strerror(errno));
-    if(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) < 0)
-      sftp_fatal("error calling setsockopt: %s", strerror(errno));
-    if(bind(listenfd, res->ai_addr, res->ai_addrlen) < 0)
-      sftp_fatal("error calling socket: %s", strerror(errno));
-    if(listen(listenfd, SOMAXCONN) < 0)
-      sftp_fatal("error calling listen: %s", strerror(errno));
+    /* With reuse-port, each preforked process gets a socket of its own.  They
+     * must all be bound now, while we still have the privilege to do so. */
+    nlisteners =
+        sftpconf_prefork && sftpconf_reuse_port ? sftpconf_prefork : 1;
+    listenfds = sftp_xcalloc(nlisteners, sizeof *listenfds);
+    for(n = 0; n < nlisteners; ++n)
+      listenfds[n] = listen_socket(res);
+    listenfd = listenfds[0];
+    freeaddrinfo(res);
   } else if(host)
     sftp_fatal("--host makes no sense without --port");
 
-  if((cd = iconv_open(local_encoding, "UTF-8")) == (iconv_t)-1)
-    sftp_fatal("error calling iconv_open(%s,UTF-8): %s", local_encoding,
-               strerror(errno));
-  iconv_close(cd);
-  if((cd = iconv_open("UTF-8", local_encoding)) == (iconv_t)-1)
-    sftp_fatal("error calling iconv_open(UTF-8, %s): %s", local_encoding,
-               strerror(errno));
-  iconv_close(cd);
+  if(root) {
+    /* Make sure the conversion modules are loaded while they are still
+     * reachable; workers open their descriptors after the chroot */
+    if((cd = iconv_open(local_encoding, "UTF-8")) == (iconv_t)-1)
+      sftp_fatal("error calling iconv_open(%s,UTF-8): %s", local_encoding,
+                 strerror(errno));
+    iconv_close(cd);
+    if((cd = iconv_open("UTF-8", local_encoding)) == (iconv_t)-1)
+      sftp_fatal("error calling iconv_open(UTF-8, %s): %s", local_encoding,
+                 strerror(errno));
+    iconv_close(cd);
+  }
 
   if(root) {
     /* Enter our chroot */
@@ -607,7 +936,15 @@ int main(int argc, char **argv) {
   }
 
   if(!port) {
-    sftp_service();
+    void *const wdv = worker_init();
+
+    sftp_service(wdv);
+    worker_cleanup(wdv);
+    return 0;
+  } else if(sftpconf_prefork) {
+    prefork_pool(listenfds, nlisteners);
+  } else if(sftpconf_multiplex) {
+    multiplex(listenfd, 0);
     return 0;
   } else {
     for(;;) {
@@ -634,7 +971,7 @@ int main(int argc, char **argv) {
             sftp_fatal("dup2: %s", strerror(errno));
           if(close(fd) < 0 || close(listenfd) < 0)
             sftp_fatal("close: %s", strerror(errno));
-          sftp_service();
+          sftp_service(worker_init());
           _exit(0);
         default:
           close(fd);
@@ -644,55 +981,311 @@ int main(int argc, char **argv) {
     }
   }
 #else
-  sftp_service();
-  return 0;
+  {
+    void *const wdv = worker_init();
+
+    sftp_service(wdv);
+    worker_cleanup(wdv);
+    return 0;
+  }
 #endif
 }
 
+/** @brief Start process-wide services */
+static void service_start(void) {
+  D(("gesftpserver %s starting up", VERSION));
+  /* Everything started from here inherits this placement unless it has one
+   * of its own */
+  sftp_affinity_apply(affinity_reader);
+  /* draft -13 s7.6 "The server SHOULD NOT apply a 'umask' to the mode
+   * bits". */
+  umask(0);
+  sftp_stats_start();
+  sftp_trace_start();
+  sftp_capture_start();
+  sftp_send_pool_start(sftpconf_max_read + SENDSLACK, sftpconf_send_pool,
+                       sftpconf_send_pool_idle, sftpconf_huge_pages);
+  if(sftpconf_zerocopy && !sftp_send_zerocopy_init())
+    D(("zero-copy reads not available"));
+  sftp_realpath_cache_init(sftpconf_realpath_cache_ttl);
+  sftp_statcache_init(sftpconf_stat_cache_ttl);
+  sftp_statbatch_start(sftpconf_stat_threads);
+  sftp_checkfile_start(sftpconf_hash_threads);
+  sftp_sync_start(worker_init, worker_cleanup);
+  sftp_watch_start(worker_init, worker_cleanup);
+  if(sftpconf_uring && sftp_uring_start(worker_init, worker_cleanup))
+    D(("io_uring not available"));
+}
+
+/** @brief Stop process-wide services
+ *
+ * The work queue is destroyed first, so every request has been answered
+ * before anything else stops.
+ */
+static void service_stop(void) {
+  queue_destroy(workqueue);
+  sftp_dirfetch_stop();
+  sftp_watch_stop();
+  sftp_uring_stop();
+  sftp_sync_stop();
+  sftp_send_output_stop();
+  sftp_send_pool_stop();
+  sftp_statbatch_stop();
+  sftp_checkfile_stop();
+  sftp_trace_stop();
+  sftp_capture_stop();
+  sftp_stats_stop();
+  if(sftp_debugging) {
+    struct poolstats ps[8];
+    const size_t max = sizeof ps / sizeof *ps;
+    size_t n, nclasses = sftp_pool_stats(ps, max);
+    unsigned long hits, misses;
+
+    for(n = 0; n < nclasses && n < max; ++n)
+      D(("pool class %zu: %lu hits %lu misses %lu overflows", ps[n].size,
+         ps[n].hits, ps[n].misses, ps[n].overflows));
+    sftp_user_cache_stats(&hits, &misses);
+    D(("user cache: %lu hits %lu misses", hits, misses));
+  }
+}
+
+/** @brief Hand a newly read request on for processing
+ * @param job Job
+ * @param wdv Worker state for the calling thread, from worker_init()
+ * @param a Allocator to use if the job is processed immediately
+ */
+static void dispatch(struct sftpjob *job, void *wdv, struct allocator *a) {
+  int query;
+
+  if(sftp_capturing)
+    sftp_capture_request(job);
+  if(sftp_trace_enabled)
+    sftp_trace(wdv, trace_request, job->data, job->len, job->len);
+  else if(sftp_debugging) {
+    D(("request:"));
+    sftp_debug_hexdump(job->data, job->len);
+  }
+  SFTP_PROBE(request_framed, job->data, job->len, job->len);
+  /* See serialize.c for the serialization rules we follow */
+  query = queue_serializable_job(job);
+  /* We process the job in a background thread, except that the background
+   * threads don't exist until SSH_FXP_INIT has succeeded.  Queries get
+   * their own thread so that they don't wait behind bulk transfers, and a
+   * fair queue shares the rest out between handles.  Since writes wait for
+   * older queries, a fair queue doesn't start reads or writes queued after
+   * a query until every older one has started; see queue.c. */
+  if(workqueue) {
+    job->queued = sftp_stats_now();
+    SFTP_PROBE(request_queued, job->data, job->len, job->len);
+    if(query)
+      queue_add_urgent(workqueue, job);
+    else
+      queue_add_keyed(workqueue, job, serialize_key(job));
+    return;
+  }
+  job->queued = 0;
+  process_sftpjob(job, wdv, a);
+  sftp_alloc_reset(a);
+  /* process_sftpjob() frees JOB when it has finished with it */
+}
+
 /** @brief Process SFTP requests
+ * @param wdv Worker state for the calling thread, from worker_init()
  *
  * Requests are always read from FD 0 and responses written to FD 1.
  */
-static void sftp_service(void) {
-  uint32_t len;
+static void sftp_service(void *wdv) {
   struct sftpjob *job;
   struct allocator a;
+  struct session s;
+
+  service_start();
+  sftp_alloc_init(&a);
+  sftp_session_init(&s, 0, 1, 0);
+  s.protocol = &sftp_preinit;
+  sftp_session_enter(&s);
+  while(sftp_state_get() != sftp_state_stop && (job = sftp_input_job(&s.in)))
+    dispatch(job, wdv, &a);
+  sftp_alloc_destroy(&a);
+  service_stop();
+  sftp_session_destroy(&s);
+}
+
+#if DAEMON
+/** @brief Start a new session in the event loop
+ * @param fd Connected socket
+ * @param wakefd Writable end of the wakeup pipe
+ * @return New session
+ */
+static struct session *multiplex_session(int fd, int wakefd) {
+  struct session *s = sftp_xmalloc(sizeof *s);
+
+  sftp_session_init(s, fd, fd, 1);
+  s->in.wakefd = wakefd;
+  s->protocol = &sftp_preinit;
+  return s;
+}
+
+/** @brief Frame and dispatch whatever requests a session has buffered
+ * @param s Session
+ * @param wdv Worker state for the calling thread, from worker_init()
+ */
+static void multiplex_requests(struct session *s, void *wdv) {
+  struct sftpjob *job;
+  int rc = 1;
+
+  sftp_session_enter(s);
+  while(sftp_state_get() != sftp_state_stop
+        && !(rc = sftp_input_next(&s->in, &job)))
+    dispatch(job, wdv, 0);
+  if(sftp_state_get() == sftp_state_stop)
+    s->ending = 1;
+  else if(rc < 0) {
+    D(("invalid request size"));
+    s->ending = 1;
+  } else if(rc == 2)
+    s->stalled = 1;
+  else {
+    s->stalled = 0;
+    /* Requests already read are answered even after EOF */
+    if(s->eof)
+      s->ending = 1;
+  }
+}
+
+/** @brief Serve many sessions from this process
+ * @param listenfd Socket to accept connections on
+ * @param limit Number of sessions to accept before exiting, or 0
+ *
+ * Up to @ref sftpconf_multiplex sessions are served at once.  A single
+ * thread reads and frames requests for all of them, which then share the
+ * work queue.  A session that runs out of in-flight budget is not read from
+ * until the wakeup pipe says that one of its requests has been freed.
+ *
+ * Workers never block writing to a client.  Responses that a client is not
+ * ready for are kept in its session's backlog, which this thread sends as the
+ * socket becomes writable; a session with @ref OUTPUTLIMIT bytes held back is
+ * not read from until the client catches up.  So a client that stops reading
+ * only holds up itself.
+ *
+ * A session that ends is not destroyed until its last request has been freed
+ * and its last response sent.
+ */
+static void multiplex(int listenfd, int limit) {
   void *const wdv = worker_init();
-  D(("gesftpserver %s starting up", VERSION));
-  /* draft -13 s7.6 "The server SHOULD NOT apply a 'umask' to the mode
-   * bits". */
-  umask(0);
-  while(sftp_state_get() != sftp_state_stop &&
-        !sftp_xread(0, &len, sizeof len)) {
-    job = sftp_xmalloc(sizeof *job);
-    job->len = ntohl(len);
-    if(!job->len || job->len > MAXREQUEST)
-      sftp_fatal("invalid request size");
-    job->data = sftp_xmalloc(job->len);
-    if(sftp_xread(0, job->data, job->len))
-      /* Job data missing or truncated - the other end is not playing the game
-       * fair so we give up straight away */
-      sftp_fatal("read error: unexpected eof");
-    if(sftp_debugging) {
-      D(("request:"));
-      sftp_debug_hexdump(job->data, job->len);
+  struct session *sessions = 0, *s, **sp;
+  struct pollfd *fds = sftp_xcalloc(sftpconf_multiplex + 2, sizeof *fds);
+  struct session **polled =
+      sftp_xcalloc(sftpconf_multiplex + 2, sizeof *polled);
+  int wake[2], nsessions = 0, accepted = 0, nfds, n, fd;
+  size_t backlog;
+  short events;
+  char buffer[64];
+
+  /* These all assume a single client on FD 1, or a single request stream */
+  sftpconf_output_batch = 0;
+  sftpconf_zerocopy = 0;
+  sftpconf_uring = 0;
+  sftpconf_capture = 0;
+  /* Responses may be copied into a backlog, and copying from a mapping of a
+   * file that has since been truncated would fault */
+  sftpconf_mmap_read = 0;
+  service_start();
+  /* Sessions are initialized independently, so the work queue can exist
+   * from the start; see sftp_v6_version_select() */
+  workqueue_start();
+  if(pipe(wake) < 0)
+    sftp_fatal("error calling pipe: %s", strerror(errno));
+  if(fcntl(wake[0], F_SETFL, O_NONBLOCK) < 0
+     || fcntl(wake[1], F_SETFL, O_NONBLOCK) < 0
+     || fcntl(listenfd, F_SETFL, O_NONBLOCK) < 0)
+    sftp_fatal("error calling fcntl: %s", strerror(errno));
+  while(nsessions || !limit || accepted < limit) {
+    nfds = 0;
+    fds[nfds].fd = wake[0];
+    fds[nfds++].events = POLLIN;
+    if(nsessions < sftpconf_multiplex && (!limit || accepted < limit)) {
+      polled[nfds] = 0;
+      fds[nfds].fd = listenfd;
+      fds[nfds++].events = POLLIN;
     }
-    /* See serialize.c for the serialization rules we follow */
-    queue_serializable_job(job);
-    /* We process the job in a background thread, except that the background
-     * threads don't exist until SSH_FXP_INIT has succeeded. */
-    if(workqueue) {
-      queue_add(workqueue, job);
-      continue;
+    for(s = sessions; s; s = s->next) {
+      backlog = sftp_send_backlog(s);
+      events = 0;
+      if(!s->stalled && !s->ending && !s->eof && backlog < OUTPUTLIMIT)
+        events |= POLLIN;
+      if(backlog)
+        events |= POLLOUT;
+      if(events) {
+        polled[nfds] = s;
+        fds[nfds].fd = s->in.fd;
+        fds[nfds++].events = events;
+      }
+    }
+    if(poll(fds, nfds, -1) < 0) {
+      if(errno == EINTR)
+        continue;
+      sftp_fatal("error calling poll: %s", strerror(errno));
+    }
+    for(n = 1; n < nfds; ++n) {
+      if(!fds[n].revents)
+        continue;
+      if(!(s = polled[n])) {
+        if((fd = accept(listenfd, 0, 0)) < 0) {
+          /* Another process may have got there first */
+          if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+             && errno != ECONNABORTED)
+            sftp_fatal("accept: %s", strerror(errno));
+          continue;
+        }
+        s = multiplex_session(fd, wake[1]);
+        s->next = sessions;
+        sessions = s;
+        ++nsessions;
+        ++accepted;
+        D(("session %d started, %d active", accepted, nsessions));
+        continue;
+      }
+      if(fds[n].events & POLLOUT)
+        sftp_send_flush(s);
+      if(!(fds[n].events & POLLIN)
+         || !(fds[n].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      if(sftp_input_read(&s->in))
+        s->eof = 1;
+      multiplex_requests(s, wdv);
+    }
+    if(fds[0].revents) {
+      while(read(wake[0], buffer, sizeof buffer) > 0)
+        ;
+      for(s = sessions; s; s = s->next)
+        if(s->stalled)
+          multiplex_requests(s, wdv);
+    }
+    /* Retire sessions that have ended and have nothing left in flight */
+    sp = &sessions;
+    while((s = *sp)) {
+      if(s->ending && sftp_input_drain(&s->in) && !sftp_send_backlog(s)) {
+        *sp = s->next;
+        fd = s->in.fd;
+        sftp_session_destroy(s);
+        free(s);
+        if(close(fd) < 0)
+          sftp_fatal("close: %s", strerror(errno));
+        --nsessions;
+        D(("session ended, %d active", nsessions));
+      } else
+        sp = &s->next;
     }
-    sftp_alloc_init(&a);
-    process_sftpjob(job, wdv, &a);
-    sftp_alloc_destroy(&a);
-    /* process_sftpjob() frees JOB when it has finished with it */
   }
-  queue_destroy(workqueue);
+  service_stop();
+  close(wake[0]);
+  close(wake[1]);
+  free(fds);
+  free(polled);
   worker_cleanup(wdv);
 }
+#endif
 
 /*
 Local Variables:
@@ -28,25 +28,188 @@
 #  include <sys/types.h>
 
 #  ifndef MAXNAMES
-/** @brief Maximum size of an @ref SSH_FXP_READDIR response */
+/** @brief Default maximum size of an @ref SSH_FXP_READDIR response */
 #    define MAXNAMES 32
 #  endif
 
+#  ifndef WALKNAMES
+/** @brief Maximum number of names in a reply to a directory walk
+ *
+ * See @ref WALK.
+ */
+#    define WALKNAMES 1024
+#  endif
+
+#  ifndef BULKERRORS
+/** @brief Maximum number of failures listed in a reply to a bulk remove
+ *
+ * See @ref REMOVE_TREE.  Failures beyond this are counted but not named.
+ */
+#    define BULKERRORS 256
+#  endif
+
+#  ifndef EXTINDEXSEEDS
+/** @brief Number of hash seeds to try for each extension index size
+ *
+ * See sftp_extensions_index().
+ */
+#    define EXTINDEXSEEDS 256
+#  endif
+
 #  ifndef MAXHANDLES
-/** @brief Maximum number of concurrent handles */
-#    define MAXHANDLES 128
+/** @brief Default maximum number of concurrent handles */
+#    define MAXHANDLES 1024
+#  endif
+
+#  ifndef MAXINFLIGHTBYTES
+/** @brief Default limit on request bytes held in memory at once */
+#    define MAXINFLIGHTBYTES 67108864
+#  endif
+
+#  ifndef MAXINFLIGHTREQUESTS
+/** @brief Default limit on requests held in memory at once */
+#    define MAXINFLIGHTREQUESTS 1024
 #  endif
 
 #  ifndef MAXREAD
-/** @brief Maximum read size */
+/** @brief Default maximum read size */
 #    define MAXREAD 1048576
 #  endif
 
 #  ifndef MAXREQUEST
-/** @brief Maximum request size */
+/** @brief Default maximum request size */
 #    define MAXREQUEST 1048576
 #  endif
 
+#  ifndef MAXWRITEOVERHEAD
+/** @brief Space reserved for the rest of a write request
+ *
+ * The largest write reported by @c limits@openssh.com is this much less than
+ * the maximum request size. */
+#    define MAXWRITEOVERHEAD 1024
+#  endif
+
+#  ifndef INPUTBUFFER
+/** @brief Size of request input buffer */
+#    define INPUTBUFFER 262144
+#  endif
+
+#  ifndef OUTPUTLIMIT
+/** @brief Maximum bytes of responses queued for output */
+#    define OUTPUTLIMIT 4194304
+#  endif
+
+#  ifndef OUTPUTSPARE
+/** @brief Maximum number of spare output queue entries kept for reuse */
+#    define OUTPUTSPARE 4
+#  endif
+
+#  ifndef OUTPUTBATCH
+/** @brief Default maximum number of responses per output syscall */
+#    define OUTPUTBATCH 64
+#  endif
+
+#  ifndef SENDPOOL
+/** @brief Default number of spare send buffers to keep */
+#    define SENDPOOL 16
+#  endif
+
+#  ifndef SENDPOOLIDLE
+/** @brief Default lifetime of unused spare send buffers in seconds */
+#    define SENDPOOLIDLE 10
+#  endif
+
+#  ifndef SENDSLACK
+/** @brief Space in pooled send buffers beyond the largest read */
+#    define SENDSLACK 4096
+#  endif
+
+#  ifndef QUEUERING
+/** @brief Number of slots in a ring work queue (must be a power of 2) */
+#    define QUEUERING 1024
+#  endif
+
+#  ifndef QUEUEFLOWS
+/** @brief Number of hash buckets for the flows of a fair work queue */
+#    define QUEUEFLOWS 64
+#  endif
+
+#  ifndef READAHEAD
+/** @brief Default read-ahead window for sequential reads */
+#    define READAHEAD 1048576
+#  endif
+
+#  ifndef READAHEADRUN
+/** @brief Consecutive sequential reads before read-ahead starts */
+#    define READAHEADRUN 2
+#  endif
+
+#  ifndef WRITEBEHIND
+/** @brief Default size of per-handle write-behind buffers, or 0 */
+#    define WRITEBEHIND 0
+#  endif
+
+#  ifndef URINGDEPTH
+/** @brief Number of entries in the io_uring */
+#    define URINGDEPTH 256
+#  endif
+
+#  ifndef LINESPAN
+/** @brief Block size for text file line indexes */
+#    define LINESPAN 65536
+#  endif
+
+#  ifndef DIRECTALIGN
+/** @brief Alignment of offsets, lengths and buffers for @c direct-io */
+#    define DIRECTALIGN 4096
+#  endif
+
+#  ifndef DIRECTCHUNK
+/** @brief Largest bounce buffer for @c direct-io, a multiple of
+ * @ref DIRECTALIGN */
+#    define DIRECTCHUNK 1048576
+#  endif
+
+#  ifndef MMAPWINDOW
+/** @brief Size of each mapped window for @c mmap-read */
+#    define MMAPWINDOW 16777216
+#  endif
+
+#  ifndef USERCACHETTL
+/** @brief Default lifetime of cached user and group lookups in seconds */
+#    define USERCACHETTL 60
+#  endif
+
+#  ifndef HASHTHREADS
+/** @brief Default number of check-file hashing helper threads */
+#    define HASHTHREADS 4
+#  endif
+
+#  ifndef HASHCHUNK
+/** @brief Read size when hashing files */
+#    define HASHCHUNK 1048576
+#  endif
+
+#  ifndef REALPATHCACHETTL
+/** @brief Default lifetime of cached symlink and cwd lookups in seconds */
+#    define REALPATHCACHETTL 2
+#  endif
+
+#  ifndef PREFORKSESSIONS
+/** @brief Default number of sessions a preforked process serves */
+#    define PREFORKSESSIONS 100
+#  endif
+
+#  ifndef PREFORKMINLIFE
+/** @brief Seconds a failing preforked process must run to avoid a delay */
+#    define PREFORKMINLIFE 10
+#  endif
+
+#  ifndef PREFORKMAXDELAY
+/** @brief Most seconds to wait before replacing a failing preforked process */
+#    define PREFORKMAXDELAY 60
+#  endif
+
 #  ifndef DEFAULT_PERMISSIONS
 /** @brief Default file permissions */
 #    define DEFAULT_PERMISSIONS 0755
@@ -57,6 +220,49 @@
 #    define NTHREADS 4
 #  endif
 
+#  ifndef MINTHREADS
+/** @brief Default fewest runtime threads */
+#    define MINTHREADS 1
+#  endif
+
+#  ifndef MAXTHREADS
+/** @brief Default most runtime threads */
+#    define MAXTHREADS 32
+#  endif
+
+#  ifndef SYNCFSBATCH
+/** @brief Files on one filesystem that are synchronized with one syncfs() */
+#    define SYNCFSBATCH 4
+#  endif
+
+#  ifndef THREADSPAWNDELAY
+/** @brief Milliseconds queued jobs may go untouched before a thread is added */
+#    define THREADSPAWNDELAY 10
+#  endif
+
+#  ifndef THREADIDLE
+/** @brief Seconds a thread may be idle before exiting */
+#    define THREADIDLE 10
+#  endif
+
+#  ifndef WATCHEVENTS
+/** @brief Most names a watch remembers changes to between reads
+ *
+ * See @ref WATCH.
+ */
+#    define WATCHEVENTS 1024
+#  endif
+
+#  ifndef WATCHDELAY
+/** @brief Milliseconds to wait for more changes before answering a read */
+#    define WATCHDELAY 20
+#  endif
+
+#  ifndef WATCHMAXWAIT
+/** @brief Longest a @ref WATCH_READ request may wait, in milliseconds */
+#    define WATCHMAXWAIT 60000
+#  endif
+
 /** @brief Send an @ref SSH_FXP_STATUS message
  * @param job Job
  * @param status Status code
@@ -150,6 +356,15 @@ uint32_t sftp_vany_mkdir(struct sftpjob *job);
  */
 uint32_t sftp_vany_extended(struct sftpjob *job);
 
+/** @brief Build the extension hash index for a protocol
+ * @param p Protocol
+ *
+ * Must be called before the protocol's first request is processed; later
+ * calls do nothing.  If no perfect hash can be found, sftp_vany_extended()
+ * falls back to a linear search.
+ */
+void sftp_extensions_index(const struct sftpprotocol *p);
+
 /** @brief Send a filename list as found in an @ref SSH_FXP_NAME response
  * @param job Job
  * @param nnames Number of names
@@ -306,6 +521,35 @@ uint32_t sftp_generic_open(struct sftpjob *job, const char *path,
                            uint32_t desired_access, uint32_t flags,
                            struct sftpattr *attrs);
 
+struct handleid;
+
+/** @brief Open a file and create a handle for it
+ * @param job Job
+ * @param path Path to open (should already have been translated)
+ * @param desired_access Access required
+ * @param flags Open flags
+ * @param attrs Initial attributes for new files
+ * @param idp Where to store the new handle
+ * @return 0 on success or an error code
+ *
+ * This is sftp_generic_open() without the response, for extensions that open
+ * a file as part of some larger operation.
+ */
+uint32_t sftp_generic_open_handle(struct sftpjob *job, const char *path,
+                                  uint32_t desired_access, uint32_t flags,
+                                  struct sftpattr *attrs,
+                                  struct handleid *idp);
+
+/** @brief Common code for @ref SSH_FXP_CLOSE
+ * @param job Job
+ * @param id Handle to close
+ * @return Error code
+ *
+ * Closes of files open for writing are answered asynchronously, once the
+ * file is closed (and durable if @ref sftpconf_fsync_on_close is set).
+ */
+uint32_t sftp_generic_close(struct sftpjob *job, const struct handleid *id);
+
 /** @brief @c space-available extension implementation
  * @param job Job
  * @return Error code
@@ -318,12 +562,120 @@ uint32_t sftp_vany_space_available(struct sftpjob *job);
  */
 uint32_t sftp_v6_version_select(struct sftpjob *job);
 
+/** @brief @c check-file-handle extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_check_file_handle(struct sftpjob *job);
+
+/** @brief @c check-file-name extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_check_file_name(struct sftpjob *job);
+
+/** @brief @c delta-signature@rjk.greenend.org.uk extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_delta_signature(struct sftpjob *job);
+
+/** @brief @c delta-apply@rjk.greenend.org.uk extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_delta_apply(struct sftpjob *job);
+
+/** @brief @c copy-data extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_copy_data(struct sftpjob *job);
+
+/** @brief @c put-file@rjk.greenend.org.uk extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_put_file(struct sftpjob *job);
+
+/** @brief @c get-file@rjk.greenend.org.uk extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_get_file(struct sftpjob *job);
+
 /** @brief @c fsync@openssh.com extension implementation
  * @param job Job
  * @return Error code
  */
 uint32_t sftp_vany_fsync(struct sftpjob *job);
 
+/** @brief @c limits@openssh.com extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_limits(struct sftpjob *job);
+
+/** @brief @c read-order@rjk.greenend.org.uk extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_read_order(struct sftpjob *job);
+
+/** @brief @c walk@rjk.greenend.org.uk extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_walk(struct sftpjob *job);
+
+/** @brief @c watch@rjk.greenend.org.uk extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_watch(struct sftpjob *job);
+
+/** @brief @c watch-read@rjk.greenend.org.uk extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_watch_read(struct sftpjob *job);
+
+/** @brief @c compress@rjk.greenend.org.uk extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_compress(struct sftpjob *job);
+
+/** @brief @c read-vector@rjk.greenend.org.uk extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_read_vector(struct sftpjob *job);
+
+/** @brief @c readdir-mask@rjk.greenend.org.uk extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_readdir_mask(struct sftpjob *job);
+
+/** @brief @c stat-batch@rjk.greenend.org.uk extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_stat_batch(struct sftpjob *job);
+
+/** @brief @c remove-tree@rjk.greenend.org.uk extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_remove_tree(struct sftpjob *job);
+
+/** @brief @c posix-rename-batch@rjk.greenend.org.uk extension implementation
+ * @param job Job
+ * @return Error code
+ */
+uint32_t sftp_vany_rename_batch(struct sftpjob *job);
+
 /** @brief @c hardlink@openssh.com extension implementation
  * @param job Job
  * @return Error code
@@ -359,6 +711,14 @@ uint32_t sftp_vany_statvfs(struct sftpjob *job);
  */
 void sftp_send_errno_status(struct sftpjob *job);
 
+/** @brief Convert an @c errno value to a status code
+ * @param errno_value @c errno value
+ * @return Status code known to the current protocol version
+ *
+ * For replies that carry several statuses without messages.
+ */
+uint32_t sftp_errno_to_status(int errno_value);
+
 #endif /* SFTPSERVER_H */
 
 /*
@@ -35,13 +35,95 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#if HAVE_STATX
+#  include <sys/sysmacros.h>
+#endif
 #include "replaced.h"
 
+#if HAVE_STATX
+/** @brief Work out which @c statx() fields some attributes need
+ * @param flags Attributes
+ * @return @c statx() mask
+ */
+static unsigned stat_statx_mask(uint32_t flags) {
+  unsigned mask = STATX_TYPE;
+
+  if(flags & SSH_FILEXFER_ATTR_SIZE)
+    mask |= STATX_SIZE;
+  if(flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+    mask |= STATX_MODE;
+  if(flags & SSH_FILEXFER_ATTR_ACCESSTIME)
+    mask |= STATX_ATIME;
+  if(flags & SSH_FILEXFER_ATTR_MODIFYTIME)
+    mask |= STATX_MTIME;
+  if(flags & SSH_FILEXFER_ATTR_CTIME)
+    mask |= STATX_CTIME;
+  if(flags & (SSH_FILEXFER_ATTR_UIDGID | SSH_FILEXFER_ATTR_OWNERGROUP))
+    mask |= STATX_UID | STATX_GID;
+  if(flags & SSH_FILEXFER_ATTR_ALLOCATION_SIZE)
+    mask |= STATX_BLOCKS;
+  if(flags & SSH_FILEXFER_ATTR_LINK_COUNT)
+    mask |= STATX_NLINK;
+  return mask;
+}
+#endif
+
+int sftp_stat_masked(int dirfd, const char *path, int follow, uint32_t flags,
+                     struct stat *sb) {
+#if HAVE_STATX
+  struct statx stx;
+  int atflags = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+
+  if(!path) {
+    path = "";
+    atflags |= AT_EMPTY_PATH;
+  }
+  if(statx(dirfd, path, atflags, stat_statx_mask(flags), &stx) == 0) {
+    sftp_memset(sb, 0, sizeof *sb);
+    sb->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    sb->st_ino = stx.stx_ino;
+    sb->st_mode = stx.stx_mode;
+    sb->st_nlink = stx.stx_nlink;
+    sb->st_uid = stx.stx_uid;
+    sb->st_gid = stx.stx_gid;
+    sb->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+    sb->st_size = stx.stx_size;
+    sb->st_blksize = stx.stx_blksize;
+    sb->st_blocks = stx.stx_blocks;
+    sb->st_atime = stx.stx_atime.tv_sec;
+    sb->st_mtime = stx.stx_mtime.tv_sec;
+    sb->st_ctime = stx.stx_ctime.tv_sec;
+#  ifdef ST_ATIM
+    sb->ST_ATIM.tv_nsec = stx.stx_atime.tv_nsec;
+    sb->ST_MTIM.tv_nsec = stx.stx_mtime.tv_nsec;
+    sb->ST_CTIM.tv_nsec = stx.stx_ctime.tv_nsec;
+#  endif
+    return 0;
+  }
+  /* The C library may have statx() when the kernel does not */
+  if(errno != ENOSYS)
+    return -1;
+  if(*path == 0)
+    path = NULL;
+#else
+  (void)flags;
+#endif
+  if(!path)
+    return fstat(dirfd, sb);
+#if HAVE_FSTATAT
+  return fstatat(dirfd, path, sb, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+#else
+  return follow ? stat(path, sb) : lstat(path, sb);
+#endif
+}
+
 void sftp_stat_to_attrs(struct allocator *a, const struct stat *sb,
                         struct sftpattr *attrs, uint32_t flags,
                         const char *path) {
   sftp_memset(attrs, 0, sizeof *attrs);
-  attrs->valid = (SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_PERMISSIONS |
+  attrs->valid = flags &
+                 (SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_PERMISSIONS |
                   SSH_FILEXFER_ATTR_ACCESSTIME | SSH_FILEXFER_ATTR_MODIFYTIME |
                   SSH_FILEXFER_ATTR_UIDGID | SSH_FILEXFER_ATTR_ALLOCATION_SIZE |
                   SSH_FILEXFER_ATTR_LINK_COUNT | SSH_FILEXFER_ATTR_CTIME |
@@ -87,7 +169,8 @@ void sftp_stat_to_attrs(struct allocator *a, const struct stat *sb,
   attrs->mtime.seconds = sb->st_mtime;
   attrs->ctime.seconds = sb->st_ctime;
 #ifdef ST_ATIM
-  if(sb->ST_ATIM.tv_nsec >= 0 && sb->ST_ATIM.tv_nsec < 1000000000 &&
+  if((flags & SSH_FILEXFER_ATTR_SUBSECOND_TIMES) &&
+     sb->ST_ATIM.tv_nsec >= 0 && sb->ST_ATIM.tv_nsec < 1000000000 &&
      sb->ST_MTIM.tv_nsec >= 0 && sb->ST_MTIM.tv_nsec < 1000000000 &&
      sb->ST_CTIM.tv_nsec >= 0 && sb->ST_CTIM.tv_nsec < 1000000000) {
     /* Only send subsecond times if they are in range */
@@ -99,7 +182,7 @@ void sftp_stat_to_attrs(struct allocator *a, const struct stat *sb,
 #endif
   attrs->link_count = sb->st_nlink;
   /* If we know the path we can determine whether the file is hidden or not */
-  if(path) {
+  if(path && (flags & SSH_FILEXFER_ATTR_BITS)) {
     const char *s = path + strlen(path);
     /* Ignore trailing slashes */
     while(s > path && s[-1] == '/')
@@ -85,6 +85,25 @@ uint32_t sftp_set_status(struct allocator *a, const char *path,
 uint32_t sftp_set_fstatus(struct allocator *a, int fd,
                           const struct sftpattr *attrs, const char **whyp);
 
+/** @brief Name of the directory listing mask extension */
+#  define READDIR_MASK "readdir-mask@rjk.greenend.org.uk"
+
+/** @brief Stat a file, fetching only what some attributes need
+ * @param dirfd Directory file descriptor, @c AT_FDCWD, or the file itself
+ * @param path Path name relative to @p dirfd, or a null pointer
+ * @param follow Nonzero to follow a final symlink
+ * @param flags Attributes that will be computed from the result
+ * @param sb Where to store the result
+ * @return 0 on success, -1 on error with @c errno set
+ *
+ * If @p path is a null pointer then @p dirfd is the file to stat.  Where @c
+ * statx() is available only the fields needed for @p flags (and the file
+ * type) are asked for, which saves work on some filesystems.  Other fields
+ * of @p sb may be 0.  Without @c fstatat() @p dirfd must be @c AT_FDCWD.
+ */
+int sftp_stat_masked(int dirfd, const char *path, int follow, uint32_t flags,
+                     struct stat *sb);
+
 /** @brief Convert @c stat() output to SFTP attributes
  * @param a Allocator
  * @param sb Result of calling @c stat() or similar
@@ -92,9 +111,9 @@ uint32_t sftp_set_fstatus(struct allocator *a, int fd,
  * @param flags Requested attributes
  * @param path Path name or a null pointer
  *
- * The only meaningful bit in @p flags currently is @ref
- * SSH_FILEXFER_ATTR_OWNERGROUP, which causes the owner and group names to be
- * filled in.
+ * Only attributes in @p flags are filled in, so that for instance owner and
+ * group names are only looked up if @ref SSH_FILEXFER_ATTR_OWNERGROUP is
+ * present.  The file type is always filled in.
  *
  * @todo @ref SSH_FILEXFER_ATTR_FLAGS_CASE_INSENSITIVE is not implemented.
  *
@@ -0,0 +1,372 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file statbatch.c @brief Parallel directory stat
+ *
+ * Listing a directory means an lstat() per entry.  On a network filesystem
+ * each of those can be a round trip to the server, so doing them one at a
+ * time makes large listings very slow.  Here a batch of names is made
+ * available to a small pool of helper threads, which claim names one at a
+ * time until the batch is exhausted.  The thread that submitted the batch
+ * joins in too.
+ *
+ * The same machinery serves the @ref STAT_BATCH extension, which lets a
+ * client stat a list of unrelated paths in a single round trip, and the
+ * unlinking of directory entries for @ref REMOVE_TREE.
+ */
+
+#include "sftpserver.h"
+#include "statbatch.h"
+#include "types.h"
+#include "globals.h"
+#include "parse.h"
+#include "send.h"
+#include "stat.h"
+#include "statcache.h"
+#include "sftp.h"
+#include "alloc.h"
+#include "thread.h"
+#include "utils.h"
+#include "debug.h"
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/** @brief A batch of stat requests in progress */
+struct statbatch {
+  /** @brief Next batch with unclaimed requests */
+  struct statbatch *next;
+
+  /** @brief Directory file descriptor or -1 */
+  int dirfd;
+
+  /** @brief Directory path name, or a null pointer for full path names */
+  const char *dirpath;
+
+  /** @brief Nonzero to follow symlinks, for full path names only */
+  int follow;
+
+  /** @brief Nonzero to unlink entries rather than stat them */
+  int unlink;
+
+  /** @brief Attributes the results will be used for */
+  uint32_t flags;
+
+  /** @brief Requests */
+  struct statreq *reqs;
+
+  /** @brief Number of requests */
+  size_t n;
+
+  /** @brief Number of requests claimed */
+  size_t claimed;
+
+  /** @brief Number of requests completed */
+  size_t completed;
+
+  /** @brief Signaled when @ref completed reaches @ref n */
+  pthread_cond_t done;
+};
+
+/** @brief Lock protecting the batch list */
+static pthread_mutex_t statbatch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Signaled when a batch is added or on shutdown */
+static pthread_cond_t statbatch_ready = PTHREAD_COND_INITIALIZER;
+
+/** @brief Batches with unclaimed requests, oldest first */
+static struct statbatch *batches;
+
+/** @brief Helper threads */
+static pthread_t *helpers;
+
+/** @brief Number of helper threads */
+static int nhelpers;
+
+/** @brief Number of helper threads to start when they are first needed */
+static int nwanted;
+
+/** @brief Set to shut down helpers */
+static int stopping;
+
+/** @brief Claim a request from the oldest batch
+ * @return Batch, or a null pointer if there is nothing to do
+ *
+ * Must be called with @ref statbatch_lock held.  The claimed request is
+ * <code>b->reqs[b->claimed - 1]</code>.  Fully claimed batches are removed from
+ * the list.
+ */
+static struct statbatch *statbatch_claim(void) {
+  struct statbatch *b = batches;
+
+  if(!b)
+    return NULL;
+  if(++b->claimed == b->n)
+    batches = b->next;
+  return b;
+}
+
+/** @brief Unlink one directory entry
+ * @param b Batch
+ * @param r Request
+ */
+static void statbatch_unlink_one(const struct statbatch *b,
+                                 struct statreq *r) {
+  int rc;
+
+#if HAVE_UNLINKAT
+  if(b->dirfd != -1)
+    rc = unlinkat(b->dirfd, r->name, 0);
+  else
+#endif
+  {
+    char *fullpath = sftp_xmalloc(strlen(b->dirpath) + strlen(r->name) + 2);
+
+    strcpy(fullpath, b->dirpath);
+    strcat(fullpath, "/");
+    strcat(fullpath, r->name);
+    rc = unlink(fullpath);
+    free(fullpath);
+  }
+  r->error = rc < 0 ? errno : 0;
+}
+
+/** @brief Stat one file
+ * @param b Batch
+ * @param r Request
+ */
+static void statbatch_one(const struct statbatch *b, struct statreq *r) {
+  int rc;
+
+  if(b->unlink) {
+    statbatch_unlink_one(b, r);
+    return;
+  }
+  if(!b->dirpath)
+    rc = sftp_statcache_stat(r->name, b->follow, b->flags, &r->sb);
+#if HAVE_FSTATAT
+  else if(b->dirfd != -1)
+    rc = sftp_stat_masked(b->dirfd, r->name, 0, b->flags, &r->sb);
+#endif
+  else {
+    char *fullpath = sftp_xmalloc(strlen(b->dirpath) + strlen(r->name) + 2);
+
+    strcpy(fullpath, b->dirpath);
+    strcat(fullpath, "/");
+    strcat(fullpath, r->name);
+    rc = sftp_stat_masked(AT_FDCWD, fullpath, 0, b->flags, &r->sb);
+    free(fullpath);
+  }
+  r->error = rc < 0 ? errno : 0;
+}
+
+/** @brief Work on claimed requests until there are none left
+ *
+ * Must be called with @ref statbatch_lock held.
+ */
+static void statbatch_work(void) {
+  struct statbatch *b;
+  struct statreq *r;
+
+  while((b = statbatch_claim())) {
+    r = &b->reqs[b->claimed - 1];
+    ferrcheck(pthread_mutex_unlock(&statbatch_lock));
+    statbatch_one(b, r);
+    ferrcheck(pthread_mutex_lock(&statbatch_lock));
+    if(++b->completed == b->n)
+      ferrcheck(pthread_cond_signal(&b->done));
+  }
+}
+
+/** @brief Helper thread
+ * @param arg Unused
+ * @return Null pointer
+ */
+static void *statbatch_thread(void attribute((unused)) * arg) {
+  ferrcheck(pthread_mutex_lock(&statbatch_lock));
+  while(!stopping) {
+    statbatch_work();
+    if(!stopping)
+      ferrcheck(pthread_cond_wait(&statbatch_ready, &statbatch_lock));
+  }
+  ferrcheck(pthread_mutex_unlock(&statbatch_lock));
+  return NULL;
+}
+
+void sftp_statbatch_start(int nthreads) {
+  nwanted = nthreads > 0 ? nthreads : 0;
+}
+
+/** @brief Start the helper threads if they are not already running
+ *
+ * Must be called with @ref statbatch_lock held.  Most sessions never share out
+ * any work, so the threads are only created when a batch first needs them.
+ */
+static void statbatch_helpers(void) {
+  int n;
+
+  if(nhelpers)
+    return;
+  helpers = sftp_xcalloc(nwanted, sizeof *helpers);
+  for(n = 0; n < nwanted; ++n)
+    ferrcheck(pthread_create(&helpers[n], 0, statbatch_thread, 0));
+  nhelpers = nwanted;
+  D(("started %d stat helpers", nhelpers));
+}
+
+void sftp_statbatch_stop(void) {
+  int n;
+
+  nwanted = 0;
+  if(!nhelpers)
+    return;
+  ferrcheck(pthread_mutex_lock(&statbatch_lock));
+  stopping = 1;
+  ferrcheck(pthread_cond_broadcast(&statbatch_ready));
+  ferrcheck(pthread_mutex_unlock(&statbatch_lock));
+  for(n = 0; n < nhelpers; ++n)
+    ferrcheck(pthread_join(helpers[n], 0));
+  free(helpers);
+  helpers = NULL;
+  nhelpers = 0;
+  stopping = 0;
+}
+
+/** @brief Complete a batch
+ * @param b Batch, with the directory, requests and mode filled in
+ */
+static void statbatch_run(struct statbatch *b) {
+  struct statbatch **bp;
+  size_t i;
+
+  if(!nwanted || b->n < 2) {
+    /* Nobody to share with */
+    for(i = 0; i < b->n; ++i)
+      statbatch_one(b, &b->reqs[i]);
+    return;
+  }
+  b->next = NULL;
+  b->claimed = b->completed = 0;
+  ferrcheck(pthread_cond_init(&b->done, 0));
+  ferrcheck(pthread_mutex_lock(&statbatch_lock));
+  statbatch_helpers();
+  for(bp = &batches; *bp; bp = &(*bp)->next)
+    ;
+  *bp = b;
+  ferrcheck(pthread_cond_broadcast(&statbatch_ready));
+  /* Help out */
+  statbatch_work();
+  while(b->completed < b->n)
+    ferrcheck(pthread_cond_wait(&b->done, &statbatch_lock));
+  ferrcheck(pthread_mutex_unlock(&statbatch_lock));
+  ferrcheck(pthread_cond_destroy(&b->done));
+}
+
+void sftp_statbatch(int dirfd, const char *dirpath, struct statreq *reqs,
+                    size_t n, uint32_t flags) {
+  struct statbatch b;
+
+  b.dirfd = dirfd;
+  b.dirpath = dirpath;
+  b.follow = 0;
+  b.unlink = 0;
+  b.flags = flags;
+  b.reqs = reqs;
+  b.n = n;
+  statbatch_run(&b);
+}
+
+void sftp_statbatch_paths(struct statreq *reqs, size_t n, int follow,
+                          uint32_t flags) {
+  struct statbatch b;
+
+  b.dirfd = -1;
+  b.dirpath = NULL;
+  b.follow = follow;
+  b.unlink = 0;
+  b.flags = flags;
+  b.reqs = reqs;
+  b.n = n;
+  statbatch_run(&b);
+}
+
+void sftp_statbatch_unlink(int dirfd, const char *dirpath,
+                           struct statreq *reqs, size_t n) {
+  struct statbatch b;
+
+  b.dirfd = dirfd;
+  b.dirpath = dirpath;
+  b.follow = 0;
+  b.unlink = 1;
+  b.flags = 0;
+  b.reqs = reqs;
+  b.n = n;
+  statbatch_run(&b);
+}
+
+uint32_t sftp_vany_stat_batch(struct sftpjob *job) {
+  struct worker *const w = job->worker;
+  struct statreq *reqs;
+  struct sftpattr attrs;
+  uint32_t flags, count, i, mask;
+  char *path;
+
+  pcheck(sftp_parse_uint32(job, &flags));
+  pcheck(sftp_parse_uint32(job, &count));
+  D(("sftp_vany_stat_batch %#" PRIx32 " %" PRIu32, flags, count));
+  /* Every path takes at least its length word, which bounds the allocation
+   * below by the size of the request */
+  if(count > job->left / 4)
+    return SSH_FX_BAD_MESSAGE;
+  reqs = sftp_alloc_raw(job->a, (count ? count : 1) * sizeof *reqs);
+  for(i = 0; i < count; ++i) {
+    pcheck(sftp_parse_path_borrow(job, &path));
+    reqs[i].name = path;
+  }
+  /* As for SSH_FXP_STAT, there is no way to communicate owner and group
+   * names in protocol version 3 */
+  mask = protocol->version > 3 ? 0xFFFFFFFF
+                               : ~(uint32_t)SSH_FILEXFER_ATTR_OWNERGROUP;
+  sftp_statbatch_paths(reqs, count, !!(flags & STAT_BATCH_FOLLOW), mask);
+  sftp_send_begin(w);
+  sftp_send_uint8(w, SSH_FXP_EXTENDED_REPLY);
+  sftp_send_uint32(w, job->id);
+  sftp_send_uint32(w, count);
+  for(i = 0; i < count; ++i) {
+    sftp_send_uint32(w, sftp_errno_to_status(reqs[i].error));
+    if(reqs[i].error)
+      continue;
+    sftp_stat_to_attrs(job->a, &reqs[i].sb, &attrs, mask, reqs[i].name);
+    protocol->sendattrs(job, &attrs);
+  }
+  sftp_send_end(w);
+  return HANDLER_RESPONDED;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
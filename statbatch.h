@@ -0,0 +1,107 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file statbatch.h @brief Parallel directory stat interface */
+
+#ifndef STATBATCH_H
+#  define STATBATCH_H
+
+#  include <sys/stat.h>
+#  include <stddef.h>
+#  include <stdint.h>
+
+/** @brief Name of batch stat extension */
+#  define STAT_BATCH "stat-batch@rjk.greenend.org.uk"
+
+/** @brief @c stat-batch@rjk.greenend.org.uk flag: follow symlinks */
+#  define STAT_BATCH_FOLLOW 0x00000001
+
+/** @brief One file to stat */
+struct statreq {
+  /** @brief Name relative to the directory, or a full path name */
+  const char *name;
+
+  /** @brief Result of lstat() */
+  struct stat sb;
+
+  /** @brief 0 on success, else an @c errno value */
+  int error;
+};
+
+/** @brief Start the stat helper threads
+ * @param nthreads Number of helper threads, or 0 for none
+ *
+ * With no helpers, sftp_statbatch() does all the work in the calling thread.
+ * The threads are not actually created until the first batch that can be
+ * shared out.
+ */
+void sftp_statbatch_start(int nthreads);
+
+/** @brief Stop the stat helper threads */
+void sftp_statbatch_stop(void);
+
+/** @brief lstat() a batch of directory entries
+ * @param dirfd File descriptor for directory, or -1
+ * @param dirpath Path name of directory
+ * @param reqs Files to stat
+ * @param n Number of files
+ * @param flags Attributes the results will be used for
+ *
+ * The files are shared out between the helper threads and the calling
+ * thread, and this function returns when all of them are done.  If
+ * fstatat() is available and @p dirfd is not -1 then names are looked up
+ * relative to @p dirfd, otherwise relative to @p dirpath.
+ */
+void sftp_statbatch(int dirfd, const char *dirpath, struct statreq *reqs,
+                    size_t n, uint32_t flags);
+
+/** @brief stat() or lstat() a batch of unrelated paths
+ * @param reqs Files to stat, named by full path
+ * @param n Number of files
+ * @param follow Nonzero to use stat(), 0 to use lstat()
+ * @param flags Attributes the results will be used for
+ *
+ * The work is shared out as for sftp_statbatch().
+ */
+void sftp_statbatch_paths(struct statreq *reqs, size_t n, int follow,
+                          uint32_t flags);
+
+/** @brief Unlink a batch of directory entries
+ * @param dirfd File descriptor for directory, or -1
+ * @param dirpath Path name of directory
+ * @param reqs Entries to unlink; only the @c error fields are filled in
+ * @param n Number of entries
+ *
+ * The work is shared out as for sftp_statbatch().  None of the entries may
+ * be directories.
+ */
+void sftp_statbatch_unlink(int dirfd, const char *dirpath,
+                           struct statreq *reqs, size_t n);
+
+#endif /* STATBATCH_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
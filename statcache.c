@@ -0,0 +1,268 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file statcache.c @brief Stat cache
+ *
+ * GUI clients and synchronization tools ask for the attributes of the same
+ * few paths over and over, around every open and after listing a directory.
+ * On a network filesystem each lookup is a round trip to the file server.
+ * So when the cache is enabled we remember successful lookups for a short
+ * time, keyed by the path name as the client gave it.  Listing a directory
+ * fills in its entries.  The server discards the whole cache before doing
+ * anything that could change the attributes of a file, so only changes made
+ * by other processes can be missed for the lifetime of an entry.
+ *
+ * Discarding the cache is not enough by itself, since a lookup by another
+ * thread, or by the directory prefetcher, may have called stat() just before
+ * the change and add its result just after.  So each thread that is making a
+ * change is counted in @ref sc_changing until sftp_statcache_settle(), and
+ * nothing is added while any are; and every lookup notes @ref sc_generation
+ * before calling stat(), and drops its result if the cache has been
+ * discarded in the meantime.
+ */
+
+#include "sftpserver.h"
+#include "statcache.h"
+#include "stat.h"
+#include "utils.h"
+#include "debug.h"
+#include "thread.h"
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+
+#ifndef STATCACHEBUCKETS
+/** @brief Number of hash buckets in the stat cache */
+#  define STATCACHEBUCKETS 256
+#endif
+
+#ifndef STATCACHEMAX
+/** @brief Maximum entries in the stat cache before it is flushed */
+#  define STATCACHEMAX 4096
+#endif
+
+/** @brief One cached lookup */
+struct scentry {
+  /** @brief Next entry in the same bucket */
+  struct scentry *next;
+
+  /** @brief Path */
+  char *path;
+
+  /** @brief Nonzero if symlinks were followed */
+  int follow;
+
+  /** @brief Attributes the result is good for */
+  uint32_t flags;
+
+  /** @brief Result */
+  struct stat sb;
+
+  /** @brief When this entry expires, in milliseconds */
+  uint64_t expires;
+};
+
+/** @brief Lock protecting the cache */
+static pthread_rwlock_t sc_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** @brief Cache lifetime in milliseconds, or 0 if disabled */
+static int sc_ttl;
+
+/** @brief Hash buckets */
+static struct scentry *sc_buckets[STATCACHEBUCKETS];
+
+/** @brief Number of cached entries */
+static size_t sc_nentries;
+
+/** @brief Incremented whenever the cache is discarded */
+static uint64_t sc_generation;
+
+/** @brief Number of threads in the middle of changing a file */
+static int sc_changing;
+
+/** @brief Nonzero if this thread is in the middle of changing a file */
+static THREAD_LOCAL int sc_thread_changing;
+
+void sftp_statcache_init(int ttl) {
+  sc_ttl = ttl;
+}
+
+/** @brief Current time for expiry purposes
+ * @return Monotonic time in milliseconds
+ */
+static uint64_t sc_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** @brief Discard all entries
+ *
+ * Must be called with @ref sc_lock held for writing.
+ */
+static void sc_flush(void) {
+  struct scentry *e;
+  size_t n;
+
+  for(n = 0; sc_nentries && n < STATCACHEBUCKETS; ++n)
+    while((e = sc_buckets[n])) {
+      sc_buckets[n] = e->next;
+      free(e->path);
+      free(e);
+      --sc_nentries;
+    }
+}
+
+void sftp_statcache_invalidate(void) {
+  if(!sc_ttl)
+    return;
+  ferrcheck(pthread_rwlock_wrlock(&sc_lock));
+  sc_flush();
+  ++sc_generation;
+  if(!sc_thread_changing) {
+    sc_thread_changing = 1;
+    ++sc_changing;
+  }
+  ferrcheck(pthread_rwlock_unlock(&sc_lock));
+}
+
+void sftp_statcache_settle(void) {
+  if(!sc_thread_changing)
+    return;
+  ferrcheck(pthread_rwlock_wrlock(&sc_lock));
+  /* Lookups that started while the change was being made are not trusted */
+  ++sc_generation;
+  --sc_changing;
+  sc_thread_changing = 0;
+  ferrcheck(pthread_rwlock_unlock(&sc_lock));
+}
+
+uint64_t sftp_statcache_generation(void) {
+  uint64_t generation;
+
+  if(!sc_ttl)
+    return 0;
+  ferrcheck(pthread_rwlock_rdlock(&sc_lock));
+  generation = sc_generation;
+  ferrcheck(pthread_rwlock_unlock(&sc_lock));
+  return generation;
+}
+
+/** @brief Find the bucket for a path
+ * @param path Path name
+ * @return Pointer to bucket
+ */
+static struct scentry **sc_bucket(const char *path) {
+  unsigned long h = 0;
+
+  while(*path)
+    h = 31 * h + (unsigned char)*path++;
+  return &sc_buckets[h % STATCACHEBUCKETS];
+}
+
+/** @brief Add an entry
+ * @param path Path name (taken over by the cache)
+ * @param follow Nonzero if symlinks were followed
+ * @param flags Attributes the result is good for
+ * @param sb Result
+ * @param generation Value of @ref sc_generation before the lookup
+ *
+ * Nothing is added if a file has been changed since the lookup started, or
+ * is being changed now.
+ */
+static void sc_add(char *path, int follow, uint32_t flags,
+                   const struct stat *sb, uint64_t generation) {
+  struct scentry *const e = sftp_xmalloc(sizeof *e);
+
+  e->path = path;
+  e->follow = follow;
+  e->flags = flags;
+  e->sb = *sb;
+  e->expires = sc_now() + sc_ttl;
+  ferrcheck(pthread_rwlock_wrlock(&sc_lock));
+  if(generation != sc_generation || sc_changing) {
+    ferrcheck(pthread_rwlock_unlock(&sc_lock));
+    D(("statcache: not adding %s", path));
+    free(path);
+    free(e);
+    return;
+  }
+  if(sc_nentries >= STATCACHEMAX)
+    sc_flush();
+  e->next = *sc_bucket(path);
+  *sc_bucket(path) = e;
+  ++sc_nentries;
+  ferrcheck(pthread_rwlock_unlock(&sc_lock));
+}
+
+int sftp_statcache_stat(const char *path, int follow, uint32_t flags,
+                        struct stat *sb) {
+  const struct scentry *e;
+  uint64_t now, generation;
+  int hit = 0;
+
+  if(!sc_ttl)
+    return sftp_stat_masked(AT_FDCWD, path, follow, flags, sb);
+  now = sc_now();
+  ferrcheck(pthread_rwlock_rdlock(&sc_lock));
+  generation = sc_generation;
+  for(e = *sc_bucket(path); e; e = e->next)
+    /* An lstat() result for anything but a link answers stat() too.  Newer
+     * entries come first, so the first usable one is the best. */
+    if(!strcmp(e->path, path) && e->expires > now &&
+       !(flags & ~e->flags) &&
+       (e->follow == follow || (!e->follow && !S_ISLNK(e->sb.st_mode)))) {
+      *sb = e->sb;
+      hit = 1;
+      break;
+    }
+  ferrcheck(pthread_rwlock_unlock(&sc_lock));
+  if(hit)
+    return 0;
+  if(sftp_stat_masked(AT_FDCWD, path, follow, flags, sb))
+    return -1;
+  sc_add(sftp_xstrdup(path), follow, flags, sb, generation);
+  return 0;
+}
+
+void sftp_statcache_note(const char *dir, const char *name, uint32_t flags,
+                         const struct stat *sb, uint64_t generation) {
+  char *path;
+
+  if(!sc_ttl)
+    return;
+  path = sftp_xmalloc(strlen(dir) + strlen(name) + 2);
+  strcpy(path, dir);
+  strcat(path, "/");
+  strcat(path, name);
+  sc_add(path, 0, flags, sb, generation);
+}
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
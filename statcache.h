@@ -0,0 +1,93 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file statcache.h @brief Stat cache interface */
+
+#ifndef STATCACHE_H
+#  define STATCACHE_H
+
+#  include <sys/stat.h>
+#  include <stdint.h>
+
+/** @brief Enable the stat cache
+ * @param ttl Lifetime of entries in milliseconds, or 0 to disable
+ */
+void sftp_statcache_init(int ttl);
+
+/** @brief stat() or lstat() a path, consulting the cache
+ * @param path Path name
+ * @param follow Nonzero to follow symlinks
+ * @param flags Attributes that will be computed from the result
+ * @param sb Where to store the result
+ * @return 0 on success, -1 on error with @c errno set
+ *
+ * As sftp_stat_masked() with @c AT_FDCWD.  Successful results are
+ * remembered; failures are not.
+ */
+int sftp_statcache_stat(const char *path, int follow, uint32_t flags,
+                        struct stat *sb);
+
+/** @brief Return a token to pass to sftp_statcache_note()
+ * @return Current generation of the cache
+ *
+ * Must be called before the lookup whose result is to be remembered.
+ */
+uint64_t sftp_statcache_generation(void);
+
+/** @brief Remember the result of an lstat() of a directory entry
+ * @param dir Directory path name
+ * @param name Name within @p dir
+ * @param flags Attributes the result was fetched for
+ * @param sb Result of lstat()
+ * @param generation Result of sftp_statcache_generation() before the lookup
+ *
+ * The result is dropped if any file has been changed since @p generation was
+ * retrieved.
+ */
+void sftp_statcache_note(const char *dir, const char *name, uint32_t flags,
+                         const struct stat *sb, uint64_t generation);
+
+/** @brief Discard the stat cache
+ *
+ * Called before anything that could change a file's attributes.  Nothing is
+ * added to the cache again until the calling thread calls
+ * sftp_statcache_settle().
+ */
+void sftp_statcache_invalidate(void);
+
+/** @brief Finish changing files
+ *
+ * Called once the changes that the calling thread announced with
+ * sftp_statcache_invalidate() have been made.  Does nothing if there were
+ * none.
+ */
+void sftp_statcache_settle(void);
+
+#endif /* STATCACHE_H */
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
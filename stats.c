@@ -0,0 +1,384 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file stats.c @brief Performance statistics
+ *
+ * Latencies are kept in log-linear histograms in the style of HdrHistogram.
+ * Values below 8us have a bucket each; above that, each power of two is
+ * split into 8 buckets, so any recorded value is known to within 12.5%.
+ * Counters are updated with relaxed atomic operations where available, so
+ * recording costs two clock reads and a few uncontended increments.
+ */
+
+#include "sftpserver.h"
+#include "sftpconf.h"
+#include "sftp.h"
+#include "utils.h"
+#include "thread.h"
+#include "debug.h"
+#include "stats.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <syslog.h>
+#include <time.h>
+#if HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
+/** @brief Number of sub-buckets per power of two (log2) */
+#define SUBBITS 3
+
+/** @brief Number of sub-buckets per power of two */
+#define SUBBUCKETS (1 << SUBBITS)
+
+/** @brief Largest power of two covered, in microseconds (about 12 days) */
+#define MAXMSB 40
+
+/** @brief Number of buckets in a histogram */
+#define NBUCKETS (SUBBUCKETS + (MAXMSB - SUBBITS + 1) * SUBBUCKETS)
+
+/** @brief Number of request types tracked
+ *
+ * Types up to @ref SSH_FXP_UNBLOCK have their own slot; @ref SSH_FXP_EXTENDED
+ * is tracked in the last one. */
+#define NTYPES (SSH_FXP_UNBLOCK + 2)
+
+#if HAVE_STDATOMIC_H
+/** @brief A counter */
+typedef _Atomic uint64_t counter;
+#else
+typedef uint64_t counter;
+
+/** @brief Lock protecting counters */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/** @brief A latency histogram */
+struct histogram {
+  /** @brief Number of values recorded */
+  counter count;
+
+  /** @brief Sum of values recorded, in nanoseconds */
+  counter total;
+
+  /** @brief Largest value recorded, in nanoseconds */
+  counter max;
+
+  /** @brief Buckets */
+  counter buckets[NBUCKETS];
+};
+
+int sftp_stats_enabled;
+
+/** @brief Request latencies by type */
+static struct histogram requests[NTYPES];
+
+/** @brief Wait times */
+static struct histogram waits[stats_nwaits];
+
+/** @brief Bytes transferred */
+static counter bytes[stats_nbytes];
+
+/** @brief Most requests in flight at once */
+static counter inflight_requests_max;
+
+/** @brief Most bytes of request data in flight at once */
+static counter inflight_bytes_max;
+
+/** @brief Times the reader waited for the in-flight budget */
+static counter inflight_stalls;
+
+/** @brief Names of request types */
+static const char *const typenames[NTYPES] = {
+    NULL,       "init",    NULL,     "open",     "close",    "read",
+    "write",    "lstat",   "fstat",  "setstat",  "fsetstat", "opendir",
+    "readdir",  "remove",  "mkdir",  "rmdir",    "realpath", "stat",
+    "rename",   "readlink", "symlink", "link",   "block",    "unblock",
+    "extended"};
+
+/** @brief Names of waits */
+static const char *const waitnames[stats_nwaits] = {"queue", "serialize"};
+
+/** @brief Names of transfer directions */
+static const char *const bytesnames[stats_nbytes] = {"read", "written"};
+
+/** @brief Thread that waits for @c SIGUSR1 */
+static pthread_t stats_thread;
+
+/** @brief Set to shut down @ref stats_thread */
+static volatile int stopping;
+
+/** @brief Add to a counter
+ * @param c Counter
+ * @param n Amount to add
+ */
+static inline void counter_add(counter *c, uint64_t n) {
+#if HAVE_STDATOMIC_H
+  atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+#else
+  ferrcheck(pthread_mutex_lock(&stats_lock));
+  *c += n;
+  ferrcheck(pthread_mutex_unlock(&stats_lock));
+#endif
+}
+
+/** @brief Read a counter
+ * @param c Counter
+ * @return Value of counter
+ */
+static inline uint64_t counter_get(counter *c) {
+#if HAVE_STDATOMIC_H
+  return atomic_load_explicit(c, memory_order_relaxed);
+#else
+  uint64_t n;
+
+  ferrcheck(pthread_mutex_lock(&stats_lock));
+  n = *c;
+  ferrcheck(pthread_mutex_unlock(&stats_lock));
+  return n;
+#endif
+}
+
+/** @brief Raise a counter to at least some value
+ * @param c Counter
+ * @param n New minimum value
+ */
+static inline void counter_max(counter *c, uint64_t n) {
+#if HAVE_STDATOMIC_H
+  uint64_t old = atomic_load_explicit(c, memory_order_relaxed);
+
+  while(n > old && !atomic_compare_exchange_weak_explicit(
+                       c, &old, n, memory_order_relaxed, memory_order_relaxed))
+    ;
+#else
+  ferrcheck(pthread_mutex_lock(&stats_lock));
+  if(n > *c)
+    *c = n;
+  ferrcheck(pthread_mutex_unlock(&stats_lock));
+#endif
+}
+
+/** @brief Find the bucket for a value
+ * @param us Value in microseconds
+ * @return Bucket index
+ */
+static unsigned bucket(uint64_t us) {
+  unsigned msb;
+
+  if(us < SUBBUCKETS)
+    return (unsigned)us;
+  msb = 63 - __builtin_clzll(us);
+  if(msb > MAXMSB)
+    return NBUCKETS - 1;
+  return SUBBUCKETS + (msb - SUBBITS) * SUBBUCKETS +
+         (unsigned)((us >> (msb - SUBBITS)) & (SUBBUCKETS - 1));
+}
+
+/** @brief Find the largest value in a bucket
+ * @param b Bucket index
+ * @return Largest value that maps to @p b, in microseconds
+ */
+static uint64_t bucket_limit(unsigned b) {
+  unsigned shift;
+
+  if(b < SUBBUCKETS)
+    return b;
+  shift = (b - SUBBUCKETS) / SUBBUCKETS;
+  return ((uint64_t)(SUBBUCKETS + (b - SUBBUCKETS) % SUBBUCKETS + 1)
+          << shift) -
+         1;
+}
+
+/** @brief Record a value
+ * @param h Histogram
+ * @param ns Value in nanoseconds
+ */
+static void record(struct histogram *h, uint64_t ns) {
+  counter_add(&h->count, 1);
+  counter_add(&h->total, ns);
+  counter_max(&h->max, ns);
+  counter_add(&h->buckets[bucket(ns / 1000)], 1);
+}
+
+/** @brief Find a percentile of a histogram
+ * @param h Histogram
+ * @param count Number of values (as read before the call)
+ * @param centile Percentile to find, times 10
+ * @param max Largest value recorded, in microseconds
+ * @return Upper bound on the percentile, in microseconds
+ */
+static uint64_t percentile(struct histogram *h, uint64_t count,
+                           unsigned centile, uint64_t max) {
+  uint64_t seen = 0, want = (count * centile + 999) / 1000;
+  unsigned b;
+
+  for(b = 0; b < NBUCKETS; ++b) {
+    seen += counter_get(&h->buckets[b]);
+    if(seen >= want && seen)
+      break;
+  }
+  return b < NBUCKETS && bucket_limit(b) < max ? bucket_limit(b) : max;
+}
+
+/** @brief Write one histogram to syslog
+ * @param kind What sort of histogram
+ * @param name Name of histogram
+ * @param h Histogram
+ */
+static void dump_histogram(const char *kind, const char *name,
+                           struct histogram *h) {
+  const uint64_t count = counter_get(&h->count);
+  const uint64_t max = counter_get(&h->max) / 1000;
+
+  if(!count)
+    return;
+  syslog(LOG_INFO,
+         "stats %s=%s count=%" PRIu64 " mean_us=%" PRIu64 " p50_us=%" PRIu64
+         " p90_us=%" PRIu64 " p99_us=%" PRIu64 " p999_us=%" PRIu64
+         " max_us=%" PRIu64,
+         kind, name, count, counter_get(&h->total) / count / 1000,
+         percentile(h, count, 500, max), percentile(h, count, 900, max),
+         percentile(h, count, 990, max), percentile(h, count, 999, max), max);
+}
+
+void sftp_stats_dump(void) {
+  int n;
+
+  for(n = 0; n < NTYPES; ++n)
+    if(typenames[n])
+      dump_histogram("request", typenames[n], &requests[n]);
+  for(n = 0; n < stats_nwaits; ++n)
+    dump_histogram("wait", waitnames[n], &waits[n]);
+  for(n = 0; n < stats_nbytes; ++n)
+    syslog(LOG_INFO, "stats bytes=%s count=%" PRIu64, bytesnames[n],
+           counter_get(&bytes[n]));
+  syslog(LOG_INFO,
+         "stats inflight requests_max=%" PRIu64 " bytes_max=%" PRIu64
+         " stalls=%" PRIu64,
+         counter_get(&inflight_requests_max), counter_get(&inflight_bytes_max),
+         counter_get(&inflight_stalls));
+}
+
+/** @brief Dump statistics on @c SIGUSR1
+ * @param arg Unused
+ * @return Null pointer
+ */
+static void *stats_signal_thread(void attribute((unused)) * arg) {
+  sigset_t ss;
+  int sig;
+
+  sigemptyset(&ss);
+  sigaddset(&ss, SIGUSR1);
+  for(;;) {
+    ferrcheck(sigwait(&ss, &sig));
+    if(stopping)
+      break;
+    sftp_stats_dump();
+  }
+  return NULL;
+}
+
+void sftp_stats_start(void) {
+  sigset_t ss;
+
+  if(!sftpconf_stats)
+    return;
+  sftp_memset(requests, 0, sizeof requests);
+  sftp_memset(waits, 0, sizeof waits);
+  sftp_memset(bytes, 0, sizeof bytes);
+  inflight_requests_max = inflight_bytes_max = inflight_stalls = 0;
+  sigemptyset(&ss);
+  sigaddset(&ss, SIGUSR1);
+  ferrcheck(pthread_sigmask(SIG_BLOCK, &ss, 0));
+  stopping = 0;
+  ferrcheck(pthread_create(&stats_thread, 0, stats_signal_thread, 0));
+  sftp_stats_enabled = 1;
+}
+
+void sftp_stats_stop(void) {
+  if(!sftp_stats_enabled)
+    return;
+  sftp_stats_enabled = 0;
+  stopping = 1;
+  ferrcheck(pthread_kill(stats_thread, SIGUSR1));
+  ferrcheck(pthread_join(stats_thread, 0));
+  sftp_stats_dump();
+}
+
+uint64_t sftp_stats_now(void) {
+  struct timespec ts;
+
+  if(!sftp_stats_enabled)
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** @brief Time elapsed since a timestamp
+ * @param started Timestamp from sftp_stats_now()
+ * @return Nanoseconds elapsed
+ */
+static uint64_t elapsed(uint64_t started) {
+  const uint64_t now = sftp_stats_now();
+
+  return now > started ? now - started : 0;
+}
+
+void sftp_stats_request(int type, uint64_t started) {
+  if(!started || !sftp_stats_enabled)
+    return;
+  if(type == SSH_FXP_EXTENDED)
+    type = NTYPES - 1;
+  else if(type < 0 || type >= NTYPES - 1)
+    return;
+  record(&requests[type], elapsed(started));
+}
+
+void sftp_stats_wait(enum stats_wait which, uint64_t started) {
+  if(!started || !sftp_stats_enabled)
+    return;
+  record(&waits[which], elapsed(started));
+}
+
+void sftp_stats_bytes(enum stats_bytes which, uint64_t n) {
+  if(sftp_stats_enabled)
+    counter_add(&bytes[which], n);
+}
+
+void sftp_stats_inflight(uint64_t requests, uint64_t nbytes, int stalled) {
+  if(!sftp_stats_enabled)
+    return;
+  counter_max(&inflight_requests_max, requests);
+  counter_max(&inflight_bytes_max, nbytes);
+  if(stalled)
+    counter_add(&inflight_stalls, 1);
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
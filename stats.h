@@ -0,0 +1,116 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file stats.h @brief Performance statistics interface
+ *
+ * When the @c stats directive is enabled, the server keeps counters and
+ * latency histograms for each request type, along with time spent waiting for
+ * a worker thread and for serialization and the high-water mark of requests
+ * held in memory.  They are written to syslog at the
+ * end of each session and whenever the server receives @c SIGUSR1.
+ */
+
+#ifndef STATS_H
+#  define STATS_H
+
+#  include <stdint.h>
+
+/** @brief Non-0 if statistics are being collected */
+extern int sftp_stats_enabled;
+
+/** @brief Things that are waited for */
+enum stats_wait {
+  /** @brief Waiting in the work queue for a worker thread */
+  stats_wait_queue,
+
+  /** @brief Waiting for conflicting requests to complete */
+  stats_wait_serialize,
+
+  /** @brief Number of kinds of wait */
+  stats_nwaits
+};
+
+/** @brief Directions of data transfer */
+enum stats_bytes {
+  /** @brief Bytes read from files */
+  stats_bytes_read,
+
+  /** @brief Bytes written to files */
+  stats_bytes_written,
+
+  /** @brief Number of directions */
+  stats_nbytes
+};
+
+/** @brief Start collecting statistics for a session
+ *
+ * Does nothing unless the @c stats directive is enabled.  Otherwise, clears
+ * all the counters and starts a thread to dump them on @c SIGUSR1.  Must be
+ * called before any other threads are created, since it blocks @c SIGUSR1 in
+ * the calling thread and they inherit that.
+ */
+void sftp_stats_start(void);
+
+/** @brief Stop collecting statistics and dump them */
+void sftp_stats_stop(void);
+
+/** @brief Write the statistics to syslog */
+void sftp_stats_dump(void);
+
+/** @brief Get a timestamp
+ * @return Monotonic time in nanoseconds, or 0 if statistics are disabled
+ */
+uint64_t sftp_stats_now(void);
+
+/** @brief Record a completed request
+ * @param type Request type
+ * @param started Timestamp from sftp_stats_now() taken beforehand
+ */
+void sftp_stats_request(int type, uint64_t started);
+
+/** @brief Record a wait
+ * @param which What was waited for
+ * @param started Timestamp from sftp_stats_now() when the wait began
+ */
+void sftp_stats_wait(enum stats_wait which, uint64_t started);
+
+/** @brief Record a data transfer
+ * @param which Direction of transfer
+ * @param n Number of bytes
+ */
+void sftp_stats_bytes(enum stats_bytes which, uint64_t n);
+
+/** @brief Record the requests held in memory
+ * @param requests Number of requests in flight
+ * @param bytes Bytes of request data in flight
+ * @param stalled Non-0 if the reader had to wait for the in-flight budget
+ */
+void sftp_stats_inflight(uint64_t requests, uint64_t bytes, int stalled);
+
+#endif /* STATS_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -100,6 +100,24 @@ const char *status_to_string(uint32_t status) {
   }
 }
 
+/** @brief Limit a status code to those known to the current protocol
+ * @param status Status code
+ * @return Status code to send
+ */
+static uint32_t status_limit(uint32_t status) {
+  if(status > protocol->maxstatus) {
+    switch(status) {
+    case SSH_FX_INVALID_FILENAME:
+      return SSH_FX_BAD_MESSAGE;
+    case SSH_FX_NO_SUCH_PATH:
+      return SSH_FX_NO_SUCH_FILE;
+    default:
+      return SSH_FX_FAILURE;
+    }
+  }
+  return status;
+}
+
 void sftp_send_status(struct sftpjob *job, uint32_t status, const char *msg) {
   if(status == HANDLER_ERRNO) {
     /* Bodge to allow us to treat -1 as a magical status meaning 'consult
@@ -113,19 +131,7 @@ void sftp_send_status(struct sftpjob *job, uint32_t status, const char *msg) {
   if(!msg)
     msg = status_to_string(status);
   /* Limit to status values known to this version of the protocol */
-  if(status > protocol->maxstatus) {
-    switch(status) {
-    case SSH_FX_INVALID_FILENAME:
-      status = SSH_FX_BAD_MESSAGE;
-      break;
-    case SSH_FX_NO_SUCH_PATH:
-      status = SSH_FX_NO_SUCH_FILE;
-      break;
-    default:
-      status = SSH_FX_FAILURE;
-      break;
-    }
-  }
+  status = status_limit(status);
   sftp_send_begin(job->worker);
   sftp_send_uint8(job->worker, SSH_FXP_STATUS);
   sftp_send_uint32(job->worker, job->id);
@@ -165,15 +171,28 @@ static const struct {
     {-1, SSH_FX_FAILURE},
 };
 
-void sftp_send_errno_status(struct sftpjob *job) {
+/** @brief Find the status code for an @c errno value
+ * @param errno_value @c errno value
+ * @return Status code, not limited to the current protocol
+ */
+static uint32_t errno_lookup(int errno_value) {
   int n;
-  const int errno_value = errno;
 
   for(n = 0;
       errnotab[n].errno_value != errno_value && errnotab[n].errno_value != -1;
       ++n)
     ;
-  sftp_send_status(job, errnotab[n].status_value, strerror(errno_value));
+  return errnotab[n].status_value;
+}
+
+void sftp_send_errno_status(struct sftpjob *job) {
+  const int errno_value = errno;
+
+  sftp_send_status(job, errno_lookup(errno_value), strerror(errno_value));
+}
+
+uint32_t sftp_errno_to_status(int errno_value) {
+  return status_limit(errno_lookup(errno_value));
 }
 
 /*
@@ -0,0 +1,284 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file sync.c @brief Batched file synchronization
+ *
+ * Implements group commit for @c fsync@openssh.com and for syncs on close.
+ * Workers hand each request to a single sync thread and move on.  The sync
+ * thread takes everything that has accumulated, synchronizes it and then
+ * responds to each request, so while one batch is being flushed the next one
+ * builds up.  Where @ref SYNCFSBATCH or more files in a batch are on the same
+ * filesystem, one @c syncfs() call does the bulk of the work for them all,
+ * and a following @c fsync() of each file collects its own result.
+ *
+ * The same thread also closes handles in the background, since @c close()
+ * can flush dirty data and take a long time on network filesystems.  Where
+ * nobody needs to know the result the request has already been answered;
+ * otherwise the response is sent once the file is closed.  Closes are done
+ * before the batch is synchronized so they do not wait behind it.
+ */
+
+#include "sftpserver.h"
+#include "sync.h"
+#include "types.h"
+#include "sftp.h"
+#include "alloc.h"
+#include "thread.h"
+#include "utils.h"
+#include "debug.h"
+#include "pool.h"
+#include "input.h"
+#include "serialize.h"
+#include "session.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/** @brief One outstanding sync */
+struct syncreq {
+  /** @brief Next request in batch */
+  struct syncreq *next;
+
+  /** @brief Job to respond to, or a null pointer */
+  struct sftpjob *job;
+
+  /** @brief File descriptor to synchronize or close, or -1 */
+  int fd;
+
+  /** @brief Directory stream to close, or a null pointer */
+  DIR *dir;
+
+  /** @brief Nonzero to synchronize before closing */
+  int sync;
+
+  /** @brief Device containing the file, or -1 if unknown */
+  dev_t dev;
+
+  /** @brief Nonzero once synchronized */
+  int done;
+
+  /** @brief @c errno value from synchronizing, or 0 */
+  int error;
+};
+
+/** @brief Lock protecting the sync state */
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Signaled when a request is added, or on shutdown */
+static pthread_cond_t sync_ready = PTHREAD_COND_INITIALIZER;
+
+/** @brief Requests waiting for the next batch, oldest first */
+static struct syncreq *pending;
+
+/** @brief Where to add the next pending request */
+static struct syncreq **pendingtail = &pending;
+
+/** @brief Sync thread */
+static pthread_t sync_thread_id;
+
+/** @brief Nonzero if the sync thread is running */
+static int sync_running;
+
+/** @brief Set to shut down the sync thread */
+static int sync_stopping;
+
+/** @brief Worker state constructor */
+static void *(*sync_winit)(void);
+
+/** @brief Worker state destructor */
+static void (*sync_wcleanup)(void *);
+
+/** @brief Synchronize a batch
+ * @param batch Requests to synchronize
+ */
+static void sync_batch(struct syncreq *batch) {
+  struct syncreq *r;
+#if HAVE_SYNCFS
+  struct syncreq *s;
+  size_t n;
+  int error;
+#endif
+
+  for(r = batch; r; r = r->next) {
+    if(r->done || !r->sync)
+      continue;
+#if HAVE_SYNCFS
+    n = 0;
+    if(r->dev != (dev_t)-1)
+      for(s = r; s; s = s->next)
+        if(!s->done && s->sync && s->dev == r->dev)
+          ++n;
+    if(n >= SYNCFSBATCH) {
+      /* Flush the whole filesystem once rather than each file in turn.
+       * syncfs() does not say which file a writeback error belongs to, so
+       * each file is then fsync'd too; with its data already written out
+       * this is cheap, and it reports that file's own errors. */
+      error = syncfs(r->fd) < 0 ? errno : 0;
+      D(("syncfs for %zu files: %s", n, error ? strerror(error) : "ok"));
+      for(s = r; s; s = s->next)
+        if(!s->done && s->sync && s->dev == r->dev) {
+          s->error = fsync(s->fd) < 0 ? errno : 0;
+          s->done = 1;
+        }
+      continue;
+    }
+#endif
+    r->error = fsync(r->fd) < 0 ? errno : 0;
+    r->done = 1;
+  }
+}
+
+/** @brief Close, respond to and free the requests in a batch
+ * @param batchp Batch, updated to hold the requests left behind
+ * @param w Worker state
+ * @param a Allocator
+ * @param all Nonzero to finish all requests, 0 for those not needing a sync
+ */
+static void sync_finish(struct syncreq **batchp, void *w,
+                        struct allocator *a, int all) {
+  struct syncreq *r;
+  struct sftpjob *job;
+  int error;
+
+  while((r = *batchp)) {
+    if(!all && r->sync) {
+      batchp = &r->next;
+      continue;
+    }
+    *batchp = r->next;
+    error = r->error;
+    if(r->fd >= 0 && close(r->fd) < 0 && !error)
+      error = errno;
+    if(r->dir && closedir(r->dir) < 0 && !error)
+      error = errno;
+    if((job = r->job)) {
+      job->worker = w;
+      job->a = a;
+      sftp_session_enter(job->session);
+      errno = error;
+      sftp_send_status(job, error ? HANDLER_ERRNO : SSH_FX_OK, 0);
+      sftp_alloc_reset(a);
+      sftp_input_free(job);
+    }
+    sftp_pool_free(r);
+  }
+}
+
+/** @brief Sync thread
+ * @param arg Unused
+ * @return Null pointer
+ */
+static void *sync_thread(void attribute((unused)) * arg) {
+  void *const w = sync_winit();
+  struct allocator a;
+  struct syncreq *batch;
+
+  sftp_alloc_init(&a);
+  ferrcheck(pthread_mutex_lock(&sync_lock));
+  for(;;) {
+    while(!pending && !sync_stopping)
+      ferrcheck(pthread_cond_wait(&sync_ready, &sync_lock));
+    if(!pending)
+      break;
+    batch = pending;
+    pending = NULL;
+    pendingtail = &pending;
+    ferrcheck(pthread_mutex_unlock(&sync_lock));
+    sync_finish(&batch, w, &a, 0);
+    sync_batch(batch);
+    sync_finish(&batch, w, &a, 1);
+    ferrcheck(pthread_mutex_lock(&sync_lock));
+  }
+  ferrcheck(pthread_mutex_unlock(&sync_lock));
+  sftp_alloc_destroy(&a);
+  sync_wcleanup(w);
+  return NULL;
+}
+
+void sftp_sync_start(void *(*winit)(void), void (*wcleanup)(void *)) {
+  sync_winit = winit;
+  sync_wcleanup = wcleanup;
+}
+
+void sftp_sync_stop(void) {
+  if(!sync_running)
+    return;
+  ferrcheck(pthread_mutex_lock(&sync_lock));
+  sync_stopping = 1;
+  ferrcheck(pthread_cond_signal(&sync_ready));
+  ferrcheck(pthread_mutex_unlock(&sync_lock));
+  ferrcheck(pthread_join(sync_thread_id, 0));
+  sync_running = 0;
+  sync_stopping = 0;
+}
+
+/** @brief Hand a request to the sync thread
+ * @param job Job to respond to, or a null pointer
+ * @param fd File descriptor, or -1
+ * @param dir Directory stream, or a null pointer
+ * @param sync Nonzero to synchronize @p fd before closing it
+ */
+static void sync_add(struct sftpjob *job, int fd, DIR *dir, int sync) {
+  struct syncreq *r = sftp_pool_alloc(sizeof *r);
+  struct stat sb;
+
+  r->next = NULL;
+  r->job = job;
+  r->fd = fd;
+  r->dir = dir;
+  r->sync = sync;
+  r->dev = sync && fstat(fd, &sb) == 0 ? sb.st_dev : (dev_t)-1;
+  r->done = 0;
+  r->error = 0;
+  if(job)
+    serialize_remove_job(job);
+  ferrcheck(pthread_mutex_lock(&sync_lock));
+  *pendingtail = r;
+  pendingtail = &r->next;
+  if(!sync_running) {
+    ferrcheck(pthread_create(&sync_thread_id, 0, sync_thread, 0));
+    sync_running = 1;
+  } else
+    ferrcheck(pthread_cond_signal(&sync_ready));
+  ferrcheck(pthread_mutex_unlock(&sync_lock));
+}
+
+void sftp_sync_submit(struct sftpjob *job, int fd) {
+  sync_add(job, fd, NULL, 1);
+}
+
+void sftp_sync_close(struct sftpjob *job, int fd) {
+  sync_add(job, fd, NULL, 0);
+}
+
+void sftp_sync_discard(int fd, DIR *dir) {
+  sync_add(NULL, fd, dir, 0);
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
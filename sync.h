@@ -0,0 +1,78 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file sync.h @brief Batched file synchronization interface */
+
+#ifndef SYNC_H
+#  define SYNC_H
+
+#  include <dirent.h>
+
+struct sftpjob;
+
+/** @brief Set up batched synchronization
+ * @param winit Creates worker state for the sync thread
+ * @param wcleanup Destroys worker state created by @p winit
+ *
+ * The sync thread itself is only started when the first request arrives.
+ */
+void sftp_sync_start(void *(*winit)(void), void (*wcleanup)(void *));
+
+/** @brief Wait for outstanding syncs and stop the sync thread */
+void sftp_sync_stop(void);
+
+/** @brief Make a file durable and then respond
+ * @param job Job to respond to
+ * @param fd File descriptor to synchronize, which is closed afterwards
+ *
+ * The job is removed from the serialization queue at once, since a sync has
+ * no effect that later requests could see, and the caller must return
+ * @ref HANDLER_ASYNC.  Requests that arrive while a batch is being
+ * synchronized are collected into the next batch.
+ */
+void sftp_sync_submit(struct sftpjob *job, int fd);
+
+/** @brief Close a file and then respond
+ * @param job Job to respond to
+ * @param fd File descriptor to close
+ *
+ * The response reports any error from @c close().  As with
+ * sftp_sync_submit(), the caller must return @ref HANDLER_ASYNC.
+ */
+void sftp_sync_close(struct sftpjob *job, int fd);
+
+/** @brief Close a file or directory in the background
+ * @param fd File descriptor to close, or -1
+ * @param dir Directory stream to close, or a null pointer
+ *
+ * Any error is ignored, so this is for handles whose close cannot lose data.
+ */
+void sftp_sync_discard(int fd, DIR *dir);
+
+#endif /* SYNC_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
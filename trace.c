@@ -0,0 +1,524 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file trace.c @brief Debug tracing implementation
+ *
+ * Each thread that traces a message gets a ring of @ref TRACESLOTS fixed-size
+ * slots the first time it does so.  Only that thread adds records and only
+ * the trace thread removes them, so the ring needs no lock: the two sides
+ * just publish their own index.  The trace thread wakes every
+ * @ref TRACEINTERVAL milliseconds and writes out the records from all the
+ * rings, oldest first.
+ *
+ * @ref trace_lock protects the list of rings.  Threads only take it to
+ * create or give up their ring.
+ */
+
+#include "sftpserver.h"
+#include "sftpconf.h"
+#include "types.h"
+#include "sftp.h"
+#include "debug.h"
+#include "utils.h"
+#include "thread.h"
+#include "trace.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
+/** @brief Number of slots in each thread's ring */
+#define TRACESLOTS 1024
+
+/** @brief Bytes of each message always copied
+ *
+ * Enough for the type, ID and a handle, which is all most requests need to be
+ * recognized. */
+#define TRACEHEADER 32
+
+/** @brief How often the trace thread writes out records, in milliseconds */
+#define TRACEINTERVAL 10
+
+#if HAVE_STDATOMIC_H
+/** @brief Type of ring indexes */
+typedef atomic_size_t tracecount;
+#else
+typedef size_t tracecount;
+#endif
+
+/** @brief A trace record
+ *
+ * Followed in its slot by @ref copied bytes of the message.
+ */
+struct tracerecord {
+  /** @brief When the message was traced, in nanoseconds since tracing began */
+  uint64_t when;
+
+  /** @brief Length of the whole message */
+  size_t length;
+
+  /** @brief Number of bytes copied */
+  size_t copied;
+
+  /** @brief Direction of message */
+  enum trace_direction direction;
+};
+
+/** @brief One thread's trace records */
+struct tracering {
+  /** @brief Next ring */
+  struct tracering *next;
+
+  /** @brief Worker that owns this ring, or a null pointer once released */
+  struct worker *owner;
+
+  /** @brief Number of ring, for the output */
+  unsigned number;
+
+  /** @brief Slots */
+  unsigned char *slots;
+
+  /** @brief Number of records ever added (written by the owner) */
+  tracecount head;
+
+  /** @brief Number of records ever written out (written by the trace thread)
+   */
+  tracecount tail;
+
+  /** @brief Number of records dropped since last reported */
+  tracecount dropped;
+
+#if !HAVE_STDATOMIC_H
+  /** @brief Lock protecting the indexes */
+  pthread_mutex_t m;
+#endif
+};
+
+int sftp_trace_enabled;
+
+/** @brief Lock protecting @ref rings */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Signaled to stop the trace thread */
+static pthread_cond_t trace_wake = PTHREAD_COND_INITIALIZER;
+
+/** @brief All rings */
+static struct tracering *rings;
+
+/** @brief Number of rings created */
+static unsigned nrings;
+
+/** @brief Size of each slot */
+static size_t slotsize;
+
+/** @brief When tracing began */
+static struct timespec epoch;
+
+/** @brief Trace thread */
+static pthread_t trace_thread_id;
+
+/** @brief Set to stop the trace thread */
+static int stopping;
+
+/** @brief Non-0 if @ref types restricts tracing */
+static int filtered;
+
+/** @brief Bitmap of message types to trace */
+static unsigned char types[256 / 8];
+
+/** @brief Names of message types */
+static const struct {
+  /** @brief Name */
+  const char *name;
+
+  /** @brief Type */
+  int type;
+} typenames[] = {
+    {"init", SSH_FXP_INIT},
+    {"version", SSH_FXP_VERSION},
+    {"open", SSH_FXP_OPEN},
+    {"close", SSH_FXP_CLOSE},
+    {"read", SSH_FXP_READ},
+    {"write", SSH_FXP_WRITE},
+    {"lstat", SSH_FXP_LSTAT},
+    {"fstat", SSH_FXP_FSTAT},
+    {"setstat", SSH_FXP_SETSTAT},
+    {"fsetstat", SSH_FXP_FSETSTAT},
+    {"opendir", SSH_FXP_OPENDIR},
+    {"readdir", SSH_FXP_READDIR},
+    {"remove", SSH_FXP_REMOVE},
+    {"mkdir", SSH_FXP_MKDIR},
+    {"rmdir", SSH_FXP_RMDIR},
+    {"realpath", SSH_FXP_REALPATH},
+    {"stat", SSH_FXP_STAT},
+    {"rename", SSH_FXP_RENAME},
+    {"readlink", SSH_FXP_READLINK},
+    {"symlink", SSH_FXP_SYMLINK},
+    {"link", SSH_FXP_LINK},
+    {"block", SSH_FXP_BLOCK},
+    {"unblock", SSH_FXP_UNBLOCK},
+    {"status", SSH_FXP_STATUS},
+    {"handle", SSH_FXP_HANDLE},
+    {"data", SSH_FXP_DATA},
+    {"name", SSH_FXP_NAME},
+    {"attrs", SSH_FXP_ATTRS},
+    {"extended", SSH_FXP_EXTENDED},
+    {"extended-reply", SSH_FXP_EXTENDED_REPLY},
+};
+
+/** @brief Number of message type names */
+#define NTYPENAMES (sizeof typenames / sizeof *typenames)
+
+const char *sftp_trace_type_name(int type) {
+  size_t n;
+
+  for(n = 0; n < NTYPENAMES; ++n)
+    if(typenames[n].type == type)
+      return typenames[n].name;
+  return NULL;
+}
+
+int sftp_trace_types(const char *list) {
+  char name[32], *end;
+  size_t n, len;
+  long type;
+
+  sftp_memset(types, 0, sizeof types);
+  filtered = 1;
+  while(*list) {
+    len = strcspn(list, ",");
+    if(len && len < sizeof name) {
+      memcpy(name, list, len);
+      name[len] = 0;
+      for(n = 0; n < NTYPENAMES && strcmp(name, typenames[n].name); ++n)
+        ;
+      if(n < NTYPENAMES)
+        type = typenames[n].type;
+      else {
+        errno = 0;
+        type = strtol(name, &end, 10);
+        if(errno || *end || type < 0 || type > 255)
+          return -1;
+      }
+      types[type / 8] |= 1 << (type % 8);
+    } else if(len)
+      return -1;
+    list += len;
+    if(*list == ',')
+      ++list;
+  }
+  return 0;
+}
+
+/** @brief Read a ring index
+ * @param r Ring
+ * @param c Index to read
+ * @return Value of index
+ */
+static size_t ring_get(struct tracering attribute((unused)) * r,
+                       tracecount *c) {
+#if HAVE_STDATOMIC_H
+  return atomic_load_explicit(c, memory_order_acquire);
+#else
+  size_t value;
+
+  ferrcheck(pthread_mutex_lock(&r->m));
+  value = *c;
+  ferrcheck(pthread_mutex_unlock(&r->m));
+  return value;
+#endif
+}
+
+/** @brief Publish a ring index
+ * @param r Ring
+ * @param c Index to set
+ * @param value New value
+ */
+static void ring_set(struct tracering attribute((unused)) * r, tracecount *c,
+                     size_t value) {
+#if HAVE_STDATOMIC_H
+  atomic_store_explicit(c, value, memory_order_release);
+#else
+  ferrcheck(pthread_mutex_lock(&r->m));
+  *c = value;
+  ferrcheck(pthread_mutex_unlock(&r->m));
+#endif
+}
+
+/** @brief Count or collect dropped records
+ * @param r Ring
+ * @param add Non-0 to count a dropped record, 0 to collect the count
+ * @return Number of dropped records collected
+ */
+static size_t ring_dropped(struct tracering *r, int add) {
+  size_t value = 0;
+
+#if HAVE_STDATOMIC_H
+  if(add)
+    atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+  else
+    value = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+#else
+  ferrcheck(pthread_mutex_lock(&r->m));
+  if(add)
+    ++r->dropped;
+  else {
+    value = r->dropped;
+    r->dropped = 0;
+  }
+  ferrcheck(pthread_mutex_unlock(&r->m));
+#endif
+  return value;
+}
+
+/** @brief Find a record in a ring
+ * @param r Ring
+ * @param index Index of record
+ * @return Record
+ */
+static struct tracerecord *ring_record(struct tracering *r, size_t index) {
+  return (struct tracerecord *)(r->slots + (index % TRACESLOTS) * slotsize);
+}
+
+/** @brief Create a ring for a worker
+ * @param w Worker
+ * @return New ring
+ */
+static struct tracering *ring_new(struct worker *w) {
+  struct tracering *r = sftp_xmalloc(sizeof *r);
+
+  r->owner = w;
+  r->slots = sftp_xmalloc(TRACESLOTS * slotsize);
+#if HAVE_STDATOMIC_H
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  atomic_init(&r->dropped, 0);
+#else
+  r->head = r->tail = r->dropped = 0;
+  ferrcheck(pthread_mutex_init(&r->m, 0));
+#endif
+  ferrcheck(pthread_mutex_lock(&trace_lock));
+  r->number = nrings++;
+  r->next = rings;
+  rings = r;
+  ferrcheck(pthread_mutex_unlock(&trace_lock));
+  return r;
+}
+
+/** @brief Destroy a ring
+ * @param r Ring
+ */
+static void ring_free(struct tracering *r) {
+#if !HAVE_STDATOMIC_H
+  ferrcheck(pthread_mutex_destroy(&r->m));
+#endif
+  free(r->slots);
+  free(r);
+}
+
+void sftp_trace(struct worker *w, enum trace_direction direction,
+                const void *msg, size_t n, size_t length) {
+  const unsigned char *m = msg;
+  struct tracering *r;
+  struct tracerecord *rec;
+  struct timespec now;
+  size_t head;
+  uint32_t id;
+
+  if(!n)
+    return;
+  if(filtered && !(types[m[0] / 8] & (1 << (m[0] % 8))))
+    return;
+  /* Sample by ID, so that responses are kept along with their requests */
+  if(sftpconf_trace_sample > 1 && n >= 5 && m[0] != SSH_FXP_INIT &&
+     m[0] != SSH_FXP_VERSION) {
+    id = (uint32_t)m[1] << 24 | (uint32_t)m[2] << 16 | (uint32_t)m[3] << 8 |
+         m[4];
+    if(id % sftpconf_trace_sample)
+      return;
+  }
+  if(!(r = w->trace))
+    r = w->trace = ring_new(w);
+  head = ring_get(r, &r->head);
+  if(head - ring_get(r, &r->tail) >= TRACESLOTS) {
+    ring_dropped(r, 1);
+    return;
+  }
+  rec = ring_record(r, head);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  rec->when = (uint64_t)(now.tv_sec - epoch.tv_sec) * 1000000000 +
+              now.tv_nsec - epoch.tv_nsec;
+  rec->length = length;
+  rec->copied = n < slotsize - sizeof *rec ? n : slotsize - sizeof *rec;
+  rec->direction = direction;
+  memcpy(rec + 1, m, rec->copied);
+  ring_set(r, &r->head, head + 1);
+}
+
+/** @brief Write out one trace record
+ * @param r Ring containing record
+ * @param rec Record
+ */
+static void trace_write(const struct tracering *r,
+                        const struct tracerecord *rec) {
+  const unsigned char *m = (const unsigned char *)(rec + 1);
+  const char *name;
+  char type[16], id[24];
+
+  if((name = sftp_trace_type_name(m[0])))
+    snprintf(type, sizeof type, "%s", name);
+  else
+    snprintf(type, sizeof type, "type %u", m[0]);
+  if(rec->copied >= 5 && m[0] != SSH_FXP_INIT && m[0] != SSH_FXP_VERSION)
+    snprintf(id, sizeof id, " id %" PRIu32,
+             (uint32_t)m[1] << 24 | (uint32_t)m[2] << 16 |
+                 (uint32_t)m[3] << 8 | m[4]);
+  else
+    id[0] = 0;
+  sftp_debug_printf("trace %" PRIu64 ".%06" PRIu64 " thread %u %s %s%s"
+                    " length %zu",
+                    rec->when / 1000000000, rec->when / 1000 % 1000000,
+                    r->number,
+                    rec->direction == trace_request ? "request" : "response",
+                    type, id, rec->length);
+  sftp_debug_hexdump(m, rec->copied);
+}
+
+/** @brief Write out all complete records
+ *
+ * Must be called with @ref trace_lock held.  Released rings are destroyed
+ * once they are empty.
+ */
+static void trace_drain(void) {
+  struct tracering *r, *best, **rr;
+  struct tracerecord *rec, *bestrec = NULL;
+  size_t tail, dropped;
+
+  for(;;) {
+    best = NULL;
+    for(r = rings; r; r = r->next) {
+      tail = ring_get(r, &r->tail);
+      if(ring_get(r, &r->head) == tail)
+        continue;
+      rec = ring_record(r, tail);
+      if(!best || rec->when < bestrec->when) {
+        best = r;
+        bestrec = rec;
+      }
+    }
+    if(!best)
+      break;
+    trace_write(best, bestrec);
+    ring_set(best, &best->tail, ring_get(best, &best->tail) + 1);
+  }
+  for(rr = &rings; (r = *rr);) {
+    if((dropped = ring_dropped(r, 0)))
+      sftp_debug_printf("trace thread %u dropped %zu records", r->number,
+                        dropped);
+    if(!r->owner && ring_get(r, &r->head) == ring_get(r, &r->tail)) {
+      *rr = r->next;
+      ring_free(r);
+    } else
+      rr = &r->next;
+  }
+}
+
+/** @brief Trace thread
+ * @param arg Unused
+ * @return Null pointer
+ */
+static void *trace_thread(void attribute((unused)) * arg) {
+  struct timespec ts;
+  int rc;
+
+  ferrcheck(pthread_mutex_lock(&trace_lock));
+  while(!stopping) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += TRACEINTERVAL * 1000000;
+    if(ts.tv_nsec >= 1000000000) {
+      ++ts.tv_sec;
+      ts.tv_nsec -= 1000000000;
+    }
+    rc = pthread_cond_timedwait(&trace_wake, &trace_lock, &ts);
+    if(rc && rc != ETIMEDOUT)
+      ferrcheck(rc);
+    trace_drain();
+  }
+  ferrcheck(pthread_mutex_unlock(&trace_lock));
+  return NULL;
+}
+
+void sftp_trace_start(void) {
+  if(!sftpconf_trace || !sftp_debugging)
+    return;
+  /* Keep records aligned */
+  slotsize = (sizeof(struct tracerecord) + TRACEHEADER +
+              sftpconf_trace_payload + 7) & ~(size_t)7;
+  clock_gettime(CLOCK_MONOTONIC, &epoch);
+  stopping = 0;
+  nrings = 0;
+  ferrcheck(pthread_create(&trace_thread_id, 0, trace_thread, 0));
+  sftp_trace_enabled = 1;
+}
+
+void sftp_trace_stop(void) {
+  struct tracering *r;
+
+  if(!sftp_trace_enabled)
+    return;
+  sftp_trace_enabled = 0;
+  ferrcheck(pthread_mutex_lock(&trace_lock));
+  stopping = 1;
+  ferrcheck(pthread_cond_signal(&trace_wake));
+  ferrcheck(pthread_mutex_unlock(&trace_lock));
+  ferrcheck(pthread_join(trace_thread_id, 0));
+  ferrcheck(pthread_mutex_lock(&trace_lock));
+  trace_drain();
+  while((r = rings)) {
+    rings = r->next;
+    if(r->owner)
+      r->owner->trace = NULL;
+    ring_free(r);
+  }
+  ferrcheck(pthread_mutex_unlock(&trace_lock));
+}
+
+void sftp_trace_release(struct worker *w) {
+  if(!w->trace)
+    return;
+  ferrcheck(pthread_mutex_lock(&trace_lock));
+  w->trace->owner = NULL;
+  w->trace = NULL;
+  ferrcheck(pthread_mutex_unlock(&trace_lock));
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
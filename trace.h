@@ -0,0 +1,108 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file trace.h @brief Debug tracing interface
+ *
+ * With the @c trace directive, debug dumps of requests and responses are
+ * copied into a ring belonging to the thread that handles them, and a
+ * background thread writes them to the debug output.  Nothing is written
+ * while a lock is held, and when a ring is full the record is dropped rather
+ * than making the thread wait.
+ */
+
+#ifndef TRACE_H
+#  define TRACE_H
+
+#  include <stddef.h>
+
+struct worker;
+
+/** @brief Non-0 if messages are being traced */
+extern int sftp_trace_enabled;
+
+/** @brief Directions of messages */
+enum trace_direction {
+  /** @brief A request from the client */
+  trace_request,
+
+  /** @brief A response to the client */
+  trace_response
+};
+
+/** @brief Find the name of a message type
+ * @param type Message type
+ * @return Name of the \c SSH_FXP_ constant in lower case, or a null pointer
+ */
+const char *sftp_trace_type_name(int type);
+
+/** @brief Restrict tracing to some message types
+ * @param list Comma-separated list of type names or numbers
+ * @return 0 on success, -1 if @p list contains an unknown type
+ *
+ * Names are those of the \c SSH_FXP_ constants in lower case, e.g. @c read
+ * or @c data.
+ */
+int sftp_trace_types(const char *list);
+
+/** @brief Start tracing
+ *
+ * Does nothing unless both the @c trace directive and debugging are
+ * enabled.  Otherwise, starts the thread that writes out trace records and
+ * sets @ref sftp_trace_enabled.
+ */
+void sftp_trace_start(void);
+
+/** @brief Stop tracing
+ *
+ * Writes out any records not yet written.  Tracing must not be in progress
+ * in any other thread.
+ */
+void sftp_trace_stop(void);
+
+/** @brief Trace a message
+ * @param w Worker state of the calling thread
+ * @param direction Direction of message
+ * @param msg Message, starting with its type byte
+ * @param n Number of bytes available at @p msg
+ * @param length Length of the whole message
+ *
+ * @ref sftp_trace_enabled must be nonzero.  @p length exceeds @p n when the
+ * rest of the message is sent from somewhere else, e.g. a mapped file.
+ */
+void sftp_trace(struct worker *w, enum trace_direction direction,
+                const void *msg, size_t n, size_t length);
+
+/** @brief Release a worker's trace ring
+ * @param w Worker state that is about to be destroyed
+ *
+ * Records already in the ring are still written out.
+ */
+void sftp_trace_release(struct worker *w);
+
+#endif /* TRACE_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
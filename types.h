@@ -217,6 +217,15 @@ struct worker {
 
   /** @brief Conversion descriptor mapping the UTF-8 to the local encoding */
   iconv_t utf8_to_local;
+
+  /** @brief Non-0 if ASCII strings are the same in both encodings */
+  int ascii_passthrough;
+
+  /** @brief Non-0 if valid UTF-8 strings are the same in both encodings */
+  int utf8_passthrough;
+
+  /** @brief Trace ring, created when the thread first traces a message */
+  struct tracering *trace;
 };
 /* Thread-specific data */
 
@@ -244,6 +253,15 @@ struct sftpjob {
 
   /** @brief Worker processing this job */
   struct worker *worker; /* worker processing this job */
+
+  /** @brief Session the request came from */
+  struct session *session;
+
+  /** @brief Serialization queue entry, or a null pointer */
+  struct sqnode *sq;
+
+  /** @brief When the job was added to the work queue, or 0 */
+  uint64_t queued;
 };
 
 /** @brief An SFTP request */
@@ -255,6 +273,15 @@ struct sftpcmd {
   uint32_t (*handler)(struct sftpjob *job);
 };
 
+/** @brief Initializer for an entry in a table of @ref sftpcmd
+ * @param TYPE Message type
+ * @param HANDLER Request handler
+ *
+ * Tables are indexed directly by message type, so looking up a handler takes
+ * constant time.  Types with no entry get a null handler.
+ */
+#  define SFTPCMD(TYPE, HANDLER) [TYPE] = {TYPE, HANDLER}
+
 /** @brief An SFTP extension request */
 struct sftpextension {
   /** @brief Extension name */
@@ -267,20 +294,52 @@ struct sftpextension {
   uint32_t (*handler)(struct sftpjob *job);
 };
 
+/** @brief Size of an extension hash index (a power of 2)
+ *
+ * This limits the number of extensions that can be indexed; beyond that,
+ * lookup falls back to a linear search.
+ */
+#  define EXTINDEXSIZE 128
+
+/** @brief Perfect hash index of a protocol's extensions
+ *
+ * Filled in by sftp_extensions_index() when a session first selects the
+ * protocol.
+ */
+struct sftpextindex {
+  /** @brief Non-0 once the index has been built */
+  int indexed;
+
+  /** @brief Hash seed with no collisions, or 0 if none was found */
+  uint32_t seed;
+
+  /** @brief Mask applied to hash values */
+  uint32_t mask;
+
+  /** @brief 1 + index into the extension table, or 0 for an empty slot */
+  unsigned char slots[EXTINDEXSIZE];
+};
+
 /** @brief Internal error code meaning "already responded" */
 #  define HANDLER_RESPONDED ((uint32_t)-1)
 
 /** @brief Internal error code meaning "consult errno" */
 #  define HANDLER_ERRNO ((uint32_t)-2)
 
+/** @brief Internal error code meaning "will respond asynchronously"
+ *
+ * The job has been handed on and will be responded to, removed from the
+ * serialization queue and freed elsewhere. */
+#  define HANDLER_ASYNC ((uint32_t)-3)
+
 /** @brief Definition of an SFTP protocol version */
 struct sftpprotocol {
-  /** @brief Number of request types supported */
+  /** @brief Size of @ref commands */
   int ncommands;
 
   /** @brief Supported request types
    *
-   * Sorted by the request type code. */
+   * Indexed by the request type code, see SFTPCMD(). */
   const struct sftpcmd *commands;
 
   /** @brief Protocol version number */
@@ -334,8 +393,11 @@ struct sftpprotocol {
 
   /** @brief Supported extension types
    *
-   * Sorted by the extension name. */
+   * In the order they are advertised. */
   const struct sftpextension *extensions;
+
+  /** @brief Hash index of @ref extensions, or a null pointer */
+  struct sftpextindex *extindex;
 };
 /* An SFTP protocol version */
 
@@ -0,0 +1,413 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file uring.c @brief Asynchronous file IO using io_uring
+ *
+ * Normally each read or write occupies a worker thread for the duration of
+ * the system call, so no more than @ref sftpconf_nthreads disk operations
+ * can be outstanding.  With this engine, handlers queue their IO on a single
+ * io_uring and return at once, freeing the worker for the next request.  A
+ * dedicated completion thread collects results, sends responses and retires
+ * the jobs.
+ *
+ * The ring is driven directly with system calls rather than through liburing,
+ * and uses only the vectored read and write operations, which are the
+ * oldest.
+ */
+
+#include "sftpserver.h"
+#include "uring.h"
+#include "types.h"
+#include "alloc.h"
+#include "thread.h"
+#include "utils.h"
+#include "debug.h"
+#include "serialize.h"
+#include "pool.h"
+#include "input.h"
+#include "session.h"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#if HAVE_LINUX_IO_URING_H && HAVE_STDATOMIC_H
+#  include <linux/io_uring.h>
+#  include <sys/syscall.h>
+#  include <sys/mman.h>
+#  include <sys/uio.h>
+#  include <stdatomic.h>
+#  include <unistd.h>
+#endif
+
+int sftp_uring;
+
+#if HAVE_LINUX_IO_URING_H && HAVE_STDATOMIC_H
+
+/** @brief One outstanding IO request */
+struct uringop {
+  /** @brief Job that issued the request */
+  struct sftpjob *job;
+
+  /** @brief Completion callback */
+  sftp_uring_done *done;
+
+  /** @brief @c IORING_OP_READV or @c IORING_OP_WRITEV */
+  uint8_t opcode;
+
+  /** @brief File descriptor */
+  int fd;
+
+  /** @brief Offset of start of request */
+  uint64_t offset;
+
+  /** @brief Buffer */
+  void *buf;
+
+  /** @brief Total request length */
+  size_t len;
+
+  /** @brief Bytes transferred so far */
+  size_t sofar;
+
+  /** @brief IO vector for the current submission */
+  struct iovec iov;
+};
+
+/** @brief The ring file descriptor */
+static int ring_fd = -1;
+
+/** @brief Submission queue ring mapping */
+static void *sq_map;
+
+/** @brief Size of @ref sq_map */
+static size_t sq_mapsize;
+
+/** @brief Completion queue ring mapping (may equal @ref sq_map) */
+static void *cq_map;
+
+/** @brief Size of @ref cq_map */
+static size_t cq_mapsize;
+
+/** @brief Submission queue entries */
+static struct io_uring_sqe *sqes;
+
+/** @brief Size of @ref sqes in bytes */
+static size_t sqes_size;
+
+/** @brief Submission queue tail */
+static unsigned *sq_tail;
+
+/** @brief Submission queue mask */
+static unsigned sq_mask;
+
+/** @brief Submission queue index array */
+static unsigned *sq_array;
+
+/** @brief Completion queue head */
+static unsigned *cq_head;
+
+/** @brief Completion queue tail */
+static unsigned *cq_tail;
+
+/** @brief Completion queue mask */
+static unsigned cq_mask;
+
+/** @brief Completion queue entries */
+static struct io_uring_cqe *cqes;
+
+/** @brief Maximum requests in flight */
+static unsigned ring_entries;
+
+/** @brief Requests in flight */
+static unsigned inflight;
+
+/** @brief Lock protecting submission and @ref inflight */
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Signaled when @ref inflight decreases */
+static pthread_cond_t uring_space = PTHREAD_COND_INITIALIZER;
+
+/** @brief Completion thread */
+static pthread_t uring_thread_id;
+
+/** @brief Worker state destructor */
+static void (*uring_wcleanup)(void *);
+
+/** @brief Worker state constructor */
+static void *(*uring_winit)(void);
+
+/** @brief Submit a request
+ * @param op Request, or a null pointer to wake the completion thread up for
+ * shutdown
+ *
+ * Must be called with @ref uring_lock held.
+ */
+static void uring_submit(struct uringop *op) {
+  const unsigned tail = *sq_tail, index = tail & sq_mask;
+  struct io_uring_sqe *const sqe = &sqes[index];
+
+  sftp_memset(sqe, 0, sizeof *sqe);
+  if(op) {
+    op->iov.iov_base = (char *)op->buf + op->sofar;
+    op->iov.iov_len = op->len - op->sofar;
+    sqe->opcode = op->opcode;
+    sqe->fd = op->fd;
+    sqe->off = op->offset + op->sofar;
+    sqe->addr = (uintptr_t)&op->iov;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t)op;
+  } else
+    sqe->opcode = IORING_OP_NOP;
+  sq_array[index] = index;
+  atomic_store_explicit((_Atomic unsigned *)sq_tail, tail + 1,
+                        memory_order_release);
+  while(syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, NULL, 0) < 0)
+    if(errno != EINTR && errno != EAGAIN)
+      sftp_fatal("io_uring_enter: %s", strerror(errno));
+}
+
+/** @brief Queue a new request
+ * @param op Request
+ */
+static void uring_queue(struct uringop *op) {
+  ferrcheck(pthread_mutex_lock(&uring_lock));
+  /* Limiting the number in flight to the ring size guarantees that neither
+   * the submission nor the completion queue can overflow */
+  while(inflight >= ring_entries)
+    ferrcheck(pthread_cond_wait(&uring_space, &uring_lock));
+  ++inflight;
+  uring_submit(op);
+  ferrcheck(pthread_mutex_unlock(&uring_lock));
+}
+
+/** @brief Handle one completion
+ * @param op Request
+ * @param res Result
+ * @param w Worker state
+ * @param a Allocator
+ */
+static void uring_complete(struct uringop *op, int res, struct worker *w,
+                           struct allocator *a) {
+  struct sftpjob *const job = op->job;
+
+  if(res > 0 && op->opcode == IORING_OP_WRITEV
+     && op->sofar + res < op->len) {
+    /* Short writes aren't allowed so we write the rest */
+    op->sofar += res;
+    ferrcheck(pthread_mutex_lock(&uring_lock));
+    uring_submit(op);
+    ferrcheck(pthread_mutex_unlock(&uring_lock));
+    return;
+  }
+  if(res >= 0)
+    res += op->sofar;
+  job->worker = w;
+  job->a = a;
+  sftp_session_enter(job->session);
+  op->done(job, res, op->buf);
+  sftp_alloc_reset(a);
+  serialize_remove_job(job);
+  sftp_input_free(job);
+  if(op->opcode == IORING_OP_READV)
+    sftp_pool_free(op->buf);
+  sftp_pool_free(op);
+  ferrcheck(pthread_mutex_lock(&uring_lock));
+  --inflight;
+  ferrcheck(pthread_cond_signal(&uring_space));
+  ferrcheck(pthread_mutex_unlock(&uring_lock));
+}
+
+/** @brief Completion thread
+ * @param arg Unused
+ * @return Null pointer
+ */
+static void *uring_thread(void attribute((unused)) * arg) {
+  void *const w = uring_winit();
+  struct allocator a;
+  unsigned head, tail;
+  struct uringop *op;
+  int res;
+
+  sftp_alloc_init(&a);
+  for(;;) {
+    head = *cq_head;
+    tail = atomic_load_explicit((_Atomic unsigned *)cq_tail,
+                                memory_order_acquire);
+    if(head == tail) {
+      if(syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS,
+                 NULL, 0) < 0
+         && errno != EINTR)
+        sftp_fatal("io_uring_enter: %s", strerror(errno));
+      continue;
+    }
+    op = (struct uringop *)(uintptr_t)cqes[head & cq_mask].user_data;
+    res = cqes[head & cq_mask].res;
+    atomic_store_explicit((_Atomic unsigned *)cq_head, head + 1,
+                          memory_order_release);
+    if(!op)
+      break;
+    uring_complete(op, res, w, &a);
+  }
+  sftp_alloc_destroy(&a);
+  uring_wcleanup(w);
+  return NULL;
+}
+
+int sftp_uring_start(void *(*winit)(void), void (*wcleanup)(void *)) {
+  struct io_uring_params p;
+  unsigned char *sq, *cq;
+  int fd;
+
+  sftp_memset(&p, 0, sizeof p);
+  if((fd = syscall(__NR_io_uring_setup, URINGDEPTH, &p)) < 0) {
+    D(("io_uring_setup: %s", strerror(errno)));
+    return -1;
+  }
+  sq_mapsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_mapsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    if(cq_mapsize > sq_mapsize)
+      sq_mapsize = cq_mapsize;
+    cq_mapsize = 0;
+  }
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  sq = mmap(0, sq_mapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_SQ_RING);
+  if(sq == MAP_FAILED)
+    sftp_fatal("mmap io_uring: %s", strerror(errno));
+  if(cq_mapsize) {
+    cq = mmap(0, cq_mapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, IORING_OFF_CQ_RING);
+    if(cq == MAP_FAILED)
+      sftp_fatal("mmap io_uring: %s", strerror(errno));
+  } else
+    cq = sq;
+  sqes = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, IORING_OFF_SQES);
+  if(sqes == MAP_FAILED)
+    sftp_fatal("mmap io_uring: %s", strerror(errno));
+  sq_map = sq;
+  cq_map = cq;
+  sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  sq_array = (unsigned *)(sq + p.sq_off.array);
+  cq_head = (unsigned *)(cq + p.cq_off.head);
+  cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  ring_entries = p.sq_entries;
+  ring_fd = fd;
+  uring_winit = winit;
+  uring_wcleanup = wcleanup;
+  ferrcheck(pthread_create(&uring_thread_id, 0, uring_thread, 0));
+  sftp_uring = 1;
+  D(("io_uring started with %u entries", ring_entries));
+  return 0;
+}
+
+void sftp_uring_stop(void) {
+  if(!sftp_uring)
+    return;
+  ferrcheck(pthread_mutex_lock(&uring_lock));
+  while(inflight)
+    ferrcheck(pthread_cond_wait(&uring_space, &uring_lock));
+  uring_submit(NULL);
+  ferrcheck(pthread_mutex_unlock(&uring_lock));
+  ferrcheck(pthread_join(uring_thread_id, 0));
+  munmap(sqes, sqes_size);
+  if(cq_map != sq_map)
+    munmap(cq_map, cq_mapsize);
+  munmap(sq_map, sq_mapsize);
+  close(ring_fd);
+  ring_fd = -1;
+  sftp_uring = 0;
+}
+
+void sftp_uring_read(struct sftpjob *job, int fd, uint64_t offset, size_t len,
+                     sftp_uring_done *done) {
+  struct uringop *op = sftp_pool_alloc(sizeof *op);
+
+  op->job = job;
+  op->done = done;
+  op->opcode = IORING_OP_READV;
+  op->fd = fd;
+  op->offset = offset;
+  op->buf = sftp_pool_alloc(len);
+  op->len = len;
+  op->sofar = 0;
+  uring_queue(op);
+}
+
+void sftp_uring_write(struct sftpjob *job, int fd, uint64_t offset,
+                      const void *buf, size_t len, sftp_uring_done *done) {
+  struct uringop *op = sftp_pool_alloc(sizeof *op);
+
+  op->job = job;
+  op->done = done;
+  op->opcode = IORING_OP_WRITEV;
+  op->fd = fd;
+  op->offset = offset;
+  op->buf = (void *)buf;
+  op->len = len;
+  op->sofar = 0;
+  uring_queue(op);
+}
+
+#else
+
+int sftp_uring_start(void *(*winit)(void), void (*wcleanup)(void *)) {
+  (void)winit;
+  (void)wcleanup;
+  return -1;
+}
+
+void sftp_uring_stop(void) {}
+
+void sftp_uring_read(struct sftpjob *job, int fd, uint64_t offset, size_t len,
+                     sftp_uring_done *done) {
+  (void)job;
+  (void)fd;
+  (void)offset;
+  (void)len;
+  (void)done;
+  sftp_fatal("io_uring not available");
+}
+
+void sftp_uring_write(struct sftpjob *job, int fd, uint64_t offset,
+                      const void *buf, size_t len, sftp_uring_done *done) {
+  (void)job;
+  (void)fd;
+  (void)offset;
+  (void)buf;
+  (void)len;
+  (void)done;
+  sftp_fatal("io_uring not available");
+}
+
+#endif
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,100 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file uring.h @brief Asynchronous file IO interface */
+
+#ifndef URING_H
+#  define URING_H
+
+#  include <stddef.h>
+#  include <stdint.h>
+#  include <sys/types.h>
+
+struct sftpjob;
+
+/** @brief Completion callback
+ * @param job Job that issued the request
+ * @param res Bytes transferred, or a negated @c errno value
+ * @param buf Data read (for reads)
+ *
+ * Completion callbacks run on the completion thread, with @c job->worker
+ * and @c job->a set to that thread's worker state and allocator.  The
+ * callback must send the response; after it returns the job is removed from
+ * the serialization queue and freed, and @p buf is freed.
+ */
+typedef void sftp_uring_done(struct sftpjob *job, ssize_t res, void *buf);
+
+/** @brief Nonzero if the asynchronous IO engine is running */
+extern int sftp_uring;
+
+/** @brief Start the asynchronous IO engine
+ * @param winit Creates worker state for the completion thread
+ * @param wcleanup Destroys worker state created by @p winit
+ * @return 0 on success, -1 if not available
+ *
+ * On success @ref sftp_uring is set.
+ */
+int sftp_uring_start(void *(*winit)(void), void (*wcleanup)(void *));
+
+/** @brief Stop the asynchronous IO engine
+ *
+ * Waits for outstanding requests to complete.  Does nothing if the engine
+ * was never started.
+ */
+void sftp_uring_stop(void);
+
+/** @brief Start an asynchronous read
+ * @param job Job to respond to
+ * @param fd File to read
+ * @param offset Offset to read from
+ * @param len Maximum bytes to read
+ * @param done Completion callback
+ *
+ * The handler must return @ref HANDLER_ASYNC after calling this.  Short reads
+ * are reported as-is.
+ */
+void sftp_uring_read(struct sftpjob *job, int fd, uint64_t offset, size_t len,
+                     sftp_uring_done *done);
+
+/** @brief Start an asynchronous write
+ * @param job Job to respond to
+ * @param fd File to write
+ * @param offset Offset to write at
+ * @param buf Data to write (must remain valid until the job is complete)
+ * @param len Number of bytes to write
+ * @param done Completion callback
+ *
+ * The handler must return @ref HANDLER_ASYNC after calling this.  Short writes
+ * are continued automatically, so the callback sees either @p len or an
+ * error.
+ */
+void sftp_uring_write(struct sftpjob *job, int fd, uint64_t offset,
+                      const void *buf, size_t len, sftp_uring_done *done);
+
+#endif /* URING_H */
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -18,30 +18,254 @@
  * USA
  */
 
+/** @file users.c @brief User and group name lookup
+ *
+ * Every entry in a v4+ directory listing needs its owner and group names,
+ * and on hosts that get users from a directory service each NSS lookup can
+ * mean a network round trip.  So results, including failed lookups, are
+ * cached for @ref sftpconf_user_cache_ttl seconds.  The caches are protected
+ * by read-write locks so that hits from different threads don't serialize;
+ * NSS itself is still only called with @ref user_lock held.
+ */
+
 #include "sftpserver.h"
 #include "users.h"
 #include "alloc.h"
 #include "thread.h"
 #include "utils.h"
+#include "sftpconf.h"
 #include <pwd.h>
 #include <grp.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#if HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
+#ifndef USERCACHEBUCKETS
+/** @brief Number of hash buckets per cache */
+#  define USERCACHEBUCKETS 256
+#endif
+
+#ifndef USERCACHEMAX
+/** @brief Maximum entries per cache before it is flushed */
+#  define USERCACHEMAX 4096
+#endif
+
+#if HAVE_STDATOMIC_H
+/** @brief Type of cache counters */
+typedef atomic_ulong usercount;
+#else
+typedef unsigned long usercount;
+#endif
+
+/** @brief One cached lookup */
+struct userentry {
+  /** @brief Next entry in the same bucket */
+  struct userentry *next;
+
+  /** @brief UID or GID */
+  unsigned long id;
+
+  /** @brief User or group name, or a null pointer */
+  char *name;
+
+  /** @brief Nonzero if the lookup succeeded */
+  int found;
+
+  /** @brief When this entry expires */
+  time_t expires;
+};
+
+/** @brief A cache of lookups in one direction */
+struct usercache {
+  /** @brief Nonzero if keyed by name, 0 if keyed by ID */
+  int byname;
+
+  /** @brief Hash buckets */
+  struct userentry *buckets[USERCACHEBUCKETS];
+
+  /** @brief Number of entries */
+  size_t nentries;
+
+  /** @brief Lock protecting the cache contents */
+  pthread_rwlock_t lock;
+
+  /** @brief Successful cache lookups */
+  usercount hits;
+
+  /** @brief Failed cache lookups */
+  usercount misses;
+};
 
 /* We don't rely on the C library doing the right thing */
 static pthread_mutex_t user_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/** @brief UID to name cache */
+static struct usercache uid_cache = {0, {0}, 0, PTHREAD_RWLOCK_INITIALIZER,
+                                     0, 0};
+
+/** @brief GID to name cache */
+static struct usercache gid_cache = {0, {0}, 0, PTHREAD_RWLOCK_INITIALIZER,
+                                     0, 0};
+
+/** @brief User name to UID cache */
+static struct usercache uname_cache = {1, {0}, 0, PTHREAD_RWLOCK_INITIALIZER,
+                                       0, 0};
+
+/** @brief Group name to GID cache */
+static struct usercache gname_cache = {1, {0}, 0, PTHREAD_RWLOCK_INITIALIZER,
+                                       0, 0};
+
+/** @brief Increment a cache counter
+ * @param c Counter
+ */
+static void user_count(usercount *c) {
+#if HAVE_STDATOMIC_H
+  atomic_fetch_add_explicit(c, 1, memory_order_relaxed);
+#else
+  ferrcheck(pthread_mutex_lock(&user_lock));
+  ++*c;
+  ferrcheck(pthread_mutex_unlock(&user_lock));
+#endif
+}
+
+/** @brief Find the bucket for a key
+ * @param c Cache
+ * @param id Key, if the cache is keyed by ID
+ * @param name Key, if the cache is keyed by name
+ * @return Pointer to bucket
+ */
+static struct userentry **cache_bucket(struct usercache *c, unsigned long id,
+                                       const char *name) {
+  unsigned long h = id;
+
+  if(c->byname)
+    for(h = 0; *name; ++name)
+      h = 31 * h + (unsigned char)*name;
+  return &c->buckets[h % USERCACHEBUCKETS];
+}
+
+/** @brief Test whether an entry matches a key
+ * @param c Cache
+ * @param e Entry
+ * @param id Key, if the cache is keyed by ID
+ * @param name Key, if the cache is keyed by name
+ * @return Nonzero on a match
+ */
+static int cache_match(const struct usercache *c, const struct userentry *e,
+                       unsigned long id, const char *name) {
+  return c->byname ? !strcmp(e->name, name) : e->id == id;
+}
+
+/** @brief Look up a cached result
+ * @param c Cache
+ * @param a Allocator for returned name
+ * @param id Key, if the cache is keyed by ID
+ * @param name Key, if the cache is keyed by name
+ * @param idp Where to store ID, if the cache is keyed by name
+ * @param namep Where to store name, if the cache is keyed by ID
+ * @return Nonzero on a cache hit
+ *
+ * A cached failure is a hit, with -1 or a null pointer stored.
+ */
+static int cache_lookup(struct usercache *c, struct allocator *a,
+                        unsigned long id, const char *name,
+                        unsigned long *idp, char **namep) {
+  const struct userentry *e;
+  int hit = 0;
+
+  if(!sftpconf_user_cache_ttl)
+    return 0;
+  ferrcheck(pthread_rwlock_rdlock(&c->lock));
+  for(e = *cache_bucket(c, id, name); e; e = e->next)
+    if(cache_match(c, e, id, name)) {
+      if(e->expires > time(NULL)) {
+        if(c->byname)
+          *idp = e->found ? e->id : (unsigned long)-1;
+        else
+          *namep = e->found ? strcpy(sftp_alloc_raw(a, strlen(e->name) + 1),
+                                     e->name)
+                            : NULL;
+        hit = 1;
+      }
+      break;
+    }
+  ferrcheck(pthread_rwlock_unlock(&c->lock));
+  user_count(hit ? &c->hits : &c->misses);
+  return hit;
+}
+
+/** @brief Discard all entries in a cache
+ * @param c Cache
+ *
+ * Must be called with the cache's lock held for writing.
+ */
+static void cache_flush(struct usercache *c) {
+  struct userentry *e;
+  size_t n;
+
+  for(n = 0; n < USERCACHEBUCKETS; ++n)
+    while((e = c->buckets[n])) {
+      c->buckets[n] = e->next;
+      free(e->name);
+      free(e);
+    }
+  c->nentries = 0;
+}
+
+/** @brief Record the result of a lookup
+ * @param c Cache
+ * @param id ID (key or result)
+ * @param name Name (key or result), or a null pointer
+ * @param found Nonzero if the lookup succeeded
+ *
+ * For ID-keyed caches, @p name may be a null pointer if @p found is 0.
+ */
+static void cache_insert(struct usercache *c, unsigned long id,
+                         const char *name, int found) {
+  struct userentry *e, **bp;
+
+  if(!sftpconf_user_cache_ttl)
+    return;
+  ferrcheck(pthread_rwlock_wrlock(&c->lock));
+  if(c->nentries >= USERCACHEMAX)
+    cache_flush(c);
+  bp = cache_bucket(c, id, name);
+  for(e = *bp; e && !cache_match(c, e, id, name); e = e->next)
+    ;
+  if(!e) {
+    e = sftp_xmalloc(sizeof *e);
+    e->next = *bp;
+    e->name = NULL;
+    *bp = e;
+    ++c->nentries;
+  }
+  if(e->name != name) {
+    free(e->name);
+    e->name = name ? sftp_xstrdup(name) : NULL;
+  }
+  e->id = id;
+  e->found = found;
+  e->expires = time(NULL) + sftpconf_user_cache_ttl;
+  ferrcheck(pthread_rwlock_unlock(&c->lock));
+}
+
 char *sftp_uid2name(struct allocator *a, uid_t uid) {
   char *s;
   const struct passwd *pw;
 
+  if(cache_lookup(&uid_cache, a, uid, NULL, NULL, &s))
+    return s;
   ferrcheck(pthread_mutex_lock(&user_lock));
   if((pw = getpwuid(uid)))
-    s = strcpy(sftp_alloc(a, strlen(pw->pw_name) + 1), pw->pw_name);
+    s = strcpy(sftp_alloc_raw(a, strlen(pw->pw_name) + 1), pw->pw_name);
   else
     s = 0;
   ferrcheck(pthread_mutex_unlock(&user_lock));
+  cache_insert(&uid_cache, uid, s, s != NULL);
   return s;
 }
 
@@ -49,41 +273,59 @@ char *sftp_gid2name(struct allocator *a, gid_t gid) {
   char *s;
   const struct group *gr;
 
+  if(cache_lookup(&gid_cache, a, gid, NULL, NULL, &s))
+    return s;
   ferrcheck(pthread_mutex_lock(&user_lock));
   if((gr = getgrgid(gid)))
-    s = strcpy(sftp_alloc(a, strlen(gr->gr_name) + 1), gr->gr_name);
+    s = strcpy(sftp_alloc_raw(a, strlen(gr->gr_name) + 1), gr->gr_name);
   else
     s = 0;
   ferrcheck(pthread_mutex_unlock(&user_lock));
+  cache_insert(&gid_cache, gid, s, s != NULL);
   return s;
 }
 
 uid_t sftp_name2uid(const char *name) {
   const struct passwd *pw;
+  unsigned long id;
   uid_t uid;
 
+  if(cache_lookup(&uname_cache, NULL, 0, name, &id, NULL))
+    return id == (unsigned long)-1 ? (uid_t)-1 : (uid_t)id;
   ferrcheck(pthread_mutex_lock(&user_lock));
   if((pw = getpwnam(name)))
     uid = pw->pw_uid;
   else
     uid = -1;
   ferrcheck(pthread_mutex_unlock(&user_lock));
+  cache_insert(&uname_cache, uid, name, pw != NULL);
   return uid;
 }
 
 gid_t sftp_name2gid(const char *name) {
   const struct group *gr;
+  unsigned long id;
   gid_t gid;
 
+  if(cache_lookup(&gname_cache, NULL, 0, name, &id, NULL))
+    return id == (unsigned long)-1 ? (gid_t)-1 : (gid_t)id;
   ferrcheck(pthread_mutex_lock(&user_lock));
   if((gr = getgrnam(name)))
     gid = gr->gr_gid;
   else
     gid = -1;
   ferrcheck(pthread_mutex_unlock(&user_lock));
+  cache_insert(&gname_cache, gid, name, gr != NULL);
   return gid;
 }
 
+void sftp_user_cache_stats(unsigned long *hits, unsigned long *misses) {
+  *hits = uid_cache.hits + gid_cache.hits + uname_cache.hits
+          + gname_cache.hits;
+  *misses = uid_cache.misses + gid_cache.misses + uname_cache.misses
+            + gname_cache.misses;
+}
+
 /*
 Local Variables:
 c-basic-offset:2
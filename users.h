@@ -30,6 +30,12 @@ char *sftp_gid2name(struct allocator *a, gid_t gid);
 uid_t sftp_name2uid(const char *name);
 gid_t sftp_name2gid(const char *name);
 
+/** @brief Retrieve user and group cache statistics
+ * @param hits Where to store number of cache hits
+ * @param misses Where to store number of cache misses
+ */
+void sftp_user_cache_stats(unsigned long *hits, unsigned long *misses);
+
 #endif /* USERS_H */
 
 /*
@@ -155,6 +155,21 @@ char *sftp_find_realpath(struct allocator *a, const char *path, unsigned flags);
  */
 #  define RP_MUST_EXIST 0x0002
 
+/** @brief Enable the sftp_find_realpath() cache
+ * @param ttl Lifetime of cache entries in seconds, or 0 to disable
+ *
+ * Symbolic link lookups on path prefixes and the current directory are
+ * cached.  The cache is disabled by default.
+ */
+void sftp_realpath_cache_init(int ttl);
+
+/** @brief Discard the sftp_find_realpath() cache
+ *
+ * Call this after any namespace change that could turn a cached prefix into
+ * or out of a symbolic link.
+ */
+void sftp_realpath_invalidate(void);
+
 /** @brief Compute the name of the current directory
  * @param a Allocator to store result
  * @return Name of current directory, or a null pointer
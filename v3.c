@@ -30,7 +30,19 @@
 #include "globals.h"
 #include "stat.h"
 #include "utils.h"
+#include "stats.h"
 #include "serialize.h"
+#include "statbatch.h"
+#include "statcache.h"
+#include "uring.h"
+#include "sync.h"
+#include "walk.h"
+#include "dirfetch.h"
+#include "lineindex.h"
+#include "mapread.h"
+#include "direct.h"
+#include "compress.h"
+#include "sftpconf.h"
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
@@ -231,7 +243,8 @@ uint32_t sftp_vany_remove(struct sftpjob *job) {
 
   if(readonly)
     return SSH_FX_PERMISSION_DENIED;
-  pcheck(sftp_parse_path(job, &path));
+  sftp_statcache_invalidate();
+  pcheck(sftp_parse_path_borrow(job, &path));
   D(("sftp_vany_remove %s", path));
   if(unlink(path) < 0) {
     if(errno == EPERM || errno == EINVAL) {
@@ -241,8 +254,9 @@ uint32_t sftp_vany_remove(struct sftpjob *job) {
       errno = save_errno;
     }
     return HANDLER_ERRNO;
-  } else
-    return SSH_FX_OK;
+  }
+  sftp_realpath_invalidate();
+  return SSH_FX_OK;
 }
 
 uint32_t sftp_vany_rmdir(struct sftpjob *job) {
@@ -250,15 +264,17 @@ uint32_t sftp_vany_rmdir(struct sftpjob *job) {
 
   if(readonly)
     return SSH_FX_PERMISSION_DENIED;
-  pcheck(sftp_parse_path(job, &path));
+  sftp_statcache_invalidate();
+  pcheck(sftp_parse_path_borrow(job, &path));
   D(("sftp_vany_rmdir %s", path));
-  if(rmdir(path) < 0)
+  if(rmdir(path) < 0) {
     if(errno == EEXIST || errno == ENOTEMPTY)
       return SSH_FX_DIR_NOT_EMPTY;
     else
       return HANDLER_ERRNO;
-  else
-    return SSH_FX_OK;
+  }
+  sftp_realpath_invalidate();
+  return SSH_FX_OK;
 }
 
 uint32_t sftp_v34_rename(struct sftpjob *job) {
@@ -266,8 +282,9 @@ uint32_t sftp_v34_rename(struct sftpjob *job) {
 
   if(readonly)
     return SSH_FX_PERMISSION_DENIED;
-  pcheck(sftp_parse_path(job, &oldpath));
-  pcheck(sftp_parse_path(job, &newpath));
+  sftp_statcache_invalidate();
+  pcheck(sftp_parse_path_borrow(job, &oldpath));
+  pcheck(sftp_parse_path_borrow(job, &newpath));
   D(("sftp_v34_rename %s %s", oldpath, newpath));
   /* newpath is not allowed to exist.  We enforce this atomically by attempting
      to link() from oldpath to newpath and unlinking oldpath if it succeeds. */
@@ -303,8 +320,6 @@ uint32_t sftp_v34_rename(struct sftpjob *job) {
 #endif
       if(rename(oldpath, newpath) < 0)
         return HANDLER_ERRNO;
-      else
-        return SSH_FX_OK;
     } else
       return HANDLER_ERRNO;
   } else if(unlink(oldpath) < 0) {
@@ -312,8 +327,9 @@ uint32_t sftp_v34_rename(struct sftpjob *job) {
     unlink(newpath);
     errno = save_errno;
     return HANDLER_ERRNO;
-  } else
-    return SSH_FX_OK;
+  }
+  sftp_realpath_invalidate();
+  return SSH_FX_OK;
 }
 
 uint32_t sftp_v345_symlink(struct sftpjob *job) {
@@ -321,6 +337,7 @@ uint32_t sftp_v345_symlink(struct sftpjob *job) {
 
   if(readonly)
     return SSH_FX_PERMISSION_DENIED;
+  sftp_statcache_invalidate();
   /* The spec is fairly clear.  linkpath is first, targetpath is second.
    * linkpath is the name of the symlink to be created and targetpath is the
    * contents.  This is the reverse of the symlink() call and the ln command,
@@ -363,11 +380,11 @@ uint32_t sftp_v345_symlink(struct sftpjob *job) {
    * extension documenting server behaviour is sent in that case too.
    */
   if(reverse_symlink) {
-    pcheck(sftp_parse_string(job, &targetpath, 0));
-    pcheck(sftp_parse_path(job, &linkpath));
+    pcheck(sftp_parse_string_borrow(job, &targetpath, 0));
+    pcheck(sftp_parse_path_borrow(job, &linkpath));
   } else {
-    pcheck(sftp_parse_path(job, &linkpath));
-    pcheck(sftp_parse_string(job, &targetpath, 0));
+    pcheck(sftp_parse_path_borrow(job, &linkpath));
+    pcheck(sftp_parse_string_borrow(job, &targetpath, 0));
   }
   D(("sftp_v345_symlink %s %s", targetpath, linkpath));
   if(strlen(targetpath) == 0) {
@@ -381,15 +398,15 @@ uint32_t sftp_v345_symlink(struct sftpjob *job) {
   pcheck(protocol->decode(job, &targetpath));
   if(symlink(targetpath, linkpath) < 0)
     return HANDLER_ERRNO;
-  else
-    return SSH_FX_OK;
+  sftp_realpath_invalidate();
+  return SSH_FX_OK;
 }
 
 uint32_t sftp_vany_readlink(struct sftpjob *job) {
   char *path, *result;
   struct sftpattr attr;
 
-  pcheck(sftp_parse_path(job, &path));
+  pcheck(sftp_parse_path_borrow(job, &path));
   D(("sftp_vany_readlink %s", path));
   if(!(result = sftp_do_readlink(job->a, path))) {
     if(errno == E2BIG) {
@@ -412,12 +429,18 @@ uint32_t sftp_vany_opendir(struct sftpjob *job) {
   char *path;
   DIR *dp;
   struct handleid id;
+  uint32_t rc;
 
-  pcheck(sftp_parse_path(job, &path));
+  pcheck(sftp_parse_path_borrow(job, &path));
   D(("sftp_vany_opendir %s", path));
   if(!(dp = opendir(path)))
     return HANDLER_ERRNO;
-  sftp_handle_new_dir(&id, dp, path);
+  if((rc = sftp_handle_new_dir(&id, dp, path))) {
+    const int save_errno = errno;
+    closedir(dp);
+    errno = save_errno;
+    return rc;
+  }
   D(("...handle is %" PRIu32 " %" PRIu32, id.id, id.tag));
   sftp_send_begin(job->worker);
   sftp_send_uint8(job->worker, SSH_FXP_HANDLE);
@@ -429,72 +452,108 @@ uint32_t sftp_vany_opendir(struct sftpjob *job) {
 
 uint32_t sftp_vany_readdir(struct sftpjob *job) {
   struct handleid id;
-  DIR *dp;
-  uint32_t rc;
-  struct sftpattr d[MAXNAMES];
-  int n;
-  struct dirent *de;
-  const char *path;
-  char *childpath, *fullpath;
-  struct stat sb;
+  uint32_t rc, mask;
+  struct sftpattr *d;
+  struct statreq *reqs;
+  struct dirfetch *f;
+  size_t n, i;
+  int error;
+  struct walk *w;
 
   pcheck(sftp_parse_handle(job, &id));
   D(("sftp_vany_readdir %" PRIu32 " %" PRIu32, id.id, id.tag));
-  if((rc = sftp_handle_get_dir(&id, &dp, &path))) {
+  if(!sftp_handle_get_walk(&id, &w))
+    return sftp_walk_readdir(job, w);
+  if((rc = sftp_handle_get_dir(&id, &f, &mask))) {
     sftp_send_status(job, rc, "invalid directory handle");
     return HANDLER_RESPONDED;
   }
-  sftp_memset(d, 0, sizeof d);
-  for(n = 0; n < MAXNAMES;) {
-    /* readdir() has a slightly shonky interface - a null return can mean EOF
-     * or error, and there is no guarantee that errno is reset to 0 on EOF. */
-    errno = 0;
-    de = readdir(dp);
-    if(!de)
-      break;
-    /* We include . and .. in the list - if the cliient doesn't like them it
-     * can filter them out itself. */
-    childpath = strcpy(sftp_alloc(job->a, strlen(de->d_name) + 1), de->d_name);
-    /* We need the full path to be able to stat the file */
-    fullpath = sftp_alloc(job->a, strlen(path) + strlen(childpath) + 2);
-    strcpy(fullpath, path);
-    strcat(fullpath, "/");
-    strcat(fullpath, childpath);
-    if(lstat(fullpath, &sb))
+  if((error = sftp_dirfetch_next(f, mask, &reqs, &n))) {
+    errno = error;
+    return HANDLER_ERRNO;
+  }
+  d = sftp_alloc(job->a, (n ? n : 1) * sizeof *d);
+  for(i = 0; i < n; ++i) {
+    if(reqs[i].error) {
+      errno = reqs[i].error;
       return HANDLER_ERRNO;
-    sftp_stat_to_attrs(job->a, &sb, &d[n], 0xFFFFFFFF, childpath);
-    d[n].name = childpath;
-    ++n;
-    errno = 0; /* avoid error slippage from
-                * e.g. getpwuid() failure */
+    }
+    sftp_stat_to_attrs(job->a, &reqs[i].sb, &d[i], mask, reqs[i].name);
+    d[i].name = reqs[i].name;
   }
-
-  if(errno)
-    return HANDLER_ERRNO;
   if(n) {
     sftp_send_begin(job->worker);
     sftp_send_uint8(job->worker, SSH_FXP_NAME);
     sftp_send_uint32(job->worker, job->id);
-    protocol->sendnames(job, n, d);
+    protocol->sendnames(job, (int)n, d);
     sftp_send_end(job->worker);
+    /* Get the next batch ready while this one is on its way */
+    sftp_dirfetch_ahead(f);
     return HANDLER_RESPONDED;
   } else
     return SSH_FX_EOF;
 }
 
+uint32_t sftp_vany_readdir_mask(struct sftpjob *job) {
+  struct handleid id;
+  uint32_t mask;
+
+  pcheck(sftp_parse_handle(job, &id));
+  pcheck(sftp_parse_uint32(job, &mask));
+  D(("sftp_vany_readdir_mask %" PRIu32 " %" PRIu32 " %#" PRIx32, id.id,
+     id.tag, mask));
+  /* In version 3 one bit stands for both timestamps */
+  if(protocol->version == 3 && (mask & SSH_FILEXFER_ACMODTIME))
+    mask |= SSH_FILEXFER_ATTR_MODIFYTIME;
+  return sftp_handle_set_attrmask(&id, mask);
+}
+
 uint32_t sftp_vany_close(struct sftpjob *job) {
   struct handleid id;
 
   pcheck(sftp_parse_handle(job, &id));
   D(("sftp_vany_close %" PRIu32 " %" PRIu32, id.id, id.tag));
-  return sftp_handle_close(&id);
+  return sftp_generic_close(job, &id);
+}
+
+uint32_t sftp_generic_close(struct sftpjob *job, const struct handleid *id) {
+  int fd, fl, save_errno;
+  DIR *dir;
+  uint32_t rc;
+
+  /* The handle is destroyed now but the close itself is left to the sync
+   * thread, so a slow close() holds up neither this worker nor anyone
+   * else. */
+  if((rc = sftp_handle_release(id, &fd, &dir))) {
+    /* A write failed, so there is nothing to gain by waiting */
+    save_errno = errno;
+    if(fd >= 0)
+      close(fd);
+    errno = save_errno;
+    return rc;
+  }
+  if(fd < 0 && !dir)
+    return 0; /* a directory walk or watch, already destroyed */
+  if(dir || (fl = fcntl(fd, F_GETFL)) < 0 || (fl & O_ACCMODE) == O_RDONLY) {
+    /* Closing cannot lose any data so answer at once */
+    sftp_sync_discard(fd, dir);
+    return 0;
+  }
+  /* Buffered writes have been flushed and unused preallocation released */
+  sftp_statcache_invalidate();
+  /* Only respond once the file is closed, and durable if so configured */
+  if(sftpconf_fsync_on_close)
+    sftp_sync_submit(job, fd);
+  else
+    sftp_sync_close(job, fd);
+  return HANDLER_ASYNC;
 }
 
 uint32_t sftp_v345_realpath(struct sftpjob *job) {
   char *path;
   struct sftpattr attr;
 
-  pcheck(sftp_parse_path(job, &path));
+  pcheck(sftp_parse_path_borrow(job, &path));
   D(("sftp_v345_realpath %s", path));
   sftp_memset(&attr, 0, sizeof attr);
   attr.name = sftp_find_realpath(job->a, path, RP_READLINK);
@@ -510,17 +569,19 @@ uint32_t sftp_v345_realpath(struct sftpjob *job) {
     return HANDLER_ERRNO;
 }
 
-/* Command code for the various _*STAT calls.  rc is the return value
- * from *stat() and SB is the buffer. */
-static uint32_t sftp_v3_stat_core(struct sftpjob *job, int rc,
-                                  const struct stat *sb) {
+/* Command code for the various _*STAT calls.  FD and PATH are as for
+ * sftp_stat_masked(). */
+static uint32_t sftp_v3_stat_core(struct sftpjob *job, int fd,
+                                  const char *path, int follow) {
   struct sftpattr attrs;
+  struct stat sb;
+  /* We suppress owner/group name lookup since there is no way to communicate
+   * it in protocol version 3 */
+  const uint32_t mask = ~(uint32_t)SSH_FILEXFER_ATTR_OWNERGROUP;
 
-  if(!rc) {
-    /* We suppress owner/group name lookup since there is no way to communicate
-     * it in protocol version 3 */
-    sftp_stat_to_attrs(job->a, sb, &attrs,
-                       ~(uint32_t)SSH_FILEXFER_ATTR_OWNERGROUP, 0);
+  if(!(path ? sftp_statcache_stat(path, follow, mask, &sb)
+            : sftp_stat_masked(fd, path, follow, mask, &sb))) {
+    sftp_stat_to_attrs(job->a, &sb, &attrs, mask, 0);
     sftp_send_begin(job->worker);
     sftp_send_uint8(job->worker, SSH_FXP_ATTRS);
     sftp_send_uint32(job->worker, job->id);
@@ -533,33 +594,30 @@ static uint32_t sftp_v3_stat_core(struct sftpjob *job, int rc,
 
 static uint32_t sftp_v3_lstat(struct sftpjob *job) {
   char *path;
-  struct stat sb;
 
-  pcheck(sftp_parse_path(job, &path));
+  pcheck(sftp_parse_path_borrow(job, &path));
   D(("sftp_v3_lstat %s", path));
-  return sftp_v3_stat_core(job, lstat(path, &sb), &sb);
+  return sftp_v3_stat_core(job, AT_FDCWD, path, 0);
 }
 
 static uint32_t sftp_v3_stat(struct sftpjob *job) {
   char *path;
-  struct stat sb;
 
-  pcheck(sftp_parse_path(job, &path));
+  pcheck(sftp_parse_path_borrow(job, &path));
   D(("sftp_v3_stat %s", path));
-  return sftp_v3_stat_core(job, stat(path, &sb), &sb);
+  return sftp_v3_stat_core(job, AT_FDCWD, path, 1);
 }
 
 static uint32_t sftp_v3_fstat(struct sftpjob *job) {
   int fd;
   struct handleid id;
-  struct stat sb;
   uint32_t rc;
 
   pcheck(sftp_parse_handle(job, &id));
   D(("sftp_v3_fstat %" PRIu32 " %" PRIu32, id.id, id.tag));
   if((rc = sftp_handle_get_fd(&id, &fd, 0)))
     return rc;
-  return sftp_v3_stat_core(job, fstat(fd, &sb), &sb);
+  return sftp_v3_stat_core(job, fd, 0, 1);
 }
 
 uint32_t sftp_vany_setstat(struct sftpjob *job) {
@@ -569,7 +627,8 @@ uint32_t sftp_vany_setstat(struct sftpjob *job) {
 
   if(readonly)
     return SSH_FX_PERMISSION_DENIED;
-  pcheck(sftp_parse_path(job, &path));
+  sftp_statcache_invalidate();
+  pcheck(sftp_parse_path_borrow(job, &path));
   pcheck(protocol->parseattrs(job, &attrs));
   D(("sftp_vany_setstat %s", path));
   /* Check owner/group */
@@ -586,6 +645,7 @@ uint32_t sftp_vany_fsetstat(struct sftpjob *job) {
 
   if(readonly)
     return SSH_FX_PERMISSION_DENIED;
+  sftp_statcache_invalidate();
   pcheck(sftp_parse_handle(job, &id));
   pcheck(protocol->parseattrs(job, &attrs));
   D(("sftp_vany_fsetstat %" PRIu32 " %" PRIu32, id.id, id.tag));
@@ -604,7 +664,8 @@ uint32_t sftp_vany_mkdir(struct sftpjob *job) {
 
   if(readonly)
     return SSH_FX_PERMISSION_DENIED;
-  pcheck(sftp_parse_path(job, &path));
+  sftp_statcache_invalidate();
+  pcheck(sftp_parse_path_borrow(job, &path));
   pcheck(protocol->parseattrs(job, &attrs));
   D(("sftp_vany_mkdir %s", path));
   attrs.valid &= (uint32_t)~SSH_FILEXFER_ATTR_SIZE; /* makes no sense */
@@ -640,7 +701,7 @@ uint32_t sftp_v34_open(struct sftpjob *job) {
   uint32_t desired_access = 0;
   uint32_t flags;
 
-  pcheck(sftp_parse_path(job, &path));
+  pcheck(sftp_parse_path_borrow(job, &path));
   pcheck(sftp_parse_uint32(job, &pflags));
   pcheck(protocol->parseattrs(job, &attrs));
   D(("sftp_v34_open %s %#" PRIx32, path, pflags));
@@ -681,11 +742,35 @@ uint32_t sftp_v34_open(struct sftpjob *job) {
   return sftp_generic_open(job, path, desired_access, flags, &attrs);
 }
 
+/** @brief Respond to an asynchronous read
+ * @param job Job
+ * @param res Bytes read, or negated errno value
+ * @param buf Data read
+ */
+static void read_done(struct sftpjob *job, ssize_t res, void *buf) {
+  if(res > 0) {
+    sftp_stats_bytes(stats_bytes_read, res);
+    sftp_send_begin(job->worker);
+    sftp_send_uint8(job->worker, SSH_FXP_DATA);
+    sftp_send_uint32(job->worker, job->id);
+    sftp_send_bytes(job->worker, buf, res);
+    sftp_send_end(job->worker);
+  } else if(res == 0)
+    sftp_send_status(job, SSH_FX_EOF, 0);
+  else {
+    errno = -res;
+    sftp_send_status(job, HANDLER_ERRNO, 0);
+  }
+}
+
 uint32_t sftp_vany_read(struct sftpjob *job) {
   struct handleid id;
+  struct lineindex **lip;
+  struct mapwindow **mp;
   uint64_t offset;
   uint32_t len, rc;
   ssize_t n;
+  off_t where;
   int fd;
   unsigned flags;
 
@@ -695,10 +780,68 @@ uint32_t sftp_vany_read(struct sftpjob *job) {
   D(("sftp_vany_read %" PRIx32 " %" PRIu32 " %" PRIu32 ": %" PRIu32
      " bytes at %" PRIu64,
      job->id, id.id, id.tag, len, offset));
-  if(len > MAXREAD)
-    len = MAXREAD;
+  if(len > (uint32_t)sftpconf_max_read)
+    len = sftpconf_max_read;
   if((rc = sftp_handle_get_fd(&id, &fd, &flags)))
     return rc;
+  /* Make sure we see our own writes */
+  sftp_handle_flush(&id);
+  /* Direct IO handles bypass the page cache, so none of the cache-based
+   * strategies apply to them */
+  if(!(flags & (HANDLE_TEXT | HANDLE_APPEND | HANDLE_DIRECT)))
+    sftp_handle_note_read(&id, fd, offset, len);
+  /* Compressed data can't be sent straight from the file */
+  if(flags & HANDLE_COMPRESS)
+    return sftp_compress_read(job, &id, fd, offset, len);
+  if(sftpconf_mmap_read && len >= ZEROCOPYMIN &&
+     !(flags & (HANDLE_TEXT | HANDLE_APPEND | HANDLE_DIRECT)) &&
+     (mp = sftp_handle_map(&id))) {
+    struct stat sb;
+    struct mapwindow *m;
+    const uint8_t *data;
+
+    /* Large files can be sent straight from a mapping, shared with anyone
+     * else reading the same file */
+    if(fstat(fd, &sb) >= 0 && S_ISREG(sb.st_mode) &&
+       sb.st_size >= sftpconf_mmap_read && (uint64_t)sb.st_size > offset) {
+      if((uint64_t)sb.st_size - offset < len)
+        len = (uint32_t)(sb.st_size - offset);
+      if((data = sftp_mapread_get(mp, fd, offset, len, sb.st_size, &m))) {
+        sftp_send_begin(job->worker);
+        sftp_send_uint8(job->worker, SSH_FXP_DATA);
+        sftp_send_uint32(job->worker, job->id);
+        sftp_send_uint32(job->worker, len);
+        sftp_stats_bytes(stats_bytes_read, len);
+        return sftp_send_end_map(job, m, data, len);
+      }
+    }
+  }
+  if(sftp_zerocopy && len >= ZEROCOPYMIN && !sftp_debugging &&
+     !(flags & (HANDLE_TEXT | HANDLE_APPEND | HANDLE_DIRECT))) {
+    struct stat sb;
+
+    /* We can send file contents without copying them at all, provided we
+     * know in advance how much there is. */
+    if(fstat(fd, &sb) >= 0 && S_ISREG(sb.st_mode) &&
+       (uint64_t)sb.st_size > offset) {
+      if((uint64_t)sb.st_size - offset < len)
+        len = (uint32_t)(sb.st_size - offset);
+      sftp_send_begin(job->worker);
+      sftp_send_uint8(job->worker, SSH_FXP_DATA);
+      sftp_send_uint32(job->worker, job->id);
+      sftp_send_uint32(job->worker, len);
+      sftp_stats_bytes(stats_bytes_read, len);
+      return sftp_send_end_file(job, fd, offset, len);
+    }
+  }
+  if(sftp_uring && !(flags & (HANDLE_TEXT | HANDLE_APPEND | HANDLE_DIRECT))) {
+    /* Free up this thread for the next request while the read happens */
+    sftp_uring_read(job, fd, offset, len, read_done);
+    return HANDLER_ASYNC;
+  }
+  /* Sequential text reads extend text-seek's line index, if there is one */
+  lip = flags & HANDLE_TEXT ? sftp_handle_lines(&id) : NULL;
+  where = lip && *lip ? lseek(fd, 0, SEEK_CUR) : -1;
   /* We read straight into our own output buffer to save a copy. */
   sftp_send_begin(job->worker);
   sftp_send_uint8(job->worker, SSH_FXP_DATA);
@@ -706,11 +849,19 @@ uint32_t sftp_vany_read(struct sftpjob *job) {
   sftp_send_need(job->worker, len + 4);
   if(flags & (HANDLE_TEXT | HANDLE_APPEND))
     n = read(fd, job->worker->buffer + job->worker->bufused + 4, len);
+  else if(flags & HANDLE_DIRECT)
+    n = sftp_direct_pread(fd, sftp_handle_get_direct(&id),
+                          job->worker->buffer + job->worker->bufused + 4, len,
+                          offset);
   else
     n = pread(fd, job->worker->buffer + job->worker->bufused + 4, len, offset);
   /* Short reads are allowed so we don't try to read more */
   if(n > 0) {
+    if(where >= 0)
+      sftp_lineindex_note(*lip, where,
+                          job->worker->buffer + job->worker->bufused + 4, n);
     /* Fix up the buffer */
+    sftp_stats_bytes(stats_bytes_read, n);
     sftp_send_uint32(job->worker, n);
     job->worker->bufused += n;
     sftp_send_end(job->worker);
@@ -724,8 +875,27 @@ uint32_t sftp_vany_read(struct sftpjob *job) {
     return HANDLER_ERRNO;
 }
 
+/** @brief Respond to an asynchronous write
+ * @param job Job
+ * @param res Bytes written, or negated errno value
+ * @param buf Unused
+ */
+static void write_done(struct sftpjob *job, ssize_t res,
+                       void attribute((unused)) * buf) {
+  /* The handler's thread settled before the write reached the file, so
+   * anything looked up since must be discarded before the client hears */
+  sftp_statcache_invalidate();
+  sftp_statcache_settle();
+  if(res < 0) {
+    errno = -res;
+    sftp_send_status(job, HANDLER_ERRNO, 0);
+  } else
+    sftp_send_status(job, SSH_FX_OK, 0);
+}
+
 uint32_t sftp_vany_write(struct sftpjob *job) {
   struct handleid id;
+  struct lineindex **lip;
   uint64_t offset;
   uint32_t len, rc;
   ssize_t n;
@@ -734,6 +904,7 @@ uint32_t sftp_vany_write(struct sftpjob *job) {
 
   if(readonly)
     return SSH_FX_PERMISSION_DENIED;
+  sftp_statcache_invalidate();
   pcheck(sftp_parse_handle(job, &id));
   pcheck(sftp_parse_uint64(job, &offset));
   pcheck(sftp_parse_uint32(job, &len));
@@ -743,6 +914,30 @@ uint32_t sftp_vany_write(struct sftpjob *job) {
      id.id, id.tag, len, offset));
   if((rc = sftp_handle_get_fd(&id, &fd, &flags)))
     return rc;
+  if((flags & HANDLE_COMPRESS) && (rc = sftp_compress_write(job, &id, &len)))
+    return rc;
+  sftp_stats_bytes(stats_bytes_written, len);
+  if(!(flags & (HANDLE_TEXT | HANDLE_APPEND)))
+    sftp_handle_note_write(&id, fd, offset, len);
+  if((flags & HANDLE_TEXT) && (lip = sftp_handle_lines(&id))) {
+    /* The line index can't be trusted once the file has been written */
+    sftp_lineindex_free(*lip);
+    *lip = NULL;
+  }
+  if((sftpconf_write_behind || (flags & HANDLE_DIRECT)) &&
+     !(flags & (HANDLE_TEXT | HANDLE_APPEND))) {
+    /* Collect adjacent writes together, and take care of direct IO */
+    if((rc = sftp_handle_write(&id, fd, offset, job->ptr, len)))
+      return rc;
+    return SSH_FX_OK;
+  }
+  /* Decompressed data belongs to the worker, so can't outlive this call */
+  if(sftp_uring && len &&
+     !(flags &
+       (HANDLE_TEXT | HANDLE_APPEND | HANDLE_DIRECT | HANDLE_COMPRESS))) {
+    sftp_uring_write(job, fd, offset, job->ptr, len, write_done);
+    return HANDLER_ASYNC;
+  }
   while(len > 0) {
     /* Short writes aren't allowed so we loop around writing more */
     if(flags & (HANDLE_TEXT | HANDLE_APPEND))
@@ -764,20 +959,21 @@ uint32_t sftp_vany_posix_rename(struct sftpjob *job) {
 
   if(readonly)
     return SSH_FX_PERMISSION_DENIED;
-  pcheck(sftp_parse_path(job, &oldpath));
-  pcheck(sftp_parse_path(job, &newpath));
+  sftp_statcache_invalidate();
+  pcheck(sftp_parse_path_borrow(job, &oldpath));
+  pcheck(sftp_parse_path_borrow(job, &newpath));
   D(("sftp_vany_posix_rename %s %s", oldpath, newpath));
   if(rename(oldpath, newpath) < 0)
     return HANDLER_ERRNO;
-  else
-    return SSH_FX_OK;
+  sftp_realpath_invalidate();
+  return SSH_FX_OK;
 }
 
 uint32_t sftp_vany_statfs(struct sftpjob *job) {
   char *path;
   struct statvfs fs;
 
-  pcheck(sftp_parse_path(job, &path));
+  pcheck(sftp_parse_path_borrow(job, &path));
   D(("sftp_vany_statfs %s", path));
   if(statvfs(path, &fs) < 0)
     return HANDLER_ERRNO;
@@ -824,7 +1020,7 @@ uint32_t sftp_vany_statvfs(struct sftpjob *job) {
   char *path;
   struct statvfs fs;
 
-  pcheck(sftp_parse_path(job, &path));
+  pcheck(sftp_parse_path_borrow(job, &path));
   D(("sftp_vany_statfs %s", path));
   return sftp_vany_statvfs_send(job, statvfs(path, &fs), &fs);
 }
@@ -848,12 +1044,29 @@ uint32_t sftp_vany_fsync(struct sftpjob *job) {
   uint32_t rc;
 
   pcheck(sftp_parse_handle(job, &id));
-  D(("sftp_v3_fstat %" PRIu32 " %" PRIu32, id.id, id.tag));
+  D(("sftp_vany_fsync %" PRIu32 " %" PRIu32, id.id, id.tag));
   if((rc = sftp_handle_get_fd(&id, &fd, 0)))
     return rc;
-  if(fsync(fd) < 0)
+  /* Sync a duplicate so that the handle can be closed in the meantime */
+  if((fd = dup(fd)) < 0)
     return HANDLER_ERRNO;
-  return SSH_FX_OK;
+  sftp_sync_submit(job, fd);
+  return HANDLER_ASYNC;
+}
+
+uint32_t sftp_vany_limits(struct sftpjob *job) {
+  struct worker *const w = job->worker;
+
+  D(("sftp_vany_limits"));
+  sftp_send_begin(w);
+  sftp_send_uint8(w, SSH_FXP_EXTENDED_REPLY);
+  sftp_send_uint32(w, job->id);
+  sftp_send_uint64(w, sftpconf_max_request);                    /* packet */
+  sftp_send_uint64(w, sftpconf_max_read);                       /* read */
+  sftp_send_uint64(w, sftpconf_max_request - MAXWRITEOVERHEAD); /* write */
+  sftp_send_uint64(w, sftpconf_max_handles); /* open handles */
+  sftp_send_end(w);
+  return HANDLER_RESPONDED;
 }
 
 uint32_t sftp_vany_hardlink(struct sftpjob *job) {
@@ -862,8 +1075,10 @@ uint32_t sftp_vany_hardlink(struct sftpjob *job) {
   /* See also comment in v3.c for SSH_FXP_SYMLINK */
   if(readonly)
     return SSH_FX_PERMISSION_DENIED;
-  pcheck(sftp_parse_path(job, &oldpath)); /* aka existing-path/target-paths */
-  pcheck(sftp_parse_path(job, &newlinkpath));
+  sftp_statcache_invalidate();
+  /* aka existing-path/target-paths */
+  pcheck(sftp_parse_path_borrow(job, &oldpath));
+  pcheck(sftp_parse_path_borrow(job, &newlinkpath));
   D(("sftp_hardlink %s %s", oldpath, newlinkpath));
   if(link(oldpath, newlinkpath) < 0)
     return HANDLER_ERRNO;
@@ -871,38 +1086,62 @@ uint32_t sftp_vany_hardlink(struct sftpjob *job) {
 }
 
 static const struct sftpcmd sftpv3tab[] = {
-    {SSH_FXP_INIT, sftp_vany_already_init},
-    {SSH_FXP_OPEN, sftp_v34_open},
-    {SSH_FXP_CLOSE, sftp_vany_close},
-    {SSH_FXP_READ, sftp_vany_read},
-    {SSH_FXP_WRITE, sftp_vany_write},
-    {SSH_FXP_LSTAT, sftp_v3_lstat},
-    {SSH_FXP_FSTAT, sftp_v3_fstat},
-    {SSH_FXP_SETSTAT, sftp_vany_setstat},
-    {SSH_FXP_FSETSTAT, sftp_vany_fsetstat},
-    {SSH_FXP_OPENDIR, sftp_vany_opendir},
-    {SSH_FXP_READDIR, sftp_vany_readdir},
-    {SSH_FXP_REMOVE, sftp_vany_remove},
-    {SSH_FXP_MKDIR, sftp_vany_mkdir},
-    {SSH_FXP_RMDIR, sftp_vany_rmdir},
-    {SSH_FXP_REALPATH, sftp_v345_realpath},
-    {SSH_FXP_STAT, sftp_v3_stat},
-    {SSH_FXP_RENAME, sftp_v34_rename},
-    {SSH_FXP_READLINK, sftp_vany_readlink},
-    {SSH_FXP_SYMLINK, sftp_v345_symlink},
-    {SSH_FXP_EXTENDED, sftp_vany_extended}};
+    SFTPCMD(SSH_FXP_INIT, sftp_vany_already_init),
+    SFTPCMD(SSH_FXP_OPEN, sftp_v34_open),
+    SFTPCMD(SSH_FXP_CLOSE, sftp_vany_close),
+    SFTPCMD(SSH_FXP_READ, sftp_vany_read),
+    SFTPCMD(SSH_FXP_WRITE, sftp_vany_write),
+    SFTPCMD(SSH_FXP_LSTAT, sftp_v3_lstat),
+    SFTPCMD(SSH_FXP_FSTAT, sftp_v3_fstat),
+    SFTPCMD(SSH_FXP_SETSTAT, sftp_vany_setstat),
+    SFTPCMD(SSH_FXP_FSETSTAT, sftp_vany_fsetstat),
+    SFTPCMD(SSH_FXP_OPENDIR, sftp_vany_opendir),
+    SFTPCMD(SSH_FXP_READDIR, sftp_vany_readdir),
+    SFTPCMD(SSH_FXP_REMOVE, sftp_vany_remove),
+    SFTPCMD(SSH_FXP_MKDIR, sftp_vany_mkdir),
+    SFTPCMD(SSH_FXP_RMDIR, sftp_vany_rmdir),
+    SFTPCMD(SSH_FXP_REALPATH, sftp_v345_realpath),
+    SFTPCMD(SSH_FXP_STAT, sftp_v3_stat),
+    SFTPCMD(SSH_FXP_RENAME, sftp_v34_rename),
+    SFTPCMD(SSH_FXP_READLINK, sftp_vany_readlink),
+    SFTPCMD(SSH_FXP_SYMLINK, sftp_v345_symlink),
+    SFTPCMD(SSH_FXP_EXTENDED, sftp_vany_extended),
+};
 
 static const struct sftpextension v3_extensions[] = {
+    {"check-file-handle", "", sftp_vany_check_file_handle},
+    {"check-file-name", "", sftp_vany_check_file_name},
+    {"compress@rjk.greenend.org.uk", "1", sftp_vany_compress},
+    {"copy-data", "1", sftp_vany_copy_data},
+    {"delta-apply@rjk.greenend.org.uk", "1", sftp_vany_delta_apply},
+    {"delta-signature@rjk.greenend.org.uk", "1", sftp_vany_delta_signature},
     {"fsync@openssh.com", "1", sftp_vany_fsync},
+    {"get-file@rjk.greenend.org.uk", "1", sftp_vany_get_file},
     {"hardlink@openssh.com", "1", sftp_vany_hardlink},
+    {"limits@openssh.com", "1", sftp_vany_limits},
     {"posix-rename@openssh.com", "1", sftp_vany_posix_rename},
     {"posix-rename@openssh.org", "", sftp_vany_posix_rename},
+    {"posix-rename-batch@rjk.greenend.org.uk", "1", sftp_vany_rename_batch},
+    {"put-file@rjk.greenend.org.uk", "1", sftp_vany_put_file},
+    {"read-order@rjk.greenend.org.uk", "1", sftp_vany_read_order},
+    {"read-vector@rjk.greenend.org.uk", "1", sftp_vany_read_vector},
+    {"readdir-mask@rjk.greenend.org.uk", "1", sftp_vany_readdir_mask},
+    {"remove-tree@rjk.greenend.org.uk", "1", sftp_vany_remove_tree},
     {"space-available", "", sftp_vany_space_available},
+    {"stat-batch@rjk.greenend.org.uk", "1", sftp_vany_stat_batch},
     {"statfs@openssh.org", "", sftp_vany_statfs},
     {"statvfs@openssh.com", "2", sftp_vany_statvfs},
     {"fstatvfs@openssh.com", "2", sftp_vany_fstatvfs},
+    {"walk@rjk.greenend.org.uk", "1", sftp_vany_walk},
+#if HAVE_SYS_INOTIFY_H
+    {"watch@rjk.greenend.org.uk", "1", sftp_vany_watch},
+    {"watch-read@rjk.greenend.org.uk", "1", sftp_vany_watch_read},
+#endif
 };
 
+/** @brief Hash index of extensions */
+static struct sftpextindex v3_extindex;
+
 const struct sftpprotocol sftp_v3 = {
     sizeof sftpv3tab / sizeof(struct sftpcmd), /* ncommands */
     sftpv3tab,                                 /* commands */
@@ -918,6 +1157,7 @@ const struct sftpprotocol sftp_v3 = {
     v3_decode,
     sizeof v3_extensions / sizeof(struct sftpextension),
     v3_extensions, /* extensions */
+    &v3_extindex, /* extindex */
 };
 
 /*
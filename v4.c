@@ -27,14 +27,20 @@
 #include "globals.h"
 #include "debug.h"
 #include "stat.h"
+#include "statcache.h"
 #include "handle.h"
 #include "serialize.h"
 #include "utils.h"
 #include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 int sftp_v456_encode(struct sftpjob *job, char **path) {
+  /* Often there is nothing to do */
+  if(sftp_charset_passthrough(job->worker, *path))
+    return 0;
   /* Translate local to UTF-8 */
-  return sftp_iconv(job->a, job->worker->local_to_utf8, path);
+  return sftp_iconv(job->a, sftp_charset_to_utf8(job->worker), path);
 }
 
 uint32_t sftp_v456_decode(struct sftpjob *job, char **path) {
@@ -42,7 +48,9 @@ uint32_t sftp_v456_decode(struct sftpjob *job, char **path) {
   if(!**path)
     *path = (char *)".";
   /* Translate UTF-8 to local */
-  if(sftp_iconv(job->a, job->worker->utf8_to_local, path))
+  if(sftp_charset_passthrough(job->worker, *path))
+    return SSH_FX_OK;
+  if(sftp_iconv(job->a, sftp_charset_to_local(job->worker), path))
     return SSH_FX_INVALID_FILENAME;
   else
     return SSH_FX_OK;
@@ -221,16 +229,19 @@ void sftp_v456_sendnames(struct sftpjob *job, int nnames,
   }
 }
 
-/* Command code for the various _*STAT calls.  rc is the return value
- * from *stat() and SB is the buffer. */
-static uint32_t sftp_v456_stat_core(struct sftpjob *job, int rc,
-                                    const struct stat *sb, const char *path) {
+/* Command code for the various _*STAT calls.  FD and PATH are as for
+ * sftp_stat_masked(). */
+static uint32_t sftp_v456_stat_core(struct sftpjob *job, int fd,
+                                    const char *path, int follow) {
   struct sftpattr attrs;
+  struct stat sb;
   uint32_t flags;
 
-  if(!rc) {
-    pcheck(sftp_parse_uint32(job, &flags));
-    sftp_stat_to_attrs(job->a, sb, &attrs, flags, path);
+  /* Only fetch what the client asked for */
+  pcheck(sftp_parse_uint32(job, &flags));
+  if(!(path ? sftp_statcache_stat(path, follow, flags, &sb)
+            : sftp_stat_masked(fd, path, follow, flags, &sb))) {
+    sftp_stat_to_attrs(job->a, &sb, &attrs, flags, path);
     sftp_send_begin(job->worker);
     sftp_send_uint8(job->worker, SSH_FXP_ATTRS);
     sftp_send_uint32(job->worker, job->id);
@@ -243,69 +254,90 @@ static uint32_t sftp_v456_stat_core(struct sftpjob *job, int rc,
 
 uint32_t sftp_v456_lstat(struct sftpjob *job) {
   char *path;
-  struct stat sb;
 
-  pcheck(sftp_parse_path(job, &path));
+  pcheck(sftp_parse_path_borrow(job, &path));
   D(("sftp_lstat %s", path));
-  return sftp_v456_stat_core(job, lstat(path, &sb), &sb, path);
+  return sftp_v456_stat_core(job, AT_FDCWD, path, 0);
 }
 
 uint32_t sftp_v456_stat(struct sftpjob *job) {
   char *path;
-  struct stat sb;
 
-  pcheck(sftp_parse_path(job, &path));
+  pcheck(sftp_parse_path_borrow(job, &path));
   D(("sftp_stat %s", path));
-  return sftp_v456_stat_core(job, stat(path, &sb), &sb, path);
+  return sftp_v456_stat_core(job, AT_FDCWD, path, 1);
 }
 
 uint32_t sftp_v456_fstat(struct sftpjob *job) {
   int fd;
   struct handleid id;
-  struct stat sb;
   uint32_t rc;
 
   pcheck(sftp_parse_handle(job, &id));
   D(("sftp_fstat %" PRIu32 " %" PRIu32, id.id, id.tag));
   if((rc = sftp_handle_get_fd(&id, &fd, 0)))
     return rc;
-  return sftp_v456_stat_core(job, fstat(fd, &sb), &sb, 0);
+  return sftp_v456_stat_core(job, fd, 0, 1);
 }
 
 static const struct sftpcmd sftpv4tab[] = {
-    {SSH_FXP_INIT, sftp_vany_already_init},
-    {SSH_FXP_OPEN, sftp_v34_open},
-    {SSH_FXP_CLOSE, sftp_vany_close},
-    {SSH_FXP_READ, sftp_vany_read},
-    {SSH_FXP_WRITE, sftp_vany_write},
-    {SSH_FXP_LSTAT, sftp_v456_lstat},
-    {SSH_FXP_FSTAT, sftp_v456_fstat},
-    {SSH_FXP_SETSTAT, sftp_vany_setstat},
-    {SSH_FXP_FSETSTAT, sftp_vany_fsetstat},
-    {SSH_FXP_OPENDIR, sftp_vany_opendir},
-    {SSH_FXP_READDIR, sftp_vany_readdir},
-    {SSH_FXP_REMOVE, sftp_vany_remove},
-    {SSH_FXP_MKDIR, sftp_vany_mkdir},
-    {SSH_FXP_RMDIR, sftp_vany_rmdir},
-    {SSH_FXP_REALPATH, sftp_v345_realpath},
-    {SSH_FXP_STAT, sftp_v456_stat},
-    {SSH_FXP_RENAME, sftp_v34_rename},
-    {SSH_FXP_READLINK, sftp_vany_readlink},
-    {SSH_FXP_SYMLINK, sftp_v345_symlink},
-    {SSH_FXP_EXTENDED, sftp_vany_extended}};
+    SFTPCMD(SSH_FXP_INIT, sftp_vany_already_init),
+    SFTPCMD(SSH_FXP_OPEN, sftp_v34_open),
+    SFTPCMD(SSH_FXP_CLOSE, sftp_vany_close),
+    SFTPCMD(SSH_FXP_READ, sftp_vany_read),
+    SFTPCMD(SSH_FXP_WRITE, sftp_vany_write),
+    SFTPCMD(SSH_FXP_LSTAT, sftp_v456_lstat),
+    SFTPCMD(SSH_FXP_FSTAT, sftp_v456_fstat),
+    SFTPCMD(SSH_FXP_SETSTAT, sftp_vany_setstat),
+    SFTPCMD(SSH_FXP_FSETSTAT, sftp_vany_fsetstat),
+    SFTPCMD(SSH_FXP_OPENDIR, sftp_vany_opendir),
+    SFTPCMD(SSH_FXP_READDIR, sftp_vany_readdir),
+    SFTPCMD(SSH_FXP_REMOVE, sftp_vany_remove),
+    SFTPCMD(SSH_FXP_MKDIR, sftp_vany_mkdir),
+    SFTPCMD(SSH_FXP_RMDIR, sftp_vany_rmdir),
+    SFTPCMD(SSH_FXP_REALPATH, sftp_v345_realpath),
+    SFTPCMD(SSH_FXP_STAT, sftp_v456_stat),
+    SFTPCMD(SSH_FXP_RENAME, sftp_v34_rename),
+    SFTPCMD(SSH_FXP_READLINK, sftp_vany_readlink),
+    SFTPCMD(SSH_FXP_SYMLINK, sftp_v345_symlink),
+    SFTPCMD(SSH_FXP_EXTENDED, sftp_vany_extended),
+};
 
 static const struct sftpextension v4_extensions[] = {
+    {"check-file-handle", "", sftp_vany_check_file_handle},
+    {"check-file-name", "", sftp_vany_check_file_name},
+    {"compress@rjk.greenend.org.uk", "1", sftp_vany_compress},
+    {"copy-data", "1", sftp_vany_copy_data},
+    {"delta-apply@rjk.greenend.org.uk", "1", sftp_vany_delta_apply},
+    {"delta-signature@rjk.greenend.org.uk", "1", sftp_vany_delta_signature},
     {"fsync@openssh.com", "1", sftp_vany_fsync},
+    {"get-file@rjk.greenend.org.uk", "1", sftp_vany_get_file},
     {"hardlink@openssh.com", "1", sftp_vany_hardlink},
+    {"limits@openssh.com", "1", sftp_vany_limits},
     {"posix-rename@openssh.com", "1", sftp_vany_posix_rename},
     {"posix-rename@openssh.org", "", sftp_vany_posix_rename},
+    {"posix-rename-batch@rjk.greenend.org.uk", "1", sftp_vany_rename_batch},
+    {"put-file@rjk.greenend.org.uk", "1", sftp_vany_put_file},
+    {"read-order@rjk.greenend.org.uk", "1", sftp_vany_read_order},
+    {"read-vector@rjk.greenend.org.uk", "1", sftp_vany_read_vector},
+    {"readdir-mask@rjk.greenend.org.uk", "1", sftp_vany_readdir_mask},
+    {"remove-tree@rjk.greenend.org.uk", "1", sftp_vany_remove_tree},
     {"space-available", "", sftp_vany_space_available},
+    {"stat-batch@rjk.greenend.org.uk", "1", sftp_vany_stat_batch},
     {"statfs@openssh.org", "", sftp_vany_statfs},
     {"text-seek", "", sftp_vany_text_seek},
     {"statvfs@openssh.com", "2", sftp_vany_statvfs},
     {"fstatvfs@openssh.com", "2", sftp_vany_fstatvfs},
+    {"walk@rjk.greenend.org.uk", "1", sftp_vany_walk},
+#if HAVE_SYS_INOTIFY_H
+    {"watch@rjk.greenend.org.uk", "1", sftp_vany_watch},
+    {"watch-read@rjk.greenend.org.uk", "1", sftp_vany_watch_read},
+#endif
 };
 
+/** @brief Hash index of extensions */
+static struct sftpextindex v4_extindex;
+
 const struct sftpprotocol sftp_v4 = {
     sizeof sftpv4tab / sizeof(struct sftpcmd),
     sftpv4tab,
@@ -321,6 +353,7 @@ const struct sftpprotocol sftp_v4 = {
     sftp_v456_decode,
     sizeof v4_extensions / sizeof(struct sftpextension),
     v4_extensions, /* extensions */
+    &v4_extindex, /* extindex */
 };
 
 /*
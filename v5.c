@@ -26,9 +26,14 @@
 #include "debug.h"
 #include "sftp.h"
 #include "handle.h"
+#include "lineindex.h"
+#include "direct.h"
 #include "globals.h"
 #include "stat.h"
+#include "statcache.h"
 #include "utils.h"
+#include "thread.h"
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -41,7 +46,7 @@ uint32_t sftp_v56_open(struct sftpjob *job) {
   uint32_t desired_access, flags;
   struct sftpattr attrs;
 
-  pcheck(sftp_parse_path(job, &path));
+  pcheck(sftp_parse_path_borrow(job, &path));
   pcheck(sftp_parse_uint32(job, &desired_access));
   pcheck(sftp_parse_uint32(job, &flags));
   pcheck(protocol->parseattrs(job, &attrs));
@@ -52,30 +57,53 @@ uint32_t sftp_v56_open(struct sftpjob *job) {
 uint32_t sftp_generic_open(struct sftpjob *job, const char *path,
                            uint32_t desired_access, uint32_t flags,
                            struct sftpattr *attrs) {
+  struct handleid id;
+  uint32_t rc;
+
+  if((rc = sftp_generic_open_handle(job, path, desired_access, flags, attrs,
+                                    &id)))
+    return rc;
+  sftp_send_begin(job->worker);
+  sftp_send_uint8(job->worker, SSH_FXP_HANDLE);
+  sftp_send_uint32(job->worker, job->id);
+  sftp_send_handle(job->worker, &id);
+  sftp_send_end(job->worker);
+  return HANDLER_RESPONDED;
+}
+
+uint32_t sftp_generic_open_handle(struct sftpjob *job, const char *path,
+                                  uint32_t desired_access, uint32_t flags,
+                                  struct sftpattr *attrs,
+                                  struct handleid *idp) {
   mode_t initial_permissions;
-  int created, open_flags, fd;
+  int created, open_flags, fd, dfd;
   struct stat sb;
   struct handleid id;
   unsigned sftp_handle_flags = 0;
+  uint64_t planned, allocation;
   uint32_t rc;
 
-  D(("sftp_generic_open %s %#" PRIx32 " %#" PRIx32, path, desired_access,
+  D(("sftp_generic_open_handle %s %#" PRIx32 " %#" PRIx32, path, desired_access,
      flags));
   /* Check owner/group */
   if((rc = sftp_normalize_ownergroup(job->a, attrs)) != SSH_FX_OK)
     return rc;
   /* For opens, the size indicates the planned total size, and doesn't affect
-   * the file creation. */
+   * the file creation.  It is used as a hint for preallocation. */
+  planned = attrs->valid & SSH_FILEXFER_ATTR_SIZE ? attrs->size : 0;
   attrs->valid &= ~(uint32_t)SSH_FILEXFER_ATTR_SIZE;
   /* The v6 spec says implementations "SHOULD" pre-allocate according to the
-   * allocation-size field if present.  This is impossible on UNIX so we ignore
-   * it.
+   * allocation-size field if present.  We do so where the platform supports
+   * it, once the file is open for writing.
    *
-   * This means that the MUST later in the same section, that the queried
-   * allocation-size must exceed the requested one, cannot be honored.  Since
-   * the specification taken literally prohibits UNIX implementations, I assume
-   * that it is in error.
+   * The MUST later in the same section, that the queried allocation-size must
+   * exceed the requested one, still cannot always be honored, since not every
+   * filesystem supports preallocation.  Since the specification taken
+   * literally prohibits such implementations, I assume that it is in error.
    */
+  allocation = attrs->valid & SSH_FILEXFER_ATTR_ALLOCATION_SIZE
+                   ? attrs->allocation_size
+                   : 0;
   switch(desired_access & (ACE4_READ_DATA | ACE4_WRITE_DATA)) {
   case 0: /* probably a broken client */
   case ACE4_READ_DATA:
@@ -157,6 +185,10 @@ uint32_t sftp_generic_open(struct sftpjob *job, const char *path,
       (flags & SSH_FXF_DELETE_ON_CLOSE))) {
     return SSH_FX_PERMISSION_DENIED;
   }
+  if((open_flags & O_ACCMODE) != O_RDONLY ||
+     (flags & SSH_FXF_ACCESS_DISPOSITION) != SSH_FXF_OPEN_EXISTING ||
+     (flags & SSH_FXF_DELETE_ON_CLOSE))
+    sftp_statcache_invalidate();
   switch(flags & SSH_FXF_ACCESS_DISPOSITION) {
   case SSH_FXF_CREATE_NEW:
     /* We create the file anew and if it exists we return an error. */
@@ -300,14 +332,23 @@ uint32_t sftp_generic_open(struct sftpjob *job, const char *path,
     D(("SSH_FXF_DELETE_ON_CLOSE"));
     unlink(path);
   }
-  sftp_handle_new_file(&id, fd, path, sftp_handle_flags);
+  if((rc = sftp_handle_new_file(&id, fd, path, sftp_handle_flags))) {
+    const int save_errno = errno;
+    close(fd);
+    if(created && !(flags & SSH_FXF_DELETE_ON_CLOSE))
+      unlink(path);
+    errno = save_errno;
+    return rc;
+  }
   D(("...handle is %" PRIu32 " %" PRIu32, id.id, id.tag));
-  sftp_send_begin(job->worker);
-  sftp_send_uint8(job->worker, SSH_FXP_HANDLE);
-  sftp_send_uint32(job->worker, job->id);
-  sftp_send_handle(job->worker, &id);
-  sftp_send_end(job->worker);
-  return HANDLER_RESPONDED;
+  if(!(sftp_handle_flags & (HANDLE_TEXT | HANDLE_APPEND)) &&
+     (dfd = sftp_direct_open(job->a, fd, path)) >= 0)
+    sftp_handle_set_direct(&id, dfd);
+  if((open_flags & O_ACCMODE) != O_RDONLY
+     && !(sftp_handle_flags & HANDLE_TEXT))
+    sftp_handle_preallocate(&id, fd, allocation, planned);
+  *idp = id;
+  return 0;
 }
 
 uint32_t sftp_v56_rename(struct sftpjob *job) {
@@ -316,8 +357,9 @@ uint32_t sftp_v56_rename(struct sftpjob *job) {
 
   if(readonly)
     return SSH_FX_PERMISSION_DENIED;
-  pcheck(sftp_parse_path(job, &oldpath));
-  pcheck(sftp_parse_path(job, &newpath));
+  sftp_statcache_invalidate();
+  pcheck(sftp_parse_path_borrow(job, &oldpath));
+  pcheck(sftp_parse_path_borrow(job, &newpath));
   pcheck(sftp_parse_uint32(job, &flags));
   D(("sftp_v56_rename %s %s %#" PRIx32, oldpath, newpath, flags));
 
@@ -330,8 +372,6 @@ uint32_t sftp_v56_rename(struct sftpjob *job) {
      * the operation began.") so we don't bother checking the atomic bit. */
     if(rename(oldpath, newpath) < 0)
       return HANDLER_ERRNO;
-    else
-      return SSH_FX_OK;
   } else {
     /* We want a non-overwriting rename.  We use the same strategy as
      * in v3.c. */
@@ -347,8 +387,6 @@ uint32_t sftp_v56_rename(struct sftpjob *job) {
 #endif
         if(rename(oldpath, newpath) < 0)
           return HANDLER_ERRNO;
-        else
-          return SSH_FX_OK;
       } else
         return SSH_FX_FILE_ALREADY_EXISTS;
     } else if(unlink(oldpath) < 0) {
@@ -357,54 +395,40 @@ uint32_t sftp_v56_rename(struct sftpjob *job) {
       unlink(newpath);
       errno = save_errno;
       return HANDLER_ERRNO;
-    } else
-      return SSH_FX_OK;
+    }
   }
+  sftp_realpath_invalidate();
+  return SSH_FX_OK;
 }
 
 uint32_t sftp_vany_text_seek(struct sftpjob *job) {
   struct handleid id;
-  uint64_t line;
+  struct lineindex **lip;
+  uint64_t line, offset;
   int fd;
-  char buffer[8192];
-  ssize_t n, i;
   uint32_t rc;
 
   pcheck(sftp_parse_handle(job, &id));
   pcheck(sftp_parse_uint64(job, &line));
   if((rc = sftp_handle_get_fd(&id, &fd, 0)))
     return rc;
-  /* Seek back to line 0 */
-  if(lseek(fd, 0, SEEK_SET) < 0)
-    return HANDLER_ERRNO;
+  if(!(lip = sftp_handle_lines(&id)))
+    return SSH_FX_INVALID_HANDLE;
+  D(("sftp_vany_text_seek %" PRIu64, line));
   /* TODO currently if we ask for the line 'just beyond' the end of the file we
    * succeed.  We should actually return SSH_FX_EOF in this case. */
-  if(line == 0) {
-    /* If we're after line 0 then we're already in the right place */
-    return SSH_FX_OK;
-  }
-  /* Look for the right line */
-  i = 0;
-  n = 0; /* quieten compiler */
-  D(("on entry: line=%" PRIu64, line));
-  while(line > 0 && (n = read(fd, buffer, sizeof buffer)) > 0) {
-    D(("outer: line=%" PRIu64 " n=%zd", line, n));
-    i = 0;
-    while(line > 0 && i < n) {
-      if(buffer[i++] == '\n')
-        --line;
-    }
-  }
-  D(("exited:: line=%" PRIu64 " n=%zd i=%zd", line, n, i));
-  if(n < 0)
-    return HANDLER_ERRNO;
-  else if(n == 0)
-    return SSH_FX_EOF;
-  else {
-    /* Seek back to the start of the line */
-    if(lseek(fd, i - n, SEEK_CUR) < 0)
+  switch(sftp_lineindex_find(lip, fd, line, &offset)) {
+  case 0:
+    if(lseek(fd, offset, SEEK_SET) < 0)
       return HANDLER_ERRNO;
     return SSH_FX_OK;
+  case 1:
+    /* Leave the file at the end, as a scan from the start would */
+    if(lseek(fd, 0, SEEK_END) < 0)
+      return HANDLER_ERRNO;
+    return SSH_FX_EOF;
+  default:
+    return HANDLER_ERRNO;
   }
 }
 
@@ -412,7 +436,7 @@ uint32_t sftp_vany_space_available(struct sftpjob *job) {
   char *path;
   struct statvfs fs;
 
-  pcheck(sftp_parse_path(job, &path));
+  pcheck(sftp_parse_path_borrow(job, &path));
   D(("sftp_space_available %s", path));
   if(statvfs(path, &fs) < 0)
     return HANDLER_ERRNO;
@@ -433,16 +457,103 @@ uint32_t sftp_vany_space_available(struct sftpjob *job) {
   return HANDLER_RESPONDED;
 }
 
+/** @brief Hash an extension name
+ * @param name Extension name
+ * @param len Length of @p name
+ * @param seed Hash seed
+ * @return Hash value
+ *
+ * FNV-1a with the seed mixed into the offset basis.
+ */
+static uint32_t extension_hash(const char *name, size_t len, uint32_t seed) {
+  uint32_t h = 2166136261u ^ seed;
+
+  while(len--) {
+    h ^= (unsigned char)*name++;
+    h *= 16777619u;
+  }
+  return h ^ (h >> 15);
+}
+
+/** @brief Compare an extension name from a request with a table entry
+ * @param name Name from request, not 0-terminated
+ * @param len Length of @p name
+ * @param ext Table entry name
+ * @return Nonzero if they match
+ */
+static int extension_match(const char *name, size_t len, const char *ext) {
+  return strlen(ext) == len && !memcmp(name, ext, len);
+}
+
+/** @brief Lock serializing sftp_extensions_index() */
+static pthread_mutex_t extindex_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Search for a perfect hash of a protocol's extensions
+ * @param p Protocol
+ * @param x Index to fill in
+ */
+static void extensions_build(const struct sftpprotocol *p,
+                             struct sftpextindex *x) {
+  uint32_t size, seed, h;
+  int n;
+
+  x->seed = 0;
+  /* Keep the table at most half full so that a good seed is quickly found */
+  for(size = 2; size < 2 * (uint32_t)p->nextensions; size *= 2)
+    ;
+  for(; size <= EXTINDEXSIZE; size *= 2)
+    for(seed = 1; seed <= EXTINDEXSEEDS; ++seed) {
+      memset(x->slots, 0, size);
+      for(n = 0; n < p->nextensions; ++n) {
+        h = extension_hash(p->extensions[n].name,
+                           strlen(p->extensions[n].name), seed) &
+            (size - 1);
+        if(x->slots[h])
+          break;
+        x->slots[h] = n + 1;
+      }
+      if(n == p->nextensions) {
+        x->seed = seed;
+        x->mask = size - 1;
+        D(("v%d: %d extensions in %" PRIu32 " slots with seed %" PRIu32,
+           p->version, p->nextensions, size, seed));
+        return;
+      }
+    }
+  D(("v%d: no perfect hash for extensions", p->version));
+}
+
+void sftp_extensions_index(const struct sftpprotocol *p) {
+  struct sftpextindex *const x = p->extindex;
+
+  if(!x)
+    return;
+  ferrcheck(pthread_mutex_lock(&extindex_lock));
+  if(!x->indexed) {
+    extensions_build(p, x);
+    x->indexed = 1;
+  }
+  ferrcheck(pthread_mutex_unlock(&extindex_lock));
+}
+
 uint32_t sftp_vany_extended(struct sftpjob *job) {
-  char *name;
+  const struct sftpextindex *const x = protocol->extindex;
+  const char *name;
+  size_t len;
   int n;
 
-  pcheck(sftp_parse_string(job, &name, 0));
-  D(("extension %s", name));
-  /* TODO when we have nontrivially many extensions we should use a binary
-   * search here. */
-  for(n = 0;
-      (n < protocol->nextensions && strcmp(name, protocol->extensions[n].name));
+  /* The name is only compared, so there is no need to copy it */
+  pcheck(sftp_parse_view(job, &name, &len));
+  D(("extension %.*s", (int)len, name));
+  if(x && x->seed) {
+    /* One probe decides it */
+    n = x->slots[extension_hash(name, len, x->seed) & x->mask] - 1;
+    if(n < 0 || !extension_match(name, len, protocol->extensions[n].name))
+      return SSH_FX_OP_UNSUPPORTED;
+    return protocol->extensions[n].handler(job);
+  }
+  for(n = 0; (n < protocol->nextensions &&
+              !extension_match(name, len, protocol->extensions[n].name));
       ++n)
     ;
   if(n >= protocol->nextensions)
@@ -452,39 +563,63 @@ uint32_t sftp_vany_extended(struct sftpjob *job) {
 }
 
 static const struct sftpcmd sftpv5tab[] = {
-    {SSH_FXP_INIT, sftp_vany_already_init},
-    {SSH_FXP_OPEN, sftp_v56_open},
-    {SSH_FXP_CLOSE, sftp_vany_close},
-    {SSH_FXP_READ, sftp_vany_read},
-    {SSH_FXP_WRITE, sftp_vany_write},
-    {SSH_FXP_LSTAT, sftp_v456_lstat},
-    {SSH_FXP_FSTAT, sftp_v456_fstat},
-    {SSH_FXP_SETSTAT, sftp_vany_setstat},
-    {SSH_FXP_FSETSTAT, sftp_vany_fsetstat},
-    {SSH_FXP_OPENDIR, sftp_vany_opendir},
-    {SSH_FXP_READDIR, sftp_vany_readdir},
-    {SSH_FXP_REMOVE, sftp_vany_remove},
-    {SSH_FXP_MKDIR, sftp_vany_mkdir},
-    {SSH_FXP_RMDIR, sftp_vany_rmdir},
-    {SSH_FXP_REALPATH, sftp_v345_realpath},
-    {SSH_FXP_STAT, sftp_v456_stat},
-    {SSH_FXP_RENAME, sftp_v56_rename},
-    {SSH_FXP_READLINK, sftp_vany_readlink},
-    {SSH_FXP_SYMLINK, sftp_v345_symlink},
-    {SSH_FXP_EXTENDED, sftp_vany_extended}};
+    SFTPCMD(SSH_FXP_INIT, sftp_vany_already_init),
+    SFTPCMD(SSH_FXP_OPEN, sftp_v56_open),
+    SFTPCMD(SSH_FXP_CLOSE, sftp_vany_close),
+    SFTPCMD(SSH_FXP_READ, sftp_vany_read),
+    SFTPCMD(SSH_FXP_WRITE, sftp_vany_write),
+    SFTPCMD(SSH_FXP_LSTAT, sftp_v456_lstat),
+    SFTPCMD(SSH_FXP_FSTAT, sftp_v456_fstat),
+    SFTPCMD(SSH_FXP_SETSTAT, sftp_vany_setstat),
+    SFTPCMD(SSH_FXP_FSETSTAT, sftp_vany_fsetstat),
+    SFTPCMD(SSH_FXP_OPENDIR, sftp_vany_opendir),
+    SFTPCMD(SSH_FXP_READDIR, sftp_vany_readdir),
+    SFTPCMD(SSH_FXP_REMOVE, sftp_vany_remove),
+    SFTPCMD(SSH_FXP_MKDIR, sftp_vany_mkdir),
+    SFTPCMD(SSH_FXP_RMDIR, sftp_vany_rmdir),
+    SFTPCMD(SSH_FXP_REALPATH, sftp_v345_realpath),
+    SFTPCMD(SSH_FXP_STAT, sftp_v456_stat),
+    SFTPCMD(SSH_FXP_RENAME, sftp_v56_rename),
+    SFTPCMD(SSH_FXP_READLINK, sftp_vany_readlink),
+    SFTPCMD(SSH_FXP_SYMLINK, sftp_v345_symlink),
+    SFTPCMD(SSH_FXP_EXTENDED, sftp_vany_extended),
+};
 
 static const struct sftpextension sftp_v5_extensions[] = {
+    {"check-file-handle", "", sftp_vany_check_file_handle},
+    {"check-file-name", "", sftp_vany_check_file_name},
+    {"compress@rjk.greenend.org.uk", "1", sftp_vany_compress},
+    {"copy-data", "1", sftp_vany_copy_data},
+    {"delta-apply@rjk.greenend.org.uk", "1", sftp_vany_delta_apply},
+    {"delta-signature@rjk.greenend.org.uk", "1", sftp_vany_delta_signature},
     {"fsync@openssh.com", "1", sftp_vany_fsync},
+    {"get-file@rjk.greenend.org.uk", "1", sftp_vany_get_file},
     {"hardlink@openssh.com", "1", sftp_vany_hardlink},
+    {"limits@openssh.com", "1", sftp_vany_limits},
     {"posix-rename@openssh.com", "1", sftp_vany_posix_rename},
     {"posix-rename@openssh.org", "", sftp_vany_posix_rename},
+    {"posix-rename-batch@rjk.greenend.org.uk", "1", sftp_vany_rename_batch},
+    {"put-file@rjk.greenend.org.uk", "1", sftp_vany_put_file},
+    {"read-order@rjk.greenend.org.uk", "1", sftp_vany_read_order},
+    {"read-vector@rjk.greenend.org.uk", "1", sftp_vany_read_vector},
+    {"readdir-mask@rjk.greenend.org.uk", "1", sftp_vany_readdir_mask},
+    {"remove-tree@rjk.greenend.org.uk", "1", sftp_vany_remove_tree},
     {"space-available", "", sftp_vany_space_available},
+    {"stat-batch@rjk.greenend.org.uk", "1", sftp_vany_stat_batch},
     {"statfs@openssh.org", "", sftp_vany_statfs},
     {"text-seek", "", sftp_vany_text_seek},
     {"statvfs@openssh.com", "2", sftp_vany_statvfs},
     {"fstatvfs@openssh.com", "2", sftp_vany_fstatvfs},
+    {"walk@rjk.greenend.org.uk", "1", sftp_vany_walk},
+#if HAVE_SYS_INOTIFY_H
+    {"watch@rjk.greenend.org.uk", "1", sftp_vany_watch},
+    {"watch-read@rjk.greenend.org.uk", "1", sftp_vany_watch_read},
+#endif
 };
 
+/** @brief Hash index of extensions */
+static struct sftpextindex v5_extindex;
+
 const struct sftpprotocol sftp_v5 = {
     sizeof sftpv5tab / sizeof(struct sftpcmd),
     sftpv5tab,
@@ -501,6 +636,7 @@ const struct sftpprotocol sftp_v5 = {
     sftp_v456_decode,
     sizeof sftp_v5_extensions / sizeof(struct sftpextension),
     sftp_v5_extensions,
+    &v5_extindex,
 };
 
 /*
@@ -23,12 +23,13 @@
 #include "sftp.h"
 #include "alloc.h"
 #include "stat.h"
+#include "statcache.h"
 #include "parse.h"
 #include "send.h"
 #include "debug.h"
 #include "utils.h"
 #include "globals.h"
-#include "queue.h"
+#include "session.h"
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -41,11 +42,11 @@ uint32_t sftp_v6_realpath(struct sftpjob *job) {
   struct stat sb;
   struct sftpattr attrs;
 
-  pcheck(sftp_parse_path(job, &path));
+  pcheck(sftp_parse_path_borrow(job, &path));
   if(job->left) {
     pcheck(sftp_parse_uint8(job, &control_byte));
     while(job->left) {
-      pcheck(sftp_parse_path(job, &compose));
+      pcheck(sftp_parse_path_borrow(job, &compose));
       if(compose[0] == '/')
         path = compose;
       else {
@@ -86,7 +87,8 @@ uint32_t sftp_v6_realpath(struct sftpjob *job) {
     break;
   case SSH_FXP_REALPATH_STAT_IF:
     /* stat as hard as we can but accept failure if it's just not there */
-    if(stat(resolvedpath, &sb) >= 0 || lstat(resolvedpath, &sb) >= 0)
+    if(!sftp_statcache_stat(resolvedpath, 1, 0xFFFFFFFF, &sb) ||
+       !sftp_statcache_stat(resolvedpath, 0, 0xFFFFFFFF, &sb))
       sftp_stat_to_attrs(job->a, &sb, &attrs, 0xFFFFFFFF, resolvedpath);
     else {
       sftp_memset(&attrs, 0, sizeof attrs);
@@ -95,7 +97,8 @@ uint32_t sftp_v6_realpath(struct sftpjob *job) {
     break;
   case SSH_FXP_REALPATH_STAT_ALWAYS:
     /* stat and error on failure */
-    if(stat(resolvedpath, &sb) >= 0 || lstat(resolvedpath, &sb) >= 0)
+    if(!sftp_statcache_stat(resolvedpath, 1, 0xFFFFFFFF, &sb) ||
+       !sftp_statcache_stat(resolvedpath, 0, 0xFFFFFFFF, &sb))
       sftp_stat_to_attrs(job->a, &sb, &attrs, 0xFFFFFFFF, resolvedpath);
     else
       /* Can only happen if path is deleted between realpath call and stat */
@@ -118,9 +121,10 @@ uint32_t sftp_v6_link(struct sftpjob *job) {
   /* See also comment in v3.c for SSH_FXP_SYMLINK */
   if(readonly)
     return SSH_FX_PERMISSION_DENIED;
-  pcheck(sftp_parse_path(job, &newlinkpath));
-  pcheck(
-      sftp_parse_string(job, &oldpath, 0)); /* aka existing-path/target-paths */
+  sftp_statcache_invalidate();
+  pcheck(sftp_parse_path_borrow(job, &newlinkpath));
+  /* aka existing-path/target-paths */
+  pcheck(sftp_parse_string_borrow(job, &oldpath, 0));
   pcheck(sftp_parse_uint8(job, &symbolic));
   D(("sftp_link %s %s [%s]", oldpath, newlinkpath,
      symbolic ? "symbolic" : "hard"));
@@ -146,32 +150,35 @@ uint32_t sftp_v6_link(struct sftpjob *job) {
     default:
       return HANDLER_ERRNO;
     }
-  } else
-    return SSH_FX_OK;
+  }
+  sftp_realpath_invalidate();
+  return SSH_FX_OK;
 }
 
 uint32_t sftp_v6_version_select(struct sftpjob *job) {
   char *newversion;
 
-  /* If we've already created the work queue then this can't be the first
-   * message. */
-  if(!workqueue) {
-    pcheck(sftp_parse_path(job, &newversion));
+  /* Only the first message after initialization can change the version */
+  if(sftp_session->selectable) {
+    pcheck(sftp_parse_path_borrow(job, &newversion));
     /* Handle known versions */
     if(!strcmp(newversion, "3")) {
-      protocol = &sftp_v3;
+      sftp_session_protocol(&sftp_v3);
+      sftp_extensions_index(&sftp_v3);
       return SSH_FX_OK;
     }
     if(!strcmp(newversion, "4")) {
-      protocol = &sftp_v4;
+      sftp_session_protocol(&sftp_v4);
+      sftp_extensions_index(&sftp_v4);
       return SSH_FX_OK;
     }
     if(!strcmp(newversion, "5")) {
-      protocol = &sftp_v5;
+      sftp_session_protocol(&sftp_v5);
+      sftp_extensions_index(&sftp_v5);
       return SSH_FX_OK;
     }
     if(!strcmp(newversion, "6")) {
-      protocol = &sftp_v6;
+      sftp_session_protocol(&sftp_v6);
       return SSH_FX_OK;
     }
     sftp_send_status(job, SSH_FX_INVALID_PARAMETER, "unknown version");
@@ -184,42 +191,66 @@ uint32_t sftp_v6_version_select(struct sftpjob *job) {
 }
 
 static const struct sftpcmd sftpv6tab[] = {
-    {SSH_FXP_INIT, sftp_vany_already_init},
-    {SSH_FXP_OPEN, sftp_v56_open},
-    {SSH_FXP_CLOSE, sftp_vany_close},
-    {SSH_FXP_READ, sftp_vany_read},
-    {SSH_FXP_WRITE, sftp_vany_write},
-    {SSH_FXP_LSTAT, sftp_v456_lstat},
-    {SSH_FXP_FSTAT, sftp_v456_fstat},
-    {SSH_FXP_SETSTAT, sftp_vany_setstat},
-    {SSH_FXP_FSETSTAT, sftp_vany_fsetstat},
-    {SSH_FXP_OPENDIR, sftp_vany_opendir},
-    {SSH_FXP_READDIR, sftp_vany_readdir},
-    {SSH_FXP_REMOVE, sftp_vany_remove},
-    {SSH_FXP_MKDIR, sftp_vany_mkdir},
-    {SSH_FXP_RMDIR, sftp_vany_rmdir},
-    {SSH_FXP_REALPATH, sftp_v6_realpath},
-    {SSH_FXP_STAT, sftp_v456_stat},
-    {SSH_FXP_RENAME, sftp_v56_rename},
-    {SSH_FXP_READLINK, sftp_vany_readlink},
-    {SSH_FXP_LINK, sftp_v6_link},
-    {SSH_FXP_EXTENDED, sftp_vany_extended}};
+    SFTPCMD(SSH_FXP_INIT, sftp_vany_already_init),
+    SFTPCMD(SSH_FXP_OPEN, sftp_v56_open),
+    SFTPCMD(SSH_FXP_CLOSE, sftp_vany_close),
+    SFTPCMD(SSH_FXP_READ, sftp_vany_read),
+    SFTPCMD(SSH_FXP_WRITE, sftp_vany_write),
+    SFTPCMD(SSH_FXP_LSTAT, sftp_v456_lstat),
+    SFTPCMD(SSH_FXP_FSTAT, sftp_v456_fstat),
+    SFTPCMD(SSH_FXP_SETSTAT, sftp_vany_setstat),
+    SFTPCMD(SSH_FXP_FSETSTAT, sftp_vany_fsetstat),
+    SFTPCMD(SSH_FXP_OPENDIR, sftp_vany_opendir),
+    SFTPCMD(SSH_FXP_READDIR, sftp_vany_readdir),
+    SFTPCMD(SSH_FXP_REMOVE, sftp_vany_remove),
+    SFTPCMD(SSH_FXP_MKDIR, sftp_vany_mkdir),
+    SFTPCMD(SSH_FXP_RMDIR, sftp_vany_rmdir),
+    SFTPCMD(SSH_FXP_REALPATH, sftp_v6_realpath),
+    SFTPCMD(SSH_FXP_STAT, sftp_v456_stat),
+    SFTPCMD(SSH_FXP_RENAME, sftp_v56_rename),
+    SFTPCMD(SSH_FXP_READLINK, sftp_vany_readlink),
+    SFTPCMD(SSH_FXP_LINK, sftp_v6_link),
+    SFTPCMD(SSH_FXP_EXTENDED, sftp_vany_extended),
+};
 
 /* TODO: file locking */
 
 static const struct sftpextension sftp_v6_extensions[] = {
+    {"check-file-handle", "", sftp_vany_check_file_handle},
+    {"check-file-name", "", sftp_vany_check_file_name},
+    {"compress@rjk.greenend.org.uk", "1", sftp_vany_compress},
+    {"copy-data", "1", sftp_vany_copy_data},
+    {"delta-apply@rjk.greenend.org.uk", "1", sftp_vany_delta_apply},
+    {"delta-signature@rjk.greenend.org.uk", "1", sftp_vany_delta_signature},
     {"fsync@openssh.com", "1", sftp_vany_fsync},
+    {"get-file@rjk.greenend.org.uk", "1", sftp_vany_get_file},
     {"hardlink@openssh.com", "1", sftp_vany_hardlink},
+    {"limits@openssh.com", "1", sftp_vany_limits},
     {"posix-rename@openssh.com", "1", sftp_vany_posix_rename},
     {"posix-rename@openssh.org", "", sftp_vany_posix_rename},
+    {"posix-rename-batch@rjk.greenend.org.uk", "1", sftp_vany_rename_batch},
+    {"put-file@rjk.greenend.org.uk", "1", sftp_vany_put_file},
+    {"read-order@rjk.greenend.org.uk", "1", sftp_vany_read_order},
+    {"read-vector@rjk.greenend.org.uk", "1", sftp_vany_read_vector},
+    {"readdir-mask@rjk.greenend.org.uk", "1", sftp_vany_readdir_mask},
+    {"remove-tree@rjk.greenend.org.uk", "1", sftp_vany_remove_tree},
     {"space-available", "", sftp_vany_space_available},
+    {"stat-batch@rjk.greenend.org.uk", "1", sftp_vany_stat_batch},
     {"statfs@openssh.org", "", sftp_vany_statfs},
     {"text-seek", "", sftp_vany_text_seek},
     {"version-select", "", sftp_v6_version_select},
     {"statvfs@openssh.com", "2", sftp_vany_statvfs},
     {"fstatvfs@openssh.com", "2", sftp_vany_fstatvfs},
+    {"walk@rjk.greenend.org.uk", "1", sftp_vany_walk},
+#if HAVE_SYS_INOTIFY_H
+    {"watch@rjk.greenend.org.uk", "1", sftp_vany_watch},
+    {"watch-read@rjk.greenend.org.uk", "1", sftp_vany_watch_read},
+#endif
 };
 
+/** @brief Hash index of extensions */
+static struct sftpextindex v6_extindex;
+
 const struct sftpprotocol sftp_v6 = {
     sizeof sftpv6tab / sizeof(struct sftpcmd),
     sftpv6tab,
@@ -237,6 +268,7 @@ const struct sftpprotocol sftp_v6 = {
     sftp_v456_decode,
     sizeof sftp_v6_extensions / sizeof(struct sftpextension),
     sftp_v6_extensions,
+    &v6_extindex,
 };
 
 /*
@@ -0,0 +1,296 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file walk.c @brief Server-side directory walk
+ *
+ * Implements the @ref WALK extension, which opens a handle on a whole tree
+ * rather than a single directory.  @ref SSH_FXP_READDIR on that handle
+ * returns the entries of every directory within it, named relative to the
+ * root, so a mirroring client needs one round trip per @ref WALKNAMES
+ * entries rather than at least three per directory.
+ *
+ * The tree is visited breadth first, so only one directory is open at a
+ * time.  Entries are stat()ed in batches with sftp_statbatch(), relative to
+ * the open directory, and optionally filtered by name, modification time and
+ * size before they are reported.  Directories are always descended into,
+ * whether or not they are reported; symbolic links are never followed.
+ */
+
+#include "sftpserver.h"
+#include "types.h"
+#include "globals.h"
+#include "handle.h"
+#include "parse.h"
+#include "send.h"
+#include "stat.h"
+#include "statbatch.h"
+#include "sftp.h"
+#include "alloc.h"
+#include "sftpconf.h"
+#include "utils.h"
+#include "debug.h"
+#include "walk.h"
+#include <dirent.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/** @brief A directory waiting to be visited */
+struct walkdir {
+  /** @brief Next directory */
+  struct walkdir *next;
+
+  /** @brief Path relative to the root of the walk */
+  char *rel;
+};
+
+struct walk {
+  /** @brief Root of the walk */
+  char *root;
+
+  /** @brief Flags, see @ref WALK_ALL_DIRS */
+  uint32_t flags;
+
+  /** @brief Pattern that names must match, or a null pointer */
+  char *glob;
+
+  /** @brief Only report files modified after this time, if nonzero */
+  uint64_t newer;
+
+  /** @brief Only report files at least this big */
+  uint64_t minsize;
+
+  /** @brief Only report files at most this big */
+  uint64_t maxsize;
+
+  /** @brief Directories still to visit, oldest first */
+  struct walkdir *queue;
+
+  /** @brief Where to add the next directory to visit */
+  struct walkdir **queuetail;
+
+  /** @brief Directory being read, or a null pointer */
+  DIR *dp;
+
+  /** @brief Path of @ref dp relative to the root, "" for the root itself */
+  char *rel;
+
+  /** @brief Full path of @ref dp */
+  char *dirpath;
+};
+
+/** @brief Move on to the next directory
+ * @param w Walk
+ * @return Nonzero if there is a directory to read, 0 at the end
+ *
+ * Directories that cannot be opened are skipped.
+ */
+static int walk_next_dir(struct walk *w) {
+  struct walkdir *wd;
+
+  while((wd = w->queue)) {
+    if(!(w->queue = wd->next))
+      w->queuetail = &w->queue;
+    free(w->rel);
+    free(w->dirpath);
+    w->rel = wd->rel;
+    free(wd);
+    w->dirpath = sftp_xmalloc(strlen(w->root) + strlen(w->rel) + 2);
+    strcpy(w->dirpath, w->root);
+    strcat(w->dirpath, "/");
+    strcat(w->dirpath, w->rel);
+    if((w->dp = opendir(w->dirpath)))
+      return 1;
+    D(("walk: %s: %s", w->dirpath, strerror(errno)));
+  }
+  return 0;
+}
+
+/** @brief Test whether an entry passes the walk's filters
+ * @param w Walk
+ * @param sb Result of lstat()
+ * @param name Name within its directory
+ * @return Nonzero to report it
+ */
+static int walk_match(const struct walk *w, const struct stat *sb,
+                      const char *name) {
+  if(S_ISDIR(sb->st_mode) && (w->flags & WALK_ALL_DIRS))
+    return 1;
+  if(w->glob && fnmatch(w->glob, name, 0))
+    return 0;
+  if(w->newer && (sb->st_mtime < 0 || (uint64_t)sb->st_mtime <= w->newer))
+    return 0;
+  if((uint64_t)sb->st_size < w->minsize || (uint64_t)sb->st_size > w->maxsize)
+    return 0;
+  return 1;
+}
+
+uint32_t sftp_walk_readdir(struct sftpjob *job, struct walk *w) {
+  struct sftpattr *d;
+  struct statreq *reqs;
+  struct walkdir *wd;
+  struct dirent *de;
+  size_t n = 0, bytes = 0, k, i;
+  int dfd, more;
+  const char *rel;
+  char *s;
+
+  d = sftp_alloc(job->a, WALKNAMES * sizeof *d);
+  reqs = sftp_alloc_raw(job->a, WALKNAMES * sizeof *reqs);
+  /* Stop well short of the largest reply a client is likely to accept,
+   * leaving room for attributes and, in v3, long names */
+  while(n < WALKNAMES && bytes < (size_t)sftpconf_max_read / 2) {
+    if(!w->dp && !walk_next_dir(w))
+      break;
+    more = 1;
+    for(k = 0; k < WALKNAMES - n;) {
+      if(!(de = readdir(w->dp))) {
+        more = 0;
+        break;
+      }
+      if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+        continue;
+      reqs[k++].name =
+          strcpy(sftp_alloc_raw(job->a, strlen(de->d_name) + 1), de->d_name);
+    }
+#if HAVE_DIRFD
+    dfd = dirfd(w->dp);
+#else
+    dfd = -1;
+#endif
+    sftp_statbatch(dfd, w->dirpath, reqs, k, 0xFFFFFFFF);
+    for(i = 0; i < k; ++i) {
+      if(reqs[i].error)
+        continue; /* vanished, most likely */
+      if(*w->rel) {
+        s = sftp_alloc_raw(job->a, strlen(w->rel) + strlen(reqs[i].name) + 2);
+        strcpy(s, w->rel);
+        strcat(s, "/");
+        strcat(s, reqs[i].name);
+        rel = s;
+      } else
+        rel = reqs[i].name;
+      if(S_ISDIR(reqs[i].sb.st_mode)) {
+        wd = sftp_xmalloc(sizeof *wd);
+        wd->next = NULL;
+        wd->rel = sftp_xstrdup(rel);
+        *w->queuetail = wd;
+        w->queuetail = &wd->next;
+      }
+      if(!walk_match(w, &reqs[i].sb, reqs[i].name))
+        continue;
+      sftp_stat_to_attrs(job->a, &reqs[i].sb, &d[n], 0xFFFFFFFF,
+                         reqs[i].name);
+      d[n].name = rel;
+      bytes += strlen(rel);
+      ++n;
+    }
+    if(!more) {
+      closedir(w->dp);
+      w->dp = NULL;
+    }
+  }
+  if(!n)
+    return SSH_FX_EOF;
+  sftp_send_begin(job->worker);
+  sftp_send_uint8(job->worker, SSH_FXP_NAME);
+  sftp_send_uint32(job->worker, job->id);
+  protocol->sendnames(job, (int)n, d);
+  sftp_send_end(job->worker);
+  return HANDLER_RESPONDED;
+}
+
+void sftp_walk_free(struct walk *w) {
+  struct walkdir *wd;
+
+  if(!w)
+    return;
+  if(w->dp)
+    closedir(w->dp);
+  while((wd = w->queue)) {
+    w->queue = wd->next;
+    free(wd->rel);
+    free(wd);
+  }
+  free(w->root);
+  free(w->glob);
+  free(w->rel);
+  free(w->dirpath);
+  free(w);
+}
+
+uint32_t sftp_vany_walk(struct sftpjob *job) {
+  char *path, *glob;
+  uint32_t flags, rc;
+  uint64_t newer, minsize, maxsize;
+  struct handleid id;
+  struct walk *w;
+  DIR *dp;
+
+  pcheck(sftp_parse_path_borrow(job, &path));
+  pcheck(sftp_parse_uint32(job, &flags));
+  /* Not sftp_parse_path_borrow() since that turns an empty string into "." */
+  pcheck(sftp_parse_string_borrow(job, &glob, 0));
+  if(*glob)
+    pcheck(protocol->decode(job, &glob));
+  pcheck(sftp_parse_uint64(job, &newer));
+  pcheck(sftp_parse_uint64(job, &minsize));
+  pcheck(sftp_parse_uint64(job, &maxsize));
+  D(("sftp_vany_walk %s %#" PRIx32 " '%s' %" PRIu64 " %" PRIu64 "-%" PRIu64,
+     path, flags, glob, newer, minsize, maxsize));
+  if(!(dp = opendir(path)))
+    return HANDLER_ERRNO;
+  w = sftp_xcalloc(1, sizeof *w);
+  w->root = sftp_xstrdup(path);
+  w->flags = flags;
+  w->glob = *glob ? sftp_xstrdup(glob) : NULL;
+  w->newer = newer;
+  w->minsize = minsize;
+  w->maxsize = maxsize;
+  w->queuetail = &w->queue;
+  w->dp = dp;
+  w->rel = sftp_xstrdup("");
+  w->dirpath = sftp_xstrdup(path);
+  if((rc = sftp_handle_new_walk(&id, w, path))) {
+    const int save_errno = errno;
+    sftp_walk_free(w);
+    errno = save_errno;
+    return rc;
+  }
+  D(("...handle is %" PRIu32 " %" PRIu32, id.id, id.tag));
+  sftp_send_begin(job->worker);
+  sftp_send_uint8(job->worker, SSH_FXP_HANDLE);
+  sftp_send_uint32(job->worker, job->id);
+  sftp_send_handle(job->worker, &id);
+  sftp_send_end(job->worker);
+  return HANDLER_RESPONDED;
+}
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
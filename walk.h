@@ -0,0 +1,65 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file walk.h @brief Directory walk interface */
+
+#ifndef WALK_H
+#  define WALK_H
+
+#  include <stdint.h>
+#  include <stddef.h>
+
+struct sftpjob;
+
+/** @brief Name of directory walk extension */
+#  define WALK "walk@rjk.greenend.org.uk"
+
+/** @brief @ref WALK flag: report every directory, whatever the filters */
+#  define WALK_ALL_DIRS 0x00000001
+
+/** @brief A directory walk in progress */
+struct walk;
+
+/** @brief Answer an @ref SSH_FXP_READDIR on a walk handle
+ * @param job Job
+ * @param w Walk
+ * @return Error code
+ *
+ * Up to @ref WALKNAMES entries are returned in each reply, named relative to
+ * the root of the walk, then @ref SSH_FX_EOF once the walk is complete.
+ */
+uint32_t sftp_walk_readdir(struct sftpjob *job, struct walk *w);
+
+/** @brief Destroy a directory walk
+ * @param w Walk
+ */
+void sftp_walk_free(struct walk *w);
+
+#endif /* WALK_H */
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,530 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file watch.c @brief Change notification
+ *
+ * Implements the @ref WATCH and @ref WATCH_READ extensions, so that a client
+ * can find out about changes to a directory without polling it.
+ *
+ * @ref WATCH takes a path and a flags word, which must be 0, and returns a
+ * handle.  @ref WATCH_READ takes that handle and a timeout in milliseconds
+ * and returns @ref SSH_FXP_EXTENDED_REPLY with a count and then, for each
+ * changed name, the name (empty for the directory itself) and a word of
+ * @c WATCH_... event bits.  Changes to the same name since the last read are
+ * combined.  If nothing has changed then the request waits, up to the
+ * timeout or @ref WATCHMAXWAIT, whichever is shorter, and is answered
+ * @ref WATCHDELAY milliseconds after the first change, so that a burst of
+ * changes comes back in one reply.  Only one read may wait on each watch at
+ * a time.  @ref SSH_FXP_CLOSE destroys the watch.
+ *
+ * SFTP has no way for a server to send a message nobody asked for, so this
+ * long poll is as close as we can get to pushing changes to the client.
+ *
+ * Waiting reads are taken out of the serialization queue, so they do not
+ * hold up the rest of the session.  They are answered by a single watch
+ * thread, which reads the process's inotify descriptor.  The watch thread
+ * sleeps in poll() and is woken through a pipe when a read starts waiting or
+ * a watch is destroyed.
+ *
+ * Only inotify is supported.  Elsewhere the extensions are not advertised.
+ */
+
+#include "sftpserver.h"
+#include "types.h"
+#include "globals.h"
+#include "handle.h"
+#include "parse.h"
+#include "send.h"
+#include "sftp.h"
+#include "alloc.h"
+#include "thread.h"
+#include "utils.h"
+#include "debug.h"
+#include "input.h"
+#include "serialize.h"
+#include "session.h"
+#include "watch.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if HAVE_SYS_INOTIFY_H
+#  include <sys/inotify.h>
+#endif
+
+#if HAVE_SYS_INOTIFY_H
+/** @brief inotify events that are reported */
+#  define WATCH_MASK                                                          \
+    (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM |          \
+     IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/** @brief Changes to one name */
+struct watchevent {
+  /** @brief Name relative to the watched directory */
+  char *name;
+
+  /** @brief @c WATCH_... bits */
+  uint32_t events;
+};
+
+/** @brief A watch on a directory */
+struct watch {
+  /** @brief Next watch */
+  struct watch *next;
+
+  /** @brief inotify watch descriptor, or -1 once the directory is gone */
+  int wd;
+
+  /** @brief Changes since the last read */
+  struct watchevent *events;
+
+  /** @brief Number of entries in @ref events */
+  size_t nevents;
+
+  /** @brief Non-0 if changes were lost since the last read */
+  int overflow;
+
+  /** @brief Waiting @ref WATCH_READ request, or a null pointer */
+  struct sftpjob *reader;
+
+  /** @brief When @ref reader must be answered */
+  uint64_t deadline;
+
+  /** @brief Non-0 once the handle has been closed */
+  int dead;
+
+  /** @brief Non-0 once the watch thread has finished with a dead watch */
+  int gone;
+};
+
+/** @brief Lock protecting the watch state */
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Signaled when the watch thread finishes with a dead watch */
+static pthread_cond_t watch_gone = PTHREAD_COND_INITIALIZER;
+
+/** @brief All watches */
+static struct watch *watches;
+
+/** @brief inotify descriptor, or -1 */
+static int watch_fd = -1;
+
+/** @brief Pipe used to wake the watch thread */
+static int watch_wake[2] = {-1, -1};
+
+/** @brief Watch thread */
+static pthread_t watch_thread_id;
+
+/** @brief Nonzero if the watch thread is running */
+static int watch_running;
+
+/** @brief Set to shut down the watch thread */
+static int watch_stopping;
+
+/** @brief Worker state constructor */
+static void *(*watch_winit)(void);
+
+/** @brief Worker state destructor */
+static void (*watch_wcleanup)(void *);
+
+/** @brief Current time
+ * @return Milliseconds since an arbitrary epoch
+ */
+static uint64_t watch_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/** @brief Wake the watch thread */
+static void watch_poke(void) {
+  static const char byte = 0;
+
+  /* If the pipe is full then the thread will wake anyway */
+  if(write(watch_wake[1], &byte, 1) < 0 && errno != EAGAIN)
+    sftp_fatal("error writing to watch pipe: %s", strerror(errno));
+}
+
+/** @brief Convert inotify event bits
+ * @param mask inotify event mask
+ * @return @c WATCH_... bits
+ */
+static uint32_t watch_events(uint32_t mask) {
+  uint32_t events = 0;
+
+  if(mask & IN_CREATE)
+    events |= WATCH_CREATED;
+  if(mask & IN_DELETE)
+    events |= WATCH_REMOVED;
+  if(mask & IN_MODIFY)
+    events |= WATCH_MODIFIED;
+  if(mask & IN_ATTRIB)
+    events |= WATCH_ATTRIBUTES;
+  if(mask & IN_MOVED_FROM)
+    events |= WATCH_MOVED_FROM;
+  if(mask & IN_MOVED_TO)
+    events |= WATCH_MOVED_TO;
+  if(mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+    events |= WATCH_GONE;
+  return events;
+}
+
+/** @brief Record a change
+ * @param w Watch
+ * @param name Name relative to the watched directory, or ""
+ * @param events @c WATCH_... bits
+ *
+ * Must be called with @ref watch_lock held.
+ */
+static void watch_record(struct watch *w, const char *name, uint32_t events) {
+  size_t n;
+
+  if(!events || w->dead)
+    return;
+  if(!w->nevents && w->reader) {
+    /* Give the rest of the burst a moment to arrive */
+    const uint64_t soon = watch_now() + WATCHDELAY;
+
+    if(soon < w->deadline)
+      w->deadline = soon;
+  }
+  for(n = 0; n < w->nevents; ++n)
+    if(!strcmp(w->events[n].name, name)) {
+      w->events[n].events |= events;
+      return;
+    }
+  if(w->nevents >= WATCHEVENTS) {
+    w->overflow = 1;
+    return;
+  }
+  if(!w->events)
+    w->events = sftp_xcalloc(WATCHEVENTS, sizeof *w->events);
+  w->events[w->nevents].name = sftp_xstrdup(name);
+  w->events[w->nevents++].events = events;
+}
+
+/** @brief Collect whatever changes the kernel has queued
+ *
+ * Must be called with @ref watch_lock held.
+ */
+static void watch_drain(void) {
+  /* Aligned as the inotify(7) example recommends */
+  char buffer[16384]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ie;
+  struct watch *w;
+  ssize_t n;
+  char *ptr;
+
+  while((n = read(watch_fd, buffer, sizeof buffer)) > 0) {
+    for(ptr = buffer; ptr < buffer + n; ptr += sizeof *ie + ie->len) {
+      ie = (const struct inotify_event *)ptr;
+      if(ie->mask & IN_Q_OVERFLOW) {
+        for(w = watches; w; w = w->next)
+          w->overflow = 1;
+        continue;
+      }
+      for(w = watches; w; w = w->next)
+        if(w->wd == ie->wd) {
+          watch_record(w, ie->len ? ie->name : "", watch_events(ie->mask));
+          if(ie->mask & IN_IGNORED)
+            w->wd = -1;
+        }
+    }
+  }
+  if(n < 0 && errno != EAGAIN && errno != EINTR)
+    sftp_fatal("error reading inotify descriptor: %s", strerror(errno));
+}
+
+/** @brief Answer a @ref WATCH_READ request with the changes so far
+ * @param job Job to respond to
+ * @param w Watch
+ *
+ * The changes are consumed.  Must be called with @ref watch_lock held.
+ */
+static void watch_reply(struct sftpjob *job, struct watch *w) {
+  struct worker *const wk = job->worker;
+  size_t n;
+
+  sftp_send_begin(wk);
+  sftp_send_uint8(wk, SSH_FXP_EXTENDED_REPLY);
+  sftp_send_uint32(wk, job->id);
+  sftp_send_uint32(wk, (uint32_t)(w->nevents + !!w->overflow));
+  for(n = 0; n < w->nevents; ++n) {
+    sftp_send_path(job, wk, w->events[n].name);
+    sftp_send_uint32(wk, w->events[n].events);
+    free(w->events[n].name);
+  }
+  if(w->overflow) {
+    sftp_send_path(job, wk, "");
+    sftp_send_uint32(wk, WATCH_OVERFLOW);
+  }
+  sftp_send_end(wk);
+  w->nevents = 0;
+  w->overflow = 0;
+}
+
+/** @brief Finish a waiting request in the watch thread
+ * @param w Watch
+ * @param wk Worker state
+ * @param a Allocator
+ *
+ * Must be called with @ref watch_lock held.
+ */
+static void watch_finish(struct watch *w, void *wk, struct allocator *a) {
+  struct sftpjob *const job = w->reader;
+
+  w->reader = NULL;
+  job->worker = wk;
+  job->a = a;
+  sftp_session_enter(job->session);
+  if(w->dead)
+    sftp_send_status(job, SSH_FX_EOF, "watch closed");
+  else
+    watch_reply(job, w);
+  sftp_alloc_reset(a);
+  sftp_input_free(job);
+}
+
+/** @brief Watch thread
+ * @param arg Unused
+ * @return Null pointer
+ */
+static void *watch_thread(void attribute((unused)) * arg) {
+  void *const wk = watch_winit();
+  struct allocator a;
+  struct pollfd fds[2];
+  struct watch *w, **wp;
+  uint64_t now, next;
+  char buffer[64];
+  int timeout;
+
+  sftp_alloc_init(&a);
+  ferrcheck(pthread_mutex_lock(&watch_lock));
+  while(!watch_stopping) {
+    now = watch_now();
+    next = UINT64_MAX;
+    for(wp = &watches; (w = *wp);) {
+      if(w->reader && (w->dead || now >= w->deadline))
+        watch_finish(w, wk, &a);
+      if(w->dead) {
+        /* sftp_watch_free() is waiting for this */
+        *wp = w->next;
+        w->gone = 1;
+        ferrcheck(pthread_cond_broadcast(&watch_gone));
+        continue;
+      }
+      if(w->reader && w->deadline < next)
+        next = w->deadline;
+      wp = &w->next;
+    }
+    ferrcheck(pthread_mutex_unlock(&watch_lock));
+    fds[0].fd = watch_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = watch_wake[0];
+    fds[1].events = POLLIN;
+    timeout = next == UINT64_MAX ? -1 : (int)(next - now);
+    if(poll(fds, 2, timeout) < 0 && errno != EINTR)
+      sftp_fatal("error calling poll: %s", strerror(errno));
+    ferrcheck(pthread_mutex_lock(&watch_lock));
+    while(read(watch_wake[0], buffer, sizeof buffer) > 0)
+      ;
+    watch_drain();
+  }
+  /* Nobody will be around to collect any more changes */
+  for(w = watches; w; w = w->next)
+    if(w->reader)
+      watch_finish(w, wk, &a);
+  ferrcheck(pthread_mutex_unlock(&watch_lock));
+  sftp_alloc_destroy(&a);
+  watch_wcleanup(wk);
+  return NULL;
+}
+
+void sftp_watch_start(void *(*winit)(void), void (*wcleanup)(void *)) {
+  watch_winit = winit;
+  watch_wcleanup = wcleanup;
+}
+
+void sftp_watch_stop(void) {
+  if(!watch_running)
+    return;
+  ferrcheck(pthread_mutex_lock(&watch_lock));
+  watch_stopping = 1;
+  watch_poke();
+  ferrcheck(pthread_mutex_unlock(&watch_lock));
+  ferrcheck(pthread_join(watch_thread_id, 0));
+  watch_running = 0;
+  watch_stopping = 0;
+}
+
+void sftp_watch_free(struct watch *w) {
+  struct watch **wp, *other;
+  size_t n;
+
+  if(!w)
+    return;
+  ferrcheck(pthread_mutex_lock(&watch_lock));
+  w->dead = 1;
+  if(w->wd >= 0) {
+    /* The descriptor may be shared with other watches */
+    for(other = watches; other; other = other->next)
+      if(!other->dead && other->wd == w->wd)
+        break;
+    if(!other)
+      inotify_rm_watch(watch_fd, w->wd);
+  }
+  if(w->reader && watch_running) {
+    watch_poke();
+    while(!w->gone)
+      ferrcheck(pthread_cond_wait(&watch_gone, &watch_lock));
+  } else {
+    for(wp = &watches; *wp != w; wp = &(*wp)->next)
+      ;
+    *wp = w->next;
+  }
+  ferrcheck(pthread_mutex_unlock(&watch_lock));
+  for(n = 0; n < w->nevents; ++n)
+    free(w->events[n].name);
+  free(w->events);
+  free(w);
+}
+
+uint32_t sftp_vany_watch(struct sftpjob *job) {
+  char *path;
+  uint32_t flags, rc;
+  struct handleid id;
+  struct watch *w;
+  int wd;
+
+  pcheck(sftp_parse_path_borrow(job, &path));
+  pcheck(sftp_parse_uint32(job, &flags));
+  D(("sftp_vany_watch %s %#" PRIx32, path, flags));
+  if(flags)
+    return SSH_FX_OP_UNSUPPORTED;
+  ferrcheck(pthread_mutex_lock(&watch_lock));
+  if(watch_fd < 0) {
+    if((watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+      const int save_errno = errno;
+      ferrcheck(pthread_mutex_unlock(&watch_lock));
+      errno = save_errno;
+      return HANDLER_ERRNO;
+    }
+    if(pipe(watch_wake) < 0 || fcntl(watch_wake[0], F_SETFL, O_NONBLOCK) < 0
+       || fcntl(watch_wake[1], F_SETFL, O_NONBLOCK) < 0)
+      sftp_fatal("error creating watch pipe: %s", strerror(errno));
+  }
+  if(!watch_running) {
+    ferrcheck(pthread_create(&watch_thread_id, 0, watch_thread, 0));
+    watch_running = 1;
+  }
+  if((wd = inotify_add_watch(watch_fd, path, WATCH_MASK)) < 0) {
+    const int save_errno = errno;
+    ferrcheck(pthread_mutex_unlock(&watch_lock));
+    errno = save_errno;
+    return HANDLER_ERRNO;
+  }
+  w = sftp_xcalloc(1, sizeof *w);
+  w->wd = wd;
+  /* Watching the same directory twice yields the same descriptor, so
+   * changes are recorded for every watch with a matching descriptor */
+  w->next = watches;
+  watches = w;
+  ferrcheck(pthread_mutex_unlock(&watch_lock));
+  if((rc = sftp_handle_new_watch(&id, w, path))) {
+    const int save_errno = errno;
+    sftp_watch_free(w);
+    errno = save_errno;
+    return rc;
+  }
+  D(("...handle is %" PRIu32 " %" PRIu32, id.id, id.tag));
+  sftp_send_begin(job->worker);
+  sftp_send_uint8(job->worker, SSH_FXP_HANDLE);
+  sftp_send_uint32(job->worker, job->id);
+  sftp_send_handle(job->worker, &id);
+  sftp_send_end(job->worker);
+  return HANDLER_RESPONDED;
+}
+
+uint32_t sftp_vany_watch_read(struct sftpjob *job) {
+  struct handleid id;
+  uint32_t timeout, rc;
+  struct watch *w;
+
+  pcheck(sftp_parse_handle(job, &id));
+  pcheck(sftp_parse_uint32(job, &timeout));
+  D(("sftp_vany_watch_read %" PRIu32 " %" PRIu32 " %" PRIu32, id.id, id.tag,
+     timeout));
+  if((rc = sftp_handle_get_watch(&id, &w)))
+    return rc;
+  ferrcheck(pthread_mutex_lock(&watch_lock));
+  if(w->reader) {
+    ferrcheck(pthread_mutex_unlock(&watch_lock));
+    return SSH_FX_FAILURE;
+  }
+  /* Pick up anything that happened before this request arrived */
+  watch_drain();
+  if(w->nevents || w->overflow || !timeout) {
+    watch_reply(job, w);
+    ferrcheck(pthread_mutex_unlock(&watch_lock));
+    return HANDLER_RESPONDED;
+  }
+  if(timeout > WATCHMAXWAIT)
+    timeout = WATCHMAXWAIT;
+  w->reader = job;
+  w->deadline = watch_now() + timeout;
+  /* Waiting has no effect that later requests could see */
+  serialize_remove_job(job);
+  watch_poke();
+  ferrcheck(pthread_mutex_unlock(&watch_lock));
+  return HANDLER_ASYNC;
+}
+#else
+void sftp_watch_start(void *(*winit)(void), void (*wcleanup)(void *)) {
+  (void)winit;
+  (void)wcleanup;
+}
+
+void sftp_watch_stop(void) {}
+
+void sftp_watch_free(struct watch attribute((unused)) * w) {}
+
+uint32_t sftp_vany_watch(struct sftpjob attribute((unused)) * job) {
+  return SSH_FX_OP_UNSUPPORTED;
+}
+
+uint32_t sftp_vany_watch_read(struct sftpjob attribute((unused)) * job) {
+  return SSH_FX_OP_UNSUPPORTED;
+}
+#endif
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,96 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file watch.h @brief Change notification interface */
+
+#ifndef WATCH_H
+#  define WATCH_H
+
+#  include <stdint.h>
+
+/** @brief Name of extension to watch a directory for changes */
+#  define WATCH "watch@rjk.greenend.org.uk"
+
+/** @brief Name of extension to collect changes from a watch */
+#  define WATCH_READ "watch-read@rjk.greenend.org.uk"
+
+/** @brief @ref WATCH event: a name was created */
+#  define WATCH_CREATED 0x00000001
+
+/** @brief @ref WATCH event: a name was removed */
+#  define WATCH_REMOVED 0x00000002
+
+/** @brief @ref WATCH event: a file's contents changed */
+#  define WATCH_MODIFIED 0x00000004
+
+/** @brief @ref WATCH event: a file's attributes changed */
+#  define WATCH_ATTRIBUTES 0x00000008
+
+/** @brief @ref WATCH event: a name was renamed away */
+#  define WATCH_MOVED_FROM 0x00000010
+
+/** @brief @ref WATCH event: a name was renamed into place */
+#  define WATCH_MOVED_TO 0x00000020
+
+/** @brief @ref WATCH event: the watched directory itself was removed or
+ * renamed, and no more events will be reported */
+#  define WATCH_GONE 0x00000040
+
+/** @brief @ref WATCH event: events were lost and the client should rescan
+ * the directory */
+#  define WATCH_OVERFLOW 0x00000080
+
+/** @brief A watch on a directory */
+struct watch;
+
+/** @brief Set up change notification
+ * @param winit Creates worker state for the watch thread
+ * @param wcleanup Destroys worker state created by @p winit
+ *
+ * The watch thread itself is only started when the first watch is created.
+ */
+void sftp_watch_start(void *(*winit)(void), void (*wcleanup)(void *));
+
+/** @brief Stop the watch thread
+ *
+ * Every outstanding @ref WATCH_READ request is answered with whatever events
+ * have been collected.
+ */
+void sftp_watch_stop(void);
+
+/** @brief Destroy a watch
+ * @param w Watch
+ *
+ * An outstanding @ref WATCH_READ request on the watch is answered with
+ * @ref SSH_FX_EOF before this returns.
+ */
+void sftp_watch_free(struct watch *w);
+
+#endif /* WATCH_H */
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,231 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file wholefile.c @brief Whole-file transfer implementation
+ *
+ * Uploading a small file normally takes an open, a write, a close and often
+ * an fsetstat, each a round trip.  The @ref PUT_FILE extension does all of
+ * them in one request:
+ *
+ * <pre>
+ * string "put-file@rjk.greenend.org.uk"
+ * string path
+ * uint32 flags
+ * ATTRS  attrs
+ * string data
+ * </pre>
+ *
+ * @c flags are the @ref SSH_FXP_OPEN flags of protocol versions 5 and 6,
+ * whatever the version in use, except that text mode is not supported.  The
+ * file is opened for writing as if by @ref SSH_FXP_OPEN, @p data is written
+ * at offset 0, @p attrs are applied as if by @ref SSH_FXP_FSETSTAT and the
+ * file is closed.  The response is a @ref SSH_FXP_STATUS.
+ *
+ * The @ref GET_FILE extension is its counterpart for downloads:
+ *
+ * <pre>
+ * string "get-file@rjk.greenend.org.uk"
+ * string path
+ * uint32 flags
+ * uint32 max-length
+ * </pre>
+ *
+ * Only @ref SSH_FXF_NOFOLLOW is meaningful in @c flags.  If the file is no
+ * larger than @c max-length (and the server's own read limit) the response
+ * is an @ref SSH_FXP_EXTENDED_REPLY containing the file's attributes and its
+ * contents:
+ *
+ * <pre>
+ * ATTRS  attrs
+ * string data
+ * </pre>
+ *
+ * Otherwise it is a @ref SSH_FXP_STATUS, and a client will generally fall
+ * back to reading the file in the usual way.
+ */
+
+#include "sftpserver.h"
+#include "sftpconf.h"
+#include "types.h"
+#include "globals.h"
+#include "handle.h"
+#include "parse.h"
+#include "send.h"
+#include "sftp.h"
+#include "stat.h"
+#include "statcache.h"
+#include "stats.h"
+#include "debug.h"
+#include "utils.h"
+#include "wholefile.h"
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/** @brief Write a whole file's contents
+ * @param id Handle
+ * @param data Contents
+ * @param len Length of contents
+ * @return 0 on success or an error code
+ */
+static uint32_t wholefile_write(const struct handleid *id, const char *data,
+                                size_t len) {
+  unsigned flags;
+  uint32_t rc;
+  ssize_t n;
+  int fd;
+
+  if((rc = sftp_handle_get_fd(id, &fd, &flags)))
+    return rc;
+  sftp_stats_bytes(stats_bytes_written, len);
+  if(!(flags & HANDLE_APPEND))
+    return sftp_handle_write(id, fd, 0, data, len);
+  while(len > 0) {
+    if((n = write(fd, data, len)) < 0)
+      return HANDLER_ERRNO;
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+uint32_t sftp_vany_put_file(struct sftpjob *job) {
+  char *path;
+  const char *data;
+  uint32_t flags, len, rc;
+  struct sftpattr attrs, after;
+  struct handleid id;
+  int fd, save_errno;
+
+  if(readonly)
+    return SSH_FX_PERMISSION_DENIED;
+  sftp_statcache_invalidate();
+  pcheck(sftp_parse_path_borrow(job, &path));
+  pcheck(sftp_parse_uint32(job, &flags));
+  pcheck(protocol->parseattrs(job, &attrs));
+  pcheck(sftp_parse_uint32(job, &len));
+  if(len > job->left)
+    return SSH_FX_BAD_MESSAGE;
+  data = (const char *)job->ptr;
+  D(("sftp_vany_put_file %s %#" PRIx32 " %" PRIu32 " bytes", path, flags,
+     len));
+  if(flags & SSH_FXF_TEXT_MODE)
+    return SSH_FX_OP_UNSUPPORTED;
+  if((rc = sftp_normalize_ownergroup(job->a, &attrs)) != SSH_FX_OK)
+    return rc;
+  /* Everything except the size is set again once the data is written, so
+   * that the modification time sticks */
+  after = attrs;
+  after.valid &= ~(uint32_t)(SSH_FILEXFER_ATTR_SIZE |
+                             SSH_FILEXFER_ATTR_ALLOCATION_SIZE);
+  /* The size at open is a preallocation hint */
+  attrs.valid |= SSH_FILEXFER_ATTR_SIZE;
+  attrs.size = len;
+  if((rc = sftp_generic_open_handle(job, path,
+                                    ACE4_WRITE_DATA | ACE4_WRITE_ATTRIBUTES,
+                                    flags, &attrs, &id)))
+    return rc;
+  if(!(rc = wholefile_write(&id, data, len)) && after.valid &&
+     !(rc = sftp_handle_get_fd(&id, &fd, 0)))
+    rc = sftp_set_fstatus(job->a, fd, &after, 0);
+  if(rc) {
+    save_errno = errno;
+    sftp_handle_close(&id);
+    errno = save_errno;
+    return rc;
+  }
+  return sftp_generic_close(job, &id);
+}
+
+uint32_t sftp_vany_get_file(struct sftpjob *job) {
+  char *path;
+  uint32_t flags, maxlen, rc;
+  struct sftpattr attrs, none;
+  struct handleid id;
+  struct stat sb;
+  struct worker *const w = job->worker;
+  size_t got = 0;
+  ssize_t n;
+  char *buffer;
+  int fd, save_errno;
+
+  pcheck(sftp_parse_path_borrow(job, &path));
+  pcheck(sftp_parse_uint32(job, &flags));
+  pcheck(sftp_parse_uint32(job, &maxlen));
+  D(("sftp_vany_get_file %s %#" PRIx32 " %" PRIu32, path, flags, maxlen));
+  if(maxlen > (uint32_t)sftpconf_max_read)
+    maxlen = sftpconf_max_read;
+  sftp_memset(&none, 0, sizeof none);
+  if((rc = sftp_generic_open_handle(job, path,
+                                    ACE4_READ_DATA | ACE4_READ_ATTRIBUTES,
+                                    SSH_FXF_OPEN_EXISTING
+                                        | (flags & SSH_FXF_NOFOLLOW),
+                                    &none, &id)))
+    return rc;
+  if((rc = sftp_handle_get_fd(&id, &fd, 0)))
+    return rc;
+  if(fstat(fd, &sb) < 0) {
+    rc = HANDLER_ERRNO;
+    goto done;
+  }
+  if(!S_ISREG(sb.st_mode) || (uint64_t)sb.st_size > maxlen) {
+    sftp_send_status(job, SSH_FX_FAILURE, "file too large");
+    rc = HANDLER_RESPONDED;
+    goto done;
+  }
+  sftp_stat_to_attrs(job->a, &sb, &attrs, 0xFFFFFFFF, path);
+  sftp_send_begin(w);
+  sftp_send_uint8(w, SSH_FXP_EXTENDED_REPLY);
+  sftp_send_uint32(w, job->id);
+  protocol->sendattrs(job, &attrs);
+  /* The contents are read straight into the output buffer */
+  sftp_send_need(w, sb.st_size + 4);
+  buffer = (char *)w->buffer + w->bufused + 4;
+  while(got < (size_t)sb.st_size) {
+    if((n = pread(fd, buffer + got, sb.st_size - got, got)) < 0) {
+      rc = HANDLER_ERRNO;
+      goto done;
+    }
+    if(!n)
+      break; /* the file got shorter */
+    got += n;
+  }
+  sftp_stats_bytes(stats_bytes_read, got);
+  sftp_send_uint32(w, got);
+  w->bufused += got;
+  sftp_send_end(w);
+  rc = HANDLER_RESPONDED;
+done:
+  save_errno = errno;
+  sftp_handle_close(&id);
+  errno = save_errno;
+  return rc;
+}
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,42 @@
+/*
+ * This file is part of the Green End SFTP Server.
+ * Copyright (C) 2007, 2011 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/** @file wholefile.h @brief Whole-file transfer extension names */
+
+#ifndef WHOLEFILE_H
+#  define WHOLEFILE_H
+
+/** @brief Name of the whole-file upload extension */
+#  define PUT_FILE "put-file@rjk.greenend.org.uk"
+
+/** @brief Name of the whole-file download extension */
+#  define GET_FILE "get-file@rjk.greenend.org.uk"
+
+#endif /* WHOLEFILE_H */
+
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/